@@ -0,0 +1,355 @@
+#!/usr/bin/env python3
+"""
+Decode uPCIe NVMe trace rings, merged with the QEMU NVMe trace-events
+=====================================================================
+
+Decodes one or more trace rings, as recorded by include/upcie/nvme/nvme_trace.h,
+and prints a single timeline of their events, followed by the latency of each
+command, from the write of the command into the SQ until its completion is
+reaped.
+
+When given the log of the QEMU trace-events of cijoe/nvme_trace.events, see
+the 'nvme_trace_log' argument of qemu_guest_start_nvme.py, then the events of
+the emulated controller are merged into the timeline. The clock of a ring is not
+that of QEMU, thus, each ring is aligned to QEMU by pairing its SQ doorbell
+writes with the 'pci_nvme_mmio_doorbell_sq' events, using the smallest offset
+seen, as QEMU cannot observe a doorbell before the driver writes it. The
+latency of each command is then given both as seen by the driver, and by QEMU.
+
+As a cijoe script, the rings are fetched from the target, and the QEMU log is
+read locally, as that is where the guest runs. It can also run standalone:
+
+  nvme_trace_decode.py /dev/shm/upcie-trace-test --qemu_log nvme-trace.log
+
+Retargetable: True
+------------------
+"""
+import logging as log
+import re
+import struct
+import sys
+from argparse import ArgumentParser
+from pathlib import Path
+
+NVME_TRACE_MAGIC = 0x52545055
+NVME_TRACE_VERSION = 1
+NVME_TRACE_CLOCK_TSC = 0x1
+
+RING_HEADER = struct.Struct("<IHHIIQQQQ16x")
+EVENT = struct.Struct("<QQIIBBHHH")
+
+EVENT_NAMES = {
+    0x1: "submit",
+    0x2: "sqdb",
+    0x3: "cqe",
+    0x4: "cqdb",
+    0x5: "timeout",
+    0x6: "expire",
+}
+
+# The log-backend of QEMU prefixes each event with "pid@seconds.microseconds:"
+QEMU_LINE = re.compile(r"^(?:\d+@)?(\d+)\.(\d+):(\w+)\s*(.*)$")
+
+
+def add_args(parser: ArgumentParser):
+    parser.add_argument(
+        "rings",
+        nargs="+",
+        type=str,
+        help="Paths to trace rings; on the target, when running as a cijoe script.",
+    )
+    parser.add_argument(
+        "--qemu_log",
+        type=str,
+        default=None,
+        help="Path to the log of the QEMU NVMe trace-events.",
+    )
+    parser.add_argument(
+        "--output",
+        type=str,
+        default="nvme_trace",
+        help="Directory to fetch the rings into, when running as a cijoe script.",
+    )
+    parser.add_argument(
+        "--no_timeline",
+        action="store_true",
+        help="Only print the per-command latencies.",
+    )
+
+
+def ring_load(path):
+    """Returns the header, as a dict, and the valid events, oldest first, of the ring at 'path'"""
+
+    data = Path(path).read_bytes()
+    magic, version, clock, nevents, qid, hz, ref_ts, ref_realtime_ns, head = (
+        RING_HEADER.unpack_from(data, 0)
+    )
+    if magic != NVME_TRACE_MAGIC or version != NVME_TRACE_VERSION:
+        raise ValueError(f"{path}: not a trace ring; magic(0x{magic:x}), version({version})")
+    if len(data) < RING_HEADER.size + nevents * EVENT.size:
+        raise ValueError(f"{path}: truncated; nevents({nevents})")
+
+    header = {
+        "path": str(path),
+        "clock": clock,
+        "qid": qid,
+        "hz": hz,
+        "ref_ts": ref_ts,
+        "ref_realtime_ns": ref_realtime_ns,
+        "head": head,
+        "nevents": nevents,
+    }
+
+    events = []
+    for pos in range(max(0, head - nevents), head):
+        offset = RING_HEADER.size + (pos % nevents) * EVENT.size
+        ts, arg, nsid, seq, etype, flags, cid, value, _ = EVENT.unpack_from(data, offset)
+        if seq != (pos + 1) & 0xFFFFFFFF:
+            continue  # Overwritten, or still being written, when the ring was copied
+        events.append(
+            {
+                "ts": ts,
+                "arg": arg,
+                "nsid": nsid,
+                "type": EVENT_NAMES.get(etype, f"0x{etype:x}"),
+                "flags": flags,
+                "cid": cid,
+                "value": value,
+                "qid": qid,
+            }
+        )
+
+    # On the GPU, slots are reserved concurrently, thus, only roughly in order of time
+    events.sort(key=lambda event: event["ts"])
+
+    for event in events:
+        event["ns"] = ring_ts_to_ns(header, event["ts"])
+
+    return header, events
+
+
+def ring_ts_to_ns(header, ts):
+    """Returns 'ts' in nanoseconds; of CLOCK_REALTIME when the ring has a reference for it"""
+
+    if header["clock"] == NVME_TRACE_CLOCK_TSC:
+        delta = (ts - header["ref_ts"]) * 1000000000 // header["hz"]
+        return header["ref_realtime_ns"] + delta
+
+    return ts * 1000000000 // header["hz"]
+
+
+def qemu_value(value):
+    try:
+        return int(value, 0)
+    except ValueError:
+        return value.strip("'\"")
+
+
+def qemu_load(path):
+    """Returns the events of the QEMU log, oldest first, with arguments as a dict"""
+
+    events = []
+    with Path(path).open("r", errors="replace") as log_file:
+        for line in log_file:
+            match = QEMU_LINE.match(line.strip())
+            if not match:
+                continue
+            sec, usec, name, rest = match.groups()
+            tokens = rest.split()
+            args = {
+                key: qemu_value(value) for key, value in zip(tokens[0::2], tokens[1::2])
+            }
+            events.append(
+                {
+                    "ns": int(sec) * 1000000000 + int(usec.ljust(6, "0")[:6]) * 1000,
+                    "name": name,
+                    "args": args,
+                }
+            )
+
+    return events
+
+
+def ring_align(header, events, qemu_events):
+    """
+    Returns the offset, in nanoseconds, which aligns the ring to the QEMU timeline, or None
+
+    The SQ doorbell writes of the ring are paired, in order, with the doorbell events of QEMU
+    of the same queue, and the same tail.
+    """
+
+    doorbells = [
+        qemu for qemu in qemu_events
+        if qemu["name"] == "pci_nvme_mmio_doorbell_sq"
+        and qemu["args"].get("sqid") == header["qid"]
+    ]
+    offset = None
+    pos = 0
+
+    for event in (event for event in events if event["type"] == "sqdb"):
+        for idx in range(pos, min(pos + 64, len(doorbells))):
+            if doorbells[idx]["args"].get("new_tail") != event["value"]:
+                continue
+            delta = doorbells[idx]["ns"] - event["ns"]
+            offset = delta if offset is None else min(offset, delta)
+            pos = idx + 1
+            break
+
+    return offset
+
+
+def timeline_pr(rows):
+    print("timeline:")
+    if not rows:
+        print("  ~")
+        return
+
+    base = rows[0][0]
+    for ns, source, text in rows:
+        print(f"  - {{t_us: {(ns - base) / 1000.0:.3f}, src: {source}, {text}}}")
+
+
+def event_text(event):
+    text = f"qid: {event['qid']}, event: {event['type']}"
+    if event["type"] == "submit":
+        text += (
+            f", cid: {event['cid']}, opc: 0x{event['flags']:x}, nsid: {event['nsid']}"
+            f", slba: {event['arg']}, slot: {event['value']}"
+        )
+    elif event["type"] == "cqe":
+        text += f", cid: {event['cid']}, status: 0x{event['value']:x}, dw0: 0x{event['arg']:x}"
+    elif event["type"] == "expire":
+        text += f", cid: {event['cid']}, slot: {event['value']}, nexpired: {event['arg']}"
+    elif event["type"] in ("sqdb", "cqdb", "timeout"):
+        shadow = ", shadow: true" if event["flags"] & 0x1 else ""
+        text += f", value: {event['value']}{shadow}"
+
+    return text
+
+
+def qemu_text(qemu):
+    args = ", ".join(f"{key}: {value}" for key, value in qemu["args"].items())
+    return f"event: {qemu['name']}" + (f", {args}" if args else "")
+
+
+def commands(events, qemu_events, offset):
+    """Returns a list of commands; paired submit and completion, and the QEMU view of them"""
+
+    qemu_cmds = {}
+    if offset is not None:
+        inflight = {}
+        for qemu in qemu_events:
+            key = (qemu["args"].get("sqid", qemu["args"].get("cqid")), qemu["args"].get("cid"))
+            if qemu["name"] == "pci_nvme_io_cmd":
+                inflight[key] = qemu["ns"]
+            elif qemu["name"] == "pci_nvme_enqueue_req_completion" and key in inflight:
+                qemu_cmds.setdefault(key, []).append((inflight.pop(key), qemu["ns"]))
+
+    cmds = []
+    inflight = {}
+    for event in events:
+        key = (event["qid"], event["cid"])
+        if event["type"] == "submit":
+            inflight[key] = event
+        elif event["type"] == "cqe" and key in inflight:
+            submit = inflight.pop(key)
+            cmd = {
+                "qid": event["qid"],
+                "cid": event["cid"],
+                "opc": submit["flags"],
+                "slba": submit["arg"],
+                "status": event["value"],
+                "lat_ns": event["ns"] - submit["ns"],
+                "qemu_lat_ns": None,
+            }
+            for begin, end in qemu_cmds.get(key, []):
+                if submit["ns"] + offset <= begin <= event["ns"] + offset:
+                    cmd["qemu_lat_ns"] = end - begin
+                    break
+            cmds.append(cmd)
+
+    return cmds
+
+
+def commands_pr(cmds):
+    print("commands:")
+    if not cmds:
+        print("  ~")
+        return
+
+    for cmd in cmds:
+        qemu = cmd["qemu_lat_ns"]
+        print(
+            f"  - {{qid: {cmd['qid']}, cid: {cmd['cid']}, opc: 0x{cmd['opc']:x}"
+            f", slba: {cmd['slba']}, status: 0x{cmd['status']:x}"
+            f", lat_us: {cmd['lat_ns'] / 1000.0:.3f}"
+            f", qemu_lat_us: {'~' if qemu is None else f'{qemu / 1000.0:.3f}'}}}"
+        )
+
+    lats = sorted(cmd["lat_ns"] for cmd in cmds)
+    print("latency:")
+    print(f"  count: {len(lats)}")
+    print(f"  min_us: {lats[0] / 1000.0:.3f}")
+    print(f"  avg_us: {sum(lats) / len(lats) / 1000.0:.3f}")
+    print(f"  p50_us: {lats[len(lats) // 2] / 1000.0:.3f}")
+    print(f"  p99_us: {lats[min(len(lats) - 1, len(lats) * 99 // 100)] / 1000.0:.3f}")
+    print(f"  max_us: {lats[-1] / 1000.0:.3f}")
+
+
+def decode(rings, qemu_log, no_timeline):
+    """Decode the given rings, merged with the QEMU log when given; returns 0 on success"""
+
+    qemu_events = qemu_load(qemu_log) if qemu_log else []
+    rows = []
+    cmds = []
+
+    for path in rings:
+        try:
+            header, events = ring_load(path)
+        except (OSError, ValueError) as exc:
+            log.error(f"ring_load(): {exc}")
+            return 1
+
+        offset = ring_align(header, events, qemu_events) if qemu_events else None
+        if qemu_events and offset is None:
+            log.warning(f"{path}: no doorbells in common with QEMU; not aligned")
+        log.info(f"{path}: qid({header['qid']}), nevents({len(events)}), offset({offset})")
+
+        rows += [(event["ns"] + (offset or 0), "upcie", event_text(event)) for event in events]
+        cmds += commands(events, qemu_events, offset)
+
+    rows += [(qemu["ns"], "qemu", qemu_text(qemu)) for qemu in qemu_events]
+    rows.sort(key=lambda row: row[0])
+
+    if not no_timeline:
+        timeline_pr(rows)
+    commands_pr(cmds)
+
+    return 0
+
+
+def main(args, cijoe):
+    """Fetch the rings from the target, and decode them merged with the local QEMU log"""
+
+    output = Path(args.output)
+    output.mkdir(parents=True, exist_ok=True)
+
+    rings = []
+    for ring in args.rings:
+        local = output / Path(ring).name
+        cijoe.get(ring, str(local))
+        if not local.exists():
+            log.error(f"cijoe.get({ring}): failed")
+            return 1
+        rings.append(local)
+
+    return decode(rings, args.qemu_log, args.no_timeline)
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser(description=__doc__.strip().splitlines()[0])
+    add_args(parser)
+    args = parser.parse_args()
+
+    log.basicConfig(level=log.INFO, format="%(levelname)s: %(message)s")
+    sys.exit(decode(args.rings, args.qemu_log, args.no_timeline))
@@ -7,6 +7,9 @@ uPCIe's driver tests only need one NVMe controller, so this sets up a single
 controller with one namespace at 0000:01:00.0. Add more controllers here if a
 test needs them.
 
+With 'nvme_trace_log', then the QEMU trace-events of cijoe/nvme_trace.events
+are logged to the given file, for nvme_trace_decode.py.
+
 Retargetable: false
 -------------------
 """
@@ -21,6 +24,7 @@ from cijoe.qemu.wrapper import Guest
 def add_args(parser: ArgumentParser):
     parser.add_argument("--nvme_img_root", type=str, default=None)
     parser.add_argument("--guest_name", type=str, default=None)
+    parser.add_argument("--nvme_trace_log", type=str, default=None)
 
 
 def qemu_nvme_args(nvme_img_root):
@@ -87,6 +91,9 @@ def main(args, cijoe):
     nvme_img_root = Path(args.nvme_img_root or guest.guest_path)
 
     drives, nvme_args = qemu_nvme_args(nvme_img_root)
+    if args.nvme_trace_log:
+        events = Path(__file__).resolve().parent.parent / "nvme_trace.events"
+        nvme_args += ["-trace", f"events={events},file={args.nvme_trace_log}"]
 
     # Create the backing-storage if it does not exist
     for drive in drives:
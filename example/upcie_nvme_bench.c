@@ -0,0 +1,863 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+//
+// A fio-style load generator on top of the uPCIe NVMe driver
+//
+// Drives random or sequential reads or writes, of a given block size and queue depth, on a number
+// of I/O qpairs, served by a number of threads, each pinned to its own core, until a runtime or a
+// number of bytes is reached. Reports IOPS, bandwidth and the latency distribution, in YAML, per
+// thread and in total. The backend, vfio-pci or uio_pci_generic, is chosen by the driver bound to
+// the device, as with upcie_nvme_driver.
+//
+// Parameters are given as name=value, e.g.:
+//
+//   upcie_nvme_bench 0000:01:00.0 rw=randread bs=4096 qd=32 qpairs=4 threads=2 runtime=10
+//
+// Writes overwrite the namespace, within [0, span), with whatever is in the buffers.
+
+#include <linux/limits.h>
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#define BENCH_QPAIRS_MAX 64
+#define BENCH_HEAP_NBYTES (1024 * 1024 * 64ULL)
+
+// Latencies are recorded in a log-linear histogram of ticks: exact below LAT_NSUB, and in
+// LAT_NSUB sub-buckets per power-of-two above; that is, within 1 / LAT_NSUB of the value
+#define LAT_SUB_SHIFT 4
+#define LAT_NSUB (1 << LAT_SUB_SHIFT)
+#define LAT_NBUCKETS ((64 - LAT_SUB_SHIFT + 1) * LAT_NSUB)
+
+enum nvme_backend {
+	NVME_BACKEND_SYSFS = 0,
+	NVME_BACKEND_VFIO,
+};
+
+enum bench_rw {
+	BENCH_RW_READ = 0,
+	BENCH_RW_WRITE,
+	BENCH_RW_RANDREAD,
+	BENCH_RW_RANDWRITE,
+};
+
+static const char *bench_rw_names[] = {"read", "write", "randread", "randwrite"};
+
+struct bench_opts {
+	const char *bdf;
+	enum bench_rw rw;
+	uint32_t bs;        ///< Block size; the size of each I/O, in bytes
+	uint32_t qd;        ///< Number of I/Os in flight per qpair
+	int nqpairs;        ///< Number of I/O qpairs, distributed among the threads
+	int nthreads;       ///< Number of threads, each pinned to its own core
+	uint64_t runtime_s; ///< Stop after this many seconds; 0: unbounded
+	uint64_t size;      ///< Stop after this many bytes, in total; 0: unbounded
+	uint64_t span;      ///< I/Os are within [0, span) of the namespace; 0: the namespace
+	uint32_t nsid;
+};
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioqs[BENCH_QPAIRS_MAX];
+	int nioqs;
+	struct vfio_ctx vfio;
+	enum nvme_backend backend;
+	uint64_t nlbas;     ///< Size of the namespace, in logical blocks
+	uint32_t lba_shift; ///< log2 of the logical block size
+};
+
+struct lat_hist {
+	uint64_t buckets[LAT_NBUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct bench_job;
+
+/**
+ * An I/O slot, bound to a buffer and a qpair; resubmitted for as long as the job is running
+ */
+struct bench_io {
+	struct bench_job *job;
+	struct nvme_qpair *qp;
+	uint8_t *buf;
+	uint32_t qpidx;     ///< Index of `qp` among the qpairs of the job
+	uint64_t submitted; ///< Timestamp, in ticks, of the submission
+};
+
+/**
+ * A thread driving one or more qpairs, pinned to a single core; nothing is shared between jobs
+ */
+struct bench_job {
+	pthread_t thread;
+	struct bench_opts *opts;
+	struct nvme *nvme;
+	struct hostmem_heap *heap;
+	struct nvme_qpair *qpairs[BENCH_QPAIRS_MAX];
+	uint32_t nqpairs;
+	struct bench_io *ios;   ///< nqpairs * qd I/O slots
+	struct bench_io **free; ///< Stack of slots not in flight
+	uint32_t nios;
+	uint32_t nfree;
+	int cpu;
+
+	uint64_t nslots; ///< Number of block-sized slots within the span
+	uint64_t next;   ///< Next slot of sequential I/O
+	uint64_t rng;    ///< State of random I/O
+	uint64_t limit;  ///< Number of I/Os to submit; 0: unbounded
+
+	uint64_t nsubmitted;
+	uint64_t ncompleted;
+	uint64_t nerrors;
+	uint64_t elapsed_ns;
+	struct lat_hist lat;
+	int err;
+};
+
+static int
+device_get_driver_name(const char *bdf, char *driver_name, size_t driver_name_len)
+{
+	char path[PATH_MAX] = {0};
+	char link[PATH_MAX] = {0};
+	ssize_t nbytes;
+	char *base;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/driver", bdf);
+
+	nbytes = readlink(path, link, sizeof(link) - 1);
+	if (nbytes < 0) {
+		return -errno;
+	}
+
+	base = strrchr(link, '/');
+	if (!base || !base[1]) {
+		return -EINVAL;
+	}
+
+	snprintf(driver_name, driver_name_len, "%s", base + 1);
+
+	return 0;
+}
+
+static inline uint32_t
+lat_hist_bucket(uint64_t ticks)
+{
+	uint32_t shift;
+
+	if (ticks < LAT_NSUB) {
+		return ticks;
+	}
+	shift = 63 - __builtin_clzll(ticks) - LAT_SUB_SHIFT;
+
+	return (shift + 1) * LAT_NSUB + ((ticks >> shift) & (LAT_NSUB - 1));
+}
+
+/**
+ * Returns the lower bound, in ticks, of the given bucket
+ */
+static inline uint64_t
+lat_hist_value(uint32_t bucket)
+{
+	if (bucket < LAT_NSUB) {
+		return bucket;
+	}
+
+	return (uint64_t)(LAT_NSUB + bucket % LAT_NSUB) << (bucket / LAT_NSUB - 1);
+}
+
+static inline void
+lat_hist_add(struct lat_hist *hist, uint64_t ticks)
+{
+	hist->buckets[lat_hist_bucket(ticks)] += 1;
+	hist->sum += ticks;
+	hist->min = (hist->count && hist->min < ticks) ? hist->min : ticks;
+	hist->max = hist->max > ticks ? hist->max : ticks;
+	hist->count += 1;
+}
+
+static void
+lat_hist_merge(struct lat_hist *dst, struct lat_hist *src)
+{
+	if (!src->count) {
+		return;
+	}
+	for (uint32_t i = 0; i < LAT_NBUCKETS; ++i) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->min = (dst->count && dst->min < src->min) ? dst->min : src->min;
+	dst->max = dst->max > src->max ? dst->max : src->max;
+	dst->sum += src->sum;
+	dst->count += src->count;
+}
+
+/**
+ * Returns the value, in ticks, at or below which the given fraction of the latencies are
+ */
+static uint64_t
+lat_hist_percentile(struct lat_hist *hist, double fraction)
+{
+	uint64_t rank = (uint64_t)(fraction * hist->count + 0.5);
+	uint64_t seen = 0;
+
+	rank = rank ? rank : 1;
+	for (uint32_t i = 0; i < LAT_NBUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			return lat_hist_value(i);
+		}
+	}
+
+	return hist->max;
+}
+
+static void
+lat_hist_pr(struct lat_hist *hist, const char *indent)
+{
+	double us = 1e6 / tsc_hz();
+
+	printf("%slat_us:\n", indent);
+	if (!hist->count) {
+		printf("%s  ~\n", indent);
+		return;
+	}
+	printf("%s  min: %.2f\n", indent, hist->min * us);
+	printf("%s  avg: %.2f\n", indent, (double)hist->sum / hist->count * us);
+	printf("%s  p50: %.2f\n", indent, lat_hist_percentile(hist, 0.50) * us);
+	printf("%s  p99: %.2f\n", indent, lat_hist_percentile(hist, 0.99) * us);
+	printf("%s  p999: %.2f\n", indent, lat_hist_percentile(hist, 0.999) * us);
+	printf("%s  max: %.2f\n", indent, hist->max * us);
+}
+
+static void
+nvme_cleanup(struct nvme *nvme)
+{
+	if (nvme->nioqs) {
+		nvme_controller_delete_io_qpairs(&nvme->ctrlr, nvme->ioqs, nvme->nioqs);
+		memset(nvme->ioqs, 0, sizeof(nvme->ioqs));
+		nvme->nioqs = 0;
+	}
+
+	if (nvme->backend == NVME_BACKEND_VFIO) {
+		nvme_controller_close_vfio(&nvme->ctrlr, &nvme->vfio);
+		return;
+	}
+
+	nvme_controller_close(&nvme->ctrlr);
+}
+
+/**
+ * Initialize the heap; large enough for the I/O buffers and the queues
+ */
+int
+rte_init(struct rte *rte, struct bench_opts *opts)
+{
+	size_t nbytes = BENCH_HEAP_NBYTES;
+	int err;
+
+	err = hostmem_config_init(&rte->config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return err;
+	}
+
+	nbytes += (size_t)opts->nqpairs * opts->qd * opts->bs * 2;
+	nbytes = (nbytes + rte->config.hugepgsz - 1) / rte->config.hugepgsz * rte->config.hugepgsz;
+
+	err = hostmem_heap_init(&rte->heap, nbytes, &rte->config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Identify the namespace, for its size and logical block size
+ */
+static int
+nvme_identify_ns(struct nvme *nvme, uint32_t nsid)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *idfy = nvme->ctrlr.buf;
+	uint8_t flbas;
+	int err;
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = nsid;
+	cmd.cdw10 = 0; // CNS=0: Identify Namespace
+
+	memset(idfy, 0, 4096);
+	err = nvme_qpair_submit_sync_contig_prps(&nvme->ctrlr.aq, nvme->ctrlr.heap, idfy, 4096,
+						 &cmd, nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+		return err;
+	}
+
+	memcpy(&nvme->nlbas, idfy, sizeof(nvme->nlbas)); ///< NSZE
+	flbas = (idfy[26] & 0xF) | ((idfy[26] >> 1) & 0x30);
+	nvme->lba_shift = idfy[128 + flbas * 4 + 2]; ///< LBADS of the LBA format in use
+
+	if (!nvme->nlbas || nvme->lba_shift < 9) {
+		printf("FAILED: nsid(%" PRIu32 ") is not active; nsze(%" PRIu64 ")\n", nsid,
+		       nvme->nlbas);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+int
+nvme_init(struct nvme *nvme, struct bench_opts *opts, struct rte *rte)
+{
+	char driver_name[NAME_MAX + 1] = {0};
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	int err;
+
+	err = device_get_driver_name(opts->bdf, driver_name, sizeof(driver_name));
+	if (err) {
+		printf("FAILED: device_get_driver_name(); err(%d)\n", err);
+		return err;
+	}
+
+	if (!strcmp(driver_name, "vfio-pci")) {
+		nvme->backend = NVME_BACKEND_VFIO;
+		err = nvme_controller_open_vfio(&nvme->ctrlr, &nvme->vfio, opts->bdf, &rte->heap);
+	} else if (!strcmp(driver_name, "uio_pci_generic")) {
+		nvme->backend = NVME_BACKEND_SYSFS;
+		err = nvme_controller_open(&nvme->ctrlr, opts->bdf, &rte->heap);
+	} else {
+		printf("FAILED: unsupported driver '%s'\n", driver_name);
+		return -ENOTSUP;
+	}
+	if (err) {
+		printf("FAILED: nvme_device_open(); err(%d)\n", err);
+		return err;
+	}
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.cdw10 = 1; // CNS=1: Identify Controller
+
+	err = nvme_qpair_submit_sync_contig_prps(&nvme->ctrlr.aq, nvme->ctrlr.heap,
+						 nvme->ctrlr.buf, 4096, &cmd,
+						 nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+		nvme_cleanup(nvme);
+		return err;
+	}
+
+	printf("SN('%.*s')\n", 20, ((uint8_t *)nvme->ctrlr.buf) + 4);
+	printf("MN('%.*s')\n", 40, ((uint8_t *)nvme->ctrlr.buf) + 24);
+
+	err = nvme_identify_ns(nvme, opts->nsid);
+	if (err) {
+		nvme_cleanup(nvme);
+		return err;
+	}
+
+	// One slot more than the queue depth; a full SQ holds depth - 1 commands
+	err = nvme_controller_create_io_qpairs(&nvme->ctrlr, opts->nqpairs, opts->qd + 1,
+					       nvme->ioqs);
+	if (err < 0) {
+		printf("FAILED: nvme_controller_create_io_qpairs(); err(%d)\n", err);
+		nvme_cleanup(nvme);
+		return err;
+	}
+	nvme->nioqs = err;
+
+	printf("nioqs: %d # of %d requested; controller allows %" PRIu16 "\n", nvme->nioqs,
+	       opts->nqpairs, nvme->ctrlr.nioqs);
+
+	return 0;
+}
+
+static inline uint64_t
+bench_rand(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+	return z ^ (z >> 31);
+}
+
+static void
+bench_io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct bench_io *io = user;
+	struct bench_job *job = io->job;
+
+	lat_hist_add(&job->lat, tsc_read() - io->submitted);
+
+	job->ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		job->nerrors += 1;
+	}
+	job->free[job->nfree++] = io;
+}
+
+/**
+ * Prepare and enqueue the command of the given slot; the doorbell is written by the caller
+ *
+ * @return On success 0 is returned. -EBUSY when the qpair is out of requests or PRP-list pages,
+ *         otherwise, negative errno is returned to indicate the error.
+ */
+static int
+bench_io_submit(struct bench_io *io)
+{
+	struct bench_job *job = io->job;
+	struct bench_opts *opts = job->opts;
+	uint64_t nlb = opts->bs >> job->nvme->lba_shift;
+	struct nvme_command cmd = {0};
+	struct nvme_request *req;
+	uint64_t slot, slba;
+	int err;
+
+	req = nvme_request_alloc(io->qp->rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = bench_io_cb;
+	req->user = io;
+
+	if (opts->rw == BENCH_RW_RANDREAD || opts->rw == BENCH_RW_RANDWRITE) {
+		slot = bench_rand(&job->rng) % job->nslots;
+	} else {
+		slot = job->next;
+		job->next = (job->next + 1) % job->nslots;
+	}
+	slba = slot * nlb;
+
+	cmd.cid = req->cid;
+	cmd.opc = (opts->rw == BENCH_RW_WRITE || opts->rw == BENCH_RW_RANDWRITE) ? 0x1 : 0x2;
+	cmd.nsid = opts->nsid;
+	cmd.cdw10 = slba & 0xFFFFFFFF;
+	cmd.cdw11 = slba >> 32;
+	cmd.cdw12 = nlb - 1;
+
+	err = nvme_request_prep_command_prps_contig(req, job->heap, io->buf, opts->bs, &cmd);
+	if (err) {
+		nvme_request_free(io->qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	io->submitted = tsc_read();
+	err = nvme_qpair_enqueue(io->qp, &cmd);
+	if (err) {
+		nvme_request_free(io->qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	return 0;
+}
+
+/**
+ * Keeps every free slot in flight, with a single doorbell write per qpair per round, until the
+ * runtime or the number of I/Os is reached, and then waits for those in flight
+ */
+static void *
+bench_job_run(void *arg)
+{
+	struct bench_job *job = arg;
+	uint64_t deadline = 0, drain = 0, begin;
+	cpu_set_t cpus;
+	int running = 1;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(job->cpu, &cpus);
+	job->err = -pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (job->err) {
+		return NULL;
+	}
+
+	begin = tsc_clock_ns();
+	if (job->opts->runtime_s) {
+		deadline = tsc_read() + tsc_from_ms(job->opts->runtime_s * 1000);
+	}
+
+	while (running || job->nfree < job->nios) {
+		uint64_t dirty = 0;
+
+		if (running && deadline && tsc_read() >= deadline) {
+			running = 0;
+		}
+
+		while (running && job->nfree) {
+			struct bench_io *io = job->free[job->nfree - 1];
+			int err;
+
+			if (job->limit && job->nsubmitted >= job->limit) {
+				running = 0;
+				break;
+			}
+
+			err = bench_io_submit(io);
+			if (err == -EBUSY) {
+				break;
+			}
+			if (err) {
+				job->err = err;
+				running = 0;
+				break;
+			}
+			job->nfree--;
+			job->nsubmitted++;
+			dirty |= 1ULL << io->qpidx;
+		}
+
+		for (uint32_t i = 0; i < job->nqpairs; ++i) {
+			if (dirty & (1ULL << i)) {
+				nvme_qpair_sqdb_update(job->qpairs[i]);
+			}
+		}
+
+		for (uint32_t i = 0; i < job->nqpairs; ++i) {
+			int ncpls = nvme_qpair_process_completions(job->qpairs[i], 0);
+
+			if (ncpls < 0 && !job->err) {
+				job->err = ncpls;
+				running = 0;
+			}
+		}
+
+		// Bail out rather than spin, when the controller stops completing
+		if (!running && !drain) {
+			drain = tsc_read() + tsc_from_ms(job->nvme->ctrlr.timeout_ms);
+		}
+		if (drain && job->nfree < job->nios && tsc_read() > drain) {
+			job->err = job->err ? job->err : -ETIMEDOUT;
+			break;
+		}
+	}
+	job->elapsed_ns = tsc_clock_ns() - begin;
+
+	return NULL;
+}
+
+/**
+ * Allocate the I/O slots of the job, and their buffers, `qd` per qpair
+ */
+static int
+bench_job_init(struct bench_job *job, struct bench_opts *opts, struct nvme *nvme,
+	       struct hostmem_heap *heap)
+{
+	job->opts = opts;
+	job->nvme = nvme;
+	job->heap = heap;
+	job->nios = job->nqpairs * opts->qd;
+
+	job->ios = calloc(job->nios, sizeof(*job->ios));
+	job->free = calloc(job->nios, sizeof(*job->free));
+	if (!job->ios || !job->free) {
+		printf("FAILED: calloc(); errno(%d)\n", errno);
+		return -ENOMEM;
+	}
+
+	for (uint32_t i = 0; i < job->nios; ++i) {
+		struct bench_io *io = &job->ios[i];
+
+		io->job = job;
+		io->qpidx = i % job->nqpairs;
+		io->qp = job->qpairs[io->qpidx];
+		io->buf = hostmem_dma_malloc(heap, opts->bs);
+		if (!io->buf) {
+			printf("FAILED: hostmem_dma_malloc(); err(%d)\n", -errno);
+			return -errno;
+		}
+		memset(io->buf, 0xA5, opts->bs);
+
+		job->free[job->nfree++] = io;
+	}
+
+	return 0;
+}
+
+static void
+bench_job_term(struct bench_job *job)
+{
+	for (uint32_t i = 0; job->ios && i < job->nios; ++i) {
+		if (job->ios[i].buf) {
+			hostmem_dma_free(job->heap, job->ios[i].buf);
+		}
+	}
+	free(job->ios);
+	free(job->free);
+}
+
+static void
+bench_pr(struct bench_opts *opts, const char *indent, uint64_t nios, uint64_t nerrors,
+	 uint64_t elapsed_ns, struct lat_hist *lat)
+{
+	double secs = elapsed_ns / 1e9;
+	double iops = secs > 0 ? nios / secs : 0;
+
+	printf("%sncompleted: %" PRIu64 "\n", indent, nios);
+	printf("%snerrors: %" PRIu64 "\n", indent, nerrors);
+	printf("%selapsed_s: %.3f\n", indent, secs);
+	printf("%siops: %.0f\n", indent, iops);
+	printf("%sbw_mibs: %.2f\n", indent, iops * opts->bs / (1024 * 1024));
+	lat_hist_pr(lat, indent);
+}
+
+/**
+ * Run the jobs, the qpairs distributed round-robin among them, and report each and the total
+ */
+static int
+bench_run(struct bench_opts *opts, struct nvme *nvme, struct rte *rte)
+{
+	struct bench_job *jobs;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t span_lbas = opts->span ? opts->span >> nvme->lba_shift : nvme->nlbas;
+	uint64_t nslots, limit = 0, nios = 0, nerrors = 0, elapsed_ns = 0;
+	struct lat_hist *lat;
+	int nthreads = opts->nthreads < nvme->nioqs ? opts->nthreads : nvme->nioqs;
+	int err = 0;
+
+	span_lbas = span_lbas < nvme->nlbas ? span_lbas : nvme->nlbas;
+	nslots = span_lbas / (opts->bs >> nvme->lba_shift);
+	if (!nslots) {
+		printf("FAILED: span(%" PRIu64 ") is smaller than bs(%" PRIu32 ")\n",
+		       span_lbas << nvme->lba_shift, opts->bs);
+		return -EINVAL;
+	}
+	if (opts->size) {
+		limit = (opts->size / opts->bs + nthreads - 1) / nthreads;
+	}
+
+	jobs = calloc(nthreads, sizeof(*jobs));
+	lat = calloc(1, sizeof(*lat));
+	if (!jobs || !lat) {
+		printf("FAILED: calloc(); errno(%d)\n", errno);
+		free(jobs);
+		free(lat);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < nvme->nioqs; ++i) {
+		struct bench_job *job = &jobs[i % nthreads];
+
+		job->qpairs[job->nqpairs++] = &nvme->ioqs[i];
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		struct bench_job *job = &jobs[i];
+
+		job->cpu = ncpus > 0 ? i % ncpus : 0;
+		job->nslots = nslots;
+		job->next = nslots / nthreads * i;
+		job->rng = i + 1;
+		job->limit = limit;
+
+		err = bench_job_init(job, opts, nvme, &rte->heap);
+		if (err) {
+			goto exit;
+		}
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		err = -pthread_create(&jobs[i].thread, NULL, bench_job_run, &jobs[i]);
+		if (err) {
+			printf("FAILED: pthread_create(); err(%d)\n", err);
+			for (int j = 0; j < i; ++j) {
+				pthread_join(jobs[j].thread, NULL);
+			}
+			goto exit;
+		}
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(jobs[i].thread, NULL);
+	}
+
+	printf("bench:\n");
+	printf("  rw: %s\n", bench_rw_names[opts->rw]);
+	printf("  bs: %" PRIu32 "\n", opts->bs);
+	printf("  qd: %" PRIu32 "\n", opts->qd);
+	printf("  qpairs: %d\n", nvme->nioqs);
+	printf("  threads: %d\n", nthreads);
+	printf("  span: %" PRIu64 "\n", span_lbas << nvme->lba_shift);
+	printf("  backend: %s\n", nvme->backend == NVME_BACKEND_VFIO ? "vfio" : "sysfs");
+	printf("jobs:\n");
+	for (int i = 0; i < nthreads; ++i) {
+		struct bench_job *job = &jobs[i];
+
+		printf("- cpu: %d\n", job->cpu);
+		printf("  qids: [");
+		for (uint32_t q = 0; q < job->nqpairs; ++q) {
+			printf("%s%" PRIu32, q ? ", " : "", job->qpairs[q]->qid);
+		}
+		printf("]\n");
+		bench_pr(opts, "  ", job->ncompleted, job->nerrors, job->elapsed_ns, &job->lat);
+		printf("  err: %d\n", job->err);
+
+		nios += job->ncompleted;
+		nerrors += job->nerrors;
+		elapsed_ns = elapsed_ns > job->elapsed_ns ? elapsed_ns : job->elapsed_ns;
+		lat_hist_merge(lat, &job->lat);
+
+		if (!err && (job->err || job->nerrors)) {
+			err = job->err ? job->err : -EIO;
+		}
+	}
+	printf("total:\n");
+	bench_pr(opts, "  ", nios, nerrors, elapsed_ns, lat);
+
+exit:
+	for (int i = 0; i < nthreads; ++i) {
+		bench_job_term(&jobs[i]);
+	}
+	free(jobs);
+	free(lat);
+
+	return err;
+}
+
+/**
+ * Returns the value of the given "name=value" argument, when it is for `name`, otherwise NULL
+ */
+static const char *
+bench_opt_val(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+
+	return (!strncmp(arg, name, len) && arg[len] == '=') ? arg + len + 1 : NULL;
+}
+
+static int
+bench_opts_parse(struct bench_opts *opts, int argc, char **argv)
+{
+	opts->bdf = argv[1];
+	opts->rw = BENCH_RW_RANDREAD;
+	opts->bs = 4096;
+	opts->qd = 32;
+	opts->nqpairs = 1;
+	opts->nthreads = 1;
+	opts->nsid = 1;
+
+	for (int i = 2; i < argc; ++i) {
+		const char *val;
+
+		if ((val = bench_opt_val(argv[i], "rw"))) {
+			int rw = 0;
+
+			while (rw < 4 && strcmp(val, bench_rw_names[rw])) {
+				rw++;
+			}
+			if (rw == 4) {
+				printf("FAILED: invalid rw '%s'\n", val);
+				return -EINVAL;
+			}
+			opts->rw = rw;
+		} else if ((val = bench_opt_val(argv[i], "bs"))) {
+			opts->bs = strtoul(val, NULL, 0);
+		} else if ((val = bench_opt_val(argv[i], "qd"))) {
+			opts->qd = strtoul(val, NULL, 0);
+		} else if ((val = bench_opt_val(argv[i], "qpairs"))) {
+			opts->nqpairs = atoi(val);
+		} else if ((val = bench_opt_val(argv[i], "threads"))) {
+			opts->nthreads = atoi(val);
+		} else if ((val = bench_opt_val(argv[i], "runtime"))) {
+			opts->runtime_s = strtoull(val, NULL, 0);
+		} else if ((val = bench_opt_val(argv[i], "size"))) {
+			opts->size = strtoull(val, NULL, 0);
+		} else if ((val = bench_opt_val(argv[i], "span"))) {
+			opts->span = strtoull(val, NULL, 0);
+		} else if ((val = bench_opt_val(argv[i], "nsid"))) {
+			opts->nsid = strtoul(val, NULL, 0);
+		} else {
+			printf("FAILED: invalid argument '%s'; expected name=value\n", argv[i]);
+			return -EINVAL;
+		}
+	}
+
+	if (!opts->runtime_s && !opts->size) {
+		opts->runtime_s = 10;
+	}
+	if (opts->bs < 512 || (opts->bs & (opts->bs - 1))) {
+		printf("FAILED: bs(%" PRIu32 ") must be a power-of-two, at least 512\n", opts->bs);
+		return -EINVAL;
+	}
+	if (opts->qd < 1 || opts->qd > 4095) {
+		printf("FAILED: qd(%" PRIu32 ") must be in [1, 4095]\n", opts->qd);
+		return -EINVAL;
+	}
+	if (opts->nqpairs < 1 || opts->nqpairs > BENCH_QPAIRS_MAX) {
+		printf("FAILED: qpairs must be in [1, %d]\n", BENCH_QPAIRS_MAX);
+		return -EINVAL;
+	}
+	if (opts->nthreads < 1 || opts->nthreads > opts->nqpairs) {
+		printf("FAILED: threads must be in [1, qpairs]\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_opts opts = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc < 2) {
+		printf("Usage: %s <PCI-BDF> [rw=read|write|randread|randwrite] [bs=4096] [qd=32]"
+		       " [qpairs=1] [threads=1] [runtime=<seconds>] [size=<bytes>] [span=<bytes>]"
+		       " [nsid=1]\n",
+		       argv[0]);
+		return 1;
+	}
+
+	err = bench_opts_parse(&opts, argc, argv);
+	if (err) {
+		return 1;
+	}
+
+	err = rte_init(&rte, &opts);
+	if (err) {
+		printf("FAILED: rte_init();");
+		return -err;
+	}
+
+	err = nvme_init(&nvme, &opts, &rte);
+	if (err) {
+		printf("FAILED: nvme_init();");
+		hostmem_heap_term(&rte.heap);
+		return -err;
+	}
+
+	if (opts.bs < (1U << nvme.lba_shift) ||
+	    (nvme.ctrlr.mdts_nbytes && opts.bs > nvme.ctrlr.mdts_nbytes)) {
+		printf("FAILED: bs(%" PRIu32 ") must be in [%u, %" PRIu32 "]\n", opts.bs,
+		       1U << nvme.lba_shift, nvme.ctrlr.mdts_nbytes);
+		err = -EINVAL;
+		goto exit;
+	}
+
+	err = bench_run(&opts, &nvme, &rte);
+	if (err) {
+		printf("FAILED: bench_run(); err(%d)\n", err);
+	}
+
+exit:
+	nvme_cleanup(&nvme);
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -6,6 +6,14 @@
 #define _UPCIE_WITH_NVME
 #include <upcie/upcie.h>
 
+#include <pthread.h>
+#include <sched.h>
+
+#define WORKER_QUEUE_DEPTH 32
+#define WORKER_NUM_IOS 100000
+#define WORKER_BUF_NBYTES 4096
+#define WORKERS_MAX 64
+
 enum nvme_backend {
 	NVME_BACKEND_SYSFS = 0,
 	NVME_BACKEND_VFIO,
@@ -18,11 +26,30 @@ struct rte {
 
 struct nvme {
 	struct nvme_controller ctrlr;
-	struct nvme_qpair ioq;
+	struct nvme_qpair ioqs[WORKERS_MAX];
+	int nioqs;
+	struct nvme_namespace ns;
 	struct vfio_ctx vfio;
 	enum nvme_backend backend;
 };
 
+/**
+ * A thread driving a single qpair, pinned to a single core; nothing is shared between workers
+ */
+struct worker {
+	pthread_t thread;
+	struct nvme_qpair *qp;
+	struct nvme_namespace *ns;
+	struct hostmem_heap *heap;
+	uint8_t *buf; ///< WORKER_QUEUE_DEPTH buffers of WORKER_BUF_NBYTES
+	int cpu;
+
+	size_t ncompleted;
+	size_t nerrors;
+	uint64_t elapsed_ns;
+	int err;
+};
+
 static int
 device_get_driver_name(const char *bdf, char *driver_name, size_t driver_name_len)
 {
@@ -51,9 +78,10 @@ device_get_driver_name(const char *bdf, char *driver_name, size_t driver_name_le
 static void
 nvme_cleanup(struct nvme *nvme)
 {
-	if (nvme->ioq.rpool) {
-		nvme_controller_delete_io_qpair(&nvme->ctrlr, &nvme->ioq);
-		memset(&nvme->ioq, 0, sizeof(nvme->ioq));
+	if (nvme->nioqs) {
+		nvme_controller_delete_io_qpairs(&nvme->ctrlr, nvme->ioqs, nvme->nioqs);
+		memset(nvme->ioqs, 0, sizeof(nvme->ioqs));
+		nvme->nioqs = 0;
 	}
 
 	if (nvme->backend == NVME_BACKEND_VFIO) {
@@ -85,7 +113,7 @@ rte_init(struct rte *rte)
 }
 
 int
-nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte)
+nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte, int nqpairs)
 {
 	char driver_name[NAME_MAX + 1] = {0};
 	struct nvme_completion cpl = {0};
@@ -128,9 +156,18 @@ nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte)
 	printf("SN('%.*s')\n", 20, ((uint8_t *)nvme->ctrlr.buf) + 4);
 	printf("MN('%.*s')\n", 40, ((uint8_t *)nvme->ctrlr.buf) + 24);
 
-	err = nvme_controller_create_io_qpair(&nvme->ctrlr, &nvme->ioq, 32);
-	if (err) {
-		printf("FAILED: nvme_device_create_io_qpair(); err(%d)\n", err);
+	err = nvme_namespace_init(&nvme->ns, &nvme->ctrlr, 1);
+	if (err || nvme->ns.lba_nbytes > WORKER_BUF_NBYTES) {
+		printf("FAILED: nvme_namespace_init(); err(%d)\n", err);
+		nvme_cleanup(nvme);
+		return err ? err : -ENOTSUP;
+	}
+	nvme_namespace_pr(&nvme->ns);
+
+	err = nvme_controller_create_io_qpairs(&nvme->ctrlr, nqpairs, WORKER_QUEUE_DEPTH,
+					       nvme->ioqs);
+	if (err < 0) {
+		printf("FAILED: nvme_controller_create_io_qpairs(); err(%d)\n", err);
 
 		if (nvme->backend == NVME_BACKEND_VFIO) {
 			nvme_controller_close_vfio(&nvme->ctrlr, &nvme->vfio);
@@ -140,21 +177,166 @@ nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte)
 
 		return err;
 	}
+	nvme->nioqs = err;
+
+	printf("nioqs: %d # of %d requested; controller allows %" PRIu16 "\n", nvme->nioqs,
+	       nqpairs, nvme->ctrlr.nioqs);
 
 	return 0;
 }
 
+static void
+worker_cb(struct nvme_completion *cpl, void *user)
+{
+	struct worker *worker = user;
+
+	worker->ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		worker->nerrors += 1;
+	}
+}
+
+/**
+ * Reads WORKER_NUM_IOS times WORKER_BUF_NBYTES, keeping up to WORKER_QUEUE_DEPTH - 1 in flight
+ */
+static void *
+worker_run(void *arg)
+{
+	struct worker *worker = arg;
+	const uint32_t nlb = WORKER_BUF_NBYTES >> worker->ns->lba_shift;
+	uint64_t begin;
+	size_t nsubmitted = 0;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->cpu, &cpus);
+	worker->err = -pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (worker->err) {
+		return NULL;
+	}
+
+	begin = tsc_clock_ns();
+	while (worker->ncompleted < WORKER_NUM_IOS) {
+		while (nsubmitted < WORKER_NUM_IOS) {
+			size_t slot = nsubmitted % WORKER_QUEUE_DEPTH;
+			uint8_t *buf = worker->buf + slot * WORKER_BUF_NBYTES;
+			struct nvme_command cmd = {0};
+			int err;
+
+			nvme_namespace_prep(worker->ns, &cmd, 0x2, (nsubmitted % 1024) * nlb, nlb);
+
+			err = nvme_qpair_submit_async_contig_prps(worker->qp, worker->heap, buf,
+								  WORKER_BUF_NBYTES, &cmd,
+								  worker_cb, worker);
+			if (err == -EBUSY) {
+				break;
+			}
+			if (err) {
+				worker->err = err;
+				return NULL;
+			}
+			nsubmitted++;
+		}
+
+		nvme_qpair_process_completions(worker->qp, 0);
+	}
+	worker->elapsed_ns = tsc_clock_ns() - begin;
+
+	return NULL;
+}
+
+/**
+ * Run a worker per qpair, each pinned to its own core, and report the IOPS of each and in total
+ */
+static int
+workers_run(struct nvme *nvme, struct rte *rte)
+{
+	struct worker workers[WORKERS_MAX] = {0};
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double iops_total = 0;
+	int err = 0;
+
+	for (int i = 0; i < nvme->nioqs; ++i) {
+		workers[i].qp = &nvme->ioqs[i];
+		workers[i].ns = &nvme->ns;
+		workers[i].heap = &rte->heap;
+		workers[i].cpu = ncpus > 0 ? i % ncpus : 0;
+		workers[i].buf =
+			hostmem_dma_malloc(&rte->heap, WORKER_QUEUE_DEPTH * WORKER_BUF_NBYTES);
+		if (!workers[i].buf) {
+			err = -errno;
+			printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+			goto exit;
+		}
+	}
+
+	for (int i = 0; i < nvme->nioqs; ++i) {
+		err = -pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+		if (err) {
+			printf("FAILED: pthread_create(); err(%d)\n", err);
+			for (int j = 0; j < i; ++j) {
+				pthread_join(workers[j].thread, NULL);
+			}
+			goto exit;
+		}
+	}
+
+	for (int i = 0; i < nvme->nioqs; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	printf("workers:\n");
+	for (int i = 0; i < nvme->nioqs; ++i) {
+		struct worker *worker = &workers[i];
+		double iops = 0;
+
+		if (worker->elapsed_ns) {
+			iops = worker->ncompleted * 1e9 / worker->elapsed_ns;
+		}
+		iops_total += iops;
+
+		printf("- qid: %" PRIu32 "\n", worker->qp->qid);
+		printf("  cpu: %d\n", worker->cpu);
+		printf("  ncompleted: %zu\n", worker->ncompleted);
+		printf("  nerrors: %zu\n", worker->nerrors);
+		printf("  iops: %.0f\n", iops);
+		printf("  err: %d\n", worker->err);
+
+		if (!err && (worker->err || worker->nerrors)) {
+			err = worker->err ? worker->err : -EIO;
+		}
+	}
+	printf("iops_total: %.0f\n", iops_total);
+
+exit:
+	for (int i = 0; i < nvme->nioqs; ++i) {
+		if (workers[i].buf) {
+			hostmem_dma_free(&rte->heap, workers[i].buf);
+		}
+	}
+
+	return err;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct nvme nvme = {0};
 	struct rte rte = {0};
+	int nqpairs = 1;
 	int err;
 
-	if (argc != 2) {
-		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+	if (argc < 2 || argc > 3) {
+		printf("Usage: %s <PCI-BDF> [nqpairs]\n", argv[0]);
 		return 1;
 	}
+	if (argc == 3) {
+		nqpairs = atoi(argv[2]);
+		if (nqpairs < 1 || nqpairs > WORKERS_MAX) {
+			printf("FAILED: nqpairs must be in [1, %d]\n", WORKERS_MAX);
+			return 1;
+		}
+	}
 
 	err = rte_init(&rte);
 	if (err) {
@@ -162,15 +344,20 @@ main(int argc, char **argv)
 		return -err;
 	}
 
-	err = nvme_init(&nvme, argv[1], &rte);
+	err = nvme_init(&nvme, argv[1], &rte, nqpairs);
 	if (err) {
 		printf("FAILED: nvme_init();");
 		hostmem_heap_term(&rte.heap);
 		return -err;
 	}
 
+	err = workers_run(&nvme, &rte);
+	if (err) {
+		printf("FAILED: workers_run(); err(%d)\n", err);
+	}
+
 	nvme_cleanup(&nvme);
 	hostmem_heap_term(&rte.heap);
 
-	return err;
+	return -err;
 }
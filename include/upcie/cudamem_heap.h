@@ -5,7 +5,9 @@
  * =====================================================
  *
  * This heap implementation uses the CUDA driver to pre-allocate memory and
- * the dma-buf interface to get the physical addresses.
+ * the dma-buf interface to get the physical addresses. These are kept as the
+ * physically contiguous runs of the dma-buf, see dmabuf_get_extents(), rather
+ * than as an address per device page.
  * While the heap memory is allocated on the GPU, the freelist is maintained in
  * host memory. This avoids segfaults at the cost of slower alloc/free.
  *
@@ -43,8 +45,7 @@ struct cudamem_heap {
 	struct dmabuf dmabuf;			///< Representation of a dma-buf
 	struct cudamem_config *config;		///< Device memory configuration (page sizes)
 	size_t size;				///< Size of the heap
-	size_t nphys;				///< Number of device pages backing 'memory' (size / config->device_pagesize)
-	uint64_t *phys_lut;			///< An array of physical addresses; one for each device page in 'memory'
+	struct dmabuf_extents extents;		///< Physically contiguous runs backing the heap
 };
 
 /**
@@ -67,10 +68,13 @@ cudamem_heap_pp(struct cudamem_heap *heap)
 	wrtn += printf("  size: '%zu'\n", heap->size);
 	wrtn += printf("  pagesize: '%d'\n", heap->config->pagesize);
 	wrtn += printf("  device_pagesize: '%d'\n", heap->config->device_pagesize);
-	wrtn += printf("  nphys: '%zu'\n", heap->nphys);
-	wrtn += printf("  phys:\n");
-	for (size_t i = 0; i < heap->nphys; ++i) {
-		wrtn += printf("  - 0x%" PRIx64 "\n", heap->phys_lut[i]);
+	wrtn += printf("  nextents: '%zu'\n", heap->extents.nextents);
+	wrtn += printf("  extents:\n");
+	for (size_t i = 0; i < heap->extents.nextents; ++i) {
+		struct dmabuf_extent *extent = &heap->extents.extents[i];
+
+		wrtn += printf("  - {off: 0x%" PRIx64 ", addr: 0x%" PRIx64 ", len: %" PRIu64 "}\n",
+			       extent->off, extent->addr, extent->len);
 	}
 
 	wrtn += printf("  freelist:\n");
@@ -108,7 +112,7 @@ cudamem_heap_term(struct cudamem_heap *heap)
 
 	dmabuf_detach(&heap->dmabuf);
 	cudamem_heap_empty_freelist(heap->freelist);
-	free(heap->phys_lut);
+	dmabuf_extents_term(&heap->extents);
 	cuMemFree((CUdeviceptr)heap->vaddr);
 }
 
@@ -117,7 +121,7 @@ cudamem_heap_term(struct cudamem_heap *heap)
  * Initialize the given heap
  *
  * - Pre-allocate a va-space of 'size' bytes backend by GPU page(s)
- * - Setup the LUT / physical address for the va-space
+ * - Setup the physically contiguous runs of the va-space
  *
  * NOTE: Set up CUDA Driver (cuInit()) and CUDA Context (cuCtxCreate())
  * before calling this function.
@@ -172,18 +176,15 @@ cudamem_heap_init(struct cudamem_heap *heap, size_t size, struct cudamem_config
 		goto error;
 	}
 
-	// Setup the LUT at device page granularity, matching the dma-buf page size
-	heap->nphys = heap->size / heap->config->device_pagesize;
-	heap->phys_lut = calloc(heap->nphys, sizeof(uint64_t));
-	if (!heap->phys_lut) {
-		err = -errno;
-		UPCIE_DEBUG("FAILED: calloc(phys_lut), errno: %d", err);
+	err = dmabuf_get_extents(&heap->dmabuf, &heap->extents);
+	if (err) {
+		UPCIE_DEBUG("FAILED: dmabuf_get_extents(), err: %d", err);
 		goto error_after_attach;
 	}
-
-	err = dmabuf_get_lut(&heap->dmabuf, heap->nphys, heap->phys_lut, heap->config->device_pagesize);
-	if (err) {
-		UPCIE_DEBUG("FAILED: dmabuf_get_lut(), err: %d", err);
+	if (heap->extents.size != heap->size) {
+		UPCIE_DEBUG("FAILED: dmabuf size (%" PRIu64 ") != heap size (%zu)",
+			    heap->extents.size, heap->size);
+		err = -EINVAL;
 		goto error_after_attach;
 	}
 
@@ -191,13 +192,12 @@ cudamem_heap_init(struct cudamem_heap *heap, size_t size, struct cudamem_config
 
 error_after_attach:
 	dmabuf_detach(&heap->dmabuf);
+	dmabuf_extents_term(&heap->extents);
 	free(heap->freelist);
-	free(heap->phys_lut);
 	cuMemFree(vaddr);
 	return err;
 error:
 	free(heap->freelist);
-	free(heap->phys_lut);
 	if (dmabuf_fd >= 0) {
 		close(dmabuf_fd);
 	}
@@ -398,10 +398,9 @@ cudamem_heap_contains(struct cudamem_heap *heap, void *virt)
 static inline int
 cudamem_heap_block_virt_to_phys(struct cudamem_heap *heap, void *virt, uint64_t *phys)
 {
-	size_t offset, page_idx, in_page_offset;
 	uint64_t vaddr = (uint64_t) virt;
 
-	if (!heap || !heap->phys_lut || !virt || !phys) {
+	if (!heap || !heap->extents.nextents || !virt || !phys) {
 		return -EINVAL;
 	}
 
@@ -409,20 +408,7 @@ cudamem_heap_block_virt_to_phys(struct cudamem_heap *heap, void *virt, uint64_t
 		return -EINVAL;
 	}
 
-	// Compute byte offset from base of heap
-	offset = vaddr - heap->vaddr;
-
-	// Determine which page this address falls into
-	page_idx = offset / heap->config->device_pagesize;
-
-	if (page_idx >= heap->nphys) {
-		return -EINVAL;
-	}
-
-	// Offset within that page
-	in_page_offset = offset % heap->config->device_pagesize;
-
-	*phys = heap->phys_lut[page_idx] + in_page_offset;
+	*phys = dmabuf_extents_addr(&heap->extents, vaddr - heap->vaddr, NULL);
 
 	return 0;
 }
@@ -436,18 +422,17 @@ cudamem_heap_block_virt_to_phys(struct cudamem_heap *heap, void *virt, uint64_t
 static inline uint64_t
 cudamem_heap_block_vtp(struct cudamem_heap *heap, void *virt)
 {
-	size_t offset, page_idx, in_page_offset;
-	uint64_t vaddr = (uint64_t) virt;
-
-	// Compute byte offset from base of heap
-	offset = vaddr - heap->vaddr;
-
-	// Determine which page this address falls into
-	page_idx = offset / heap->config->device_pagesize;
-	assert(page_idx < heap->nphys);
-
-	// Offset within that page
-	in_page_offset = offset % heap->config->device_pagesize;
+	return dmabuf_extents_addr(&heap->extents, (uint64_t)virt - heap->vaddr, NULL);
+}
 
-	return heap->phys_lut[page_idx] + in_page_offset;
+/**
+ * Calculate the physical address of a block on the given heap, and via 'contig', the number of
+ * bytes which are physically contiguous from it
+ *
+ * Same as cudamem_heap_block_vtp(), for building DMA descriptors per physically contiguous run.
+ */
+static inline uint64_t
+cudamem_heap_block_vtp_contig(struct cudamem_heap *heap, void *virt, uint64_t *contig)
+{
+	return dmabuf_extents_addr(&heap->extents, (uint64_t)virt - heap->vaddr, contig);
 }
@@ -23,7 +23,7 @@
  *
  * `_add` walks chunks intersecting the floored user range, ref-bumps existing
  * entries, and populates new entries via cuMemGetHandleForAddressRange +
- * dmabuf_attach + dmabuf_get_lut. `_remove` decrements rc and frees the dma-buf
+ * dmabuf_attach + dmabuf_get_extents. `_remove` decrements rc and frees the dma-buf
  * when rc reaches zero. Repeated overlapping registrations in the same chunk
  * amortize to one dma-buf cost, and resolve to identical phys for any VA they
  * share.
@@ -52,6 +52,31 @@
  * The split keeps the hot path flat-array-of-u64: `_virt_to_phys` reads
  * `lut_phys[chunk_idx]` only and never touches `lut_meta`.
  *
+ * Concurrency
+ * -----------
+ *
+ * `_virt_to_phys` is lock-free, and may run concurrently with `_add`,
+ * `_remove` and `_clear`: a `lut_phys` slot is published with a release-store
+ * once its chunk is populated, and is cleared before the chunk is released.
+ * The writers serialize on the registry lock, and the chunk refcounts are
+ * atomic.
+ *
+ * A reader may still hold, or have put into a command, a phys it loaded just
+ * before the slot was cleared, thus, the dma-buf of a released chunk is not
+ * detached right away. It is retired, tagged with the registry epoch, and
+ * detached once every registered reader has declared a quiescent state after
+ * the retirement; a grace period in the manner of QSBR. A reader thread calls:
+ *
+ *   cudamem_mapping_reader_register()    once, obtaining a reader id
+ *   cudamem_mapping_quiescent()          whenever it holds no translations,
+ *                                        e.g. after reaping its completions
+ *   cudamem_mapping_reader_unregister()  when done
+ *
+ * Declaring a quiescent state is two atomic operations, no locks. Retired
+ * dma-bufs are reclaimed by the writers, on each `_add` / `_remove`, or
+ * explicitly via cudamem_mapping_reclaim(). Readers which are not registered
+ * are not waited for.
+ *
  * Caveat: Hardware requirements
  * -----------------------------
  *
@@ -107,6 +132,11 @@
  */
 #define CUDAMEM_MAPPING_VA_BITS 48
 
+/**
+ * Maximum number of concurrently registered readers, see cudamem_mapping_reader_register()
+ */
+#define CUDAMEM_MAPPING_READERS_MAX 64
+
 /**
  * Per-chunk cache entry (cold-path only).
  *
@@ -135,6 +165,22 @@ struct cudamem_mapping_registration {
 	struct cudamem_mapping_registration *next; ///< List linkage owned by the registry
 };
 
+/**
+ * A dma-buf of a released chunk, detached once its grace period has elapsed
+ */
+struct cudamem_mapping_retired {
+	uint64_t epoch;                       ///< Registry epoch at retirement
+	struct dmabuf attach;                 ///< The dma-buf to detach
+	struct cudamem_mapping_retired *next; ///< List linkage owned by the registry
+};
+
+/**
+ * The epoch last observed by a reader in a quiescent state; 0 when the slot is free
+ */
+struct cudamem_mapping_reader {
+	uint64_t epoch;
+} __attribute__((aligned(64)));
+
 /**
  * Registry of all registrations for one CUDA device.
  *
@@ -155,6 +201,11 @@ struct cudamem_mapping_registry {
 	uint64_t *lut_phys;                          ///< chunk_idx -> phys_base; mmap-backed
 	struct cudamem_mapping_chunk_meta *lut_meta; ///< chunk_idx -> meta; mmap-backed
 	struct cudamem_mapping_registration *list;   ///< Owned list of registration metadata
+
+	pthread_mutex_t lock;                     ///< Serializes _add, _remove, _clear and _reclaim
+	uint64_t epoch;                           ///< Advanced on every retirement; starts at 1
+	struct cudamem_mapping_retired *retired;  ///< dma-bufs awaiting their grace period
+	struct cudamem_mapping_reader readers[CUDAMEM_MAPPING_READERS_MAX];
 };
 
 /**
@@ -186,6 +237,9 @@ cudamem_mapping_registry_init(struct cudamem_mapping_registry *registry,
 	registry->gran_mask = (uint64_t)config->alloc_granularity - 1;
 	registry->lut_capacity = (1ULL << CUDAMEM_MAPPING_VA_BITS) >> registry->gran_shift;
 	registry->list = NULL;
+	registry->retired = NULL;
+	registry->epoch = 1;
+	memset(registry->readers, 0, sizeof(registry->readers));
 
 	phys_bytes = registry->lut_capacity * sizeof(*registry->lut_phys);
 	registry->lut_phys = mmap(NULL, phys_bytes, PROT_READ | PROT_WRITE,
@@ -207,15 +261,148 @@ cudamem_mapping_registry_init(struct cudamem_mapping_registry *registry,
 		return -ENOMEM;
 	}
 
+	pthread_mutex_init(&registry->lock, NULL);
+
 	return 0;
 }
 
 /**
- * Decrement rc on chunks [chunk_first, chunk_first + chunk_cnt) and detach
+ * Register the calling thread as a reader, see "Concurrency" above
+ *
+ * @param id Pointer to store the reader id in
+ *
+ * @return 0 on success, -EBUSY when CUDAMEM_MAPPING_READERS_MAX readers are registered.
+ */
+static inline int
+cudamem_mapping_reader_register(struct cudamem_mapping_registry *registry, int *id)
+{
+	for (int i = 0; i < CUDAMEM_MAPPING_READERS_MAX; ++i) {
+		uint64_t expected = 0;
+		uint64_t epoch = __atomic_load_n(&registry->epoch, __ATOMIC_ACQUIRE);
+
+		if (__atomic_compare_exchange_n(&registry->readers[i].epoch, &expected, epoch, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			*id = i;
+			return 0;
+		}
+	}
+
+	return -EBUSY;
+}
+
+static inline void
+cudamem_mapping_reader_unregister(struct cudamem_mapping_registry *registry, int id)
+{
+	__atomic_store_n(&registry->readers[id].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Declare that the reader holds no physical addresses obtained from the registry
+ *
+ * Lock-free; to be called by the reader as often as convenient, as retired dma-bufs are only
+ * detached once every registered reader has done so since their retirement.
+ */
+static inline void
+cudamem_mapping_quiescent(struct cudamem_mapping_registry *registry, int id)
+{
+	__atomic_store_n(&registry->readers[id].epoch,
+			 __atomic_load_n(&registry->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+/**
+ * Detach the retired dma-bufs whose grace period has elapsed; the registry lock must be held
+ *
+ * @return The number of dma-bufs still awaiting their grace period
+ */
+static inline int
+cudamem_mapping_reclaim_locked(struct cudamem_mapping_registry *registry)
+{
+	uint64_t oldest = __atomic_load_n(&registry->epoch, __ATOMIC_ACQUIRE);
+	struct cudamem_mapping_retired **prev = &registry->retired;
+	int nretired = 0;
+
+	for (int i = 0; i < CUDAMEM_MAPPING_READERS_MAX; ++i) {
+		uint64_t epoch = __atomic_load_n(&registry->readers[i].epoch, __ATOMIC_ACQUIRE);
+
+		if (epoch && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	while (*prev) {
+		struct cudamem_mapping_retired *retired = *prev;
+
+		if (retired->epoch < oldest) {
+			*prev = retired->next;
+			dmabuf_detach(&retired->attach);
+			free(retired);
+		} else {
+			prev = &retired->next;
+			nretired++;
+		}
+	}
+
+	return nretired;
+}
+
+/**
+ * Detach the retired dma-bufs whose grace period has elapsed
+ *
+ * @return The number of dma-bufs still awaiting their grace period
+ */
+static inline int
+cudamem_mapping_reclaim(struct cudamem_mapping_registry *registry)
+{
+	int nretired;
+
+	pthread_mutex_lock(&registry->lock);
+	nretired = cudamem_mapping_reclaim_locked(registry);
+	pthread_mutex_unlock(&registry->lock);
+
+	return nretired;
+}
+
+/**
+ * Retire the dma-buf of a chunk whose slot has been cleared; the registry lock must be held
+ *
+ * Readers observing the advanced epoch, in a quiescent state, no longer hold addresses of it.
+ * When the retirement cannot be recorded, then the readers are waited for instead.
+ */
+static inline void
+cudamem_mapping_retire(struct cudamem_mapping_registry *registry, struct dmabuf *attach)
+{
+	struct cudamem_mapping_retired *retired = calloc(1, sizeof(*retired));
+
+	if (!retired) {
+		UPCIE_DEBUG("FAILED: calloc(retired); waiting for the readers");
+
+		__atomic_add_fetch(&registry->epoch, 1, __ATOMIC_SEQ_CST);
+		for (int i = 0; i < CUDAMEM_MAPPING_READERS_MAX; ++i) {
+			const uint64_t epoch = __atomic_load_n(&registry->epoch, __ATOMIC_RELAXED);
+			uint64_t seen;
+
+			do {
+				seen = __atomic_load_n(&registry->readers[i].epoch,
+						       __ATOMIC_ACQUIRE);
+			} while (seen && seen < epoch);
+		}
+		dmabuf_detach(attach);
+		return;
+	}
+
+	retired->attach = *attach;
+	retired->epoch = __atomic_fetch_add(&registry->epoch, 1, __ATOMIC_SEQ_CST);
+	retired->next = registry->retired;
+	registry->retired = retired;
+}
+
+/**
+ * Decrement rc on chunks [chunk_first, chunk_first + chunk_cnt) and retire
  * the dma-buf for each chunk whose rc transitions to zero.
  *
  * Chunks with rc == 0 on entry are skipped, making the helper safe for
  * partial unwind paths (where some chunks in the range were never bumped).
+ * The registry lock must be held.
  */
 static inline void
 cudamem_mapping_chunk_deref(struct cudamem_mapping_registry *registry, size_t chunk_first,
@@ -225,14 +412,13 @@ cudamem_mapping_chunk_deref(struct cudamem_mapping_registry *registry, size_t ch
 		const size_t idx = chunk_first + k;
 		struct cudamem_mapping_chunk_meta *cm = &registry->lut_meta[idx];
 
-		if (cm->rc == 0) {
+		if (__atomic_load_n(&cm->rc, __ATOMIC_ACQUIRE) == 0) {
 			continue;
 		}
-		cm->rc--;
-		if (cm->rc == 0) {
-			dmabuf_detach(&cm->attach);
+		if (__atomic_sub_fetch(&cm->rc, 1, __ATOMIC_ACQ_REL) == 0) {
+			__atomic_store_n(&registry->lut_phys[idx], 0, __ATOMIC_RELEASE);
+			cudamem_mapping_retire(registry, &cm->attach);
 			memset(&cm->attach, 0, sizeof(cm->attach));
-			registry->lut_phys[idx] = 0;
 		}
 	}
 }
@@ -240,8 +426,8 @@ cudamem_mapping_chunk_deref(struct cudamem_mapping_registry *registry, size_t ch
 /**
  * Detach all cached dma-bufs and free registration metadata.
  *
- * Walks the registration list and decrements each chunk's rc, releasing the
- * dma-buf and clearing the lut_phys slot when rc reaches zero. The LUT mmaps
+ * Walks the registration list and decrements each chunk's rc, clearing the
+ * lut_phys slot and retiring the dma-buf when rc reaches zero. The LUT mmaps
  * stay reserved.
  */
 static inline void
@@ -256,6 +442,7 @@ cudamem_mapping_clear(struct cudamem_mapping_registry *registry)
 	const uint64_t mask = registry->gran_mask;
 	const int gran_shift = registry->gran_shift;
 
+	pthread_mutex_lock(&registry->lock);
 	for (struct cudamem_mapping_registration *m = registry->list; m; m = next) {
 		const size_t chunk_first = (size_t)(m->vaddr >> gran_shift);
 		const size_t chunk_cnt =
@@ -267,11 +454,16 @@ cudamem_mapping_clear(struct cudamem_mapping_registry *registry)
 		free(m);
 	}
 	registry->list = NULL;
+	cudamem_mapping_reclaim_locked(registry);
+	pthread_mutex_unlock(&registry->lock);
 }
 
 /**
  * Tear down a registry, releasing the LUT mmaps and detaching all cached
  * dma-bufs.
+ *
+ * There must be no readers left, thus, the retired dma-bufs are detached
+ * without waiting for their grace period.
  */
 static inline void
 cudamem_mapping_registry_term(struct cudamem_mapping_registry *registry)
@@ -282,6 +474,10 @@ cudamem_mapping_registry_term(struct cudamem_mapping_registry *registry)
 
 	cudamem_mapping_clear(registry);
 
+	memset(registry->readers, 0, sizeof(registry->readers));
+	cudamem_mapping_reclaim(registry);
+	pthread_mutex_destroy(&registry->lock);
+
 	if (registry->lut_phys) {
 		munmap(registry->lut_phys, registry->lut_capacity * sizeof(*registry->lut_phys));
 		registry->lut_phys = NULL;
@@ -297,8 +493,8 @@ cudamem_mapping_registry_term(struct cudamem_mapping_registry *registry)
  * Populate one chunk from CUDA.
  *
  * Calls cuMemGetHandleForAddressRange for the chunk's full alloc_granularity
- * extent, attaches the dma-buf, fetches the host-page LUT, verifies that the
- * LUT is contiguous (BAR1 large-page assumption), and returns the chunk's
+ * extent, attaches the dma-buf, fetches its contiguous runs, verifies that the
+ * chunk is a single run (BAR1 large-page assumption), and returns the chunk's
  * phys_base via *phys_base_out and the attachment via *attach_out. On any
  * failure both outputs are left untouched and an errno is returned.
  *
@@ -308,61 +504,50 @@ static inline int
 cudamem_mapping_chunk_populate(uint64_t *phys_base_out, struct dmabuf *attach_out,
 			       uint64_t chunk_va, struct cudamem_config *config)
 {
-	const size_t pagesize = (size_t)config->pagesize;
 	const size_t gran = config->alloc_granularity;
-	const size_t nphys = gran >> config->pagesize_shift;
-	uint64_t *tmp = NULL;
+	struct dmabuf_extents extents = {0};
 	int dmabuf_fd = -1;
 	struct dmabuf attach = {0};
 	int err;
 	CUresult cr;
 
-	tmp = calloc(nphys, sizeof(*tmp));
-	if (!tmp) {
-		return -ENOMEM;
-	}
-
 	cr = cuMemGetHandleForAddressRange(&dmabuf_fd, (CUdeviceptr)chunk_va, gran,
 					   CU_MEM_RANGE_HANDLE_TYPE_DMA_BUF_FD, 0);
 	if (cr != CUDA_SUCCESS) {
 		UPCIE_DEBUG("FAILED: cuMemGetHandleForAddressRange(0x%" PRIx64 ", %zu), cr: %d",
 			    chunk_va, gran, cr);
-		err = -EIO;
-		goto err_free;
+		return -EIO;
 	}
 
 	err = dmabuf_attach(dmabuf_fd, &attach);
 	if (err) {
 		UPCIE_DEBUG("FAILED: dmabuf_attach(), err: %d", err);
 		close(dmabuf_fd);
-		goto err_free;
+		return err;
 	}
 
-	err = dmabuf_get_lut(&attach, nphys, tmp, (int)pagesize);
+	err = dmabuf_get_extents(&attach, &extents);
 	if (err) {
-		UPCIE_DEBUG("FAILED: dmabuf_get_lut(), err: %d", err);
+		UPCIE_DEBUG("FAILED: dmabuf_get_extents(), err: %d", err);
 		goto err_detach;
 	}
 
-	for (size_t i = 1; i < nphys; ++i) {
-		if (tmp[i] != tmp[0] + i * pagesize) {
-			UPCIE_DEBUG("FAILED: chunk LUT not contiguous at i=%zu; phys[0]=0x%" PRIx64
-				    " phys[%zu]=0x%" PRIx64,
-				    i, tmp[0], i, tmp[i]);
-			err = -EOPNOTSUPP;
-			goto err_detach;
-		}
+	if (extents.nextents != 1 || extents.size != gran) {
+		UPCIE_DEBUG("FAILED: chunk not contiguous; nextents=%zu, size=%" PRIu64
+			    ", phys[0]=0x%" PRIx64,
+			    extents.nextents, extents.size, extents.extents[0].addr);
+		err = -EOPNOTSUPP;
+		goto err_detach;
 	}
 
-	*phys_base_out = tmp[0];
+	*phys_base_out = extents.extents[0].addr;
 	*attach_out = attach;
-	free(tmp);
+	dmabuf_extents_term(&extents);
 	return 0;
 
 err_detach:
+	dmabuf_extents_term(&extents);
 	dmabuf_detach(&attach);
-err_free:
-	free(tmp);
 	return err;
 }
 
@@ -427,19 +612,25 @@ cudamem_mapping_add(struct cudamem_mapping_registry *registry, struct cudamem_co
 	m->vaddr = va;
 	m->size = nbytes;
 
+	pthread_mutex_lock(&registry->lock);
+
 	for (size_t k = 0; k < chunk_cnt; ++k) {
 		const size_t idx = chunk_first + k;
 		struct cudamem_mapping_chunk_meta *cm = &registry->lut_meta[idx];
 
-		if (cm->rc == 0) {
+		if (__atomic_load_n(&cm->rc, __ATOMIC_ACQUIRE) == 0) {
 			const uint64_t chunk_va = (uint64_t)idx << gran_shift;
-			err = cudamem_mapping_chunk_populate(&registry->lut_phys[idx], &cm->attach,
-							     chunk_va, config);
+			uint64_t phys_base;
+
+			err = cudamem_mapping_chunk_populate(&phys_base, &cm->attach, chunk_va,
+							     config);
 			if (err) {
 				goto err_unwind;
 			}
+			// Published once the chunk is fully populated
+			__atomic_store_n(&registry->lut_phys[idx], phys_base, __ATOMIC_RELEASE);
 		}
-		cm->rc++;
+		__atomic_add_fetch(&cm->rc, 1, __ATOMIC_ACQ_REL);
 		bumped_cnt++;
 	}
 
@@ -449,10 +640,14 @@ cudamem_mapping_add(struct cudamem_mapping_registry *registry, struct cudamem_co
 		*out = m;
 	}
 
+	cudamem_mapping_reclaim_locked(registry);
+	pthread_mutex_unlock(&registry->lock);
+
 	return 0;
 
 err_unwind:
 	cudamem_mapping_chunk_deref(registry, chunk_first, bumped_cnt);
+	pthread_mutex_unlock(&registry->lock);
 
 	free(m);
 	return err;
@@ -478,6 +673,7 @@ cudamem_mapping_remove(struct cudamem_mapping_registry *registry, void *vaddr)
 	const int gran_shift = registry->gran_shift;
 	const uint64_t mask = registry->gran_mask;
 
+	pthread_mutex_lock(&registry->lock);
 	for (struct cudamem_mapping_registration **prev = &registry->list, *m = registry->list; m;
 	     prev = &m->next, m = m->next) {
 		if (m->vaddr == key) {
@@ -489,9 +685,12 @@ cudamem_mapping_remove(struct cudamem_mapping_registry *registry, void *vaddr)
 
 			*prev = m->next;
 			free(m);
+			cudamem_mapping_reclaim_locked(registry);
+			pthread_mutex_unlock(&registry->lock);
 			return 0;
 		}
 	}
+	pthread_mutex_unlock(&registry->lock);
 
 	return -EINVAL;
 }
@@ -499,7 +698,9 @@ cudamem_mapping_remove(struct cudamem_mapping_registry *registry, void *vaddr)
 /**
  * Resolve a CUDA virtual address registered with the registry.
  *
- * O(1): one LUT load.
+ * O(1): one LUT load. Lock-free, and safe to call concurrently with
+ * `_add` / `_remove`; see "Concurrency" above for when the returned phys may
+ * be used until.
  *
  * @return 0 on success, -EINVAL if `virt` is not in a registered chunk.
  */
@@ -520,7 +721,7 @@ cudamem_mapping_virt_to_phys(struct cudamem_mapping_registry *registry, void *vi
 		return -EINVAL;
 	}
 
-	base = registry->lut_phys[idx];
+	base = __atomic_load_n(&registry->lut_phys[idx], __ATOMIC_ACQUIRE);
 	if (base == 0) {
 		return -EINVAL;
 	}
@@ -11,6 +11,14 @@
  * NOTE: This depends on a patch for UDMABUF adding capabilites to import a
  * dma-buf and return the physical addresses to Userspace
  *
+ * The addresses are available in two forms:
+ *
+ * - dmabuf_get_lut(), a flat LUT with one physical address per page
+ * - dmabuf_get_extents(), the physically contiguous runs of the dma-buf, each described by
+ *   [offset, address, length], sorted by offset, and with an index for finding the run of a given
+ *   offset in a few steps. A dma-buf of device memory usually consists of few, long, runs, thus,
+ *   this is much smaller than the LUT, and lets DMA descriptors be emitted per run.
+ *
  * @file dmabuf.h
  * @version 0.4.4
  */
@@ -29,6 +37,27 @@ struct dmabuf {
 	struct dmabuf_page *pages;	///< Array of pages in the dma-buf
 };
 
+/**
+ * A physically contiguous run of a dma-buf
+ */
+struct dmabuf_extent {
+	uint64_t off;			///< Offset of the run within the dma-buf
+	uint64_t addr;			///< Physical address of the run
+	uint64_t len;			///< Length of the run in bytes
+};
+
+/**
+ * The runs of a dma-buf, as set up by dmabuf_get_extents()
+ */
+struct dmabuf_extents {
+	uint64_t size;			///< Sum of the lengths of the runs
+	size_t nextents;		///< Number of runs
+	struct dmabuf_extent *extents;	///< Array of runs, sorted by offset
+	int index_shift;		///< Each index entry covers (1 << index_shift) bytes
+	size_t nindex;			///< Number of index entries
+	uint32_t *index;		///< The run holding the first byte covered by each entry
+};
+
 /**
  * Print information about the given dma-buf and each of it's pages
  */
@@ -90,6 +119,124 @@ dmabuf_get_lut(struct dmabuf *dmabuf, size_t nphys, uint64_t *phys_lut, uint64_t
 	return 0;
 }
 
+static inline void
+dmabuf_extents_term(struct dmabuf_extents *extents)
+{
+	if (!extents) {
+		return;
+	}
+
+	free(extents->extents);
+	free(extents->index);
+	memset(extents, 0, sizeof(*extents));
+}
+
+/**
+ * Get the physically contiguous runs of the given dma-buf
+ *
+ * Pages of the dma-buf which are physically adjacent are merged into a single run. The index is
+ * given a granularity such that it has at most a few entries per run, and at least a page.
+ *
+ * NOTE: Release the runs with dmabuf_extents_term()
+ */
+static inline int
+dmabuf_get_extents(struct dmabuf *dmabuf, struct dmabuf_extents *extents)
+{
+	memset(extents, 0, sizeof(*extents));
+
+	extents->extents = calloc(dmabuf->npages ? dmabuf->npages : 1, sizeof(*extents->extents));
+	if (!extents->extents) {
+		UPCIE_DEBUG("FAILED: calloc(extents), errno: %d", errno);
+		return -ENOMEM;
+	}
+
+	for (size_t j = 0; j < dmabuf->npages; j++) {
+		struct dmabuf_extent *last = NULL;
+		struct dmabuf_page *page = &dmabuf->pages[j];
+
+		if (!page->len) {
+			continue;
+		}
+
+		if (extents->nextents) {
+			last = &extents->extents[extents->nextents - 1];
+		}
+		if (last && last->addr + last->len == page->addr) {
+			last->len += page->len;
+		} else {
+			extents->extents[extents->nextents].off = extents->size;
+			extents->extents[extents->nextents].addr = page->addr;
+			extents->extents[extents->nextents].len = page->len;
+			extents->nextents++;
+		}
+		extents->size += page->len;
+	}
+
+	if (!extents->nextents) {
+		UPCIE_DEBUG("FAILED: dmabuf has no pages");
+		dmabuf_extents_term(extents);
+		return -EINVAL;
+	}
+
+	extents->index_shift = 12;
+	while ((extents->size >> extents->index_shift) > 4 * extents->nextents) {
+		extents->index_shift++;
+	}
+	extents->nindex = ((extents->size - 1) >> extents->index_shift) + 1;
+
+	extents->index = calloc(extents->nindex, sizeof(*extents->index));
+	if (!extents->index) {
+		UPCIE_DEBUG("FAILED: calloc(index), errno: %d", errno);
+		dmabuf_extents_term(extents);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0, e = 0; i < extents->nindex; i++) {
+		const uint64_t off = (uint64_t)i << extents->index_shift;
+
+		while (extents->extents[e].off + extents->extents[e].len <= off) {
+			e++;
+		}
+		extents->index[i] = e;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the run holding the given offset; 'off' must be less than 'extents->size'
+ */
+static inline const struct dmabuf_extent *
+dmabuf_extents_find(const struct dmabuf_extents *extents, uint64_t off)
+{
+	const struct dmabuf_extent *extent;
+
+	assert(off < extents->size);
+
+	extent = &extents->extents[extents->index[off >> extents->index_shift]];
+	while (extent->off + extent->len <= off) {
+		extent++;
+	}
+
+	return extent;
+}
+
+/**
+ * Returns the physical address of the given offset, and via 'contig', when not NULL, the number
+ * of bytes which are physically contiguous from it, that is, to the end of its run.
+ */
+static inline uint64_t
+dmabuf_extents_addr(const struct dmabuf_extents *extents, uint64_t off, uint64_t *contig)
+{
+	const struct dmabuf_extent *extent = dmabuf_extents_find(extents, off);
+
+	if (contig) {
+		*contig = extent->off + extent->len - off;
+	}
+
+	return extent->addr + (off - extent->off);
+}
+
 #ifdef UDMABUF_ATTACH
 /**
  * Attach to dma-buf with given FD
@@ -71,3 +71,94 @@ hostmem_pagemap_virt_to_phys(void *virt, uint64_t *phys)
 
 	return 0;
 }
+
+/**
+ * Consult "/proc/self/pagemap" for 'count' addresses, 'stride' bytes apart, starting at 'virt'
+ *
+ * Same as hostmem_pagemap_virt_to_phys(), for a range of addresses, e.g. one per hugepage, with
+ * pagemap opened once. When 'stride' is the page size, then the entries are adjacent in pagemap,
+ * and are read in batches, with a single pread() per batch.
+ *
+ * @param virt Page-aligned address of the first entry
+ * @param count Number of addresses to resolve
+ * @param stride Distance between the addresses; a multiple of the page size
+ * @param phys Array of 'count' entries to record the physical addresses in
+ *
+ * @returns On success, 0 is returned. On error, negative errno is return to indicate the error.
+ */
+static inline int
+hostmem_pagemap_virt_to_phys_range(void *virt, size_t count, size_t stride, uint64_t *phys)
+{
+	const uint64_t pfn_mask = ((1ULL << 55) - 1);
+	const size_t pgsz = getpagesize();
+	const size_t step = stride / pgsz;
+	const uint64_t virt_pfn = (uint64_t)virt / pgsz;
+	uint64_t entries[512];
+	int err = 0;
+	int fd;
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		UPCIE_DEBUG("FAILED: open(pagemap); errno(%d), fd(%d)", errno, fd);
+		return -errno;
+	}
+
+	for (size_t i = 0; i < count && !err;) {
+		size_t n = 1;
+		ssize_t nbytes;
+
+		if (step == 1) {
+			n = count - i < 512 ? count - i : 512;
+		}
+		nbytes = n * sizeof(*entries);
+
+		if (pread(fd, entries, nbytes, (virt_pfn + i * step) * sizeof(*entries)) !=
+		    nbytes) {
+			UPCIE_DEBUG("FAILED: pread(pagemap); errno(%d)", errno);
+			err = errno ? -errno : -EIO;
+			break;
+		}
+
+		for (size_t j = 0; j < n; ++j) {
+			if (!(entries[j] & (1ULL << 63))) {
+				UPCIE_DEBUG("FAILED: Page not present");
+				err = -EINVAL;
+				break;
+			}
+			phys[i + j] = (entries[j] & pfn_mask) * pgsz;
+		}
+		i += n;
+	}
+
+	close(fd);
+
+	return err;
+}
+
+/**
+ * Bind the memory of [virt, virt + size) to the given NUMA node
+ *
+ * This must be done before the memory is faulted in, e.g. before mlock() or touching it, as the
+ * policy applies to pages allocated after the call.
+ *
+ * @returns On success, 0 is returned. On error, negative errno is return to indicate the error.
+ */
+static inline int
+hostmem_numa_bind(void *virt, size_t size, int node)
+{
+	unsigned long nodemask;
+
+	if (node < 0 || node >= (int)(8 * sizeof(nodemask))) {
+		UPCIE_DEBUG("FAILED: node(%d) out of range", node);
+		return -EINVAL;
+	}
+	nodemask = 1UL << node;
+
+	// The kernel reads 'maxnode - 1' bits of the mask
+	if (syscall(SYS_mbind, virt, size, MPOL_BIND, &nodemask, 8 * sizeof(nodemask) + 1, 0)) {
+		UPCIE_DEBUG("FAILED: mbind(node: %d); errno(%d)", node, errno);
+		return -errno;
+	}
+
+	return 0;
+}
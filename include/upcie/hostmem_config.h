@@ -26,6 +26,9 @@ struct hostmem_config {
 	int pagesize; ///< Host memory pagesize (not HUGEPAGE size)
 	int pagesize_shift;
 	int hugepgsz; ///< THIS, is the HUGEPAGE size
+	int hugepgsz_shift;
+	int numa_node; ///< NUMA node to bind hugepages to; -1 for no binding
+	int nthreads;  ///< Number of threads faulting-in hugepages, see hostmem_hugepage_prefault()
 };
 
 static inline int
@@ -48,6 +51,9 @@ hostmem_config_pp(struct hostmem_config *config)
 	wrtn += printf("  pagesize: %d\n", config->pagesize);
 	wrtn += printf("  pagesize_shift: %d\n", config->pagesize_shift);
 	wrtn += printf("  hugepgsz: %d\n", config->hugepgsz);
+	wrtn += printf("  hugepgsz_shift: %d\n", config->hugepgsz_shift);
+	wrtn += printf("  numa_node: %d\n", config->numa_node);
+	wrtn += printf("  nthreads: %d\n", config->nthreads);
 
 	return wrtn;
 };
@@ -93,6 +99,7 @@ hostmem_config_init(struct hostmem_config *config)
 	if (err) {
 		return err;
 	}
+	config->hugepgsz_shift = upcie_util_shift_from_size(config->hugepgsz);
 
 	config->memfd_flags = MFD_HUGETLB;
 	if (config->hugepgsz == 2 * 1024 * 1024) {
@@ -104,6 +111,18 @@ hostmem_config_init(struct hostmem_config *config)
 		return -EINVAL;
 	}
 
+	config->numa_node = -1;
+	env = getenv("HOSTMEM_NUMA_NODE");
+	if (env) {
+		config->numa_node = atoi(env);
+	}
+
+	config->nthreads = 1;
+	env = getenv("HOSTMEM_NTHREADS");
+	if (env) {
+		config->nthreads = atoi(env);
+	}
+
 	env = getenv("HOSTMEM_HUGETLB_PATH");
 	if (env) {
 		snprintf(config->hugetlb_path, sizeof(config->hugetlb_path), "%s", env);
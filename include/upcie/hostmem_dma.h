@@ -21,6 +21,16 @@
  *  - uint64_t hostmem_dma_v2p(void *virt);
  *    Resolve a virtual address to its corresponding physical address.
  *
+ *  - int hostmem_dma_v2p_batch(void *virt, size_t nbytes, uint64_t *addrs, size_t max);
+ *    Resolve the physical addresses of all pages in a range, or an iovec, in one pass.
+ *
+ *  - uint64_t hostmem_dma_v2iova(void *virt);
+ *    Resolve a virtual address to its I/O virtual address, for a heap mapped via VFIO.
+ *
+ * The addresses given by hostmem_dma_v2p() are those to be handed to devices. These are the
+ * physical addresses, unless the heap is mapped into an IOMMU domain, e.g. by vfio_map_heap(),
+ * then they are the IOVAs, thus, the NVMe code paths are the same with, and without, VFIO.
+ *
  * Usage
  * -----
  *
@@ -33,8 +43,8 @@
  * - Physical contiguity is guaranteed only up to the system's hugepage size. On most systems, this
  *   is 2MB.
  *
- * - Sub-hugepage allocations may span multiple hugepages, resulting in reduced physical
- *   contiguity. This may be addressed in a future update.
+ * - Allocations up to the hugepage size never span multiple hugepages; they are rounded up to a
+ *   power-of-two by the underlying buddy allocator, see hostmem_heap.h.
  *
  * - Alignment is currently to the system's page size (typically 4KB).
  *
@@ -44,7 +54,6 @@
  * Planned improvements include:
  *
  *   - hostmem_dma_calloc() for zero-initialized memory
- *   - Sub-hugepage contiguity enforcement
  *
  * @file hostmem_dma.h
  * @version 0.4.4
@@ -122,22 +131,116 @@ hostmem_dma_alloc_array(struct hostmem_heap *heap, size_t elem_count, size_t ele
 /**
  * Resolve the physical address of a given virtual address.
  *
+ * When the heap is mapped into an IOMMU domain, then this is the IOVA, see hostmem_dma_v2iova().
+ *
  * @param virt Pointer to memory previously allocated by hostmem_dma_malloc().
  * @return Physical address corresponding to the given virtual address.
  */
 static inline uint64_t
 hostmem_dma_v2p(struct hostmem_heap *heap, void *virt)
 {
-	size_t offset, hpage_idx, in_hpage_offset;
+	const int shift = heap->config->hugepgsz_shift;
+	size_t offset;
 
 	// Compute byte offset from base of heap
 	offset = (char *)virt - (char *)heap->memory.virt;
 
-	// Determine which hugepage this address falls into
-	hpage_idx = offset / heap->config->hugepgsz;
+	// The hugepage this address falls into, and the offset within that hugepage
+	return heap->dma_lut[offset >> shift] + (offset & (((size_t)1 << shift) - 1));
+}
+
+/**
+ * Resolve the I/O virtual address of a given virtual address
+ *
+ * The heap is mapped into the IOMMU domain as a single range, thus, the IOVA range of the heap is
+ * contiguous, also across hugepages, and the resolution is a plain offset from heap->iova_base.
+ *
+ * @param virt Pointer to memory previously allocated by hostmem_dma_malloc().
+ * @return The IOVA; only meaningful once the heap is mapped, e.g. by vfio_map_heap()
+ */
+static inline uint64_t
+hostmem_dma_v2iova(struct hostmem_heap *heap, void *virt)
+{
+	assert(heap->iova_refs);
+
+	return heap->iova_base + ((char *)virt - (char *)heap->memory.virt);
+}
+
+/**
+ * Resolve the physical addresses of the pages of [virt, virt + nbytes), e.g. for PRP entries
+ *
+ * The first entry is the physical address of `virt`, that is, including its offset within the
+ * page; the following entries are the page-aligned addresses of the remaining pages. The LUT is
+ * looked up once per hugepage, the entries within a hugepage are consecutive, thus, filled by a
+ * plain loop which the compiler can vectorize.
+ *
+ * @param virt Pointer to memory previously allocated by hostmem_dma_malloc().
+ * @param nbytes Number of bytes in the range
+ * @param addrs Array to store the physical addresses in
+ * @param max Number of entries available in `addrs`
+ *
+ * @return On success, the number of entries written to `addrs` is returned. When more than `max`
+ *         entries are needed, then -E2BIG is returned.
+ */
+static inline int
+hostmem_dma_v2p_batch(struct hostmem_heap *heap, void *virt, size_t nbytes, uint64_t *addrs,
+		      size_t max)
+{
+	const int pshift = heap->config->pagesize_shift;
+	const int hshift = heap->config->hugepgsz_shift;
+	const size_t pmask = ((size_t)1 << pshift) - 1;
+	const size_t hmask = ((size_t)1 << hshift) - 1;
+	size_t offset, npages, n = 0;
+
+	if (!nbytes) {
+		return 0;
+	}
+
+	offset = (char *)virt - (char *)heap->memory.virt;
+	npages = ((offset & pmask) + nbytes + pmask) >> pshift;
+	if (npages > max) {
+		return -E2BIG;
+	}
+
+	for (size_t cur = offset & ~pmask; n < npages;) {
+		const uint64_t base = heap->dma_lut[cur >> hshift] + (cur & hmask);
+		size_t run = ((hmask + 1) - (cur & hmask)) >> pshift;
+
+		if (run > npages - n) {
+			run = npages - n;
+		}
+		for (size_t i = 0; i < run; ++i) {
+			addrs[n + i] = base + ((uint64_t)i << pshift);
+		}
 
-	// Offset within that hugepage
-	in_hpage_offset = offset % heap->config->hugepgsz;
+		n += run;
+		cur += run << pshift;
+	}
+	addrs[0] += offset & pmask;
+
+	return n;
+}
+
+/**
+ * Same as hostmem_dma_v2p_batch(), for each of the `iovcnt` entries of `iov`, in order
+ *
+ * @return On success, the total number of entries written to `addrs` is returned. When more than
+ *         `max` entries are needed, then -E2BIG is returned.
+ */
+static inline int
+hostmem_dma_v2p_batch_iov(struct hostmem_heap *heap, struct iovec *iov, size_t iovcnt,
+			  uint64_t *addrs, size_t max)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < iovcnt; ++i) {
+		int ret = hostmem_dma_v2p_batch(heap, iov[i].iov_base, iov[i].iov_len, addrs + n,
+						max - n);
+		if (ret < 0) {
+			return ret;
+		}
+		n += ret;
+	}
 
-	return heap->phys_lut[hpage_idx] + in_hpage_offset;
+	return n;
 }
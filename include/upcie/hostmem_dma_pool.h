@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Pools of fixed-size DMA buffers with per-thread caches
+ * =======================================================
+ *
+ * Most I/O buffers come in a few fixed sizes, e.g. 4KB, 128KB, and 2MB. A
+ * 'struct hostmem_dma_pool' preallocates a number of objects of one size from a
+ * 'struct hostmem_heap', with the physical address of each object resolved upfront. Objects are
+ * handed out together with their physical address, thus, the PRP builders can be given the
+ * physical address directly, see nvme_request_prep_command_prps_phys(), without a call to
+ * hostmem_dma_v2p(). The addresses are resolved at initialization, thus, when the heap is to be
+ * mapped via VFIO, then initialize the pool after the heap is mapped.
+ *
+ * - hostmem_dma_pool_init() / hostmem_dma_pool_term()
+ * - hostmem_dma_pool_get() / hostmem_dma_pool_put()
+ * - hostmem_dma_pool_cache_init() / hostmem_dma_pool_cache_flush()
+ *
+ * The object size is rounded up to a power-of-two, of at least a page, and at most a hugepage,
+ * such that an object never crosses a hugepage boundary, and thus, is physically contiguous.
+ *
+ * The free objects are kept on a lock-free stack of object indices; get and put are O(1). To avoid
+ * contention on it, each thread can use its own 'struct hostmem_dma_pool_cache', a magazine of
+ * free objects, which is refilled from, and flushed to, the pool in batches of half a magazine.
+ * A cache must only be used by a single thread, and must be flushed before the pool is terminated.
+ *
+ * @file hostmem_dma_pool.h
+ * @version 0.4.4
+ */
+
+#define HOSTMEM_DMA_POOL_NONE UINT32_MAX
+#define HOSTMEM_DMA_POOL_MAGAZINE 64
+
+struct hostmem_dma_pool {
+	struct hostmem_heap *heap; ///< The heap that the objects are allocated from
+	char *virt;                ///< Base of the array of objects
+	uint64_t *phys;            ///< Physical address of each object
+	size_t objsize;            ///< Stride of the objects, a power-of-two
+	int objsize_shift;
+	uint32_t nobjs;
+
+	uint64_t head;  ///< Top of the free-stack: tag << 32 | index
+	uint32_t *next; ///< Links of the free-stack
+};
+
+/**
+ * A magazine of free objects, owned by a single thread
+ */
+struct hostmem_dma_pool_cache {
+	struct hostmem_dma_pool *pool;
+	uint32_t count;
+	uint32_t objs[HOSTMEM_DMA_POOL_MAGAZINE];
+};
+
+static inline int
+hostmem_dma_pool_pp(struct hostmem_dma_pool *pool)
+{
+	int wrtn = 0;
+
+	wrtn += printf("hostmem_dma_pool:");
+
+	if (!pool) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+
+	wrtn += printf("\n");
+	wrtn += printf("  objsize: %zu\n", pool->objsize);
+	wrtn += printf("  nobjs: %" PRIu32 "\n", pool->nobjs);
+	wrtn += printf("  virt: %p\n", (void *)pool->virt);
+
+	return wrtn;
+}
+
+static inline void
+hostmem_dma_pool_push(struct hostmem_dma_pool *pool, uint32_t idx)
+{
+	uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+	uint64_t desired;
+
+	do {
+		__atomic_store_n(&pool->next[idx], (uint32_t)head, __ATOMIC_RELAXED);
+		desired = ((head >> 32) + 1) << 32 | idx;
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, desired, 1, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/**
+ * Pop an object-index from the free-stack of the pool
+ *
+ * @return The index, or HOSTMEM_DMA_POOL_NONE when the pool is empty
+ */
+static inline uint32_t
+hostmem_dma_pool_pop(struct hostmem_dma_pool *pool)
+{
+	uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	uint64_t desired;
+	uint32_t idx;
+
+	do {
+		idx = (uint32_t)head;
+		if (idx == HOSTMEM_DMA_POOL_NONE) {
+			return HOSTMEM_DMA_POOL_NONE;
+		}
+		desired = ((head >> 32) + 1) << 32 |
+			  __atomic_load_n(&pool->next[idx], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, desired, 1, __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+
+	return idx;
+}
+
+static inline void
+hostmem_dma_pool_term(struct hostmem_dma_pool *pool)
+{
+	if (!pool) {
+		return;
+	}
+
+	hostmem_heap_block_free(pool->heap, pool->virt);
+	free(pool->phys);
+	free(pool->next);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Initialize a pool of 'nobjs' objects of at least 'objsize' bytes, allocated from 'heap'
+ *
+ * @param pool The pool to initialize
+ * @param heap The heap to allocate the objects from
+ * @param objsize Size of each object; rounded up to a power-of-two, of at least a page, and must
+ *                not exceed the hugepage size
+ * @param nobjs Number of objects
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+hostmem_dma_pool_init(struct hostmem_dma_pool *pool, struct hostmem_heap *heap, size_t objsize,
+		      uint32_t nobjs)
+{
+	int err;
+
+	memset(pool, 0, sizeof(*pool));
+
+	if (!heap || !objsize || !nobjs || nobjs == HOSTMEM_DMA_POOL_NONE ||
+	    objsize > (size_t)heap->config->hugepgsz) {
+		UPCIE_DEBUG("FAILED: invalid objsize(%zu) or nobjs(%" PRIu32 ")", objsize, nobjs);
+		return -EINVAL;
+	}
+
+	pool->heap = heap;
+	pool->nobjs = nobjs;
+	pool->objsize_shift = heap->config->pagesize_shift;
+	while (((size_t)1 << pool->objsize_shift) < objsize) {
+		pool->objsize_shift++;
+	}
+	pool->objsize = (size_t)1 << pool->objsize_shift;
+
+	pool->phys = calloc(nobjs, sizeof(*pool->phys));
+	pool->next = calloc(nobjs, sizeof(*pool->next));
+	if (!pool->phys || !pool->next) {
+		UPCIE_DEBUG("FAILED: calloc(); errno(%d)", errno);
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	// The objsize divides the hugepage size, thus, no object is split over hugepages
+	pool->virt = hostmem_heap_block_alloc_array(heap, nobjs, pool->objsize);
+	if (!pool->virt) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: hostmem_heap_block_alloc_array(); err(%d)", err);
+		goto fail;
+	}
+
+	for (uint32_t i = 0; i < nobjs; ++i) {
+		void *obj = pool->virt + ((size_t)i << pool->objsize_shift);
+
+		pool->phys[i] = hostmem_dma_v2p(heap, obj);
+		pool->next[i] = i + 1 < nobjs ? i + 1 : HOSTMEM_DMA_POOL_NONE;
+	}
+	pool->head = 0;
+
+	return 0;
+
+fail:
+	hostmem_dma_pool_term(pool);
+
+	return err;
+}
+
+static inline uint32_t
+hostmem_dma_pool_idx(struct hostmem_dma_pool *pool, void *virt)
+{
+	return ((char *)virt - pool->virt) >> pool->objsize_shift;
+}
+
+/**
+ * Initialize an empty cache for the calling thread
+ */
+static inline void
+hostmem_dma_pool_cache_init(struct hostmem_dma_pool_cache *cache, struct hostmem_dma_pool *pool)
+{
+	cache->pool = pool;
+	cache->count = 0;
+}
+
+/**
+ * Return all objects in the cache to the pool
+ */
+static inline void
+hostmem_dma_pool_cache_flush(struct hostmem_dma_pool_cache *cache)
+{
+	while (cache->count) {
+		hostmem_dma_pool_push(cache->pool, cache->objs[--cache->count]);
+	}
+}
+
+/**
+ * Get an object from the pool, via the given cache, when not NULL
+ *
+ * @param pool The pool
+ * @param cache A cache of the calling thread, or NULL to get directly from the pool
+ * @param phys Pointer to store the physical address of the object; may be NULL
+ *
+ * @return On success, a pointer to the object is returned. When the pool is exhausted, NULL is
+ *         returned and errno set to ENOMEM.
+ */
+static inline void *
+hostmem_dma_pool_get(struct hostmem_dma_pool *pool, struct hostmem_dma_pool_cache *cache,
+		     uint64_t *phys)
+{
+	uint32_t idx;
+
+	if (cache) {
+		if (!cache->count) {
+			while (cache->count < HOSTMEM_DMA_POOL_MAGAZINE / 2) {
+				idx = hostmem_dma_pool_pop(pool);
+				if (idx == HOSTMEM_DMA_POOL_NONE) {
+					break;
+				}
+				cache->objs[cache->count++] = idx;
+			}
+		}
+		idx = cache->count ? cache->objs[--cache->count] : HOSTMEM_DMA_POOL_NONE;
+	} else {
+		idx = hostmem_dma_pool_pop(pool);
+	}
+
+	if (idx == HOSTMEM_DMA_POOL_NONE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (phys) {
+		*phys = pool->phys[idx];
+	}
+
+	return pool->virt + ((size_t)idx << pool->objsize_shift);
+}
+
+/**
+ * Return an object to the pool, via the given cache, when not NULL
+ *
+ * If `virt` is NULL, no operation is performed.
+ */
+static inline void
+hostmem_dma_pool_put(struct hostmem_dma_pool *pool, struct hostmem_dma_pool_cache *cache,
+		     void *virt)
+{
+	if (!virt) {
+		return;
+	}
+
+	if (!cache) {
+		hostmem_dma_pool_push(pool, hostmem_dma_pool_idx(pool, virt));
+		return;
+	}
+
+	if (cache->count == HOSTMEM_DMA_POOL_MAGAZINE) {
+		while (cache->count > HOSTMEM_DMA_POOL_MAGAZINE / 2) {
+			hostmem_dma_pool_push(pool, cache->objs[--cache->count]);
+		}
+	}
+	cache->objs[cache->count++] = hostmem_dma_pool_idx(pool, virt);
+}
+
+/**
+ * Returns the physical address of the given object, or of an address within it
+ */
+static inline uint64_t
+hostmem_dma_pool_v2p(struct hostmem_dma_pool *pool, void *virt)
+{
+	size_t offset = (char *)virt - pool->virt;
+
+	return pool->phys[offset >> pool->objsize_shift] + (offset & (pool->objsize - 1));
+}
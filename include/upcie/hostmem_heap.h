@@ -5,9 +5,55 @@
  * Heap-based memory allocator backed by hugepages for DMA in user-space drivers
  * =============================================================================
  *
- * - hostmem_heap_init() / hostmem_heap_term()
+ * - hostmem_heap_init() / hostmem_heap_import() / hostmem_heap_term()
+ * - hostmem_heap_init_growable() / hostmem_heap_shrink()
  * - hostmem_heap_block_alloc() / hostmem_heap_block_alloc_aligned() / hostmem_heap_block_free()
  * - hostmem_heap_block_virt_to_phys()
+ * - hostmem_heap_registry_init() / hostmem_heap_registry_get() / hostmem_heap_registry_term()
+ *
+ * Allocation is done by a buddy allocator, with blocks of 64 bytes up to a hugepage, or up to 2MB
+ * on systems with larger hugepages, and a scan for runs of such chunks beyond that. The blocks
+ * handed out have no header, the order of each block is kept in a table with one byte per 64
+ * bytes of heap. Allocation and free are O(log n), and a block never crosses a hugepage boundary.
+ *
+ * Self-describing heap
+ * --------------------
+ *
+ * The heap is described by itself, that is, the start of the hugepage memory holds a
+ * 'struct hostmem_heap_desc', followed by the table of block orders, and by phys_lut[]; the free
+ * lists are linked by offsets into the memory. Thus, another process can attach to the heap, with
+ * hostmem_heap_import(), and allocate from it, and resolve physical addresses, without walking
+ * /proc/self/pagemap. The allocator state is protected by a spinlock, in the descriptor, shared
+ * by all the processes using the heap.
+ *
+ * Caveat: trust boundary
+ * ----------------------
+ *
+ * The free lists, the block-orders, and the spinlock are in the shared memory, and written by
+ * every process allocating from the heap, thus, the descriptor cannot be mapped read-only for an
+ * importer; any process permitted to open the heap can corrupt the allocator state, or hold the
+ * lock, and is trusted not to. What is guarded against is that such corruption reaches outside
+ * of the heap: the layout of the descriptor is validated on import, and kept in
+ * 'struct hostmem_heap', the offsets of the free lists, and the orders and run-lengths of blocks,
+ * are bounds-checked before use, such that a corrupt heap fails allocations, and leaks blocks,
+ * instead of making a process write outside of its mapping. Restrict who may open the heap via
+ * the permissions of its file, see hostmem_heap_import().
+ *
+ * Growable heap
+ * -------------
+ *
+ * A heap initialized with hostmem_heap_init() commits all of its hugepages upfront. A heap
+ * initialized with hostmem_heap_init_growable() reserves the file, and va-space, for a maximum
+ * size, and commits hugepages in extents: the first at initialization, and another one each time
+ * an allocation finds no free block. The extents are adjacent in the va-space, thus, offsets and
+ * the buddy allocator work as for any other heap; each extent fills in its part of phys_lut[].
+ * Extents which are entirely free can be released with hostmem_heap_shrink(). Growing is done
+ * with the heap locked, thus, other threads allocating from the heap wait for it. Only the
+ * process which initialized the heap grows, and shrinks, it; importers allocate from the extents
+ * committed.
+ *
+ * A callback, heap->extent_cb, is invoked on commit, and release, of an extent; this is how
+ * vfio_map_heap() keeps the IOMMU mappings in sync with the extents.
  *
  * Caveat: system setup
  * --------------------
@@ -24,43 +70,134 @@
  * Caveat: CAP_SYS_ADMIN
  * ---------------------
  *
- * Reading /proc/self/pagemap requires CAP_SYS_ADMIN, so hostmem_virt_to_phys() cannot be used by
- * non-privileged users. Therefore, any process needing DMA via this allocator must run as root.
- *
- * Possible Workaround: Since the allocator uses MAP_SHARED, a privileged "allocator-daemon" could
- * handle virt_to_phys translations and share the results via shared memory with unprivileged
- * clients. This allows integration into the heap with minimal complexity. Example:
- *
- * After heap initialization, write the heap structure into hugepage memory. Because phys_lut[]
- * resolves all physical addresses of the backing hugepages, any process that imports the hugepage
- * also gains access to those physical addresses—without needing CAP_SYS_ADMIN.
+ * Reading /proc/self/pagemap requires CAP_SYS_ADMIN, so hostmem_heap_init() must run as root.
+ * However, phys_lut[] is stored in the heap itself, thus, a privileged process can set up the
+ * heap, and non-privileged processes can attach to it with hostmem_heap_import(), and gain access
+ * to the physical addresses, without needing CAP_SYS_ADMIN.
  *
  * @file hostmem.h
  * @version 0.4.4
  */
 
+#define HOSTMEM_HEAP_ORDER_MIN 6  ///< Smallest block is 64 bytes, that is, a cache-line
+#define HOSTMEM_HEAP_ORDER_MAX 21 ///< Largest buddy block is 2MB, or the hugepage when smaller
+#define HOSTMEM_HEAP_NORDERS (HOSTMEM_HEAP_ORDER_MAX + 1)
+#define HOSTMEM_HEAP_ORDER_FREE 0x80 ///< Flag in hostmem_heap->orders[] of a free block
+#define HOSTMEM_HEAP_NONE UINT64_MAX ///< End of a free list
+#define HOSTMEM_HEAP_MAGIC 0x3170616568696370ULL ///< "pciheap1"
+#define HOSTMEM_HEAP_EXTENTS_MAX 64 ///< Maximum number of extents of a growable heap
+
 /**
- * Representation of a memory-allocation as produced by
- * hostmem_buffer_alloc(...)
+ * A free block in the heap; free blocks of the same order are linked, the links are stored in
+ * the free memory itself, as offsets from the start of the heap
  */
 struct hostmem_heap_block {
-	size_t size;
-	int free;
-	struct hostmem_heap_block *next;
+	uint64_t next;
+	uint64_t prev;
+};
+
+/**
+ * The description of the heap stored at the start of the heap memory; all references are byte
+ * offsets from the start of the heap memory, thus, valid in any process mapping the heap
+ */
+struct hostmem_heap_desc {
+	uint64_t magic;    ///< HOSTMEM_HEAP_MAGIC, set once the heap is initialized
+	uint64_t size;     ///< Size of the heap memory
+	uint64_t nchunks;  ///< Number of chunks in the heap memory
+	uint64_t nphys;    ///< Number of hugepages backing the heap memory
+	uint32_t hugepgsz; ///< Size of the hugepages backing the heap memory
+	uint32_t chunk_shift;
+	uint64_t orders;   ///< Offset of the block-orders; one byte per 64-byte unit
+	uint64_t runs;     ///< Offset of the run-lengths; one uint32_t per chunk
+	uint64_t phys_lut; ///< Offset of the physical addresses; one uint64_t per hugepage
+	uint64_t freelists[HOSTMEM_HEAP_NORDERS]; ///< Offset of the first free block, by order
+	uint64_t extent_size;  ///< Size of the extents of a growable heap; zero when not growable
+	uint64_t extents_base; ///< Offset of the first extent
+	uint64_t extents;      ///< Bitmap of the committed extents
+	uint32_t nextents;     ///< Number of extents that 'size' has room for
+	uint32_t lock;         ///< Spinlock protecting the allocator state
 };
 
+struct hostmem_heap;
+
+/**
+ * Invoked, with the heap locked, when an extent of a growable heap is committed, or released
+ *
+ * @return On commit, a non-zero value fails the commit; on release, it keeps the extent
+ */
+typedef int (*hostmem_heap_extent_cb)(struct hostmem_heap *heap, uint64_t offset, uint64_t size,
+				      int commit, void *arg);
+
 /**
  * A pre-allocated heap providing memory for a buffer-allocator
+ *
+ * The memory is split into chunks of '1 << chunk_shift' bytes, managed by a buddy allocator down
+ * to blocks of '1 << HOSTMEM_HEAP_ORDER_MIN' bytes. Allocations larger than a chunk are served by
+ * a run of consecutive chunks. The pointers below all point into the heap memory itself.
  */
 struct hostmem_heap {
 	struct hostmem_hugepage memory; ///< A hugepage-allocation; can span multiple hugepages
-	struct hostmem_heap_block
-		*freelist;             ///< Pointers to description of free memory in the heap
+	struct hostmem_heap_desc *desc; ///< Description of the heap; at the start of 'memory'
+	uint8_t *orders; ///< Per 64-byte unit: order of the block starting there, zero if none
+	uint32_t *runs;  ///< Per chunk: number of chunks allocated starting there, zero if none
+	size_t nchunks;  ///< Number of chunks in 'memory'
+	int chunk_shift; ///< A chunk is the smaller of a hugepage and 1 << HOSTMEM_HEAP_ORDER_MAX
 	struct hostmem_config *config; ///< Pointer to hugepage configuration
 	size_t nphys;                  ///< Number of hugepages backing 'memory'
 	uint64_t *phys_lut; ///< An array of physical addresses; on for each hugepage in 'memory'
+	hostmem_heap_extent_cb extent_cb; ///< Invoked on commit and release of extents; may be NULL
+	void *extent_cb_arg;              ///< Opaque pointer passed on to 'extent_cb'
+	uint64_t *dma_lut;  ///< Bus address of each hugepage; phys_lut, or iova_lut when mapped
+	uint64_t *iova_lut; ///< IOVA of each hugepage; allocated by the process mapping it via VFIO
+	uint64_t iova_base; ///< IOVA of 'memory', mapped as a single range; zero when not mapped
+	int iova_refs;      ///< Number of VFIO containers which 'memory' is mapped into
+	int imported;       ///< Whether the heap was attached to by hostmem_heap_import()
 };
 
+static inline struct hostmem_heap_block *
+hostmem_heap_block_at(struct hostmem_heap *heap, uint64_t offset)
+{
+	return (struct hostmem_heap_block *)((char *)heap->memory.virt + offset);
+}
+
+/**
+ * Returns the free-list link `offset`, read from the shared memory, when it is a block of the
+ * heap, past the tables, or HOSTMEM_HEAP_NONE when it is not; see "Caveat: trust boundary"
+ */
+static inline uint64_t
+hostmem_heap_link(struct hostmem_heap *heap, uint64_t offset)
+{
+	const uint64_t tables = (uint64_t)(heap->orders - (uint8_t *)heap->memory.virt) +
+				(heap->memory.size >> HOSTMEM_HEAP_ORDER_MIN);
+
+	if (offset == HOSTMEM_HEAP_NONE) {
+		return offset;
+	}
+	if (offset < tables || offset >= heap->memory.size ||
+	    offset & (((uint64_t)1 << HOSTMEM_HEAP_ORDER_MIN) - 1)) {
+		UPCIE_DEBUG("FAILED: free-list link(0x%" PRIx64 ") is not within the heap", offset);
+		return HOSTMEM_HEAP_NONE;
+	}
+
+	return offset;
+}
+
+static inline void
+hostmem_heap_lock(struct hostmem_heap *heap)
+{
+	while (__atomic_exchange_n(&heap->desc->lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&heap->desc->lock, __ATOMIC_RELAXED)) {
+			cpu_relax();
+		}
+	}
+}
+
+static inline void
+hostmem_heap_unlock(struct hostmem_heap *heap)
+{
+	__atomic_store_n(&heap->desc->lock, 0, __ATOMIC_RELEASE);
+}
+
 static inline int
 hostmem_heap_pp(struct hostmem_heap *heap)
 {
@@ -75,15 +212,42 @@ hostmem_heap_pp(struct hostmem_heap *heap)
 
 	wrtn += printf("\n");
 
+	wrtn += printf("  imported: %d\n", heap->imported);
 	wrtn += printf("  nphys: '%zu'\n", heap->nphys);
 	wrtn += printf("  phys:\n");
 	for (size_t i = 0; i < heap->nphys; ++i) {
 		wrtn += printf("  - 0x%" PRIx64 "\n", heap->phys_lut[i]);
 	}
 
-	wrtn += printf("  freelist:\n");
-	for (struct hostmem_heap_block *block = heap->freelist; block; block = block->next) {
-		wrtn += printf("  - {size: %zu, free: %d}\n", block->size, block->free);
+	wrtn += printf("  nchunks: %zu\n", heap->nchunks);
+	if (heap->desc && heap->desc->extent_size) {
+		wrtn += printf("  extent_size: %" PRIu64 "\n", heap->desc->extent_size);
+		wrtn += printf("  extents: 0x%" PRIx64 "\n", heap->desc->extents);
+	}
+	wrtn += printf("  chunk_shift: %d\n", heap->chunk_shift);
+	wrtn += printf("  freelists:\n");
+	if (heap->desc) {
+		hostmem_heap_lock(heap);
+	}
+	for (int order = HOSTMEM_HEAP_ORDER_MIN; order <= heap->chunk_shift; ++order) {
+		const size_t nmax = heap->memory.size >> order; ///< Bounds a corrupt list
+		size_t nfree = 0;
+
+		if (!heap->desc) {
+			break;
+		}
+
+		for (uint64_t ofz = hostmem_heap_link(heap, heap->desc->freelists[order]);
+		     ofz != HOSTMEM_HEAP_NONE && nfree < nmax;
+		     ofz = hostmem_heap_link(heap, hostmem_heap_block_at(heap, ofz)->next)) {
+			nfree += 1;
+		}
+		if (nfree) {
+			wrtn += printf("  - {size: %zu, nfree: %zu}\n", (size_t)1 << order, nfree);
+		}
+	}
+	if (heap->desc) {
+		hostmem_heap_unlock(heap);
 	}
 
 	wrtn += hostmem_hugepage_pp(&heap->memory);
@@ -91,6 +255,151 @@ hostmem_heap_pp(struct hostmem_heap *heap)
 	return wrtn;
 }
 
+static inline void
+hostmem_heap_list_push(struct hostmem_heap *heap, uint64_t offset, int order)
+{
+	struct hostmem_heap_block *block = hostmem_heap_block_at(heap, offset);
+	uint64_t *head = &heap->desc->freelists[order];
+
+	block->prev = HOSTMEM_HEAP_NONE;
+	block->next = hostmem_heap_link(heap, *head);
+	if (block->next != HOSTMEM_HEAP_NONE) {
+		hostmem_heap_block_at(heap, block->next)->prev = offset;
+	}
+	*head = offset;
+
+	heap->orders[offset >> HOSTMEM_HEAP_ORDER_MIN] = HOSTMEM_HEAP_ORDER_FREE | order;
+}
+
+static inline void
+hostmem_heap_list_remove(struct hostmem_heap *heap, uint64_t offset, int order)
+{
+	struct hostmem_heap_block *block = hostmem_heap_block_at(heap, offset);
+	uint64_t next = hostmem_heap_link(heap, block->next);
+	uint64_t prev = hostmem_heap_link(heap, block->prev);
+
+	if (prev != HOSTMEM_HEAP_NONE) {
+		hostmem_heap_block_at(heap, prev)->next = next;
+	} else {
+		heap->desc->freelists[order] = next;
+	}
+	if (next != HOSTMEM_HEAP_NONE) {
+		hostmem_heap_block_at(heap, next)->prev = prev;
+	}
+
+	heap->orders[offset >> HOSTMEM_HEAP_ORDER_MIN] = 0;
+}
+
+/**
+ * Allocate a block of '1 << order' bytes, with order <= chunk_shift, in O(log n)
+ *
+ * Takes a block from the smallest non-empty order, splitting it, keeping the upper halves free.
+ *
+ * @return The offset of the block, or HOSTMEM_HEAP_NONE when there is no free block to split
+ */
+static inline uint64_t
+hostmem_heap_buddy_alloc(struct hostmem_heap *heap, int order)
+{
+	uint64_t offset = HOSTMEM_HEAP_NONE;
+	int cur = order;
+
+	while (cur <= heap->chunk_shift) {
+		offset = hostmem_heap_link(heap, heap->desc->freelists[cur]);
+		if (offset != HOSTMEM_HEAP_NONE) {
+			break;
+		}
+		cur++;
+	}
+	if (cur > heap->chunk_shift) {
+		return HOSTMEM_HEAP_NONE;
+	}
+
+	hostmem_heap_list_remove(heap, offset, cur);
+
+	while (cur > order) {
+		cur--;
+		hostmem_heap_list_push(heap, offset + ((uint64_t)1 << cur), cur);
+	}
+
+	heap->orders[offset >> HOSTMEM_HEAP_ORDER_MIN] = order;
+	if (order == heap->chunk_shift) {
+		heap->runs[offset >> heap->chunk_shift] = 1;
+	}
+
+	return offset;
+}
+
+/**
+ * Allocate a run of 'count' consecutive chunks, starting at a multiple of 'stride' chunks
+ *
+ * When the run fits within a hugepage, then it is not allowed to cross a hugepage boundary;
+ * 'stride' is expected to be a multiple of chunks-per-hugepage otherwise. This is a linear scan of
+ * the chunks; only used for allocations larger than a chunk.
+ *
+ * @return The offset of the run, or HOSTMEM_HEAP_NONE when no such run is free
+ */
+static inline uint64_t
+hostmem_heap_run_alloc(struct hostmem_heap *heap, size_t count, size_t stride)
+{
+	size_t chunks_per_hpage = (size_t)heap->config->hugepgsz >> heap->chunk_shift;
+	size_t start = 0;
+
+	// The chunks up to the end of the highest committed extent, when the heap is growable
+	while (start + count <= heap->desc->nchunks && start + count <= heap->nchunks) {
+		size_t nfree = 0;
+
+		if (count <= chunks_per_hpage &&
+		    (start % chunks_per_hpage) + count > chunks_per_hpage) {
+			start = (start / chunks_per_hpage + 1) * chunks_per_hpage;
+			start = (start + stride - 1) / stride * stride;
+			continue;
+		}
+
+		while (nfree < count) {
+			uint64_t chunk = (uint64_t)(start + nfree) << heap->chunk_shift;
+
+			if (heap->orders[chunk >> HOSTMEM_HEAP_ORDER_MIN] !=
+			    (HOSTMEM_HEAP_ORDER_FREE | heap->chunk_shift)) {
+				break;
+			}
+			nfree++;
+		}
+		if (nfree == count) {
+			uint64_t run = (uint64_t)start << heap->chunk_shift;
+
+			for (size_t i = 0; i < count; ++i) {
+				hostmem_heap_list_remove(heap, run + (i << heap->chunk_shift),
+							 heap->chunk_shift);
+			}
+			heap->orders[run >> HOSTMEM_HEAP_ORDER_MIN] = heap->chunk_shift;
+			heap->runs[start] = count;
+
+			return run;
+		}
+
+		// Skip past the chunk in use
+		start = (start + nfree + 1 + stride - 1) / stride * stride;
+	}
+
+	return HOSTMEM_HEAP_NONE;
+}
+
+/**
+ * Setup the pointers of the heap, from the descriptor at the start of heap->memory
+ */
+static inline void
+hostmem_heap_attach(struct hostmem_heap *heap)
+{
+	heap->desc = heap->memory.virt;
+	heap->orders = (uint8_t *)heap->memory.virt + heap->desc->orders;
+	heap->runs = (uint32_t *)((char *)heap->memory.virt + heap->desc->runs);
+	heap->phys_lut = (uint64_t *)((char *)heap->memory.virt + heap->desc->phys_lut);
+	heap->dma_lut = heap->phys_lut;
+	heap->nchunks = heap->desc->size >> heap->desc->chunk_shift;
+	heap->chunk_shift = heap->desc->chunk_shift;
+	heap->nphys = heap->desc->nphys;
+}
+
 static inline void
 hostmem_heap_term(struct hostmem_heap *heap)
 {
@@ -98,19 +407,212 @@ hostmem_heap_term(struct hostmem_heap *heap)
 		return;
 	}
 
-	free(heap->phys_lut);
-	hostmem_hugepage_free(&heap->memory);
+	if (heap->imported) {
+		// The hugepage belongs to the process which initialized the heap; do not unlink it
+		if (heap->memory.virt && heap->memory.size) {
+			munmap(heap->memory.virt, heap->memory.size);
+		}
+		if (heap->memory.fd >= 0) {
+			close(heap->memory.fd);
+		}
+		memset(&heap->memory, 0, sizeof(heap->memory));
+	} else {
+		hostmem_hugepage_free(&heap->memory);
+	}
+
+	heap->desc = NULL;
+	heap->orders = NULL;
+	heap->runs = NULL;
+	heap->phys_lut = NULL;
+	heap->dma_lut = NULL;
+	free(heap->iova_lut);
+	heap->iova_lut = NULL;
+	heap->iova_base = 0;
+	heap->iova_refs = 0;
+}
+
+/**
+ * Returns the chunk_shift for the hugepage size of the given config, or -EINVAL when too small
+ */
+static inline int
+hostmem_heap_chunk_shift(struct hostmem_config *config)
+{
+	int chunk_shift = HOSTMEM_HEAP_ORDER_MAX;
+
+	while (((size_t)1 << chunk_shift) > (size_t)config->hugepgsz) {
+		chunk_shift--;
+	}
+	if (chunk_shift < HOSTMEM_HEAP_ORDER_MIN) {
+		UPCIE_DEBUG("FAILED: hugepgsz(%d) too small", config->hugepgsz);
+		return -EINVAL;
+	}
+
+	return chunk_shift;
+}
+
+/**
+ * Setup the descriptor for a heap of 'size' bytes, and the offsets of its tables
+ *
+ * @return The offset of the end of the tables, 64-byte aligned
+ */
+static inline uint64_t
+hostmem_heap_desc_layout(struct hostmem_heap_desc *desc, uint64_t size, int chunk_shift,
+			 uint32_t hugepgsz)
+{
+	const uint64_t umask = ((uint64_t)1 << HOSTMEM_HEAP_ORDER_MIN) - 1;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->size = size;
+	desc->nchunks = size >> chunk_shift;
+	desc->nphys = size / hugepgsz;
+	desc->hugepgsz = hugepgsz;
+	desc->chunk_shift = chunk_shift;
+
+	desc->phys_lut = (sizeof(*desc) + 7) & ~7ULL;
+	desc->runs = desc->phys_lut + desc->nphys * sizeof(uint64_t);
+	desc->orders = desc->runs + desc->nchunks * sizeof(uint32_t);
+
+	return (desc->orders + (size >> HOSTMEM_HEAP_ORDER_MIN) + umask) & ~umask;
+}
+
+/**
+ * Setup the descriptor, the tables, and the buddy allocator over heap->memory
+ *
+ * The descriptor and the tables are at the start of the memory, the remainder is made free, as
+ * the largest naturally aligned blocks that it can be split into.
+ */
+static inline int
+hostmem_heap_arena_init(struct hostmem_heap *heap)
+{
+	struct hostmem_heap_desc *desc = heap->memory.virt;
+	uint64_t offset, end;
+	int chunk_shift;
+
+	chunk_shift = hostmem_heap_chunk_shift(heap->config);
+	if (chunk_shift < 0) {
+		return chunk_shift;
+	}
+
+	end = hostmem_heap_desc_layout(desc, heap->memory.size, chunk_shift,
+				       heap->config->hugepgsz);
+	if (end >= heap->memory.size) {
+		UPCIE_DEBUG("FAILED: size(%zu) too small for the description", heap->memory.size);
+		return -EINVAL;
+	}
+	for (int order = 0; order < HOSTMEM_HEAP_NORDERS; ++order) {
+		desc->freelists[order] = HOSTMEM_HEAP_NONE;
+	}
+
+	hostmem_heap_attach(heap);
+	memset(heap->runs, 0, desc->nchunks * sizeof(uint32_t));
+	memset(heap->orders, 0, heap->memory.size >> HOSTMEM_HEAP_ORDER_MIN);
+
+	// Free the remainder, lowest addresses at the head of the free lists
+	offset = heap->memory.size;
+	while (offset > end) {
+		int order = HOSTMEM_HEAP_ORDER_MIN;
+
+		while (order < chunk_shift && !(offset & ((uint64_t)1 << order)) &&
+		       offset - ((uint64_t)2 << order) >= end) {
+			order++;
+		}
+		offset -= (uint64_t)1 << order;
+		hostmem_heap_list_push(heap, offset, order);
+	}
+
+	return 0;
+}
+
+/**
+ * Setup the LUT of the hugepages of [offset, offset + size), via /proc/self/pagemap
+ */
+static inline int
+hostmem_heap_lut_fill(struct hostmem_heap *heap, uint64_t offset, uint64_t size)
+{
+	const int shift = heap->config->hugepgsz_shift;
+	const uint64_t first = offset >> shift;
+	const uint64_t end = (offset + size + ((uint64_t)1 << shift) - 1) >> shift;
+	int err;
+
+	err = hostmem_pagemap_virt_to_phys_range((char *)heap->memory.virt + (first << shift),
+						 end - first, (size_t)1 << shift,
+						 &heap->phys_lut[first]);
+	if (err) {
+		UPCIE_DEBUG("FAILED: hostmem_pagemap_virt_to_phys_range(); err(%d)", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Commit the lowest extent not committed, and free its chunks; with the heap locked
+ *
+ * @return On success 0 is returned. When the heap is not growable, has no extents left, or the
+ *         hugepages are not available, then negative errno is returned.
+ */
+static inline int
+hostmem_heap_grow(struct hostmem_heap *heap)
+{
+	struct hostmem_heap_desc *desc = heap->desc;
+	const uint64_t size = desc->extent_size;
+	uint64_t offset;
+	uint32_t k = 0;
+	int err;
+
+	if (!size || heap->imported) {
+		return -ENOMEM;
+	}
+
+	while (k < desc->nextents && desc->extents & ((uint64_t)1 << k)) {
+		k++;
+	}
+	if (k == desc->nextents) {
+		return -ENOMEM;
+	}
+	offset = desc->extents_base + k * size;
+
+	// The block-orders of the extent, and the extent itself
+	err = hostmem_hugepage_commit(&heap->memory,
+				      desc->orders + (offset >> HOSTMEM_HEAP_ORDER_MIN),
+				      size >> HOSTMEM_HEAP_ORDER_MIN);
+	if (!err) {
+		err = hostmem_hugepage_commit(&heap->memory, offset, size);
+	}
+	if (!err) {
+		err = hostmem_heap_lut_fill(heap, offset, size);
+	}
+	if (!err && heap->extent_cb) {
+		err = heap->extent_cb(heap, offset, size, 1, heap->extent_cb_arg);
+	}
+	if (err) {
+		UPCIE_DEBUG("FAILED: commit of extent(%" PRIu32 "); err(%d)", k, err);
+		hostmem_hugepage_decommit(&heap->memory, offset, size);
+		return err;
+	}
+
+	// Lowest addresses at the head of the free list
+	for (uint64_t chunk = offset + size; chunk > offset;) {
+		chunk -= (uint64_t)1 << heap->chunk_shift;
+		hostmem_heap_list_push(heap, chunk, heap->chunk_shift);
+	}
+	desc->extents |= (uint64_t)1 << k;
+	if ((offset + size) >> heap->chunk_shift > desc->nchunks) {
+		desc->nchunks = (offset + size) >> heap->chunk_shift;
+	}
+
+	return 0;
 }
 
 /**
  * Initialize the given heap
  *
  * - Pre-allocate a va-space of 'size' bytes backend by hugepage(s)
+ * - Setup the heap-description and the buddy allocator at the start of the va-space
  * - Setup the LUT / physical address for hugepage backing the va-space
  *
- * TODO: use the hugepage memory for the heap-description! By doing so, then a helper process can
- *       do all the hugepage lookup-work, and then anybody who imports it, will be able to, as a
- *       non-privileged user to know of the virt-to-phys mapping
+ * The description of the heap, including the LUT, is stored in the hugepage memory itself, thus,
+ * other processes can attach to it using hostmem_heap_import() with heap->memory.path.
  */
 static inline int
 hostmem_heap_init(struct hostmem_heap *heap, size_t size, struct hostmem_config *config)
@@ -129,63 +631,366 @@ hostmem_heap_init(struct hostmem_heap *heap, size_t size, struct hostmem_config
 		return err;
 	}
 
-	// Initialize a single free block spanning the entire heap
-	heap->freelist = (struct hostmem_heap_block *)heap->memory.virt;
-	heap->freelist->size = size;
-	heap->freelist->free = 1;
-	heap->freelist->next = NULL;
+	err = hostmem_heap_arena_init(heap);
+	if (err) {
+		hostmem_heap_term(heap);
+		return err;
+	}
+
+	err = hostmem_heap_lut_fill(heap, 0, heap->memory.size);
+	if (err) {
+		hostmem_heap_term(heap);
+		return err;
+	}
 
-	// Setup the LUT
-	heap->nphys = size / heap->config->hugepgsz;
-	heap->phys_lut = calloc(heap->nphys, sizeof(uint64_t));
+	if (heap->memory.phys != heap->phys_lut[0]) {
+		hostmem_heap_term(heap);
+		return -ENOMEM;
+	}
 
-	for (size_t i = 0; i < heap->nphys; ++i) {
-		void *vaddr = (char *)heap->memory.virt + i * heap->config->hugepgsz;
+	// Publish the heap to importers
+	__atomic_store_n(&heap->desc->magic, HOSTMEM_HEAP_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
 
-		err = hostmem_pagemap_virt_to_phys(vaddr, &heap->phys_lut[i]);
-		if (err) {
-			hostmem_heap_term(heap);
-			return err;
+/**
+ * Initialize a heap which grows in extents of 'extent_size' bytes, up to 'max_size' bytes
+ *
+ * The file and va-space are reserved for the description of the heap, sized for 'max_size', and
+ * for the extents; only the hugepages of the first extent, and of the parts of the description in
+ * use, are committed. Further extents are committed when an allocation finds no free block.
+ *
+ * @param heap The heap to initialize
+ * @param extent_size Size of each extent; a multiple of the hugepage size
+ * @param max_size Maximum size of the heap, excluding its description; a multiple of
+ *                 'extent_size', and at most HOSTMEM_HEAP_EXTENTS_MAX extents
+ * @param config The hugepage configuration
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+hostmem_heap_init_growable(struct hostmem_heap *heap, size_t extent_size, size_t max_size,
+			   struct hostmem_config *config)
+{
+	const uint64_t hmask = (uint64_t)config->hugepgsz - 1;
+	struct hostmem_heap_desc layout;
+	uint64_t base = 0, end, meta;
+	int chunk_shift, err;
+
+	if (!heap || !config) {
+		return -EINVAL;
+	}
+
+	memset(heap, 0, sizeof(*heap));
+	heap->config = config;
+
+	if (!extent_size || extent_size & hmask || max_size % extent_size ||
+	    max_size / extent_size > HOSTMEM_HEAP_EXTENTS_MAX) {
+		UPCIE_DEBUG("FAILED: invalid extent_size(%zu) or max_size(%zu)", extent_size,
+			    max_size);
+		return -EINVAL;
+	}
+
+	chunk_shift = hostmem_heap_chunk_shift(config);
+	if (chunk_shift < 0) {
+		return chunk_shift;
+	}
+
+	// The extents follow the description, which is sized for the description and the extents
+	for (;;) {
+		end = hostmem_heap_desc_layout(&layout, base + max_size, chunk_shift,
+					       config->hugepgsz);
+		end = (end + hmask) & ~hmask;
+		if (end <= base) {
+			break;
 		}
+		base = end;
 	}
 
-	if (heap->memory.phys != heap->phys_lut[0]) {
+	err = hostmem_hugepage_reserve(layout.size, &heap->memory, config);
+	if (err) {
+		UPCIE_DEBUG("FAILED: hostmem_hugepage_reserve(); err(%d)", err);
+		return err;
+	}
+
+	// The descriptor, the LUT, the run-lengths, and the block-orders of the description itself
+	meta = layout.orders + (base >> HOSTMEM_HEAP_ORDER_MIN);
+	err = hostmem_hugepage_commit(&heap->memory, 0, meta);
+	if (err) {
 		hostmem_heap_term(heap);
-		return -ENOMEM;
+		return err;
+	}
+
+	memcpy(heap->memory.virt, &layout, sizeof(layout));
+	hostmem_heap_attach(heap);
+	for (int order = 0; order < HOSTMEM_HEAP_NORDERS; ++order) {
+		heap->desc->freelists[order] = HOSTMEM_HEAP_NONE;
+	}
+
+	heap->desc->nchunks = base >> chunk_shift;
+	heap->desc->extent_size = extent_size;
+	heap->desc->extents_base = base;
+	heap->desc->nextents = max_size / extent_size;
+
+	err = hostmem_heap_lut_fill(heap, 0, meta);
+	if (!err) {
+		err = hostmem_heap_grow(heap);
+	}
+	if (err) {
+		hostmem_heap_term(heap);
+		return err;
 	}
+	heap->memory.phys = heap->phys_lut[0];
+
+	// Publish the heap to importers
+	__atomic_store_n(&heap->desc->magic, HOSTMEM_HEAP_MAGIC, __ATOMIC_RELEASE);
 
 	return 0;
 }
 
+/**
+ * Attach to a heap initialized, by another process, with hostmem_heap_init()
+ *
+ * The hugepage memory is mapped, and the description of the heap, including the physical
+ * addresses, is read from the memory itself; /proc/self/pagemap is not consulted, thus, this does
+ * not require CAP_SYS_ADMIN. The memory may be mapped at a different virtual address than in the
+ * other process. The heap is released with hostmem_heap_term(), which leaves the hugepage itself
+ * to the process which initialized it.
+ *
+ * The importing process must be permitted to open `path`; for a non-privileged importer, this
+ * means a hugetlbfs file with suitable permissions, as /proc/<pid>/fd/ of a memfd is not
+ * accessible to other users.
+ *
+ * The layout of the descriptor is validated against the one recomputed from the size of the file,
+ * and the hugepage size; a heap holding another layout is rejected with -EINVAL. Every process
+ * which can open `path` shares the allocator state, see "Caveat: trust boundary".
+ *
+ * @param heap The heap to initialize
+ * @param path Path to the memfd or hugetlbfs file, heap->memory.path of the initializing process
+ * @param config The hugepage configuration; must have the same hugepage size as the initializer
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+hostmem_heap_import(struct hostmem_heap *heap, const char *path, struct hostmem_config *config)
+{
+	struct hostmem_heap_desc layout;
+	struct hostmem_heap_desc *desc;
+	int chunk_shift;
+	struct stat st;
+
+	if (!heap || !path || !config) {
+		return -EINVAL;
+	}
+
+	memset(heap, 0, sizeof(*heap));
+	heap->config = config;
+	heap->imported = 1;
+	heap->memory.config = config;
+	snprintf(heap->memory.path, sizeof(heap->memory.path), "%s", path);
+
+	heap->memory.fd = open(heap->memory.path, O_RDWR);
+	if (heap->memory.fd < 0) {
+		UPCIE_DEBUG("FAILED: open(path); errno(%d)", errno);
+		return -errno;
+	}
+
+	if (fstat(heap->memory.fd, &st) != 0) {
+		UPCIE_DEBUG("FAILED: fstat(path); errno(%d)", errno);
+		close(heap->memory.fd);
+		return -errno;
+	}
+
+	// No reservation, as the extents of a growable heap, not committed, have no hugepages
+	heap->memory.virt = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_NORESERVE, heap->memory.fd, 0);
+	if (heap->memory.virt == MAP_FAILED) {
+		UPCIE_DEBUG("FAILED: mmap(path); errno(%d)", errno);
+		close(heap->memory.fd);
+		return -errno;
+	}
+	heap->memory.size = st.st_size;
+
+	desc = heap->memory.virt;
+	if (__atomic_load_n(&desc->magic, __ATOMIC_ACQUIRE) != HOSTMEM_HEAP_MAGIC ||
+	    desc->size != heap->memory.size || desc->hugepgsz != (uint32_t)config->hugepgsz) {
+		UPCIE_DEBUG("FAILED: path(%s) does not hold a heap with hugepgsz(%d)", path,
+			    config->hugepgsz);
+		hostmem_heap_term(heap);
+		return -EINVAL;
+	}
+
+	// The layout is recomputed, rather than trusted, as the offsets become pointers of the heap
+	chunk_shift = hostmem_heap_chunk_shift(config);
+	hostmem_heap_desc_layout(&layout, heap->memory.size, chunk_shift < 0 ? 0 : chunk_shift,
+				 config->hugepgsz);
+	if (chunk_shift < 0 || desc->chunk_shift != layout.chunk_shift ||
+	    desc->nphys != layout.nphys || desc->nchunks > layout.nchunks ||
+	    desc->phys_lut != layout.phys_lut || desc->runs != layout.runs ||
+	    desc->orders != layout.orders) {
+		UPCIE_DEBUG("FAILED: path(%s) holds a heap with an invalid layout", path);
+		hostmem_heap_term(heap);
+		return -EINVAL;
+	}
+
+	hostmem_heap_attach(heap);
+	heap->memory.phys = heap->phys_lut[0];
+
+	return 0;
+}
+
+/**
+ * Free a block obtained from one of the hostmem_heap_block_alloc*() functions
+ *
+ * Blocks are coalesced with their buddy, while it is free, in O(log n).
+ */
 static inline void
 hostmem_heap_block_free(struct hostmem_heap *heap, void *ptr)
 {
-	size_t alignment = heap->config->pagesize;
-	struct hostmem_heap_block *block = NULL;
+	uint64_t offset;
+	size_t unit;
+	int order;
 
-	if (!ptr) {
+	if (!heap || !ptr) {
 		return;
 	}
 
-	block = (struct hostmem_heap_block *)((char *)ptr - alignment);
-	block->free = 1;
+	offset = (char *)ptr - (char *)heap->memory.virt;
+	unit = offset >> HOSTMEM_HEAP_ORDER_MIN;
+	if ((char *)ptr < (char *)heap->memory.virt || offset >= heap->memory.size ||
+	    offset & (((uint64_t)1 << HOSTMEM_HEAP_ORDER_MIN) - 1)) {
+		UPCIE_DEBUG("FAILED: ptr(%p) is not within the heap", ptr);
+		return;
+	}
 
-	block = heap->freelist;
-	while (block && block->next) {
-		if (block->free && block->next->free) {
-			block->size += alignment + block->next->size;
-			block->next = block->next->next;
-		} else {
-			block = block->next;
+	hostmem_heap_lock(heap);
+
+	order = heap->orders[unit];
+	if (order < HOSTMEM_HEAP_ORDER_MIN || order > heap->chunk_shift ||
+	    offset & (((uint64_t)1 << order) - 1)) {
+		hostmem_heap_unlock(heap);
+		UPCIE_DEBUG("FAILED: ptr(%p) is not an allocated block", ptr);
+		return;
+	}
+
+	if (order == heap->chunk_shift) {
+		size_t first = offset >> heap->chunk_shift;
+		size_t count = heap->runs[first];
+
+		if (count > heap->nchunks - first) {
+			count = heap->nchunks - first; ///< A corrupt run-length
+		}
+
+		heap->runs[first] = 0;
+		for (size_t i = count; i > 0; --i) {
+			hostmem_heap_list_push(heap, (uint64_t)(first + i - 1) << heap->chunk_shift,
+					       heap->chunk_shift);
+		}
+		hostmem_heap_unlock(heap);
+		return;
+	}
+
+	while (order < heap->chunk_shift) {
+		uint64_t buddy = offset ^ ((uint64_t)1 << order);
+
+		if (heap->orders[buddy >> HOSTMEM_HEAP_ORDER_MIN] !=
+		    (HOSTMEM_HEAP_ORDER_FREE | order)) {
+			break;
 		}
+		hostmem_heap_list_remove(heap, buddy, order);
+
+		heap->orders[offset >> HOSTMEM_HEAP_ORDER_MIN] = 0;
+		offset &= ~((uint64_t)1 << order);
+		order++;
 	}
+
+	hostmem_heap_list_push(heap, offset, order);
+
+	hostmem_heap_unlock(heap);
 }
 
+/**
+ * Release the extents of a growable heap which are entirely free, except for the first extent
+ *
+ * The hugepages of a released extent are returned to the system; the extent is committed again
+ * when the heap needs to grow.
+ *
+ * @return On success, the number of extents released is returned. On error, negative errno is
+ *         returned to indicate the error.
+ */
+static inline int
+hostmem_heap_shrink(struct hostmem_heap *heap)
+{
+	const uint64_t chunk_size = (uint64_t)1 << heap->chunk_shift;
+	struct hostmem_heap_desc *desc = heap->desc;
+	int nreleased = 0;
+
+	if (!desc || !desc->extent_size || heap->imported) {
+		return -EINVAL;
+	}
+
+	hostmem_heap_lock(heap);
+
+	for (uint32_t k = 1; k < desc->nextents; ++k) {
+		const uint64_t offset = desc->extents_base + k * desc->extent_size;
+		const uint64_t end = offset + desc->extent_size;
+		uint64_t chunk = offset;
+
+		if (!(desc->extents & ((uint64_t)1 << k))) {
+			continue;
+		}
+
+		while (chunk < end && heap->orders[chunk >> HOSTMEM_HEAP_ORDER_MIN] ==
+					      (HOSTMEM_HEAP_ORDER_FREE | heap->chunk_shift)) {
+			chunk += chunk_size;
+		}
+		if (chunk < end) {
+			continue;
+		}
+		if (heap->extent_cb &&
+		    heap->extent_cb(heap, offset, desc->extent_size, 0, heap->extent_cb_arg)) {
+			continue;
+		}
+
+		for (chunk = offset; chunk < end; chunk += chunk_size) {
+			hostmem_heap_list_remove(heap, chunk, heap->chunk_shift);
+		}
+		desc->extents &= ~((uint64_t)1 << k);
+
+		hostmem_hugepage_decommit(&heap->memory, offset, desc->extent_size);
+		nreleased++;
+	}
+
+	hostmem_heap_unlock(heap);
+
+	return nreleased;
+}
+
+/**
+ * Allocate an array of 'elem_count' elements of 'elem_size' bytes, aligned to 'alignment'
+ *
+ * An allocation is never split over hugepages, unless it is larger than a hugepage; then it
+ * starts on a hugepage boundary, and 'elem_size' must be a divisor of the hugepage size, such that
+ * elements are not split over hugepages.
+ *
+ * Up to a chunk, see 'struct hostmem_heap', the allocation is rounded up to a power-of-two and
+ * served, in O(log n), by the buddy allocator. Larger allocations are rounded up to whole chunks,
+ * and then found by a scan of the chunks.
+ */
 static inline void *
 hostmem_heap_block_alloc_array_aligned(struct hostmem_heap *heap, size_t elem_count, size_t elem_size, size_t alignment)
 {
-	struct hostmem_heap_block *block = heap->freelist;
-	size_t total_size;
+	size_t hugepgsz = heap->config->hugepgsz;
+	size_t chunk_size = (size_t)1 << heap->chunk_shift;
+	size_t total_size, count, stride;
+	int order = HOSTMEM_HEAP_ORDER_MIN;
+	uint64_t offset;
+
+	if (!elem_count || !elem_size || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
 
 	if (elem_count > SIZE_MAX / elem_size) {
 		UPCIE_DEBUG("FAILED: Cannot allocate memory; elem_size(%ld) * elem_count(%ld) too large", 
@@ -196,65 +1001,46 @@ hostmem_heap_block_alloc_array_aligned(struct hostmem_heap *heap, size_t elem_co
 
 	total_size = elem_count * elem_size;
 
-	assert(sizeof(*block) < alignment);
-
-	if (elem_size > (size_t)heap->config->hugepgsz || (total_size > (size_t)heap->config->hugepgsz 
-		&& (size_t)heap->config->hugepgsz % elem_size != 0)
-	) {
+	if (elem_size > hugepgsz || (total_size > hugepgsz && hugepgsz % elem_size != 0)) {
 		UPCIE_DEBUG("FAILED: Cannot allocate memory; elem_size(%ld) must be aligned to hugepage size(%d)", 
 			elem_size, heap->config->hugepgsz);
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	while (block) {
-		if (block->free && block->size >= (total_size + alignment)) {
-			struct hostmem_heap_block *newblock;
-			size_t offset, in_hpage_offset, hpage_remaining, disalignment, remaining;
-			
-			offset = (char *)block - (char *)heap->memory.virt;
-			in_hpage_offset = offset % heap->config->hugepgsz;
-			hpage_remaining = heap->config->hugepgsz - in_hpage_offset;
-			disalignment = (hpage_remaining - alignment) % elem_size;
-
-			if (hpage_remaining < (total_size + alignment) && disalignment) {
-				// Not enough room in hpage and allocating here will cause disalignment
-				// with hpages - create a block to ensure alignment
-				newblock = (void *)((char *)block + alignment + disalignment);
-				newblock->size = block->size - alignment - disalignment;
-				newblock->free = 1;
-				newblock->next = block->next;
-
-				block->next = newblock;
-				block->size = disalignment;
-
-				// Skip forward
-				block = block->next;
-				continue;
-			}
-
-			remaining = block->size - total_size - alignment;
-
-			if (remaining > sizeof(*block)) {
-				newblock = (void *)((char *)block + alignment + total_size);
-				newblock->size = remaining;
-				newblock->free = 1;
-				newblock->next = block->next;
-
-				block->next = newblock;
-				block->size = total_size;
-			}
+	if (total_size <= chunk_size && alignment <= chunk_size) {
+		while (((size_t)1 << order) < total_size || ((size_t)1 << order) < alignment) {
+			order++;
+		}
+		count = 0;
+		stride = 0;
+	} else {
+		count = (total_size + chunk_size - 1) >> heap->chunk_shift;
+		stride = alignment > chunk_size ? alignment >> heap->chunk_shift : 1;
+		if (total_size > hugepgsz && stride < (hugepgsz >> heap->chunk_shift)) {
+			stride = hugepgsz >> heap->chunk_shift;
+		}
+	}
 
-			block->free = 0;
+	hostmem_heap_lock(heap);
 
-			return (char *)block + alignment;
+	// A growable heap is grown until the allocation succeeds, or it has no more extents
+	do {
+		if (!count) {
+			offset = hostmem_heap_buddy_alloc(heap, order);
+		} else {
+			offset = hostmem_heap_run_alloc(heap, count, stride);
 		}
+	} while (offset == HOSTMEM_HEAP_NONE && !hostmem_heap_grow(heap));
 
-		block = block->next;
+	hostmem_heap_unlock(heap);
+
+	if (offset == HOSTMEM_HEAP_NONE) {
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	errno = ENOMEM;
-	return NULL;
+	return (char *)heap->memory.virt + offset;
 }
 
 static inline void *
@@ -263,10 +1049,20 @@ hostmem_heap_block_alloc_array(struct hostmem_heap *heap, size_t elem_count, siz
 	return hostmem_heap_block_alloc_array_aligned(heap, elem_count, elem_size, heap->config->pagesize);
 }
 
+/**
+ * Allocate 'size' bytes aligned to 'alignment'
+ *
+ * Allocations smaller than a page are served as a single element, with the size rounded up to a
+ * power-of-two of at least 64 bytes; page-sized and larger allocations as an array of pages.
+ */
 static inline void *
 hostmem_heap_block_alloc_aligned(struct hostmem_heap *heap, size_t size, size_t alignment)
 {
 	size_t elem_count, total_size, elem_size;
+
+	if (size < (size_t)heap->config->pagesize) {
+		return hostmem_heap_block_alloc_array_aligned(heap, 1, size, alignment);
+	}
 	
 	total_size = (size + heap->config->pagesize - 1) & ~(heap->config->pagesize - 1);
 	elem_count = total_size / heap->config->pagesize;
@@ -299,10 +1095,10 @@ hostmem_heap_block_virt_to_phys(struct hostmem_heap *heap, void *virt, uint64_t
 	offset = (char *)virt - (char *)heap->memory.virt;
 
 	// Determine which hugepage this address falls into
-	hpage_idx = offset / heap->config->hugepgsz;
+	hpage_idx = offset >> heap->config->hugepgsz_shift;
 
 	// Offset within that hugepage
-	in_hpage_offset = offset % heap->config->hugepgsz;
+	in_hpage_offset = offset & (((size_t)1 << heap->config->hugepgsz_shift) - 1);
 
 	if (hpage_idx >= heap->nphys) {
 		return -EINVAL;
@@ -326,11 +1122,99 @@ hostmem_heap_block_vtp(struct hostmem_heap *heap, void *virt)
 	offset = (char *)virt - (char *)heap->memory.virt;
 
 	// Determine which hugepage this address falls into
-	hpage_idx = offset / heap->config->hugepgsz;
+	hpage_idx = offset >> heap->config->hugepgsz_shift;
 	assert(hpage_idx < heap->nphys);
 
 	// Offset within that hugepage
-	in_hpage_offset = offset % heap->config->hugepgsz;
+	in_hpage_offset = offset & (((size_t)1 << heap->config->hugepgsz_shift) - 1);
 
 	return heap->phys_lut[hpage_idx] + in_hpage_offset;
 }
+
+#define HOSTMEM_HEAP_REGISTRY_MAX 8
+
+/**
+ * A set of heaps, each bound to a NUMA node, created on demand
+ *
+ * Used to provide each device with memory local to it, see nvme_controller_open_numa(). The heaps
+ * are stored in the registry, thus, it must not be moved or copied while the heaps are in use.
+ */
+struct hostmem_heap_registry {
+	struct hostmem_config config; ///< Template of the heap configurations
+	struct hostmem_config configs[HOSTMEM_HEAP_REGISTRY_MAX]; ///< Per heap, with its numa_node
+	struct hostmem_heap heaps[HOSTMEM_HEAP_REGISTRY_MAX];
+	size_t heap_size; ///< Size of each heap
+	int nheaps;
+};
+
+static inline void
+hostmem_heap_registry_term(struct hostmem_heap_registry *registry)
+{
+	for (int i = 0; i < registry->nheaps; ++i) {
+		hostmem_heap_term(&registry->heaps[i]);
+	}
+	registry->nheaps = 0;
+}
+
+/**
+ * Initialize an empty registry of heaps of 'heap_size' bytes, configured after 'config'
+ */
+static inline int
+hostmem_heap_registry_init(struct hostmem_heap_registry *registry, size_t heap_size,
+			   struct hostmem_config *config)
+{
+	if (!registry || !config || !heap_size) {
+		return -EINVAL;
+	}
+
+	memset(registry, 0, sizeof(*registry));
+	registry->config = *config;
+	registry->heap_size = heap_size;
+
+	return 0;
+}
+
+/**
+ * Get the heap bound to the given NUMA node, creating it when the registry has none
+ *
+ * @param registry The registry
+ * @param numa_node The NUMA node; -1 for the heap with no binding
+ * @param heap Pointer to store the heap in
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+hostmem_heap_registry_get(struct hostmem_heap_registry *registry, int numa_node,
+			  struct hostmem_heap **heap)
+{
+	struct hostmem_config *config;
+	int err;
+
+	for (int i = 0; i < registry->nheaps; ++i) {
+		if (registry->configs[i].numa_node == numa_node) {
+			*heap = &registry->heaps[i];
+			return 0;
+		}
+	}
+
+	if (registry->nheaps == HOSTMEM_HEAP_REGISTRY_MAX) {
+		UPCIE_DEBUG("FAILED: registry is full; nheaps(%d)", registry->nheaps);
+		return -ENOMEM;
+	}
+
+	config = &registry->configs[registry->nheaps];
+	*config = registry->config;
+	config->numa_node = numa_node;
+
+	err = hostmem_heap_init(&registry->heaps[registry->nheaps], registry->heap_size, config);
+	if (err) {
+		UPCIE_DEBUG("FAILED: hostmem_heap_init(numa_node: %d); err(%d)", numa_node, err);
+		return err;
+	}
+	// The count names the hugetlbfs files, thus, shared by the heaps of the registry
+	registry->config.count = config->count;
+
+	*heap = &registry->heaps[registry->nheaps++];
+
+	return 0;
+}
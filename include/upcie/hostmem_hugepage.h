@@ -24,6 +24,13 @@
  *
  * - hostmem_hugepage_alloc()
  *   - Allocate memory in multiples of hugepage size
+ *   - Bound to the NUMA node of config->numa_node, when it is not -1
+ *
+ * - hostmem_hugepage_prefault()
+ *   - Fault-in [virt, virt + size), split over config->nthreads threads
+ *
+ * - hostmem_hugepage_reserve() / hostmem_hugepage_commit() / hostmem_hugepage_decommit()
+ *   - Reserve a file and va-space of a given size, and allocate hugepages within it on demand
  *
  * - hostmem_hugepage_import()
  *   - Import hugepage for allocated by another process
@@ -49,18 +56,22 @@
  * Reading /proc/self/pagemap requires CAP_SYS_ADMIN, so hostmem_virt_to_phys() cannot be used by
  * non-privileged users. Therefore, any process needing DMA via this allocator must run as root.
  *
- * Possible Workaround: Since the allocator uses MAP_SHARED, a privileged "allocator-daemon" could
- * handle virt_to_phys translations and share the results via shared memory with unprivileged
- * clients. This allows integration into the heap with minimal complexity. Example:
- *
- * After heap initialization, write the heap structure into hugepage memory. Because phys_lut[]
- * resolves all physical addresses of the backing hugepages, any process that imports the hugepage
- * also gains access to those physical addresses—without needing CAP_SYS_ADMIN.
+ * Workaround: Since the allocator uses MAP_SHARED, a privileged process can do the virt_to_phys
+ * translations and share the results via shared memory with unprivileged clients. This is what
+ * hostmem_heap_init() and hostmem_heap_import() do; the heap structure, including phys_lut[], is
+ * stored in the hugepage memory, thus, any process that imports the heap also gains access to
+ * those physical addresses—without needing CAP_SYS_ADMIN.
  *
  * @file hostmem_hugepage.h
  * @version 0.4.4
  */
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define HOSTMEM_HUGEPAGE_PREFAULT_THREADS_MAX 64
+
 struct hostmem_hugepage {
 	int fd;
 	void *virt;
@@ -117,28 +128,11 @@ hostmem_hugepage_free(struct hostmem_hugepage *hugepage)
 }
 
 /**
- * Allocate a hugepage of the given 'size'
- *
- * @param size Must be a multiple of 2M
- * @param hugepage Pointer to a pre-allocated hugepage-descriptor
- *
- * @return On success, 0 is returned. On error, negative errno is returned to
- * indicate the error.
+ * Create the memfd, or hugetlbfs file, of 'hugepage->size' bytes, backing a hugepage allocation
  */
 static inline int
-hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
-		       struct hostmem_config *config)
+hostmem_hugepage_create(struct hostmem_hugepage *hugepage)
 {
-	int err;
-
-	if (size % (config->hugepgsz) != 0) {
-		UPCIE_DEBUG("FAILED: size must be multiple of hugepgsz(%d)", config->hugepgsz);
-		return -EINVAL;
-	}
-
-	hugepage->config = config;
-	hugepage->size = size;
-
 	switch (hugepage->config->backend) {
 	case HOSTMEM_BACKEND_MEMFD:
 		hugepage->fd =
@@ -156,7 +150,8 @@ hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
 		snprintf(hugepage->path, sizeof(hugepage->path), "%s/%d",
 			 hugepage->config->hugetlb_path, hugepage->config->count);
 
-		hugepage->fd = open(hugepage->path, O_CREAT | O_RDWR, 0600);
+		// Truncated, as a stale file would hand out hugepages that are not zeroed
+		hugepage->fd = open(hugepage->path, O_CREAT | O_TRUNC | O_RDWR, 0600);
 		if (hugepage->fd < 0) {
 			UPCIE_DEBUG("FAILED: open(hugepage); ");
 			return -errno;
@@ -171,6 +166,111 @@ hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
 		return -ENOMEM;
 	}
 
+	return 0;
+}
+
+struct hostmem_hugepage_prefaulter {
+	pthread_t thread;
+	char *virt;
+	size_t size;
+	size_t stride; ///< Distance between the touches, when MADV_POPULATE_WRITE is not supported
+};
+
+static inline void *
+hostmem_hugepage_prefault_run(void *arg)
+{
+	struct hostmem_hugepage_prefaulter *pf = arg;
+
+	if (madvise(pf->virt, pf->size, MADV_POPULATE_WRITE)) {
+		volatile char *ptr = pf->virt;
+
+		for (size_t i = 0; i < pf->size; i += pf->stride) {
+			(void)ptr[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Fault-in the hugepages of [virt, virt + size), split over config->nthreads threads
+ *
+ * A fault of a hugepage is dominated by the kernel zeroing it, thus, this is what makes the
+ * initialization of a large heap slow. The range is populated with madvise(MADV_POPULATE_WRITE),
+ * or on kernels without it, by a read of each hugepage. The calling thread does the first part
+ * itself; when a thread cannot be created, then the calling thread does its part as well.
+ *
+ * @param virt Hugepage-aligned start of the range
+ * @param size Size of the range; a multiple of the hugepage size
+ */
+static inline void
+hostmem_hugepage_prefault(void *virt, size_t size, struct hostmem_config *config)
+{
+	struct hostmem_hugepage_prefaulter pfs[HOSTMEM_HUGEPAGE_PREFAULT_THREADS_MAX] = {0};
+	const size_t npages = size / config->hugepgsz;
+	size_t nthreads = config->nthreads > 1 ? config->nthreads : 1;
+	size_t first = 0;
+
+	if (nthreads > HOSTMEM_HUGEPAGE_PREFAULT_THREADS_MAX) {
+		nthreads = HOSTMEM_HUGEPAGE_PREFAULT_THREADS_MAX;
+	}
+	if (nthreads > npages) {
+		nthreads = npages ? npages : 1;
+	}
+
+	for (size_t t = 0; t < nthreads; ++t) {
+		size_t count = npages / nthreads + (t < npages % nthreads);
+
+		pfs[t].virt = (char *)virt + first * config->hugepgsz;
+		pfs[t].size = count * config->hugepgsz;
+		pfs[t].stride = config->hugepgsz;
+		first += count;
+
+		if (t && pthread_create(&pfs[t].thread, NULL, hostmem_hugepage_prefault_run,
+					&pfs[t])) {
+			UPCIE_DEBUG("FAILED: pthread_create(); faulting-in on the calling thread");
+			hostmem_hugepage_prefault_run(&pfs[t]);
+			pfs[t].size = 0;
+		}
+	}
+
+	hostmem_hugepage_prefault_run(&pfs[0]);
+
+	for (size_t t = 1; t < nthreads; ++t) {
+		if (pfs[t].size) {
+			pthread_join(pfs[t].thread, NULL);
+		}
+	}
+}
+
+/**
+ * Allocate a hugepage of the given 'size'
+ *
+ * @param size Must be a multiple of 2M
+ * @param hugepage Pointer to a pre-allocated hugepage-descriptor
+ *
+ * @return On success, 0 is returned. On error, negative errno is returned to
+ * indicate the error.
+ */
+static inline int
+hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
+		       struct hostmem_config *config)
+{
+	int err;
+
+	if (size % (config->hugepgsz) != 0) {
+		UPCIE_DEBUG("FAILED: size must be multiple of hugepgsz(%d)", config->hugepgsz);
+		return -EINVAL;
+	}
+
+	hugepage->config = config;
+	hugepage->size = size;
+
+	err = hostmem_hugepage_create(hugepage);
+	if (err) {
+		return err;
+	}
+
 	hugepage->virt =
 		mmap(NULL, hugepage->size, PROT_READ | PROT_WRITE, MAP_SHARED, hugepage->fd, 0);
 	if (hugepage->virt == MAP_FAILED) {
@@ -179,6 +279,20 @@ hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
 		return -ENOMEM;
 	}
 
+	if (config->numa_node >= 0) {
+		err = hostmem_numa_bind(hugepage->virt, hugepage->size, config->numa_node);
+		if (err) {
+			UPCIE_DEBUG("FAILED: hostmem_numa_bind(); err(%d)", err);
+			munmap(hugepage->virt, hugepage->size);
+			close(hugepage->fd);
+			return err;
+		}
+	}
+
+	// Faulted-in after the binding, and before mlock(), which then only has to pin the pages.
+	// The file is new, or truncated, thus, the hugepages are zeroed by the kernel.
+	hostmem_hugepage_prefault(hugepage->virt, hugepage->size, config);
+
 	err = mlock(hugepage->virt, hugepage->size);
 	if (err) {
 		UPCIE_DEBUG("FAILED: mlock(hugepage); err(%d)", err);
@@ -187,16 +301,6 @@ hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
 		return -ENOMEM;
 	}
 
-	{
-		volatile char *ptr = (volatile char *)hugepage->virt;
-		for (size_t i = 0; i < hugepage->size; i += hugepage->config->pagesize) {
-			ptr[i] = 0;
-		}
-	}
-
-	///< The assumption here is that memset and mlock should lead to pinned pages
-	memset(hugepage->virt, 0, hugepage->size);
-
 	err = hostmem_pagemap_virt_to_phys(hugepage->virt, &hugepage->phys);
 	if (err) {
 		UPCIE_DEBUG("FAILED: hostmem_virt_to_phys(hugepage); err(%d)", err);
@@ -210,6 +314,116 @@ hostmem_hugepage_alloc(size_t size, struct hostmem_hugepage *hugepage,
 	return 0;
 }
 
+/**
+ * Reserve a hugepage allocation of the given 'size', without allocating any hugepages
+ *
+ * The file backing the allocation is created, and mapped, with MAP_NORESERVE, however, no
+ * hugepages are allocated; these are allocated, pinned, and released in parts, with
+ * hostmem_hugepage_commit() and hostmem_hugepage_decommit(). Memory not committed must not be
+ * accessed. The allocation is released, as usual, with hostmem_hugepage_free().
+ *
+ * @param size Must be a multiple of the hugepage size
+ * @param hugepage Pointer to a pre-allocated hugepage-descriptor
+ *
+ * @return On success, 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+hostmem_hugepage_reserve(size_t size, struct hostmem_hugepage *hugepage,
+			 struct hostmem_config *config)
+{
+	int err;
+
+	if (size % (config->hugepgsz) != 0) {
+		UPCIE_DEBUG("FAILED: size must be multiple of hugepgsz(%d)", config->hugepgsz);
+		return -EINVAL;
+	}
+
+	hugepage->config = config;
+	hugepage->size = size;
+
+	err = hostmem_hugepage_create(hugepage);
+	if (err) {
+		return err;
+	}
+
+	hugepage->virt = mmap(NULL, hugepage->size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_NORESERVE, hugepage->fd, 0);
+	if (hugepage->virt == MAP_FAILED) {
+		UPCIE_DEBUG("FAILED: mmap(hugepage); errno(%d)", errno);
+		close(hugepage->fd);
+		return -ENOMEM;
+	}
+
+	// The policy is shared with the file, thus, it also applies to hostmem_hugepage_commit()
+	if (config->numa_node >= 0) {
+		err = hostmem_numa_bind(hugepage->virt, hugepage->size, config->numa_node);
+		if (err) {
+			UPCIE_DEBUG("FAILED: hostmem_numa_bind(); err(%d)", err);
+			munmap(hugepage->virt, hugepage->size);
+			close(hugepage->fd);
+			return err;
+		}
+	}
+
+	hugepage->config->count++;
+
+	return 0;
+}
+
+/**
+ * Allocate, pin, and fault-in the hugepages of [offset, offset + size) of a reserved allocation
+ *
+ * The range is widened to hugepage boundaries. Committing a range which is, partially, committed
+ * already, leaves the content of the committed part as is; newly allocated hugepages are zeroed.
+ *
+ * @return On success, 0 is returned. When the hugepages are not available, -ENOMEM is returned.
+ */
+static inline int
+hostmem_hugepage_commit(struct hostmem_hugepage *hugepage, size_t offset, size_t size)
+{
+	const size_t hmask = (size_t)hugepage->config->hugepgsz - 1;
+	const size_t end = (offset + size + hmask) & ~hmask;
+	volatile const char *ptr;
+
+	offset &= ~hmask;
+	size = end - offset;
+	ptr = (volatile const char *)hugepage->virt + offset;
+
+	if (fallocate(hugepage->fd, 0, offset, size)) {
+		UPCIE_DEBUG("FAILED: fallocate(hugepage); errno(%d)", errno);
+		return -ENOMEM;
+	}
+
+	if (mlock((const void *)ptr, size)) {
+		UPCIE_DEBUG("FAILED: mlock(hugepage); errno(%d)", errno);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < size; i += hugepage->config->hugepgsz) {
+		(void)ptr[i];
+	}
+
+	return 0;
+}
+
+/**
+ * Unpin, and release, the hugepages of [offset, offset + size) of a reserved allocation
+ *
+ * The range must be hugepage-aligned, and must no longer be in use, e.g. for DMA.
+ */
+static inline int
+hostmem_hugepage_decommit(struct hostmem_hugepage *hugepage, size_t offset, size_t size)
+{
+	munlock((char *)hugepage->virt + offset, size);
+
+	if (fallocate(hugepage->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size)) {
+		UPCIE_DEBUG("FAILED: fallocate(PUNCH_HOLE); errno(%d)", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
 /**
  * Import (re-map) an existing hugepage shared by another process.
  *
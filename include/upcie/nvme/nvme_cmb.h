@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Controller Memory Buffer (CMB) and Persistent Memory Region (PMR)
+ * =================================================================
+ *
+ * A controller can expose memory of its own via a BAR: the CMB, for queues, PRP and SGL lists,
+ * and data, and the PMR, persistent memory, e.g. for staging buffers which must survive a power
+ * loss. The regions are discovered, and mapped, by the controller, see
+ * nvme_controller_cmb_setup() and nvme_controller_pmr_setup(); this header describes them.
+ *
+ * With the SQ in the CMB, then the host writes commands to the controller with posted writes,
+ * instead of the controller fetching them from host memory, after the doorbell, thus, a DMA
+ * round-trip per command is saved. The same goes for PRP lists. The CMB is mapped
+ * write-combining, when the BAR is prefetchable, thus, the writes are buffered by the CPU, and
+ * must be flushed via wmb() before the doorbell is written; nvme_qpair_sqdb_update() does so,
+ * for qpairs with the SQ in the CMB.
+ *
+ * The CMB is handed out in pages, via nvme_cmb_alloc() and nvme_cmb_free(), which, as with the
+ * creation of qpairs, is not thread-safe. Addresses given to the controller are those of its
+ * controller memory space, see nvme_cmb_v2p(), not host physical addresses.
+ *
+ * @file nvme_cmb.h
+ * @version 0.4.4
+ */
+
+struct nvme_cmb {
+	uint8_t *virt;    ///< Mapping of the CMB; NULL when the controller has none, or not mapped
+	uint64_t addr;    ///< Address of the CMB in controller memory space
+	size_t nbytes;    ///< Size of the CMB, in bytes
+	size_t pagesize;  ///< Granularity of allocations
+	uint32_t cmbsz;   ///< Value of CMBSZ; which uses, e.g. SQS and LISTS, are supported
+	uint32_t npages;  ///< Number of pages of the CMB
+	uint64_t *pages;  ///< Allocation status, a bit per page; set when allocated
+	uint32_t nfree;   ///< Number of free pages
+};
+
+struct nvme_pmr {
+	uint8_t *virt;   ///< Mapping of the PMR; NULL when the controller has none, or not enabled
+	uint64_t addr;   ///< Address of the PMR in controller memory space; 0 when CMSS is unset
+	size_t nbytes;   ///< Size of the PMR, in bytes
+	uint32_t pmrcap; ///< Value of PMRCAP
+};
+
+static inline int
+nvme_cmb_pp(struct nvme_cmb *cmb)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_cmb:");
+
+	if (!cmb || !cmb->virt) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+
+	wrtn += printf("\n");
+	wrtn += printf("  virt: %p\n", (void *)cmb->virt);
+	wrtn += printf("  addr: 0x%" PRIx64 "\n", cmb->addr);
+	wrtn += printf("  nbytes: %zu\n", cmb->nbytes);
+	wrtn += printf("  cmbsz: 0x%08" PRIx32 "\n", cmb->cmbsz);
+	wrtn += printf("  npages: %" PRIu32 "\n", cmb->npages);
+	wrtn += printf("  nfree: %" PRIu32 "\n", cmb->nfree);
+
+	return wrtn;
+}
+
+static inline void
+nvme_cmb_term(struct nvme_cmb *cmb)
+{
+	free(cmb->pages);
+	memset(cmb, 0, sizeof(*cmb));
+}
+
+/**
+ * Initialize the allocator of a mapped CMB
+ *
+ * @param cmb The CMB to initialize
+ * @param virt Mapping of the CMB
+ * @param addr Address of the CMB in controller memory space
+ * @param nbytes Size of the CMB in bytes; a trailing partial page is not used
+ * @param pagesize Granularity of allocations, a power-of-two
+ * @param cmbsz Value of the CMBSZ register
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_cmb_init(struct nvme_cmb *cmb, void *virt, uint64_t addr, size_t nbytes, size_t pagesize,
+	      uint32_t cmbsz)
+{
+	memset(cmb, 0, sizeof(*cmb));
+
+	if (!virt || !pagesize || (pagesize & (pagesize - 1)) || nbytes < pagesize ||
+	    nbytes / pagesize > UINT32_MAX) {
+		UPCIE_DEBUG("FAILED: invalid nbytes(%zu) or pagesize(%zu)", nbytes, pagesize);
+		return -EINVAL;
+	}
+
+	cmb->npages = nbytes / pagesize;
+	cmb->pages = calloc((cmb->npages + 63) / 64, sizeof(*cmb->pages));
+	if (!cmb->pages) {
+		UPCIE_DEBUG("FAILED: calloc(pages); errno(%d)", errno);
+		cmb->npages = 0;
+		return -ENOMEM;
+	}
+
+	cmb->virt = virt;
+	cmb->addr = addr;
+	cmb->nbytes = nbytes;
+	cmb->pagesize = pagesize;
+	cmb->cmbsz = cmbsz;
+	cmb->nfree = cmb->npages;
+
+	return 0;
+}
+
+static inline int
+nvme_cmb_page_is_used(struct nvme_cmb *cmb, uint32_t page)
+{
+	return (cmb->pages[page / 64] >> (page % 64)) & 1;
+}
+
+static inline void
+nvme_cmb_pages_mark(struct nvme_cmb *cmb, uint32_t first, uint32_t npages, int used)
+{
+	for (uint32_t page = first; page < first + npages; ++page) {
+		if (used) {
+			cmb->pages[page / 64] |= 1ULL << (page % 64);
+		} else {
+			cmb->pages[page / 64] &= ~(1ULL << (page % 64));
+		}
+	}
+}
+
+/**
+ * Allocate `nbytes`, rounded up to whole pages, of physically contiguous memory of the CMB
+ *
+ * The first fit is taken; the CMB holds a handful of queues and list-pages, thus, a scan of the
+ * page bitmap is sufficient.
+ *
+ * @return On success, a pointer to the memory is returned. On error, NULL is returned and `errno`
+ *         set to indicate the error.
+ */
+static inline void *
+nvme_cmb_alloc(struct nvme_cmb *cmb, size_t nbytes)
+{
+	uint32_t npages, run = 0;
+
+	if (!cmb->virt || !nbytes) {
+		errno = cmb->virt ? EINVAL : ENOTSUP;
+		return NULL;
+	}
+
+	npages = (nbytes + cmb->pagesize - 1) / cmb->pagesize;
+	if (npages > cmb->nfree) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (uint32_t page = 0; page < cmb->npages; ++page) {
+		if (nvme_cmb_page_is_used(cmb, page)) {
+			run = 0;
+			continue;
+		}
+		if (++run < npages) {
+			continue;
+		}
+
+		nvme_cmb_pages_mark(cmb, page + 1 - npages, npages, 1);
+		cmb->nfree -= npages;
+
+		return cmb->virt + (size_t)(page + 1 - npages) * cmb->pagesize;
+	}
+
+	errno = ENOMEM;
+	return NULL;
+}
+
+/**
+ * Free memory allocated by nvme_cmb_alloc(), `nbytes` must be that given at allocation
+ *
+ * If `virt` is NULL, no operation is performed.
+ */
+static inline void
+nvme_cmb_free(struct nvme_cmb *cmb, void *virt, size_t nbytes)
+{
+	uint32_t first, npages;
+
+	if (!virt) {
+		return;
+	}
+
+	first = ((uint8_t *)virt - cmb->virt) / cmb->pagesize;
+	npages = (nbytes + cmb->pagesize - 1) / cmb->pagesize;
+
+	nvme_cmb_pages_mark(cmb, first, npages, 0);
+	cmb->nfree += npages;
+}
+
+/**
+ * Returns the address, in controller memory space, of the given address within the CMB
+ */
+static inline uint64_t
+nvme_cmb_v2p(struct nvme_cmb *cmb, void *virt)
+{
+	return cmb->addr + ((uint8_t *)virt - cmb->virt);
+}
@@ -37,3 +37,25 @@ struct nvme_command {
 	uint32_t cdw14;
 	uint32_t cdw15;
 };
+
+#define NVME_SGL_TYPE_DATA_BLOCK 0x0
+#define NVME_SGL_TYPE_SEGMENT 0x2
+#define NVME_SGL_TYPE_LAST_SEGMENT 0x3
+
+/**
+ * Command Dword 0, PRP or SGL for Data Transfer (PSDT); SGLs with MPTR as contiguous buffer
+ */
+#define NVME_COMMAND_PSDT_SGL 0x1
+
+/**
+ * Scatter Gather List (SGL) Descriptor
+ *
+ * When the command has PSDT set to use SGLs, then the command PRP1 and PRP2 fields are the first
+ * SGL descriptor (SGL1) of the command.
+ */
+struct nvme_sgl_desc {
+	uint64_t addr;   ///< Address of the data block or the SGL segment
+	uint32_t len;    ///< Length in bytes of the data block or the SGL segment
+	uint8_t rsvd[3];
+	uint8_t type;    ///< Descriptor type (bits 7:4) and sub type (bits 3:0)
+};
@@ -8,10 +8,50 @@
  * This header defines basic structures and access patterns for working with an NVMe controller,
  * including BAR-space mappings, controller registers, and values derived from register content.
  *
+ * On open, the controller is identified, and a selection of the Identify Controller fields are
+ * kept in the controller struct. The number of I/O queues is negotiated, and multiple I/O qpairs
+ * can be created at once with nvme_controller_create_io_qpairs(). When the controller supports
+ * the Doorbell Buffer Config command, as advertised by OACS bit 8, then shadow doorbell buffers
+ * are set up and used by the I/O qpairs, see the "Shadow Doorbells" section of nvme_qpair.h. The Maximum Data Transfer Size is kept in
+ * the controller and in each qpair, in bytes, for nvme_qpair_submit_sync_contig_prps_split().
+ *
+ * When the controller has a Controller Memory Buffer, then it is mapped on open, and I/O qpairs
+ * can have their SQ, and PRP-list pages, placed in it, see nvme_io_qpair_opts->sq_cmb. The
+ * Persistent Memory Region is mapped and enabled on request, via nvme_controller_pmr_setup(). See
+ * nvme_cmb.h.
+ *
+ * When the controller supports Weighted Round Robin with Urgent Priority Class arbitration, as
+ * advertised by CAP.AMS, then it is selected by nvme_controller_wrr_enable(), and I/O qpairs are
+ * created with the priority class of nvme_io_qpair_opts->qprio, and arbitrated between according
+ * to the weights of nvme_controller_arbitration_set(). See nvme_sched.h for routing commands to
+ * the qpairs by class.
+ *
+ * A controller which reports a fatal status, or stops completing commands, is recovered by
+ * nvme_controller_reset(), without closing it: the controller is disabled and enabled again with
+ * the memory of its admin and I/O qpairs, the I/O queues are created anew, in place, and the
+ * commands in flight are either aborted, or submitted again.
+ *
  * @file nvme_controller.h
  * @version 0.4.4
  */
 
+#define NVME_CONTROLLER_NIOQS 1024
+#define NVME_CONTROLLER_ABORTS_MAX 64 ///< Aborts queued, and not yet submitted; a power of two
+
+#define NVME_CONTROLLER_RESET_RESUBMIT 0x1 ///< Submit the commands in flight again, on reset
+#define NVME_CONTROLLER_AMS_RR 0x0  ///< CC.AMS: Round Robin
+#define NVME_CONTROLLER_AMS_WRR 0x1 ///< CC.AMS: Weighted Round Robin with Urgent Priority Class
+
+/**
+ * An Abort queued by nvme_controller_abort_queue(), see nvme_controller_process_aborts()
+ */
+struct nvme_controller_abort_slot {
+	uint64_t seq;  ///< == position: free; == position + 1: holds an Abort for the admin qpair
+	uint32_t sqid; ///< SQ of the command to abort
+	uint16_t cid;  ///< Command to abort
+	uint16_t rsvd;
+};
+
 /**
  * This is one way of combining the various components needed
  */
@@ -28,215 +68,1740 @@ struct nvme_controller {
 	uint32_t cc;   ///< Controller configuration Register Value
 
 	int timeout_ms; ///< Command timeout in milliseconds (derived from cap.to)
+
+	uint16_t oacs; ///< Optional Admin Command Support (from Identify Controller)
+	uint16_t oncs; ///< Optional NVM Command Support, from Identify Controller
+	uint32_t sgls; ///< SGL Support (from Identify Controller); bits 1:0 != 0 when supported
+	uint32_t mdts_nbytes; ///< Maximum Data Transfer Size in bytes (from Identify); 0: unlimited
+	uint16_t nioqs; ///< I/O queue-pairs allocated by the controller; 0 when not negotiated
+	uint8_t ams;    ///< Arbitration Mechanism, NVME_CONTROLLER_AMS_*; written to CC.AMS
+
+	void *dbbuf_dbs; ///< Shadow doorbell buffer; NULL when not in use
+	void *dbbuf_eis; ///< EventIdx buffer; NULL when not in use
+
+	struct nvme_cmb cmb; ///< Controller Memory Buffer; cmb.virt is NULL when not available
+	struct nvme_pmr pmr; ///< Persistent Memory Region; pmr.virt is NULL when not set up
+
+	struct nvme_controller_abort_slot aborts[NVME_CONTROLLER_ABORTS_MAX]; ///< Queued Aborts
+	uint64_t aborts_tail;     ///< Position of the next Abort queued; advanced by any thread
+	uint64_t aborts_head;     ///< Position of the next Abort submitted; by the aq owner
+	uint64_t aborts_deadline; ///< TSC by which the Aborts in flight are to have completed
+	uint32_t naborts;         ///< Aborts in flight on the admin qpair
+	int reset;                ///< Set when a command is stuck; the controller is to be reset
 };
 
+/**
+ * Empty the queue of Aborts, see nvme_controller_abort_queue()
+ */
 static inline void
-nvme_controller_close(struct nvme_controller *ctrlr)
+nvme_controller_aborts_init(struct nvme_controller *ctrlr)
 {
-	if (ctrlr->aq.rpool) {
-		nvme_qpair_term(&ctrlr->aq);
-		memset(&ctrlr->aq, 0, sizeof(ctrlr->aq));
+	for (uint64_t i = 0; i < NVME_CONTROLLER_ABORTS_MAX; ++i) {
+		ctrlr->aborts[i].seq = i;
 	}
+	ctrlr->aborts_tail = 0;
+	ctrlr->aborts_head = 0;
+}
 
-	if (ctrlr->buf) {
-		hostmem_dma_free(ctrlr->heap, ctrlr->buf);
-		ctrlr->buf = NULL;
+/**
+ * Identify the controller and store the fields of interest in the controller struct
+ *
+ * The Identify Controller data structure is left in ctrlr->buf.
+ */
+static inline int
+nvme_controller_identify(struct nvme_controller *ctrlr)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *idfy = ctrlr->buf;
+	int err;
+
+	cmd.opc = 0x6;  ///< IDENTIFY
+	cmd.cdw10 = 1; ///< CNS=1: Identify Controller
+
+	err = nvme_qpair_submit_sync_contig_prps(&ctrlr->aq, ctrlr->heap, ctrlr->buf, 4096, &cmd,
+						 ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)", err);
+		return err;
 	}
 
-	pci_func_close(&ctrlr->func);
-	memset(ctrlr, 0, sizeof(*ctrlr));
+	ctrlr->oacs = idfy[256] | (idfy[257] << 8);
+	ctrlr->oncs = idfy[520] | (idfy[521] << 8);
+	memcpy(&ctrlr->sgls, &idfy[536], sizeof(ctrlr->sgls));
+
+	// MDTS is a power of two in units of the minimum memory page size (CAP.MPSMIN)
+	ctrlr->mdts_nbytes = 0;
+	if (idfy[77]) {
+		uint64_t cap = nvme_mmio_cap_read(ctrlr->func.bars[0].region);
+		uint64_t mdts = (1ULL << idfy[77]) << (12 + nvme_reg_cap_get_mpsmin(cap));
+
+		ctrlr->mdts_nbytes = mdts > UINT32_MAX ? 0 : mdts;
+	}
+	ctrlr->aq.mdts_nbytes = ctrlr->mdts_nbytes;
+
+	return 0;
+}
+
+static inline void
+nvme_controller_dbbuf_term(struct nvme_controller *ctrlr)
+{
+	if (ctrlr->dbbuf_dbs) {
+		hostmem_dma_free(ctrlr->heap, ctrlr->dbbuf_dbs);
+	}
+	if (ctrlr->dbbuf_eis) {
+		hostmem_dma_free(ctrlr->heap, ctrlr->dbbuf_eis);
+	}
+	ctrlr->dbbuf_dbs = NULL;
+	ctrlr->dbbuf_eis = NULL;
 }
 
 /**
- * Disables the NVMe controller at 'bdf', sets up admin-queues and enables it again
+ * Returns 1 when the controller supports SGLs for NVM command set I/O commands, 0 otherwise
  */
 static inline int
-nvme_controller_open(struct nvme_controller *ctrlr, const char *bdf, struct hostmem_heap *heap)
+nvme_controller_sgl_supported(struct nvme_controller *ctrlr)
 {
-	uint64_t cap;
-	void *bar0;
+	return (ctrlr->sgls & 0x3) != 0;
+}
+
+/**
+ * Set up shadow doorbell and EventIdx buffers via the Doorbell Buffer Config admin command
+ *
+ * Must be called after the controller is enabled, and before I/O qpairs are created; qpairs
+ * created via nvme_controller_create_io_qpair() thereafter use the shadow doorbells. The admin
+ * qpair keeps using the MMIO doorbells.
+ *
+ * @return On success 0 is returned. When the controller does not support the command, -ENOTSUP
+ *         is returned. On other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_dbbuf_setup(struct nvme_controller *ctrlr)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	size_t pagesize = ctrlr->heap->config->pagesize;
 	int err;
 
-	memset(ctrlr, 0, sizeof(*ctrlr));
-	ctrlr->heap = heap;
+	if (!(ctrlr->oacs & (1 << 8))) {
+		return -ENOTSUP;
+	}
 
-	ctrlr->buf = hostmem_dma_malloc(ctrlr->heap, 4096);
-	if (!ctrlr->buf) {
-		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(buf); errno(%d)\n", errno);
-		return -errno;
+	// The buffers are kept across a controller reset; see nvme_controller_reset()
+	if (!ctrlr->dbbuf_dbs) {
+		ctrlr->dbbuf_dbs = hostmem_dma_malloc(ctrlr->heap, pagesize);
 	}
-	memset(ctrlr->buf, 0, 4096);
+	if (!ctrlr->dbbuf_eis) {
+		ctrlr->dbbuf_eis = hostmem_dma_malloc(ctrlr->heap, pagesize);
+	}
+	if (!ctrlr->dbbuf_dbs || !ctrlr->dbbuf_eis) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(dbbuf); err(%d)", err);
+		nvme_controller_dbbuf_term(ctrlr);
+		return err;
+	}
+	memset(ctrlr->dbbuf_dbs, 0, pagesize);
+	memset(ctrlr->dbbuf_eis, 0, pagesize);
 
-	nvme_qid_bitmap_init(ctrlr->qids);
+	cmd.opc = 0x7C; ///< Doorbell Buffer Config
+	cmd.prp1 = hostmem_dma_v2p(ctrlr->heap, ctrlr->dbbuf_dbs);
+	cmd.prp2 = hostmem_dma_v2p(ctrlr->heap, ctrlr->dbbuf_eis);
 
-	err = pci_func_open(bdf, &ctrlr->func);
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
 	if (err) {
-		UPCIE_DEBUG("FAILED: pci_func_open(%.*s); err(%d)", 13, bdf, err);
-		return -err;
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Doorbell Buffer Config); err(%d)", err);
+		nvme_controller_dbbuf_term(ctrlr);
+		return err;
 	}
 
-	err = pci_bar_map(ctrlr->func.bdf, 0, &ctrlr->func.bars[0]);
+	return 0;
+}
+
+/**
+ * Map BAR `bir` of the controller, write-combining when the BAR is prefetchable
+ *
+ * BAR0 is mapped already, uncached, thus, a region within it is used as is. A BAR mapped by an
+ * earlier call is reused, e.g. when the CMB and PMR share one.
+ */
+static inline int
+nvme_controller_bar_map_wc(struct nvme_controller *ctrlr, uint8_t bir)
+{
+	struct pci_func_bar *bar = &ctrlr->func.bars[bir];
+	int err;
+
+	if (bir >= PCI_NBARS) {
+		return -EINVAL;
+	}
+	if (bar->region) {
+		return 0;
+	}
+
+	err = pci_bar_map_wc(ctrlr->func.bdf, bir, bar);
+	if (err == -ENOENT) {
+		err = pci_bar_map(ctrlr->func.bdf, bir, bar);
+	}
 	if (err) {
-		UPCIE_DEBUG("FAILED: pci_bar_map(BAR0); err(%d)", err);
-		return -err;
+		UPCIE_DEBUG("FAILED: pci_bar_map(BAR%" PRIu8 "); err(%d)", bir, err);
 	}
-	bar0 = ctrlr->func.bars[0].region;
 
-	cap = nvme_mmio_cap_read(bar0);
-	// CAP.TO is encoded in units of 500 ms.
-	ctrlr->timeout_ms = nvme_reg_cap_get_to(cap) * 500;
+	return err;
+}
 
-	nvme_mmio_cc_disable(bar0);
+/**
+ * Discover and map the Controller Memory Buffer (CMB) via CAP.CMBS, CMBLOC, and CMBSZ
+ *
+ * The controller must be disabled, as CMBMSC, which enables the CMB registers, and the
+ * controller memory space at the bus address of the CMB, must only be changed then. This is done
+ * by nvme_controller_open().
+ *
+ * @return On success 0 is returned. When the controller has no CMB, -ENOTSUP is returned. On
+ *         other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_cmb_setup(struct nvme_controller *ctrlr)
+{
+	uint8_t *bar0 = ctrlr->func.bars[0].region;
+	uint32_t cmbloc, cmbsz;
+	uint64_t unit, offset, nbytes, addr = 0;
+	uint8_t bir;
+	int err;
 
-	err = nvme_mmio_csts_wait_until_not_ready(bar0, ctrlr->timeout_ms);
+	if (!nvme_reg_cap_get_cmbs(nvme_mmio_cap_read(bar0))) {
+		return -ENOTSUP;
+	}
+
+	nvme_mmio_cmbmsc_write(bar0, 0x1); ///< CRE: make CMBLOC and CMBSZ reportable
+
+	cmbloc = nvme_mmio_cmbloc_read(bar0);
+	cmbsz = nvme_mmio_cmbsz_read(bar0);
+	if (!cmbsz) {
+		return -ENOTSUP;
+	}
+
+	bir = nvme_reg_cmbloc_get_bir(cmbloc);
+	unit = nvme_reg_cmbsz_unit_nbytes(cmbsz);
+	offset = nvme_reg_cmbloc_get_ofst(cmbloc) * unit;
+	nbytes = nvme_reg_cmbsz_get_sz(cmbsz) * unit;
+
+	err = nvme_controller_bar_map_wc(ctrlr, bir);
 	if (err) {
-		UPCIE_DEBUG("FAILED: nvme_mmio_csts_wait_until_ready(); err(%d)\n", err);
-		return -err;
+		return err;
+	}
+	if (offset + nbytes > ctrlr->func.bars[bir].size) {
+		UPCIE_DEBUG("FAILED: CMB(%" PRIu64 " + %" PRIu64 ") exceeds BAR%" PRIu8, offset,
+			    nbytes, bir);
+		return -EINVAL;
 	}
 
-	err = nvme_qpair_init(&ctrlr->aq, 0, 256, ctrlr->func.bars[0].region, ctrlr->heap);
+	err = pci_bar_addr(ctrlr->func.bdf, bir, &addr);
 	if (err) {
-		UPCIE_DEBUG("FAILED: nvme_qpair_init(); err(%d)", err);
-		return -err;
+		UPCIE_DEBUG("FAILED: pci_bar_addr(BAR%" PRIu8 "); err(%d)", bir, err);
+		return err;
 	}
+	addr += offset;
 
-	nvme_mmio_aq_setup(bar0, hostmem_dma_v2p(heap, ctrlr->aq.sq),
-			   hostmem_dma_v2p(heap, ctrlr->aq.cq), ctrlr->aq.depth);
+	nvme_mmio_cmbmsc_write(bar0, addr | 0x2 | 0x1); ///< CBA, CMSE, and CRE
 
-	{
-		uint32_t css = (nvme_reg_cap_get_css(cap) & (1 << 6)) ? 0x6 : 0x0;
-		uint32_t cc = 0;
+	return nvme_cmb_init(&ctrlr->cmb, (uint8_t *)ctrlr->func.bars[bir].region + offset, addr,
+			     nbytes, ctrlr->heap->config->pagesize, cmbsz);
+}
+
+/**
+ * Discover, map, and enable the Persistent Memory Region (PMR) via CAP.PMRS and PMRCAP
+ *
+ * The PMR spans all of the BAR indicated by PMRCAP.BIR. When the controller supports it, then the
+ * PMR is also made addressable in controller memory space, at the bus address of the BAR, such
+ * that it can be used as a data buffer of commands, via pmr.addr.
+ *
+ * @return On success 0 is returned. When the controller has no PMR, -ENOTSUP is returned. On
+ *         other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_pmr_setup(struct nvme_controller *ctrlr)
+{
+	uint8_t *bar0 = ctrlr->func.bars[0].region;
+	uint32_t pmrcap;
+	uint8_t bir;
+	int timeout_ms, err;
 
-		cc = nvme_reg_cc_set_css(cc, css);
-		cc = nvme_reg_cc_set_shn(cc, 0x0);
-		cc = nvme_reg_cc_set_mps(cc, 0x0);
-		cc = nvme_reg_cc_set_ams(cc, 0x0);
-		cc = nvme_reg_cc_set_iosqes(cc, 6);
-		cc = nvme_reg_cc_set_iocqes(cc, 4);
-		cc = nvme_reg_cc_set_en(cc, 0x1);
+	if (!nvme_reg_cap_get_pmrs(nvme_mmio_cap_read(bar0))) {
+		return -ENOTSUP;
+	}
 
-		nvme_mmio_cc_write(bar0, cc);
+	pmrcap = nvme_mmio_pmrcap_read(bar0);
+	bir = nvme_reg_pmrcap_get_bir(pmrcap);
+	if (!bir) {
+		UPCIE_DEBUG("FAILED: PMR in BAR0");
+		return -EINVAL;
 	}
 
-	err = nvme_mmio_csts_wait_until_ready(bar0, ctrlr->timeout_ms);
+	err = nvme_controller_bar_map_wc(ctrlr, bir);
 	if (err) {
-		UPCIE_DEBUG("FAILED: nvme_mmio_csts_wait_until_ready(); err(%d)", err);
-		return -err;
+		return err;
+	}
+
+	ctrlr->pmr.addr = 0;
+	if (nvme_reg_pmrcap_get_cmss(pmrcap)) {
+		err = pci_bar_addr(ctrlr->func.bdf, bir, &ctrlr->pmr.addr);
+		if (err) {
+			UPCIE_DEBUG("FAILED: pci_bar_addr(BAR%" PRIu8 "); err(%d)", bir, err);
+			return err;
+		}
+		nvme_mmio_pmrmsc_write(bar0, ctrlr->pmr.addr | 0x2); ///< CBA and CMSE
+	}
+
+	nvme_mmio_pmrctl_write(bar0, 0x1); ///< EN
+
+	// PMRTO is in units of 500 milliseconds, or of minutes
+	timeout_ms = nvme_reg_pmrcap_get_pmrto(pmrcap) *
+		     (nvme_reg_pmrcap_get_pmrtu(pmrcap) ? 60000 : 500);
+	err = nvme_mmio_pmrsts_wait_until_ready(bar0, timeout_ms ? timeout_ms : 500);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_mmio_pmrsts_wait_until_ready(); err(%d)", err);
+		nvme_mmio_pmrctl_write(bar0, 0x0);
+		return err;
 	}
 
+	ctrlr->pmr.virt = ctrlr->func.bars[bir].region;
+	ctrlr->pmr.nbytes = ctrlr->func.bars[bir].size;
+	ctrlr->pmr.pmrcap = pmrcap;
+
 	return 0;
 }
 
 /**
- * Deletes the submission-queue and completion-queue and frees host-side resources.
+ * Negotiate the number of I/O queues via Set Features Number of Queues (FID 0x07)
  *
- * Sends Delete I/O SQ and Delete I/O CQ admin commands to the controller, then
- * releases the host DMA memory and returns the queue ID to the free pool.
+ * Requests `nqueues` submission and completion queues; the number allocated by the controller,
+ * which may be fewer or more, is stored in ctrlr->nioqs. The feature can only be set before any
+ * I/O queue is created.
  *
- * @param ctrlr Pointer to a pre-allocated NVMe controller
- * @param qpair Pointer to a queue-pair (from nvme_controller_create_io_qpair)
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_set_num_queues(struct nvme_controller *ctrlr, uint16_t nqueues)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint16_t nsqa, ncqa;
+	int err;
+
+	if (!nqueues || nqueues == UINT16_MAX) {
+		return -EINVAL;
+	}
+
+	cmd.opc = 0x09;  ///< SET FEATURES
+	cmd.cdw10 = 0x07; ///< FID: Number of Queues
+	cmd.cdw11 = ((uint32_t)(nqueues - 1) << 16) | (nqueues - 1); ///< NCQR and NSQR
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Set Features); err(%d)", err);
+		return err;
+	}
+
+	nsqa = (cpl.cdw0 & 0xFFFF) + 1;
+	ncqa = (cpl.cdw0 >> 16) + 1;
+	ctrlr->nioqs = nsqa < ncqa ? nsqa : ncqa;
+
+	return 0;
+}
+
+/**
+ * Identify the controller, negotiate the number of queues, and set up shadow doorbells
  *
- * @return 0 on success, negative errno on error. Resources are freed regardless.
+ * This is the common tail of nvme_controller_open() and nvme_controller_open_vfio(), run once the
+ * controller is ready. NVME_CONTROLLER_NIOQS I/O queues are requested, the controller clamps this
+ * to what it supports. Neither failing to negotiate, nor failing to set up the shadow doorbells,
+ * which are an optimization, is an error.
  */
 static inline int
-nvme_controller_delete_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+nvme_controller_setup(struct nvme_controller *ctrlr)
 {
-	uint16_t qid = qpair->qid;
 	int err;
 
-	{
-		struct nvme_command cmd = {0};
-		struct nvme_completion cpl = {0};
+	err = nvme_controller_identify(ctrlr);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_identify(); err(%d)", err);
+		return err;
+	}
 
-		cmd.opc = 0x0; ///< Delete I/O Submission Queue
-		cmd.cdw10 = qid;
+	err = nvme_controller_set_num_queues(ctrlr, NVME_CONTROLLER_NIOQS);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_set_num_queues(); err(%d)", err);
+	}
 
-		err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
-		if (err) {
-			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Delete SQ); err(%d)", err);
-		}
+	err = nvme_controller_dbbuf_setup(ctrlr);
+	if (err && err != -ENOTSUP) {
+		UPCIE_DEBUG("FAILED: nvme_controller_dbbuf_setup(); err(%d); using MMIO doorbells",
+			    err);
 	}
 
-	{
-		struct nvme_command cmd = {0};
-		struct nvme_completion cpl = {0};
+	return 0;
+}
 
-		cmd.opc = 0x4; ///< Delete I/O Completion Queue
-		cmd.cdw10 = qid;
+static inline void
+nvme_controller_close(struct nvme_controller *ctrlr)
+{
+	if (ctrlr->aq.rpool) {
+		nvme_qpair_term(&ctrlr->aq);
+		memset(&ctrlr->aq, 0, sizeof(ctrlr->aq));
+	}
 
-		err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
-		if (err) {
-			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Delete CQ); err(%d)", err);
-		}
+	if (ctrlr->buf) {
+		hostmem_dma_free(ctrlr->heap, ctrlr->buf);
+		ctrlr->buf = NULL;
 	}
 
-	nvme_qpair_term(qpair);
-	nvme_qid_free(ctrlr->qids, qid);
+	nvme_controller_dbbuf_term(ctrlr);
+	nvme_cmb_term(&ctrlr->cmb);
 
-	return err;
+	pci_func_close(&ctrlr->func);
+	memset(ctrlr, 0, sizeof(*ctrlr));
 }
 
 /**
- * Allocates a submission-queue, a completion-queue, and wraps them in the nvme_qpair struct
+ * Programs AQA/ASQ/ACQ with the admin qpair, and enables the controller; CC.EN=1
+ *
+ * Does not wait for CSTS.RDY. The admin qpair must be initialized, and the controller disabled.
+ */
+static inline void
+nvme_controller_aq_enable(struct nvme_controller *ctrlr)
+{
+	void *bar0 = ctrlr->func.bars[0].region;
+	uint64_t cap = nvme_mmio_cap_read(bar0);
+	uint32_t css = (nvme_reg_cap_get_css(cap) & (1 << 6)) ? 0x6 : 0x0;
+	uint32_t cc = 0;
+
+	nvme_mmio_aq_setup(bar0, hostmem_dma_v2p(ctrlr->heap, ctrlr->aq.sq),
+			   hostmem_dma_v2p(ctrlr->heap, ctrlr->aq.cq), ctrlr->aq.depth);
+
+	cc = nvme_reg_cc_set_css(cc, css);
+	cc = nvme_reg_cc_set_shn(cc, 0x0);
+	cc = nvme_reg_cc_set_mps(cc, 0x0);
+	cc = nvme_reg_cc_set_ams(cc, ctrlr->ams);
+	cc = nvme_reg_cc_set_iosqes(cc, 6);
+	cc = nvme_reg_cc_set_iocqes(cc, 4);
+	cc = nvme_reg_cc_set_en(cc, 0x1);
+
+	nvme_mmio_cc_write(bar0, cc);
+}
+
+/**
+ * Maps the NVMe controller at 'bdf' and disables it, without waiting for CSTS.RDY to clear
+ *
+ * This is the first stage of nvme_controller_open(); the second is nvme_controller_open_enable(),
+ * and is to be run once the controller is no longer ready. On error, the controller is left as
+ * is, release it with nvme_controller_close().
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
  */
 static inline int
-nvme_controller_create_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair,
-				uint16_t depth)
+nvme_controller_open_disable(struct nvme_controller *ctrlr, const char *bdf,
+			     struct hostmem_heap *heap)
 {
-	uint16_t qid;
+	uint64_t cap;
 	int err;
 
-	err = nvme_qid_find_free(ctrlr->qids);
-	if (err < 1) {
-		return -ENOMEM;
+	memset(ctrlr, 0, sizeof(*ctrlr));
+	ctrlr->heap = heap;
+
+	ctrlr->buf = hostmem_dma_malloc(ctrlr->heap, 4096);
+	if (!ctrlr->buf) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(buf); errno(%d)\n", errno);
+		return -errno;
 	}
-	qid = err;
+	memset(ctrlr->buf, 0, 4096);
 
-	err = nvme_qid_alloc(ctrlr->qids, qid);
+	nvme_qid_bitmap_init(ctrlr->qids);
+	nvme_controller_aborts_init(ctrlr);
+
+	err = pci_func_open(bdf, &ctrlr->func);
 	if (err) {
-		UPCIE_DEBUG("FAILED: nvme_qid_alloc(): err(%d)", err);
+		UPCIE_DEBUG("FAILED: pci_func_open(%.*s); err(%d)", 13, bdf, err);
 		return err;
 	}
 
-	err = nvme_qpair_init(qpair, qid, depth, ctrlr->func.bars[0].region, ctrlr->heap);
+	err = pci_bar_map(ctrlr->func.bdf, 0, &ctrlr->func.bars[0]);
 	if (err) {
-		UPCIE_DEBUG("FAILED: nvme_qpair_init(); err(%d)\n", err);
-		nvme_qid_free(ctrlr->qids, qid);
-
+		UPCIE_DEBUG("FAILED: pci_bar_map(BAR0); err(%d)", err);
 		return err;
 	}
 
-	{
-		struct nvme_command cmd = {0};
-		struct nvme_completion cpl = {0};
+	cap = nvme_mmio_cap_read(ctrlr->func.bars[0].region);
+	// CAP.TO is encoded in units of 500 ms.
+	ctrlr->timeout_ms = nvme_reg_cap_get_to(cap) * 500;
 
-		cmd.opc = 0x5; ///< Create I/O Completion Queue
-		cmd.prp1 = hostmem_dma_v2p(ctrlr->heap, qpair->cq);
-		cmd.cdw10 = ((depth - 1) << 16) | qid;
-		cmd.cdw11 = 0x1; ///< Physically contigous
+	nvme_mmio_cc_disable(ctrlr->func.bars[0].region);
 
-		err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
-		if (err) {
-			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
-			return err;
-		}
-	}
+	return 0;
+}
 
-	{
-		struct nvme_command cmd = {0};
-		struct nvme_completion cpl = {0};
+/**
+ * Sets up the admin-queues of a disabled controller and enables it, without waiting for CSTS.RDY
+ *
+ * This is the second stage of nvme_controller_open(), once CSTS.RDY == 0; when the controller is
+ * ready, then nvme_controller_setup() completes the open.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_open_enable(struct nvme_controller *ctrlr)
+{
+	void *bar0 = ctrlr->func.bars[0].region;
+	int err;
+
+	// The CMB is an optimization, thus, failing to set it up is not an error
+	err = nvme_controller_cmb_setup(ctrlr);
+	if (err && err != -ENOTSUP) {
+		UPCIE_DEBUG("FAILED: nvme_controller_cmb_setup(); err(%d); not using the CMB", err);
+		nvme_cmb_term(&ctrlr->cmb);
+	}
+
+	err = nvme_qpair_init(&ctrlr->aq, 0, 256, bar0, ctrlr->heap);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_init(); err(%d)", err);
+		return err;
+	}
+
+	nvme_controller_aq_enable(ctrlr);
+
+	return 0;
+}
+
+/**
+ * Disables the NVMe controller at 'bdf', sets up admin-queues and enables it again
+ *
+ * To open several controllers, without waiting for each to reset in turn, then see
+ * nvme_controller_open_parallel().
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_open(struct nvme_controller *ctrlr, const char *bdf, struct hostmem_heap *heap)
+{
+	int err;
+
+	err = nvme_controller_open_disable(ctrlr, bdf, heap);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_open_disable(); err(%d)", err);
+		return err;
+	}
+
+	err = nvme_mmio_csts_wait_until_not_ready(ctrlr->func.bars[0].region, ctrlr->timeout_ms);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_mmio_csts_wait_until_not_ready(); err(%d)\n", err);
+		return err;
+	}
+
+	err = nvme_controller_open_enable(ctrlr);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_open_enable(); err(%d)", err);
+		return err;
+	}
+
+	err = nvme_mmio_csts_wait_until_ready(ctrlr->func.bars[0].region, ctrlr->timeout_ms);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_mmio_csts_wait_until_ready(); err(%d)", err);
+		return err;
+	}
+
+	err = nvme_controller_setup(ctrlr);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_setup(); err(%d)", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Same as nvme_controller_open(), with the heap taken from the registry, bound to the NUMA node of
+ * the controller, thus, queues and buffers are allocated in memory local to the controller
+ *
+ * When the system does not report the NUMA node of the controller, then the heap of the registry
+ * without a binding is used.
+ */
+static inline int
+nvme_controller_open_numa(struct nvme_controller *ctrlr, const char *bdf,
+			  struct hostmem_heap_registry *registry)
+{
+	struct hostmem_heap *heap;
+	int numa_node, err;
+
+	if (pci_numa_node(bdf, &numa_node)) {
+		numa_node = -1;
+	}
+
+	err = hostmem_heap_registry_get(registry, numa_node, &heap);
+	if (err) {
+		UPCIE_DEBUG("FAILED: hostmem_heap_registry_get(); err(%d)", err);
+		return err;
+	}
+
+	return nvme_controller_open(ctrlr, bdf, heap);
+}
+
+enum nvme_controller_open_state {
+	NVME_CONTROLLER_OPEN_DISABLING = 0, ///< CC.EN=0 written, waiting for CSTS.RDY == 0
+	NVME_CONTROLLER_OPEN_ENABLING,      ///< CC.EN=1 written, waiting for CSTS.RDY == 1
+	NVME_CONTROLLER_OPEN_READY,         ///< Ready; to be set up
+	NVME_CONTROLLER_OPEN_FAILED,
+};
+
+/**
+ * Invoked by nvme_controller_open_parallel(), on a thread of its own, once the controller at index
+ * `idx` is set up; e.g. to create its I/O qpairs
+ *
+ * @return On success 0 is returned. On error, negative errno; then the controller is closed, thus,
+ *         what `fn` created on it must be released by `fn` before returning.
+ */
+typedef int (*nvme_controller_open_fn)(struct nvme_controller *ctrlr, int idx, void *user);
+
+/**
+ * The state of a single controller of nvme_controller_open_parallel()
+ */
+struct nvme_controller_open_worker {
+	pthread_t thread;
+	struct nvme_controller *ctrlr;
+	nvme_controller_open_fn fn;
+	void *user;
+	uint64_t deadline; ///< When the current state is given up, in TSC ticks
+	enum nvme_controller_open_state state;
+	int threaded; ///< Whether 'thread' is to be joined
+	int idx;
+	int err;
+};
+
+static inline void *
+nvme_controller_open_worker_run(void *arg)
+{
+	struct nvme_controller_open_worker *worker = arg;
+
+	worker->err = nvme_controller_setup(worker->ctrlr);
+	if (worker->err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_setup(); err(%d)", worker->err);
+		return NULL;
+	}
+
+	if (worker->fn) {
+		worker->err = worker->fn(worker->ctrlr, worker->idx, worker->user);
+	}
+
+	return NULL;
+}
+
+/**
+ * Open `n` controllers; as nvme_controller_open(), though concurrently
+ *
+ * All controllers are disabled, and then, as each reports CSTS.RDY == 0, its admin-queues are set
+ * up and it is enabled, thus, the controllers reset concurrently, and each is given its own
+ * CAP.TO. Once ready, each controller is set up, Identify etc., on a thread of its own, where `fn`
+ * is then invoked, when given. Thus, opening takes about as long as the slowest of the
+ * controllers, rather than the sum of them.
+ *
+ * The controllers share `heap`, which is thread-safe; `fn` must only touch the controller it is
+ * given, or synchronize on its own.
+ *
+ * @param ctrlrs Array of `n` controllers
+ * @param bdfs Array of the `n` PCI addresses of the controllers
+ * @param n Number of controllers
+ * @param heap The heap of the controllers
+ * @param fn Invoked for each controller once it is set up; may be NULL
+ * @param user Opaque pointer passed to `fn`
+ * @param errs Array of `n`, to store the error of each controller; may be NULL
+ *
+ * @return When all controllers are opened, 0 is returned. Otherwise, the error of the first
+ *         controller which failed, as negative errno; the controllers which failed are closed,
+ *         while the others are open.
+ */
+static inline int
+nvme_controller_open_parallel(struct nvme_controller *ctrlrs, const char **bdfs, int n,
+			      struct hostmem_heap *heap, nvme_controller_open_fn fn, void *user,
+			      int *errs)
+{
+	struct nvme_controller_open_worker *workers;
+	int npending = 0;
+	int err = 0;
+
+	workers = calloc(n, sizeof(*workers));
+	if (!workers) {
+		UPCIE_DEBUG("FAILED: calloc(); errno(%d)", errno);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		struct nvme_controller_open_worker *worker = &workers[i];
+
+		worker->ctrlr = &ctrlrs[i];
+		worker->fn = fn;
+		worker->user = user;
+		worker->idx = i;
+
+		worker->err = nvme_controller_open_disable(worker->ctrlr, bdfs[i], heap);
+		if (worker->err) {
+			UPCIE_DEBUG("FAILED: nvme_controller_open_disable(%s); err(%d)", bdfs[i],
+				    worker->err);
+			worker->state = NVME_CONTROLLER_OPEN_FAILED;
+			continue;
+		}
+		worker->deadline = tsc_read() + tsc_from_ms(worker->ctrlr->timeout_ms);
+		npending++;
+	}
+
+	while (npending) {
+		uint64_t now = tsc_read();
+
+		for (int i = 0; i < n; ++i) {
+			struct nvme_controller_open_worker *worker = &workers[i];
+			uint32_t csts;
+
+			if (worker->state > NVME_CONTROLLER_OPEN_ENABLING) {
+				continue;
+			}
+			csts = nvme_mmio_csts_read(worker->ctrlr->func.bars[0].region);
+
+			if (worker->state == NVME_CONTROLLER_OPEN_DISABLING && !(csts & 0x1)) {
+				worker->err = nvme_controller_open_enable(worker->ctrlr);
+				worker->state = NVME_CONTROLLER_OPEN_ENABLING;
+				worker->deadline = now + tsc_from_ms(worker->ctrlr->timeout_ms);
+			} else if (worker->state == NVME_CONTROLLER_OPEN_ENABLING && (csts & 0x1)) {
+				worker->state = NVME_CONTROLLER_OPEN_READY;
+			} else if (worker->state == NVME_CONTROLLER_OPEN_ENABLING && (csts & 0x2)) {
+				worker->err = -EIO; ///< CSTS.CFS: Controller Fatal Status
+			} else if (now >= worker->deadline) {
+				worker->err = -ETIMEDOUT;
+			}
+
+			if (worker->err) {
+				UPCIE_DEBUG("FAILED: bdf(%s) state(%d); err(%d)", bdfs[i],
+					    worker->state, worker->err);
+				worker->state = NVME_CONTROLLER_OPEN_FAILED;
+			}
+			if (worker->state > NVME_CONTROLLER_OPEN_ENABLING) {
+				npending--;
+			}
+		}
+
+		if (npending) {
+			usleep(1000);
+		}
+	}
+
+	// Admin commands of distinct controllers are independent; a thread per controller
+	for (int i = 0; i < n; ++i) {
+		struct nvme_controller_open_worker *worker = &workers[i];
+
+		if (worker->state != NVME_CONTROLLER_OPEN_READY) {
+			continue;
+		}
+		worker->threaded = !pthread_create(&worker->thread, NULL,
+						   nvme_controller_open_worker_run, worker);
+		if (!worker->threaded) {
+			nvme_controller_open_worker_run(worker);
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		struct nvme_controller_open_worker *worker = &workers[i];
+
+		if (worker->threaded) {
+			pthread_join(worker->thread, NULL);
+		}
+		if (worker->err) {
+			nvme_controller_close(worker->ctrlr);
+			err = err ? err : worker->err;
+		}
+		if (errs) {
+			errs[i] = worker->err;
+		}
+	}
+
+	free(workers);
+
+	return err;
+}
+
+/**
+ * Deletes the submission-queue and completion-queue and frees host-side resources.
+ *
+ * Sends Delete I/O SQ and Delete I/O CQ admin commands to the controller, then
+ * releases the host DMA memory and returns the queue ID to the free pool. When the SQ completes to
+ * a shared CQ, then only the SQ is deleted, and detached from the shared CQ.
+ *
+ * @param ctrlr Pointer to a pre-allocated NVMe controller
+ * @param qpair Pointer to a queue-pair (from nvme_controller_create_io_qpair)
+ *
+ * @return 0 on success, negative errno on error. Resources are freed regardless.
+ */
+static inline int
+nvme_controller_delete_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	uint16_t qid = qpair->qid;
+	int err;
+
+	{
+		struct nvme_command cmd = {0};
+		struct nvme_completion cpl = {0};
+
+		cmd.opc = 0x0; ///< Delete I/O Submission Queue
+		cmd.cdw10 = qid;
+
+		err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Delete SQ); err(%d)", err);
+		}
+	}
+
+	if (qpair->shcq) {
+		nvme_cq_detach(qpair->shcq, qpair);
+	} else {
+		struct nvme_command cmd = {0};
+		struct nvme_completion cpl = {0};
+
+		cmd.opc = 0x4; ///< Delete I/O Completion Queue
+		cmd.cdw10 = qid;
+
+		err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Delete CQ); err(%d)", err);
+		}
+	}
+
+	nvme_qpair_dbbuf_detach(qpair);
+	nvme_qpair_term(qpair);
+	nvme_qid_free(ctrlr->qids, qid);
+
+	return err;
+}
+
+/**
+ * Options for the creation of I/O queue-pairs, initialize with nvme_io_qpair_opts_init()
+ */
+struct nvme_io_qpair_opts {
+	int irq_vector; ///< Interrupt vector of the CQ; negative for interrupts disabled
+	int irq_fd;     ///< eventfd signalled on 'irq_vector'; stored in nvme_qpair->irq_fd
+	int sq_cmb;     ///< Place the SQ, and PRP-list pages, in the CMB; nvme_qpair_cmb_attach()
+	int qprio;      ///< Priority class of the SQ, NVME_QPAIR_QPRIO_*; only used under WRR
+	int qid;        ///< From nvme_controller_qid_alloc(), owned by the qpair; 0: allocate one
+};
+
+static inline void
+nvme_io_qpair_opts_init(struct nvme_io_qpair_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->irq_vector = -1;
+	opts->irq_fd = -1;
+	opts->qprio = NVME_QPAIR_QPRIO_MEDIUM;
+}
+
+/**
+ * Creates an I/O CQ on the controller; Create I/O Completion Queue
+ *
+ * @param ctrlr Pointer to an opened controller
+ * @param qid The CQID
+ * @param depth Number of entries
+ * @param cq Pointer to the DMA-capable memory of the CQ
+ * @param irq_vector Interrupt vector of the CQ; negative for interrupts disabled
+ */
+static inline int
+nvme_controller_io_cq_register(struct nvme_controller *ctrlr, uint32_t qid, uint16_t depth,
+			       void *cq, int irq_vector)
+{
+	struct nvme_command cmd = {0};
+	struct nvme_completion cpl = {0};
+	int err;
+
+	cmd.opc = 0x5; ///< Create I/O Completion Queue
+	cmd.prp1 = hostmem_dma_v2p(ctrlr->heap, cq);
+	cmd.cdw10 = ((depth - 1) << 16) | qid;
+	cmd.cdw11 = 0x1; ///< Physically contigous
+	if (irq_vector >= 0) {
+		cmd.cdw11 |= (irq_vector << 16) | 0x2; ///< IV and Interrupts Enabled
+	}
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Creates the I/O SQ of an initialized qpair, completing to the CQ of `cqid`; Create I/O SQ
+ */
+static inline int
+nvme_controller_io_sq_register(struct nvme_controller *ctrlr, struct nvme_qpair *qpair,
+			       uint32_t cqid)
+{
+	struct nvme_command cmd = {0};
+	struct nvme_completion cpl = {0};
+	int err;
+
+	cmd.opc = 0x1; ///< Create I/O Submission Queue
+	cmd.prp1 = qpair->cmb ? nvme_cmb_v2p(qpair->cmb, qpair->sq)
+			      : hostmem_dma_v2p(ctrlr->heap, qpair->sq);
+	cmd.cdw10 = ((qpair->depth - 1) << 16) | qpair->qid;
+	cmd.cdw11 = (cqid << 16) | 0x1; ///< CQID and Physically contigous
+	if (ctrlr->ams == NVME_CONTROLLER_AMS_WRR) {
+		cmd.cdw11 |= (qpair->qprio & 0x3) << 1; ///< QPRIO
+	}
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Creates the I/O CQ and SQ of an initialized qpair on the controller; Create I/O CQ/SQ
+ *
+ * The queues are created from the memory, depth, qid, and interrupt vector of the qpair, thus,
+ * this is also how the queues of a qpair are created anew after a controller reset. On error,
+ * neither queue is left on the controller, and the qpair is unchanged.
+ */
+static inline int
+nvme_controller_io_qpair_register(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	int err;
+
+	err = nvme_controller_io_cq_register(ctrlr, qpair->qid, qpair->depth, qpair->cq,
+					     qpair->irq_vector);
+	if (err) {
+		return err;
+	}
+
+	err = nvme_controller_io_sq_register(ctrlr, qpair, qpair->qid);
+	if (err) {
+		struct nvme_command del = {0};
+		struct nvme_completion cpl = {0};
+
+		del.opc = 0x4; ///< Delete I/O Completion Queue
+		del.cdw10 = qpair->qid;
+		nvme_qpair_submit_sync(&ctrlr->aq, &del, ctrlr->timeout_ms, &cpl);
+
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocate a free I/O queue-id, within the number of queues negotiated with the controller
+ *
+ * @return On success, the allocated qid is returned. On error, negative errno is returned.
+ */
+static inline int
+nvme_controller_qid_alloc(struct nvme_controller *ctrlr)
+{
+	uint16_t qid;
+	int err;
+
+	err = nvme_qid_find_free(ctrlr->qids);
+	if (err < 1) {
+		return -ENOMEM;
+	}
+	qid = err;
+
+	if (ctrlr->nioqs && qid > ctrlr->nioqs) {
+		UPCIE_DEBUG("FAILED: qid(%" PRIu16 ") > nioqs(%" PRIu16 ")", qid, ctrlr->nioqs);
+		return -ENOSPC;
+	}
+
+	err = nvme_qid_alloc(ctrlr->qids, qid);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qid_alloc(): err(%d)", err);
+		return err;
+	}
+
+	return qid;
+}
+
+/**
+ * Allocates a submission-queue, a completion-queue, and wraps them in the nvme_qpair struct
+ *
+ * Same as nvme_controller_create_io_qpair(), with the queue-pair setup as described by `opts`.
+ * When opts->qid is given, then the qpair is created with it, e.g. as the interrupt vector is
+ * chosen by qid, see nvme_controller_create_io_qpair_vfio_irq(); it is freed on error.
+ */
+static inline int
+nvme_controller_create_io_qpair_opts(struct nvme_controller *ctrlr, struct nvme_qpair *qpair,
+				     uint16_t depth, const struct nvme_io_qpair_opts *opts)
+{
+	uint16_t qid;
+	int err;
+
+	err = opts->qid ? opts->qid : nvme_controller_qid_alloc(ctrlr);
+	if (err < 0) {
+		return err;
+	}
+	qid = err;
+
+	err = nvme_qpair_init(qpair, qid, depth, ctrlr->func.bars[0].region, ctrlr->heap);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_init(); err(%d)\n", err);
+		nvme_qid_free(ctrlr->qids, qid);
+
+		return err;
+	}
+
+	if (opts->sq_cmb) {
+		err = nvme_qpair_cmb_attach(qpair, &ctrlr->cmb);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_qpair_cmb_attach(); err(%d)", err);
+			nvme_qpair_term(qpair);
+			nvme_qid_free(ctrlr->qids, qid);
+			return err;
+		}
+	}
+
+	qpair->irq_vector = opts->irq_vector;
+	qpair->qprio = opts->qprio & 0x3;
+
+	err = nvme_controller_io_qpair_register(ctrlr, qpair);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_io_qpair_register(); err(%d)", err);
+		nvme_qpair_term(qpair);
+		nvme_qid_free(ctrlr->qids, qid);
+		return err;
+	}
+
+	if (ctrlr->dbbuf_dbs) {
+		nvme_qpair_dbbuf_attach(qpair, ctrlr->func.bars[0].region, ctrlr->dbbuf_dbs,
+					ctrlr->dbbuf_eis);
+	}
+	if (opts->irq_vector >= 0) {
+		qpair->irq_fd = opts->irq_fd;
+	}
+	qpair->mdts_nbytes = ctrlr->mdts_nbytes;
+
+	return 0;
+}
+
+/**
+ * Allocates a submission-queue, a completion-queue, and wraps them in the nvme_qpair struct
+ *
+ * The completion-queue is created with interrupts disabled, thus completions must be polled.
+ */
+static inline int
+nvme_controller_create_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair,
+				uint16_t depth)
+{
+	struct nvme_io_qpair_opts opts;
+
+	nvme_io_qpair_opts_init(&opts);
+
+	return nvme_controller_create_io_qpair_opts(ctrlr, qpair, depth, &opts);
+}
+
+/**
+ * Create up to `n` I/O queue-pairs, e.g. one per core for a share-nothing threading model
+ *
+ * The number created is bounded by the count negotiated via nvme_controller_set_num_queues(), and
+ * `depth` is clamped to CAP.MQES. Each qpair has its own SQ, CQ, and request-pool, allocated from
+ * the controller heap, and no state is shared between qpairs, thus, each can be driven by its own
+ * thread without locking. However, creating and deleting qpairs uses the admin qpair, which is not
+ * thread-safe.
+ *
+ * @param ctrlr Pointer to an opened controller
+ * @param n Number of queue-pairs to create
+ * @param depth Depth of each queue-pair
+ * @param qpairs Array of at least `n` queue-pairs to initialize
+ *
+ * @return On success, the number of queue-pairs created, at least one, is returned. On error,
+ *         negative errno is returned to indicate the error, and no queue-pairs are created.
+ */
+static inline int
+nvme_controller_create_io_qpairs(struct nvme_controller *ctrlr, uint16_t n, uint16_t depth,
+				 struct nvme_qpair *qpairs)
+{
+	uint64_t cap = nvme_mmio_cap_read(ctrlr->func.bars[0].region);
+	uint32_t mqes = nvme_reg_cap_get_mqes(cap) + 1;
+	int nqpairs = 0;
+
+	if (!n || depth < 2) {
+		return -EINVAL;
+	}
+	if (depth > mqes) {
+		depth = mqes;
+	}
+
+	for (; nqpairs < n; ++nqpairs) {
+		int err;
+
+		err = nvme_controller_create_io_qpair(ctrlr, &qpairs[nqpairs], depth);
+		if (err == -ENOSPC && nqpairs) {
+			break;
+		}
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_controller_create_io_qpair(%d); err(%d)", nqpairs,
+				    err);
+			while (nqpairs--) {
+				nvme_controller_delete_io_qpair(ctrlr, &qpairs[nqpairs]);
+			}
+			return err;
+		}
+	}
+
+	return nqpairs;
+}
+
+/**
+ * Delete the `n` queue-pairs created by nvme_controller_create_io_qpairs()
+ */
+static inline void
+nvme_controller_delete_io_qpairs(struct nvme_controller *ctrlr, struct nvme_qpair *qpairs,
+				 uint16_t n)
+{
+	for (uint16_t i = 0; i < n; ++i) {
+		nvme_controller_delete_io_qpair(ctrlr, &qpairs[i]);
+	}
+}
+
+/**
+ * Allocates a completion-queue, without a submission-queue, for SQs to share; see nvme_cq.h
+ *
+ * The SQs are then created via nvme_controller_create_io_sq(). The CQ takes a qid of its own,
+ * thus, the SQ of that qid is not used.
+ *
+ * @param ctrlr Pointer to an opened controller
+ * @param cq The CQ to initialize
+ * @param depth Number of entries; should fit the commands in flight on all its SQs
+ * @param irq_vector Interrupt vector of the CQ; negative for interrupts disabled
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_create_io_cq(struct nvme_controller *ctrlr, struct nvme_cq *cq, uint16_t depth,
+			     int irq_vector)
+{
+	uint16_t qid;
+	int err;
+
+	err = nvme_controller_qid_alloc(ctrlr);
+	if (err < 0) {
+		return err;
+	}
+	qid = err;
+
+	err = nvme_cq_init(cq, qid, depth, ctrlr->func.bars[0].region, ctrlr->heap);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_cq_init(); err(%d)", err);
+		nvme_qid_free(ctrlr->qids, qid);
+		return err;
+	}
+	cq->irq_vector = irq_vector;
+
+	err = nvme_controller_io_cq_register(ctrlr, qid, depth, cq->cq, irq_vector);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_io_cq_register(); err(%d)", err);
+		nvme_cq_term(cq);
+		nvme_qid_free(ctrlr->qids, qid);
+		return err;
+	}
+
+	if (ctrlr->dbbuf_dbs) {
+		nvme_cq_dbbuf_attach(cq, ctrlr->func.bars[0].region, ctrlr->dbbuf_dbs,
+				     ctrlr->dbbuf_eis);
+	}
 
-		cmd.opc = 0x1; ///< Create I/O Submission Queue
-		cmd.prp1 = hostmem_dma_v2p(ctrlr->heap, qpair->sq);
-		cmd.cdw10 = ((depth - 1) << 16) | qid;
-		cmd.cdw11 = (qid << 16) | 0x1; ///< CQID and Physically contigous
+	return 0;
+}
 
-		err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+/**
+ * Deletes a CQ created by nvme_controller_create_io_cq(), once its SQs are deleted
+ *
+ * @return On success 0 is returned. When SQs are still attached, -EBUSY is returned, and the CQ is
+ *         left as is. On other errors, negative errno is returned; resources are freed regardless.
+ */
+static inline int
+nvme_controller_delete_io_cq(struct nvme_controller *ctrlr, struct nvme_cq *cq)
+{
+	struct nvme_command cmd = {0};
+	struct nvme_completion cpl = {0};
+	uint16_t qid = cq->qid;
+	int err;
+
+	if (cq->nsqs) {
+		return -EBUSY;
+	}
+
+	cmd.opc = 0x4; ///< Delete I/O Completion Queue
+	cmd.cdw10 = qid;
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Delete CQ); err(%d)", err);
+	}
+
+	nvme_cq_dbbuf_detach(cq);
+	nvme_cq_term(cq);
+	nvme_qid_free(ctrlr->qids, qid);
+
+	return err;
+}
+
+/**
+ * Allocates a submission-queue, completing to the shared `cq`, and wraps it in the nvme_qpair
+ *
+ * Same as nvme_controller_create_io_qpair_opts(), except that the qpair has no CQ of its own, see
+ * nvme_cq_attach(); the interrupt options are those of the CQ, thus, `opts->irq_vector` and
+ * `opts->irq_fd` are not used. Delete the qpair via nvme_controller_delete_io_qpair().
+ */
+static inline int
+nvme_controller_create_io_sq(struct nvme_controller *ctrlr, struct nvme_qpair *qpair,
+			     struct nvme_cq *cq, uint16_t depth,
+			     const struct nvme_io_qpair_opts *opts)
+{
+	uint16_t qid;
+	int err;
+
+	err = opts->qid ? opts->qid : nvme_controller_qid_alloc(ctrlr);
+	if (err < 0) {
+		return err;
+	}
+	qid = err;
+
+	err = nvme_qpair_init_sq(qpair, qid, depth, ctrlr->func.bars[0].region, ctrlr->heap);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_init_sq(); err(%d)\n", err);
+		nvme_qid_free(ctrlr->qids, qid);
+		return err;
+	}
+
+	if (opts->sq_cmb) {
+		err = nvme_qpair_cmb_attach(qpair, &ctrlr->cmb);
 		if (err) {
-			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+			UPCIE_DEBUG("FAILED: nvme_qpair_cmb_attach(); err(%d)", err);
+			nvme_qpair_term(qpair);
+			nvme_qid_free(ctrlr->qids, qid);
 			return err;
 		}
 	}
+	qpair->qprio = opts->qprio & 0x3;
+
+	err = nvme_cq_attach(cq, qpair);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_cq_attach(); err(%d)", err);
+		nvme_qpair_term(qpair);
+		nvme_qid_free(ctrlr->qids, qid);
+		return err;
+	}
+
+	err = nvme_controller_io_sq_register(ctrlr, qpair, cq->qid);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_io_sq_register(); err(%d)", err);
+		nvme_cq_detach(cq, qpair);
+		nvme_qpair_term(qpair);
+		nvme_qid_free(ctrlr->qids, qid);
+		return err;
+	}
+
+	if (ctrlr->dbbuf_dbs) {
+		nvme_qpair_dbbuf_attach(qpair, ctrlr->func.bars[0].region, ctrlr->dbbuf_dbs,
+					ctrlr->dbbuf_eis);
+	}
+	qpair->mdts_nbytes = ctrlr->mdts_nbytes;
+
+	return 0;
+}
+
+/**
+ * Reset the controller and recover it in place; CC.EN=0, then CC.EN=1 with the existing queues
+ *
+ * The controller is disabled, and enabled again with AQA/ASQ/ACQ programmed from the memory of the
+ * existing admin qpair. The I/O queues of the `nqpairs` qpairs are then created again with the
+ * memory, qid, depth, and interrupt vector they already have, thus, pointers to the qpairs, and to
+ * their memory, remain valid, and no queue memory is allocated from, or freed to, the heap. The
+ * mapping of the BARs and the CMB, the shadow doorbell buffers, and the Identify Controller fields
+ * are kept; a reset does not change what the controller is.
+ *
+ * Commands in flight on the admin qpair are aborted. Commands in flight on the I/O qpairs are
+ * completed with NVME_QPAIR_SC_ABORTED_SQ_DELETION, or, with NVME_CONTROLLER_RESET_RESUBMIT,
+ * submitted again, in the order they were submitted, see nvme_qpair_reset(). Either way, each
+ * request is completed, via its callback, once. A command executed by the controller, and not yet
+ * reaped from the CQ, is in flight as well, thus, only resubmit commands which are idempotent,
+ * such as reads and writes.
+ *
+ * The qpairs must not be used concurrently with the reset. I/O qpairs of the controller which are
+ * not given are left without queues on the controller, and must be deleted; see
+ * nvme_controller_delete_io_qpair(). Qpairs whose SQ completes to a shared CQ, see nvme_cq.h,
+ * are not recovered; -ENOTSUP is returned when one is given, before the controller is touched.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         the commands of a qpair which could not be created again are aborted.
+ */
+static inline int
+nvme_controller_reset(struct nvme_controller *ctrlr, struct nvme_qpair *qpairs, uint16_t nqpairs,
+		      int flags)
+{
+	void *bar0 = ctrlr->func.bars[0].region;
+	struct nvme_command *pending = NULL;
+	uint32_t *npending = NULL;
+	size_t offset = 0;
+	int err;
+
+	for (uint16_t i = 0; i < nqpairs; ++i) {
+		if (qpairs[i].shcq) {
+			UPCIE_DEBUG("FAILED: qid(%" PRIu32 ") is on a shared CQ", qpairs[i].qid);
+			return -ENOTSUP;
+		}
+	}
+
+	// Allocated up front, such that a failure leaves the controller as it was
+	if ((flags & NVME_CONTROLLER_RESET_RESUBMIT) && nqpairs) {
+		size_t depths = 0;
+
+		for (uint16_t i = 0; i < nqpairs; ++i) {
+			depths += qpairs[i].depth;
+		}
+
+		pending = calloc(depths, sizeof(*pending));
+		npending = calloc(nqpairs, sizeof(*npending));
+		if (!pending || !npending) {
+			UPCIE_DEBUG("FAILED: calloc(pending)");
+			free(pending);
+			free(npending);
+			return -ENOMEM;
+		}
+	}
+
+	nvme_mmio_cc_disable(bar0);
+
+	err = nvme_mmio_csts_wait_until_not_ready(bar0, ctrlr->timeout_ms);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_mmio_csts_wait_until_not_ready(); err(%d)", err);
+		goto exit;
+	}
+
+	nvme_qpair_reset(&ctrlr->aq, NULL);
+	for (uint16_t i = 0; i < nqpairs; ++i) {
+		nvme_qpair_dbbuf_detach(&qpairs[i]);
+		if (pending) {
+			npending[i] = nvme_qpair_reset(&qpairs[i], &pending[offset]);
+			offset += qpairs[i].depth;
+		} else {
+			nvme_qpair_reset(&qpairs[i], NULL);
+		}
+	}
+
+	// CMBMSC is cleared by the reset; enable the CMB again, at the address it is mapped at
+	if (ctrlr->cmb.virt) {
+		nvme_mmio_cmbmsc_write(bar0, ctrlr->cmb.addr | 0x2 | 0x1); ///< CBA, CMSE, and CRE
+	}
+
+	nvme_controller_aq_enable(ctrlr);
+
+	err = nvme_mmio_csts_wait_until_ready(bar0, ctrlr->timeout_ms);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_mmio_csts_wait_until_ready(); err(%d)", err);
+		goto exit;
+	}
+
+	err = nvme_controller_set_num_queues(ctrlr, NVME_CONTROLLER_NIOQS);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_set_num_queues(); err(%d)", err);
+	}
+
+	if (ctrlr->dbbuf_dbs) {
+		err = nvme_controller_dbbuf_setup(ctrlr);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_controller_dbbuf_setup(); err(%d)", err);
+		}
+	}
+
+	err = 0;
+	offset = 0;
+	for (uint16_t i = 0; i < nqpairs; ++i) {
+		struct nvme_qpair *qpair = &qpairs[i];
+		int qerr;
+
+		qerr = nvme_controller_io_qpair_register(ctrlr, qpair);
+		if (qerr) {
+			UPCIE_DEBUG("FAILED: nvme_controller_io_qpair_register(); qid(%" PRIu32
+				    "), err(%d)", qpair->qid, qerr);
+			err = err ? err : qerr;
+			for (uint32_t j = 0; pending && j < npending[i]; ++j) {
+				nvme_qpair_abort_cid(qpair, pending[offset + j].cid);
+			}
+		} else {
+			if (ctrlr->dbbuf_dbs) {
+				nvme_qpair_dbbuf_attach(qpair, bar0, ctrlr->dbbuf_dbs,
+							ctrlr->dbbuf_eis);
+			}
+			if (pending) {
+				nvme_qpair_resubmit(qpair, &pending[offset], npending[i]);
+			}
+		}
+		if (npending) {
+			npending[i] = 0; ///< Handed back to the qpair, or aborted
+		}
+		offset += qpair->depth;
+	}
+
+exit:
+	if (err && pending) {
+		// Commands taken from the qpairs, which are not handed to a qpair again
+		offset = 0;
+		for (uint16_t i = 0; i < nqpairs; ++i) {
+			for (uint32_t j = 0; j < npending[i]; ++j) {
+				nvme_qpair_abort_cid(&qpairs[i], pending[offset + j].cid);
+			}
+			offset += qpairs[i].depth;
+		}
+	}
+	free(pending);
+	free(npending);
+
+	return err;
+}
+
+/**
+ * Request the controller to abort the command of `cid` on the I/O qpair; Abort
+ *
+ * The Abort is submitted on the admin qpair and waited for. When the command is aborted, then the
+ * controller completes it on its qpair with status Command Abort Requested, thus, its callback is
+ * invoked by nvme_qpair_process_completions() as for any other completion. The admin qpair is
+ * not thread-safe; when the I/O qpairs are driven by multiple threads, then the caller must
+ * serialize the use of it. As this blocks, it is not for use from an expire callback; see
+ * nvme_controller_expire_abort() and nvme_controller_process_aborts() for that.
+ *
+ * @return On success, that is, the command is aborted, 0 is returned. When the controller did not
+ *         abort it, e.g. as it is being processed, -EAGAIN is returned. On other errors, negative
+ *         errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_abort(struct nvme_controller *ctrlr, struct nvme_qpair *qpair, uint16_t cid)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	int err;
+
+	cmd.opc = 0x08; ///< Abort
+	cmd.cdw10 = ((uint32_t)cid << 16) | qpair->qid; ///< CID and SQID
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Abort); err(%d)", err);
+		return err;
+	}
+
+	return (cpl.cdw0 & 0x1) ? -EAGAIN : 0; ///< Bit 0: the command was not aborted
+}
+
+/**
+ * Queue an Abort of the command of `cid` on SQ `sqid`, to be submitted by
+ * nvme_controller_process_aborts()
+ *
+ * This does not touch the admin qpair, and is safe to call from any thread, e.g. from the expire
+ * callbacks of I/O qpairs driven by multiple threads; the queue is that of nvme_mpsc.h.
+ *
+ * @return On success 0 is returned. When NVME_CONTROLLER_ABORTS_MAX Aborts are already queued,
+ *         then -EBUSY is returned.
+ */
+static inline int
+nvme_controller_abort_queue(struct nvme_controller *ctrlr, uint32_t sqid, uint16_t cid)
+{
+	struct nvme_controller_abort_slot *slot;
+	uint64_t pos = __atomic_load_n(&ctrlr->aborts_tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &ctrlr->aborts[pos & (NVME_CONTROLLER_ABORTS_MAX - 1)];
+		diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&ctrlr->aborts_tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -EBUSY;
+		} else {
+			pos = __atomic_load_n(&ctrlr->aborts_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->sqid = sqid;
+	slot->cid = cid;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Callback of the Aborts submitted by nvme_controller_process_aborts(); `user` is the ctrlr
+ */
+static inline void
+nvme_controller_abort_cb(struct nvme_completion *cpl, void *user)
+{
+	struct nvme_controller *ctrlr = user;
+
+	ctrlr->naborts--;
+	if (ctrlr->naborts) {
+		ctrlr->aborts_deadline = tsc_read() + tsc_from_ms(ctrlr->timeout_ms);
+	}
+
+	if (cpl->status & 0x1FE) {
+		UPCIE_DEBUG("FAILED: Abort; status(0x%" PRIx16 ")", cpl->status);
+	} else if (cpl->cdw0 & 0x1) {
+		UPCIE_DEBUG("INFO: Abort; the command was not aborted");
+	}
+}
+
+/**
+ * Submit the queued Aborts, reap their completions, and reset the controller when one is stuck
+ *
+ * This is to be called by the thread owning the admin qpair, e.g. from its polling loop; it does
+ * not wait. The Aborts queued by nvme_controller_abort_queue() are submitted on the admin qpair,
+ * as long as it has free requests, and their completions reaped along with any other on it.
+ *
+ * When an Abort does not complete within ctrlr->timeout_ms, or a command is still in flight one
+ * timeout after its Abort was queued, see nvme_controller_expire_abort(), then the controller is
+ * recovered by nvme_controller_reset(), given the `nqpairs` qpairs and `flags`. The qpairs must
+ * not be used concurrently with the reset; when `qpairs` is NULL, then the reset is left to the
+ * caller, e.g. once the threads driving the qpairs are quiesced, and -ETIMEDOUT is returned.
+ * Aborts still queued on reset are dropped, the commands they target are gone.
+ *
+ * @return 0 when the controller is making progress, 1 when it was reset. On error, negative errno
+ *         is returned to indicate the error, see above, and nvme_controller_reset().
+ */
+static inline int
+nvme_controller_process_aborts(struct nvme_controller *ctrlr, struct nvme_qpair *qpairs,
+			       uint16_t nqpairs, int flags)
+{
+	struct nvme_qpair *aq = &ctrlr->aq;
+	uint32_t nsubmitted = 0;
+	int err;
+
+	for (;;) {
+		struct nvme_controller_abort_slot *slot;
+		struct nvme_command cmd = {0};
+		struct nvme_request *req;
+
+		slot = &ctrlr->aborts[ctrlr->aborts_head & (NVME_CONTROLLER_ABORTS_MAX - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ctrlr->aborts_head + 1) {
+			break;
+		}
+
+		req = nvme_request_alloc(aq->rpool);
+		if (!req) {
+			break;
+		}
+		req->cb = nvme_controller_abort_cb;
+		req->user = ctrlr;
+
+		cmd.opc = 0x08; ///< Abort
+		cmd.cid = req->cid;
+		cmd.cdw10 = ((uint32_t)slot->cid << 16) | slot->sqid; ///< CID and SQID
+
+		err = nvme_qpair_enqueue(aq, &cmd);
+		if (err) {
+			nvme_request_free(aq->rpool, req->cid);
+			break;
+		}
+		__atomic_store_n(&slot->seq, ctrlr->aborts_head + NVME_CONTROLLER_ABORTS_MAX,
+				 __ATOMIC_RELEASE);
+		ctrlr->aborts_head++;
+
+		if (!ctrlr->naborts++) {
+			ctrlr->aborts_deadline = tsc_read() + tsc_from_ms(ctrlr->timeout_ms);
+		}
+		nsubmitted++;
+	}
+	if (nsubmitted) {
+		nvme_qpair_sqdb_update(aq);
+	}
+
+	nvme_qpair_process_completions(aq, 0);
+
+	if (!__atomic_load_n(&ctrlr->reset, __ATOMIC_ACQUIRE) &&
+	    !(ctrlr->naborts && tsc_read() >= ctrlr->aborts_deadline)) {
+		return 0;
+	}
+	if (!qpairs) {
+		UPCIE_DEBUG("FAILED: a command is stuck; naborts(%" PRIu32 ")", ctrlr->naborts);
+		return -ETIMEDOUT;
+	}
+
+	UPCIE_DEBUG("INFO: a command is stuck; resetting the controller");
+	err = nvme_controller_reset(ctrlr, qpairs, nqpairs, flags);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_reset(); err(%d)", err);
+		return err;
+	}
+
+	// The Aborts in flight are completed as aborted by the reset, drop those still queued
+	for (;;) {
+		struct nvme_controller_abort_slot *slot;
+
+		slot = &ctrlr->aborts[ctrlr->aborts_head & (NVME_CONTROLLER_ABORTS_MAX - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ctrlr->aborts_head + 1) {
+			break;
+		}
+		__atomic_store_n(&slot->seq, ctrlr->aborts_head + NVME_CONTROLLER_ABORTS_MAX,
+				 __ATOMIC_RELEASE);
+		ctrlr->aborts_head++;
+	}
+	ctrlr->naborts = 0;
+	__atomic_store_n(&ctrlr->reset, 0, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/**
+ * An nvme_qpair_expire_cb aborting the command; `arg` is the ctrlr
+ *
+ * On the first expiry of the command, an Abort is queued via nvme_controller_abort_queue(), this
+ * does not block, and the admin qpair is left to its owner, which submits it by
+ * nvme_controller_process_aborts(). A command which is still in flight one timeout after that,
+ * is stuck on the controller, which is then marked to be reset by
+ * nvme_controller_process_aborts().
+ */
+static inline void
+nvme_controller_expire_abort(struct nvme_qpair *qpair, struct nvme_request *req, void *arg)
+{
+	struct nvme_controller *ctrlr = arg;
+	int err;
+
+	if (req->nexpired > 1) {
+		UPCIE_DEBUG("INFO: qid(%" PRIu32 ") cid(%" PRIu16 ") still in flight; nexpired(%d)",
+			    qpair->qid, req->cid, req->nexpired);
+		__atomic_store_n(&ctrlr->reset, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	err = nvme_controller_abort_queue(ctrlr, qpair->qid, req->cid);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_abort_queue(); qid(%" PRIu32 ") cid(%" PRIu16
+			    "), err(%d)", qpair->qid, req->cid, err);
+	}
+}
+
+/**
+ * Weights of the priority classes under Weighted Round Robin; Set Features Arbitration (FID 0x01)
+ *
+ * The weights are zeroes-based, thus, a weight of 0 is one command per round. The urgent class,
+ * and the admin SQ, are not weighted, they are served before the weighted classes.
+ */
+struct nvme_controller_arbitration {
+	uint8_t ab;  ///< Arbitration Burst; up to 2^ab commands taken at a time; 7: no limit
+	uint8_t lpw; ///< Low Priority Weight
+	uint8_t mpw; ///< Medium Priority Weight
+	uint8_t hpw; ///< High Priority Weight
+};
+
+static inline int
+nvme_controller_arbitration_pr(struct nvme_controller_arbitration *arb)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_controller_arbitration:\n");
+	wrtn += printf("  ab: %" PRIu8 "\n", arb->ab);
+	wrtn += printf("  lpw: %" PRIu8 "\n", arb->lpw);
+	wrtn += printf("  mpw: %" PRIu8 "\n", arb->mpw);
+	wrtn += printf("  hpw: %" PRIu8 "\n", arb->hpw);
+
+	return wrtn;
+}
+
+/**
+ * Configure the Arbitration Burst, and the weights of the priority classes
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_arbitration_set(struct nvme_controller *ctrlr,
+				const struct nvme_controller_arbitration *arb)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	int err;
+
+	cmd.opc = 0x09;  ///< SET FEATURES
+	cmd.cdw10 = 0x01; ///< FID: Arbitration
+	cmd.cdw11 = (arb->ab & 0x7) | ((uint32_t)arb->lpw << 8) | ((uint32_t)arb->mpw << 16) |
+		    ((uint32_t)arb->hpw << 24);
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Set Features); err(%d)", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Retrieve the current Arbitration Burst, and weights of the priority classes
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_controller_arbitration_get(struct nvme_controller *ctrlr,
+				struct nvme_controller_arbitration *arb)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	int err;
+
+	cmd.opc = 0x0A;  ///< GET FEATURES
+	cmd.cdw10 = 0x01; ///< FID: Arbitration, SEL: current
+
+	err = nvme_qpair_submit_sync(&ctrlr->aq, &cmd, ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(Get Features); err(%d)", err);
+		return err;
+	}
+
+	arb->ab = cpl.cdw0 & 0x7;
+	arb->lpw = (cpl.cdw0 >> 8) & 0xFF;
+	arb->mpw = (cpl.cdw0 >> 16) & 0xFF;
+	arb->hpw = (cpl.cdw0 >> 24) & 0xFF;
+
+	return 0;
+}
+
+/**
+ * Select Weighted Round Robin with Urgent Priority Class arbitration, via a controller reset
+ *
+ * CC.AMS can only be changed while the controller is disabled, thus, the controller is reset,
+ * and enabled again with WRR, via nvme_controller_reset(); this must be done before any I/O qpair
+ * is created. Then create the I/O qpairs with nvme_io_qpair_opts->qprio, and set the weights with
+ * nvme_controller_arbitration_set(); the weights are reset along with the controller.
+ *
+ * @return On success 0 is returned. When the controller does not support WRR, -ENOTSUP is
+ *         returned, and when I/O qpairs exist, -EBUSY. On other errors, negative errno is returned
+ *         to indicate the error.
+ */
+static inline int
+nvme_controller_wrr_enable(struct nvme_controller *ctrlr)
+{
+	uint64_t cap = nvme_mmio_cap_read(ctrlr->func.bars[0].region);
+	int err;
+
+	if (!(nvme_reg_cap_get_ams(cap) & 0x1)) {
+		return -ENOTSUP;
+	}
+	for (size_t i = 0; i < NVME_QID_BITMAP_WORDS; ++i) {
+		if (ctrlr->qids[i] & ~(i ? 0ULL : 0x1ULL)) {
+			return -EBUSY;
+		}
+	}
+
+	ctrlr->ams = NVME_CONTROLLER_AMS_WRR;
+
+	err = nvme_controller_reset(ctrlr, NULL, 0, 0);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_reset(); err(%d)", err);
+		ctrlr->ams = NVME_CONTROLLER_AMS_RR;
+		return err;
+	}
 
 	return 0;
 }
@@ -7,11 +7,150 @@
  * This header extends the functionality defined in the uPCIe NVMe Controller
  * header `upcie/nvme/nvme_controller.h` with functions for CUDA compatible
  * NVMe controllers.
+ *
+ * The queues of a CUDA queue-pair are in GPU memory by default; with
+ * nvme_controller_cuda_create_io_qpair_opts() either of them can be placed in
+ * host-pinned memory instead, see enum nvme_qpair_cuda_placement.
+ *
+ * A trace ring, see nvme_trace.h, is attached to a CUDA queue-pair with
+ * nvme_controller_cuda_trace_attach(); it is registered with CUDA, mapped to
+ * the device, and time-stamped by the global timer of the GPU.
  * 
  * @file nvme_controller_cuda.h
  * @version 0.4.4
  */
 
+/**
+ * Options for nvme_controller_cuda_create_io_qpair_opts()
+ */
+struct nvme_io_qpair_cuda_opts {
+	enum nvme_qpair_cuda_placement sq; ///< Memory backing the SQ
+	enum nvme_qpair_cuda_placement cq; ///< Memory backing the CQ
+};
+
+/**
+ * Initialize the options to the defaults of nvme_controller_cuda_create_io_qpair()
+ *
+ * That is, both queues in GPU memory.
+ */
+static inline void
+nvme_io_qpair_cuda_opts_init(struct nvme_io_qpair_cuda_opts *opts)
+{
+	opts->sq = NVME_QPAIR_CUDA_PLACEMENT_DEVICE;
+	opts->cq = NVME_QPAIR_CUDA_PLACEMENT_DEVICE;
+}
+
+/**
+ * Free a queue allocated by nvme_controller_cuda_ring_alloc()
+ *
+ * If `ring` is NULL, no operation is performed.
+ */
+static inline void
+nvme_controller_cuda_ring_free(struct nvme_controller *ctrlr, struct cudamem_heap *heap,
+			       uint8_t placement, void *ring)
+{
+	int err;
+
+	if (!ring) {
+		return;
+	}
+
+	if (placement == NVME_QPAIR_CUDA_PLACEMENT_DEVICE) {
+		cudamem_heap_block_free(heap, ring);
+		return;
+	}
+
+	err = cuMemHostUnregister(ring);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemHostUnregister(ring); CUresult(%d)", err);
+	}
+	hostmem_dma_free(ctrlr->heap, ring);
+}
+
+/**
+ * Allocate a physically contiguous, zeroed, queue of nbytes with the given placement
+ *
+ * Host-pinned queues are allocated from the heap of the controller, as it is there that the
+ * physical addresses are known, and registered with CUDA as mapped memory; this relies on unified
+ * addressing, such that host and device pointers to it are the same.
+ *
+ * @param ctrlr Pointer to the NVMe controller
+ * @param heap Pointer to CUDA Heap
+ * @param placement The memory to allocate the queue from; enum nvme_qpair_cuda_placement
+ * @param nbytes Size of the queue in bytes
+ * @param phys Pointer to store the physical address of the queue
+ *
+ * @return On success, a pointer to the queue is returned. On error, NULL is returned and `errno`
+ *         set to indicate the error.
+ */
+static inline void *
+nvme_controller_cuda_ring_alloc(struct nvme_controller *ctrlr, struct cudamem_heap *heap,
+				uint8_t placement, size_t nbytes, uint64_t *phys)
+{
+	size_t pagesize = ctrlr->heap->config->pagesize;
+	CUdeviceptr dptr = 0;
+	void *ring;
+	int err;
+
+	switch (placement) {
+	case NVME_QPAIR_CUDA_PLACEMENT_DEVICE:
+		ring = cudamem_heap_block_alloc(heap, nbytes);
+		if (!ring) {
+			UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(); errno(%d)", errno);
+			return NULL;
+		}
+
+		err = cuMemsetD8((CUdeviceptr)ring, 0, nbytes);
+		if (err) {
+			UPCIE_DEBUG("FAILED: cuMemsetD8(); CUresult(%d)", err);
+			cudamem_heap_block_free(heap, ring);
+			errno = EIO;
+			return NULL;
+		}
+		*phys = cudamem_heap_block_vtp(heap, ring);
+		return ring;
+
+	case NVME_QPAIR_CUDA_PLACEMENT_HOST:
+		break;
+
+	default:
+		UPCIE_DEBUG("FAILED: invalid placement(%d)", placement);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// Whole pages, such that no two queues share a page registered with CUDA
+	nbytes = (nbytes + pagesize - 1) & ~(pagesize - 1);
+
+	ring = hostmem_dma_alloc_array(ctrlr->heap, 1, nbytes);
+	if (!ring) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(); errno(%d)", errno);
+		return NULL;
+	}
+	memset(ring, 0, nbytes);
+
+	err = cuMemHostRegister(ring, nbytes,
+				CU_MEMHOSTREGISTER_DEVICEMAP | CU_MEMHOSTREGISTER_PORTABLE);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemHostRegister(ring); CUresult(%d)", err);
+		hostmem_dma_free(ctrlr->heap, ring);
+		errno = EIO;
+		return NULL;
+	}
+
+	err = cuMemHostGetDevicePointer(&dptr, ring, 0);
+	if (err || (void *)dptr != ring) {
+		UPCIE_DEBUG("FAILED: cuMemHostGetDevicePointer(); CUresult(%d), no UVA?", err);
+		cuMemHostUnregister(ring);
+		hostmem_dma_free(ctrlr->heap, ring);
+		errno = err ? EIO : ENOTSUP;
+		return NULL;
+	}
+	*phys = hostmem_dma_v2p(ctrlr->heap, ring);
+
+	return ring;
+}
+
 
 /**
  * Deletes the CUDA submission-queue and CUDA completion-queue
@@ -43,6 +182,13 @@ nvme_controller_cuda_delete_io_qpair(struct nvme_controller *ctrlr,
 	if (err) {
 		UPCIE_DEBUG("FAILED: cuMemHostUnregister(cqdb); CUresult(%d)", err);
 	}
+
+	if (_qpair.trace) {
+		err = cuMemHostUnregister(_qpair.trace);
+		if (err) {
+			UPCIE_DEBUG("FAILED: cuMemHostUnregister(trace); CUresult(%d)", err);
+		}
+	}
 	
 	{
 		struct nvme_command cmd = {0};
@@ -70,25 +216,75 @@ nvme_controller_cuda_delete_io_qpair(struct nvme_controller *ctrlr,
 		}
 	}
 
-	cudamem_heap_block_free(heap, _qpair.sq);
-	cudamem_heap_block_free(heap, _qpair.cq);
+	nvme_controller_cuda_ring_free(ctrlr, heap, _qpair.sq_placement, _qpair.sq);
+	nvme_controller_cuda_ring_free(ctrlr, heap, _qpair.cq_placement, _qpair.cq);
+	cudamem_heap_block_free(heap, _qpair.cpls);
+}
+
+/**
+ * Allocate, and initialize, the per-CID state of the shared submission path of the given qpair
+ *
+ * A single allocation holds the per-CID completion words, followed by the bitmap of free CIDs;
+ * CIDs [0, depth - 1) are free, as the SQ holds at most depth - 1 commands.
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult
+ *         errors.
+ */
+static inline int
+nvme_controller_cuda_qpair_cids_alloc(struct nvme_qpair_cuda *_qpair, struct cudamem_heap *heap)
+{
+	const size_t ncids = _qpair->depth - 1;
+	const size_t nwords = (ncids + 31) / 32;
+	const size_t nbytes = (_qpair->depth + nwords) * sizeof(uint32_t);
+	uint32_t *state;
+	int err;
+
+	state = calloc(1, nbytes);
+	if (!state) {
+		return -errno;
+	}
+	for (size_t cid = 0; cid < ncids; ++cid) {
+		state[_qpair->depth + cid / 32] |= 1u << (cid % 32);
+	}
+
+	_qpair->cpls = cudamem_heap_block_alloc(heap, nbytes);
+	if (!_qpair->cpls) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(cpls); errno(%d)", err);
+		free(state);
+		return err;
+	}
+	_qpair->cids = _qpair->cpls + _qpair->depth;
+
+	err = cuMemcpyHtoD((CUdeviceptr)_qpair->cpls, state, nbytes);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyHtoD(cpls); CUresult(%d)", err);
+		cudamem_heap_block_free(heap, _qpair->cpls);
+		_qpair->cpls = NULL;
+		_qpair->cids = NULL;
+	}
+	free(state);
+
+	return err;
 }
 
 /**
  * Allocates a CUDA submission-queue, a CUDA completion-queue, and wraps them in
- * the nvme_qpair struct
+ * the nvme_qpair struct, with the memory backing each queue as given by opts
  *
  * @param ctrlr Pointer to a pre-allocated NVMe controller
  * @param qpair Pointer to a pre-allocated queue-pair (using CUDA)
  * @param depth The queue depth
  * @param heap Pointer to CUDA Heap
+ * @param opts Pointer to the options, see nvme_io_qpair_cuda_opts_init()
  *
  * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult errors.
  */
 static inline int
-nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
-                                     struct nvme_qpair_cuda *qpair, uint16_t depth,
-                                     struct cudamem_heap *heap)
+nvme_controller_cuda_create_io_qpair_opts(struct nvme_controller *ctrlr,
+					  struct nvme_qpair_cuda *qpair, uint16_t depth,
+					  struct cudamem_heap *heap,
+					  const struct nvme_io_qpair_cuda_opts *opts)
 {
 	/* _qpair declared at function scope so sq/cq remain accessible when building
 	 * the Create I/O CQ/SQ admin commands below. This code is inlined here
@@ -96,6 +292,7 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 	 * device-code compilation units.
 	 */
 	struct nvme_qpair_cuda _qpair = {0};
+	uint64_t sq_phys = 0, cq_phys = 0;
 	uint16_t qid;
 	int err;
 
@@ -123,6 +320,8 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 		_qpair.head = 0;
 		_qpair.depth = depth;
 		_qpair.phase = 1;
+		_qpair.sq_placement = opts->sq;
+		_qpair.cq_placement = opts->cq;
 		_qpair.timeout_ms = ctrlr->timeout_ms;
 
 		{
@@ -147,22 +346,35 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 			return err;
 		}
 
-		_qpair.sq = cudamem_heap_block_alloc(heap, nbytes);
+		_qpair.sq = nvme_controller_cuda_ring_alloc(ctrlr, heap, opts->sq, nbytes,
+							    &sq_phys);
 		if (!_qpair.sq) {
 			err = -errno;
-			UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(sq); errno(%d)", err);
+			UPCIE_DEBUG("FAILED: nvme_controller_cuda_ring_alloc(sq); errno(%d)", err);
 			cuMemHostUnregister(_qpair.sqdb);
 			cuMemHostUnregister(_qpair.cqdb);
 			return err;
 		}
 
-		_qpair.cq = cudamem_heap_block_alloc(heap, nbytes);
+		_qpair.cq = nvme_controller_cuda_ring_alloc(ctrlr, heap, opts->cq, nbytes,
+							    &cq_phys);
 		if (!_qpair.cq) {
 			err = -errno;
-			UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(cq); errno(%d)", err);
+			UPCIE_DEBUG("FAILED: nvme_controller_cuda_ring_alloc(cq); errno(%d)", err);
+			cuMemHostUnregister(_qpair.sqdb);
+			cuMemHostUnregister(_qpair.cqdb);
+			nvme_controller_cuda_ring_free(ctrlr, heap, opts->sq, _qpair.sq);
+			return err;
+		}
+
+		err = nvme_controller_cuda_qpair_cids_alloc(&_qpair, heap);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_controller_cuda_qpair_cids_alloc(); err(%d)",
+				    err);
 			cuMemHostUnregister(_qpair.sqdb);
 			cuMemHostUnregister(_qpair.cqdb);
-			cudamem_heap_block_free(heap, _qpair.sq);
+			nvme_controller_cuda_ring_free(ctrlr, heap, opts->sq, _qpair.sq);
+			nvme_controller_cuda_ring_free(ctrlr, heap, opts->cq, _qpair.cq);
 			return err;
 		}
 
@@ -171,8 +383,9 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 			UPCIE_DEBUG("FAILED: cuMemcpyHtoD(host QP -> device QP); CUresult(%d)", err);
 			cuMemHostUnregister(_qpair.sqdb);
 			cuMemHostUnregister(_qpair.cqdb);
-			cudamem_heap_block_free(heap, _qpair.sq);
-			cudamem_heap_block_free(heap, _qpair.cq);
+			nvme_controller_cuda_ring_free(ctrlr, heap, opts->sq, _qpair.sq);
+			nvme_controller_cuda_ring_free(ctrlr, heap, opts->cq, _qpair.cq);
+			cudamem_heap_block_free(heap, _qpair.cpls);
 			return err;
 		}
 	}
@@ -182,7 +395,7 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 		struct nvme_completion cpl = {0};
 
 		cmd.opc = 0x5; ///< Create I/O Completion Queue
-		cmd.prp1 = cudamem_heap_block_vtp(heap, _qpair.cq);
+		cmd.prp1 = cq_phys;
 		cmd.cdw10 = ((depth - 1) << 16) | qid;
 		cmd.cdw11 = 0x1; ///< Physically contigous
 
@@ -198,7 +411,7 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 		struct nvme_completion cpl = {0};
 
 		cmd.opc = 0x1; ///< Create I/O Submission Queue
-		cmd.prp1 = cudamem_heap_block_vtp(heap, _qpair.sq);
+		cmd.prp1 = sq_phys;
 		cmd.cdw10 = ((depth - 1) << 16) | qid;
 		cmd.cdw11 = (qid << 16) | 0x1; ///< CQID and Physically contigous
 
@@ -210,4 +423,250 @@ nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Allocates a CUDA submission-queue, a CUDA completion-queue, and wraps them in
+ * the nvme_qpair struct
+ *
+ * Same as nvme_controller_cuda_create_io_qpair_opts(), with both queues in GPU memory.
+ *
+ * @param ctrlr Pointer to a pre-allocated NVMe controller
+ * @param qpair Pointer to a pre-allocated queue-pair (using CUDA)
+ * @param depth The queue depth
+ * @param heap Pointer to CUDA Heap
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult errors.
+ */
+static inline int
+nvme_controller_cuda_create_io_qpair(struct nvme_controller *ctrlr,
+                                     struct nvme_qpair_cuda *qpair, uint16_t depth,
+                                     struct cudamem_heap *heap)
+{
+	struct nvme_io_qpair_cuda_opts opts;
+
+	nvme_io_qpair_cuda_opts_init(&opts);
+
+	return nvme_controller_cuda_create_io_qpair_opts(ctrlr, qpair, depth, heap, &opts);
+}
+
+/**
+ * Create a persistent I/O engine for the given queue-pair, see nvme_engine_cuda.h
+ *
+ * The engine state, and a host-fed work queue, are allocated in mapped host memory; this relies
+ * on unified addressing, such that host and device pointers to it are the same. A kernel-fed
+ * work queue, and the per-CID state, are allocated from the heap.
+ *
+ * @param qpair Pointer to a queue-pair (from nvme_controller_cuda_create_io_qpair)
+ * @param nslots Number of slots of the work queue, a power-of-two
+ * @param host Whether the work queue is fed by host threads, or by kernels
+ * @param heap Pointer to CUDA Heap
+ * @param engine Pointer to store the engine; pass it to the kernel running nvme_engine_cuda_run()
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult
+ *         errors.
+ */
+static inline int
+nvme_controller_cuda_engine_create(struct nvme_qpair_cuda *qpair, uint32_t nslots, int host,
+				   struct cudamem_heap *heap, struct nvme_engine_cuda **engine)
+{
+	const size_t wq_nbytes = sizeof(struct nvme_engine_cuda_wq) +
+				 nslots * sizeof(struct nvme_engine_cuda_request);
+	struct nvme_qpair_cuda _qpair = {0};
+	struct nvme_engine_cuda *_engine;
+	struct nvme_engine_cuda_wq *wq;
+	CUdeviceptr dptr;
+	void *hptr;
+	int err;
+
+	if (!nslots || (nslots & (nslots - 1))) {
+		UPCIE_DEBUG("FAILED: nslots(%" PRIu32 ") is not a power-of-two", nslots);
+		return -EINVAL;
+	}
+
+	err = cuMemcpyDtoH(&_qpair, (CUdeviceptr)qpair, sizeof(_qpair));
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyDtoH(device QP -> host QP); CUresult(%d)", err);
+		return err;
+	}
+
+	err = cuMemHostAlloc(&hptr, sizeof(*_engine) + (host ? wq_nbytes : 0),
+			     CU_MEMHOSTALLOC_DEVICEMAP | CU_MEMHOSTALLOC_PORTABLE);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemHostAlloc(engine); CUresult(%d)", err);
+		return err;
+	}
+	memset(hptr, 0, sizeof(*_engine) + (host ? wq_nbytes : 0));
+
+	err = cuMemHostGetDevicePointer(&dptr, hptr, 0);
+	if (err || (void *)dptr != hptr) {
+		UPCIE_DEBUG("FAILED: cuMemHostGetDevicePointer(); CUresult(%d); no UVA", err);
+		cuMemFreeHost(hptr);
+		return err ? err : -ENOTSUP;
+	}
+
+	_engine = hptr;
+	_engine->qp = qpair;
+	_engine->host = host;
+
+	_engine->inflight = cudamem_heap_block_alloc(heap, _qpair.depth * (sizeof(int32_t *) +
+								       sizeof(uint16_t)));
+	if (!_engine->inflight) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(inflight); errno(%d)", err);
+		cuMemFreeHost(hptr);
+		return err;
+	}
+	_engine->cids = (uint16_t *)(_engine->inflight + _qpair.depth);
+
+	// The slots are free for the first lap, that is, seq == pos
+	wq = host ? (void *)(_engine + 1) : calloc(1, wq_nbytes);
+	if (!wq) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: calloc(wq); errno(%d)", err);
+		goto failed;
+	}
+	wq->nslots = nslots;
+	for (uint32_t i = 0; i < nslots; ++i) {
+		((struct nvme_engine_cuda_request *)(wq + 1))[i].seq = i;
+	}
+
+	if (host) {
+		wq->slots = (void *)(wq + 1);
+		_engine->wq = wq;
+		*engine = _engine;
+		return 0;
+	}
+
+	_engine->wq = cudamem_heap_block_alloc(heap, wq_nbytes);
+	if (!_engine->wq) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(wq); errno(%d)", err);
+		free(wq);
+		goto failed;
+	}
+	wq->slots = (void *)(_engine->wq + 1);
+
+	err = cuMemcpyHtoD((CUdeviceptr)_engine->wq, wq, wq_nbytes);
+	free(wq);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyHtoD(wq); CUresult(%d)", err);
+		cudamem_heap_block_free(heap, _engine->wq);
+		goto failed;
+	}
+
+	*engine = _engine;
+
+	return 0;
+
+failed:
+	cudamem_heap_block_free(heap, _engine->inflight);
+	cuMemFreeHost(hptr);
+
+	return err;
+}
+
+/**
+ * Destroy an engine created by nvme_controller_cuda_engine_create()
+ *
+ * The kernel running the engine must have returned, see nvme_engine_cuda_stop().
+ */
+static inline void
+nvme_controller_cuda_engine_destroy(struct nvme_engine_cuda *engine, struct cudamem_heap *heap)
+{
+	if (!engine) {
+		return;
+	}
+
+	if (!engine->host) {
+		cudamem_heap_block_free(heap, engine->wq);
+	}
+	cudamem_heap_block_free(heap, engine->inflight);
+	cuMemFreeHost(engine);
+}
+
+/**
+ * Attach a trace ring, from nvme_trace_ring_open(), to the given CUDA queue-pair
+ *
+ * The ring is re-initialized for the global timer of the GPU, and registered with CUDA; this
+ * requires unified addressing, as the device pointer of the ring must equal its host pointer.
+ * No kernel may be using the queue-pair while attaching or detaching.
+ *
+ * @param qpair Pointer to a queue-pair (from nvme_controller_cuda_create_io_qpair)
+ * @param ring The ring to record into
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult
+ *         errors.
+ */
+static inline int
+nvme_controller_cuda_trace_attach(struct nvme_qpair_cuda *qpair, struct nvme_trace_ring *ring)
+{
+	struct nvme_qpair_cuda _qpair = {0};
+	CUdeviceptr dptr;
+	int err;
+
+	err = cuMemcpyDtoH(&_qpair, (CUdeviceptr)qpair, sizeof(_qpair));
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyDtoH(device QP -> host QP); CUresult(%d)", err);
+		return err;
+	}
+	if (_qpair.trace) {
+		UPCIE_DEBUG("FAILED: a trace ring is already attached");
+		return -EBUSY;
+	}
+
+	nvme_trace_ring_init(ring, ring->nevents, NVME_TRACE_CLOCK_GLOBALTIMER);
+	ring->qid = _qpair.qid;
+
+	err = cuMemHostRegister(ring, nvme_trace_ring_nbytes(ring->nevents),
+				CU_MEMHOSTREGISTER_DEVICEMAP | CU_MEMHOSTREGISTER_PORTABLE);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemHostRegister(trace); CUresult(%d)", err);
+		return err;
+	}
+
+	err = cuMemHostGetDevicePointer(&dptr, ring, 0);
+	if (err || (void *)dptr != ring) {
+		UPCIE_DEBUG("FAILED: cuMemHostGetDevicePointer(); CUresult(%d), no UVA?", err);
+		cuMemHostUnregister(ring);
+		return err ? err : -ENOTSUP;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)qpair + offsetof(struct nvme_qpair_cuda, trace), &ring,
+			   sizeof(ring));
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyHtoD(trace); CUresult(%d)", err);
+		cuMemHostUnregister(ring);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Detach, and unregister, the trace ring of the given CUDA queue-pair; the ring is not unmapped
+ */
+static inline void
+nvme_controller_cuda_trace_detach(struct nvme_qpair_cuda *qpair)
+{
+	struct nvme_trace_ring *ring = NULL, *none = NULL;
+	int err;
+
+	err = cuMemcpyDtoH(&ring, (CUdeviceptr)qpair + offsetof(struct nvme_qpair_cuda, trace),
+			   sizeof(ring));
+	if (err || !ring) {
+		return;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)qpair + offsetof(struct nvme_qpair_cuda, trace),
+			   &none, sizeof(none));
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyHtoD(trace); CUresult(%d)", err);
+		return;
+	}
+
+	err = cuMemHostUnregister(ring);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemHostUnregister(trace); CUresult(%d)", err);
+	}
+}
@@ -6,11 +6,61 @@
 /**
  * VFIO NVMe Controller Extension
  * ==============================
- * 
+ *
+ * Interrupts
+ * ----------
+ *
+ * By default, the I/O queues are created with interrupts disabled, and completions are polled.
+ * With nvme_vfio_irqs_enable(), then MSI-X vectors are routed to eventfds, and I/O queue-pairs
+ * created via nvme_controller_create_io_qpair_vfio_irq() signal the eventfd of their vector, see
+ * nvme_irq.h for waiting on them.
+ *
+ * IOVA allocation
+ * ---------------
+ *
+ * The IOVA space of the container is managed by a first-fit allocator over a sorted array of free
+ * ranges, starting above the 32-bit range where the MSI window and other reserved regions live.
+ * The heap is mapped by vfio_map_heap() as a single range, thus, it is contiguous in IOVA space,
+ * and hostmem_dma_v2p() resolves to IOVAs, see hostmem_dma_v2iova(). Physical addresses are not
+ * used for DMA, thus, a heap attached via hostmem_heap_import() needs no CAP_SYS_ADMIN.
+ *
+ * Registration of application buffers
+ * -----------------------------------
+ *
+ * Memory outside of the heap, e.g. an mmap()'ed file or anonymous memory, is made available for
+ * DMA by nvme_vfio_register(), which maps it at an IOVA range of its own, giving zero-copy I/O
+ * without bouncing through the heap. The registrations are cached; nvme_vfio_unregister() drops a
+ * reference, and the mapping is kept until evicted by a new registration, or by
+ * nvme_vfio_reg_flush().
+ *
  * @file nvme_controller_vfio.h
  * @version 0.4.4
  */
 
+#define NVME_VFIO_IRQS_MAX 64
+#define NVME_VFIO_IOVA_BASE (1ULL << 32)  ///< Above the MSI window and other reserved ranges
+#define NVME_VFIO_IOVA_LIMIT (1ULL << 47) ///< Within the 48-bit address width of common IOMMUs
+#define NVME_VFIO_IOVA_RANGES 64          ///< Maximum number of free IOVA ranges
+#define NVME_VFIO_REGS_MAX 64             ///< Maximum number of cached buffer registrations
+
+/**
+ * A range of free IOVA space
+ */
+struct nvme_vfio_iova_range {
+	uint64_t iova;
+	uint64_t size;
+};
+
+/**
+ * An application buffer mapped, by nvme_vfio_register(), at an IOVA range of its own
+ */
+struct nvme_vfio_reg {
+	uintptr_t vaddr; ///< Page-aligned start of the mapping
+	uint64_t size;   ///< Page-aligned size of the mapping
+	uint64_t iova;
+	uint32_t refs; ///< Number of registrations using it; the mapping is kept, cached, at zero
+};
+
 /**
  * VFIO state needed to access a single NVMe controller from user space.
  */
@@ -21,6 +71,15 @@ struct vfio_ctx {
 	void *bar0;
 	size_t bar0_size;
 	int iommu_set;
+
+	int irq_fds[NVME_VFIO_IRQS_MAX]; ///< eventfd per MSI-X vector
+	int nirqs;                       ///< Number of MSI-X vectors routed to 'irq_fds'
+
+	struct hostmem_heap *heap; ///< The heap mapped by vfio_map_heap(); NULL when not mapped
+	struct nvme_vfio_iova_range iova_free[NVME_VFIO_IOVA_RANGES]; ///< Free IOVA space, sorted
+	int niova_free;
+	struct nvme_vfio_reg regs[NVME_VFIO_REGS_MAX]; ///< Cache of registered application buffers
+	int nregs;
 };
 
 static inline int
@@ -60,16 +119,645 @@ nvme_vfio_ctx_init(struct vfio_ctx *vfio)
 	vfio->device_fd = -1;
 	vfio->group.fd = -1;
 	vfio->container.fd = -1;
+	for (int i = 0; i < NVME_VFIO_IRQS_MAX; ++i) {
+		vfio->irq_fds[i] = -1;
+	}
+	vfio->iova_free[0].iova = NVME_VFIO_IOVA_BASE;
+	vfio->iova_free[0].size = NVME_VFIO_IOVA_LIMIT - NVME_VFIO_IOVA_BASE;
+	vfio->niova_free = 1;
+}
+
+/**
+ * Stop routing MSI-X vectors to eventfds and close the eventfds
+ */
+static inline void
+nvme_vfio_irqs_disable(struct vfio_ctx *vfio)
+{
+	struct vfio_device dev = {.fd = vfio->device_fd};
+
+	if (vfio->nirqs && vfio->device_fd >= 0) {
+		struct vfio_irq_set irq_set = {0};
+
+		irq_set.argsz = sizeof(irq_set);
+		irq_set.flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER;
+		irq_set.index = VFIO_PCI_MSIX_IRQ_INDEX;
+		irq_set.start = 0;
+		irq_set.count = 0;
+
+		if (vfio_device_set_irqs(&dev, &irq_set) < 0) {
+			UPCIE_DEBUG("FAILED: vfio_device_set_irqs(disable); errno(%d)", errno);
+		}
+	}
+
+	for (int i = 0; i < NVME_VFIO_IRQS_MAX; ++i) {
+		if (vfio->irq_fds[i] >= 0) {
+			close(vfio->irq_fds[i]);
+		}
+		vfio->irq_fds[i] = -1;
+	}
+	vfio->nirqs = 0;
+}
+
+/**
+ * Route up to `nirqs` MSI-X vectors of the device to non-blocking eventfds
+ *
+ * Vector 0 is shared with the admin completion queue, thus, this needs at least two vectors to
+ * give I/O queues a vector of their own. The number of vectors routed is capped by what the
+ * device supports and NVME_VFIO_IRQS_MAX.
+ *
+ * @return On success, the number of vectors routed is returned. On error, negative errno is
+ *         returned to indicate the error.
+ */
+static inline int
+nvme_vfio_irqs_enable(struct vfio_ctx *vfio, int nirqs)
+{
+	struct vfio_device dev = {.fd = vfio->device_fd};
+	struct vfio_irq_info irq = {0};
+	struct vfio_irq_set *irq_set;
+	size_t nbytes;
+	int err;
+
+	irq.index = VFIO_PCI_MSIX_IRQ_INDEX;
+	err = vfio_device_get_irq_info(&dev, &irq);
+	if (err < 0) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: vfio_device_get_irq_info(MSIX); err(%d)", err);
+		return err;
+	}
+	if (!irq.count || !(irq.flags & VFIO_IRQ_INFO_EVENTFD)) {
+		UPCIE_DEBUG("FAILED: MSI-X with eventfd not supported");
+		return -ENOTSUP;
+	}
+
+	if (nirqs > (int)irq.count) {
+		nirqs = irq.count;
+	}
+	if (nirqs > NVME_VFIO_IRQS_MAX) {
+		nirqs = NVME_VFIO_IRQS_MAX;
+	}
+	if (nirqs < 1) {
+		return -EINVAL;
+	}
+
+	nbytes = sizeof(*irq_set) + nirqs * sizeof(int32_t);
+	irq_set = calloc(1, nbytes);
+	if (!irq_set) {
+		return -errno;
+	}
+
+	for (int i = 0; i < nirqs; ++i) {
+		vfio->irq_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (vfio->irq_fds[i] < 0) {
+			err = -errno;
+			UPCIE_DEBUG("FAILED: eventfd(); err(%d)", err);
+			goto fail;
+		}
+	}
+
+	irq_set->argsz = nbytes;
+	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+	irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
+	irq_set->start = 0;
+	irq_set->count = nirqs;
+	memcpy(irq_set->data, vfio->irq_fds, nirqs * sizeof(int32_t));
+
+	if (vfio_device_set_irqs(&dev, irq_set) < 0) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: vfio_device_set_irqs(MSIX); err(%d)", err);
+		goto fail;
+	}
+	vfio->nirqs = nirqs;
+
+	free(irq_set);
+
+	return nirqs;
+
+fail:
+	free(irq_set);
+	nvme_vfio_irqs_disable(vfio);
+
+	return err;
+}
+
+/**
+ * Remove [iova, iova + size) from the free IOVA range at index `i`, which must contain it
+ */
+static inline int
+nvme_vfio_iova_take(struct vfio_ctx *vfio, int i, uint64_t iova, uint64_t size)
+{
+	struct nvme_vfio_iova_range *range = &vfio->iova_free[i];
+	const uint64_t head = iova - range->iova;
+	const uint64_t tail = range->iova + range->size - (iova + size);
+
+	if (head && tail) {
+		if (vfio->niova_free == NVME_VFIO_IOVA_RANGES) {
+			UPCIE_DEBUG("FAILED: free IOVA ranges exhausted");
+			return -ENOMEM;
+		}
+		memmove(range + 1, range, (vfio->niova_free - i) * sizeof(*range));
+		vfio->niova_free += 1;
+		range[0].size = head;
+		range[1].iova = iova + size;
+		range[1].size = tail;
+	} else if (head) {
+		range->size = head;
+	} else if (tail) {
+		range->iova = iova + size;
+		range->size = tail;
+	} else {
+		memmove(range, range + 1, (vfio->niova_free - i - 1) * sizeof(*range));
+		vfio->niova_free -= 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocate `size` bytes of IOVA space, aligned to `align`, a power-of-two; first-fit
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_vfio_iova_alloc(struct vfio_ctx *vfio, uint64_t size, uint64_t align, uint64_t *iova)
+{
+	for (int i = 0; i < vfio->niova_free; ++i) {
+		struct nvme_vfio_iova_range *range = &vfio->iova_free[i];
+		uint64_t start = (range->iova + align - 1) & ~(align - 1);
+		int err;
+
+		if (start + size > range->iova + range->size) {
+			continue;
+		}
+
+		err = nvme_vfio_iova_take(vfio, i, start, size);
+		if (err) {
+			return err;
+		}
+		*iova = start;
+
+		return 0;
+	}
+
+	UPCIE_DEBUG("FAILED: no free IOVA range of size(%" PRIu64 ")", size);
+
+	return -ENOMEM;
+}
+
+/**
+ * Allocate the IOVA range [iova, iova + size); e.g. to map a heap at the same IOVA everywhere
+ */
+static inline int
+nvme_vfio_iova_alloc_at(struct vfio_ctx *vfio, uint64_t iova, uint64_t size)
+{
+	for (int i = 0; i < vfio->niova_free; ++i) {
+		struct nvme_vfio_iova_range *range = &vfio->iova_free[i];
+
+		if (iova >= range->iova && iova + size <= range->iova + range->size) {
+			return nvme_vfio_iova_take(vfio, i, iova, size);
+		}
+	}
+
+	UPCIE_DEBUG("FAILED: iova(0x%" PRIx64 ") size(%" PRIu64 ") is not free", iova, size);
+
+	return -EBUSY;
+}
+
+/**
+ * Return [iova, iova + size) to the free IOVA space, merging it with adjacent free ranges
+ */
+static inline void
+nvme_vfio_iova_free(struct vfio_ctx *vfio, uint64_t iova, uint64_t size)
+{
+	struct nvme_vfio_iova_range *range;
+	int i = 0;
+
+	while (i < vfio->niova_free && vfio->iova_free[i].iova < iova) {
+		i++;
+	}
+	range = &vfio->iova_free[i];
+
+	if (i && range[-1].iova + range[-1].size == iova) {
+		range[-1].size += size;
+		if (i < vfio->niova_free && iova + size == range->iova) {
+			range[-1].size += range->size;
+			memmove(range, range + 1, (vfio->niova_free - i - 1) * sizeof(*range));
+			vfio->niova_free -= 1;
+		}
+		return;
+	}
+	if (i < vfio->niova_free && iova + size == range->iova) {
+		range->iova = iova;
+		range->size += size;
+		return;
+	}
+
+	if (vfio->niova_free == NVME_VFIO_IOVA_RANGES) {
+		UPCIE_DEBUG("FAILED: IOVA ranges exhausted; leaking iova(0x%" PRIx64 ")", iova);
+		return;
+	}
+	memmove(range + 1, range, (vfio->niova_free - i) * sizeof(*range));
+	vfio->niova_free += 1;
+	range->iova = iova;
+	range->size = size;
+}
+
+static inline int
+nvme_vfio_dma_map(struct vfio_ctx *vfio, uintptr_t vaddr, uint64_t iova, uint64_t size)
+{
+	struct vfio_iommu_type1_dma_map map = {0};
+
+	map.argsz = sizeof(map);
+	map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
+	map.vaddr = vaddr;
+	map.iova = iova;
+	map.size = size;
+
+	if (vfio_iommu_map_dma(&vfio->container, &map) < 0) {
+		UPCIE_DEBUG("FAILED: vfio_iommu_map_dma(); errno(%d)", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static inline int
+nvme_vfio_dma_unmap(struct vfio_ctx *vfio, uint64_t iova, uint64_t size)
+{
+	struct vfio_iommu_type1_dma_unmap unmap = {0};
+
+	unmap.argsz = sizeof(unmap);
+	unmap.iova = iova;
+	unmap.size = size;
+
+	if (vfio_iommu_unmap_dma(&vfio->container, &unmap) < 0) {
+		UPCIE_DEBUG("FAILED: vfio_iommu_unmap_dma(); errno(%d)", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Map, or unmap, an extent of a growable heap; the heap->extent_cb installed by vfio_map_heap()
+ */
+static inline int
+nvme_vfio_heap_extent_cb(struct hostmem_heap *heap, uint64_t offset, uint64_t size, int commit,
+			 void *arg)
+{
+	struct vfio_ctx *vfio = arg;
+
+	if (commit) {
+		return nvme_vfio_dma_map(vfio, (uintptr_t)heap->memory.virt + offset,
+					 heap->iova_base + offset, size);
+	}
+
+	return nvme_vfio_dma_unmap(vfio, heap->iova_base + offset, size);
+}
+
+/**
+ * Map, or unmap, the committed extents of a growable heap, and install, or remove, the callback
+ * mapping, and unmapping, the extents committed, and released, thereafter
+ */
+static inline int
+nvme_vfio_heap_extents(struct vfio_ctx *vfio, struct hostmem_heap *heap, int commit)
+{
+	struct hostmem_heap_desc *desc = heap->desc;
+	int err = 0, ret = 0;
+	uint32_t k;
+
+	hostmem_heap_lock(heap);
+
+	for (k = 0; k < desc->nextents; ++k) {
+		if (!(desc->extents & ((uint64_t)1 << k))) {
+			continue;
+		}
+
+		ret = nvme_vfio_heap_extent_cb(heap, desc->extents_base + k * desc->extent_size,
+					       desc->extent_size, commit, vfio);
+		if (ret && commit) {
+			break;
+		}
+		if (ret && !err) {
+			err = ret;
+		}
+	}
+
+	if (commit && k < desc->nextents) {
+		// Undo the mappings of the extents below the one failing
+		while (k--) {
+			uint64_t offset = desc->extents_base + k * desc->extent_size;
+
+			if (desc->extents & ((uint64_t)1 << k)) {
+				nvme_vfio_heap_extent_cb(heap, offset, desc->extent_size, 0, vfio);
+			}
+		}
+		err = ret;
+	} else {
+		heap->extent_cb = commit ? nvme_vfio_heap_extent_cb : NULL;
+		heap->extent_cb_arg = commit ? vfio : NULL;
+	}
+
+	hostmem_heap_unlock(heap);
+
+	return err;
+}
+
+/**
+ * Map the hugepage-backed heap into the VFIO IOMMU domain.
+ *
+ * The heap is mapped as a single range, at an IOVA allocated from the container, thus, the heap
+ * is contiguous in IOVA space. The IOVAs become the bus addresses of the heap, that is, what
+ * hostmem_dma_v2p() resolves to, such that the NVMe code paths for SQ/CQ/PRP DMA addresses work
+ * as-is. A heap mapped into multiple containers is given the same IOVA in each of them.
+ *
+ * Of a growable heap, see hostmem_heap_init_growable(), the IOVA range is allocated for its
+ * maximum size, while only the committed extents are mapped; extents committed, or released,
+ * later are mapped, or unmapped, via heap->extent_cb. Thus, a growable heap can only be mapped
+ * into a single container.
+ */
+static inline int
+vfio_map_heap(struct vfio_ctx *vfio, struct hostmem_heap *heap)
+{
+	const uint64_t size = heap->memory.size;
+	const int growable = heap->desc->extent_size != 0;
+	uint64_t iova = heap->iova_base;
+	int err;
+
+	if (vfio->heap) {
+		UPCIE_DEBUG("FAILED: a heap is already mapped");
+		return -EEXIST;
+	}
+	if (growable && heap->iova_refs) {
+		UPCIE_DEBUG("FAILED: growable heap is already mapped by another container");
+		return -EBUSY;
+	}
+
+	if (heap->iova_refs) {
+		err = nvme_vfio_iova_alloc_at(vfio, iova, size);
+	} else {
+		err = nvme_vfio_iova_alloc(vfio, size, heap->config->hugepgsz, &iova);
+	}
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_vfio_iova_alloc(); err(%d)", err);
+		return err;
+	}
+
+	if (!heap->iova_refs) {
+		heap->iova_lut = calloc(heap->nphys, sizeof(*heap->iova_lut));
+		if (!heap->iova_lut) {
+			err = -errno;
+			UPCIE_DEBUG("FAILED: calloc(iova_lut); err(%d)", err);
+			nvme_vfio_iova_free(vfio, iova, size);
+			return err;
+		}
+		for (size_t i = 0; i < heap->nphys; ++i) {
+			heap->iova_lut[i] = iova + ((uint64_t)i << heap->config->hugepgsz_shift);
+		}
+		heap->iova_base = iova;
+	}
+
+	if (growable) {
+		err = nvme_vfio_heap_extents(vfio, heap, 1);
+	} else {
+		err = nvme_vfio_dma_map(vfio, (uintptr_t)heap->memory.virt, iova, size);
+	}
+	if (err) {
+		nvme_vfio_iova_free(vfio, iova, size);
+		if (!heap->iova_refs) {
+			free(heap->iova_lut);
+			heap->iova_lut = NULL;
+			heap->iova_base = 0;
+		}
+		return err;
+	}
+
+	heap->dma_lut = heap->iova_lut;
+	heap->iova_refs += 1;
+	vfio->heap = heap;
+
+	return 0;
+}
+
+/**
+ * Undo vfio_map_heap(); once unmapped from all containers, the bus addresses are physical again
+ */
+static inline int
+vfio_unmap_heap(struct vfio_ctx *vfio)
+{
+	struct hostmem_heap *heap = vfio->heap;
+	int err;
+
+	if (!heap) {
+		return 0;
+	}
+
+	if (heap->desc->extent_size) {
+		err = nvme_vfio_heap_extents(vfio, heap, 0);
+	} else {
+		err = nvme_vfio_dma_unmap(vfio, heap->iova_base, heap->memory.size);
+	}
+	nvme_vfio_iova_free(vfio, heap->iova_base, heap->memory.size);
+
+	heap->iova_refs -= 1;
+	if (!heap->iova_refs) {
+		heap->dma_lut = heap->phys_lut;
+		free(heap->iova_lut);
+		heap->iova_lut = NULL;
+		heap->iova_base = 0;
+	}
+	vfio->heap = NULL;
+
+	return err;
+}
+
+/**
+ * Returns the index of the registration containing [vaddr, vaddr + size), or -1 when none does
+ */
+static inline int
+nvme_vfio_reg_find(struct vfio_ctx *vfio, uintptr_t vaddr, size_t size)
+{
+	for (int i = 0; i < vfio->nregs; ++i) {
+		struct nvme_vfio_reg *reg = &vfio->regs[i];
+
+		if (vaddr >= reg->vaddr && vaddr + size <= reg->vaddr + reg->size) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Unmap the registration at index `i`, and remove it from the cache
+ */
+static inline int
+nvme_vfio_reg_evict(struct vfio_ctx *vfio, int i)
+{
+	struct nvme_vfio_reg *reg = &vfio->regs[i];
+	int err;
+
+	err = nvme_vfio_dma_unmap(vfio, reg->iova, reg->size);
+	nvme_vfio_iova_free(vfio, reg->iova, reg->size);
+
+	vfio->nregs -= 1;
+	*reg = vfio->regs[vfio->nregs];
+
+	return err;
+}
+
+/**
+ * Unmap all cached registrations which are no longer referenced
+ *
+ * Call this before unmapping, or otherwise repurposing, memory which has been registered, as the
+ * cache keeps the pages pinned and mapped.
+ */
+static inline int
+nvme_vfio_reg_flush(struct vfio_ctx *vfio)
+{
+	int err = 0;
+
+	// Backwards, as eviction moves the last registration into the evicted slot
+	for (int i = vfio->nregs - 1; i >= 0; --i) {
+		if (!vfio->regs[i].refs) {
+			int ret = nvme_vfio_reg_evict(vfio, i);
+
+			if (ret && !err) {
+				err = ret;
+			}
+		}
+	}
+
+	return err;
+}
+
+/**
+ * Register an application buffer for DMA, e.g. an mmap()'ed file, or anonymous memory
+ *
+ * The pages of the buffer are pinned, and mapped into the IOMMU domain at an IOVA range of their
+ * own, thus, the buffer is contiguous in IOVA space, and PRPs can be built with
+ * nvme_request_prep_command_prps_phys(). A buffer within an existing registration is served from
+ * the cache, without a call into the kernel. When the cache is full, then an unreferenced
+ * registration is evicted.
+ *
+ * @param vfio The VFIO context of the controller
+ * @param vaddr Start of the buffer
+ * @param size Size of the buffer, in bytes
+ * @param iova Pointer to store the IOVA of `vaddr`
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_vfio_register(struct vfio_ctx *vfio, void *vaddr, size_t size, uint64_t *iova)
+{
+	const uintptr_t pmask = (uintptr_t)getpagesize() - 1;
+	struct nvme_vfio_reg *reg;
+	uintptr_t start, end;
+	int i, err;
+
+	if (!vaddr || !size || !iova || !vfio->iommu_set) {
+		return -EINVAL;
+	}
+
+	i = nvme_vfio_reg_find(vfio, (uintptr_t)vaddr, size);
+	if (i >= 0) {
+		reg = &vfio->regs[i];
+		reg->refs += 1;
+		*iova = reg->iova + ((uintptr_t)vaddr - reg->vaddr);
+		return 0;
+	}
+
+	if (vfio->nregs == NVME_VFIO_REGS_MAX) {
+		for (i = 0; i < vfio->nregs && vfio->regs[i].refs; ++i) {
+			;
+		}
+		if (i == vfio->nregs) {
+			UPCIE_DEBUG("FAILED: all NVME_VFIO_REGS_MAX(%d) registrations are in use",
+				    NVME_VFIO_REGS_MAX);
+			return -ENOMEM;
+		}
+		nvme_vfio_reg_evict(vfio, i);
+	}
+
+	start = (uintptr_t)vaddr & ~pmask;
+	end = ((uintptr_t)vaddr + size + pmask) & ~pmask;
+	reg = &vfio->regs[vfio->nregs];
+
+	err = nvme_vfio_iova_alloc(vfio, end - start, pmask + 1, &reg->iova);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_vfio_iova_alloc(); err(%d)", err);
+		return err;
+	}
+
+	err = nvme_vfio_dma_map(vfio, start, reg->iova, end - start);
+	if (err) {
+		nvme_vfio_iova_free(vfio, reg->iova, end - start);
+		return err;
+	}
+
+	reg->vaddr = start;
+	reg->size = end - start;
+	reg->refs = 1;
+	vfio->nregs += 1;
+
+	*iova = reg->iova + ((uintptr_t)vaddr - start);
+
+	return 0;
+}
+
+/**
+ * Drop a registration made by nvme_vfio_register(); the mapping is kept in the cache
+ *
+ * @return On success 0 is returned. When the buffer is not registered, then -ENOENT is returned.
+ */
+static inline int
+nvme_vfio_unregister(struct vfio_ctx *vfio, void *vaddr, size_t size)
+{
+	int i = nvme_vfio_reg_find(vfio, (uintptr_t)vaddr, size);
+
+	if (i < 0 || !vfio->regs[i].refs) {
+		return -ENOENT;
+	}
+	vfio->regs[i].refs -= 1;
+
+	return 0;
 }
 
 /**
- * Release VFIO resources and undo DMA mappings created for the heap.
+ * Resolve the IOVA of `virt`, within the mapped heap, or within a registered buffer
+ *
+ * @return On success 0 is returned. When `virt` is not mapped, then -ENOENT is returned.
  */
 static inline int
-nvme_vfio_ctx_close(struct vfio_ctx *vfio, struct hostmem_heap *heap)
+nvme_vfio_v2iova(struct vfio_ctx *vfio, void *virt, uint64_t *iova)
+{
+	struct hostmem_heap *heap = vfio->heap;
+	int i;
+
+	if (heap && (char *)virt >= (char *)heap->memory.virt &&
+	    (char *)virt < (char *)heap->memory.virt + heap->memory.size) {
+		*iova = hostmem_dma_v2iova(heap, virt);
+		return 0;
+	}
+
+	i = nvme_vfio_reg_find(vfio, (uintptr_t)virt, 1);
+	if (i < 0) {
+		return -ENOENT;
+	}
+	*iova = vfio->regs[i].iova + ((uintptr_t)virt - vfio->regs[i].vaddr);
+
+	return 0;
+}
+
+/**
+ * Release VFIO resources and undo the DMA mappings of the heap and of the registered buffers.
+ */
+static inline int
+nvme_vfio_ctx_close(struct vfio_ctx *vfio)
 {
 	int err = 0;
 
+	nvme_vfio_irqs_disable(vfio);
+
 	if (vfio->bar0 && vfio->bar0_size) {
 		munmap(vfio->bar0, vfio->bar0_size);
 	}
@@ -78,18 +766,20 @@ nvme_vfio_ctx_close(struct vfio_ctx *vfio, struct hostmem_heap *heap)
 		close(vfio->device_fd);
 	}
 
-	if (heap && vfio->iommu_set) {
-		for (size_t i = 0; i < heap->nphys; ++i) {
-			struct vfio_iommu_type1_dma_unmap unmap = {0};
-
-			unmap.argsz = sizeof(unmap);
-			unmap.iova = heap->phys_lut[i];
-			unmap.size = heap->config->hugepgsz;
+	if (vfio->iommu_set) {
+		int ret;
 
-			if (vfio_iommu_unmap_dma(&vfio->container, &unmap) < 0 && !err) {
-				err = -errno;
+		while (vfio->nregs) {
+			ret = nvme_vfio_reg_evict(vfio, vfio->nregs - 1);
+			if (ret && !err) {
+				err = ret;
 			}
 		}
+
+		ret = vfio_unmap_heap(vfio);
+		if (ret && !err) {
+			err = ret;
+		}
 	}
 
 	if (vfio->group.fd >= 0) {
@@ -139,7 +829,9 @@ nvme_controller_close_vfio(struct nvme_controller *ctrlr, struct vfio_ctx *vfio)
 		ctrlr->buf = NULL;
 	}
 
-	close_err = nvme_vfio_ctx_close(vfio, ctrlr->heap);
+	nvme_controller_dbbuf_term(ctrlr);
+
+	close_err = nvme_vfio_ctx_close(vfio);
 	if (close_err && !err) {
 		err = close_err;
 	}
@@ -176,38 +868,6 @@ vfio_device_get_iommu_group_id(const char *bdf, int *group_id)
 	return 0;
 }
 
-/**
- * Map the hugepage-backed heap into the VFIO IOMMU domain.
- *
- * The current implementation intentionally uses `iova == phys` for each hugepage.
- * This keeps the existing NVMe code paths working because they already pass
- * hostmem_dma_v2p() results to the controller for SQ/CQ/PRP DMA addresses.
- *
- * TODO: decouple IOVA from physical addresses by introducing a dedicated
- *       hostmem_dma_v2iova() path for VFIO-backed DMA.
- */
-static inline int
-vfio_map_heap(struct vfio_ctx *vfio, struct hostmem_heap *heap)
-{
-	for (size_t i = 0; i < heap->nphys; ++i) {
-		struct vfio_iommu_type1_dma_map map = {0};
-		void *vaddr = (uint8_t *)heap->memory.virt + (i * heap->config->hugepgsz);
-
-		map.argsz = sizeof(map);
-		map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
-		map.vaddr = (uintptr_t)vaddr;
-		map.iova = heap->phys_lut[i];
-		map.size = heap->config->hugepgsz;
-
-		if (vfio_iommu_map_dma(&vfio->container, &map) < 0) {
-			UPCIE_DEBUG("FAILED: vfio_iommu_map_dma(); errno(%d)", errno);
-			return -errno;
-		}
-	}
-
-	return 0;
-}
-
 /**
  * Open an NVMe controller through VFIO.
  *
@@ -237,6 +897,7 @@ nvme_controller_open_vfio(struct nvme_controller *ctrlr, struct vfio_ctx *vfio,
 	memset(ctrlr->buf, 0, 4096);
 
 	nvme_qid_bitmap_init(ctrlr->qids);
+	nvme_controller_aborts_init(ctrlr);
 
 	// Set up VFIO resources
 	err = vfio_device_get_iommu_group_id(bdf, &group_id);
@@ -363,23 +1024,7 @@ nvme_controller_open_vfio(struct nvme_controller *ctrlr, struct vfio_ctx *vfio,
 		goto fail;
 	}
 
-	nvme_mmio_aq_setup(bar0, hostmem_dma_v2p(heap, ctrlr->aq.sq),
-			   hostmem_dma_v2p(heap, ctrlr->aq.cq), ctrlr->aq.depth);
-
-	{
-		uint32_t css = (nvme_reg_cap_get_css(cap) & (1 << 6)) ? 0x6 : 0x0;
-		uint32_t cc = 0;
-
-		cc = nvme_reg_cc_set_css(cc, css);
-		cc = nvme_reg_cc_set_shn(cc, 0x0);
-		cc = nvme_reg_cc_set_mps(cc, 0x0);
-		cc = nvme_reg_cc_set_ams(cc, 0x0);
-		cc = nvme_reg_cc_set_iosqes(cc, 6);
-		cc = nvme_reg_cc_set_iocqes(cc, 4);
-		cc = nvme_reg_cc_set_en(cc, 0x1);
-
-		nvme_mmio_cc_write(bar0, cc);
-	}
+	nvme_controller_aq_enable(ctrlr);
 
 	err = nvme_mmio_csts_wait_until_ready(bar0, ctrlr->timeout_ms);
 	if (err) {
@@ -387,6 +1032,12 @@ nvme_controller_open_vfio(struct nvme_controller *ctrlr, struct vfio_ctx *vfio,
 		goto fail;
 	}
 
+	err = nvme_controller_setup(ctrlr);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_controller_setup(); err(%d)", err);
+		goto fail;
+	}
+
 	return 0;
 
 fail:
@@ -394,3 +1045,37 @@ fail:
 
 	return err;
 }
+
+/**
+ * Create an I/O queue-pair with the completion-queue signalling an MSI-X vector
+ *
+ * The vectors routed by nvme_vfio_irqs_enable(), except vector 0 of the admin queue, are assigned
+ * round-robin by queue identifier; the eventfd of the vector is available as
+ * nvme_qpair->irq_fd. When only a single vector is routed, then it is shared with the admin queue.
+ */
+static inline int
+nvme_controller_create_io_qpair_vfio_irq(struct nvme_controller *ctrlr, struct vfio_ctx *vfio,
+					 struct nvme_qpair *qpair, uint16_t depth)
+{
+	struct nvme_io_qpair_opts opts;
+	int qid, vector;
+
+	if (!vfio->nirqs) {
+		UPCIE_DEBUG("FAILED: no MSI-X vectors; see nvme_vfio_irqs_enable()");
+		return -EINVAL;
+	}
+
+	// The qid is allocated here, and handed to the qpair, as the vector is chosen by it
+	qid = nvme_controller_qid_alloc(ctrlr);
+	if (qid < 0) {
+		return qid;
+	}
+	vector = (vfio->nirqs > 1) ? 1 + ((qid - 1) % (vfio->nirqs - 1)) : 0;
+
+	nvme_io_qpair_opts_init(&opts);
+	opts.irq_vector = vector;
+	opts.irq_fd = vfio->irq_fds[vector];
+	opts.qid = qid;
+
+	return nvme_controller_create_io_qpair_opts(ctrlr, qpair, depth, &opts);
+}
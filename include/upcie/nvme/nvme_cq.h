@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Completion Queues shared by multiple Submission Queues
+ * ======================================================
+ *
+ * A 'struct nvme_cq' is an I/O CQ on its own, created via nvme_controller_create_io_cq(), to
+ * which the SQs of multiple qpairs complete, each created via nvme_controller_create_io_sq().
+ * Thus, a thread driving an SQ per priority class, or per tenant, polls a single CQ, instead of
+ * one per SQ, touching a single CQ, and writing a single CQ doorbell, per batch of completions.
+ *
+ * Each SQ keeps its own request-pool, hence, its own cids; a completion is routed back to the
+ * qpair of its SQ by the `sqid` of the completion, and then to its request by the `cid`. The
+ * qpair of the previous completion is tried first, as completions tend to come in runs from the
+ * same SQ, then the, at most NVME_CQ_SQS_MAX, SQs attached are searched.
+ *
+ * As for the qpairs, the CQ and its SQs are single-threaded; the SQs of a CQ are driven by the
+ * thread processing the CQ.
+ *
+ * @file nvme_cq.h
+ * @version 0.4.4
+ */
+
+#define NVME_CQ_SQS_MAX 64 ///< SQs attached to a CQ at most
+
+struct nvme_cq {
+	void *cq;       ///< VA-Pointer to DMA-capable memory backing the Completion Queue (CQ)
+	void *cqdb;     ///< Pointer to Completion Queue Doorbell Register in bar0
+	uint32_t qid;   ///< The queue-id of the CQ, the CQID given when creating its SQs
+	uint16_t depth; ///< Length of the CQ
+	uint16_t head;  ///< Completion Queue Head Pointer
+	uint8_t phase;
+	uint8_t rsvd;
+	uint16_t nsqs; ///< Number of SQs attached
+
+	int irq_fd;     ///< eventfd signalled by the MSI-X vector of the CQ; -1 when only polled
+	int irq_vector; ///< MSI-X vector of the CQ; -1 when interrupts are disabled
+
+	volatile uint32_t *dbbuf_cqdb; ///< Shadow CQ head doorbell; NULL when not attached
+	volatile uint32_t *dbbuf_cqei; ///< EventIdx of the CQ head doorbell
+
+	struct hostmem_heap *heap; ///< For allocation / free of DMA-capable CQ entries
+
+	uint64_t nreaped;   ///< Completions processed
+	uint64_t nunrouted; ///< Completions of an SQ which is not attached; dropped
+
+	struct nvme_qpair *last;                 ///< Qpair of the previous completion
+	struct nvme_qpair *sqs[NVME_CQ_SQS_MAX]; ///< Qpairs whose SQ completes to the CQ
+};
+
+static inline int
+nvme_cq_pr(struct nvme_cq *cq)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_cq:\n");
+	wrtn += printf("  qid: %" PRIu32 "\n", cq->qid);
+	wrtn += printf("  depth: %" PRIu16 "\n", cq->depth);
+	wrtn += printf("  nsqs: %" PRIu16 "\n", cq->nsqs);
+	wrtn += printf("  sqids: [");
+	for (uint16_t i = 0; i < cq->nsqs; ++i) {
+		wrtn += printf("%s%" PRIu32, i ? ", " : "", cq->sqs[i]->qid);
+	}
+	wrtn += printf("]\n");
+	wrtn += printf("  nreaped: %" PRIu64 "\n", cq->nreaped);
+	wrtn += printf("  nunrouted: %" PRIu64 "\n", cq->nunrouted);
+
+	return wrtn;
+}
+
+static inline void
+nvme_cq_term(struct nvme_cq *cq)
+{
+	hostmem_dma_free(cq->heap, cq->cq);
+	cq->cq = NULL;
+}
+
+/**
+ * Initialize a CQ of `depth` entries, with the CQ doorbell of `qid`, rounded up to the page size
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_cq_init(struct nvme_cq *cq, uint32_t qid, uint16_t depth, uint8_t *bar0,
+	     struct hostmem_heap *heap)
+{
+	int dstrd = nvme_reg_cap_get_dstrd(nvme_mmio_cap_read(bar0));
+	size_t pagesize = heap->config->pagesize;
+	size_t cq_nbytes = (((size_t)depth * 16) + pagesize - 1) & ~(pagesize - 1);
+
+	memset(cq, 0, sizeof(*cq));
+	cq->heap = heap;
+	cq->cqdb = bar0 + 0x1000 + ((2 * qid + 1) << (2 + dstrd));
+	cq->qid = qid;
+	cq->depth = depth;
+	cq->phase = 1;
+	cq->irq_fd = -1;
+	cq->irq_vector = -1;
+
+	cq->cq = hostmem_dma_alloc_array(heap, 1, cq_nbytes);
+	if (!cq->cq) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(cq); errno(%d)", errno);
+		return -errno;
+	}
+	memset(cq->cq, 0, cq_nbytes);
+
+	return 0;
+}
+
+/**
+ * Attach the CQ to the shadow doorbell and EventIdx buffers; see nvme_qpair_dbbuf_attach()
+ */
+static inline void
+nvme_cq_dbbuf_attach(struct nvme_cq *cq, uint8_t *bar0, void *dbs, void *eis)
+{
+	int dstrd = nvme_reg_cap_get_dstrd(nvme_mmio_cap_read(bar0));
+	size_t cq_idx = (2 * cq->qid + 1) << dstrd;
+
+	cq->dbbuf_cqdb = (uint32_t *)dbs + cq_idx;
+	cq->dbbuf_cqei = (uint32_t *)eis + cq_idx;
+
+	*cq->dbbuf_cqdb = 0;
+	*cq->dbbuf_cqei = 0;
+}
+
+static inline void
+nvme_cq_dbbuf_detach(struct nvme_cq *cq)
+{
+	if (!cq->dbbuf_cqdb) {
+		return;
+	}
+
+	*cq->dbbuf_cqdb = 0;
+	*cq->dbbuf_cqei = 0;
+
+	cq->dbbuf_cqdb = NULL;
+	cq->dbbuf_cqei = NULL;
+}
+
+/**
+ * Attach the SQ of the qpair to the CQ, releasing the CQ memory of the qpair, if any
+ *
+ * Must be done after nvme_qpair_init_sq(), or nvme_qpair_init(), and before the SQ is created on
+ * the controller, with the qid of the CQ as its CQID; see nvme_controller_create_io_sq().
+ *
+ * @return On success 0 is returned. When NVME_CQ_SQS_MAX SQs are attached, -ENOSPC is returned.
+ */
+static inline int
+nvme_cq_attach(struct nvme_cq *cq, struct nvme_qpair *qp)
+{
+	if (cq->nsqs == NVME_CQ_SQS_MAX) {
+		return -ENOSPC;
+	}
+	cq->sqs[cq->nsqs++] = qp;
+
+	hostmem_dma_free(qp->heap, qp->cq);
+	qp->cq = NULL;
+	qp->shcq = cq;
+
+	return 0;
+}
+
+/**
+ * Detach the SQ of the qpair from the CQ, once the SQ is deleted from the controller
+ */
+static inline void
+nvme_cq_detach(struct nvme_cq *cq, struct nvme_qpair *qp)
+{
+	for (uint16_t i = 0; i < cq->nsqs; ++i) {
+		if (cq->sqs[i] == qp) {
+			cq->sqs[i] = cq->sqs[--cq->nsqs];
+			break;
+		}
+	}
+	if (cq->last == qp) {
+		cq->last = NULL;
+	}
+	qp->shcq = NULL;
+}
+
+/**
+ * Returns the qpair of the SQ with the given `sqid`, or NULL when it is not attached to the CQ
+ */
+static inline struct nvme_qpair *
+nvme_cq_sq(struct nvme_cq *cq, uint16_t sqid)
+{
+	if (cq->last && cq->last->qid == sqid) {
+		return cq->last;
+	}
+
+	for (uint16_t i = 0; i < cq->nsqs; ++i) {
+		if (cq->sqs[i]->qid == sqid) {
+			cq->last = cq->sqs[i];
+			return cq->last;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Inform the controller of the current CQ head, via the shadow doorbell when attached
+ */
+static inline void
+nvme_cq_cqdb_update(struct nvme_cq *cq)
+{
+	if (cq->dbbuf_cqdb && !nvme_qpair_dbbuf_update(cq->dbbuf_cqdb, cq->dbbuf_cqei, cq->head)) {
+		return;
+	}
+
+	mmio_write32(cq->cqdb, 0, cq->head);
+}
+
+/**
+ * Reaps all ready completions, up to `max`, and invokes the callback of each request
+ *
+ * Same as nvme_qpair_process_completions(), with each completion routed to the qpair of its SQ
+ * by its `sqid`; the SQ head, the request-pool, the telemetry and the trace ring of that qpair are
+ * the ones updated. The deadlines of the SQs are checked once the CQ doorbell is written.
+ *
+ * @param cq Pointer to the shared CQ
+ * @param max Maximum number of completions to process; 0 means no limit.
+ *
+ * @return The number of completions processed.
+ */
+static inline int
+nvme_cq_process_completions(struct nvme_cq *cq, uint32_t max)
+{
+	volatile struct nvme_completion *cqes = cq->cq;
+	uint32_t nreaped = 0;
+
+	while (!max || nreaped < max) {
+		volatile struct nvme_completion *cqe = &cqes[cq->head];
+		struct nvme_completion cpl;
+		struct nvme_qpair *qp;
+
+		if ((cqe->status & 0x1) != cq->phase) {
+			break;
+		}
+		dma_rmb();
+
+		cpl = *cqe;
+
+		cq->head++;
+		if (cq->head == cq->depth) {
+			cq->head = 0;
+			cq->phase ^= 1;
+		}
+		nreaped++;
+
+		qp = nvme_cq_sq(cq, cpl.sqid);
+		if (!qp) {
+			UPCIE_DEBUG("FAILED: cqid(%" PRIu32 ") sqid(%" PRIu16 ") is not attached",
+				    cq->qid, cpl.sqid);
+			cq->nunrouted++;
+			continue;
+		}
+		qp->sqhd = cpl.sqhd;
+		NVME_TELEMETRY_FCALL(nvme_telemetry_on_complete(&qp->telemetry, qp->rpool, &cpl));
+		if (qp->trace) {
+			nvme_qpair_trace_cpl(qp, &cpl);
+		}
+
+		if (nvme_qpair_cpl_valid(qp, &cpl)) {
+			nvme_qpair_complete(qp, &cpl);
+		}
+	}
+
+	if (nreaped) {
+		nvme_cq_cqdb_update(cq);
+		cq->nreaped += nreaped;
+	}
+
+	for (uint16_t i = 0; i < cq->nsqs; ++i) {
+		struct nvme_qpair *qp = cq->sqs[i];
+
+		if (qp->rpool->timer.narmed && tsc_read() >= qp->expire_next) {
+			nvme_qpair_expire(qp);
+		}
+	}
+
+	return nreaped;
+}
@@ -0,0 +1,377 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/**
+ * CUDA NVMe persistent I/O engine
+ * ===============================
+ *
+ * With `nvme_qpair_cuda_io()`, a threadblock submits a batch, waits for all of
+ * it to complete, and only then submits the next; the queue drains between
+ * rounds, and the slowest command of a batch gates the next. The engine is
+ * instead a persistent kernel, one warp per queue-pair, which runs until it
+ * is stopped, and in a loop:
+ *
+ *   - Reaps the completions which have arrived, in whatever order: the status
+ *     is written to the result of the request by CID, the CID is released, and
+ *     head and phase are advanced by the number of completions reaped, with a
+ *     single CQ doorbell write
+ *   - Tops the SQ up with as many requests of its work queue as there are free
+ *     CIDs, with a single SQ doorbell write
+ *
+ * Requests are fed to the engine via a 'struct nvme_engine_cuda_wq', a bounded
+ * multi-producer ring. A work queue is fed either by host threads, with
+ * nvme_engine_cuda_host_push(), in which case it lives in mapped host memory,
+ * or by kernels, with nvme_engine_cuda_push(), in which case it lives in device
+ * memory; device atomics on host memory are not generally supported over PCIe.
+ *
+ * The result of a request is written to the location given with the request,
+ * which must be accessible by the GPU; it reads NVME_ENGINE_CUDA_PENDING until
+ * the command has completed. Results of host-fed requests are thus to be given
+ * in mapped host memory.
+ *
+ * The engine, and its work queue, are created and destroyed using
+ * nvme_controller_cuda_engine_create() / nvme_controller_cuda_engine_destroy().
+ * The engine owns all the CIDs of its queue-pair; it must not be mixed with
+ * the other submission paths on the same queue.
+ *
+ * @file nvme_engine_cuda.h
+ * @version 0.4.4
+ */
+
+#define NVME_ENGINE_CUDA_PENDING (-EINPROGRESS)
+#define NVME_ENGINE_CUDA_WARP 32
+
+/**
+ * A slot of the work queue
+ *
+ * The slot at position 'pos' is free for the producer of 'pos' when seq == pos, and holds a
+ * request for the engine when seq == pos + 1; the engine frees it, for the next lap, by setting
+ * seq = pos + nslots.
+ */
+struct nvme_engine_cuda_request {
+	struct nvme_command cmd; ///< The command; `cid` is assigned by the engine
+	int32_t *result;         ///< 0 on success, NVMe status code, or negative errno on completion
+	unsigned long long seq;  ///< Sequence number of the slot
+};
+
+struct nvme_engine_cuda_wq {
+	unsigned long long tail;                ///< Number of slots claimed by producers
+	uint32_t nslots;                        ///< Number of slots, a power-of-two
+	uint32_t _rsvd;
+	struct nvme_engine_cuda_request *slots; ///< Follows this struct in the same allocation
+};
+
+/**
+ * The state of an engine, in mapped host memory
+ *
+ * The engine loads it once, at start, holds the queue state in registers while running, and
+ * stores it back at exit; only 'stop' is polled while running.
+ */
+struct nvme_engine_cuda {
+	struct nvme_qpair_cuda *qp;     ///< The queue-pair driven by the engine; device memory
+	struct nvme_engine_cuda_wq *wq; ///< The work queue feeding the engine
+	int32_t **inflight;             ///< Per CID, the result of its request; device memory
+	uint16_t *cids;                 ///< Ring of free CIDs, depth - 1 entries; device memory
+	unsigned long long head;        ///< Number of work queue slots consumed
+	uint32_t stop;                  ///< Set by nvme_engine_cuda_stop(); drain and exit
+	uint32_t host;                  ///< The work queue is fed by host threads
+	uint64_t nsubmitted;            ///< Commands submitted, updated at exit
+	uint64_t ncompleted;            ///< Commands completed, updated at exit
+	uint64_t ntimedout;             ///< Commands given up on when draining, updated at exit
+};
+
+/**
+ * Push a request onto a kernel-fed work queue
+ *
+ * Called by any thread, of any kernel, running concurrently with the engine.
+ *
+ * @param wq The work queue; device memory
+ * @param cmd The command
+ * @param result Where to write the result on completion; set to NVME_ENGINE_CUDA_PENDING here
+ *
+ * @return 0 on success, -EBUSY when the work queue is full
+ */
+static inline __device__ int
+nvme_engine_cuda_push(struct nvme_engine_cuda_wq *wq, const struct nvme_command *cmd,
+		      int32_t *result)
+{
+#ifndef __CUDACC__
+	(void)wq; (void)cmd; (void)result;
+
+	return -ENOTSUP;
+#else
+	const unsigned long long mask = wq->nslots - 1;
+	unsigned long long pos = *(volatile unsigned long long *)&wq->tail;
+	struct nvme_engine_cuda_request *slot;
+
+	for (;;) {
+		unsigned long long seq;
+
+		slot = &wq->slots[pos & mask];
+		seq = *(volatile unsigned long long *)&slot->seq;
+		if (seq == pos) {
+			unsigned long long prev = atomicCAS(&wq->tail, pos, pos + 1);
+
+			if (prev == pos) {
+				break;
+			}
+			pos = prev;
+		} else if (seq < pos) {
+			return -EBUSY;
+		} else {
+			pos = *(volatile unsigned long long *)&wq->tail;
+		}
+	}
+
+	*(volatile int32_t *)result = NVME_ENGINE_CUDA_PENDING;
+	slot->cmd = *cmd;
+	slot->result = result;
+	__threadfence();
+	*(volatile unsigned long long *)&slot->seq = pos + 1;
+
+	return 0;
+#endif /* __CUDACC__ */
+}
+
+/**
+ * Push a request onto a host-fed work queue
+ *
+ * Called by any host thread. The result must be in mapped host memory, see
+ * nvme_controller_cuda_engine_create().
+ *
+ * @param wq The work queue; mapped host memory
+ * @param cmd The command
+ * @param result Where to write the result on completion; set to NVME_ENGINE_CUDA_PENDING here
+ *
+ * @return 0 on success, -EBUSY when the work queue is full
+ */
+static inline __host__ int
+nvme_engine_cuda_host_push(struct nvme_engine_cuda_wq *wq, const struct nvme_command *cmd,
+			   int32_t *result)
+{
+	const unsigned long long mask = wq->nslots - 1;
+	unsigned long long pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+	struct nvme_engine_cuda_request *slot;
+
+	for (;;) {
+		unsigned long long seq;
+
+		slot = &wq->slots[pos & mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&wq->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (seq < pos) {
+			return -EBUSY;
+		} else {
+			pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(result, NVME_ENGINE_CUDA_PENDING, __ATOMIC_RELAXED);
+	slot->cmd = *cmd;
+	slot->result = result;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Tell the engine to exit, once its work queue is empty and all its commands have completed
+ *
+ * The engine clears 'stop' as it exits, thus, it can be run again.
+ */
+static inline __host__ void
+nvme_engine_cuda_stop(struct nvme_engine_cuda *engine)
+{
+	__atomic_store_n(&engine->stop, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Run the engine; must be called by all the lanes of a single warp, and returns once stopped
+ *
+ * When stopping, and the engine makes no progress within the command timeout of the queue-pair,
+ * the commands in flight are given up on: their result is set to -ETIMEDOUT, and they are
+ * counted in 'ntimedout'. The queue-pair is then to be deleted, as the controller may still post
+ * their completions.
+ *
+ * @param engine The engine, as created by nvme_controller_cuda_engine_create()
+ */
+static inline __device__ void
+nvme_engine_cuda_run(struct nvme_engine_cuda *engine)
+{
+#ifndef __CUDACC__
+	(void)engine;
+#else
+	const unsigned full = 0xFFFFFFFFu;
+	const unsigned lane = threadIdx.x % NVME_ENGINE_CUDA_WARP;
+	struct nvme_qpair_cuda *qp = engine->qp;
+	struct nvme_engine_cuda_wq *wq = engine->wq;
+	struct nvme_engine_cuda_request *slots = wq->slots;
+	volatile struct nvme_completion *cq = (volatile struct nvme_completion *)qp->cq;
+	struct nvme_command *sq = (struct nvme_command *)qp->sq;
+	int32_t **inflight = engine->inflight;
+	uint16_t *cids = engine->cids;
+	const uint32_t depth = qp->depth;
+	const uint32_t ncids = depth - 1;
+	const unsigned long long mask = wq->nslots - 1;
+	unsigned long long head = engine->head;
+	uint32_t sq_tail = qp->tail;
+	uint32_t cq_head = qp->head;
+	uint32_t phase = qp->phase;
+	uint32_t ninflight = 0;
+	uint32_t cid_head = 0; ///< The free CIDs are at [cid_head, cid_head + ncids - ninflight)
+	uint64_t nsubmitted = 0, ncompleted = 0, ntimedout = 0;
+	int64_t deadline = 0;
+	int stopping = 0;
+
+	for (uint32_t i = lane; i < ncids; i += NVME_ENGINE_CUDA_WARP) {
+		cids[i] = i;
+		inflight[i] = NULL;
+	}
+	__syncwarp();
+
+	for (;;) {
+		unsigned ballot;
+		uint32_t n, k;
+
+		// Reap the completions which have arrived; a lane per CQ entry
+		{
+			const uint32_t pos = cq_head + lane;
+			const uint32_t idx = pos < depth ? pos : pos - depth;
+			const uint32_t expected = pos < depth ? phase : phase ^ 1;
+			uint16_t status = 0;
+			int ready = 0;
+
+			if (lane < ninflight) {
+				status = cq[idx].status;
+				ready = (status & 0x1) == expected;
+			}
+			ballot = __ballot_sync(full, ready);
+			n = ~ballot ? __ffs(~ballot) - 1 : NVME_ENGINE_CUDA_WARP;
+
+			if (lane < n) {
+				const uint16_t cid = cq[idx].cid;
+				int32_t *result = inflight[cid];
+
+				inflight[cid] = NULL;
+				*(volatile int32_t *)result = (status & 0x1FE) >> 1;
+				cids[(cid_head + ncids - ninflight + lane) % ncids] = cid;
+			}
+		}
+		if (n) {
+			__threadfence_system();
+			__syncwarp();
+
+			cq_head += n;
+			if (cq_head >= depth) {
+				cq_head -= depth;
+				phase ^= 1;
+			}
+			if (!lane) {
+				*(volatile uint32_t *)qp->cqdb = cq_head;
+			}
+			ninflight -= n;
+			ncompleted += n;
+		}
+
+		// Top the SQ up with the requests which are ready; a lane per work queue slot
+		{
+			const unsigned long long pos = head + lane;
+			struct nvme_engine_cuda_request *slot = &slots[pos & mask];
+			int ready = 0;
+
+			if (lane < ncids - ninflight) {
+				ready = *(volatile unsigned long long *)&slot->seq == pos + 1;
+			}
+			ballot = __ballot_sync(full, ready);
+			k = ~ballot ? __ffs(~ballot) - 1 : NVME_ENGINE_CUDA_WARP;
+
+			if (lane < k) {
+				const uint32_t cid = cids[(cid_head + lane) % ncids];
+				volatile uint32_t *src = (volatile uint32_t *)&slot->cmd;
+				volatile uint32_t *dst;
+				uint32_t idx = sq_tail + lane;
+
+				__threadfence();
+				inflight[cid] = slot->result;
+
+				// The CID is in the upper half of dword 0, below it are opc and fuse
+				idx = idx < depth ? idx : idx - depth;
+				dst = (volatile uint32_t *)&sq[idx];
+				dst[0] = (src[0] & 0xFFFF) | cid << 16;
+				for (unsigned i = 1; i < sizeof(struct nvme_command) / sizeof(uint32_t);
+				     i++) {
+					dst[i] = src[i];
+				}
+
+				__threadfence();
+				*(volatile unsigned long long *)&slot->seq = pos + wq->nslots;
+			}
+		}
+		if (k) {
+			__threadfence_system();
+			__syncwarp();
+
+			sq_tail += k;
+			if (sq_tail >= depth) {
+				sq_tail -= depth;
+			}
+			if (!lane) {
+				*(volatile uint32_t *)qp->sqdb = sq_tail;
+			}
+			cid_head = (cid_head + k) % ncids;
+			head += k;
+			ninflight += k;
+			nsubmitted += k;
+		}
+
+		if (n || k) {
+			if (stopping) {
+				deadline = (int64_t)clock64() +
+					   (int64_t)qp->timeout_ms * (int64_t)qp->clocks_per_ms;
+			}
+			continue;
+		}
+
+		// Idle; check whether to exit
+		if (!stopping) {
+			stopping = *(volatile uint32_t *)&engine->stop;
+			stopping = __shfl_sync(full, stopping, 0);
+			if (stopping) {
+				deadline = (int64_t)clock64() +
+					   (int64_t)qp->timeout_ms * (int64_t)qp->clocks_per_ms;
+			}
+			continue;
+		}
+		if (!ninflight && *(volatile unsigned long long *)&wq->tail == head) {
+			break;
+		}
+		if (ninflight && (int64_t)clock64() >= deadline) {
+			// Give up on the commands in flight; their CIDs remain owned by the controller
+			for (uint32_t cid = lane; cid < ncids; cid += NVME_ENGINE_CUDA_WARP) {
+				if (inflight[cid]) {
+					*(volatile int32_t *)inflight[cid] = -ETIMEDOUT;
+				}
+			}
+			__threadfence_system();
+			ntimedout += ninflight;
+			break;
+		}
+	}
+
+	__syncwarp();
+	if (!lane) {
+		engine->stop = 0;
+		qp->tail = sq_tail;
+		qp->head = cq_head;
+		qp->phase = phase;
+		engine->head = head;
+		engine->nsubmitted += nsubmitted;
+		engine->ncompleted += ncompleted;
+		engine->ntimedout += ntimedout;
+		__threadfence_system();
+	}
+#endif /* __CUDACC__ */
+}
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Interrupt-driven waiting on multiple queue-pairs
+ * ================================================
+ *
+ * A 'struct nvme_irq_waiter' groups queue-pairs whose completion-queues signal an eventfd, that
+ * is, queue-pairs with nvme_qpair->irq_fd set as done by
+ * nvme_controller_create_io_qpair_vfio_irq(). nvme_irq_waiter_wait() processes completions, via
+ * nvme_qpair_process_completions(), in one of two modes:
+ *
+ * - Polling: while completions keep arriving, the queue-pairs are polled, and the eventfds are
+ *   left alone; this gives low latency under load.
+ * - Interrupt: after 'idle_polls_max' consecutive rounds of polling without completions, the
+ *   eventfds are drained, the queue-pairs are polled once more, to catch completions arriving
+ *   in-between, and then the thread sleeps in epoll_wait() until a vector fires. This gives
+ *   near-zero CPU usage when idle.
+ *
+ * This is similar to NAPI in the Linux network stack. However, with MSI-X and VFIO, the vectors
+ * cannot be masked, so while in the polling mode, interrupts are still raised; they just do not
+ * wake up the thread.
+ *
+ * @file nvme_irq.h
+ * @version 0.4.4
+ */
+
+#define NVME_IRQ_WAITER_QPAIRS_MAX 64
+#define NVME_IRQ_WAITER_IDLE_POLLS 64
+
+struct nvme_irq_waiter {
+	int epfd;                                         ///< epoll instance watching the eventfds
+	struct nvme_qpair *qps[NVME_IRQ_WAITER_QPAIRS_MAX]; ///< The queue-pairs waited upon
+	uint32_t nqps;                                    ///< Number of queue-pairs in 'qps'
+	uint32_t idle_polls_max; ///< Empty polling rounds before switching to interrupts
+	uint32_t idle_polls;     ///< Current number of consecutive empty polling rounds
+	uint64_t nwakeups;       ///< Number of times the thread was woken by an interrupt
+};
+
+static inline void
+nvme_irq_waiter_term(struct nvme_irq_waiter *waiter)
+{
+	if (waiter->epfd >= 0) {
+		close(waiter->epfd);
+	}
+	memset(waiter, 0, sizeof(*waiter));
+	waiter->epfd = -1;
+}
+
+/**
+ * Initialize the waiter
+ *
+ * @param waiter The waiter to initialize
+ * @param idle_polls_max Number of polling rounds without completions before sleeping; when 0,
+ *                       NVME_IRQ_WAITER_IDLE_POLLS is used
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_irq_waiter_init(struct nvme_irq_waiter *waiter, uint32_t idle_polls_max)
+{
+	memset(waiter, 0, sizeof(*waiter));
+	waiter->idle_polls_max = idle_polls_max ? idle_polls_max : NVME_IRQ_WAITER_IDLE_POLLS;
+
+	waiter->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (waiter->epfd < 0) {
+		UPCIE_DEBUG("FAILED: epoll_create1(); errno(%d)", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Add a queue-pair to the waiter; several queue-pairs may share the same eventfd
+ */
+static inline int
+nvme_irq_waiter_add(struct nvme_irq_waiter *waiter, struct nvme_qpair *qp)
+{
+	struct epoll_event event = {0};
+
+	if (qp->irq_fd < 0) {
+		UPCIE_DEBUG("FAILED: qpair(%" PRIu32 ") has no irq_fd", qp->qid);
+		return -EINVAL;
+	}
+	if (waiter->nqps == NVME_IRQ_WAITER_QPAIRS_MAX) {
+		return -ENOMEM;
+	}
+
+	event.events = EPOLLIN;
+	event.data.fd = qp->irq_fd;
+
+	if (epoll_ctl(waiter->epfd, EPOLL_CTL_ADD, qp->irq_fd, &event) < 0 && errno != EEXIST) {
+		UPCIE_DEBUG("FAILED: epoll_ctl(); errno(%d)", errno);
+		return -errno;
+	}
+
+	waiter->qps[waiter->nqps++] = qp;
+
+	return 0;
+}
+
+static inline int
+nvme_irq_waiter_poll(struct nvme_irq_waiter *waiter)
+{
+	int nreaped = 0;
+
+	for (uint32_t i = 0; i < waiter->nqps; ++i) {
+		nreaped += nvme_qpair_process_completions(waiter->qps[i], 0);
+	}
+
+	return nreaped;
+}
+
+static inline void
+nvme_irq_waiter_drain(struct nvme_irq_waiter *waiter)
+{
+	for (uint32_t i = 0; i < waiter->nqps; ++i) {
+		uint64_t count;
+
+		while (read(waiter->qps[i]->irq_fd, &count, sizeof(count)) == sizeof(count)) {
+			;
+		}
+	}
+}
+
+/**
+ * Process completions on the queue-pairs of the waiter, sleeping until interrupted when idle
+ *
+ * Returns as soon as a polling round has processed completions. When idle for long enough, then
+ * it sleeps in epoll_wait() for at most `timeout_ms`.
+ *
+ * @param waiter The waiter
+ * @param timeout_ms Maximum time to sleep waiting for an interrupt; -1 waits indefinitely
+ *
+ * @return The number of completions processed, 0 on timeout. On error, negative errno is returned
+ *         to indicate the error.
+ */
+static inline int
+nvme_irq_waiter_wait(struct nvme_irq_waiter *waiter, int timeout_ms)
+{
+	struct epoll_event events[NVME_IRQ_WAITER_QPAIRS_MAX];
+	int nreaped, nevents;
+
+	for (;;) {
+		nreaped = nvme_irq_waiter_poll(waiter);
+		if (nreaped) {
+			waiter->idle_polls = 0;
+			return nreaped;
+		}
+
+		if (++waiter->idle_polls < waiter->idle_polls_max) {
+			cpu_relax();
+			continue;
+		}
+
+		// Arm: clear pending signals, then catch completions posted before the clearing
+		nvme_irq_waiter_drain(waiter);
+		nreaped = nvme_irq_waiter_poll(waiter);
+		if (nreaped) {
+			waiter->idle_polls = 0;
+			return nreaped;
+		}
+
+		nevents = epoll_wait(waiter->epfd, events, NVME_IRQ_WAITER_QPAIRS_MAX, timeout_ms);
+		if (nevents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			UPCIE_DEBUG("FAILED: epoll_wait(); errno(%d)", errno);
+			return -errno;
+		}
+		if (!nevents) {
+			return 0;
+		}
+
+		waiter->nwakeups++;
+		waiter->idle_polls = 0;
+	}
+}
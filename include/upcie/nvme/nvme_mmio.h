@@ -31,6 +31,16 @@
 #define NVME_REG_AQA 0x24
 #define NVME_REG_ASQ 0x28
 #define NVME_REG_ACQ 0x30
+#define NVME_REG_CMBLOC 0x38
+#define NVME_REG_CMBSZ 0x3C
+#define NVME_REG_CMBMSC 0x50
+
+#define NVME_REG_PMRCAP 0xE00
+#define NVME_REG_PMRCTL 0xE04
+#define NVME_REG_PMRSTS 0xE08
+#define NVME_REG_PMREBS 0xE0C
+#define NVME_REG_PMRMSCL 0xE14
+#define NVME_REG_PMRMSCU 0xE18
 
 /**
  * Controller Capabilities: Maximum Queue Entries Supported (MQES)
@@ -512,4 +522,252 @@ static inline uint32_t
 nvme_reg_cc_set_crime(uint32_t cc, uint8_t val)
 {
 	return bitfield_set(cc, 24, 1, val);
-}
\ No newline at end of file
+}
+
+/**
+ * Controller Memory Buffer Location: Base Indicator Register (BIR)
+ */
+static inline uint8_t
+nvme_reg_cmbloc_get_bir(uint32_t cmbloc)
+{
+	return bitfield_get(cmbloc, 0, 3);
+}
+
+/**
+ * Controller Memory Buffer Location: Offset (OFST), in units of CMBSZ.SZU
+ */
+static inline uint32_t
+nvme_reg_cmbloc_get_ofst(uint32_t cmbloc)
+{
+	return bitfield_get(cmbloc, 12, 20);
+}
+
+/**
+ * Controller Memory Buffer Size: Submission Queue Support (SQS)
+ */
+static inline uint8_t
+nvme_reg_cmbsz_get_sqs(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 0, 1);
+}
+
+/**
+ * Controller Memory Buffer Size: Completion Queue Support (CQS)
+ */
+static inline uint8_t
+nvme_reg_cmbsz_get_cqs(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 1, 1);
+}
+
+/**
+ * Controller Memory Buffer Size: PRP SGL List Support (LISTS)
+ */
+static inline uint8_t
+nvme_reg_cmbsz_get_lists(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 2, 1);
+}
+
+/**
+ * Controller Memory Buffer Size: Read Data Support (RDS)
+ */
+static inline uint8_t
+nvme_reg_cmbsz_get_rds(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 3, 1);
+}
+
+/**
+ * Controller Memory Buffer Size: Write Data Support (WDS)
+ */
+static inline uint8_t
+nvme_reg_cmbsz_get_wds(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 4, 1);
+}
+
+/**
+ * Controller Memory Buffer Size: Size Units (SZU); 4KiB * 16^SZU bytes
+ */
+static inline uint8_t
+nvme_reg_cmbsz_get_szu(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 8, 4);
+}
+
+/**
+ * Controller Memory Buffer Size: Size (SZ), in units of SZU
+ */
+static inline uint32_t
+nvme_reg_cmbsz_get_sz(uint32_t cmbsz)
+{
+	return bitfield_get(cmbsz, 12, 20);
+}
+
+/**
+ * Returns the number of bytes of a unit of CMBSZ.SZU, that is, of CMBSZ.SZ and CMBLOC.OFST
+ */
+static inline uint64_t
+nvme_reg_cmbsz_unit_nbytes(uint32_t cmbsz)
+{
+	return (uint64_t)1 << (12 + 4 * nvme_reg_cmbsz_get_szu(cmbsz));
+}
+
+static inline int
+nvme_reg_cmbsz_pr(uint32_t cmbsz)
+{
+	int wrtn = 0;
+
+	wrtn += printf("CMBSZ = 0x%08" PRIx32 "\n", cmbsz);
+	wrtn += printf("  sqs:    %u # submission queue support\n", nvme_reg_cmbsz_get_sqs(cmbsz));
+	wrtn += printf("  cqs:    %u # completion queue support\n", nvme_reg_cmbsz_get_cqs(cmbsz));
+	wrtn += printf("  lists:  %u # PRP SGL list support\n", nvme_reg_cmbsz_get_lists(cmbsz));
+	wrtn += printf("  rds:    %u # read data support\n", nvme_reg_cmbsz_get_rds(cmbsz));
+	wrtn += printf("  wds:    %u # write data support\n", nvme_reg_cmbsz_get_wds(cmbsz));
+	wrtn += printf("  szu:    %u # size units (4KiB * 16^n)\n", nvme_reg_cmbsz_get_szu(cmbsz));
+	wrtn += printf("  sz:     %u # size in units of szu\n", nvme_reg_cmbsz_get_sz(cmbsz));
+
+	return wrtn;
+}
+
+static inline uint32_t
+nvme_mmio_cmbloc_read(void *bar0)
+{
+	return mmio_read32(bar0, NVME_REG_CMBLOC);
+}
+
+static inline uint32_t
+nvme_mmio_cmbsz_read(void *bar0)
+{
+	return mmio_read32(bar0, NVME_REG_CMBSZ);
+}
+
+/**
+ * Write the Controller Memory Buffer Memory Space Control (CMBMSC)
+ *
+ * Bit 0 is Capabilities Registers Enabled (CRE), which must be set for CMBLOC and CMBSZ to read
+ * non-zero, bit 1 is Controller Memory Space Enable (CMSE), and bits 63:12 the Controller Base
+ * Address (CBA) at which the controller is to recognize addresses in its CMB. The register was
+ * introduced with NVMe 1.4; older controllers ignore the write, and always report CMBLOC and
+ * CMBSZ.
+ * The upper half is written first, as CRE and CMSE take effect with the lower.
+ */
+static inline void
+nvme_mmio_cmbmsc_write(void *bar0, uint64_t cmbmsc)
+{
+	mmio_write32(bar0, NVME_REG_CMBMSC + 4, (uint32_t)(cmbmsc >> 32));
+	mmio_write32(bar0, NVME_REG_CMBMSC, (uint32_t)cmbmsc);
+}
+
+/**
+ * Persistent Memory Region Capabilities: Read Data Support (RDS)
+ */
+static inline uint8_t
+nvme_reg_pmrcap_get_rds(uint32_t pmrcap)
+{
+	return bitfield_get(pmrcap, 3, 1);
+}
+
+/**
+ * Persistent Memory Region Capabilities: Write Data Support (WDS)
+ */
+static inline uint8_t
+nvme_reg_pmrcap_get_wds(uint32_t pmrcap)
+{
+	return bitfield_get(pmrcap, 4, 1);
+}
+
+/**
+ * Persistent Memory Region Capabilities: Base Indicator Register (BIR)
+ */
+static inline uint8_t
+nvme_reg_pmrcap_get_bir(uint32_t pmrcap)
+{
+	return bitfield_get(pmrcap, 5, 3);
+}
+
+/**
+ * Persistent Memory Region Capabilities: Time Units (PMRTU); 0: 500 milliseconds, 1: minutes
+ */
+static inline uint8_t
+nvme_reg_pmrcap_get_pmrtu(uint32_t pmrcap)
+{
+	return bitfield_get(pmrcap, 8, 2);
+}
+
+/**
+ * Persistent Memory Region Capabilities: Timeout (PMRTO), in units of PMRTU
+ */
+static inline uint8_t
+nvme_reg_pmrcap_get_pmrto(uint32_t pmrcap)
+{
+	return bitfield_get(pmrcap, 16, 8);
+}
+
+/**
+ * Persistent Memory Region Capabilities: Controller Memory Space Supported (CMSS)
+ */
+static inline uint8_t
+nvme_reg_pmrcap_get_cmss(uint32_t pmrcap)
+{
+	return bitfield_get(pmrcap, 24, 1);
+}
+
+/**
+ * Persistent Memory Region Status: Not Ready (NRDY)
+ */
+static inline uint8_t
+nvme_reg_pmrsts_get_nrdy(uint32_t pmrsts)
+{
+	return bitfield_get(pmrsts, 8, 1);
+}
+
+static inline uint32_t
+nvme_mmio_pmrcap_read(void *bar0)
+{
+	return mmio_read32(bar0, NVME_REG_PMRCAP);
+}
+
+static inline uint32_t
+nvme_mmio_pmrsts_read(void *bar0)
+{
+	return mmio_read32(bar0, NVME_REG_PMRSTS);
+}
+
+/**
+ * Write the Persistent Memory Region Control (PMRCTL); bit 0 is Enable (EN)
+ */
+static inline void
+nvme_mmio_pmrctl_write(void *bar0, uint32_t pmrctl)
+{
+	mmio_write32(bar0, NVME_REG_PMRCTL, pmrctl);
+}
+
+/**
+ * Write the Persistent Memory Region Controller Memory Space Control (PMRMSCL, PMRMSCU)
+ *
+ * Bit 1 is Controller Memory Space Enable (CMSE), and bits 63:12 the Controller Base Address
+ * (CBA); the upper half is written first, as CMSE takes effect with the lower.
+ */
+static inline void
+nvme_mmio_pmrmsc_write(void *bar0, uint64_t pmrmsc)
+{
+	mmio_write32(bar0, NVME_REG_PMRMSCU, (uint32_t)(pmrmsc >> 32));
+	mmio_write32(bar0, NVME_REG_PMRMSCL, (uint32_t)pmrmsc);
+}
+
+/**
+ * Wait until PMRSTS.NRDY == 0 (persistent memory region is ready)
+ */
+static inline int
+nvme_mmio_pmrsts_wait_until_ready(void *mmio, int timeout_ms)
+{
+	for (int elapsed = 0; elapsed < timeout_ms; ++elapsed) {
+		if (!nvme_reg_pmrsts_get_nrdy(nvme_mmio_pmrsts_read(mmio))) {
+			return 0;
+		}
+		usleep(1000);
+	}
+	return -ETIMEDOUT;
+}
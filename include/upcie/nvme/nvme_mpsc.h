@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Multi-producer submission ring in front of a qpair
+ * ==================================================
+ *
+ * A 'struct nvme_qpair' is single-threaded, thus, sharing one between threads requires a lock
+ * around every submission. A 'struct nvme_mpsc' is a bounded ring of commands in front of a
+ * qpair, allowing any number of threads, the producers, to submit without a lock, while a single
+ * thread, the consumer, moves commands from the ring to the SQ, and processes completions.
+ *
+ * - Producers call nvme_mpsc_submit() or nvme_mpsc_submit_contig_prps(). A request is allocated
+ *   from the lock-free freelist of the qpair request-pool, the PRPs are prepared by the producer,
+ *   and a slot in the ring is reserved with a compare-and-swap on the ring tail.
+ * - The consumer calls nvme_mpsc_poll(), which flushes the ring to the SQ, with a single doorbell
+ *   write per flush, and then processes completions; the callbacks are thus invoked on the
+ *   consumer thread.
+ *
+ * The ring is that of Dmitry Vyukov's bounded MPMC queue, with a sequence number per slot
+ * signalling whether it is free, or ready for the consumer. Only nvme_mpsc_poll() and
+ * nvme_mpsc_flush() are to be called on the consumer thread, and the qpair must not be used
+ * directly by other threads while the ring is in front of it.
+ *
+ * @file nvme_mpsc.h
+ * @version 0.4.4
+ */
+
+struct nvme_mpsc_slot {
+	uint64_t seq; ///< == position: free; == position + 1: holds a command for the consumer
+	struct nvme_command cmd;
+};
+
+struct nvme_mpsc {
+	struct nvme_qpair *qp;        ///< The qpair that the ring submits to
+	struct nvme_mpsc_slot *slots; ///< Array of 'mask + 1' slots
+	uint64_t mask;
+
+	uint64_t tail __attribute__((aligned(64))); ///< Next position for producers to reserve
+	uint64_t head __attribute__((aligned(64))); ///< Next position for the consumer to flush
+
+	uint64_t nflushes; ///< Number of flushes moving at least one command to the SQ
+	uint64_t ncmds;    ///< Number of commands moved to the SQ
+};
+
+static inline void
+nvme_mpsc_term(struct nvme_mpsc *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/**
+ * Initialize a ring in front of the given qpair
+ *
+ * @param ring The ring to initialize
+ * @param qp The qpair to submit to, created as usual, e.g. nvme_controller_create_io_qpair()
+ * @param nslots Number of slots, must be a power of two
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_mpsc_init(struct nvme_mpsc *ring, struct nvme_qpair *qp, uint32_t nslots)
+{
+	if (!nslots || (nslots & (nslots - 1))) {
+		UPCIE_DEBUG("FAILED: nslots(%" PRIu32 ") is not a power of two", nslots);
+		return -EINVAL;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->qp = qp;
+	ring->mask = nslots - 1;
+
+	ring->slots = calloc(nslots, sizeof(*ring->slots));
+	if (!ring->slots) {
+		UPCIE_DEBUG("FAILED: calloc(slots); errno(%d)", errno);
+		return -errno;
+	}
+	for (uint32_t i = 0; i < nslots; ++i) {
+		ring->slots[i].seq = i;
+	}
+
+	return 0;
+}
+
+/**
+ * Reserve a slot and publish the command to the consumer; any thread
+ */
+static inline int
+nvme_mpsc_push(struct nvme_mpsc *ring, struct nvme_command *cmd)
+{
+	uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct nvme_mpsc_slot *slot;
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &ring->slots[pos & ring->mask];
+		diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -EBUSY;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->cmd = *cmd;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Submit a command via the ring; any thread
+ *
+ * The PRP fields are neither modified nor validated, see nvme_mpsc_submit_contig_prps().
+ *
+ * @param ring The ring
+ * @param cmd The command to submit; `cid` will be assigned
+ * @param cb Callback invoked, on the consumer thread, upon completion; may be NULL
+ * @param user Opaque pointer passed on to `cb`
+ *
+ * @return On success 0 is returned. When the request-pool, or the ring, is exhausted, then -EBUSY
+ *         is returned.
+ */
+static inline int
+nvme_mpsc_submit(struct nvme_mpsc *ring, struct nvme_command *cmd, nvme_request_cb cb, void *user)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(ring->qp->rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = cb;
+	req->user = user;
+	cmd->cid = req->cid;
+
+	err = nvme_mpsc_push(ring, cmd);
+	if (err) {
+		nvme_request_free(ring->qp->rpool, req->cid);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Submit a command with a contiguous PRP payload via the ring; any thread
+ *
+ * Same as nvme_mpsc_submit(), with the PRP entries prepared, by the calling thread, using the
+ * provided `heap` and `dbuf`.
+ *
+ * @return On success 0 is returned. When the request-pool, its PRP-list pages, or the ring is
+ *         exhausted, then -EBUSY is returned.
+ */
+static inline int
+nvme_mpsc_submit_contig_prps(struct nvme_mpsc *ring, struct hostmem_heap *heap, void *dbuf,
+			     size_t dbuf_nbytes, struct nvme_command *cmd, nvme_request_cb cb,
+			     void *user)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(ring->qp->rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = cb;
+	req->user = user;
+	cmd->cid = req->cid;
+
+	err = nvme_request_prep_command_prps_contig(req, heap, dbuf, dbuf_nbytes, cmd);
+	if (!err) {
+		err = nvme_mpsc_push(ring, cmd);
+	}
+	if (err) {
+		nvme_request_free(ring->qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	return 0;
+}
+
+/**
+ * Move as many commands as fit from the ring to the SQ, and write the SQ doorbell once; consumer
+ *
+ * @return The number of commands moved to the SQ
+ */
+static inline int
+nvme_mpsc_flush(struct nvme_mpsc *ring)
+{
+	struct nvme_qpair *qp = ring->qp;
+	int ncmds = 0;
+
+	for (;;) {
+		struct nvme_mpsc_slot *slot = &ring->slots[ring->head & ring->mask];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1) {
+			break;
+		}
+		if (nvme_qpair_enqueue(qp, &slot->cmd)) {
+			break;
+		}
+
+		__atomic_store_n(&slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+		ring->head += 1;
+		ncmds += 1;
+	}
+
+	if (ncmds) {
+		nvme_qpair_sqdb_update(qp);
+		ring->nflushes += 1;
+		ring->ncmds += ncmds;
+	}
+
+	return ncmds;
+}
+
+/**
+ * Flush the ring, then process completions of the qpair; consumer
+ *
+ * @param ring The ring
+ * @param max Maximum number of completions to process; 0 means no limit
+ *
+ * @return The number of completions processed
+ */
+static inline int
+nvme_mpsc_poll(struct nvme_mpsc *ring, uint32_t max)
+{
+	nvme_mpsc_flush(ring);
+
+	return nvme_qpair_process_completions(ring->qp, max);
+}
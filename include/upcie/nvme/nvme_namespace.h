@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Namespaces and large I/O of the NVM command set
+ * ===============================================
+ *
+ * A 'struct nvme_namespace' caches what is needed to issue I/O to a namespace, from the Identify
+ * Namespace data structure, and from the Identify Controller fields kept by
+ * nvme_controller_identify(): the size, the logical block size of the format in use, the Maximum
+ * Data Transfer Size (MDTS), the Namespace Optimal I/O Boundary (NOIOB), and, when the namespace
+ * reports them (NSFEAT.OPTPERF), the preferred write granularity and alignment (NPWG, NPWA), and
+ * the Namespace Optimal Write Size (NOWS).
+ *
+ * The metadata of the format, and its End-to-end Data Protection settings (DPS), are kept as
+ * well. With extended LBAs, the metadata of each logical block follows it in the data buffer,
+ * thus, a logical block takes 'xfer_nbytes' of the buffer, instead of 'lba_nbytes'. When the
+ * metadata holds protection information (PI) alone, then commands are prepared with PRACT set,
+ * such that the controller inserts the PI on writes, and strips it on reads, and no metadata is
+ * transferred; explicit PI, generated and verified by the host, is prepared via nvme_pi.h.
+ *
+ * nvme_namespace_prep() prepares a read or write command, thus, callers do not need to know the
+ * layout of cdw10-cdw12. nvme_namespace_read() and nvme_namespace_write() transfer a range of any
+ * length, to or from one buffer: the range is split into commands of at most MDTS, never crossing
+ * an optimal I/O boundary, and, for writes, ending on the preferred write granularity; then the
+ * commands are kept in flight on the qpair, as many as it holds, with the SQ doorbell written once
+ * per batch. Thus, a single call drives a qpair at its full depth.
+ *
+ * Just as the qpairs it drives, then a namespace is not thread-safe; distinct threads may however
+ * issue I/O to the same namespace on distinct qpairs.
+ *
+ * @file nvme_namespace.h
+ * @version 0.4.4
+ */
+
+#define NVME_NAMESPACE_NSFEAT_OPTPERF (1 << 4) ///< NPWG, NPWA, NPDG, NPDA, and NOWS are valid
+#define NVME_NAMESPACE_FLBAS_EXT (1 << 4)      ///< Metadata is transferred as extended LBAs
+#define NVME_NAMESPACE_DPS_PIT_MASK 0x7         ///< Protection Information Type; 0: disabled
+#define NVME_NAMESPACE_DPS_PIP (1 << 3)         ///< PI is the first 8 bytes of the metadata
+
+#define NVME_NAMESPACE_CDW12_PRACT (1U << 29) ///< Protection Information Action
+
+struct nvme_namespace {
+	struct nvme_controller *ctrlr; ///< The controller of the namespace
+	uint32_t nsid;                 ///< Namespace Identifier
+	uint32_t lba_nbytes;           ///< Logical block size of the format in use
+	uint64_t nsze;                 ///< Namespace Size, in logical blocks
+	uint64_t ncap;                 ///< Namespace Capacity, in logical blocks
+	uint16_t ms;                   ///< Metadata size per logical block, in bytes
+	uint8_t lba_shift;             ///< log2 of 'lba_nbytes'
+	uint8_t nsfeat;                ///< Namespace Features
+	uint8_t lbaf;                  ///< Index of the LBA Format in use, from FLBAS
+	uint8_t nlbaf;                 ///< Number of LBA Formats, 1-based
+	uint8_t ext;                   ///< Metadata is transferred as extended LBAs
+	uint8_t dps;                   ///< End-to-end Data Protection Type Settings
+	uint8_t pract;                 ///< Commands are prepared with PRACT; see above
+	uint32_t xfer_nbytes;          ///< Bytes of a logical block in the data buffer
+	uint32_t max_nlb;              ///< Maximum logical blocks per command; bound by MDTS
+	uint32_t noiob;                ///< Optimal I/O Boundary, in logical blocks; 0: none
+	uint32_t npwg;                 ///< Preferred Write Granularity, in logical blocks; 0: none
+	uint32_t npwa;                 ///< Preferred Write Alignment, in logical blocks; 0: none
+	uint32_t nows;                 ///< Optimal Write Size, in logical blocks; 0: none
+};
+
+/**
+ * State of a single nvme_namespace_io(); see nvme_qpair_pipeline_run()
+ */
+struct nvme_namespace_io_ctx {
+	struct nvme_namespace *ns;
+	struct nvme_qpair *qp;
+	struct hostmem_heap *heap;
+	uint8_t *buf;
+	uint64_t slba;
+	uint64_t nlb;
+	uint64_t nsubmitted; ///< Number of logical blocks enqueued
+	uint8_t opc;
+};
+
+static inline int
+nvme_namespace_pr(struct nvme_namespace *ns)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_namespace:\n");
+	wrtn += printf("  nsid: %" PRIu32 "\n", ns->nsid);
+	wrtn += printf("  nsze: %" PRIu64 "\n", ns->nsze);
+	wrtn += printf("  ncap: %" PRIu64 "\n", ns->ncap);
+	wrtn += printf("  lba_nbytes: %" PRIu32 "\n", ns->lba_nbytes);
+	wrtn += printf("  ms: %" PRIu16 "\n", ns->ms);
+	wrtn += printf("  nsfeat: 0x%" PRIx8 "\n", ns->nsfeat);
+	wrtn += printf("  lbaf: %" PRIu8 "\n", ns->lbaf);
+	wrtn += printf("  nlbaf: %" PRIu8 "\n", ns->nlbaf);
+	wrtn += printf("  ext: %" PRIu8 "\n", ns->ext);
+	wrtn += printf("  dps: 0x%" PRIx8 "\n", ns->dps);
+	wrtn += printf("  pract: %" PRIu8 "\n", ns->pract);
+	wrtn += printf("  xfer_nbytes: %" PRIu32 "\n", ns->xfer_nbytes);
+	wrtn += printf("  max_nlb: %" PRIu32 "\n", ns->max_nlb);
+	wrtn += printf("  noiob: %" PRIu32 "\n", ns->noiob);
+	wrtn += printf("  npwg: %" PRIu32 "\n", ns->npwg);
+	wrtn += printf("  npwa: %" PRIu32 "\n", ns->npwa);
+	wrtn += printf("  nows: %" PRIu32 "\n", ns->nows);
+
+	return wrtn;
+}
+
+/**
+ * Identify the namespace `nsid` of the controller, and cache the fields needed for I/O
+ *
+ * The Identify Namespace data structure is left in ctrlr->buf. As other admin commands of the
+ * controller, this must not run concurrently with them.
+ *
+ * @return On success 0 is returned. When the namespace is inactive, or uses a logical block size
+ *         which is not a power of two of at least 512 bytes, then -ENODEV is returned. On other
+ *         errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_namespace_init(struct nvme_namespace *ns, struct nvme_controller *ctrlr, uint32_t nsid)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *idfy = ctrlr->buf;
+	uint8_t *lbaf;
+	uint64_t max_nlb;
+	int err;
+
+	memset(ns, 0, sizeof(*ns));
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = nsid;
+	cmd.cdw10 = 0; ///< CNS=0: Identify Namespace
+
+	err = nvme_qpair_submit_sync_contig_prps(&ctrlr->aq, ctrlr->heap, ctrlr->buf, 4096, &cmd,
+						 ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)", err);
+		return err;
+	}
+
+	memcpy(&ns->nsze, &idfy[0], sizeof(ns->nsze));
+	memcpy(&ns->ncap, &idfy[8], sizeof(ns->ncap));
+	ns->nsfeat = idfy[24];
+	ns->nlbaf = idfy[25] + 1;
+
+	// FLBAS[3:0] indexes the LBA Format table; FLBAS[6:5] holds the upper bits, when NLBAF > 16
+	ns->lbaf = (idfy[26] & 0xF) | ((idfy[26] >> 1) & 0x30);
+	lbaf = &idfy[128 + 4 * ns->lbaf];
+	ns->ms = lbaf[0] | (lbaf[1] << 8);
+	ns->lba_shift = lbaf[2];
+
+	if (!ns->nsze || ns->lba_shift < 9 || ns->lba_shift > 31) {
+		UPCIE_DEBUG("FAILED: nsid(%" PRIu32 ") nsze(%" PRIu64 ") lbads(%" PRIu8 ")", nsid,
+			    ns->nsze, ns->lba_shift);
+		return -ENODEV;
+	}
+	ns->lba_nbytes = 1U << ns->lba_shift;
+
+	ns->ext = !!(idfy[26] & NVME_NAMESPACE_FLBAS_EXT);
+	ns->dps = idfy[29];
+	ns->pract = (ns->dps & NVME_NAMESPACE_DPS_PIT_MASK) && ns->ms == 8;
+	ns->xfer_nbytes = ns->lba_nbytes + (ns->ext && !ns->pract ? ns->ms : 0);
+
+	ns->noiob = idfy[46] | (idfy[47] << 8);
+	if (ns->nsfeat & NVME_NAMESPACE_NSFEAT_OPTPERF) {
+		ns->npwg = (idfy[64] | (idfy[65] << 8)) + 1;
+		ns->npwa = (idfy[66] | (idfy[67] << 8)) + 1;
+		ns->nows = (idfy[72] | (idfy[73] << 8)) + 1;
+	}
+
+	// NLB of a command is 16 bits, 0-based; bound further by the MDTS of the controller
+	max_nlb = 0x10000;
+	if (ctrlr->mdts_nbytes && (ctrlr->mdts_nbytes / ns->xfer_nbytes) < max_nlb) {
+		max_nlb = ctrlr->mdts_nbytes / ns->xfer_nbytes;
+	}
+	if (!max_nlb) {
+		UPCIE_DEBUG("FAILED: xfer_nbytes(%" PRIu32 ") > mdts_nbytes(%" PRIu32 ")",
+			    ns->xfer_nbytes, ctrlr->mdts_nbytes);
+		return -ENODEV;
+	}
+	ns->max_nlb = max_nlb;
+	ns->ctrlr = ctrlr;
+	ns->nsid = nsid;
+
+	return 0;
+}
+
+/**
+ * Returns the number of logical blocks of the next command of a range of `nlb` blocks at `slba`
+ *
+ * The command is at most 'max_nlb' blocks, does not cross an optimal I/O boundary, and, for a
+ * write (`opc` 0x1), ends on a multiple of the preferred write granularity, unless that would
+ * leave it empty, such that the commands which follow it are aligned.
+ */
+static inline uint32_t
+nvme_namespace_cmd_nlb(struct nvme_namespace *ns, uint8_t opc, uint64_t slba, uint64_t nlb)
+{
+	uint64_t n = nlb < ns->max_nlb ? nlb : ns->max_nlb;
+
+	if (ns->noiob) {
+		uint64_t boundary = ns->noiob - slba % ns->noiob;
+
+		n = n < boundary ? n : boundary;
+	}
+
+	if (opc == 0x1 && ns->npwg > 1 && n < nlb) {
+		uint64_t tail = (slba + n) % ns->npwg;
+
+		n = tail < n ? n - tail : n;
+	}
+
+	return n;
+}
+
+/**
+ * Prepare a read, or write, command of `nlb` logical blocks at `slba`
+ *
+ * The PRPs are not set. The caller is responsible for `nlb` being within 'max_nlb'; see
+ * nvme_namespace_cmd_nlb(). PRACT is set when the namespace has 'pract'.
+ */
+static inline void
+nvme_namespace_prep(struct nvme_namespace *ns, struct nvme_command *cmd, uint8_t opc,
+		    uint64_t slba, uint32_t nlb)
+{
+	memset(cmd, 0, sizeof(*cmd));
+
+	cmd->opc = opc;
+	cmd->nsid = ns->nsid;
+	cmd->cdw10 = slba & 0xFFFFFFFF;
+	cmd->cdw11 = slba >> 32;
+	cmd->cdw12 = nlb - 1;
+	if (ns->pract) {
+		cmd->cdw12 |= NVME_NAMESPACE_CDW12_PRACT;
+	}
+}
+
+/**
+ * Enqueue the next commands of a nvme_namespace_io(); see nvme_qpair_pipeline_submit_fn
+ */
+static inline int
+nvme_namespace_io_submit(struct nvme_qpair_pipeline *pl, void *arg)
+{
+	struct nvme_namespace_io_ctx *ctx = arg;
+	struct nvme_namespace *ns = ctx->ns;
+	int dirty = 0;
+	int err = 0;
+
+	while (ctx->nsubmitted < ctx->nlb) {
+		uint64_t slba = ctx->slba + ctx->nsubmitted;
+		uint32_t n = nvme_namespace_cmd_nlb(ns, ctx->opc, slba, ctx->nlb - ctx->nsubmitted);
+		struct nvme_request *req;
+		struct nvme_command cmd;
+
+		req = nvme_qpair_pipeline_request(pl, ctx->qp);
+		if (!req) {
+			break;
+		}
+
+		nvme_namespace_prep(ns, &cmd, ctx->opc, slba, n);
+		cmd.cid = req->cid;
+
+		err = nvme_request_prep_command_prps_contig(
+			req, ctx->heap, ctx->buf + ctx->nsubmitted * ns->xfer_nbytes,
+			(size_t)n * ns->xfer_nbytes, &cmd);
+		if (!err) {
+			err = nvme_qpair_enqueue(ctx->qp, &cmd);
+		}
+		if (err) {
+			nvme_request_free(ctx->qp->rpool, req->cid);
+			if (err == -ENOMEM || err == -EBUSY) {
+				err = 0;
+				break;
+			}
+			UPCIE_DEBUG("FAILED: submit; err(%d)", err);
+			break;
+		}
+		ctx->nsubmitted += n;
+		pl->ncmds++;
+		dirty = 1;
+	}
+	if (dirty) {
+		nvme_qpair_sqdb_update(ctx->qp);
+	}
+
+	return err ? err : ctx->nsubmitted < ctx->nlb;
+}
+
+static inline struct nvme_qpair *
+nvme_namespace_io_qpair(void *arg, uint32_t idx)
+{
+	struct nvme_namespace_io_ctx *ctx = arg;
+
+	return idx ? NULL : ctx->qp;
+}
+
+/**
+ * Transfer `nlb` logical blocks at `slba`, from/to the buffer, and wait for completion
+ *
+ * The range is split into commands by nvme_namespace_cmd_nlb(), which are submitted on the qpair
+ * until it, its request pool, or its PRP-list pages, are exhausted; then the SQ doorbell is
+ * written and completions are processed, until the range is done; see nvme_qpair_pipeline_run().
+ * The commands target consecutive offsets of `buf`, which must hold `nlb` blocks of
+ * 'xfer_nbytes', be dword-aligned, and be allocated in `heap`.
+ *
+ * When no completion is processed for the timeout of the controller, then the I/O is given up;
+ * the commands still in flight are detached, thus, the qpair may be used again, yet, the buffer
+ * must not be reused before the qpair is destroyed.
+ *
+ * @param ns The namespace
+ * @param qp An I/O qpair of the controller of the namespace
+ * @param heap The heap `buf` is allocated in
+ * @param opc The opcode of the commands; e.g. 0x1 for write, or 0x2 for read
+ * @param slba The first logical block of the range
+ * @param nlb Number of logical blocks of the range
+ * @param buf The buffer
+ * @param cpl Pointer to store the completion of the first failed command; may be NULL
+ *
+ * @return On success 0 is returned. When a command fails, -EIO is returned, after all commands
+ *         have completed. On timeout -EAGAIN is returned. On other errors, negative errno is
+ *         returned to indicate the error.
+ */
+static inline int
+nvme_namespace_io(struct nvme_namespace *ns, struct nvme_qpair *qp, struct hostmem_heap *heap,
+		  uint8_t opc, uint64_t slba, uint64_t nlb, void *buf, struct nvme_completion *cpl)
+{
+	struct nvme_namespace_io_ctx ctx = {.ns = ns, .qp = qp, .heap = heap, .buf = buf,
+					    .slba = slba, .nlb = nlb, .opc = opc};
+	struct nvme_qpair_pipeline pl = {0};
+
+	if (!nlb || slba + nlb > ns->nsze || slba + nlb < slba || ((uintptr_t)buf & 0x3)) {
+		UPCIE_DEBUG("FAILED: slba(%" PRIu64 ") nlb(%" PRIu64 ")", slba, nlb);
+		return -EINVAL;
+	}
+
+	return nvme_qpair_pipeline_run(&pl, nvme_namespace_io_submit, nvme_namespace_io_qpair, &ctx,
+				       ns->ctrlr->timeout_ms, cpl);
+}
+
+/**
+ * Read `nlb` logical blocks at `slba` into `buf`; see nvme_namespace_io()
+ */
+static inline int
+nvme_namespace_read(struct nvme_namespace *ns, struct nvme_qpair *qp, struct hostmem_heap *heap,
+		    uint64_t slba, uint64_t nlb, void *buf, struct nvme_completion *cpl)
+{
+	return nvme_namespace_io(ns, qp, heap, 0x2, slba, nlb, buf, cpl);
+}
+
+/**
+ * Write `nlb` logical blocks at `slba` from `buf`; see nvme_namespace_io()
+ */
+static inline int
+nvme_namespace_write(struct nvme_namespace *ns, struct nvme_qpair *qp, struct hostmem_heap *heap,
+		     uint64_t slba, uint64_t nlb, void *buf, struct nvme_completion *cpl)
+{
+	return nvme_namespace_io(ns, qp, heap, 0x1, slba, nlb, buf, cpl);
+}
@@ -0,0 +1,590 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Offloaded data movement: Dataset Management, Write Zeroes, and Copy
+ * ===================================================================
+ *
+ * Helpers for the commands of the NVM command set which move, or discard, data on the controller,
+ * without transferring the data between host and controller:
+ *
+ * - Dataset Management, with the Attribute Deallocate, that is, TRIM of up to
+ *   NVME_OFFLOAD_DSM_NRANGES_MAX ranges per command; see struct nvme_offload_dsm
+ * - Write Zeroes, of any number of logical blocks, split into commands of at most 64K blocks
+ *   which are driven concurrently; see nvme_offload_write_zeroes()
+ * - Copy, from multiple source ranges to a single destination range of the same namespace, with
+ *   source range descriptors of format 0h; see struct nvme_offload_copy
+ *
+ * The range lists, of Dataset Management and Copy, are built in DMA-capable memory from a
+ * 'struct hostmem_heap', by adding ranges until the list is full, thus, many ranges are handled
+ * by a single command. Adjacent ranges are merged as they are added.
+ *
+ * Support of these commands is optional, thus, check nvme_offload_caps before use, and fall back
+ * to reading and writing the data, when the command is not supported. The capabilities are
+ * gathered by nvme_offload_caps_init(), from the ONCS field of Identify Controller, kept in
+ * `ctrlr->oncs`, and the copy limits of Identify Namespace.
+ *
+ * As with the qpairs they submit on, then the range lists are not thread-safe.
+ *
+ * @file nvme_offload.h
+ * @version 0.4.4
+ */
+
+#define NVME_OFFLOAD_ONCS_DSM (1 << 2)          ///< Dataset Management is supported
+#define NVME_OFFLOAD_ONCS_WRITE_ZEROES (1 << 3) ///< Write Zeroes is supported
+#define NVME_OFFLOAD_ONCS_COPY (1 << 8)         ///< Copy is supported
+
+#define NVME_OFFLOAD_DSM_NRANGES_MAX 256
+#define NVME_OFFLOAD_COPY_NRANGES_MAX 256
+#define NVME_OFFLOAD_WRITE_ZEROES_DEAC (1 << 25) ///< cdw12: deallocate the blocks, if possible
+
+/**
+ * A range of Dataset Management, as defined by the NVM command set
+ */
+struct nvme_offload_dsm_range {
+	uint32_t cattr; ///< Context Attributes
+	uint32_t nlb;   ///< Number of logical blocks; not 0-based
+	uint64_t slba;  ///< Starting LBA
+};
+UPCIE_STATIC_ASSERT(sizeof(struct nvme_offload_dsm_range) == 16, "Incorrect size")
+
+/**
+ * A source range of Copy, of descriptor format 0h, as defined by the NVM command set
+ */
+struct nvme_offload_copy_range {
+	uint64_t rsvd0;
+	uint64_t slba;   ///< Starting LBA
+	uint16_t nlb;    ///< Number of logical blocks; 0-based
+	uint8_t rsvd18[6];
+	uint32_t eilbrt; ///< Expected Initial Logical Block Reference Tag
+	uint16_t elbat;  ///< Expected Logical Block Application Tag
+	uint16_t elbatm; ///< Expected Logical Block Application Tag Mask
+};
+UPCIE_STATIC_ASSERT(sizeof(struct nvme_offload_copy_range) == 32, "Incorrect size")
+
+struct nvme_offload_caps {
+	uint16_t oncs;  ///< Optional NVM Command Support; NVME_OFFLOAD_ONCS_*
+	uint16_t msrc;  ///< Maximum number of source ranges of a Copy; not 0-based
+	uint32_t mssrl; ///< Maximum number of logical blocks of a source range of a Copy
+	uint32_t mcl;   ///< Maximum number of logical blocks of a Copy; 0 when not limited
+};
+
+/**
+ * A list of ranges to deallocate, in DMA-capable memory; a single Dataset Management command
+ */
+struct nvme_offload_dsm {
+	struct nvme_offload_dsm_range *ranges; ///< NVME_OFFLOAD_DSM_NRANGES_MAX ranges
+	uint32_t nranges;                      ///< Number of ranges in use
+	uint32_t rsvd;
+	uint64_t nlb; ///< Total number of logical blocks of the ranges
+};
+
+/**
+ * A list of source ranges, in DMA-capable memory; a single Copy command
+ */
+struct nvme_offload_copy {
+	struct nvme_offload_copy_range *ranges; ///< `max` ranges
+	uint32_t nranges;                       ///< Number of ranges in use
+	uint32_t max;                           ///< Number of ranges; caps->msrc
+	uint32_t mssrl;                         ///< Logical blocks per range; at most 64K
+	uint32_t mcl;                           ///< Logical blocks per command; 0 when not limited
+	uint64_t nlb;                           ///< Total number of logical blocks of the ranges
+};
+
+static inline int
+nvme_offload_caps_pr(struct nvme_offload_caps *caps)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_offload_caps:");
+
+	if (!caps) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+
+	wrtn += printf("\n");
+	wrtn += printf("  oncs: 0x%04" PRIx16 "\n", caps->oncs);
+	wrtn += printf("  dsm: %d\n", !!(caps->oncs & NVME_OFFLOAD_ONCS_DSM));
+	wrtn += printf("  write_zeroes: %d\n", !!(caps->oncs & NVME_OFFLOAD_ONCS_WRITE_ZEROES));
+	wrtn += printf("  copy: %d\n", !!(caps->oncs & NVME_OFFLOAD_ONCS_COPY));
+	wrtn += printf("  msrc: %" PRIu16 "\n", caps->msrc);
+	wrtn += printf("  mssrl: %" PRIu32 "\n", caps->mssrl);
+	wrtn += printf("  mcl: %" PRIu32 "\n", caps->mcl);
+
+	return wrtn;
+}
+
+/**
+ * Gather the offload capabilities of the controller, and the copy limits of namespace `nsid`
+ *
+ * The Identify Namespace data structure is left in ctrlr->buf. As other admin commands of the
+ * controller, this must not run concurrently with them.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_offload_caps_init(struct nvme_offload_caps *caps, struct nvme_controller *ctrlr,
+		       uint32_t nsid)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *idfy = ctrlr->buf;
+	int err;
+
+	memset(caps, 0, sizeof(*caps));
+	caps->oncs = ctrlr->oncs;
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = nsid;
+	cmd.cdw10 = 0; ///< CNS=0: Identify Namespace
+
+	err = nvme_qpair_submit_sync_contig_prps(&ctrlr->aq, ctrlr->heap, ctrlr->buf, 4096, &cmd,
+						 ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)", err);
+		return err;
+	}
+
+	if (caps->oncs & NVME_OFFLOAD_ONCS_COPY) {
+		caps->mssrl = idfy[74] | (idfy[75] << 8);
+		memcpy(&caps->mcl, &idfy[76], sizeof(caps->mcl));
+		caps->msrc = idfy[80] + 1;
+	}
+
+	return 0;
+}
+
+static inline void
+nvme_offload_dsm_reset(struct nvme_offload_dsm *dsm)
+{
+	dsm->nranges = 0;
+	dsm->nlb = 0;
+}
+
+/**
+ * Allocate the range list, of a single page, from the given heap
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_offload_dsm_init(struct nvme_offload_dsm *dsm, struct hostmem_heap *heap)
+{
+	memset(dsm, 0, sizeof(*dsm));
+
+	dsm->ranges = hostmem_dma_malloc(heap, NVME_OFFLOAD_DSM_NRANGES_MAX * sizeof(*dsm->ranges));
+	if (!dsm->ranges) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(); errno(%d)", errno);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static inline void
+nvme_offload_dsm_term(struct nvme_offload_dsm *dsm, struct hostmem_heap *heap)
+{
+	hostmem_dma_free(heap, dsm->ranges);
+	memset(dsm, 0, sizeof(*dsm));
+}
+
+/**
+ * Add the `nlb` logical blocks at `slba` to the list; merged with the last range when adjacent
+ *
+ * @return On success 0 is returned. When the list is full, then -ENOSPC is returned, and none of
+ *         the blocks are added; submit the list, and add again.
+ */
+static inline int
+nvme_offload_dsm_add(struct nvme_offload_dsm *dsm, uint64_t slba, uint64_t nlb)
+{
+	struct nvme_offload_dsm_range *last = dsm->nranges ? &dsm->ranges[dsm->nranges - 1] : NULL;
+	uint64_t nranges;
+
+	if (!nlb) {
+		return -EINVAL;
+	}
+
+	if (last && last->slba + last->nlb == slba && last->nlb + nlb <= UINT32_MAX) {
+		last->nlb += nlb;
+		dsm->nlb += nlb;
+		return 0;
+	}
+
+	nranges = (nlb + UINT32_MAX - 1) / UINT32_MAX;
+	if (dsm->nranges + nranges > NVME_OFFLOAD_DSM_NRANGES_MAX) {
+		return -ENOSPC;
+	}
+
+	dsm->nlb += nlb;
+	while (nlb) {
+		struct nvme_offload_dsm_range *range = &dsm->ranges[dsm->nranges++];
+		uint32_t n = nlb < UINT32_MAX ? nlb : UINT32_MAX;
+
+		range->cattr = 0;
+		range->nlb = n;
+		range->slba = slba;
+
+		slba += n;
+		nlb -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Prepare a Dataset Management command, with the Attribute Deallocate, of the ranges of the list
+ *
+ * The PRPs are not set; see nvme_offload_dsm_submit_sync() and nvme_offload_dsm_submit_async().
+ */
+static inline void
+nvme_offload_dsm_prep(struct nvme_offload_dsm *dsm, uint32_t nsid, struct nvme_command *cmd)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = 0x9; ///< DATASET MANAGEMENT
+	cmd->nsid = nsid;
+	cmd->cdw10 = dsm->nranges - 1; ///< NR; 0-based
+	cmd->cdw11 = 1 << 2;           ///< AD: Attribute Deallocate
+}
+
+/**
+ * Deallocate the ranges of the list, wait for completion, and reset the list
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_offload_dsm_submit_sync(struct nvme_qpair *qp, struct hostmem_heap *heap,
+			     struct nvme_offload_dsm *dsm, uint32_t nsid, int timeout_ms,
+			     struct nvme_completion *cpl)
+{
+	struct nvme_command cmd;
+	int err;
+
+	if (!dsm->nranges) {
+		return 0;
+	}
+
+	nvme_offload_dsm_prep(dsm, nsid, &cmd);
+
+	err = nvme_qpair_submit_sync_contig_prps(qp, heap, dsm->ranges,
+						 dsm->nranges * sizeof(*dsm->ranges), &cmd,
+						 timeout_ms, cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(DSM); err(%d)", err);
+		return err;
+	}
+	nvme_offload_dsm_reset(dsm);
+
+	return 0;
+}
+
+/**
+ * Deallocate the ranges of the list, without waiting for completion
+ *
+ * The list must not be modified until `cb` has been invoked; reset it with
+ * nvme_offload_dsm_reset() then, e.g. from `cb`.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EBUSY when the submission queue, or the request pool, is exhausted.
+ */
+static inline int
+nvme_offload_dsm_submit_async(struct nvme_qpair *qp, struct hostmem_heap *heap,
+			      struct nvme_offload_dsm *dsm, uint32_t nsid, nvme_request_cb cb,
+			      void *user)
+{
+	struct nvme_command cmd;
+
+	if (!dsm->nranges) {
+		return -EINVAL;
+	}
+
+	nvme_offload_dsm_prep(dsm, nsid, &cmd);
+
+	return nvme_qpair_submit_async_contig_prps(qp, heap, dsm->ranges,
+						   dsm->nranges * sizeof(*dsm->ranges), &cmd, cb,
+						   user);
+}
+
+/**
+ * Prepare a Write Zeroes command of `nlb` logical blocks at `slba`
+ *
+ * @param cmd The command to prepare
+ * @param nsid Namespace identifier
+ * @param slba Starting LBA
+ * @param nlb Number of logical blocks; 1 to 65536
+ * @param flags Bits of cdw12 other than NLB, e.g. NVME_OFFLOAD_WRITE_ZEROES_DEAC
+ */
+static inline void
+nvme_offload_write_zeroes_prep(struct nvme_command *cmd, uint32_t nsid, uint64_t slba,
+			       uint32_t nlb, uint32_t flags)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = 0x8; ///< WRITE ZEROES
+	cmd->nsid = nsid;
+	cmd->cdw10 = slba & 0xFFFFFFFF;
+	cmd->cdw11 = slba >> 32;
+	cmd->cdw12 = (flags & 0xFFFF0000) | ((nlb - 1) & 0xFFFF);
+}
+
+/**
+ * State of a single nvme_offload_write_zeroes(); see nvme_qpair_pipeline_run()
+ */
+struct nvme_offload_ctx {
+	struct nvme_qpair *qp;
+	uint64_t slba;
+	uint64_t nlb;
+	uint64_t nsubmitted; ///< Number of logical blocks enqueued
+	uint32_t nsid;
+	uint32_t flags;
+};
+
+/**
+ * Enqueue the next commands of a nvme_offload_write_zeroes(); see nvme_qpair_pipeline_submit_fn
+ */
+static inline int
+nvme_offload_submit(struct nvme_qpair_pipeline *pl, void *arg)
+{
+	struct nvme_offload_ctx *ctx = arg;
+	int batch = 0;
+
+	while (ctx->nsubmitted < ctx->nlb) {
+		uint64_t n = ctx->nlb - ctx->nsubmitted;
+		struct nvme_command cmd;
+		struct nvme_request *req;
+
+		n = n < 0x10000 ? n : 0x10000;
+
+		req = nvme_qpair_pipeline_request(pl, ctx->qp);
+		if (!req) {
+			break;
+		}
+
+		nvme_offload_write_zeroes_prep(&cmd, ctx->nsid, ctx->slba + ctx->nsubmitted, n,
+					       ctx->flags);
+		cmd.cid = req->cid;
+		if (nvme_qpair_enqueue(ctx->qp, &cmd)) {
+			nvme_request_free(ctx->qp->rpool, req->cid);
+			break;
+		}
+		ctx->nsubmitted += n;
+		pl->ncmds++;
+		batch++;
+	}
+	if (batch) {
+		nvme_qpair_sqdb_update(ctx->qp);
+	}
+
+	return ctx->nsubmitted < ctx->nlb;
+}
+
+static inline struct nvme_qpair *
+nvme_offload_qpair(void *arg, uint32_t idx)
+{
+	struct nvme_offload_ctx *ctx = arg;
+
+	return idx ? NULL : ctx->qp;
+}
+
+/**
+ * Write zeroes to the `nlb` logical blocks at `slba`, and wait for completion
+ *
+ * The range is split into commands of at most 64K logical blocks, which are submitted until the
+ * qpair is full, with one SQ doorbell write per batch, and then completions are processed, until
+ * all are done; see nvme_qpair_pipeline_run(). When no completion is processed for the timeout,
+ * then the range is given up; the commands still in flight are detached, thus, the qpair may be
+ * used again.
+ *
+ * @param qp The qpair to submit on
+ * @param nsid Namespace identifier
+ * @param slba Starting LBA
+ * @param nlb Number of logical blocks
+ * @param flags Bits of cdw12 other than NLB, e.g. NVME_OFFLOAD_WRITE_ZEROES_DEAC
+ * @param timeout_ms Timeout in milliseconds without any completion
+ * @param cpl Pointer to store the completion of the first failed command; may be NULL
+ *
+ * @return On success 0 is returned. When a command fails, -EIO is returned, after all commands
+ *         have completed. On timeout -EAGAIN is returned. On other errors, negative errno is
+ *         returned to indicate the error.
+ */
+static inline int
+nvme_offload_write_zeroes(struct nvme_qpair *qp, uint32_t nsid, uint64_t slba, uint64_t nlb,
+			  uint32_t flags, int timeout_ms, struct nvme_completion *cpl)
+{
+	struct nvme_offload_ctx ctx = {.qp = qp, .slba = slba, .nlb = nlb, .nsid = nsid,
+				       .flags = flags};
+	struct nvme_qpair_pipeline pl = {0};
+
+	return nvme_qpair_pipeline_run(&pl, nvme_offload_submit, nvme_offload_qpair, &ctx,
+				       timeout_ms, cpl);
+}
+
+static inline void
+nvme_offload_copy_reset(struct nvme_offload_copy *copy)
+{
+	copy->nranges = 0;
+	copy->nlb = 0;
+}
+
+/**
+ * Allocate the list of source ranges, within the limits of the given capabilities
+ *
+ * @return On success 0 is returned. When Copy is not supported, then -ENOTSUP is returned. On
+ *         other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_offload_copy_init(struct nvme_offload_copy *copy, struct hostmem_heap *heap,
+		       struct nvme_offload_caps *caps)
+{
+	memset(copy, 0, sizeof(*copy));
+
+	if (!(caps->oncs & NVME_OFFLOAD_ONCS_COPY) || !caps->msrc) {
+		UPCIE_DEBUG("FAILED: Copy is not supported; oncs(0x%x)", caps->oncs);
+		return -ENOTSUP;
+	}
+
+	copy->max = caps->msrc < NVME_OFFLOAD_COPY_NRANGES_MAX ? caps->msrc
+							      : NVME_OFFLOAD_COPY_NRANGES_MAX;
+	copy->mssrl = caps->mssrl && caps->mssrl < 0x10000 ? caps->mssrl : 0x10000;
+	copy->mcl = caps->mcl;
+
+	copy->ranges = hostmem_dma_malloc(heap, copy->max * sizeof(*copy->ranges));
+	if (!copy->ranges) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(); errno(%d)", errno);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static inline void
+nvme_offload_copy_term(struct nvme_offload_copy *copy, struct hostmem_heap *heap)
+{
+	hostmem_dma_free(heap, copy->ranges);
+	memset(copy, 0, sizeof(*copy));
+}
+
+/**
+ * Add the `nlb` logical blocks at `slba` as source; split into ranges of at most `mssrl` blocks,
+ * and merged with the last range when adjacent
+ *
+ * @return On success 0 is returned. When the ranges, or the blocks, would exceed the limits of a
+ *         single Copy, then -ENOSPC is returned, and none of the blocks are added; submit the
+ *         list, and add again.
+ */
+static inline int
+nvme_offload_copy_add(struct nvme_offload_copy *copy, uint64_t slba, uint64_t nlb)
+{
+	struct nvme_offload_copy_range *last = NULL;
+	uint64_t nranges;
+
+	if (!nlb) {
+		return -EINVAL;
+	}
+	if (copy->mcl && copy->nlb + nlb > copy->mcl) {
+		return -ENOSPC;
+	}
+
+	if (copy->nranges) {
+		last = &copy->ranges[copy->nranges - 1];
+	}
+	if (last && last->slba + last->nlb + 1 == slba && last->nlb + 1 + nlb <= copy->mssrl) {
+		last->nlb += nlb;
+		copy->nlb += nlb;
+		return 0;
+	}
+
+	nranges = (nlb + copy->mssrl - 1) / copy->mssrl;
+	if (copy->nranges + nranges > copy->max) {
+		return -ENOSPC;
+	}
+
+	copy->nlb += nlb;
+	while (nlb) {
+		struct nvme_offload_copy_range *range = &copy->ranges[copy->nranges++];
+		uint32_t n = nlb < copy->mssrl ? nlb : copy->mssrl;
+
+		memset(range, 0, sizeof(*range));
+		range->slba = slba;
+		range->nlb = n - 1;
+
+		slba += n;
+		nlb -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Prepare a Copy command, of the source ranges of the list, to the blocks at `sdlba`
+ *
+ * The PRPs are not set; see nvme_offload_copy_submit_sync() and nvme_offload_copy_submit_async().
+ */
+static inline void
+nvme_offload_copy_prep(struct nvme_offload_copy *copy, uint32_t nsid, uint64_t sdlba,
+		       struct nvme_command *cmd)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = 0x19; ///< COPY
+	cmd->nsid = nsid;
+	cmd->cdw10 = sdlba & 0xFFFFFFFF;
+	cmd->cdw11 = sdlba >> 32;
+	cmd->cdw12 = (copy->nranges - 1) & 0xFF; ///< NR; 0-based, Descriptor Format 0h
+}
+
+/**
+ * Copy the source ranges of the list to the blocks at `sdlba`, wait for completion, and reset
+ * the list
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_offload_copy_submit_sync(struct nvme_qpair *qp, struct hostmem_heap *heap,
+			      struct nvme_offload_copy *copy, uint32_t nsid, uint64_t sdlba,
+			      int timeout_ms, struct nvme_completion *cpl)
+{
+	struct nvme_command cmd;
+	int err;
+
+	if (!copy->nranges) {
+		return 0;
+	}
+
+	nvme_offload_copy_prep(copy, nsid, sdlba, &cmd);
+
+	err = nvme_qpair_submit_sync_contig_prps(qp, heap, copy->ranges,
+						 copy->nranges * sizeof(*copy->ranges), &cmd,
+						 timeout_ms, cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(Copy); err(%d)", err);
+		return err;
+	}
+	nvme_offload_copy_reset(copy);
+
+	return 0;
+}
+
+/**
+ * Copy the source ranges of the list to the blocks at `sdlba`, without waiting for completion
+ *
+ * The list must not be modified until `cb` has been invoked; reset it with
+ * nvme_offload_copy_reset() then, e.g. from `cb`.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EBUSY when the submission queue, or the request pool, is exhausted.
+ */
+static inline int
+nvme_offload_copy_submit_async(struct nvme_qpair *qp, struct hostmem_heap *heap,
+			       struct nvme_offload_copy *copy, uint32_t nsid, uint64_t sdlba,
+			       nvme_request_cb cb, void *user)
+{
+	struct nvme_command cmd;
+
+	if (!copy->nranges) {
+		return -EINVAL;
+	}
+
+	nvme_offload_copy_prep(copy, nsid, sdlba, &cmd);
+
+	return nvme_qpair_submit_async_contig_prps(qp, heap, copy->ranges,
+						   copy->nranges * sizeof(*copy->ranges), &cmd, cb,
+						   user);
+}
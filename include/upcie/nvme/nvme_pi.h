@@ -0,0 +1,442 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * End-to-end Data Protection Information
+ * ======================================
+ *
+ * For namespaces formatted with Protection Information (PI), that is, with a non-zero PI Type in
+ * the End-to-end Data Protection Type Settings (DPS), each logical block carries an 8-byte tuple
+ * in its metadata: a 16-bit Guard, the CRC16 T10-DIF of the data of the block, a 16-bit
+ * Application Tag, and a 32-bit Reference Tag, for PI Types 1 and 2 the lower 32 bits of the
+ * logical block address. The tuple is stored big-endian, in the first 8 bytes of the metadata when
+ * DPS.PIP is set, otherwise in the last; in the latter case the Guard also covers the metadata
+ * bytes preceding the tuple.
+ *
+ * The metadata is transferred either as a separate buffer, via the Metadata Pointer (MPTR) of the
+ * command, see nvme_request_prep_command_mptr(), or interleaved with the data, as extended LBAs;
+ * nvme_pi_generate() and nvme_pi_verify() take the metadata buffer, or NULL for the latter. The
+ * PRINFO of a command, that is, PRACT and the checks done by the controller (PRCHK), along with
+ * the expected tags, are set by nvme_pi_prep().
+ *
+ * The Guard is computed by nvme_pi_crc16(), which, on x86 with PCLMULQDQ, and on aarch64 when
+ * built with the crypto extension (PMULL), folds the data with carry-less multiplication, 64
+ * bytes at a time; otherwise a table-driven scalar, nvme_pi_crc16_scalar(), is used. Thus, the
+ * Guard of a logical block is computed at a throughput well above that of a controller.
+ *
+ * Only the 16-bit Guard PI format is supported; the 32b and 64b Guard formats of the extended LBA
+ * formats are not.
+ *
+ * @file nvme_pi.h
+ * @version 0.4.4
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for _mm_clmulepi64_si128()
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#include <arm_neon.h> // for vmull_p64()
+#define NVME_PI_PMULL
+#endif
+
+#define NVME_PI_PRINFO_PRACT (1 << 3)       ///< Controller inserts, or strips, and checks the PI
+#define NVME_PI_PRINFO_PRCHK_GUARD (1 << 2) ///< Controller checks the Guard
+#define NVME_PI_PRINFO_PRCHK_APP (1 << 1)   ///< Controller checks the Application Tag
+#define NVME_PI_PRINFO_PRCHK_REF (1 << 0)   ///< Controller checks the Reference Tag
+#define NVME_PI_PRINFO_PRCHK_ALL 0x7
+
+#define NVME_PI_APPTAG_ESCAPE 0xFFFF ///< Application Tag of blocks which are not checked
+
+/**
+ * The protection information tuple of a logical block; fields are big-endian
+ */
+struct nvme_pi_tuple {
+	uint16_t guard;  ///< CRC16 T10-DIF of the data, and of the metadata preceding the tuple
+	uint16_t apptag; ///< Application Tag
+	uint32_t reftag; ///< Reference Tag
+};
+
+/**
+ * CRC16 T10-DIF, polynomial 0x8BB7, MSB-first, of all bytes
+ */
+static const uint16_t nvme_pi_crc16_lut[256] = {
+	0x0000, 0x8BB7, 0x9CD9, 0x176E, 0xB205, 0x39B2, 0x2EDC, 0xA56B,
+	0xEFBD, 0x640A, 0x7364, 0xF8D3, 0x5DB8, 0xD60F, 0xC161, 0x4AD6,
+	0x54CD, 0xDF7A, 0xC814, 0x43A3, 0xE6C8, 0x6D7F, 0x7A11, 0xF1A6,
+	0xBB70, 0x30C7, 0x27A9, 0xAC1E, 0x0975, 0x82C2, 0x95AC, 0x1E1B,
+	0xA99A, 0x222D, 0x3543, 0xBEF4, 0x1B9F, 0x9028, 0x8746, 0x0CF1,
+	0x4627, 0xCD90, 0xDAFE, 0x5149, 0xF422, 0x7F95, 0x68FB, 0xE34C,
+	0xFD57, 0x76E0, 0x618E, 0xEA39, 0x4F52, 0xC4E5, 0xD38B, 0x583C,
+	0x12EA, 0x995D, 0x8E33, 0x0584, 0xA0EF, 0x2B58, 0x3C36, 0xB781,
+	0xD883, 0x5334, 0x445A, 0xCFED, 0x6A86, 0xE131, 0xF65F, 0x7DE8,
+	0x373E, 0xBC89, 0xABE7, 0x2050, 0x853B, 0x0E8C, 0x19E2, 0x9255,
+	0x8C4E, 0x07F9, 0x1097, 0x9B20, 0x3E4B, 0xB5FC, 0xA292, 0x2925,
+	0x63F3, 0xE844, 0xFF2A, 0x749D, 0xD1F6, 0x5A41, 0x4D2F, 0xC698,
+	0x7119, 0xFAAE, 0xEDC0, 0x6677, 0xC31C, 0x48AB, 0x5FC5, 0xD472,
+	0x9EA4, 0x1513, 0x027D, 0x89CA, 0x2CA1, 0xA716, 0xB078, 0x3BCF,
+	0x25D4, 0xAE63, 0xB90D, 0x32BA, 0x97D1, 0x1C66, 0x0B08, 0x80BF,
+	0xCA69, 0x41DE, 0x56B0, 0xDD07, 0x786C, 0xF3DB, 0xE4B5, 0x6F02,
+	0x3AB1, 0xB106, 0xA668, 0x2DDF, 0x88B4, 0x0303, 0x146D, 0x9FDA,
+	0xD50C, 0x5EBB, 0x49D5, 0xC262, 0x6709, 0xECBE, 0xFBD0, 0x7067,
+	0x6E7C, 0xE5CB, 0xF2A5, 0x7912, 0xDC79, 0x57CE, 0x40A0, 0xCB17,
+	0x81C1, 0x0A76, 0x1D18, 0x96AF, 0x33C4, 0xB873, 0xAF1D, 0x24AA,
+	0x932B, 0x189C, 0x0FF2, 0x8445, 0x212E, 0xAA99, 0xBDF7, 0x3640,
+	0x7C96, 0xF721, 0xE04F, 0x6BF8, 0xCE93, 0x4524, 0x524A, 0xD9FD,
+	0xC7E6, 0x4C51, 0x5B3F, 0xD088, 0x75E3, 0xFE54, 0xE93A, 0x628D,
+	0x285B, 0xA3EC, 0xB482, 0x3F35, 0x9A5E, 0x11E9, 0x0687, 0x8D30,
+	0xE232, 0x6985, 0x7EEB, 0xF55C, 0x5037, 0xDB80, 0xCCEE, 0x4759,
+	0x0D8F, 0x8638, 0x9156, 0x1AE1, 0xBF8A, 0x343D, 0x2353, 0xA8E4,
+	0xB6FF, 0x3D48, 0x2A26, 0xA191, 0x04FA, 0x8F4D, 0x9823, 0x1394,
+	0x5942, 0xD2F5, 0xC59B, 0x4E2C, 0xEB47, 0x60F0, 0x779E, 0xFC29,
+	0x4BA8, 0xC01F, 0xD771, 0x5CC6, 0xF9AD, 0x721A, 0x6574, 0xEEC3,
+	0xA415, 0x2FA2, 0x38CC, 0xB37B, 0x1610, 0x9DA7, 0x8AC9, 0x017E,
+	0x1F65, 0x94D2, 0x83BC, 0x080B, 0xAD60, 0x26D7, 0x31B9, 0xBA0E,
+	0xF0D8, 0x7B6F, 0x6C01, 0xE7B6, 0x42DD, 0xC96A, 0xDE04, 0x55B3,
+};
+
+/**
+ * Compute the CRC16 T10-DIF of `nbytes` of `buf`, continuing from `crc`; 0 for a new CRC
+ */
+static inline uint16_t
+nvme_pi_crc16_scalar(uint16_t crc, const void *buf, size_t nbytes)
+{
+	const uint8_t *p = buf;
+
+	for (size_t i = 0; i < nbytes; ++i) {
+		crc = (crc << 8) ^ nvme_pi_crc16_lut[((crc >> 8) ^ p[i]) & 0xFF];
+	}
+
+	return crc;
+}
+
+/**
+ * Folding constants; x^n mod 0x18BB7, for folding 128 bits, and 512 bits, at a time
+ *
+ * The data is kept as 128-bit polynomials, the first byte most significant. A 128-bit lane of
+ * high and low 64 bits, H * x^64 + L, is moved n bits forward by H * (x^(n+64) mod P) + L * (x^n
+ * mod P), which is congruent modulo P and of degree below 128. Once all the data is folded into a
+ * single lane, the CRC of the lane, as 16 bytes, is the CRC of the data.
+ */
+#define NVME_PI_CRC16_X128 0xA010ULL
+#define NVME_PI_CRC16_X192 0x1FAAULL
+#define NVME_PI_CRC16_X512 0x1069ULL
+#define NVME_PI_CRC16_X576 0xDD31ULL
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("pclmul,ssse3"))) static inline __m128i
+nvme_pi_crc16_clmul_fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+/**
+ * Compute the CRC16 T10-DIF via PCLMULQDQ; see nvme_pi_crc16_scalar()
+ */
+__attribute__((target("pclmul,ssse3"))) static inline uint16_t
+nvme_pi_crc16_clmul(uint16_t crc, const void *buf, size_t nbytes)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k128 = _mm_set_epi64x(NVME_PI_CRC16_X192, NVME_PI_CRC16_X128);
+	const __m128i k512 = _mm_set_epi64x(NVME_PI_CRC16_X576, NVME_PI_CRC16_X512);
+	const uint8_t *p = buf;
+	uint8_t lane[16];
+	__m128i x[4];
+
+	if (nbytes < 64) {
+		return nvme_pi_crc16_scalar(crc, buf, nbytes);
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		x[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+	}
+	// Continuing from `crc` is the same as starting from 0, with `crc` added to the first bytes
+	x[0] = _mm_xor_si128(x[0], _mm_set_epi64x((long long)((uint64_t)crc << 48), 0));
+	p += 64;
+	nbytes -= 64;
+
+	for (; nbytes >= 64; p += 64, nbytes -= 64) {
+		for (int i = 0; i < 4; ++i) {
+			__m128i d = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+
+			x[i] = _mm_xor_si128(nvme_pi_crc16_clmul_fold(x[i], k512),
+					     _mm_shuffle_epi8(d, bswap));
+		}
+	}
+
+	x[0] = _mm_xor_si128(nvme_pi_crc16_clmul_fold(x[0], k128), x[1]);
+	x[0] = _mm_xor_si128(nvme_pi_crc16_clmul_fold(x[0], k128), x[2]);
+	x[0] = _mm_xor_si128(nvme_pi_crc16_clmul_fold(x[0], k128), x[3]);
+	for (; nbytes >= 16; p += 16, nbytes -= 16) {
+		__m128i d = _mm_loadu_si128((const __m128i *)p);
+
+		x[0] = _mm_xor_si128(nvme_pi_crc16_clmul_fold(x[0], k128),
+				     _mm_shuffle_epi8(d, bswap));
+	}
+
+	_mm_storeu_si128((__m128i *)lane, _mm_shuffle_epi8(x[0], bswap));
+
+	return nvme_pi_crc16_scalar(nvme_pi_crc16_scalar(0, lane, 16), p, nbytes);
+}
+#endif
+
+#ifdef NVME_PI_PMULL
+static inline uint8x16_t
+nvme_pi_crc16_pmull_load(const uint8_t *p)
+{
+	uint8x16_t d = vrev64q_u8(vld1q_u8(p));
+
+	return vextq_u8(d, d, 8);
+}
+
+static inline uint8x16_t
+nvme_pi_crc16_pmull_fold(uint8x16_t x, uint64_t k_hi, uint64_t k_lo)
+{
+	uint64x2_t x64 = vreinterpretq_u64_u8(x);
+	poly128_t hi = vmull_p64((poly64_t)vgetq_lane_u64(x64, 1), (poly64_t)k_hi);
+	poly128_t lo = vmull_p64((poly64_t)vgetq_lane_u64(x64, 0), (poly64_t)k_lo);
+
+	return veorq_u8(vreinterpretq_u8_p128(hi), vreinterpretq_u8_p128(lo));
+}
+
+/**
+ * Compute the CRC16 T10-DIF via PMULL; see nvme_pi_crc16_scalar()
+ */
+static inline uint16_t
+nvme_pi_crc16_pmull(uint16_t crc, const void *buf, size_t nbytes)
+{
+	const uint8_t *p = buf;
+	uint8_t lane[16];
+	uint8x16_t x[4];
+
+	if (nbytes < 64) {
+		return nvme_pi_crc16_scalar(crc, buf, nbytes);
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		x[i] = nvme_pi_crc16_pmull_load(p + 16 * i);
+	}
+	// Continuing from `crc` is the same as starting from 0, with `crc` added to the first bytes
+	x[0] = veorq_u8(x[0], vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(0),
+								vcreate_u64((uint64_t)crc << 48))));
+	p += 64;
+	nbytes -= 64;
+
+	for (; nbytes >= 64; p += 64, nbytes -= 64) {
+		for (int i = 0; i < 4; ++i) {
+			x[i] = veorq_u8(nvme_pi_crc16_pmull_fold(x[i], NVME_PI_CRC16_X576,
+								 NVME_PI_CRC16_X512),
+					nvme_pi_crc16_pmull_load(p + 16 * i));
+		}
+	}
+
+	for (int i = 1; i < 4; ++i) {
+		x[0] = veorq_u8(
+			nvme_pi_crc16_pmull_fold(x[0], NVME_PI_CRC16_X192, NVME_PI_CRC16_X128),
+			x[i]);
+	}
+	for (; nbytes >= 16; p += 16, nbytes -= 16) {
+		x[0] = veorq_u8(
+			nvme_pi_crc16_pmull_fold(x[0], NVME_PI_CRC16_X192, NVME_PI_CRC16_X128),
+			nvme_pi_crc16_pmull_load(p));
+	}
+
+	x[0] = vrev64q_u8(x[0]);
+	vst1q_u8(lane, vextq_u8(x[0], x[0], 8));
+
+	return nvme_pi_crc16_scalar(nvme_pi_crc16_scalar(0, lane, 16), p, nbytes);
+}
+#endif
+
+typedef uint16_t (*nvme_pi_crc16_fn)(uint16_t crc, const void *buf, size_t nbytes);
+
+/**
+ * Returns the CRC16 T10-DIF implementation for the CPU; carry-less multiplication when it has it
+ */
+static inline nvme_pi_crc16_fn
+nvme_pi_crc16_resolve(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+		return nvme_pi_crc16_clmul;
+	}
+#elif defined(NVME_PI_PMULL)
+	return nvme_pi_crc16_pmull;
+#endif
+
+	return nvme_pi_crc16_scalar;
+}
+
+/**
+ * Compute the CRC16 T10-DIF of `nbytes` of `buf`, continuing from `crc`; 0 for a new CRC
+ *
+ * Uses carry-less multiplication when the CPU has it, see above; the result is the same as that
+ * of nvme_pi_crc16_scalar(). The CPU is checked on the first call only, the implementation is
+ * then kept, as tsc_hz() keeps its calibration.
+ */
+static inline uint16_t
+nvme_pi_crc16(uint16_t crc, const void *buf, size_t nbytes)
+{
+	static nvme_pi_crc16_fn fn;
+	nvme_pi_crc16_fn crc16 = __atomic_load_n(&fn, __ATOMIC_RELAXED);
+
+	if (!crc16) {
+		crc16 = nvme_pi_crc16_resolve();
+		__atomic_store_n(&fn, crc16, __ATOMIC_RELAXED);
+	}
+
+	return crc16(crc, buf, nbytes);
+}
+
+/**
+ * Returns the offset of the protection information tuple in the metadata of a logical block
+ */
+static inline uint32_t
+nvme_pi_offset(struct nvme_namespace *ns)
+{
+	return (ns->dps & NVME_NAMESPACE_DPS_PIP) ? 0 : ns->ms - sizeof(struct nvme_pi_tuple);
+}
+
+/**
+ * Returns the Guard of the logical block `data`, with metadata `meta`
+ */
+static inline uint16_t
+nvme_pi_guard(struct nvme_namespace *ns, const uint8_t *data, const uint8_t *meta)
+{
+	uint16_t guard = nvme_pi_crc16(0, data, ns->lba_nbytes);
+
+	return nvme_pi_crc16_scalar(guard, meta, nvme_pi_offset(ns));
+}
+
+/**
+ * Returns the metadata of the logical block `i`, of `data` or `meta`, see nvme_pi_generate()
+ */
+static inline uint8_t *
+nvme_pi_meta(struct nvme_namespace *ns, void *data, void *meta, uint64_t i)
+{
+	if (meta) {
+		return (uint8_t *)meta + i * ns->ms;
+	}
+
+	return (uint8_t *)data + i * (ns->lba_nbytes + ns->ms) + ns->lba_nbytes;
+}
+
+static inline uint8_t *
+nvme_pi_data(struct nvme_namespace *ns, void *data, void *meta, uint64_t i)
+{
+	return (uint8_t *)data + i * (meta ? ns->lba_nbytes : ns->lba_nbytes + ns->ms);
+}
+
+/**
+ * Generate the protection information of `nlb` logical blocks at `slba`
+ *
+ * @param ns The namespace; formatted with PI
+ * @param data The data of the logical blocks; with extended LBAs, the data and metadata
+ * @param meta The metadata of the logical blocks, as given via MPTR; NULL with extended LBAs
+ * @param slba The first logical block; the Reference Tag of PI Types 1 and 2
+ * @param nlb Number of logical blocks
+ * @param apptag The Application Tag
+ *
+ * @return On success 0 is returned. When the namespace is not formatted with PI, then -EINVAL is
+ *         returned.
+ */
+static inline int
+nvme_pi_generate(struct nvme_namespace *ns, void *data, void *meta, uint64_t slba, uint64_t nlb,
+		 uint16_t apptag)
+{
+	if (!(ns->dps & NVME_NAMESPACE_DPS_PIT_MASK) || ns->ms < sizeof(struct nvme_pi_tuple)) {
+		return -EINVAL;
+	}
+
+	for (uint64_t i = 0; i < nlb; ++i) {
+		uint8_t *md = nvme_pi_meta(ns, data, meta, i);
+		uint16_t guard = nvme_pi_guard(ns, nvme_pi_data(ns, data, meta, i), md);
+		struct nvme_pi_tuple pi;
+
+		pi.guard = __builtin_bswap16(guard);
+		pi.apptag = __builtin_bswap16(apptag);
+		pi.reftag = __builtin_bswap32((uint32_t)(slba + i));
+		memcpy(md + nvme_pi_offset(ns), &pi, sizeof(pi));
+	}
+
+	return 0;
+}
+
+/**
+ * Verify the protection information of `nlb` logical blocks at `slba`
+ *
+ * The checks are those of the controller for PRCHK of all fields: the Guard, the Application Tag
+ * under `appmask`, and, for PI Types 1 and 2, the Reference Tag. Blocks with the Application Tag
+ * NVME_PI_APPTAG_ESCAPE, and for PI Type 3 also the Reference Tag 0xFFFFFFFF, are not checked.
+ *
+ * @param ns The namespace; formatted with PI
+ * @param data The data of the logical blocks; with extended LBAs, the data and metadata
+ * @param meta The metadata of the logical blocks, as given via MPTR; NULL with extended LBAs
+ * @param slba The first logical block
+ * @param nlb Number of logical blocks
+ * @param apptag The expected Application Tag
+ * @param appmask The bits of the Application Tag to check
+ * @param bad Pointer to store the index of the first block failing a check; may be NULL
+ *
+ * @return On success 0 is returned. When a block fails a check, then -EIO is returned; when the
+ *         namespace is not formatted with PI, then -EINVAL.
+ */
+static inline int
+nvme_pi_verify(struct nvme_namespace *ns, void *data, void *meta, uint64_t slba, uint64_t nlb,
+	       uint16_t apptag, uint16_t appmask, uint64_t *bad)
+{
+	uint8_t pit = ns->dps & NVME_NAMESPACE_DPS_PIT_MASK;
+
+	if (!pit || ns->ms < sizeof(struct nvme_pi_tuple)) {
+		return -EINVAL;
+	}
+
+	for (uint64_t i = 0; i < nlb; ++i) {
+		uint8_t *md = nvme_pi_meta(ns, data, meta, i);
+		struct nvme_pi_tuple pi;
+		uint16_t pi_apptag;
+		uint32_t pi_reftag;
+
+		memcpy(&pi, md + nvme_pi_offset(ns), sizeof(pi));
+		pi_apptag = __builtin_bswap16(pi.apptag);
+		pi_reftag = __builtin_bswap32(pi.reftag);
+
+		if (pi_apptag == NVME_PI_APPTAG_ESCAPE && (pit != 3 || pi_reftag == 0xFFFFFFFF)) {
+			continue;
+		}
+
+		if (__builtin_bswap16(pi.guard) !=
+			    nvme_pi_guard(ns, nvme_pi_data(ns, data, meta, i), md) ||
+		    ((pi_apptag ^ apptag) & appmask) ||
+		    (pit != 3 && pi_reftag != (uint32_t)(slba + i))) {
+			UPCIE_DEBUG("FAILED: lba(%" PRIu64 ") apptag(0x%" PRIx16
+				    ") reftag(0x%" PRIx32 ")",
+				    slba + i, pi_apptag, pi_reftag);
+			if (bad) {
+				*bad = i;
+			}
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Set the PRINFO of a read, or write, command, as prepared by nvme_namespace_prep()
+ *
+ * PRINFO replaces that set by nvme_namespace_prep(). With PRCHK of the Reference Tag, the Initial
+ * Logical Block Reference Tag is the lower 32 bits of `slba`, as generated by nvme_pi_generate().
+ *
+ * @param cmd The command
+ * @param prinfo NVME_PI_PRINFO_* flags
+ * @param slba The first logical block of the command
+ * @param apptag The expected Application Tag
+ * @param appmask The bits of the Application Tag checked by the controller
+ */
+static inline void
+nvme_pi_prep(struct nvme_command *cmd, uint8_t prinfo, uint64_t slba, uint16_t apptag,
+	     uint16_t appmask)
+{
+	cmd->cdw12 = (cmd->cdw12 & ~(0xFU << 26)) | ((uint32_t)(prinfo & 0xF) << 26);
+	cmd->cdw14 = (uint32_t)slba;
+	cmd->cdw15 = ((uint32_t)appmask << 16) | apptag;
+}
@@ -16,11 +16,121 @@
  * Key functions include:
  *
  * nvme_qpair_init():      Initializes a queue pair and allocates DMA memory for SQ/CQ.
+ * nvme_qpair_init_sq():   Same, for an SQ completing to a shared CQ; allocates no CQ.
  * nvme_qpair_term():      Frees resources associated with a queue pair.
  * nvme_qpair_reap_cpl():  Polls the CQ for a completion, updates head/phase, and rings CQ
  * doorbell. nvme_qpair_sqdb_ring(): Notifies the controller by ringing the SQ doorbell.
+ * nvme_qpair_set_poll():  Selects how nvme_qpair_reap_cpl() waits; spin, hybrid or adaptive.
+ * nvme_qpair_reap_cpls(): Reaps up to N ready completions and rings the CQ doorbell once.
  * nvme_qpair_enqueue():     Writes the given command into the SQ
+ * nvme_qpair_enqueue_batch(): Writes N commands into the SQ, handling wrap-around.
  * nvme_qpair_submit_sync(): Submits a command and waits synchronously for its completion.
+ * nvme_qpair_submit_async(): Submits a command with a completion callback, without waiting.
+ * nvme_qpair_process_completions(): Reaps ready completions and invokes their callbacks.
+ * nvme_qpair_reset():     Rewinds the queues, in place, e.g. after a controller reset.
+ * nvme_qpair_set_timeout(): Gives commands a deadline, and a callback for when they miss it.
+ * NVME_QPAIR_POW2_DEFINE(): Defines the enqueue functions of qpairs of a power-of-two depth.
+ * nvme_qpair_pipeline_run(): Drives the commands of an I/O over qpairs until all are done.
+ *
+ * Polling
+ * -------
+ *
+ * nvme_qpair_reap_cpl() waits for a completion using a deadline measured with tsc_read(), the
+ * waiting is done according to the polling mode of the qpair:
+ *
+ * NVME_QPAIR_POLL_SPIN:   Spin using cpu_relax() until a completion arrives or the deadline
+ *                         expires. Lowest latency, keeps the core busy.
+ * NVME_QPAIR_POLL_HYBRID: Spin for a window of 'poll_spin_us' microseconds, then back off via
+ *                         usleep() with an exponentially growing period capped at
+ *                         NVME_QPAIR_POLL_BACKOFF_MAX_US. The admin qpair uses a window of
+ *                         zero, as admin commands are rare and slow, thus, it backs off at once.
+ * NVME_QPAIR_POLL_ADAPTIVE: As hybrid, with a window of twice the moving average of the time
+ *                         waited for the completions reaped, at most 'poll_spin_us'. The
+ *                         average is an EWMA, with a weight of 1/8 for each completion. This is
+ *                         the default of I/O qpairs, with a 'poll_spin_us' of
+ *                         NVME_QPAIR_POLL_SPIN_US.
+ *
+ * The spin and sleep counts are accumulated in nvme_qpair->stats.
+ *
+ * Telemetry
+ * ---------
+ *
+ * When compiled with UPCIE_TELEMETRY_ENABLED, then the qpair keeps latency histograms and
+ * counters of the enqueue, reap and doorbell paths in nvme_qpair->telemetry; read them via
+ * nvme_qpair_telemetry_snapshot(). See nvme_telemetry.h.
+ *
+ * Tracing
+ * -------
+ *
+ * With a ring attached via nvme_qpair_trace_attach(), then commands written to the SQ, doorbell
+ * writes, completions and timeouts are recorded into it; see nvme_trace.h.
+ *
+ * Shadow Doorbells
+ * ----------------
+ *
+ * When the controller supports the Doorbell Buffer Config command, which is common for emulated
+ * and virtualized controllers, then doorbell values can be written to a shadow doorbell buffer in
+ * host memory, and the MMIO doorbell, which causes a VM-exit, need only be written when the
+ * controller signals via its EventIdx buffer that it needs it. Once attached via
+ * nvme_qpair_dbbuf_attach(), then the SQ tail and CQ head updates use the shadow doorbells.
+ *
+ * Deadlines
+ * ---------
+ *
+ * With nvme_qpair_set_timeout(), then each command enqueued is given a deadline, kept in its
+ * request, and armed in the timer wheel of the request-pool, see nvme_request.h. The wheel is
+ * checked by nvme_qpair_process_completions(), at most once per tick of the wheel, thus, a
+ * command which never completes is noticed without a thread waiting on it. The expire callback is
+ * then invoked, e.g. nvme_controller_expire_abort(), which queues an Abort for the command, to be
+ * submitted on the admin qpair, by its owner, via nvme_controller_process_aborts(); the command
+ * then completes, via its own callback, with status Command Abort Requested. A command whose
+ * deadline expired is armed again, thus, the callback is invoked again, with req->nexpired
+ * incremented, when it is still in flight one timeout later.
+ *
+ * Recovery
+ * --------
+ *
+ * The SQ slot of each command is kept in its request, as enqueued, thus, the commands in flight
+ * can be recovered from the SQ. When the controller is reset, then nvme_qpair_reset() rewinds the
+ * queues, keeping their memory, and either completes the commands in flight as aborted, or hands
+ * them back, oldest first, to be submitted again by nvme_qpair_resubmit() once the queues are
+ * created anew; see nvme_controller_reset().
+ *
+ * Shared Completion Queues
+ * ------------------------
+ *
+ * The SQ of a qpair can complete to a CQ shared with other SQs, see nvme_cq.h, such that a thread
+ * driving many SQs, e.g. one per priority class or tenant, polls a single CQ. Such a qpair has no
+ * CQ of its own, nvme_qpair->shcq points to the shared CQ, and
+ * nvme_qpair_process_completions() processes the shared CQ, thus, the completions of all its SQs.
+ * The synchronous submission, nvme_qpair_reap_cpl() and nvme_qpair_reap_cpls() wait on the CQ of
+ * the qpair itself, thus, are not for use on these qpairs.
+ *
+ * Power-of-two Depth
+ * ------------------
+ *
+ * The SQ index math of nvme_qpair_enqueue() and nvme_qpair_enqueue_batch() is modulo the depth
+ * of the qpair, which is only known at runtime. NVME_QPAIR_POW2_DEFINE(DEPTH) defines
+ * nvme_qpair_pow2_<DEPTH>_enqueue() and nvme_qpair_pow2_<DEPTH>_enqueue_batch(), for qpairs
+ * created with a depth of DEPTH, which must be a power of two, where the index math is masks with
+ * a constant. E.g.:
+ *
+ *   NVME_QPAIR_POW2_DEFINE(256)
+ *   ...
+ *   err = nvme_qpair_pow2_256_enqueue(&qp, &cmd);
+ *
+ * They are otherwise the same as the generic functions, which remain the ones for other depths.
+ * Both write each command into its SQ slot via nvme_qpair_sqe_store(), with aligned 16-byte, or
+ * with AVX 32-byte, stores.
+ *
+ * Pipelined I/O
+ * -------------
+ *
+ * An I/O of many commands, e.g. nvme_namespace_io(), is driven by nvme_qpair_pipeline_run(): a
+ * submit function enqueues commands until the qpairs, or their request pools, are exhausted, then
+ * completions are processed, freeing requests for the next batch, until all are done. The
+ * completions are tracked in a 'struct nvme_qpair_pipeline', typically on the stack of the
+ * caller; when the I/O times out, then its requests still in flight are detached from it.
  *
  * See also: nvme_qid.h for queue ID (qid) management.
  *
@@ -28,6 +138,52 @@
  * @version 0.4.4
  */
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for _mm_store_si128()
+#elif defined(__aarch64__)
+#include <arm_neon.h> // for vst1q_u8()
+#endif
+
+#define NVME_QPAIR_POLL_SPIN_US 100 ///< Spin-window of I/O qpairs; the bound of the adaptive one
+#define NVME_QPAIR_POLL_BACKOFF_MAX_US 1000
+#define NVME_QPAIR_SC_ABORTED_SQ_DELETION 0x08 ///< Generic; Command Aborted due to SQ Deletion
+#define NVME_QPAIR_QPRIO_URGENT 0x0 ///< Priority class of an SQ, under Weighted Round Robin
+#define NVME_QPAIR_QPRIO_HIGH 0x1
+#define NVME_QPAIR_QPRIO_MEDIUM 0x2
+#define NVME_QPAIR_QPRIO_LOW 0x3
+
+struct nvme_qpair;
+struct nvme_cq;
+
+static inline int
+nvme_cq_process_completions(struct nvme_cq *cq, uint32_t max);
+
+/**
+ * Invoked when the deadline of a command in flight expires; see nvme_qpair_set_timeout()
+ *
+ * The request is still in flight, it must not be freed by the callback.
+ *
+ * @param qp The queue-pair the command was submitted on
+ * @param req The request of the command; req->nexpired is 1 on the first expiry
+ * @param arg The opaque pointer given to nvme_qpair_set_timeout()
+ */
+typedef void (*nvme_qpair_expire_cb)(struct nvme_qpair *qp, struct nvme_request *req, void *arg);
+
+enum nvme_qpair_poll {
+	NVME_QPAIR_POLL_HYBRID = 0x0,   ///< Spin for a window, then back off via usleep()
+	NVME_QPAIR_POLL_SPIN = 0x1,     ///< Spin until completion or timeout
+	NVME_QPAIR_POLL_ADAPTIVE = 0x2, ///< Hybrid, with the window from the time waited so far
+};
+
+struct nvme_qpair_stats {
+	uint64_t nreaped;   ///< Completions reaped via nvme_qpair_reap_cpl()
+	uint64_t nspins;    ///< Number of times the CQ was found empty and the CPU relaxed
+	uint64_t nsleeps;   ///< Number of times the CQ was found empty and the thread slept
+	uint64_t ntimeouts; ///< Number of times the deadline expired without a completion
+	uint64_t nexpired;  ///< Number of times the deadline of a command in flight expired
+	uint64_t ninvalid;  ///< Completions dropped, see nvme_qpair_cpl_valid()
+};
+
 struct nvme_qpair {
 	void *sq;       ///< VA-Pointer to DMA-capable memory backing the Submission Queue (SQ)
 	void *cq;       ///< VA-Pointer to DMA-capable memory backing the Completion Queue (CQ)
@@ -39,30 +195,176 @@ struct nvme_qpair {
 	uint16_t tail_last_written; ///< Last tail-value written to DB-reg. init to UINT16_MAX
 	uint16_t head;              ///< Completion Queue Head Pointer
 	uint8_t phase;
-	uint8_t _rsdv[3];
+	uint8_t qprio; ///< Priority class of the SQ, NVME_QPAIR_QPRIO_*; only used under WRR
+	uint16_t sqhd; ///< Submission Queue Head Pointer, as last reported by the controller
 	struct nvme_request_pool *rpool; ///< Command Identifier tracking and user-callback
 	struct hostmem_heap *heap;       ///< For allocation / free of DMA-capable SQ/CQ entries
+
+	int irq_fd;     ///< eventfd signalled by the MSI-X vector of the CQ; -1 when only polled
+	int irq_vector; ///< MSI-X vector of the CQ; -1 when interrupts are disabled
+
+	volatile uint32_t *dbbuf_sqdb; ///< Shadow SQ tail doorbell; NULL when not attached
+	volatile uint32_t *dbbuf_cqdb; ///< Shadow CQ head doorbell; NULL when not attached
+	volatile uint32_t *dbbuf_sqei; ///< EventIdx of the SQ tail doorbell
+	volatile uint32_t *dbbuf_cqei; ///< EventIdx of the CQ head doorbell
+
+	enum nvme_qpair_poll poll_mode; ///< How nvme_qpair_reap_cpl() waits for completions
+	uint64_t poll_spin_ticks;       ///< Spin-window of the hybrid mode in tsc_read() ticks
+	uint64_t poll_wait_ewma;        ///< Average ticks waited for a completion; adaptive mode
+	struct nvme_qpair_stats stats;  ///< Counters of nvme_qpair_reap_cpl()
+
+	nvme_qpair_expire_cb expire_cb; ///< Invoked on commands missing their deadline; may be NULL
+	void *expire_arg;               ///< Passed on to 'expire_cb'
+	uint64_t expire_next;           ///< tsc_read() tick at which to check the deadlines again
+
+	uint32_t mdts_nbytes; ///< Maximum Data Transfer Size of the controller; 0 when unlimited
+
+	struct nvme_cmb *cmb; ///< The CMB holding the SQ; NULL when the SQ is in host memory
+
+	struct nvme_trace_ring *trace; ///< Events are recorded here; NULL when not tracing
+
+	struct nvme_cq *shcq; ///< Shared CQ taking the completions of the SQ; NULL for its own CQ
+
+#ifdef UPCIE_TELEMETRY_ENABLED
+	struct nvme_telemetry telemetry; ///< Latencies and counters; see nvme_telemetry.h
+#endif
 };
 
+static inline int
+nvme_qpair_stats_pr(struct nvme_qpair_stats *stats)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_qpair_stats:");
+
+	if (!stats) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+
+	wrtn += printf("\n");
+	wrtn += printf("  nreaped: %" PRIu64 "\n", stats->nreaped);
+	wrtn += printf("  nspins: %" PRIu64 "\n", stats->nspins);
+	wrtn += printf("  nsleeps: %" PRIu64 "\n", stats->nsleeps);
+	wrtn += printf("  ntimeouts: %" PRIu64 "\n", stats->ntimeouts);
+	wrtn += printf("  nexpired: %" PRIu64 "\n", stats->nexpired);
+	wrtn += printf("  ninvalid: %" PRIu64 "\n", stats->ninvalid);
+
+	return wrtn;
+}
+
+/**
+ * Select the polling mode used by nvme_qpair_reap_cpl()
+ *
+ * @param qp The queue-pair
+ * @param mode The polling mode
+ * @param spin_us Spin-window in microseconds; with NVME_QPAIR_POLL_ADAPTIVE, the bound of the
+ *                window, which starts out at it; not used by NVME_QPAIR_POLL_SPIN
+ */
+static inline void
+nvme_qpair_set_poll(struct nvme_qpair *qp, enum nvme_qpair_poll mode, uint32_t spin_us)
+{
+	qp->poll_mode = mode;
+	qp->poll_spin_ticks = tsc_from_us(spin_us);
+	qp->poll_wait_ewma = qp->poll_spin_ticks / 2;
+}
+
+/**
+ * Record the events of the qpair into the given ring, see nvme_trace.h
+ *
+ * The `qid` of the ring is set to that of the qpair. A ring must only be attached to a single
+ * qpair at a time.
+ */
+static inline void
+nvme_qpair_trace_attach(struct nvme_qpair *qp, struct nvme_trace_ring *ring)
+{
+	ring->qid = qp->qid;
+	qp->trace = ring;
+}
+
+static inline void
+nvme_qpair_trace_detach(struct nvme_qpair *qp)
+{
+	qp->trace = NULL;
+}
+
+static inline void
+nvme_qpair_trace_submit(struct nvme_qpair *qp, struct nvme_command *cmd, uint16_t slot)
+{
+	nvme_trace_record(qp->trace, NVME_TRACE_SUBMIT, cmd->opc, cmd->cid, slot, cmd->nsid,
+			  ((uint64_t)cmd->cdw11 << 32) | cmd->cdw10);
+}
+
+static inline void
+nvme_qpair_trace_cpl(struct nvme_qpair *qp, struct nvme_completion *cpl)
+{
+	nvme_trace_record(qp->trace, NVME_TRACE_CQE, 0, cpl->cid, cpl->status, 0, cpl->cdw0);
+}
+
+/**
+ * Take a snapshot of the telemetry of the qpair, e.g. for merging with that of other qpairs
+ *
+ * The snapshot can be taken from another thread than the one driving the qpair; see
+ * nvme_telemetry.h on its consistency.
+ *
+ * @param qp The queue-pair
+ * @param snapshot Populated with the telemetry; zeroed when compiled without telemetry
+ *
+ * @return On success 0 is returned. When compiled without UPCIE_TELEMETRY_ENABLED, then -ENOTSUP
+ *         is returned.
+ */
+static inline int
+nvme_qpair_telemetry_snapshot(struct nvme_qpair *qp, struct nvme_telemetry *snapshot)
+{
+#ifdef UPCIE_TELEMETRY_ENABLED
+	nvme_telemetry_copy(snapshot, &qp->telemetry);
+
+	return 0;
+#else
+	(void)qp;
+	nvme_telemetry_reset(snapshot);
+
+	return -ENOTSUP;
+#endif
+}
+
+static inline size_t
+nvme_qpair_sq_nbytes(struct nvme_qpair *qp)
+{
+	size_t pagesize = qp->heap->config->pagesize;
+
+	return (((size_t)qp->depth * 64) + pagesize - 1) & ~(pagesize - 1);
+}
+
 static inline void
 nvme_qpair_term(struct nvme_qpair *qp)
 {
 	nvme_request_pool_term_prps(qp->rpool, qp->heap);
-	
+	nvme_request_pool_term(qp->rpool);
+
 	free(qp->rpool);
-	hostmem_dma_free(qp->heap, qp->sq);
+	if (qp->cmb) {
+		nvme_cmb_free(qp->cmb, qp->sq, nvme_qpair_sq_nbytes(qp));
+		qp->cmb = NULL;
+	} else {
+		hostmem_dma_free(qp->heap, qp->sq);
+	}
 	hostmem_dma_free(qp->heap, qp->cq);
 }
 
 /**
- * Initialize a queue-pair on the given controller
+ * Initialize the SQ of a queue-pair on the given controller, without a CQ of its own
+ *
+ * Same as nvme_qpair_init(), except that no CQ memory is allocated, qp->cq is NULL; this is for
+ * an SQ completing to a shared CQ, to be attached via nvme_cq_attach().
  */
 static inline int
-nvme_qpair_init(struct nvme_qpair *qp, uint32_t qid, uint16_t depth, uint8_t *bar0,
-		struct hostmem_heap *heap)
+nvme_qpair_init_sq(struct nvme_qpair *qp, uint32_t qid, uint16_t depth, uint8_t *bar0,
+		   struct hostmem_heap *heap)
 {
 	int dstrd = nvme_reg_cap_get_dstrd(nvme_mmio_cap_read(bar0));
-	size_t nbytes = 1024 * 64;
+	size_t pagesize = heap->config->pagesize;
+	size_t sq_nbytes = (((size_t)depth * 64) + pagesize - 1) & ~(pagesize - 1);
 	int err;
 
 	qp->heap = heap;
@@ -72,199 +374,698 @@ nvme_qpair_init(struct nvme_qpair *qp, uint32_t qid, uint16_t depth, uint8_t *ba
 	qp->tail = 0;
 	qp->tail_last_written = UINT16_MAX;
 	qp->head = 0;
+	qp->sqhd = 0;
 	qp->depth = depth;
 	qp->phase = 1;
+	qp->qprio = NVME_QPAIR_QPRIO_MEDIUM;
+	qp->irq_fd = -1;
+	qp->irq_vector = -1;
+	qp->dbbuf_sqdb = NULL;
+	qp->dbbuf_cqdb = NULL;
+	qp->dbbuf_sqei = NULL;
+	qp->dbbuf_cqei = NULL;
+	memset(&qp->stats, 0, sizeof(qp->stats));
+	qp->mdts_nbytes = 0;
+	qp->cmb = NULL;
+	qp->trace = NULL;
+	qp->shcq = NULL;
+	qp->cq = NULL;
+	qp->expire_cb = NULL;
+	qp->expire_arg = NULL;
+	qp->expire_next = 0;
+	if (qid) {
+		nvme_qpair_set_poll(qp, NVME_QPAIR_POLL_ADAPTIVE, NVME_QPAIR_POLL_SPIN_US);
+	} else {
+		nvme_qpair_set_poll(qp, NVME_QPAIR_POLL_HYBRID, 0);
+	}
+	NVME_TELEMETRY_FCALL(nvme_telemetry_reset(&qp->telemetry));
 
-	qp->sq = hostmem_dma_alloc_array(qp->heap, 1, nbytes);
+	qp->sq = hostmem_dma_alloc_array(qp->heap, 1, sq_nbytes);
 	if (!qp->sq) {
 		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(sq); errno(%d)", errno);
 		return -errno;
 	}
-	memset(qp->sq, 0, nbytes);
-
-	qp->cq = hostmem_dma_alloc_array(qp->heap, 1, nbytes);
-	if (!qp->cq) {
-		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(cq); errno(%d)", errno);
-		hostmem_dma_free(qp->heap, qp->sq);
-		return -errno;
-	}
-	memset(qp->cq, 0, nbytes);
+	memset(qp->sq, 0, sq_nbytes);
 
 	qp->rpool = calloc(1, sizeof(*qp->rpool));
 	if (!qp->rpool) {
 		UPCIE_DEBUG("FAILED: calloc(rpool); errno(%d)", errno);
 		hostmem_dma_free(qp->heap, qp->sq);
-		hostmem_dma_free(qp->heap, qp->cq);
 		return -errno;
 	}
-	nvme_request_pool_init(qp->rpool);
 
-	err = nvme_request_pool_init_prps(qp->rpool, heap);
+	err = nvme_request_pool_init(qp->rpool, depth);
 	if (err) {
-		hostmem_dma_free(qp->heap, qp->sq);
-		hostmem_dma_free(qp->heap, qp->cq);
-		free(qp->rpool);
+		UPCIE_DEBUG("FAILED: nvme_request_pool_init(); err(%d)", err);
+		goto fail;
+	}
 
+	err = nvme_request_pool_init_prps(qp->rpool, heap, 0);
+	if (err) {
 		UPCIE_DEBUG("FAILED: nvme_request_pool_init_prps; err(%d)", err);
-		return -errno;
+		nvme_request_pool_term(qp->rpool);
+		goto fail;
 	}
 
 	return 0;
+
+fail:
+	hostmem_dma_free(qp->heap, qp->sq);
+	free(qp->rpool);
+	qp->rpool = NULL;
+
+	return err;
 }
 
 /**
- * Reaps at most a single completion and informs the controller via qp->cqdb
- *
- * @param qp A queue-pair as represented by 'struct nvme_qp'
- * @param cpl Completion when one is reaped
- * @param timeout_ms Timeout in milliseconds
+ * Initialize a queue-pair on the given controller
  *
- * @return Pointer to a valid completion, or NULL on timeout.
+ * The SQ and CQ are sized by `depth`, rounded up to the page size, and so is the request-pool;
+ * the pool shares at most NVME_REQUEST_POOL_PAGES PRP-list pages among its requests.
  */
 static inline int
-nvme_qpair_reap_cpl(struct nvme_qpair *qp, int timeout_ms, struct nvme_completion *cpl)
+nvme_qpair_init(struct nvme_qpair *qp, uint32_t qid, uint16_t depth, uint8_t *bar0,
+		struct hostmem_heap *heap)
 {
-	struct nvme_completion *cq = qp->cq;
-
-	for (int i = 0; i < timeout_ms; ++i) {
-		struct nvme_completion *cqe = &cq[qp->head];
-
-		if ((cqe->cid < 0xFFFF) && ((cqe->status & 0x1) == qp->phase)) {
-			*cpl = *cqe;
-
-			// Advance CQ head and toggle phase if wrapping
-			qp->head++;
-			if (qp->head == qp->depth) {
-				qp->head = 0;
-				qp->phase ^= 1;
-			}
+	size_t pagesize = heap->config->pagesize;
+	size_t cq_nbytes = (((size_t)depth * 16) + pagesize - 1) & ~(pagesize - 1);
+	int err;
 
-			mmio_write32(qp->cqdb, 0, qp->head);
-			return 0;
-		}
+	err = nvme_qpair_init_sq(qp, qid, depth, bar0, heap);
+	if (err) {
+		return err;
+	}
 
-		usleep(1000);
+	qp->cq = hostmem_dma_alloc_array(qp->heap, 1, cq_nbytes);
+	if (!qp->cq) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(cq); errno(%d)", errno);
+		nvme_qpair_term(qp);
+		return err;
 	}
+	memset(qp->cq, 0, cq_nbytes);
 
-	return -EAGAIN;
+	return 0;
 }
 
 /**
- * Update the submission queue tail doorbell if needed.
+ * Move the SQ of the qpair, and its PRP-list pages when the CMB supports lists, to the CMB
  *
- * This function writes the current SQ tail index to the MMIO doorbell register
- * for the given queue pair, notifying the controller of new commands.
- * To avoid redundant MMIO writes, the function checks whether the tail value
- * has changed since the last call. The last written value is tracked in
- * nvme_qpair->tail_last_written.
+ * Must be done after nvme_qpair_init(), and before the SQ is created on the controller, as the
+ * address of the SQ changes; see nvme_io_qpair_opts->sq_cmb.
  *
- * @param qp Pointer to the NVMe queue pair whose SQ doorbell should be updated.
+ * @param qp The queue-pair
+ * @param cmb The CMB of the controller of the qpair
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -ENOTSUP when the CMB is not mapped, or does not support SQs. On error, the qpair is
+ *         unchanged.
  */
-static inline void
-nvme_qpair_sqdb_update(struct nvme_qpair *qp)
+static inline int
+nvme_qpair_cmb_attach(struct nvme_qpair *qp, struct nvme_cmb *cmb)
 {
-	if (qp->tail == qp->tail_last_written) {
-		return;
+	size_t sq_nbytes = nvme_qpair_sq_nbytes(qp);
+	void *sq;
+
+	if (!cmb->virt || !nvme_reg_cmbsz_get_sqs(cmb->cmbsz)) {
+		return -ENOTSUP;
 	}
 
-	mmio_write32(qp->sqdb, 0, qp->tail);
-	qp->tail_last_written = qp->tail;
+	sq = nvme_cmb_alloc(cmb, sq_nbytes);
+	if (!sq) {
+		UPCIE_DEBUG("FAILED: nvme_cmb_alloc(sq); errno(%d)", errno);
+		return -errno;
+	}
+	memset(sq, 0, sq_nbytes);
+
+	if (nvme_reg_cmbsz_get_lists(cmb->cmbsz)) {
+		struct nvme_request_pool pool = *qp->rpool;
+		int err;
+
+		err = nvme_request_pool_init_prps_cmb(&pool, cmb, qp->rpool->npages);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_request_pool_init_prps_cmb(); err(%d)", err);
+			nvme_cmb_free(cmb, sq, sq_nbytes);
+			return err;
+		}
+		nvme_request_pool_term_prps(qp->rpool, qp->heap);
+		*qp->rpool = pool;
+	}
+
+	hostmem_dma_free(qp->heap, qp->sq);
+	qp->sq = sq;
+	qp->cmb = cmb;
+
+	return 0;
 }
 
 /**
- * Enqueue a command into an NVMe submission queue of a `nvme_qpair`
+ * Attach the qpair to the shadow doorbell and EventIdx buffers
  *
- * That is, writes it into the submission queue memory and increments the tail-pointer, it does
- * **not** write the tail to the sq-doorbell.
+ * The buffers are those given to the controller via the Doorbell Buffer Config admin command,
+ * each is a single page, laid out like the doorbell registers, but with a stride of
+ * 4 << CAP.DSTRD bytes. The shadow entries of the qpair are initialized to zero.
  *
  * @param qp The queue-pair
- * @param cmd Command to submit
- * @param user Optional opaque pointer returned on completion
- *
- * @return On success 0 is returned. On error then negative errno is set to indicate the error.
+ * @param bar0 Pointer to the mapped BAR0 of the controller, used to read CAP.DSTRD
+ * @param dbs Pointer to the shadow doorbell buffer
+ * @param eis Pointer to the EventIdx buffer
  */
-static inline int
-nvme_qpair_enqueue(struct nvme_qpair *qp, struct nvme_command *cmd)
+static inline void
+nvme_qpair_dbbuf_attach(struct nvme_qpair *qp, uint8_t *bar0, void *dbs, void *eis)
 {
-	volatile struct nvme_command *sq = qp->sq;
+	int dstrd = nvme_reg_cap_get_dstrd(nvme_mmio_cap_read(bar0));
+	size_t sq_idx = (2 * qp->qid) << dstrd;
+	size_t cq_idx = (2 * qp->qid + 1) << dstrd;
 
-	sq[qp->tail] = *cmd;
+	qp->dbbuf_sqdb = (uint32_t *)dbs + sq_idx;
+	qp->dbbuf_cqdb = (uint32_t *)dbs + cq_idx;
+	qp->dbbuf_sqei = (uint32_t *)eis + sq_idx;
+	qp->dbbuf_cqei = (uint32_t *)eis + cq_idx;
 
-	qp->tail = (qp->tail + 1) % qp->depth;
+	*qp->dbbuf_sqdb = 0;
+	*qp->dbbuf_cqdb = 0;
+	*qp->dbbuf_sqei = 0;
+	*qp->dbbuf_cqei = 0;
+}
 
-	return 0;
+/**
+ * Detach the qpair from the shadow doorbell buffers, reverting to MMIO doorbell writes
+ */
+static inline void
+nvme_qpair_dbbuf_detach(struct nvme_qpair *qp)
+{
+	if (!qp->dbbuf_sqdb) {
+		return;
+	}
+
+	*qp->dbbuf_sqdb = 0;
+	*qp->dbbuf_cqdb = 0;
+	*qp->dbbuf_sqei = 0;
+	*qp->dbbuf_cqei = 0;
+
+	qp->dbbuf_sqdb = NULL;
+	qp->dbbuf_cqdb = NULL;
+	qp->dbbuf_sqei = NULL;
+	qp->dbbuf_cqei = NULL;
 }
 
 /**
- * Submits a command on the given qpair, waits for completion, and populates `cpl`.
- *
- * This is intended for synchronous I/O or Admin commands where the caller manages the payload
- * and sets up PRP1/PRP2 manually. The function does not modify or validate the PRP fields.
+ * Write `value` to the shadow doorbell `db` and check whether the MMIO doorbell is needed
  *
- * @param qp         Pointer to the submission queue pair.
- * @param cmd        Pointer to the command to submit; `cid` will be assigned.
- * @param timeout_ms Timeout in milliseconds to wait for command completion.
- * @param cpl        Pointer to a completion structure to receive the result.
+ * The controller updates the EventIdx `ei` with the doorbell value it last observed; the MMIO
+ * doorbell must be written when the new value has moved past the EventIdx, that is, when the
+ * EventIdx lies in the range [old, value).
  *
- * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ * @return 1 when the MMIO doorbell must be written, 0 otherwise.
  */
 static inline int
-nvme_qpair_submit_sync(struct nvme_qpair *qp, struct nvme_command *cmd, int timeout_ms,
-		       struct nvme_completion *cpl)
+nvme_qpair_dbbuf_update(volatile uint32_t *db, volatile uint32_t *ei, uint16_t value)
 {
-	struct nvme_request *req;
-	int err;
+	uint16_t old = *db;
+	uint16_t event_idx;
 
-	req = nvme_request_alloc(qp->rpool);
-	if (!req) {
-		UPCIE_DEBUG("FAILED: nvme_request_alloc(); errno(%d)", errno);
-		return -errno;
-	}
-	cmd->cid = req->cid;
+	// Queue entries must be visible before the shadow doorbell is
+	wmb();
+	*db = value;
 
-	err = nvme_qpair_enqueue(qp, cmd);
-	if (err) {
-		return -err;
-	}
+	// The shadow doorbell must be visible before the EventIdx is read
+	mb();
+	event_idx = *ei;
 
-	nvme_qpair_sqdb_update(qp);
+	return (uint16_t)(value - event_idx - 1) < (uint16_t)(value - old);
+}
 
-	err = nvme_qpair_reap_cpl(qp, timeout_ms, cpl);
-	if (err) {
-		return -err;
+/**
+ * Inform the controller of the current CQ head, via the shadow doorbell when attached
+ */
+static inline void
+nvme_qpair_cqdb_update(struct nvme_qpair *qp)
+{
+	if (qp->dbbuf_cqdb && !nvme_qpair_dbbuf_update(qp->dbbuf_cqdb, qp->dbbuf_cqei, qp->head)) {
+		if (qp->trace) {
+			nvme_trace_record(qp->trace, NVME_TRACE_CQDB, NVME_TRACE_FLAG_SHADOW,
+					  NVME_TRACE_CID_NONE, qp->head, 0, 0);
+		}
+		return;
 	}
 
-	nvme_request_free(qp->rpool, req->cid);
+	mmio_write32(qp->cqdb, 0, qp->head);
+	NVME_TELEMETRY_FCALL(qp->telemetry.ncqdb++);
+	if (qp->trace) {
+		nvme_trace_record(qp->trace, NVME_TRACE_CQDB, 0, NVME_TRACE_CID_NONE, qp->head, 0,
+				  0);
+	}
+}
 
-	if (cpl->status & 0x1FE) {
-		err = -EIO;
+/**
+ * Returns whether the reaped completion `cpl` is of a command in flight on the qpair
+ *
+ * The cid is written by the controller, thus, it is checked against the request-pool before the
+ * request is looked up. A completion of a cid out of range, e.g. 0xFFFF as read from a device
+ * which is gone, or of a request which is not in flight, e.g. a duplicate, would corrupt the
+ * pool; it is counted in qp->stats.ninvalid, and is to be dropped. This is done by every path
+ * reaping completions, nvme_qpair_reap_cpl(), nvme_qpair_reap_cpls(),
+ * nvme_qpair_process_completions(), and nvme_cq_process_completions().
+ */
+static inline int
+nvme_qpair_cpl_valid(struct nvme_qpair *qp, const struct nvme_completion *cpl)
+{
+	if (cpl->cid >= qp->rpool->len ||
+	    qp->rpool->reqs[cpl->cid].slot == NVME_REQUEST_SLOT_NONE) {
+		UPCIE_DEBUG("FAILED: qid(%" PRIu32 ") cid(%" PRIu16 ") is not in flight; dropped",
+			    qp->qid, cpl->cid);
+		qp->stats.ninvalid++;
+		return 0;
 	}
 
-	return err;
+	return 1;
 }
 
 /**
- * Submits a command with a contiguous PRP payload, waits for completion, and populates `cpl`.
+ * Reaps at most a single completion and informs the controller via qp->cqdb
  *
- * This is intended for synchronous I/O or Admin commands using a physically contiguous buffer.
- * The function prepares the PRP entries automatically using the provided `heap` and `dbuf`,
- * sets up the command, submits it on the given qpair, and waits for completion.
+ * Waits for the completion according to the polling mode of the qpair, see
+ * nvme_qpair_set_poll().
  *
- * @param qp          Pointer to the submission queue pair.
- * @param heap        Pointer to the host memory heap used for resolving physical addresses.
- * @param dbuf        Pointer to the data buffer to be described via PRPs.
- * @param dbuf_nbytes Size of the data buffer in bytes.
- * @param cmd         Pointer to the command to submit; `cid` will be assigned and PRPs set.
- * @param timeout_ms  Timeout in milliseconds to wait for command completion.
- * @param cpl         Pointer to a completion structure to receive the result.
+ * @param qp A queue-pair as represented by 'struct nvme_qp'
+ * @param timeout_ms Timeout in milliseconds
+ * @param cpl Completion when one is reaped
  *
- * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ * @return On success 0 is returned and `cpl` populated. On timeout -EAGAIN is returned.
  */
 static inline int
-nvme_qpair_submit_sync_contig_prps(struct nvme_qpair *qp, struct hostmem_heap *heap, void *dbuf,
-				   size_t dbuf_nbytes, struct nvme_command *cmd, int timeout_ms,
-				   struct nvme_completion *cpl)
+nvme_qpair_reap_cpl(struct nvme_qpair *qp, int timeout_ms, struct nvme_completion *cpl)
+{
+	volatile struct nvme_completion *cq = qp->cq;
+	const uint64_t start = tsc_read();
+	const uint64_t deadline = start + tsc_from_ms(timeout_ms);
+	uint64_t spin_end = start + qp->poll_spin_ticks;
+	useconds_t backoff_us = 1;
+
+	if ((qp->poll_mode == NVME_QPAIR_POLL_ADAPTIVE) &&
+	    (2 * qp->poll_wait_ewma < qp->poll_spin_ticks)) {
+		spin_end = start + 2 * qp->poll_wait_ewma;
+	}
+
+	for (;;) {
+		volatile struct nvme_completion *cqe = &cq[qp->head];
+		uint64_t now;
+
+		if ((cqe->status & 0x1) == qp->phase) {
+			dma_rmb();
+
+			*cpl = *cqe;
+			qp->sqhd = cpl->sqhd;
+
+			// Advance CQ head and toggle phase if wrapping
+			qp->head++;
+			if (qp->head == qp->depth) {
+				qp->head = 0;
+				qp->phase ^= 1;
+			}
+
+			NVME_TELEMETRY_FCALL(
+				nvme_telemetry_on_complete(&qp->telemetry, qp->rpool, cpl));
+			if (qp->trace) {
+				nvme_qpair_trace_cpl(qp, cpl);
+			}
+			nvme_qpair_cqdb_update(qp);
+			if (!nvme_qpair_cpl_valid(qp, cpl)) {
+				continue;
+			}
+			qp->stats.nreaped++;
+			if (qp->poll_mode == NVME_QPAIR_POLL_ADAPTIVE) {
+				uint64_t waited = tsc_read() - start;
+
+				qp->poll_wait_ewma += waited / 8 - qp->poll_wait_ewma / 8;
+			}
+			return 0;
+		}
+		NVME_TELEMETRY_FCALL(qp->telemetry.npolls_empty++);
+
+		now = tsc_read();
+		if (now >= deadline) {
+			qp->stats.ntimeouts++;
+			if (qp->trace) {
+				nvme_trace_record(qp->trace, NVME_TRACE_TIMEOUT, 0,
+						  NVME_TRACE_CID_NONE, qp->head, 0, 0);
+			}
+			return -EAGAIN;
+		}
+
+		if ((qp->poll_mode == NVME_QPAIR_POLL_SPIN) || (now < spin_end)) {
+			qp->stats.nspins++;
+			cpu_relax();
+			continue;
+		}
+
+		qp->stats.nsleeps++;
+		usleep(backoff_us);
+		if (backoff_us < NVME_QPAIR_POLL_BACKOFF_MAX_US) {
+			backoff_us *= 2;
+		}
+	}
+}
+
+/**
+ * Reaps up to `max` ready completions and informs the controller via qp->cqdb once
+ *
+ * Unlike nvme_qpair_reap_cpl(), this does not wait; it consumes the completions that are ready,
+ * and coalesces the CQ head update into a single doorbell write for the batch.
+ *
+ * @param qp A queue-pair as represented by 'struct nvme_qp'
+ * @param cpls Array of at least `max` completions, populated with the reaped completions
+ * @param max Maximum number of completions to reap
+ *
+ * @return The number of completions reaped, that is, 0 when none are ready.
+ */
+static inline int
+nvme_qpair_reap_cpls(struct nvme_qpair *qp, struct nvme_completion *cpls, uint32_t max)
+{
+	volatile struct nvme_completion *cq = qp->cq;
+	uint32_t nconsumed = 0;
+	uint32_t nreaped = 0;
+
+	while (nreaped < max) {
+		volatile struct nvme_completion *cqe = &cq[qp->head];
+
+		if ((cqe->status & 0x1) != qp->phase) {
+			break;
+		}
+		dma_rmb();
+
+		cpls[nreaped] = *cqe;
+		qp->sqhd = cpls[nreaped].sqhd;
+		NVME_TELEMETRY_FCALL(
+			nvme_telemetry_on_complete(&qp->telemetry, qp->rpool, &cpls[nreaped]));
+		if (qp->trace) {
+			nvme_qpair_trace_cpl(qp, &cpls[nreaped]);
+		}
+		nconsumed++;
+
+		qp->head++;
+		if (qp->head == qp->depth) {
+			qp->head = 0;
+			qp->phase ^= 1;
+		}
+
+		if (nvme_qpair_cpl_valid(qp, &cpls[nreaped])) {
+			nreaped++;
+		}
+	}
+
+	if (nconsumed) {
+		nvme_qpair_cqdb_update(qp);
+		qp->stats.nreaped += nreaped;
+	} else {
+		NVME_TELEMETRY_FCALL(qp->telemetry.npolls_empty++);
+	}
+
+	return nreaped;
+}
+
+/**
+ * Update the submission queue tail doorbell if needed.
+ *
+ * This function writes the current SQ tail index to the MMIO doorbell register
+ * for the given queue pair, notifying the controller of new commands.
+ * To avoid redundant MMIO writes, the function checks whether the tail value
+ * has changed since the last call. The last written value is tracked in
+ * nvme_qpair->tail_last_written. When shadow doorbells are attached, then the tail is written to
+ * the shadow doorbell, and the MMIO doorbell only when the EventIdx requires it.
+ *
+ * @param qp Pointer to the NVMe queue pair whose SQ doorbell should be updated.
+ */
+static inline void
+nvme_qpair_sqdb_update(struct nvme_qpair *qp)
+{
+	if (qp->tail == qp->tail_last_written) {
+		return;
+	}
+	qp->tail_last_written = qp->tail;
+
+	// Flush the write-combining buffers holding the commands written to the CMB
+	if (qp->cmb) {
+		wmb();
+	}
+
+	if (qp->dbbuf_sqdb && !nvme_qpair_dbbuf_update(qp->dbbuf_sqdb, qp->dbbuf_sqei, qp->tail)) {
+		if (qp->trace) {
+			nvme_trace_record(qp->trace, NVME_TRACE_SQDB, NVME_TRACE_FLAG_SHADOW,
+					  NVME_TRACE_CID_NONE, qp->tail, 0, 0);
+		}
+		return;
+	}
+
+	mmio_write32(qp->sqdb, 0, qp->tail);
+	NVME_TELEMETRY_FCALL(qp->telemetry.nsqdb++);
+	if (qp->trace) {
+		nvme_trace_record(qp->trace, NVME_TRACE_SQDB, 0, NVME_TRACE_CID_NONE, qp->tail, 0,
+				  0);
+	}
+}
+
+/**
+ * Write the 64-byte command into the SQ slot; with aligned 16-byte stores, 32-byte with AVX
+ *
+ * The slots of the SQ are 64-byte aligned, and the stores are ordered before the doorbell write by
+ * a compiler barrier, as for nvme_qpair_enqueue_batch(), and by wmb() when the SQ is in the CMB.
+ */
+static inline void
+nvme_qpair_sqe_store(void *slot, const struct nvme_command *cmd)
+{
+#if defined(__AVX__)
+	const __m256i *src = (const __m256i *)cmd;
+	__m256i *dst = (__m256i *)slot;
+
+	_mm256_store_si256(&dst[0], _mm256_loadu_si256(&src[0]));
+	_mm256_store_si256(&dst[1], _mm256_loadu_si256(&src[1]));
+#elif defined(__SSE2__)
+	const __m128i *src = (const __m128i *)cmd;
+	__m128i *dst = (__m128i *)slot;
+
+	for (int i = 0; i < 4; ++i) {
+		_mm_store_si128(&dst[i], _mm_loadu_si128(&src[i]));
+	}
+#elif defined(__aarch64__)
+	const uint8_t *src = (const uint8_t *)cmd;
+	uint8_t *dst = (uint8_t *)slot;
+
+	for (int i = 0; i < 4; ++i) {
+		vst1q_u8(&dst[i * 16], vld1q_u8(&src[i * 16]));
+	}
+#else
+	memcpy(slot, cmd, sizeof(*cmd));
+#endif
+	barrier();
+}
+
+/**
+ * Record the SQ slot of the command in its request, and arm its deadline; bookkeeping of enqueue
+ */
+static inline void
+nvme_qpair_enqueue_track(struct nvme_qpair *qp, struct nvme_command *cmd, uint16_t slot)
+{
+	if (cmd->cid < qp->rpool->len) {
+		qp->rpool->reqs[cmd->cid].slot = slot;
+		if (qp->rpool->timer.timeout) {
+			nvme_request_timer_arm(qp->rpool, &qp->rpool->reqs[cmd->cid],
+					       tsc_read() + qp->rpool->timer.timeout);
+		}
+	}
+	NVME_TELEMETRY_FCALL(nvme_telemetry_on_submit(&qp->telemetry, qp->rpool, cmd->cid));
+	if (qp->trace) {
+		nvme_qpair_trace_submit(qp, cmd, slot);
+	}
+}
+
+/**
+ * Enqueue a command into an NVMe submission queue of a `nvme_qpair`
+ *
+ * That is, writes it into the submission queue memory and increments the tail-pointer, it does
+ * **not** write the tail to the sq-doorbell.
+ *
+ * The submission queue is full when advancing the tail would make it equal to the head as last
+ * reported by the controller via a completion (nvme_qpair->sqhd).
+ *
+ * @param qp The queue-pair
+ * @param cmd Command to submit
+ *
+ * @return On success 0 is returned. On error then negative errno is set to indicate the error.
+ */
+static inline int
+nvme_qpair_enqueue(struct nvme_qpair *qp, struct nvme_command *cmd)
+{
+	struct nvme_command *sq = qp->sq;
+
+	if ((qp->tail + 1) % qp->depth == qp->sqhd) {
+		return -EBUSY;
+	}
+
+	nvme_qpair_sqe_store(&sq[qp->tail], cmd);
+	nvme_qpair_enqueue_track(qp, cmd, qp->tail);
+
+	qp->tail = (qp->tail + 1) % qp->depth;
+
+	return 0;
+}
+
+/**
+ * Enqueue `n` commands into an NVMe submission queue of a `nvme_qpair`
+ *
+ * The commands are copied into the submission queue memory in at most two contiguous segments,
+ * handling wrap-around of the tail, and the tail-pointer is advanced by `n`. As with
+ * nvme_qpair_enqueue(), this does **not** write the tail to the sq-doorbell, thus, a batch of
+ * commands is made visible to the controller by a single call to nvme_qpair_sqdb_update().
+ *
+ * Either all commands are enqueued, or none are. The caller assigns the command identifiers.
+ *
+ * @param qp The queue-pair
+ * @param cmds Array of `n` commands to enqueue
+ * @param n Number of commands in `cmds`
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EBUSY when the submission queue does not have room for `n` commands.
+ */
+static inline int
+nvme_qpair_enqueue_batch(struct nvme_qpair *qp, struct nvme_command *cmds, uint32_t n)
+{
+	struct nvme_command *sq = qp->sq;
+	uint32_t nfree = (qp->sqhd + qp->depth - qp->tail - 1) % qp->depth;
+	uint32_t first;
+
+	if (n > nfree) {
+		return -EBUSY;
+	}
+
+	first = qp->depth - qp->tail;
+	if (first > n) {
+		first = n;
+	}
+
+	memcpy(&sq[qp->tail], cmds, first * sizeof(*cmds));
+	if (n > first) {
+		memcpy(&sq[0], &cmds[first], (n - first) * sizeof(*cmds));
+	}
+	barrier();
+	{
+		uint64_t timeout = qp->rpool->timer.timeout;
+		uint64_t deadline = timeout ? tsc_read() + timeout : 0;
+
+		for (uint32_t i = 0; i < n; ++i) {
+			if (cmds[i].cid >= qp->rpool->len) {
+				continue;
+			}
+			qp->rpool->reqs[cmds[i].cid].slot = (qp->tail + i) % qp->depth;
+			if (deadline) {
+				nvme_request_timer_arm(qp->rpool, &qp->rpool->reqs[cmds[i].cid],
+						       deadline);
+			}
+		}
+	}
+	NVME_TELEMETRY_FCALL(nvme_telemetry_on_submit_batch(&qp->telemetry, qp->rpool, cmds, n));
+	for (uint32_t i = 0; qp->trace && i < n; ++i) {
+		nvme_qpair_trace_submit(qp, &cmds[i], (qp->tail + i) % qp->depth);
+	}
+
+	qp->tail = (qp->tail + n) % qp->depth;
+
+	return 0;
+}
+
+/**
+ * Define the enqueue functions of qpairs of depth `DEPTH`, which must be a power of two
+ *
+ * nvme_qpair_pow2_<DEPTH>_enqueue() and nvme_qpair_pow2_<DEPTH>_enqueue_batch() behave as
+ * nvme_qpair_enqueue() and nvme_qpair_enqueue_batch(), with the index math masked by the
+ * constant `DEPTH - 1`; they must only be used on qpairs created with a depth of `DEPTH`.
+ */
+#define NVME_QPAIR_POW2_DEFINE(DEPTH)                                                             \
+	UPCIE_STATIC_ASSERT((DEPTH) >= 2 && !((DEPTH) & ((DEPTH) - 1)), "Not a power of two")     \
+                                                                                                  \
+	static inline int                                                                         \
+	nvme_qpair_pow2_##DEPTH##_enqueue(struct nvme_qpair *qp, struct nvme_command *cmd)        \
+	{                                                                                         \
+		struct nvme_command *sq = qp->sq;                                                 \
+		uint16_t tail = qp->tail;                                                         \
+                                                                                                  \
+		assert(qp->depth == (DEPTH));                                                     \
+		if (((tail + 1) & ((DEPTH) - 1)) == qp->sqhd) {                                   \
+			return -EBUSY;                                                            \
+		}                                                                                 \
+                                                                                                  \
+		nvme_qpair_sqe_store(&sq[tail], cmd);                                             \
+		nvme_qpair_enqueue_track(qp, cmd, tail);                                          \
+                                                                                                  \
+		qp->tail = (tail + 1) & ((DEPTH) - 1);                                            \
+                                                                                                  \
+		return 0;                                                                         \
+	}                                                                                         \
+                                                                                                  \
+	static inline int                                                                         \
+	nvme_qpair_pow2_##DEPTH##_enqueue_batch(struct nvme_qpair *qp, struct nvme_command *cmds, \
+						uint32_t n)                                       \
+	{                                                                                         \
+		struct nvme_command *sq = qp->sq;                                                 \
+		uint16_t tail = qp->tail;                                                         \
+                                                                                                  \
+		assert(qp->depth == (DEPTH));                                                     \
+		if (n > ((uint32_t)(qp->sqhd - tail - 1) & ((DEPTH) - 1))) {                      \
+			return -EBUSY;                                                            \
+		}                                                                                 \
+                                                                                                  \
+		for (uint32_t i = 0; i < n; ++i) {                                                \
+			uint16_t slot = (tail + i) & ((DEPTH) - 1);                               \
+                                                                                                  \
+			nvme_qpair_sqe_store(&sq[slot], &cmds[i]);                                \
+			nvme_qpair_enqueue_track(qp, &cmds[i], slot);                             \
+		}                                                                                 \
+                                                                                                  \
+		qp->tail = (tail + n) & ((DEPTH) - 1);                                            \
+                                                                                                  \
+		return 0;                                                                         \
+	}
+
+/**
+ * Complete the request of the reaped completion `cpl`; frees its `cid`, then invokes its callback
+ */
+static inline void
+nvme_qpair_complete(struct nvme_qpair *qp, struct nvme_completion *cpl)
+{
+	struct nvme_request *req = nvme_request_get(qp->rpool, cpl->cid);
+	nvme_request_cb cb = req->cb;
+	void *user = req->user;
+
+	nvme_request_free(qp->rpool, cpl->cid);
+
+	if (cb) {
+		cb(cpl, user);
+	}
+}
+
+/**
+ * Submits a command on the given qpair, waits for completion, and populates `cpl`.
+ *
+ * This is intended for synchronous I/O or Admin commands where the caller manages the payload
+ * and sets up PRP1/PRP2 manually. The function does not modify or validate the PRP fields.
+ *
+ * Completions of other commands, reaped while waiting, e.g. of the Aborts submitted by
+ * nvme_controller_process_aborts(), are completed via their callbacks. On timeout, the request
+ * is left in flight, and freed when its completion is reaped later on.
+ *
+ * @param qp         Pointer to the submission queue pair.
+ * @param cmd        Pointer to the command to submit; `cid` will be assigned.
+ * @param timeout_ms Timeout in milliseconds to wait for command completion.
+ * @param cpl        Pointer to a completion structure to receive the result.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_qpair_submit_sync(struct nvme_qpair *qp, struct nvme_command *cmd, int timeout_ms,
+		       struct nvme_completion *cpl)
 {
+	const uint64_t deadline = tsc_read() + tsc_from_ms(timeout_ms);
 	struct nvme_request *req;
 	int err;
 
@@ -273,20 +1074,30 @@ nvme_qpair_submit_sync_contig_prps(struct nvme_qpair *qp, struct hostmem_heap *h
 		UPCIE_DEBUG("FAILED: nvme_request_alloc(); errno(%d)", errno);
 		return -errno;
 	}
+	req->cb = NULL;
+	req->user = NULL;
 	cmd->cid = req->cid;
 
-	nvme_request_prep_command_prps_contig(req, heap, dbuf, dbuf_nbytes, cmd);
-
 	err = nvme_qpair_enqueue(qp, cmd);
 	if (err) {
-		return -err;
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
 	}
 
 	nvme_qpair_sqdb_update(qp);
 
-	err = nvme_qpair_reap_cpl(qp, timeout_ms, cpl);
-	if (err) {
-		return -err;
+	for (;;) {
+		uint64_t now = tsc_read();
+
+		err = nvme_qpair_reap_cpl(
+			qp, now < deadline ? (deadline - now) / tsc_from_ms(1) : 0, cpl);
+		if (err) {
+			return err;
+		}
+		if (cpl->cid == req->cid) {
+			break;
+		}
+		nvme_qpair_complete(qp, cpl);
 	}
 
 	nvme_request_free(qp->rpool, req->cid);
@@ -299,16 +1110,16 @@ nvme_qpair_submit_sync_contig_prps(struct nvme_qpair *qp, struct hostmem_heap *h
 }
 
 /**
- * Submits a command with an iovec PRP payload, waits for completion, and populates `cpl`.
+ * Submits a command with a contiguous PRP payload, waits for completion, and populates `cpl`.
  *
- * This is intended for synchronous I/O commands using scatter-gather buffers.
- * The function prepares the PRP entries automatically using the provided `heap` and `dvec`,
+ * This is intended for synchronous I/O or Admin commands using a physically contiguous buffer.
+ * The function prepares the PRP entries automatically using the provided `heap` and `dbuf`,
  * sets up the command, submits it on the given qpair, and waits for completion.
  *
  * @param qp          Pointer to the submission queue pair.
  * @param heap        Pointer to the host memory heap used for resolving physical addresses.
- * @param dvec        Array of iovec structures describing the data segments.
- * @param dvec_cnt    Number of elements in the dvec array.
+ * @param dbuf        Pointer to the data buffer to be described via PRPs.
+ * @param dbuf_nbytes Size of the data buffer in bytes.
  * @param cmd         Pointer to the command to submit; `cid` will be assigned and PRPs set.
  * @param timeout_ms  Timeout in milliseconds to wait for command completion.
  * @param cpl         Pointer to a completion structure to receive the result.
@@ -316,9 +1127,9 @@ nvme_qpair_submit_sync_contig_prps(struct nvme_qpair *qp, struct hostmem_heap *h
  * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
  */
 static inline int
-nvme_qpair_submit_sync_iov_prps(struct nvme_qpair *qp, struct hostmem_heap *heap,
-				struct iovec *dvec, size_t dvec_cnt, struct nvme_command *cmd,
-				int timeout_ms, struct nvme_completion *cpl)
+nvme_qpair_submit_sync_contig_prps(struct nvme_qpair *qp, struct hostmem_heap *heap, void *dbuf,
+				   size_t dbuf_nbytes, struct nvme_command *cmd, int timeout_ms,
+				   struct nvme_completion *cpl)
 {
 	struct nvme_request *req;
 	int err;
@@ -330,18 +1141,24 @@ nvme_qpair_submit_sync_iov_prps(struct nvme_qpair *qp, struct hostmem_heap *heap
 	}
 	cmd->cid = req->cid;
 
-	nvme_request_prep_command_prps_iov(req, heap, dvec, dvec_cnt, cmd);
+	err = nvme_request_prep_command_prps_contig(req, heap, dbuf, dbuf_nbytes, cmd);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_request_prep_command_prps_contig(); err(%d)", err);
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
+	}
 
 	err = nvme_qpair_enqueue(qp, cmd);
 	if (err) {
-		return -err;
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
 	}
 
 	nvme_qpair_sqdb_update(qp);
 
 	err = nvme_qpair_reap_cpl(qp, timeout_ms, cpl);
 	if (err) {
-		return -err;
+		return err;
 	}
 
 	nvme_request_free(qp->rpool, req->cid);
@@ -351,4 +1168,676 @@ nvme_qpair_submit_sync_iov_prps(struct nvme_qpair *qp, struct hostmem_heap *heap
 	}
 
 	return err;
-}
\ No newline at end of file
+}
+
+/**
+ * Submits an LBA-range command with a contiguous payload, split by the Maximum Data Transfer Size
+ *
+ * Same as nvme_qpair_submit_sync_contig_prps(), however, when `dbuf_nbytes` exceeds
+ * qp->mdts_nbytes, then the command is split into multiple commands, each transferring at most
+ * qp->mdts_nbytes, submitted one after the other. This assumes the layout of the NVM command set
+ * read/write commands: SLBA in cdw10/cdw11 and NLB in cdw12[15:0]; the logical block size is
+ * derived from `dbuf_nbytes` and NLB. Upon error, the remaining chunks are not submitted, and
+ * `cpl` holds the completion of the failed chunk.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EINVAL when `dbuf_nbytes` is not a multiple of the number of logical blocks, or when a
+ *         single logical block exceeds qp->mdts_nbytes.
+ */
+static inline int
+nvme_qpair_submit_sync_contig_prps_split(struct nvme_qpair *qp, struct hostmem_heap *heap,
+					 void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd,
+					 int timeout_ms, struct nvme_completion *cpl)
+{
+	uint64_t slba = cmd->cdw10 | ((uint64_t)cmd->cdw11 << 32);
+	uint32_t nlb = (cmd->cdw12 & 0xFFFF) + 1;
+	size_t lba_nbytes, nlb_max;
+
+	if (!qp->mdts_nbytes || dbuf_nbytes <= qp->mdts_nbytes) {
+		return nvme_qpair_submit_sync_contig_prps(qp, heap, dbuf, dbuf_nbytes, cmd,
+							  timeout_ms, cpl);
+	}
+
+	if (dbuf_nbytes % nlb) {
+		UPCIE_DEBUG("FAILED: dbuf_nbytes(%zu) %% nlb(%" PRIu32 ") != 0", dbuf_nbytes, nlb);
+		return -EINVAL;
+	}
+	lba_nbytes = dbuf_nbytes / nlb;
+
+	nlb_max = qp->mdts_nbytes / lba_nbytes;
+	if (!nlb_max) {
+		UPCIE_DEBUG("FAILED: lba_nbytes(%zu) > mdts_nbytes(%" PRIu32 ")", lba_nbytes,
+			    qp->mdts_nbytes);
+		return -EINVAL;
+	}
+
+	for (uint8_t *chunk = dbuf; nlb;) {
+		struct nvme_command sub = *cmd;
+		uint32_t n = nlb < nlb_max ? nlb : nlb_max;
+		int err;
+
+		sub.cdw10 = slba & 0xFFFFFFFF;
+		sub.cdw11 = slba >> 32;
+		sub.cdw12 = (cmd->cdw12 & ~0xFFFFU) | (n - 1);
+
+		err = nvme_qpair_submit_sync_contig_prps(qp, heap, chunk, n * lba_nbytes, &sub,
+							 timeout_ms, cpl);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)", err);
+			return err;
+		}
+
+		chunk += n * lba_nbytes;
+		slba += n;
+		nlb -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Submits a command with an iovec PRP payload, waits for completion, and populates `cpl`.
+ *
+ * This is intended for synchronous I/O commands using scatter-gather buffers.
+ * The function prepares the PRP entries automatically using the provided `heap` and `dvec`,
+ * sets up the command, submits it on the given qpair, and waits for completion.
+ *
+ * @param qp          Pointer to the submission queue pair.
+ * @param heap        Pointer to the host memory heap used for resolving physical addresses.
+ * @param dvec        Array of iovec structures describing the data segments.
+ * @param dvec_cnt    Number of elements in the dvec array.
+ * @param cmd         Pointer to the command to submit; `cid` will be assigned and PRPs set.
+ * @param timeout_ms  Timeout in milliseconds to wait for command completion.
+ * @param cpl         Pointer to a completion structure to receive the result.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_qpair_submit_sync_iov_prps(struct nvme_qpair *qp, struct hostmem_heap *heap,
+				struct iovec *dvec, size_t dvec_cnt, struct nvme_command *cmd,
+				int timeout_ms, struct nvme_completion *cpl)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(qp->rpool);
+	if (!req) {
+		UPCIE_DEBUG("FAILED: nvme_request_alloc(); errno(%d)", errno);
+		return -errno;
+	}
+	cmd->cid = req->cid;
+
+	err = nvme_request_prep_command_prps_iov(req, heap, dvec, dvec_cnt, cmd);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_request_prep_command_prps_iov(); err(%d)", err);
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
+	}
+
+	err = nvme_qpair_enqueue(qp, cmd);
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
+	}
+
+	nvme_qpair_sqdb_update(qp);
+
+	err = nvme_qpair_reap_cpl(qp, timeout_ms, cpl);
+	if (err) {
+		return err;
+	}
+
+	nvme_request_free(qp->rpool, req->cid);
+
+	if (cpl->status & 0x1FE) {
+		err = -EIO;
+	}
+
+	return err;
+}
+
+/**
+ * Submits a command on the given qpair without waiting for its completion
+ *
+ * A request is allocated from the qpair request-pool, its `cid` is assigned to `cmd`, and `cb`
+ * and `user` are stored in the request. The command is enqueued and the SQ doorbell is updated.
+ * As with nvme_qpair_submit_sync(), the PRP fields are neither modified nor validated; see
+ * nvme_qpair_submit_async_contig_prps() and nvme_qpair_submit_async_iov_prps().
+ *
+ * The callback is invoked from nvme_qpair_process_completions() when the command completes.
+ *
+ * @param qp   Pointer to the submission queue pair.
+ * @param cmd  Pointer to the command to submit; `cid` will be assigned.
+ * @param cb   Callback invoked upon completion; may be NULL.
+ * @param user Opaque pointer passed on to `cb`.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EBUSY when the submission queue or request pool is exhausted.
+ */
+static inline int
+nvme_qpair_submit_async(struct nvme_qpair *qp, struct nvme_command *cmd, nvme_request_cb cb,
+			void *user)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(qp->rpool);
+	if (!req) {
+		UPCIE_DEBUG("FAILED: nvme_request_alloc(); errno(%d)", errno);
+		return -EBUSY;
+	}
+	req->cb = cb;
+	req->user = user;
+	cmd->cid = req->cid;
+
+	err = nvme_qpair_enqueue(qp, cmd);
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
+	}
+
+	nvme_qpair_sqdb_update(qp);
+
+	return 0;
+}
+
+/**
+ * Submits a command with a contiguous PRP payload without waiting for its completion
+ *
+ * Same as nvme_qpair_submit_async(), with the PRP entries prepared using the provided `heap` and
+ * `dbuf`. The buffer must remain valid until the callback has been invoked.
+ *
+ * @param qp          Pointer to the submission queue pair.
+ * @param heap        Pointer to the host memory heap used for resolving physical addresses.
+ * @param dbuf        Pointer to the data buffer to be described via PRPs.
+ * @param dbuf_nbytes Size of the data buffer in bytes.
+ * @param cmd         Pointer to the command to submit; `cid` will be assigned and PRPs set.
+ * @param cb          Callback invoked upon completion; may be NULL.
+ * @param user        Opaque pointer passed on to `cb`.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EBUSY when the submission queue, the request pool, or its PRP-list pages are exhausted.
+ */
+static inline int
+nvme_qpair_submit_async_contig_prps(struct nvme_qpair *qp, struct hostmem_heap *heap, void *dbuf,
+				    size_t dbuf_nbytes, struct nvme_command *cmd,
+				    nvme_request_cb cb, void *user)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(qp->rpool);
+	if (!req) {
+		UPCIE_DEBUG("FAILED: nvme_request_alloc(); errno(%d)", errno);
+		return -EBUSY;
+	}
+	req->cb = cb;
+	req->user = user;
+	cmd->cid = req->cid;
+
+	err = nvme_request_prep_command_prps_contig(req, heap, dbuf, dbuf_nbytes, cmd);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_request_prep_command_prps_contig(); err(%d)", err);
+		nvme_request_free(qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	err = nvme_qpair_enqueue(qp, cmd);
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
+	}
+
+	nvme_qpair_sqdb_update(qp);
+
+	return 0;
+}
+
+/**
+ * Submits a command with an iovec PRP payload without waiting for its completion
+ *
+ * Same as nvme_qpair_submit_async(), with the PRP entries prepared using the provided `heap` and
+ * `dvec`. The buffers must remain valid until the callback has been invoked.
+ *
+ * @param qp       Pointer to the submission queue pair.
+ * @param heap     Pointer to the host memory heap used for resolving physical addresses.
+ * @param dvec     Array of iovec structures describing the data segments.
+ * @param dvec_cnt Number of elements in the dvec array.
+ * @param cmd      Pointer to the command to submit; `cid` will be assigned and PRPs set.
+ * @param cb       Callback invoked upon completion; may be NULL.
+ * @param user     Opaque pointer passed on to `cb`.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error;
+ *         -EBUSY when the submission queue, the request pool, or its PRP-list pages are exhausted.
+ */
+static inline int
+nvme_qpair_submit_async_iov_prps(struct nvme_qpair *qp, struct hostmem_heap *heap,
+				 struct iovec *dvec, size_t dvec_cnt, struct nvme_command *cmd,
+				 nvme_request_cb cb, void *user)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(qp->rpool);
+	if (!req) {
+		UPCIE_DEBUG("FAILED: nvme_request_alloc(); errno(%d)", errno);
+		return -EBUSY;
+	}
+	req->cb = cb;
+	req->user = user;
+	cmd->cid = req->cid;
+
+	err = nvme_request_prep_command_prps_iov(req, heap, dvec, dvec_cnt, cmd);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_request_prep_command_prps_iov(); err(%d)", err);
+		nvme_request_free(qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	err = nvme_qpair_enqueue(qp, cmd);
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err;
+	}
+
+	nvme_qpair_sqdb_update(qp);
+
+	return 0;
+}
+
+/**
+ * Give each command enqueued a deadline of `timeout_ms`, and invoke `cb` for those missing it
+ *
+ * The deadlines are checked by nvme_qpair_process_completions(), and by nvme_qpair_expire(). Must
+ * be called while no commands are in flight; a `timeout_ms` of 0 disables the deadlines.
+ *
+ * @param qp The queue-pair
+ * @param timeout_ms Deadline of commands, relative to when they are enqueued; 0 disables
+ * @param cb Invoked for each command missing its deadline; may be NULL
+ * @param arg Passed on to `cb`
+ */
+static inline void
+nvme_qpair_set_timeout(struct nvme_qpair *qp, uint32_t timeout_ms, nvme_qpair_expire_cb cb,
+		       void *arg)
+{
+	nvme_request_timer_setup(qp->rpool, tsc_from_ms(timeout_ms), tsc_read());
+	qp->expire_cb = cb;
+	qp->expire_arg = arg;
+	qp->expire_next = 0;
+}
+
+/**
+ * Expire the commands in flight whose deadline has passed, invoking the expire callback of each
+ *
+ * Each command expired is armed again, with a deadline one timeout later, and req->nexpired
+ * incremented. This is called by nvme_qpair_process_completions() once per tick of the timer
+ * wheel; call it directly to check the deadlines of a qpair which is not otherwise processed.
+ *
+ * @return The number of commands whose deadline expired.
+ */
+static inline uint32_t
+nvme_qpair_expire(struct nvme_qpair *qp)
+{
+	struct nvme_request_pool *pool = qp->rpool;
+	uint64_t now = tsc_read();
+	uint32_t nexpired = 0;
+	uint16_t cids[32];
+	uint32_t n;
+
+	if (!pool->timer.timeout) {
+		return 0;
+	}
+	qp->expire_next = now + pool->timer.tick;
+
+	do {
+		n = nvme_request_timer_expire(pool, now, cids, 32);
+		for (uint32_t i = 0; i < n; ++i) {
+			struct nvme_request *req = &pool->reqs[cids[i]];
+
+			req->nexpired += req->nexpired < UINT8_MAX;
+			nvme_request_timer_arm(pool, req, now + pool->timer.timeout);
+			qp->stats.nexpired++;
+			if (qp->trace) {
+				nvme_trace_record(qp->trace, NVME_TRACE_EXPIRE, 0, req->cid,
+						  req->slot, 0, req->nexpired);
+			}
+			if (qp->expire_cb) {
+				qp->expire_cb(qp, req, qp->expire_arg);
+			}
+		}
+		nexpired += n;
+	} while (n == 32);
+
+	return nexpired;
+}
+
+/**
+ * Reaps all ready completions, up to `max`, and invokes the callback of each request
+ *
+ * For each completion the request is looked up via nvme_request_get() and its `cid` is freed
+ * *before* its callback is invoked, thus the callback may submit new commands. Completions which
+ * are not of a command in flight are dropped, see nvme_qpair_cpl_valid(). The CQ doorbell is
+ * written once, after the ready completions have been consumed. This does not wait; when no
+ * completions are ready, then 0 is returned. When the SQ completes to a shared CQ, then the
+ * shared CQ is processed instead, see nvme_cq_process_completions().
+ *
+ * @param qp  Pointer to the queue pair.
+ * @param max Maximum number of completions to process; 0 means no limit.
+ *
+ * @return The number of completions processed.
+ */
+static inline int
+nvme_qpair_process_completions(struct nvme_qpair *qp, uint32_t max)
+{
+	volatile struct nvme_completion *cq = qp->cq;
+	uint32_t nreaped = 0;
+
+	if (qp->shcq) {
+		return nvme_cq_process_completions(qp->shcq, max);
+	}
+
+	while (!max || nreaped < max) {
+		volatile struct nvme_completion *cqe = &cq[qp->head];
+		struct nvme_completion cpl;
+
+		if ((cqe->status & 0x1) != qp->phase) {
+			break;
+		}
+		dma_rmb();
+
+		cpl = *cqe;
+		qp->sqhd = cpl.sqhd;
+
+		qp->head++;
+		if (qp->head == qp->depth) {
+			qp->head = 0;
+			qp->phase ^= 1;
+		}
+		nreaped++;
+		NVME_TELEMETRY_FCALL(nvme_telemetry_on_complete(&qp->telemetry, qp->rpool, &cpl));
+		if (qp->trace) {
+			nvme_qpair_trace_cpl(qp, &cpl);
+		}
+
+		if (nvme_qpair_cpl_valid(qp, &cpl)) {
+			nvme_qpair_complete(qp, &cpl);
+		}
+	}
+
+	if (nreaped) {
+		nvme_qpair_cqdb_update(qp);
+	} else {
+		NVME_TELEMETRY_FCALL(qp->telemetry.npolls_empty++);
+	}
+
+	if (qp->rpool->timer.narmed && tsc_read() >= qp->expire_next) {
+		nvme_qpair_expire(qp);
+	}
+
+	return nreaped;
+}
+
+/**
+ * Complete the request of `cid` as aborted, without the controller, invoking its callback
+ */
+static inline void
+nvme_qpair_abort_cid(struct nvme_qpair *qp, uint16_t cid)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_request *req = nvme_request_get(qp->rpool, cid);
+	nvme_request_cb cb = req->cb;
+	void *user = req->user;
+
+	cpl.cid = cid;
+	cpl.sqid = qp->qid;
+	cpl.sqhd = qp->sqhd;
+	cpl.status = (NVME_QPAIR_SC_ABORTED_SQ_DELETION << 1) | qp->phase;
+
+	nvme_request_free(qp->rpool, cid);
+	if (cb) {
+		cb(&cpl, user);
+	}
+}
+
+/**
+ * Rewind the SQ and CQ of the qpair, keeping their memory, once the controller no longer has them
+ *
+ * That is, after the controller is disabled, or the queues are deleted, and before they are
+ * created again. The commands in flight are those whose request holds the SQ slot they were last
+ * enqueued at, and where that slot still holds them. When `pending` is given, then these commands
+ * are copied to it, oldest first, to be given to nvme_qpair_resubmit(); their requests, and
+ * PRP-list pages, are kept. Otherwise, and for commands whose slot was since overwritten, thus
+ * lost, the requests are completed with NVME_QPAIR_SC_ABORTED_SQ_DELETION, via
+ * nvme_qpair_abort_cid().
+ *
+ * The qpair must not be used concurrently; requests allocated, and not yet enqueued, are kept.
+ *
+ * @param qp The queue-pair
+ * @param pending Array of at least qp->depth commands; may be NULL
+ *
+ * @return The number of commands copied to `pending`.
+ */
+static inline uint32_t
+nvme_qpair_reset(struct nvme_qpair *qp, struct nvme_command *pending)
+{
+	struct nvme_command *sq = qp->sq;
+	struct nvme_request_pool *pool = qp->rpool;
+	uint32_t npending = 0;
+
+	// The slots from the tail onwards are the oldest; a slot only holds the latest command
+	for (uint32_t i = 0; i < qp->depth; ++i) {
+		uint16_t slot = (qp->tail + i) % qp->depth;
+		uint16_t cid = sq[slot].cid;
+
+		if (cid >= pool->len || pool->reqs[cid].slot != slot) {
+			continue;
+		}
+
+		if (pending) {
+			pending[npending++] = sq[slot];
+			pool->reqs[cid].slot = NVME_REQUEST_SLOT_NONE;
+		} else {
+			nvme_qpair_abort_cid(qp, cid);
+		}
+	}
+
+	for (uint16_t cid = 0; cid < pool->len; ++cid) {
+		if (pool->reqs[cid].slot != NVME_REQUEST_SLOT_NONE) {
+			UPCIE_DEBUG("INFO: qid(%" PRIu32 ") cid(%" PRIu16 ") lost; aborting",
+				    qp->qid, cid);
+			nvme_qpair_abort_cid(qp, cid);
+		}
+	}
+
+	memset(qp->sq, 0, nvme_qpair_sq_nbytes(qp));
+	if (qp->cq) {
+		memset(qp->cq, 0, (size_t)qp->depth * sizeof(struct nvme_completion));
+	}
+
+	qp->tail = 0;
+	qp->tail_last_written = UINT16_MAX;
+	qp->head = 0;
+	qp->sqhd = 0;
+	qp->phase = 1;
+
+	return npending;
+}
+
+/**
+ * Enqueue the commands handed back by nvme_qpair_reset() and write the SQ doorbell
+ *
+ * The commands keep their cid, thus, their requests, callbacks, and PRP-list pages; their expiry
+ * count, req->nexpired, starts over, as they are new to the controller.
+ *
+ * @return On success 0 is returned. When a command does not fit, -EBUSY is returned, and the
+ *         commands from it onwards are aborted via nvme_qpair_abort_cid().
+ */
+static inline int
+nvme_qpair_resubmit(struct nvme_qpair *qp, struct nvme_command *pending, uint32_t npending)
+{
+	int err = 0;
+
+	for (uint32_t i = 0; i < npending; ++i) {
+		if (!err) {
+			qp->rpool->reqs[pending[i].cid].nexpired = 0;
+			err = nvme_qpair_enqueue(qp, &pending[i]);
+		}
+		if (err) {
+			nvme_qpair_abort_cid(qp, pending[i].cid);
+		}
+	}
+	nvme_qpair_sqdb_update(qp);
+
+	return err;
+}
+
+/**
+ * Tracks the commands of a single I/O driven by nvme_qpair_pipeline_run()
+ */
+struct nvme_qpair_pipeline {
+	size_t ncmds;               ///< Number of commands enqueued; counted by the submit function
+	size_t ncompleted;          ///< Number of commands completed
+	size_t nerrors;             ///< Number of commands completed with an error status
+	struct nvme_completion cpl; ///< Completion of the first failed command
+};
+
+/**
+ * Enqueues the next commands of a pipelined I/O; see nvme_qpair_pipeline_run()
+ *
+ * Commands are enqueued, each with a request of nvme_qpair_pipeline_request(), counted in
+ * pl->ncmds, until done, or until the qpairs, their request pools, or PRP-list pages, are
+ * exhausted; then the SQ doorbells of the qpairs enqueued on are written.
+ *
+ * @return 1 when commands remain to be enqueued, 0 when all are. On error, negative errno is
+ *         returned, and no more commands are enqueued.
+ */
+typedef int (*nvme_qpair_pipeline_submit_fn)(struct nvme_qpair_pipeline *pl, void *arg);
+
+/**
+ * Returns qpair `idx` of those a pipelined I/O enqueues on, or NULL when `idx` is past the last
+ */
+typedef struct nvme_qpair *(*nvme_qpair_pipeline_qpair_fn)(void *arg, uint32_t idx);
+
+static inline void
+nvme_qpair_pipeline_cb(struct nvme_completion *cpl, void *user)
+{
+	struct nvme_qpair_pipeline *pl = user;
+
+	pl->ncompleted += 1;
+	if ((cpl->status & 0x1FE) && !pl->nerrors++) {
+		pl->cpl = *cpl;
+	}
+}
+
+/**
+ * Allocate a request of the qpair, with its completion tracked by the given pipeline
+ *
+ * @return On success, the request is returned. When the request pool is exhausted, then NULL.
+ */
+static inline struct nvme_request *
+nvme_qpair_pipeline_request(struct nvme_qpair_pipeline *pl, struct nvme_qpair *qp)
+{
+	struct nvme_request *req = nvme_request_alloc(qp->rpool);
+
+	if (req) {
+		req->cb = nvme_qpair_pipeline_cb;
+		req->user = pl;
+	}
+
+	return req;
+}
+
+/**
+ * Detach the requests of the pipeline, which are in flight on the qpair, from the pipeline
+ *
+ * Their callbacks are cleared, thus, their completions are reaped without effect, and the
+ * pipeline may go out of scope.
+ */
+static inline void
+nvme_qpair_pipeline_detach(struct nvme_qpair_pipeline *pl, struct nvme_qpair *qp)
+{
+	for (uint16_t cid = 0; cid < qp->rpool->len; ++cid) {
+		struct nvme_request *req = &qp->rpool->reqs[cid];
+
+		if (req->slot != NVME_REQUEST_SLOT_NONE && req->user == pl) {
+			req->cb = NULL;
+			req->user = NULL;
+		}
+	}
+}
+
+/**
+ * Drive a pipelined I/O: enqueue its commands as requests allow, and wait for their completion
+ *
+ * `submit` is invoked, while commands remain to be enqueued, before each pass processing the
+ * completions of the qpairs given by `qpair`; see nvme_qpair_pipeline_submit_fn.
+ *
+ * When no completion is processed, on any of the qpairs, for `timeout_ms`, then the I/O is given
+ * up; its requests still in flight are detached via nvme_qpair_pipeline_detach(), thus, `pl` may
+ * go out of scope, and the qpairs may be used, and polled, again. As those commands may still
+ * transfer data, their buffers must not be reused before the qpairs are destroyed.
+ *
+ * @param pl Zeroed pipeline tracking the commands of the I/O
+ * @param submit Enqueues the next commands of the I/O
+ * @param qpair Gives the qpairs enqueued on
+ * @param arg Passed on to `submit` and `qpair`
+ * @param timeout_ms Timeout in milliseconds without any completion
+ * @param cpl Pointer to store the completion of the first failed command; may be NULL
+ *
+ * @return On success 0 is returned. When `submit` fails, its error is returned, once the commands
+ *         enqueued have completed. When a command fails, -EIO is returned, after all commands
+ *         have completed. On timeout -EAGAIN is returned.
+ */
+static inline int
+nvme_qpair_pipeline_run(struct nvme_qpair_pipeline *pl, nvme_qpair_pipeline_submit_fn submit,
+			nvme_qpair_pipeline_qpair_fn qpair, void *arg, uint32_t timeout_ms,
+			struct nvme_completion *cpl)
+{
+	uint64_t timeout = tsc_from_ms(timeout_ms);
+	uint64_t deadline = tsc_read() + timeout;
+	int more = 1, err = 0;
+
+	while (more || pl->ncompleted < pl->ncmds) {
+		struct nvme_qpair *qp;
+		int nreaped = 0;
+
+		if (more) {
+			more = submit(pl, arg);
+			if (more < 0) {
+				err = more;
+				more = 0;
+			}
+		}
+		if (!more && pl->ncompleted == pl->ncmds) {
+			break;
+		}
+
+		for (uint32_t i = 0; (qp = qpair(arg, i)); ++i) {
+			nreaped += nvme_qpair_process_completions(qp, 0);
+		}
+		if (nreaped) {
+			deadline = tsc_read() + timeout;
+		} else if (tsc_read() >= deadline) {
+			UPCIE_DEBUG("FAILED: timeout; ncompleted(%zu) < ncmds(%zu)", pl->ncompleted,
+				    pl->ncmds);
+			for (uint32_t i = 0; (qp = qpair(arg, i)); ++i) {
+				nvme_qpair_pipeline_detach(pl, qp);
+			}
+			return -EAGAIN;
+		} else {
+			cpu_relax();
+		}
+	}
+
+	if (err) {
+		return err;
+	}
+	if (pl->nerrors) {
+		if (cpl) {
+			*cpl = pl->cpl;
+		}
+		return -EIO;
+	}
+
+	return 0;
+}
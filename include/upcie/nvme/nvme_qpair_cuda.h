@@ -8,6 +8,43 @@
  * header `upcie/nvme/nvme_qpair.h` with a CUDA compatible queue implementation.
  *
  * Look to `nvme_qpair_cuda_io()` to see the intended flow of IO function calls.
+ *
+ * Shared submission
+ * -----------------
+ *
+ * `nvme_qpair_cuda_io()` runs a threadblock in lockstep on its own queue, with
+ * blockDim.x <= depth and cid == threadIdx.x. The shared path, see
+ * `nvme_qpair_cuda_io_shared()`, instead lets any thread, of any block, submit
+ * to any queue, and thus, any grid shape drive any number of queues:
+ *
+ *   - CIDs are allocated from a bitmap of depth - 1 free CIDs, which also
+ *     bounds the commands in flight to what the SQ can hold
+ *   - The lanes of a warp submitting together reserve their SQ slots with a
+ *     single atomicAdd by an elected lane, and write their commands
+ *   - The elected lane writes the SQ doorbell, once the warps which reserved
+ *     slots before it have written theirs, such that the doorbell only moves
+ *     forward, and only over written commands
+ *   - Completions are processed by whichever thread holds the CQ lock, which
+ *     records the status per CID, for the submitting thread to pick up
+ *
+ * The two paths must not be mixed on the same queue.
+ *
+ * Power-of-two depth
+ * ------------------
+ *
+ * The index math of `nvme_qpair_cuda_io()` is modulo the depth of the queue, and integer modulo
+ * is a long sequence of instructions on the GPU. NVME_QPAIR_CUDA_POW2_DEFINE(DEPTH) defines
+ * `nvme_qpair_cuda_pow2_<DEPTH>_io()`, and the functions it is made of, for queues created with a
+ * depth of DEPTH, a power of two, where the index math is masks with a constant. The generic
+ * functions remain those for other depths. Both write commands into the SQ via
+ * `nvme_qpair_cuda_sqe_store()`, four 16-byte vector stores instead of sixteen 4-byte ones.
+ *
+ * Tracing
+ * -------
+ *
+ * With a ring attached via nvme_controller_cuda_trace_attach(), then both paths record commands
+ * written to the SQ, doorbell writes, completions and timeouts into it, time-stamped with the
+ * global timer of the GPU; see nvme_trace.h.
  * 
  * @file nvme_qpair_cuda.h
  * @version 0.4.4
@@ -20,6 +57,18 @@
 #define __host__
 #endif
 
+/**
+ * Memory backing a queue of a 'struct nvme_qpair_cuda', see nvme_io_qpair_cuda_opts
+ *
+ * GPU memory is local to the kernels writing the SQ and polling the CQ, yet, the controller has
+ * to reach it via peer-to-peer DMA; host-pinned memory is mapped into the device address space,
+ * such that kernel accesses go over PCIe, and the controller DMAs to and from system memory.
+ */
+enum nvme_qpair_cuda_placement {
+	NVME_QPAIR_CUDA_PLACEMENT_DEVICE = 0x0, ///< GPU memory, from the 'struct cudamem_heap'
+	NVME_QPAIR_CUDA_PLACEMENT_HOST = 0x1,   ///< Host-pinned memory, from the controller heap
+};
+
 struct nvme_qpair_cuda {
 	void *sq;             ///< VA-Pointer to DMA-capable memory backing the Submission Queue (SQ)
 	void *cq;             ///< VA-Pointer to DMA-capable memory backing the Completion Queue (CQ)
@@ -30,11 +79,95 @@ struct nvme_qpair_cuda {
 	uint16_t tail;        ///< Submission Queue Tail Pointer
 	uint16_t head;        ///< Completion Queue Head Pointer
 	uint8_t phase;        ///< Expected CQ phase bit; flips each time the CQ head wraps to 0
-	uint8_t _rsvd[3];     ///< Padding to align timeout_ms to a 4-byte boundary
+	uint8_t sq_placement; ///< Memory backing the SQ; enum nvme_qpair_cuda_placement
+	uint8_t cq_placement; ///< Memory backing the CQ; enum nvme_qpair_cuda_placement
+	uint8_t _rsvd[1];     ///< Padding to align timeout_ms to a 4-byte boundary
 	uint32_t timeout_ms;  ///< Command timeout in milliseconds (derived from cap.to)
 	uint64_t clocks_per_ms; ///< SM clock cycles per millisecond (set from CU_DEVICE_ATTRIBUTE_CLOCK_RATE)
+
+	// State of the shared submission path, see nvme_qpair_cuda_io_shared()
+	unsigned long long sq_reserved;  ///< Number of SQ slots reserved
+	unsigned long long sq_published; ///< Number of SQ slots made visible via the SQ doorbell
+	uint32_t cq_lock;                ///< Held by the thread processing completions
+	uint32_t *cids;                  ///< Bitmap of free CIDs, depth - 1 bits; device memory
+	uint32_t *cpls;                  ///< Per CID: bit 31 set on completion, status in 15:0
+
+	struct nvme_trace_ring *trace; ///< Host-pinned, mapped to the device; NULL when not tracing
 };
 
+#define NVME_QPAIR_CUDA_CPL_DONE 0x80000000u
+
+/**
+ * Record an event into the trace ring of the qpair, when one is attached; by any thread
+ *
+ * The slot is reserved via atomicAdd() on the head of the ring, the `seq` of the event is written
+ * last, after a system-wide fence, such that host readers see either all of the event, or none.
+ */
+static inline __device__ void
+nvme_qpair_cuda_trace(struct nvme_qpair_cuda *qp, uint8_t type, uint8_t flags, uint16_t cid,
+		      uint16_t value, uint32_t nsid, uint64_t arg)
+{
+#ifndef __CUDACC__
+	(void)qp; (void)type; (void)flags; (void)cid; (void)value; (void)nsid; (void)arg;
+#else
+	struct nvme_trace_ring *ring = qp->trace;
+	volatile struct nvme_trace_event *event;
+	unsigned long long idx, ts;
+
+	if (!ring) {
+		return;
+	}
+
+	idx = atomicAdd(&ring->head, 1ULL);
+	event = (volatile struct nvme_trace_event *)(ring + 1) + (idx & (ring->nevents - 1));
+
+	event->seq = 0;
+	__threadfence_system();
+
+	asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(ts));
+	event->ts = ts;
+	event->arg = arg;
+	event->nsid = nsid;
+	event->type = type;
+	event->flags = flags;
+	event->cid = cid;
+	event->value = value;
+
+	__threadfence_system();
+	event->seq = (uint32_t)(idx + 1);
+#endif /* __CUDACC__ */
+}
+
+/**
+ * Write the 64-byte command into the SQ slot as four volatile 16-byte vector stores
+ *
+ * The stores are volatile to bypass the per-SM L1 cache, such that they reach system DRAM without
+ * waiting for eviction, and are visible to the NVMe DMA engine; the slots are 64-byte aligned.
+ * The source does not need to be volatile, nor aligned: `cmd` is a per-thread local copy held in
+ * registers.
+ */
+static inline __device__ void
+nvme_qpair_cuda_sqe_store(void *slot, const struct nvme_command *cmd)
+{
+	const uint32_t *src = (const uint32_t *)cmd;
+
+#ifdef __CUDACC__
+	for (unsigned i = 0; i < sizeof(struct nvme_command) / sizeof(uint32_t); i += 4) {
+		asm volatile("st.volatile.v4.u32 [%0], {%1, %2, %3, %4};"
+			     :
+			     : "l"((uint32_t *)slot + i), "r"(src[i]), "r"(src[i + 1]),
+			       "r"(src[i + 2]), "r"(src[i + 3])
+			     : "memory");
+	}
+#else
+	volatile uint32_t *dst = (volatile uint32_t *)slot;
+
+	for (unsigned i = 0; i < sizeof(struct nvme_command) / sizeof(uint32_t); i++) {
+		dst[i] = src[i];
+	}
+#endif /* __CUDACC__ */
+}
+
 /**
  * Enqueue a command into an NVMe submission queue at a certain index
  *
@@ -51,16 +184,11 @@ nvme_qpair_cuda_enqueue_at_i(struct nvme_qpair_cuda *qp, struct nvme_command *cm
 	struct nvme_command *sq = (struct nvme_command *)qp->sq;
 	uint16_t index = (qp->tail + offset) % qp->depth;
 
-	// Copy the command to the SQ word-by-word. The destination uses a volatile
-	// pointer to bypass the per-SM L1 cache so writes reach system DRAM
-	// without waiting for eviction, making them visible to the NVMe DMA engine.
-	// The source does not need to be volatile: cmd is a per-thread local copy
-	// held in registers.
-	uint32_t *src = (uint32_t *)cmd;
-	volatile uint32_t *dst = (volatile uint32_t *)&sq[index];
+	nvme_qpair_cuda_sqe_store(&sq[index], cmd);
 
-	for (unsigned i = 0; i < sizeof(struct nvme_command) / sizeof(uint32_t); i++) {
-		dst[i] = src[i];
+	if (qp->trace) {
+		nvme_qpair_cuda_trace(qp, NVME_TRACE_SUBMIT, cmd->opc, cmd->cid, index, cmd->nsid,
+				      ((uint64_t)cmd->cdw11 << 32) | cmd->cdw10);
 	}
 }
 
@@ -81,6 +209,10 @@ nvme_qpair_cuda_sq_update(struct nvme_qpair_cuda *qp, uint16_t increment)
 	__threadfence_system(); // flush sq writes to system DRAM (visible to NVMe DMA)
 #endif
 	*(volatile uint32_t *)qp->sqdb = qp->tail;
+
+	if (qp->trace) {
+		nvme_qpair_cuda_trace(qp, NVME_TRACE_SQDB, 0, NVME_TRACE_CID_NONE, qp->tail, 0, 0);
+	}
 }
 
 /**
@@ -145,6 +277,10 @@ nvme_qpair_cuda_cq_update(struct nvme_qpair_cuda *qp, uint16_t increment)
 	}
 	qp->head = new_head;
 	*(volatile uint32_t *)qp->cqdb = qp->head;
+
+	if (qp->trace) {
+		nvme_qpair_cuda_trace(qp, NVME_TRACE_CQDB, 0, NVME_TRACE_CID_NONE, qp->head, 0, 0);
+	}
 }
 
 /**
@@ -221,3 +357,407 @@ nvme_qpair_cuda_io(struct nvme_qpair_cuda *qp, struct nvme_command *cmd, size_t
 
 	return (cpl.status & 0x1FE) >> 1;
 }
+
+/**
+ * Define `nvme_qpair_cuda_pow2_<DEPTH>_io()` for queues of depth `DEPTH`, a power of two
+ *
+ * Along with `_enqueue_at_i()`, `_sq_update()`, `_reap_at_i()` and `_cq_update()`, prefixed
+ * `nvme_qpair_cuda_pow2_<DEPTH>`, these behave as the generic functions of the same suffix, with
+ * the index math masked by the constant `DEPTH - 1`; they must only be used on queues created with
+ * a depth of `DEPTH`. Without __CUDACC__, then nothing is defined.
+ */
+#ifdef __CUDACC__
+#define NVME_QPAIR_CUDA_POW2_DEFINE(DEPTH)                                                       \
+	UPCIE_STATIC_ASSERT((DEPTH) >= 2 && !((DEPTH) & ((DEPTH) - 1)), "Not a power of two")    \
+                                                                                                 \
+	static inline __device__ void                                                            \
+	nvme_qpair_cuda_pow2_##DEPTH##_enqueue_at_i(struct nvme_qpair_cuda *qp,                  \
+						    struct nvme_command *cmd, uint16_t offset)   \
+	{                                                                                        \
+		struct nvme_command *sq = (struct nvme_command *)qp->sq;                         \
+		uint16_t index = (qp->tail + offset) & ((DEPTH) - 1);                            \
+                                                                                                 \
+		nvme_qpair_cuda_sqe_store(&sq[index], cmd);                                      \
+                                                                                                 \
+		if (qp->trace) {                                                                 \
+			uint64_t arg = ((uint64_t)cmd->cdw11 << 32) | cmd->cdw10;                \
+                                                                                                 \
+			nvme_qpair_cuda_trace(qp, NVME_TRACE_SUBMIT, cmd->opc, cmd->cid, index,  \
+					      cmd->nsid, arg);                                   \
+		}                                                                                \
+	}                                                                                        \
+                                                                                                 \
+	static inline __device__ void                                                            \
+	nvme_qpair_cuda_pow2_##DEPTH##_sq_update(struct nvme_qpair_cuda *qp, uint16_t increment) \
+	{                                                                                        \
+		qp->tail = (qp->tail + increment) & ((DEPTH) - 1);                               \
+		__threadfence_system();                                                          \
+		*(volatile uint32_t *)qp->sqdb = qp->tail;                                       \
+                                                                                                 \
+		if (qp->trace) {                                                                 \
+			nvme_qpair_cuda_trace(qp, NVME_TRACE_SQDB, 0, NVME_TRACE_CID_NONE,       \
+					      qp->tail, 0, 0);                                   \
+		}                                                                                \
+	}                                                                                        \
+                                                                                                 \
+	static inline __device__ int                                                             \
+	nvme_qpair_cuda_pow2_##DEPTH##_reap_at_i(struct nvme_qpair_cuda *qp, int timeout_ms,     \
+						 struct nvme_completion *cpl, uint16_t offset)   \
+	{                                                                                        \
+		volatile struct nvme_completion *cq = (volatile struct nvme_completion *)qp->cq; \
+		uint16_t pos = qp->head + offset;                                                \
+		uint8_t expected_phase = (pos & (DEPTH)) ? (qp->phase ^ 1) : qp->phase;          \
+		volatile struct nvme_completion *cqe = &cq[pos & ((DEPTH) - 1)];                 \
+		int64_t deadline = (int64_t)clock64() +                                          \
+				   (int64_t)timeout_ms * (int64_t)qp->clocks_per_ms;             \
+                                                                                                 \
+		do {                                                                             \
+			if ((cqe->cid < 0xFFFF) && ((cqe->status & 0x1) == expected_phase)) {    \
+				*cpl = *(struct nvme_completion *)cqe;                           \
+				return 0;                                                        \
+			}                                                                        \
+		} while ((int64_t)clock64() < deadline);                                         \
+                                                                                                 \
+		return -EAGAIN;                                                                  \
+	}                                                                                        \
+                                                                                                 \
+	static inline __device__ void                                                            \
+	nvme_qpair_cuda_pow2_##DEPTH##_cq_update(struct nvme_qpair_cuda *qp, uint16_t increment) \
+	{                                                                                        \
+		uint16_t pos = qp->head + increment;                                             \
+                                                                                                 \
+		if (pos & (DEPTH)) {                                                             \
+			qp->phase ^= 1;                                                          \
+		}                                                                                \
+		qp->head = pos & ((DEPTH) - 1);                                                  \
+		*(volatile uint32_t *)qp->cqdb = qp->head;                                       \
+                                                                                                 \
+		if (qp->trace) {                                                                 \
+			nvme_qpair_cuda_trace(qp, NVME_TRACE_CQDB, 0, NVME_TRACE_CID_NONE,       \
+					      qp->head, 0, 0);                                   \
+		}                                                                                \
+	}                                                                                        \
+                                                                                                 \
+	static inline __device__ int                                                             \
+	nvme_qpair_cuda_pow2_##DEPTH##_io(struct nvme_qpair_cuda *qp, struct nvme_command *cmd,  \
+					  size_t tid, size_t batch_size)                         \
+	{                                                                                        \
+		struct nvme_completion cpl = {0};                                                \
+		int err = 0;                                                                     \
+                                                                                                 \
+		if (tid < batch_size) {                                                          \
+			cmd->cid = tid;                                                          \
+			nvme_qpair_cuda_pow2_##DEPTH##_enqueue_at_i(qp, cmd, tid);               \
+		}                                                                                \
+		__syncthreads();                                                                 \
+                                                                                                 \
+		if (tid == 0 && batch_size) {                                                    \
+			nvme_qpair_cuda_pow2_##DEPTH##_sq_update(qp, batch_size);                \
+		}                                                                                \
+                                                                                                 \
+		if (tid < batch_size) {                                                          \
+			err = nvme_qpair_cuda_pow2_##DEPTH##_reap_at_i(qp, qp->timeout_ms, &cpl, \
+								       tid);                     \
+		}                                                                                \
+		__syncthreads();                                                                 \
+                                                                                                 \
+		if (tid == 0 && batch_size) {                                                    \
+			nvme_qpair_cuda_pow2_##DEPTH##_cq_update(qp, batch_size);                \
+		}                                                                                \
+                                                                                                 \
+		if (err) {                                                                       \
+			return err;                                                              \
+		}                                                                                \
+                                                                                                 \
+		return (cpl.status & 0x1FE) >> 1;                                                \
+	}
+#else
+#define NVME_QPAIR_CUDA_POW2_DEFINE(DEPTH)
+#endif /* __CUDACC__ */
+
+
+/**
+ * Allocate a CID from the bitmap of free CIDs
+ *
+ * The search starts at a word given by the calling thread, to spread the threads over the bitmap.
+ *
+ * @return The CID on success, -EBUSY when all CIDs are in flight
+ */
+static inline __device__ int
+nvme_qpair_cuda_cid_alloc(struct nvme_qpair_cuda *qp)
+{
+#ifndef __CUDACC__
+	(void)qp;
+#else
+	const uint32_t nwords = (qp->depth - 1 + 31) / 32;
+	const uint32_t start = (blockIdx.x * blockDim.x + threadIdx.x) / 32;
+
+	for (uint32_t i = 0; i < nwords; ++i) {
+		const uint32_t w = (start + i) % nwords;
+		uint32_t word = *(volatile uint32_t *)&qp->cids[w];
+
+		while (word) {
+			const uint32_t bit = 1u << (__ffs(word) - 1);
+			const uint32_t prev = atomicAnd(&qp->cids[w], ~bit);
+
+			if (prev & bit) {
+				return w * 32 + __ffs(bit) - 1;
+			}
+			word = prev & ~bit;
+		}
+	}
+#endif /* __CUDACC__ */
+
+	return -EBUSY;
+}
+
+static inline __device__ void
+nvme_qpair_cuda_cid_free(struct nvme_qpair_cuda *qp, int cid)
+{
+#ifndef __CUDACC__
+	(void)qp; (void)cid;
+#else
+	atomicOr(&qp->cids[cid / 32], 1u << (cid % 32));
+#endif /* __CUDACC__ */
+}
+
+/**
+ * Submit a command, with a CID from nvme_qpair_cuda_cid_alloc(), via the shared submission path
+ *
+ * The lanes of the calling warp which submit together are aggregated: one elected lane reserves
+ * the SQ slots of all of them with a single atomicAdd, and writes the SQ doorbell once they are
+ * written. Allocating the CID upfront lets the caller set up per-CID state, such as a PRP list,
+ * see nvme_request_cuda_device.h, before submitting.
+ *
+ * @param qp Pointer to the NVMe queue pair to submit command to
+ * @param cmd Command to submit; `cid` will be assigned
+ * @param cid The CID of the command
+ *
+ * @return The CID; pass it to nvme_qpair_cuda_wait()
+ */
+static inline __device__ int
+nvme_qpair_cuda_submit_cid(struct nvme_qpair_cuda *qp, struct nvme_command *cmd, int cid)
+{
+	cmd->cid = cid;
+
+#ifndef __CUDACC__
+	(void)qp;
+#else
+	{
+		volatile uint32_t *dst;
+		const uint32_t *src = (const uint32_t *)cmd;
+		const unsigned mask = __activemask();
+		const int leader = __ffs(mask) - 1;
+		unsigned lanemask_lt;
+		unsigned long long base = 0;
+		unsigned rank, n;
+		uint32_t slot;
+
+		asm volatile("mov.u32 %0, %%lanemask_lt;" : "=r"(lanemask_lt));
+		rank = __popc(mask & lanemask_lt);
+		n = __popc(mask);
+
+		*(volatile uint32_t *)&qp->cpls[cid] = 0;
+
+		if (!rank) {
+			base = atomicAdd(&qp->sq_reserved, (unsigned long long)n);
+		}
+		base = __shfl_sync(mask, base, leader);
+
+		slot = (uint32_t)((base + rank) % qp->depth);
+		dst = (volatile uint32_t *)&((struct nvme_command *)qp->sq)[slot];
+		for (unsigned i = 0; i < sizeof(struct nvme_command) / sizeof(uint32_t); i++) {
+			dst[i] = src[i];
+		}
+		if (qp->trace) {
+			nvme_qpair_cuda_trace(qp, NVME_TRACE_SUBMIT, cmd->opc, cid, slot, cmd->nsid,
+					      ((uint64_t)cmd->cdw11 << 32) | cmd->cdw10);
+		}
+		__threadfence_system();
+		__syncwarp(mask);
+
+		// Ring the doorbell in reservation order, once the slots before 'base' are written
+		if (!rank) {
+			while (*(volatile unsigned long long *)&qp->sq_published != base) {
+				;
+			}
+			*(volatile uint32_t *)qp->sqdb = (uint32_t)((base + n) % qp->depth);
+			__threadfence_system();
+			atomicExch(&qp->sq_published, base + n);
+			if (qp->trace) {
+				nvme_qpair_cuda_trace(qp, NVME_TRACE_SQDB, 0, NVME_TRACE_CID_NONE,
+						      (uint16_t)((base + n) % qp->depth), 0, 0);
+			}
+		}
+	}
+#endif /* __CUDACC__ */
+
+	return cid;
+}
+
+/**
+ * Submit a command via the shared submission path
+ *
+ * Same as nvme_qpair_cuda_submit_cid(), with a CID allocated here.
+ *
+ * @param qp Pointer to the NVMe queue pair to submit command to
+ * @param cmd Command to submit; `cid` will be assigned
+ *
+ * @return The CID on success, -EBUSY when all CIDs are in flight
+ */
+static inline __device__ int
+nvme_qpair_cuda_submit(struct nvme_qpair_cuda *qp, struct nvme_command *cmd)
+{
+	int cid = nvme_qpair_cuda_cid_alloc(qp);
+
+	if (cid < 0) {
+		return cid;
+	}
+
+	return nvme_qpair_cuda_submit_cid(qp, cmd, cid);
+}
+
+/**
+ * Process the completions in the CQ, recording the status of each per CID
+ *
+ * Only one thread at a time processes completions; when another thread does, this returns
+ * immediately.
+ *
+ * @return The number of completions processed
+ */
+static inline __device__ int
+nvme_qpair_cuda_process_completions(struct nvme_qpair_cuda *qp)
+{
+	int n = 0;
+
+#ifndef __CUDACC__
+	(void)qp;
+#else
+	volatile struct nvme_completion *cq = (volatile struct nvme_completion *)qp->cq;
+	volatile uint16_t *head = &qp->head;
+	volatile uint8_t *phase = &qp->phase;
+
+	if (atomicCAS(&qp->cq_lock, 0, 1)) {
+		return 0;
+	}
+	__threadfence();
+
+	for (;;) {
+		volatile struct nvme_completion *cqe = &cq[*head];
+		uint16_t status = cqe->status;
+
+		if ((status & 0x1) != *phase) {
+			break;
+		}
+		atomicExch(&qp->cpls[cqe->cid], NVME_QPAIR_CUDA_CPL_DONE | status);
+		if (qp->trace) {
+			nvme_qpair_cuda_trace(qp, NVME_TRACE_CQE, 0, cqe->cid, status, 0,
+					      cqe->cdw0);
+		}
+
+		if (*head + 1 == qp->depth) {
+			*head = 0;
+			*phase ^= 1;
+		} else {
+			*head += 1;
+		}
+		n++;
+	}
+	if (n) {
+		*(volatile uint32_t *)qp->cqdb = *head;
+		if (qp->trace) {
+			nvme_qpair_cuda_trace(qp, NVME_TRACE_CQDB, 0, NVME_TRACE_CID_NONE, *head, 0,
+					      0);
+		}
+	}
+
+	__threadfence();
+	atomicExch(&qp->cq_lock, 0);
+#endif /* __CUDACC__ */
+
+	return n;
+}
+
+/**
+ * Wait for the completion of the command with the given CID, and release the CID
+ *
+ * @return 0 on success, -EAGAIN on timeout; in which case the CID is left allocated, as the
+ *         command is still owned by the controller. Positive values are NVMe status codes.
+ */
+static inline __device__ int
+nvme_qpair_cuda_wait(struct nvme_qpair_cuda *qp, int cid, int timeout_ms)
+{
+#ifndef __CUDACC__
+	(void)qp; (void)cid; (void)timeout_ms;
+#else
+	int64_t deadline = (int64_t)clock64() + (int64_t)timeout_ms * (int64_t)qp->clocks_per_ms;
+
+	do {
+		uint32_t cpl = *(volatile uint32_t *)&qp->cpls[cid];
+
+		if (cpl & NVME_QPAIR_CUDA_CPL_DONE) {
+			nvme_qpair_cuda_cid_free(qp, cid);
+			return (cpl & 0x1FE) >> 1;
+		}
+		nvme_qpair_cuda_process_completions(qp);
+	} while ((int64_t)clock64() < deadline);
+
+	if (qp->trace) {
+		nvme_qpair_cuda_trace(qp, NVME_TRACE_TIMEOUT, 0, cid, qp->head, 0, 0);
+	}
+#endif /* __CUDACC__ */
+
+	return -EAGAIN;
+}
+
+/**
+ * Allocate a CID, processing completions while all CIDs are in flight, until the command timeout
+ *
+ * @return The CID on success, -EBUSY on timeout
+ */
+static inline __device__ int
+nvme_qpair_cuda_cid_get(struct nvme_qpair_cuda *qp)
+{
+	int cid = nvme_qpair_cuda_cid_alloc(qp);
+
+#ifdef __CUDACC__
+	if (cid == -EBUSY) {
+		int64_t deadline = (int64_t)clock64() +
+				   (int64_t)qp->timeout_ms * (int64_t)qp->clocks_per_ms;
+
+		do {
+			nvme_qpair_cuda_process_completions(qp);
+			cid = nvme_qpair_cuda_cid_alloc(qp);
+		} while (cid == -EBUSY && (int64_t)clock64() < deadline);
+	}
+#endif /* __CUDACC__ */
+
+	return cid;
+}
+
+/**
+ * Submit IO and reap its completion via the shared submission path
+ *
+ * Unlike nvme_qpair_cuda_io(), there are no barriers nor any requirements on the grid shape: any
+ * thread may call this, on any queue, at any time, and the queue is kept at up to depth - 1
+ * commands in flight. When all CIDs are in flight, then completions are processed until one is
+ * released, or the timeout expires.
+ *
+ * @param qp Pointer to the NVMe queue pair to submit command to
+ * @param cmd Command to submit
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are NVMe
+ *         status codes.
+ */
+static inline __device__ int
+nvme_qpair_cuda_io_shared(struct nvme_qpair_cuda *qp, struct nvme_command *cmd)
+{
+	int cid = nvme_qpair_cuda_cid_get(qp);
+
+	if (cid < 0) {
+		return cid;
+	}
+	nvme_qpair_cuda_submit_cid(qp, cmd, cid);
+
+	return nvme_qpair_cuda_wait(qp, cid, qp->timeout_ms);
+}
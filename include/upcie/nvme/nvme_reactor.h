@@ -0,0 +1,347 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Single-threaded polling reactor over many qpairs
+ * ================================================
+ *
+ * A 'struct nvme_reactor' lets a single thread drive the qpairs of any number of controllers,
+ * instead of waiting on one qpair at a time, e.g. in nvme_qpair_reap_cpl(). Each iteration of
+ * nvme_reactor_poll() does the following:
+ *
+ * - Checks the phase bit of the next CQ entry of every qpair registered, prefetching that of the
+ *   next qpair, and processes the completions of those which have any; the callbacks are invoked
+ *   on the thread of the reactor, and may submit, via nvme_qpair_enqueue(), without writing the
+ *   doorbell.
+ * - Writes the SQ doorbell of every qpair whose tail moved, once.
+ * - Checks the deadlines of the commands of idle qpairs; see nvme_qpair_set_timeout().
+ * - Runs the pollers, SPDK-style: those of period 0 on every iteration, those with a period, i.e.
+ *   timers, once it has passed.
+ *
+ * The qpairs are polled in order of activity: each has a score, a moving average of its
+ * completions per iteration, and every NVME_REACTOR_REORDER iterations the qpairs are sorted by
+ * score, thus, the busiest CQs are checked first, and their entries are the ones kept in cache.
+ *
+ * nvme_reactor_run() iterates until nvme_reactor_stop() is called, e.g. by a callback, or a
+ * poller. The reactor, and the qpairs registered, are single-threaded; they are used by the thread
+ * of the reactor alone while registered.
+ *
+ * @file nvme_reactor.h
+ * @version 0.4.4
+ */
+
+#define NVME_REACTOR_QPAIRS_MAX 64
+#define NVME_REACTOR_POLLERS_MAX 32
+#define NVME_REACTOR_REORDER 1024 ///< Iterations between sorting the qpairs by score
+
+/**
+ * A poller, or a timer; returns the amount of work done, 0 when idle, or negative errno to stop
+ */
+typedef int (*nvme_reactor_fn)(void *arg);
+
+struct nvme_reactor_qpair {
+	struct nvme_qpair *qp;
+	uint32_t score;   ///< Moving average of completions per iteration, in 1/256
+	uint64_t nreaped; ///< Completions processed by the reactor
+};
+
+struct nvme_reactor_poller {
+	nvme_reactor_fn fn; ///< NULL when the slot is free
+	void *arg;          ///< Passed on to 'fn'
+	uint64_t period;    ///< tsc_read() ticks between invocations; 0: every iteration
+	uint64_t next;      ///< tsc_read() tick of the next invocation of a timer
+	uint64_t ncalls;    ///< Number of invocations
+};
+
+struct nvme_reactor {
+	struct nvme_reactor_qpair qps[NVME_REACTOR_QPAIRS_MAX]; ///< Sorted by score, busiest first
+	uint32_t nqps;
+	uint32_t npollers; ///< Slots of 'pollers' in use, free slots included
+	struct nvme_reactor_poller pollers[NVME_REACTOR_POLLERS_MAX];
+
+	int stop;         ///< Set by nvme_reactor_stop(); ends nvme_reactor_run()
+	int err;          ///< Error of the poller which stopped the reactor; 0 otherwise
+	uint64_t niters;  ///< Iterations of nvme_reactor_poll()
+	uint64_t nidle;   ///< Iterations without any completions nor work of pollers
+	uint64_t nreaped; ///< Completions processed
+};
+
+static inline int
+nvme_reactor_pr(struct nvme_reactor *reactor)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_reactor:\n");
+	wrtn += printf("  niters: %" PRIu64 "\n", reactor->niters);
+	wrtn += printf("  nidle: %" PRIu64 "\n", reactor->nidle);
+	wrtn += printf("  nreaped: %" PRIu64 "\n", reactor->nreaped);
+	wrtn += printf("  qpairs:\n");
+	for (uint32_t i = 0; i < reactor->nqps; ++i) {
+		struct nvme_reactor_qpair *rqp = &reactor->qps[i];
+
+		wrtn += printf("  - {qid: %" PRIu32 ", score: %" PRIu32 ", nreaped: %" PRIu64 "}\n",
+			       rqp->qp->qid, rqp->score, rqp->nreaped);
+	}
+	wrtn += printf("  pollers:\n");
+	for (uint32_t i = 0; i < reactor->npollers; ++i) {
+		struct nvme_reactor_poller *poller = &reactor->pollers[i];
+
+		if (!poller->fn) {
+			continue;
+		}
+		wrtn += printf("  - {id: %" PRIu32 ", period: %" PRIu64 ", ncalls: %" PRIu64 "}\n",
+			       i, poller->period, poller->ncalls);
+	}
+
+	return wrtn;
+}
+
+static inline void
+nvme_reactor_init(struct nvme_reactor *reactor)
+{
+	memset(reactor, 0, sizeof(*reactor));
+}
+
+/**
+ * Register a qpair, of any controller, with the reactor
+ *
+ * @return On success 0 is returned. When NVME_REACTOR_QPAIRS_MAX qpairs are registered, -ENOSPC
+ *         is returned, and -EEXIST when the qpair is registered already.
+ */
+static inline int
+nvme_reactor_add(struct nvme_reactor *reactor, struct nvme_qpair *qp)
+{
+	for (uint32_t i = 0; i < reactor->nqps; ++i) {
+		if (reactor->qps[i].qp == qp) {
+			return -EEXIST;
+		}
+	}
+	if (reactor->nqps == NVME_REACTOR_QPAIRS_MAX) {
+		return -ENOSPC;
+	}
+
+	reactor->qps[reactor->nqps].qp = qp;
+	reactor->qps[reactor->nqps].score = 0;
+	reactor->qps[reactor->nqps].nreaped = 0;
+	reactor->nqps++;
+
+	return 0;
+}
+
+/**
+ * Unregister a qpair; e.g. before deleting it. Not to be called by callbacks, nor pollers
+ */
+static inline void
+nvme_reactor_remove(struct nvme_reactor *reactor, struct nvme_qpair *qp)
+{
+	for (uint32_t i = 0; i < reactor->nqps; ++i) {
+		if (reactor->qps[i].qp == qp) {
+			memmove(&reactor->qps[i], &reactor->qps[i + 1],
+				(reactor->nqps - i - 1) * sizeof(reactor->qps[0]));
+			reactor->nqps--;
+			return;
+		}
+	}
+}
+
+/**
+ * Register a poller, invoked on every iteration when `period_us` is 0, otherwise every `period_us`
+ *
+ * @return On success the id of the poller, for nvme_reactor_poller_remove(), is returned. When
+ *         NVME_REACTOR_POLLERS_MAX pollers are registered, -ENOSPC is returned.
+ */
+static inline int
+nvme_reactor_poller_add(struct nvme_reactor *reactor, nvme_reactor_fn fn, void *arg,
+			uint64_t period_us)
+{
+	struct nvme_reactor_poller *poller;
+	uint32_t id;
+
+	if (!fn) {
+		return -EINVAL;
+	}
+
+	for (id = 0; id < reactor->npollers; ++id) {
+		if (!reactor->pollers[id].fn) {
+			break;
+		}
+	}
+	if (id == NVME_REACTOR_POLLERS_MAX) {
+		return -ENOSPC;
+	}
+
+	poller = &reactor->pollers[id];
+	poller->fn = fn;
+	poller->arg = arg;
+	poller->period = period_us ? tsc_from_us(period_us) : 0;
+	poller->next = tsc_read() + poller->period;
+	poller->ncalls = 0;
+	if (id == reactor->npollers) {
+		reactor->npollers++;
+	}
+
+	return id;
+}
+
+/**
+ * Unregister the poller of the given `id`; may be called by the poller itself
+ */
+static inline void
+nvme_reactor_poller_remove(struct nvme_reactor *reactor, int id)
+{
+	if (id < 0 || (uint32_t)id >= reactor->npollers) {
+		return;
+	}
+
+	reactor->pollers[id].fn = NULL;
+	while (reactor->npollers && !reactor->pollers[reactor->npollers - 1].fn) {
+		reactor->npollers--;
+	}
+}
+
+/**
+ * Make nvme_reactor_run() return after the current iteration
+ */
+static inline void
+nvme_reactor_stop(struct nvme_reactor *reactor)
+{
+	reactor->stop = 1;
+}
+
+/**
+ * Returns the next CQ entry of the qpair, that of the shared CQ when it has one
+ */
+static inline volatile struct nvme_completion *
+nvme_reactor_cqe(struct nvme_qpair *qp, uint8_t *phase)
+{
+	if (qp->shcq) {
+		*phase = qp->shcq->phase;
+		return &((volatile struct nvme_completion *)qp->shcq->cq)[qp->shcq->head];
+	}
+	*phase = qp->phase;
+
+	return &((volatile struct nvme_completion *)qp->cq)[qp->head];
+}
+
+/**
+ * Sort the qpairs by score, busiest first; insertion sort, as the order changes little
+ */
+static inline void
+nvme_reactor_reorder(struct nvme_reactor *reactor)
+{
+	for (uint32_t i = 1; i < reactor->nqps; ++i) {
+		struct nvme_reactor_qpair rqp = reactor->qps[i];
+		uint32_t j = i;
+
+		while (j && reactor->qps[j - 1].score < rqp.score) {
+			reactor->qps[j] = reactor->qps[j - 1];
+			j--;
+		}
+		reactor->qps[j] = rqp;
+	}
+}
+
+/**
+ * Run a single iteration: completions, doorbells, deadlines, and pollers; see above
+ *
+ * @return The number of completions processed, plus the work reported by the pollers. When a
+ *         poller returns negative errno, then the reactor is stopped, and the error returned.
+ */
+static inline int
+nvme_reactor_poll(struct nvme_reactor *reactor)
+{
+	uint32_t nqps = reactor->nqps;
+	uint64_t now;
+	int nwork = 0;
+
+	for (uint32_t i = 0; i < nqps; ++i) {
+		struct nvme_reactor_qpair *rqp = &reactor->qps[i];
+		volatile struct nvme_completion *cqe;
+		uint8_t phase;
+		int nreaped = 0;
+
+		if (i + 1 < nqps) {
+			uint8_t next_phase;
+			const volatile void *next;
+
+			next = nvme_reactor_cqe(reactor->qps[i + 1].qp, &next_phase);
+			__builtin_prefetch((const void *)next);
+		}
+
+		cqe = nvme_reactor_cqe(rqp->qp, &phase);
+		if ((cqe->status & 0x1) == phase) {
+			nreaped = nvme_qpair_process_completions(rqp->qp, 0);
+			rqp->nreaped += nreaped;
+			nwork += nreaped;
+		}
+		rqp->score = rqp->score - (rqp->score >> 4) + ((uint32_t)nreaped << 4);
+	}
+	reactor->nreaped += nwork;
+
+	// Doorbells of the commands enqueued by callbacks, and by pollers of the previous iteration
+	now = tsc_read();
+	for (uint32_t i = 0; i < nqps; ++i) {
+		struct nvme_qpair *qp = reactor->qps[i].qp;
+
+		nvme_qpair_sqdb_update(qp);
+		if (qp->rpool->timer.narmed && now >= qp->expire_next) {
+			nvme_qpair_expire(qp);
+		}
+	}
+
+	for (uint32_t id = 0; id < reactor->npollers; ++id) {
+		struct nvme_reactor_poller *poller = &reactor->pollers[id];
+		int ret;
+
+		if (!poller->fn || (poller->period && now < poller->next)) {
+			continue;
+		}
+		if (poller->period) {
+			poller->next = now + poller->period;
+		}
+		poller->ncalls++;
+
+		ret = poller->fn(poller->arg);
+		if (ret < 0) {
+			reactor->err = ret;
+			reactor->stop = 1;
+			return ret;
+		}
+		nwork += ret;
+	}
+
+	reactor->niters++;
+	if (!nwork) {
+		reactor->nidle++;
+	}
+	if (!(reactor->niters % NVME_REACTOR_REORDER)) {
+		nvme_reactor_reorder(reactor);
+	}
+
+	return nwork;
+}
+
+/**
+ * Iterate until nvme_reactor_stop() is called; the doorbells are flushed before returning
+ *
+ * @return 0 when stopped by nvme_reactor_stop(). When stopped by a poller returning negative
+ *         errno, then that is returned.
+ */
+static inline int
+nvme_reactor_run(struct nvme_reactor *reactor)
+{
+	reactor->stop = 0;
+	reactor->err = 0;
+
+	while (!reactor->stop) {
+		if (!nvme_reactor_poll(reactor)) {
+			cpu_relax();
+		}
+	}
+
+	for (uint32_t i = 0; i < reactor->nqps; ++i) {
+		nvme_qpair_sqdb_update(reactor->qps[i].qp);
+	}
+
+	return reactor->err;
+}
@@ -9,6 +9,10 @@
  * in user space. The abstraction uses a fixed-size pool of `struct nvme_request`, each assigned a
  * CID, along with a freelist-based allocator for constant-time allocation and release.
  *
+ * The freelists of cids and of PRP-list pages are lock-free, thus, requests can be allocated,
+ * prepared, and freed by multiple threads concurrently, e.g. by the producers of a
+ * 'struct nvme_mpsc'. A single request is still only to be used by one thread at a time.
+ *
  * This is not part of the NVMe specification, but is useful for tracking user-submitted commands
  * while they are in flight and associating user-defined metadata with each command.
  *
@@ -17,74 +21,571 @@
  *
  * assert() is used here. thus instead of a segfault, you will get a nice message like::
  *
- *   nvme_request_get: Assertion `cid < NVME_REQUEST_POOL_LEN' failed.
+ *   nvme_request_get: Assertion `cid < pool->len' failed.
  *
  * Of course, this comes at a cost, so, make sure e.g. meson disables assert on release builds.
  *
- * The stack implementation has an upper-bound of NVME_REQUEST_POOL_LEN elements.
+ * The number of requests in a pool is given at nvme_request_pool_init(); a qpair uses its depth.
+ *
+ * Payload description
+ * -------------------
+ *
+ * The data buffer of a command is described either by PRPs, via the
+ * nvme_request_prep_command_prps_*() helpers, or by SGLs, via the
+ * nvme_request_prep_command_sgl_*() helpers. The SGL helpers require that the controller supports
+ * SGLs, as advertised by nvme_controller->sgls, and emit a single data block descriptor per
+ * physically contiguous extent, rather than an entry per page, and have no alignment requirements
+ * on the buffers. With both schemes, when a list is needed, then a page is taken from the pages
+ * shared by the pool, and made available as request->prp; the page is returned to the pool by
+ * nvme_request_free(), or when the request is prepared again. A separate metadata buffer, see
+ * nvme_pi.h, is described by the MPTR of the command, via nvme_request_prep_command_mptr().
+ *
+ * Deadlines
+ * ---------
+ *
+ * A request in flight can be given a deadline, via nvme_request_timer_arm(), which inserts it into
+ * the timer wheel of its pool: an array of NVME_REQUEST_TIMER_NSLOTS lists of requests, a slot per
+ * 'tick' of time, where a request is in the slot of its deadline, modulo the number of slots.
+ * Arming and disarming is constant-time, and nvme_request_timer_expire() only visits the slots of
+ * the ticks which have passed since it was last called, thus, checking often is cheap. A request
+ * is disarmed when freed. The wheel is not thread-safe; requests are armed, expired, and freed,
+ * once armed, by the thread driving the qpair. The qpair arms commands as they are enqueued, see
+ * nvme_qpair_set_timeout().
  *
  * @file nvme_request.h
  * @version 0.4.4
  */
 
 #define NVME_REQUEST_POOL_LEN 1024
+#define NVME_REQUEST_POOL_PAGES 64
+#define NVME_REQUEST_V2P_BATCH 64 ///< Pages translated per call to hostmem_dma_v2p_batch()
+#define NVME_REQUEST_FREELIST_NONE UINT16_MAX
+#define NVME_REQUEST_PAGE_NONE NVME_REQUEST_FREELIST_NONE
+#define NVME_REQUEST_SLOT_NONE NVME_REQUEST_FREELIST_NONE
+#define NVME_REQUEST_TIMER_NSLOTS 256 ///< Slots of the timer wheel; a power of two
+#define NVME_REQUEST_TIMER_SPAN 64    ///< Slots spanned by the timeout of the wheel
+
+struct nvme_request_pool;
+
+/**
+ * A lock-free freelist of 16-bit indices, e.g. cids or page-indices
+ *
+ * This is a Treiber-stack over the 'next' array, the head carries a tag, which is incremented on
+ * every update, to make the compare-and-swap immune to ABA. Any number of threads may push and
+ * pop concurrently.
+ */
+struct nvme_request_freelist {
+	uint64_t head;  ///< Tag in bits 63:32, index of the first free entry in bits 15:0
+	uint16_t *next; ///< Link of each entry
+};
+
+static inline void
+nvme_request_freelist_push(struct nvme_request_freelist *freelist, uint16_t idx)
+{
+	uint64_t head = __atomic_load_n(&freelist->head, __ATOMIC_RELAXED);
+	uint64_t desired;
+
+	do {
+		__atomic_store_n(&freelist->next[idx], (uint16_t)(head & 0xFFFF), __ATOMIC_RELAXED);
+		desired = ((((head >> 32) + 1) & 0xFFFFFFFF) << 32) | idx;
+	} while (!__atomic_compare_exchange_n(&freelist->head, &head, desired, 1, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/**
+ * Pop an index from the freelist
+ *
+ * @return The index, or NVME_REQUEST_FREELIST_NONE when the freelist is empty
+ */
+static inline uint16_t
+nvme_request_freelist_pop(struct nvme_request_freelist *freelist)
+{
+	uint64_t head = __atomic_load_n(&freelist->head, __ATOMIC_ACQUIRE);
+	uint64_t desired;
+	uint16_t idx;
+
+	do {
+		idx = head & 0xFFFF;
+		if (idx == NVME_REQUEST_FREELIST_NONE) {
+			return NVME_REQUEST_FREELIST_NONE;
+		}
+		desired = ((((head >> 32) + 1) & 0xFFFFFFFF) << 32) |
+			  __atomic_load_n(&freelist->next[idx], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&freelist->head, &head, desired, 1, __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+
+	return idx;
+}
+
+/**
+ * Initialize the freelist with the indices [0, len-1], popped in increasing order
+ */
+static inline void
+nvme_request_freelist_init(struct nvme_request_freelist *freelist, uint16_t *next, uint16_t len)
+{
+	freelist->next = next;
+	for (uint16_t i = 0; i < len; ++i) {
+		next[i] = (i + 1 < len) ? i + 1 : NVME_REQUEST_FREELIST_NONE;
+	}
+	freelist->head = len ? 0 : NVME_REQUEST_FREELIST_NONE;
+}
+
+/**
+ * Completion callback as invoked by nvme_qpair_process_completions()
+ *
+ * @param cpl The completion of the command, valid only for the duration of the callback
+ * @param user The opaque pointer given to nvme_qpair_submit_async()
+ */
+typedef void (*nvme_request_cb)(struct nvme_completion *cpl, void *user);
 
 struct nvme_request {
-	uint16_t cid; ///< The NVMe command identifier
-	uint8_t rsvd[6];
+	uint16_t cid;  ///< The NVMe command identifier
+	uint16_t page; ///< Last list-page taken from the pool; NVME_REQUEST_PAGE_NONE when none
+	uint16_t slot; ///< SQ slot last enqueued at; NVME_REQUEST_SLOT_NONE when not enqueued
+	uint16_t tnext; ///< Next request in the slot of the timer wheel; NVME_REQUEST_FREELIST_NONE
+	uint16_t tprev; ///< Previous request in the slot of the timer wheel
+	uint8_t nexpired; ///< Number of times the deadline expired while in flight
+	uint8_t rsvd[3];
+	uint64_t deadline; ///< tsc_read() tick by which the command must complete; 0 when not armed
+
+	void *user;         ///< An arbitrary pointer for caller to pass on to completion
+	nvme_request_cb cb; ///< Completion callback; used by the asynchronous submission path
+	uint64_t prp_addr;  ///< Use this when constructing command.PRP2
+	void *prp;          ///< The PRP-list itself; NULL until nvme_request_prp_acquire()
+
+	struct nvme_request_pool *pool; ///< The pool that the request belongs to
 
-	void *user;        ///< An arbitrary pointer for caller to pass on to completion
-	uint64_t prp_addr; ///< Use this when constructing command.PRP2
-	void *prp;         ///< Use this when constructing the PRP-list itself
+#ifdef UPCIE_TELEMETRY_ENABLED
+	uint64_t submitted; ///< tsc_read() at enqueue of the command; 0 when not in flight
+#endif
+};
+
+/**
+ * Timer wheel of the requests with a deadline; see "Deadlines" above
+ */
+struct nvme_request_timer {
+	uint16_t slots[NVME_REQUEST_TIMER_NSLOTS]; ///< First request of each slot
+	uint64_t timeout; ///< Default deadline, relative to enqueue, in ticks; 0 when disabled
+	uint64_t tick;    ///< Length of a slot in tsc_read() ticks
+	uint64_t cursor;  ///< The tick up to which the slots are expired
+	uint32_t narmed;  ///< Number of requests armed
 };
 
 struct nvme_request_pool {
-	struct nvme_request reqs[NVME_REQUEST_POOL_LEN];
-	uint16_t stack[NVME_REQUEST_POOL_LEN];
-	size_t top;
-	void *prps; ///< Pointer to pre-allocated memory directly mapped to each reqs.
+	struct nvme_request *reqs;         ///< Array of 'len' requests
+	struct nvme_request_freelist cids; ///< Free cids; links in 'cid_next'
+	uint16_t *cid_next;
+	uint16_t len; ///< Number of requests, that is, the cids are [0, len-1]
+
+	void *pages;                        ///< Pre-allocated PRP-list pages shared by all reqs
+	size_t pagesize;                    ///< Size of each page in 'pages'
+	uint16_t npages;                    ///< Number of pages in 'pages'
+	struct nvme_request_freelist pfree; ///< Free pages; links in 'page_next'
+	uint16_t *page_next;  ///< Links of the freelist and of the per-request lists
+	uint64_t *page_addrs; ///< Physical address of each page
+	struct nvme_cmb *cmb; ///< The CMB holding 'pages'; NULL when allocated from a heap
+
+	struct nvme_request_timer timer; ///< Deadlines of the requests in flight
 };
 
 /**
- * Initialize a request-pool
+ * Free the memory allocated by nvme_request_pool_init()
+ */
+static inline void
+nvme_request_pool_term(struct nvme_request_pool *pool)
+{
+	free(pool->reqs);
+	free(pool->cid_next);
+	pool->reqs = NULL;
+	pool->cid_next = NULL;
+	pool->len = 0;
+}
+
+/**
+ * Initialize a request-pool of 'len' requests
  *
  * When intending to use PRPs associated with the commands, then also use:
  *
  * - nvme_request_pool_{init,term}_prps()
+ *
+ * @param pool The pool to initialize
+ * @param len Number of requests; when 0, NVME_REQUEST_POOL_LEN is used
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
  */
-static inline void
-nvme_request_pool_init(struct nvme_request_pool *pool)
+static inline int
+nvme_request_pool_init(struct nvme_request_pool *pool, uint16_t len)
 {
-	pool->top = NVME_REQUEST_POOL_LEN;
-	for (uint16_t i = 0; i < NVME_REQUEST_POOL_LEN; ++i) {
+	len = len ? len : NVME_REQUEST_POOL_LEN;
+
+	pool->reqs = calloc(len, sizeof(*pool->reqs));
+	pool->cid_next = calloc(len, sizeof(*pool->cid_next));
+	if (!pool->reqs || !pool->cid_next) {
+		UPCIE_DEBUG("FAILED: calloc(reqs/cid_next); errno(%d)", errno);
+		nvme_request_pool_term(pool);
+		return -ENOMEM;
+	}
+
+	pool->len = len;
+	for (uint16_t i = 0; i < len; ++i) {
 		pool->reqs[i].cid = i;
-		pool->stack[NVME_REQUEST_POOL_LEN - 1 - i] = i;
+		pool->reqs[i].page = NVME_REQUEST_PAGE_NONE;
+		pool->reqs[i].slot = NVME_REQUEST_SLOT_NONE;
+		pool->reqs[i].tnext = NVME_REQUEST_FREELIST_NONE;
+		pool->reqs[i].tprev = NVME_REQUEST_FREELIST_NONE;
+		pool->reqs[i].pool = pool;
 	}
+	memset(&pool->timer, 0, sizeof(pool->timer));
+	for (uint32_t i = 0; i < NVME_REQUEST_TIMER_NSLOTS; ++i) {
+		pool->timer.slots[i] = NVME_REQUEST_FREELIST_NONE;
+	}
+	nvme_request_freelist_init(&pool->cids, pool->cid_next, len);
+	nvme_request_freelist_init(&pool->pfree, NULL, 0);
+
+	return 0;
 }
 
 static inline void
 nvme_request_pool_term_prps(struct nvme_request_pool *pool, struct hostmem_heap *heap)
 {
-	hostmem_dma_free(heap, pool->prps);
+	if (pool->pages && pool->cmb) {
+		nvme_cmb_free(pool->cmb, pool->pages, (size_t)pool->npages * pool->pagesize);
+	} else if (pool->pages) {
+		hostmem_dma_free(heap, pool->pages);
+	}
+	free(pool->page_next);
+	free(pool->page_addrs);
+
+	pool->pages = NULL;
+	pool->page_next = NULL;
+	pool->page_addrs = NULL;
+	pool->npages = 0;
+	pool->cmb = NULL;
+	nvme_request_freelist_init(&pool->pfree, NULL, 0);
+}
+
+/**
+ * Allocate the PRP-list pages of the pool
+ *
+ * The pages are shared by the requests of the pool: a request takes a page when a command needs
+ * a PRP-list, or SGL segment, and returns it upon nvme_request_free(). Thus, commands of one or two
+ * pages, and commands described by a single SGL descriptor, consume no pages.
+ *
+ * @param pool The pool, initialized with nvme_request_pool_init()
+ * @param heap The heap to allocate the pages from
+ * @param npages Number of pages; when 0, the smaller of pool->len and NVME_REQUEST_POOL_PAGES
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_request_pool_init_prps(struct nvme_request_pool *pool, struct hostmem_heap *heap,
+			    uint16_t npages)
+{
+	if (!npages) {
+		npages = pool->len < NVME_REQUEST_POOL_PAGES ? pool->len : NVME_REQUEST_POOL_PAGES;
+	}
+	if (npages == NVME_REQUEST_PAGE_NONE) {
+		return -EINVAL;
+	}
+
+	pool->pagesize = heap->config->pagesize;
+	pool->cmb = NULL;
+	pool->page_next = calloc(npages, sizeof(*pool->page_next));
+	pool->page_addrs = calloc(npages, sizeof(*pool->page_addrs));
+	pool->pages = hostmem_dma_alloc_array(heap, npages, pool->pagesize);
+	if (!pool->page_next || !pool->page_addrs || !pool->pages) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(pages); errno(%d)", errno);
+		nvme_request_pool_term_prps(pool, heap);
+		return -ENOMEM;
+	}
+
+	for (uint16_t i = 0; i < npages; ++i) {
+		void *page = ((uint8_t *)pool->pages) + (i * pool->pagesize);
+
+		pool->page_addrs[i] = hostmem_dma_v2p(heap, page);
+	}
+	pool->npages = npages;
+	nvme_request_freelist_init(&pool->pfree, pool->page_next, npages);
+
+	return 0;
 }
 
+/**
+ * Allocate the PRP-list pages of the pool in the Controller Memory Buffer
+ *
+ * Same as nvme_request_pool_init_prps(), with the pages in the CMB, thus, the controller reads
+ * the lists from its own memory. The page size is that of the CMB allocator. Terminate with
+ * nvme_request_pool_term_prps(), the heap given to it is then not used.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
 static inline int
-nvme_request_pool_init_prps(struct nvme_request_pool *pool, struct hostmem_heap *heap)
+nvme_request_pool_init_prps_cmb(struct nvme_request_pool *pool, struct nvme_cmb *cmb,
+				uint16_t npages)
 {
-	pool->prps = hostmem_dma_alloc_array(heap, NVME_REQUEST_POOL_LEN, heap->config->pagesize);
-	if (!pool->prps) {
-		UPCIE_DEBUG("FAILED: hostmem_dma_alloc_array(prps); errno(%d)", errno);
+	if (!npages) {
+		npages = pool->len < NVME_REQUEST_POOL_PAGES ? pool->len : NVME_REQUEST_POOL_PAGES;
+	}
+	if (npages == NVME_REQUEST_PAGE_NONE) {
+		return -EINVAL;
+	}
+
+	pool->pagesize = cmb->pagesize;
+	pool->page_next = calloc(npages, sizeof(*pool->page_next));
+	pool->page_addrs = calloc(npages, sizeof(*pool->page_addrs));
+	pool->pages = nvme_cmb_alloc(cmb, (size_t)npages * pool->pagesize);
+	pool->cmb = cmb;
+	pool->npages = npages;
+	if (!pool->page_next || !pool->page_addrs || !pool->pages) {
+		UPCIE_DEBUG("FAILED: nvme_cmb_alloc(pages); errno(%d)", errno);
+		nvme_request_pool_term_prps(pool, NULL);
 		return -ENOMEM;
 	}
 
-	for (uint16_t i = 0; i < NVME_REQUEST_POOL_LEN; ++i) {
-		pool->reqs[i].prp = ((uint8_t *)pool->prps) + (i * heap->config->pagesize);
-		pool->reqs[i].prp_addr = hostmem_dma_v2p(heap, pool->reqs[i].prp);
+	for (uint16_t i = 0; i < npages; ++i) {
+		void *page = ((uint8_t *)pool->pages) + (i * pool->pagesize);
+
+		pool->page_addrs[i] = nvme_cmb_v2p(cmb, page);
 	}
+	nvme_request_freelist_init(&pool->pfree, pool->page_next, npages);
 
 	return 0;
 }
 
+/**
+ * Return the PRP-list pages of the given request to the pool
+ */
+static inline void
+nvme_request_pages_release(struct nvme_request *request)
+{
+	struct nvme_request_pool *pool = request->pool;
+
+	while (request->page != NVME_REQUEST_PAGE_NONE) {
+		uint16_t idx = request->page;
+
+		request->page = pool->page_next[idx];
+		nvme_request_freelist_push(&pool->pfree, idx);
+	}
+	request->prp = NULL;
+	request->prp_addr = 0;
+}
+
+/**
+ * Take a PRP-list page from the pool and attach it to the given request
+ *
+ * @return On success, a pointer to the page is returned and `addr` is set to its physical
+ *         address. On error, NULL is returned and errno set to indicate the error.
+ */
+static inline uint64_t *
+nvme_request_page_alloc(struct nvme_request *request, uint64_t *addr)
+{
+	struct nvme_request_pool *pool = request->pool;
+	uint16_t idx = nvme_request_freelist_pop(&pool->pfree);
+
+	if (idx == NVME_REQUEST_PAGE_NONE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->page_next[idx] = request->page;
+	request->page = idx;
+
+	*addr = pool->page_addrs[idx];
+
+	return (uint64_t *)(((uint8_t *)pool->pages) + (idx * pool->pagesize));
+}
+
+/**
+ * Ensure that request->prp and request->prp_addr refer to a PRP-list page
+ *
+ * @return On success 0 is returned. When the pool has no free pages, then -ENOMEM is returned.
+ */
+static inline int
+nvme_request_prp_acquire(struct nvme_request *request)
+{
+	if (request->prp) {
+		return 0;
+	}
+
+	request->prp = nvme_request_page_alloc(request, &request->prp_addr);
+	if (!request->prp) {
+		UPCIE_DEBUG("FAILED: nvme_request_page_alloc(); errno(%d)", errno);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * State for writing the entries of a PRP-list, chaining list-pages as needed
+ */
+struct nvme_request_prp_writer {
+	struct nvme_request *request;
+	uint64_t *list;   ///< The list-page currently written to
+	size_t idx;       ///< Index of the next entry in 'list'
+	size_t nentries;  ///< Number of entries per list-page
+	size_t remaining; ///< Number of entries yet to be written
+};
+
+static inline void
+nvme_request_prp_writer_init(struct nvme_request_prp_writer *writer, struct nvme_request *request,
+			     uint64_t *list, size_t pagesize, size_t nentries)
+{
+	writer->request = request;
+	writer->list = list;
+	writer->idx = 0;
+	writer->nentries = pagesize / sizeof(uint64_t);
+	writer->remaining = nentries;
+}
+
+/**
+ * Write a PRP entry; when filling the last entry of a list-page, and more entries follow, then the
+ * last entry instead points to a chained list-page, and the entry is written there.
+ */
+static inline int
+nvme_request_prp_writer_push(struct nvme_request_prp_writer *writer, uint64_t entry)
+{
+	if ((writer->idx == writer->nentries - 1) && (writer->remaining > 1)) {
+		uint64_t addr;
+		uint64_t *next = nvme_request_page_alloc(writer->request, &addr);
+
+		if (!next) {
+			UPCIE_DEBUG("FAILED: nvme_request_page_alloc(); errno(%d)", errno);
+			return -ENOMEM;
+		}
+		writer->list[writer->idx] = addr;
+		writer->list = next;
+		writer->idx = 0;
+	}
+
+	writer->list[writer->idx++] = entry;
+	writer->remaining--;
+
+	return 0;
+}
+
+/**
+ * Enable the timer wheel of the pool with a default `timeout`, in ticks; 0 disables it
+ *
+ * The slots are sized such that the timeout spans NVME_REQUEST_TIMER_SPAN slots, thus, a deadline
+ * expires at most a slot late. Requests already armed must be disarmed before the timeout changes.
+ */
+static inline void
+nvme_request_timer_setup(struct nvme_request_pool *pool, uint64_t timeout, uint64_t now)
+{
+	struct nvme_request_timer *timer = &pool->timer;
+
+	timer->timeout = timeout;
+	timer->tick = timeout / NVME_REQUEST_TIMER_SPAN;
+	timer->tick = timer->tick ? timer->tick : 1;
+	timer->cursor = now / timer->tick;
+}
+
+static inline void
+nvme_request_timer_disarm(struct nvme_request_pool *pool, struct nvme_request *req)
+{
+	struct nvme_request_timer *timer = &pool->timer;
+
+	if (!req->deadline) {
+		return;
+	}
+
+	if (req->tprev != NVME_REQUEST_FREELIST_NONE) {
+		pool->reqs[req->tprev].tnext = req->tnext;
+	} else {
+		uint64_t slot = (req->deadline / timer->tick) % NVME_REQUEST_TIMER_NSLOTS;
+
+		timer->slots[slot] = req->tnext;
+	}
+	if (req->tnext != NVME_REQUEST_FREELIST_NONE) {
+		pool->reqs[req->tnext].tprev = req->tprev;
+	}
+
+	req->tnext = NVME_REQUEST_FREELIST_NONE;
+	req->tprev = NVME_REQUEST_FREELIST_NONE;
+	req->deadline = 0;
+	timer->narmed--;
+}
+
+/**
+ * Insert the request into the timer wheel with the given `deadline`, re-arming it when armed
+ *
+ * The timer wheel must be set up via nvme_request_timer_setup().
+ */
+static inline void
+nvme_request_timer_arm(struct nvme_request_pool *pool, struct nvme_request *req, uint64_t deadline)
+{
+	struct nvme_request_timer *timer = &pool->timer;
+	uint16_t *slot;
+
+	nvme_request_timer_disarm(pool, req);
+
+	// A deadline in a slot already passed would not be visited until the wheel wraps
+	if (deadline / timer->tick < timer->cursor) {
+		deadline = timer->cursor * timer->tick;
+	}
+	deadline = deadline ? deadline : 1;
+
+	slot = &timer->slots[(deadline / timer->tick) % NVME_REQUEST_TIMER_NSLOTS];
+	req->deadline = deadline;
+	req->tprev = NVME_REQUEST_FREELIST_NONE;
+	req->tnext = *slot;
+	if (*slot != NVME_REQUEST_FREELIST_NONE) {
+		pool->reqs[*slot].tprev = req->cid;
+	}
+	*slot = req->cid;
+	timer->narmed++;
+}
+
+/**
+ * Disarm up to `max` requests whose deadline is at or before `now`, storing their cids in `cids`
+ *
+ * Visits the slots of the ticks from where the previous call stopped, up to `now`; requests in
+ * these slots with a deadline in a later turn of the wheel are left armed. When `max` requests
+ * have expired, then the wheel stops at the slot it is in, and the next call continues from it.
+ *
+ * @return The number of cids stored in `cids`.
+ */
+static inline uint32_t
+nvme_request_timer_expire(struct nvme_request_pool *pool, uint64_t now, uint16_t *cids,
+			  uint32_t max)
+{
+	struct nvme_request_timer *timer = &pool->timer;
+	uint64_t end = now / timer->tick;
+	uint32_t nexpired = 0;
+
+	if (!timer->narmed) {
+		timer->cursor = end;
+		return 0;
+	}
+
+	// Once all slots are visited, the rest of the ticks fall on the same slots again
+	if (end - timer->cursor >= NVME_REQUEST_TIMER_NSLOTS) {
+		timer->cursor = end - NVME_REQUEST_TIMER_NSLOTS + 1;
+	}
+
+	for (; timer->cursor <= end; ++timer->cursor) {
+		uint16_t cid = timer->slots[timer->cursor % NVME_REQUEST_TIMER_NSLOTS];
+
+		while (cid != NVME_REQUEST_FREELIST_NONE) {
+			struct nvme_request *req = &pool->reqs[cid];
+
+			cid = req->tnext;
+			if (req->deadline > now) {
+				continue;
+			}
+			if (nexpired == max) {
+				return nexpired;
+			}
+			nvme_request_timer_disarm(pool, req);
+			cids[nexpired++] = req->cid;
+		}
+	}
+	timer->cursor = end; ///< The slot of 'now' may receive deadlines which are not yet due
+
+	return nexpired;
+}
+
 /**
  * Allocates a request object from the pool.
  *
@@ -97,17 +598,13 @@ nvme_request_pool_init_prps(struct nvme_request_pool *pool, struct hostmem_heap
 static inline struct nvme_request *
 nvme_request_alloc(struct nvme_request_pool *pool)
 {
-	uint16_t cid;
+	uint16_t cid = nvme_request_freelist_pop(&pool->cids);
 
-	assert(pool->top > 0);
-
-	if (pool->top == 0) {
+	if (cid == NVME_REQUEST_FREELIST_NONE) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	cid = pool->stack[--pool->top];
-
 	return &pool->reqs[cid];
 }
 
@@ -129,8 +626,13 @@ nvme_request_alloc(struct nvme_request_pool *pool)
 static inline void
 nvme_request_free(struct nvme_request_pool *pool, uint16_t cid)
 {
-	assert(pool->top < NVME_REQUEST_POOL_LEN);
-	pool->stack[pool->top++] = cid;
+	assert(cid < pool->len);
+
+	nvme_request_pages_release(&pool->reqs[cid]);
+	nvme_request_timer_disarm(pool, &pool->reqs[cid]);
+	pool->reqs[cid].slot = NVME_REQUEST_SLOT_NONE;
+	pool->reqs[cid].nexpired = 0;
+	nvme_request_freelist_push(&pool->cids, cid);
 }
 
 /**
@@ -146,10 +648,65 @@ nvme_request_free(struct nvme_request_pool *pool, uint16_t cid)
 static inline struct nvme_request *
 nvme_request_get(struct nvme_request_pool *pool, uint16_t cid)
 {
-	assert(cid < NVME_REQUEST_POOL_LEN);
+	assert(cid < pool->len);
 	return &pool->reqs[cid];
 }
 
+/**
+ * Prepare PRP entries for a physically contiguous data buffer given by its physical address
+ *
+ * Same as nvme_request_prep_command_prps_contig(), for a buffer whose physical address is already
+ * known, e.g. as handed out by hostmem_dma_pool_get(), thus, without the virt-to-phys lookup. The
+ * `heap` is only used for its page size.
+ *
+ * @return On success 0 is returned. When the pool has no more free PRP-list pages, then -ENOMEM
+ *         is returned.
+ */
+static inline int
+nvme_request_prep_command_prps_phys(struct nvme_request *request, struct hostmem_heap *heap,
+				    uint64_t dbuf_phys, size_t dbuf_nbytes,
+				    struct nvme_command *cmd)
+{
+	const uint64_t pagesize = heap->config->pagesize;
+
+	nvme_request_pages_release(request);
+
+	cmd->prp1 = dbuf_phys;
+
+	/* Only PRP1 may carry a sub-page offset; the page count and every later
+	 * entry are measured from the page floor. ceil((off+nbytes)/pagesize). */
+	const uint64_t page_off = cmd->prp1 & (pagesize - 1);
+	const uint64_t page_base = cmd->prp1 - page_off;
+	const uint64_t npages =
+		(page_off + dbuf_nbytes + pagesize - 1) >> heap->config->pagesize_shift;
+
+	if (npages == 1) {
+		return 0;
+	} else if (npages == 2) {
+		cmd->prp2 = page_base + pagesize;
+	} else {
+		struct nvme_request_prp_writer writer;
+		int err;
+
+		err = nvme_request_prp_acquire(request);
+		if (err) {
+			return err;
+		}
+		nvme_request_prp_writer_init(&writer, request, request->prp, pagesize, npages - 1);
+
+		cmd->prp2 = request->prp_addr;
+		for (uint64_t i = 1; i < npages; ++i) {
+			err = nvme_request_prp_writer_push(
+				&writer, page_base + (i << heap->config->pagesize_shift));
+			if (err) {
+				return err;
+			}
+		}
+	}
+
+	return 0;
+}
+
 /**
  * Prepare the PRP list for a command with a contiguous data buffer.
  *
@@ -158,48 +715,63 @@ nvme_request_get(struct nvme_request_pool *pool, uint16_t cid)
  * It sets up the PRP1 and PRP2 fields in the command to describe the physical memory backing the
  * `data` buffer, allowing the NVMe controller to access the buffer during command execution.
  *
+ * When a PRP list is needed, its pages are taken from the request pool, and chained when the list
+ * does not fit in a single page; the pages are returned to the pool by nvme_request_free(), or when
+ * the request is prepared again.
+ *
  * Caveats
  * -------
  *
  * - Assumes that the memory backing `dbuf` in `heap` is physically contiguous.
- * - Does *not* support PRP list chaining; only a single list page is constructed.
  *
  * @param request Pointer to the NVMe request context used for tracking and metadata.
  * @param heap Pointer to the hostmemory heap that dbuf is allocated within.
  * @param dbuf Pointer to the contiguous data buffer to be described by PRPs.
  * @param dbuf_nbytes Size in bytes of the data buffer.
  * @param cmd Pointer to the NVMe command to be prepared with PRP entries.
+ *
+ * @return On success 0 is returned. When the pool has no more free PRP-list pages, then -ENOMEM
+ *         is returned.
  */
-static inline void
+static inline int
 nvme_request_prep_command_prps_contig(struct nvme_request *request, struct hostmem_heap *heap,
 				      void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd)
 {
-	const uint64_t pagesize = heap->config->pagesize;
-
-	cmd->prp1 = hostmem_dma_v2p(heap, dbuf);
-
-	/* Only PRP1 may carry a sub-page offset; the page count and every later
-	 * entry are measured from the page floor. ceil((off+nbytes)/pagesize). */
-	const uint64_t page_off = cmd->prp1 & (pagesize - 1);
-	const uint64_t page_base = cmd->prp1 - page_off;
-	const uint64_t npages =
-		(page_off + dbuf_nbytes + pagesize - 1) >> heap->config->pagesize_shift;
-
-	/* Chaining is not supported, thus assert that the given dbuf fits. */
-	assert(npages <= 1 + 512);
+	return nvme_request_prep_command_prps_phys(request, heap, hostmem_dma_v2p(heap, dbuf),
+						   dbuf_nbytes, cmd);
+}
 
-	if (npages == 1) {
-		return;
-	} else if (npages == 2) {
-		cmd->prp2 = page_base + pagesize;
-	} else {
-		uint64_t *prp_list = request->prp;
+/**
+ * Set the Metadata Pointer (MPTR) of a command to a contiguous metadata buffer
+ *
+ * For namespaces formatted with metadata transferred as a separate buffer, that is, not as
+ * extended LBAs; the buffer holds the metadata of each logical block of the command, in order.
+ * The MPTR describes a single physically contiguous buffer, thus, `mbuf` must not cross a
+ * hugepage boundary, which allocations from `heap`, up to the hugepage size, never do.
+ *
+ * @param heap Pointer to the hostmemory heap that mbuf is allocated within.
+ * @param mbuf Pointer to the metadata buffer; dword-aligned.
+ * @param mbuf_nbytes Size in bytes of the metadata buffer.
+ * @param cmd Pointer to the NVMe command to be prepared with the metadata pointer.
+ *
+ * @return On success 0 is returned. When `mbuf` is not dword-aligned, or not physically
+ *         contiguous, then -EINVAL is returned.
+ */
+static inline int
+nvme_request_prep_command_mptr(struct hostmem_heap *heap, void *mbuf, size_t mbuf_nbytes,
+			       struct nvme_command *cmd)
+{
+	uint64_t mbuf_phys = hostmem_dma_v2p(heap, mbuf);
+	uint64_t mbuf_last = mbuf_phys + mbuf_nbytes - 1;
 
-		cmd->prp2 = request->prp_addr;
-		for (uint64_t i = 1; i < npages; ++i) {
-			prp_list[i - 1] = page_base + (i << heap->config->pagesize_shift);
-		}
+	if (((uintptr_t)mbuf & 0x3) || !mbuf_nbytes ||
+	    hostmem_dma_v2p(heap, (uint8_t *)mbuf + mbuf_nbytes - 1) != mbuf_last) {
+		UPCIE_DEBUG("FAILED: mbuf(%p) mbuf_nbytes(%zu)", mbuf, mbuf_nbytes);
+		return -EINVAL;
 	}
+	cmd->mptr = mbuf_phys;
+
+	return 0;
 }
 
 /**
@@ -209,50 +781,281 @@ nvme_request_prep_command_prps_contig(struct nvme_request *request, struct hostm
  * (`cmd`) using the provided request and an array of iovec entries. Each iovec entry is assumed to
  * be page-aligned and allocated from the given `heap`.
  *
+ * As with nvme_request_prep_command_prps_contig(), PRP list pages are chained as needed.
+ *
  * Caveats
  * -------
  *
  * - Each iovec base must be page-aligned and allocated from `heap`.
- * - Does *not* support PRP list chaining; only a single list page is constructed.
  *
  * @param request Pointer to the NVMe request context used for tracking and metadata.
  * @param heap Pointer to the hostmemory heap that iovec buffers are allocated within.
  * @param dvec Array of iovec structures describing the data segments.
  * @param dvec_cnt Number of elements in the dvec array.
  * @param cmd Pointer to the NVMe command to be prepared with PRP entries.
+ *
+ * @return On success 0 is returned. When the pool has no more free PRP-list pages, then -ENOMEM
+ *         is returned.
  */
-static inline void
+static inline int
 nvme_request_prep_command_prps_iov(struct nvme_request *request, struct hostmem_heap *heap,
 				   struct iovec *dvec, size_t dvec_cnt, struct nvme_command *cmd)
 {
 	const uint64_t pagesize = heap->config->pagesize;
-	uint64_t *prp_list = request->prp;
-	size_t prp_idx = 0;
+	struct nvme_request_prp_writer writer;
+	uint64_t prp2 = 0;
+	size_t npages = 0;
+	int first = 1;
 
-	cmd->prp1 = hostmem_dma_v2p(heap, dvec[0].iov_base);
+	nvme_request_pages_release(request);
 
 	for (size_t i = 0; i < dvec_cnt; ++i) {
-		uint8_t *base = dvec[i].iov_base;
-		size_t remaining = dvec[i].iov_len;
-		size_t offset = 0;
+		npages += (dvec[i].iov_len + pagesize - 1) >> heap->config->pagesize_shift;
+	}
+	if (!npages) {
+		return -EINVAL;
+	}
 
-		/* Skip the first page of the first iovec — it is PRP1 */
-		if (i == 0) {
-			offset = pagesize;
-			remaining = (remaining > pagesize) ? remaining - pagesize : 0;
+	// A single entry goes directly into PRP2, thus, a list-page is only needed for more
+	if (npages > 2) {
+		int err = nvme_request_prp_acquire(request);
+		if (err) {
+			return err;
 		}
+		nvme_request_prp_writer_init(&writer, request, request->prp, pagesize, npages - 1);
+	} else {
+		nvme_request_prp_writer_init(&writer, request, &prp2, pagesize, npages - 1);
+	}
+
+	// Translate in batches; the first entry of the first iovec is PRP1
+	for (size_t i = 0; i < dvec_cnt; ++i) {
+		uint8_t *base = dvec[i].iov_base;
+		size_t remaining = dvec[i].iov_len;
 
 		while (remaining > 0) {
-			prp_list[prp_idx++] = hostmem_dma_v2p(heap, base + offset);
+			const size_t batch_nbytes = (NVME_REQUEST_V2P_BATCH - 1)
+						    << heap->config->pagesize_shift;
+			uint64_t addrs[NVME_REQUEST_V2P_BATCH];
+			size_t nbytes = remaining < batch_nbytes ? remaining : batch_nbytes;
+			int naddrs;
+
+			naddrs = hostmem_dma_v2p_batch(heap, base, nbytes, addrs,
+						       NVME_REQUEST_V2P_BATCH);
+			if (naddrs < 0) {
+				return naddrs;
+			}
+
+			for (int j = 0; j < naddrs; ++j) {
+				int err;
 
-			offset += pagesize;
-			remaining = (remaining > pagesize) ? remaining - pagesize : 0;
+				if (first) {
+					cmd->prp1 = addrs[0];
+					first = 0;
+					continue;
+				}
+				err = nvme_request_prp_writer_push(&writer, addrs[j]);
+				if (err) {
+					return err;
+				}
+			}
+
+			base += nbytes;
+			remaining -= nbytes;
 		}
 	}
 
-	if (prp_idx == 1) {
-		cmd->prp2 = prp_list[0];
-	} else if (prp_idx > 1) {
+	if (npages == 2) {
+		cmd->prp2 = prp2;
+	} else if (npages > 2) {
 		cmd->prp2 = request->prp_addr;
 	}
-}
\ No newline at end of file
+
+	return 0;
+}
+
+/**
+ * Add the extent [addr, addr + len) to the SGL of the request as a data block descriptor
+ *
+ * The extent is merged with the last descriptor when physically adjacent to it. The first
+ * descriptor is kept in `first`, held by the caller, and a PRP-list page is only taken from the
+ * pool once a second descriptor is needed; the first is then moved to the head of the page.
+ *
+ * @return On success, the number of descriptors is returned. When more than `max` descriptors are
+ *         needed, then -E2BIG is returned; -ENOMEM when the pool has no free PRP-list pages.
+ */
+static inline int
+nvme_request_sgl_add(struct nvme_request *request, struct nvme_sgl_desc *first, int ndescs,
+		     int max, uint64_t addr, uint64_t len)
+{
+	struct nvme_sgl_desc *descs = ndescs > 1 ? request->prp : first;
+	int err;
+
+	if (ndescs && (descs[ndescs - 1].addr + descs[ndescs - 1].len == addr) &&
+	    ((uint64_t)descs[ndescs - 1].len + len <= UINT32_MAX)) {
+		descs[ndescs - 1].len += len;
+		return ndescs;
+	}
+	if (ndescs == max) {
+		return -E2BIG;
+	}
+
+	if (ndescs == 1) {
+		err = nvme_request_prp_acquire(request);
+		if (err) {
+			return err;
+		}
+		descs = request->prp;
+		descs[0] = *first;
+	}
+
+	memset(&descs[ndescs], 0, sizeof(*descs));
+	descs[ndescs].addr = addr;
+	descs[ndescs].len = len;
+	descs[ndescs].type = NVME_SGL_TYPE_DATA_BLOCK << 4;
+
+	return ndescs + 1;
+}
+
+/**
+ * Append the physically contiguous extents of [virt, virt + nbytes) as SGL data block descriptors
+ *
+ * The range is split at each hugepage boundary, and neighbouring pieces which are physically
+ * contiguous are merged, thus, a buffer within one hugepage, or spanning hugepages which happen
+ * to be physically contiguous, becomes a single descriptor; see nvme_request_sgl_add().
+ *
+ * @return On success, the number of descriptors is returned. When more than `max` descriptors are
+ *         needed, then -E2BIG is returned; -ENOMEM when the pool has no free PRP-list pages.
+ */
+static inline int
+nvme_request_sgl_append(struct nvme_request *request, struct hostmem_heap *heap, void *virt,
+			size_t nbytes, struct nvme_sgl_desc *first, int ndescs, int max)
+{
+	const size_t hugepgsz = heap->config->hugepgsz;
+	uint8_t *cur = virt;
+
+	while (nbytes) {
+		size_t offset = cur - (uint8_t *)heap->memory.virt;
+		size_t len = hugepgsz - (offset & (hugepgsz - 1));
+
+		if (len > nbytes) {
+			len = nbytes;
+		}
+
+		ndescs = nvme_request_sgl_add(request, first, ndescs, max,
+					      hostmem_dma_v2p(heap, cur), len);
+		if (ndescs < 0) {
+			return ndescs;
+		}
+
+		cur += len;
+		nbytes -= len;
+	}
+
+	return ndescs;
+}
+
+/**
+ * Set up the SGL1 field of the given command from the descriptors added by nvme_request_sgl_add()
+ *
+ * A single descriptor, `first`, is embedded in the command; several are referenced via a last
+ * segment descriptor pointing to the list in the request PRP page.
+ */
+static inline void
+nvme_request_prep_command_sgl_finish(struct nvme_request *request, struct nvme_sgl_desc *first,
+				     int ndescs, struct nvme_command *cmd)
+{
+	struct nvme_sgl_desc sgl1 = {0};
+
+	if (ndescs == 1) {
+		sgl1 = *first;
+	} else {
+		sgl1.addr = request->prp_addr;
+		sgl1.len = ndescs * sizeof(struct nvme_sgl_desc);
+		sgl1.type = NVME_SGL_TYPE_LAST_SEGMENT << 4;
+	}
+
+	cmd->fuse = (cmd->fuse & 0x3F) | (NVME_COMMAND_PSDT_SGL << 6);
+	memcpy(&cmd->prp1, &sgl1, sizeof(sgl1));
+}
+
+/**
+ * Prepare the SGL for a command with a contiguous data buffer.
+ *
+ * The buffer need not be aligned. Within a hugepage the buffer is physically contiguous, thus,
+ * buffers not spanning hugepages are described by a single data block descriptor embedded in the
+ * command, and no list is constructed.
+ *
+ * @param request Pointer to the NVMe request context used for tracking and metadata.
+ * @param heap Pointer to the hostmemory heap that dbuf is allocated within.
+ * @param dbuf Pointer to the data buffer to be described by the SGL.
+ * @param dbuf_nbytes Size in bytes of the data buffer.
+ * @param cmd Pointer to the NVMe command to be prepared with the SGL.
+ *
+ * @return On success 0 is returned. When the buffer needs more descriptors than fit in the
+ *         request PRP page, then -E2BIG is returned; -ENOMEM when it needs a list, and the pool
+ *         has no free PRP-list pages.
+ */
+static inline int
+nvme_request_prep_command_sgl_contig(struct nvme_request *request, struct hostmem_heap *heap,
+				     void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd)
+{
+	const int max = heap->config->pagesize / sizeof(struct nvme_sgl_desc);
+	struct nvme_sgl_desc first;
+	int ndescs;
+
+	nvme_request_pages_release(request);
+
+	ndescs = nvme_request_sgl_append(request, heap, dbuf, dbuf_nbytes, &first, 0, max);
+	if (ndescs < 0) {
+		return ndescs;
+	}
+
+	nvme_request_prep_command_sgl_finish(request, &first, ndescs, cmd);
+
+	return 0;
+}
+
+/**
+ * Prepare the SGL for a command with an iovec (scatter-gather) data buffer.
+ *
+ * Unlike nvme_request_prep_command_prps_iov(), the iovec entries need not be page-aligned, nor
+ * have a length that is a multiple of the page size. Each iovec becomes one data block descriptor
+ * per physically contiguous extent. Controllers reporting SGLS bits 1:0 == 10b do require dword
+ * alignment and granularity of the data blocks.
+ *
+ * @param request Pointer to the NVMe request context used for tracking and metadata.
+ * @param heap Pointer to the hostmemory heap that iovec buffers are allocated within.
+ * @param dvec Array of iovec structures describing the data segments.
+ * @param dvec_cnt Number of elements in the dvec array.
+ * @param cmd Pointer to the NVMe command to be prepared with the SGL.
+ *
+ * @return On success 0 is returned. When the buffers need more descriptors than fit in the
+ *         request PRP page, then -E2BIG is returned; -ENOMEM when they need a list, and the pool
+ *         has no free PRP-list pages.
+ */
+static inline int
+nvme_request_prep_command_sgl_iov(struct nvme_request *request, struct hostmem_heap *heap,
+				  struct iovec *dvec, size_t dvec_cnt, struct nvme_command *cmd)
+{
+	const int max = heap->config->pagesize / sizeof(struct nvme_sgl_desc);
+	struct nvme_sgl_desc first;
+	int ndescs = 0;
+
+	nvme_request_pages_release(request);
+
+	for (size_t i = 0; i < dvec_cnt; ++i) {
+		ndescs = nvme_request_sgl_append(request, heap, dvec[i].iov_base, dvec[i].iov_len,
+						 &first, ndescs, max);
+		if (ndescs < 0) {
+			return ndescs;
+		}
+	}
+
+	if (!ndescs) {
+		return -EINVAL;
+	}
+
+	nvme_request_prep_command_sgl_finish(request, &first, ndescs, cmd);
+
+	return 0;
+}
@@ -6,12 +6,45 @@
  * ===========================
  *
  * This header extends the functionality defined in the uPCIe NVMe Request header
- * `upcie/nvme/nvme_request.h` with a CUDA dependent PRP preparation function.
+ * `upcie/nvme/nvme_request.h` with CUDA dependent PRP and SGL preparation functions. For buffers
+ * of a 'struct cudamem_heap', the entries are produced per physically contiguous run of the heap.
  * 
  * @file nvme_request_cuda.h
  * @version 0.4.4
  */
 
+/**
+ * Write PRP entries for the pages of [virt, virt + nbytes), with `virt` page-aligned
+ *
+ * The physical address is looked up once per physically contiguous run of the heap, see
+ * cudamem_heap_block_vtp_contig(); within a run, the entries are consecutive pages.
+ */
+static inline int
+nvme_request_prp_writer_push_cuda(struct nvme_request_prp_writer *writer,
+				  struct cudamem_heap *heap, uint8_t *virt, size_t nbytes)
+{
+	const uint64_t pagesize = heap->config->pagesize;
+	uint64_t addr = 0, contig = 0;
+
+	for (size_t offset = 0; offset < nbytes; offset += pagesize) {
+		int err;
+
+		if (!contig) {
+			addr = cudamem_heap_block_vtp_contig(heap, virt + offset, &contig);
+		}
+
+		err = nvme_request_prp_writer_push(writer, addr);
+		if (err) {
+			return err;
+		}
+
+		addr += pagesize;
+		contig = contig > pagesize ? contig - pagesize : 0;
+	}
+
+	return 0;
+}
+
 /**
  * Prepare the PRP list for a command with a contiguous CUDA data buffer.
  *
@@ -20,48 +53,63 @@
  * It sets up the PRP1 and PRP2 fields in the command to describe the physical memory backing the
  * `data` buffer, allowing the NVMe controller to access the buffer during command execution.
  *
- * Caveats
- * -------
- *
- * - Assumes that the memory backing `dbuf` in `heap` is physically contiguous.
- * - Does *not* support PRP list chaining; only a single list page is constructed.
+ * The buffer need not be physically contiguous; the entries are produced per physically
+ * contiguous run of the heap. When a PRP list is needed, its pages are taken from the request
+ * pool, and chained when the list does not fit in a single page.
  *
  * @param request Pointer to the NVMe request context used for tracking and metadata.
  * @param heap Pointer to the CUDA memory heap that dbuf is allocated within.
  * @param dbuf Pointer to the contiguous data buffer to be described by PRPs.
  * @param dbuf_nbytes Size in bytes of the data buffer.
  * @param cmd Pointer to the NVMe command to be prepared with PRP entries.
+ *
+ * @return On success 0 is returned. When the request pool has no free PRP-list pages, then
+ *         -ENOMEM is returned.
  */
-static inline void
+static inline int
 nvme_request_prep_command_prps_contig_cuda(struct nvme_request *request, struct cudamem_heap *heap,
                                            void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd)
 {
 	const uint64_t pagesize = heap->config->pagesize;
+	struct nvme_request_prp_writer writer;
+	uint64_t prp2 = 0;
+	int err;
+
+	nvme_request_pages_release(request);
 
 	cmd->prp1 = cudamem_heap_block_vtp(heap, dbuf);
 
 	/* Only PRP1 may carry a sub-page offset; the page count and every later
 	 * entry are measured from the page floor. ceil((off+nbytes)/pagesize). */
 	const uint64_t page_off = cmd->prp1 & (pagesize - 1);
-	const uint64_t page_base = cmd->prp1 - page_off;
+	uint8_t *page_base = (uint8_t *)dbuf - page_off;
 	const uint64_t npages =
 		(page_off + dbuf_nbytes + pagesize - 1) >> heap->config->pagesize_shift;
 
-	/* Chaining is not supported, thus assert that the given dbuf fits. */
-	assert(npages <= 1 + 512);
-
 	if (npages == 1) {
-		return;
-	} else if (npages == 2) {
-		cmd->prp2 = page_base + pagesize;
-	} else {
-		uint64_t *prp_list = (uint64_t *)request->prp;
+		return 0;
+	}
 
-		cmd->prp2 = request->prp_addr;
-		for (uint64_t i = 1; i < npages; ++i) {
-			prp_list[i - 1] = page_base + (i << heap->config->pagesize_shift);
+	// A single entry goes directly into PRP2, thus, a list-page is only needed for more
+	if (npages > 2) {
+		err = nvme_request_prp_acquire(request);
+		if (err) {
+			return err;
 		}
+		nvme_request_prp_writer_init(&writer, request, request->prp, pagesize, npages - 1);
+	} else {
+		nvme_request_prp_writer_init(&writer, request, &prp2, pagesize, npages - 1);
 	}
+
+	err = nvme_request_prp_writer_push_cuda(&writer, heap, page_base + pagesize,
+						(npages - 1) * pagesize);
+	if (err) {
+		return err;
+	}
+
+	cmd->prp2 = npages == 2 ? prp2 : request->prp_addr;
+
+	return 0;
 }
 
 /**
@@ -71,52 +119,184 @@ nvme_request_prep_command_prps_contig_cuda(struct nvme_request *request, struct
  * (`cmd`) using the provided request and an array of iovec entries. Each iovec entry is assumed to
  * be page-aligned and allocated from the given `heap`.
  *
+ * As with nvme_request_prep_command_prps_contig_cuda(), the entries are produced per physically
+ * contiguous run, and PRP list pages are chained as needed.
+ *
  * Caveats
  * -------
  *
  * - Each iovec base must be page-aligned and allocated from `heap`.
- * - Does *not* support PRP list chaining; only a single list page is constructed.
  *
  * @param request Pointer to the NVMe request context used for tracking and metadata.
  * @param heap Pointer to the CUDA heap that iovec buffers are allocated within.
  * @param dvec Array of iovec structures describing the data segments.
  * @param dvec_cnt Number of elements in the dvec array.
  * @param cmd Pointer to the NVMe command to be prepared with PRP entries.
+ *
+ * @return On success 0 is returned. When the request pool has no free PRP-list pages, then
+ *         -ENOMEM is returned.
  */
-static inline void
+static inline int
 nvme_request_prep_command_prps_iov_cuda(struct nvme_request *request, struct cudamem_heap *heap,
 				   	struct iovec *dvec, size_t dvec_cnt, struct nvme_command *cmd)
 {
 	const uint64_t pagesize = heap->config->pagesize;
-	uint64_t *prp_list = (uint64_t *)request->prp;
-	size_t prp_idx = 0;
+	struct nvme_request_prp_writer writer;
+	uint64_t prp2 = 0;
+	size_t npages = 0;
+	int err;
+
+	nvme_request_pages_release(request);
+
+	for (size_t i = 0; i < dvec_cnt; ++i) {
+		npages += (dvec[i].iov_len + pagesize - 1) >> heap->config->pagesize_shift;
+	}
+	if (!npages) {
+		return -EINVAL;
+	}
+
+	if (npages > 2) {
+		err = nvme_request_prp_acquire(request);
+		if (err) {
+			return err;
+		}
+		nvme_request_prp_writer_init(&writer, request, request->prp, pagesize, npages - 1);
+	} else {
+		nvme_request_prp_writer_init(&writer, request, &prp2, pagesize, npages - 1);
+	}
 
 	cmd->prp1 = cudamem_heap_block_vtp(heap, dvec[0].iov_base);
 
 	for (size_t i = 0; i < dvec_cnt; ++i) {
 		uint8_t *base = (uint8_t *)dvec[i].iov_base;
-		size_t remaining = dvec[i].iov_len;
-		size_t offset = 0;
+		size_t nbytes = dvec[i].iov_len;
 
 		/* Skip the first page of the first iovec — it is PRP1 */
 		if (i == 0) {
-			offset = pagesize;
-			remaining = (remaining > pagesize) ? remaining - pagesize : 0;
+			base += pagesize;
+			nbytes = (nbytes > pagesize) ? nbytes - pagesize : 0;
 		}
 
-		while (remaining > 0) {
-			prp_list[prp_idx++] = cudamem_heap_block_vtp(heap, base + offset);
-
-			offset += pagesize;
-			remaining = (remaining > pagesize) ? remaining - pagesize : 0;
+		err = nvme_request_prp_writer_push_cuda(&writer, heap, base, nbytes);
+		if (err) {
+			return err;
 		}
 	}
 
-	if (prp_idx == 1) {
-		cmd->prp2 = prp_list[0];
-	} else if (prp_idx > 1) {
+	if (npages == 2) {
+		cmd->prp2 = prp2;
+	} else if (npages > 2) {
 		cmd->prp2 = request->prp_addr;
 	}
+
+	return 0;
+}
+
+/**
+ * Append the physically contiguous runs of [virt, virt + nbytes) as SGL data block descriptors
+ *
+ * Same as nvme_request_sgl_append(), for a CUDA heap; each run of the heap, see
+ * cudamem_heap_block_vtp_contig(), becomes a single descriptor, merged with the previous one when
+ * physically adjacent.
+ *
+ * @return On success, the number of descriptors is returned. When more than `max` descriptors are
+ *         needed, then -E2BIG is returned; -ENOMEM when the pool has no free PRP-list pages.
+ */
+static inline int
+nvme_request_sgl_append_cuda(struct nvme_request *request, struct cudamem_heap *heap, void *virt,
+			     size_t nbytes, struct nvme_sgl_desc *first, int ndescs, int max)
+{
+	uint8_t *cur = virt;
+
+	while (nbytes) {
+		uint64_t len;
+		uint64_t addr = cudamem_heap_block_vtp_contig(heap, cur, &len);
+
+		if (len > nbytes) {
+			len = nbytes;
+		}
+		if (len > UINT32_MAX) {
+			len = (uint64_t)1 << 31;
+		}
+
+		ndescs = nvme_request_sgl_add(request, first, ndescs, max, addr, len);
+		if (ndescs < 0) {
+			return ndescs;
+		}
+
+		cur += len;
+		nbytes -= len;
+	}
+
+	return ndescs;
+}
+
+/**
+ * Prepare the SGL for a command with a contiguous CUDA data buffer.
+ *
+ * Same as nvme_request_prep_command_sgl_contig(), for a buffer allocated within a CUDA heap; a
+ * buffer within a single physically contiguous run is described by a single data block
+ * descriptor embedded in the command.
+ *
+ * @return On success 0 is returned. When the buffer needs more descriptors than fit in the
+ *         request PRP page, then -E2BIG is returned; -ENOMEM when it needs a list, and the pool
+ *         has no free PRP-list pages.
+ */
+static inline int
+nvme_request_prep_command_sgl_contig_cuda(struct nvme_request *request, struct cudamem_heap *heap,
+					  void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd)
+{
+	const int max = heap->config->pagesize / sizeof(struct nvme_sgl_desc);
+	struct nvme_sgl_desc first;
+	int ndescs;
+
+	nvme_request_pages_release(request);
+
+	ndescs = nvme_request_sgl_append_cuda(request, heap, dbuf, dbuf_nbytes, &first, 0, max);
+	if (ndescs < 0) {
+		return ndescs;
+	}
+
+	nvme_request_prep_command_sgl_finish(request, &first, ndescs, cmd);
+
+	return 0;
+}
+
+/**
+ * Prepare the SGL for a command with a CUDA iovec (scatter-gather) data buffer.
+ *
+ * Same as nvme_request_prep_command_sgl_iov(), for iovec entries allocated within a CUDA heap.
+ *
+ * @return On success 0 is returned. When the buffers need more descriptors than fit in the
+ *         request PRP page, then -E2BIG is returned; -ENOMEM when they need a list, and the pool
+ *         has no free PRP-list pages.
+ */
+static inline int
+nvme_request_prep_command_sgl_iov_cuda(struct nvme_request *request, struct cudamem_heap *heap,
+				       struct iovec *dvec, size_t dvec_cnt,
+				       struct nvme_command *cmd)
+{
+	const int max = heap->config->pagesize / sizeof(struct nvme_sgl_desc);
+	struct nvme_sgl_desc first;
+	int ndescs = 0;
+
+	nvme_request_pages_release(request);
+
+	for (size_t i = 0; i < dvec_cnt; ++i) {
+		ndescs = nvme_request_sgl_append_cuda(request, heap, dvec[i].iov_base,
+						      dvec[i].iov_len, &first, ndescs, max);
+		if (ndescs < 0) {
+			return ndescs;
+		}
+	}
+
+	if (!ndescs) {
+		return -EINVAL;
+	}
+
+	nvme_request_prep_command_sgl_finish(request, &first, ndescs, cmd);
+
+	return 0;
 }
 
 /**
@@ -142,7 +322,8 @@ nvme_request_prep_command_prps_iov_cuda(struct nvme_request *request, struct cud
  * @param dbuf Pointer to the contiguous data buffer to be described by PRPs.
  * @param dbuf_nbytes Size in bytes of the data buffer.
  * @param cmd Pointer to the NVMe command to be prepared with PRP entries.
- * @return 0 on success, -EINVAL if any page of the buffer is unmapped.
+ * @return 0 on success, -EINVAL if any page of the buffer is unmapped, -ENOMEM if the request
+ *         pool has no free PRP-list pages.
  */
 static inline int
 nvme_request_prep_command_prps_contig_cuda_mapped(struct nvme_request *request,
@@ -162,6 +343,8 @@ nvme_request_prep_command_prps_contig_cuda_mapped(struct nvme_request *request,
 		return -EINVAL;
 	}
 
+	nvme_request_pages_release(request);
+
 	/* virt_to_phys preserves the sub-page offset, so PRP1 carries it. */
 	err = cudamem_mapping_virt_to_phys(registry, dbuf, &cmd->prp1);
 	if (err) {
@@ -175,6 +358,11 @@ nvme_request_prep_command_prps_contig_cuda_mapped(struct nvme_request *request,
 		return cudamem_mapping_virt_to_phys(registry, page_base + pagesize, &cmd->prp2);
 	}
 
+	err = nvme_request_prp_acquire(request);
+	if (err) {
+		return err;
+	}
+
 	uint64_t *prp_list = (uint64_t *)request->prp;
 	cmd->prp2 = request->prp_addr;
 	for (uint64_t i = 1; i < npages; ++i) {
@@ -204,7 +392,8 @@ nvme_request_prep_command_prps_contig_cuda_mapped(struct nvme_request *request,
  * @param dvec Array of iovec structures describing the data segments.
  * @param dvec_cnt Number of elements in the dvec array.
  * @param cmd Pointer to the NVMe command to be prepared with PRP entries.
- * @return 0 on success, -EINVAL if any iovec cannot be resolved.
+ * @return 0 on success, -EINVAL if any iovec cannot be resolved, -ENOMEM if the request pool
+ *         has no free PRP-list pages.
  */
 static inline int
 nvme_request_prep_command_prps_iov_cuda_mapped(struct nvme_request *request,
@@ -218,10 +407,17 @@ nvme_request_prep_command_prps_iov_cuda_mapped(struct nvme_request *request,
 
 	const uint64_t pagesize = config->pagesize;
 	const size_t prp_cap = pagesize / sizeof(uint64_t);
-	uint64_t *prp_list = (uint64_t *)request->prp;
+	uint64_t *prp_list;
 	size_t prp_idx = 0;
 	int err;
 
+	nvme_request_pages_release(request);
+	err = nvme_request_prp_acquire(request);
+	if (err) {
+		return err;
+	}
+	prp_list = (uint64_t *)request->prp;
+
 	for (size_t i = 0; i < dvec_cnt; ++i) {
 		uint8_t *base = (uint8_t *)dvec[i].iov_base;
 		size_t iov_len = dvec[i].iov_len;
@@ -261,3 +457,211 @@ nvme_request_prep_command_prps_iov_cuda_mapped(struct nvme_request *request,
 
 	return 0;
 }
+
+/**
+ * Copy the host array of physical addresses to device memory, as the entries of the given LUT
+ */
+static inline int
+nvme_request_cuda_lut_upload(struct nvme_request_cuda_lut *lut, uint64_t *phys)
+{
+	const size_t nbytes = lut->nentries * sizeof(*phys);
+	int err;
+
+	err = cuMemAlloc((CUdeviceptr *)&lut->phys, nbytes);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemAlloc(lut); CUresult(%d)", err);
+		lut->phys = NULL;
+		return err;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)lut->phys, phys, nbytes);
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyHtoD(lut); CUresult(%d)", err);
+		cuMemFree((CUdeviceptr)lut->phys);
+		lut->phys = NULL;
+	}
+
+	return err;
+}
+
+static inline void
+nvme_request_cuda_lut_term(struct nvme_request_cuda_lut *lut)
+{
+	if (!lut) {
+		return;
+	}
+
+	if (lut->phys) {
+		cuMemFree((CUdeviceptr)lut->phys);
+	}
+	memset(lut, 0, sizeof(*lut));
+}
+
+/**
+ * Build a device-resident LUT of the given heap, see nvme_request_cuda_device.h
+ *
+ * An entry covers the largest power-of-two to which all the physically contiguous runs of the
+ * heap are aligned, thus, a heap backed by a few large runs needs but a few entries.
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult
+ *         errors.
+ */
+static inline int
+nvme_request_cuda_lut_from_heap(struct nvme_request_cuda_lut *lut, struct cudamem_heap *heap)
+{
+	uint64_t bits = heap->size;
+	uint64_t *phys;
+	int err;
+
+	memset(lut, 0, sizeof(*lut));
+
+	for (size_t i = 0; i < heap->extents.nextents; ++i) {
+		bits |= heap->extents.extents[i].off | heap->extents.extents[i].len;
+	}
+	if (!bits) {
+		return -EINVAL;
+	}
+
+	lut->vaddr = heap->vaddr;
+	lut->shift = __builtin_ctzll(bits);
+	lut->nentries = heap->size >> lut->shift;
+
+	phys = calloc(lut->nentries, sizeof(*phys));
+	if (!phys) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: calloc(); err(%d)", err);
+		return err;
+	}
+	for (uint64_t i = 0; i < lut->nentries; ++i) {
+		phys[i] = dmabuf_extents_addr(&heap->extents, i << lut->shift, NULL);
+	}
+
+	err = nvme_request_cuda_lut_upload(lut, phys);
+	free(phys);
+
+	return err;
+}
+
+/**
+ * Build a device-resident LUT of [virt, virt + nbytes) from the 'lut_phys' of a mapping registry
+ *
+ * An entry covers a chunk of the registry; chunks which are not registered at the time of the call
+ * are not mapped in the LUT.
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult
+ *         errors.
+ */
+static inline int
+nvme_request_cuda_lut_from_mapping(struct nvme_request_cuda_lut *lut,
+				   struct cudamem_mapping_registry *registry, void *virt,
+				   size_t nbytes)
+{
+	const uint64_t first = (uint64_t)virt >> registry->gran_shift;
+	const uint64_t end = (uint64_t)virt + nbytes;
+	const uint64_t last = (end + registry->gran_mask) >> registry->gran_shift;
+	uint64_t *phys;
+	int err;
+
+	memset(lut, 0, sizeof(*lut));
+
+	if (!nbytes || last > registry->lut_capacity) {
+		return -EINVAL;
+	}
+
+	lut->vaddr = first << registry->gran_shift;
+	lut->shift = registry->gran_shift;
+	lut->nentries = last - first;
+
+	phys = calloc(lut->nentries, sizeof(*phys));
+	if (!phys) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: calloc(); err(%d)", err);
+		return err;
+	}
+	for (uint64_t i = 0; i < lut->nentries; ++i) {
+		phys[i] = __atomic_load_n(&registry->lut_phys[first + i], __ATOMIC_ACQUIRE);
+	}
+
+	err = nvme_request_cuda_lut_upload(lut, phys);
+	free(phys);
+
+	return err;
+}
+
+static inline void
+nvme_request_cuda_lists_term(struct nvme_request_cuda_lists *lists, struct cudamem_heap *heap)
+{
+	if (!lists) {
+		return;
+	}
+
+	cudamem_heap_block_free(heap, lists->virt);
+	if (lists->phys) {
+		cuMemFree((CUdeviceptr)lists->phys);
+	}
+	memset(lists, 0, sizeof(*lists));
+}
+
+/**
+ * Allocate 'npages' list pages per CID, for 'ncids' CIDs, from the heap
+ *
+ * @return 0 on success. Negative values indicate errno-style errors, positive values are CUresult
+ *         errors.
+ */
+static inline int
+nvme_request_cuda_lists_init(struct nvme_request_cuda_lists *lists, struct cudamem_heap *heap,
+			     uint32_t ncids, uint32_t npages)
+{
+	const size_t ntotal = (size_t)ncids * npages;
+	uint64_t *phys = NULL;
+	int err;
+
+	memset(lists, 0, sizeof(*lists));
+
+	if (!ntotal) {
+		return -EINVAL;
+	}
+
+	lists->npages = npages;
+	lists->pagesize = heap->config->pagesize;
+	lists->pagesize_shift = heap->config->pagesize_shift;
+
+	lists->virt = cudamem_heap_block_alloc(heap, ntotal << lists->pagesize_shift);
+	if (!lists->virt) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: cudamem_heap_block_alloc(lists); err(%d)", err);
+		return err;
+	}
+
+	phys = calloc(ntotal, sizeof(*phys));
+	if (!phys) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: calloc(); err(%d)", err);
+		goto failed;
+	}
+	for (size_t i = 0; i < ntotal; ++i) {
+		phys[i] = cudamem_heap_block_vtp(heap, lists->virt + (i << lists->pagesize_shift));
+	}
+
+	err = cuMemAlloc((CUdeviceptr *)&lists->phys, ntotal * sizeof(*phys));
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemAlloc(lists); CUresult(%d)", err);
+		lists->phys = NULL;
+		goto failed;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)lists->phys, phys, ntotal * sizeof(*phys));
+	if (err) {
+		UPCIE_DEBUG("FAILED: cuMemcpyHtoD(lists); CUresult(%d)", err);
+		goto failed;
+	}
+	free(phys);
+
+	return 0;
+
+failed:
+	free(phys);
+	nvme_request_cuda_lists_term(lists, heap);
+
+	return err;
+}
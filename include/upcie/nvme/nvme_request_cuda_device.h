@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/**
+ * Device-side PRP and SGL construction for GPU-initiated I/O
+ * ==========================================================
+ *
+ * The PRP and SGL builders of `upcie/nvme/nvme_request_cuda.h` run on the host; a kernel deciding
+ * at runtime what to read, e.g. when traversing a graph, or looking up embeddings, would have to
+ * round-trip to the CPU for every command. The functions here run on the device instead:
+ *
+ * - nvme_request_cuda_lut_vtp(), address translation via a 'struct nvme_request_cuda_lut'
+ * - nvme_request_cuda_prep_command_prps(), PRPs, with list pages chained as needed
+ * - nvme_request_cuda_prep_command_sgl(), SGL data block descriptors per contiguous run
+ *
+ * A 'struct nvme_request_cuda_lut' is a device-resident copy of the physical addresses behind a
+ * range of virtual addresses, with one entry per naturally aligned, physically contiguous, chunk.
+ * It is built on the host, from a 'struct cudamem_heap', or from the 'lut_phys' of a
+ * 'struct cudamem_mapping_registry', see nvme_request_cuda_lut_from_heap() and
+ * nvme_request_cuda_lut_from_mapping(). It is a snapshot; rebuild it when the mappings change.
+ *
+ * PRP lists and SGL segments are written to a 'struct nvme_request_cuda_lists', a number of list
+ * pages per CID, in GPU memory of the heap, thus, visible to the controller. The pages of a CID are
+ * owned by the command using the CID; use nvme_qpair_cuda_cid_get() and
+ * nvme_qpair_cuda_submit_cid() to build them between allocating the CID and submitting.
+ *
+ * @file nvme_request_cuda_device.h
+ * @version 0.4.4
+ */
+
+#ifndef __device__
+#define __device__
+#endif
+#ifndef __host__
+#define __host__
+#endif
+
+struct nvme_request_cuda_lut {
+	uint64_t vaddr;    ///< Virtual address of the first entry
+	uint64_t nentries; ///< Number of entries
+	int shift;         ///< Number of bytes covered by an entry, as a power of two
+	uint64_t *phys;    ///< Physical address per entry, 0 when not mapped; device memory
+};
+
+struct nvme_request_cuda_lists {
+	uint8_t *virt;       ///< 'npages' list pages per CID; GPU memory of the heap
+	uint64_t *phys;      ///< Physical address per list page; device memory
+	uint32_t npages;     ///< Number of list pages per CID
+	uint32_t pagesize;   ///< Host page size
+	int pagesize_shift;
+};
+
+/**
+ * Translate a virtual address via the LUT
+ *
+ * @param lut The LUT
+ * @param virt The virtual address
+ * @param phys Pointer to store the physical address
+ * @param contig Pointer to store the number of bytes which are physically contiguous from virt, at
+ *               least to the end of its entry; may be NULL
+ *
+ * @return 0 on success, -EINVAL when virt is not covered, or not mapped
+ */
+static inline __device__ __host__ int
+nvme_request_cuda_lut_vtp(const struct nvme_request_cuda_lut *lut, const void *virt,
+			  uint64_t *phys, uint64_t *contig)
+{
+	const uint64_t mask = ((uint64_t)1 << lut->shift) - 1;
+	const uint64_t off = (uint64_t)virt - lut->vaddr;
+	uint64_t idx, base;
+
+	if ((uint64_t)virt < lut->vaddr) {
+		return -EINVAL;
+	}
+	idx = off >> lut->shift;
+	if (idx >= lut->nentries) {
+		return -EINVAL;
+	}
+	base = lut->phys[idx];
+	if (!base) {
+		return -EINVAL;
+	}
+
+	*phys = base + (off & mask);
+	if (contig) {
+		*contig = (mask + 1) - (off & mask);
+	}
+
+	return 0;
+}
+
+/**
+ * Prepare the PRPs of a command with a contiguous data buffer, on the device
+ *
+ * Same as nvme_request_prep_command_prps_contig_cuda(), with the translation done via the LUT,
+ * and an eventual PRP list written to the list pages of the given CID; when the list does not fit
+ * in a page, then the last entry of the page points to the next page of the CID.
+ *
+ * @param lut The LUT covering dbuf
+ * @param lists The list pages
+ * @param cid The CID of the command
+ * @param dbuf Pointer to the data buffer; only the first page may have an offset
+ * @param dbuf_nbytes Size in bytes of the data buffer
+ * @param cmd Pointer to the NVMe command to be prepared with PRP entries
+ *
+ * @return On success 0 is returned. When a page of dbuf is not in the LUT, then -EINVAL is
+ *         returned; when the list needs more than the pages of a CID, then -E2BIG.
+ */
+static inline __device__ int
+nvme_request_cuda_prep_command_prps(const struct nvme_request_cuda_lut *lut,
+				    const struct nvme_request_cuda_lists *lists, uint16_t cid,
+				    void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd)
+{
+	const uint64_t pagesize = lists->pagesize;
+	const uint32_t cap = lists->pagesize / sizeof(uint64_t);
+	uint64_t page_off, npages, nentries, addr, contig;
+	uint8_t *virt;
+	uint32_t page = 0, idx = 0;
+	uint64_t *list;
+	int err;
+
+	err = nvme_request_cuda_lut_vtp(lut, dbuf, &cmd->prp1, NULL);
+	if (err) {
+		return err;
+	}
+
+	page_off = cmd->prp1 & (pagesize - 1);
+	npages = (page_off + dbuf_nbytes + pagesize - 1) >> lists->pagesize_shift;
+	virt = (uint8_t *)dbuf - page_off + pagesize;
+
+	if (npages == 1) {
+		return 0;
+	}
+	if (npages == 2) {
+		return nvme_request_cuda_lut_vtp(lut, virt, &cmd->prp2, NULL);
+	}
+
+	// Each page but the last loses an entry to the chain pointer
+	nentries = npages - 1;
+	if (nentries > (uint64_t)lists->npages * (cap - 1) + 1) {
+		return -E2BIG;
+	}
+
+	page = cid * lists->npages;
+	list = (uint64_t *)(lists->virt + ((size_t)page << lists->pagesize_shift));
+	cmd->prp2 = lists->phys[page];
+
+	contig = 0;
+	for (uint64_t i = 0; i < nentries; ++i) {
+		if (!contig) {
+			err = nvme_request_cuda_lut_vtp(lut, virt, &addr, &contig);
+			if (err) {
+				return err;
+			}
+		}
+
+		if (idx == cap - 1 && i + 1 < nentries) {
+			page++;
+			list[idx] = lists->phys[page];
+			list = (uint64_t *)(lists->virt + ((size_t)page << lists->pagesize_shift));
+			idx = 0;
+		}
+		list[idx++] = addr;
+
+		virt += pagesize;
+		addr += pagesize;
+		contig = contig > pagesize ? contig - pagesize : 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Prepare the SGL of a command with a contiguous data buffer, on the device
+ *
+ * Same as nvme_request_prep_command_sgl_contig_cuda(), with the translation done via the LUT;
+ * physically adjacent entries are merged into one data block descriptor. A single descriptor is
+ * embedded in the command; several are written to the first list page of the given CID, and
+ * referenced via a last segment descriptor.
+ *
+ * @return On success 0 is returned. When a part of dbuf is not in the LUT, then -EINVAL is
+ *         returned; when more descriptors are needed than fit in a page, then -E2BIG.
+ */
+static inline __device__ int
+nvme_request_cuda_prep_command_sgl(const struct nvme_request_cuda_lut *lut,
+				   const struct nvme_request_cuda_lists *lists, uint16_t cid,
+				   void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd)
+{
+	const uint32_t page = cid * lists->npages;
+	const int max = lists->pagesize / sizeof(struct nvme_sgl_desc);
+	struct nvme_sgl_desc *descs;
+	struct nvme_sgl_desc sgl1;
+	uint8_t *cur = (uint8_t *)dbuf;
+	int ndescs = 0;
+
+	descs = (struct nvme_sgl_desc *)(lists->virt + ((size_t)page << lists->pagesize_shift));
+	memset(&sgl1, 0, sizeof(sgl1));
+
+	while (dbuf_nbytes) {
+		uint64_t addr, len;
+		int err;
+
+		err = nvme_request_cuda_lut_vtp(lut, cur, &addr, &len);
+		if (err) {
+			return err;
+		}
+		if (len > dbuf_nbytes) {
+			len = dbuf_nbytes;
+		}
+		if (len > UINT32_MAX) {
+			len = (uint64_t)1 << 31;
+		}
+
+		if (ndescs && (descs[ndescs - 1].addr + descs[ndescs - 1].len == addr) &&
+		    ((uint64_t)descs[ndescs - 1].len + len <= UINT32_MAX)) {
+			descs[ndescs - 1].len += len;
+		} else {
+			if (ndescs == max) {
+				return -E2BIG;
+			}
+			memset(&descs[ndescs], 0, sizeof(*descs));
+			descs[ndescs].addr = addr;
+			descs[ndescs].len = len;
+			descs[ndescs].type = NVME_SGL_TYPE_DATA_BLOCK << 4;
+			ndescs++;
+		}
+
+		cur += len;
+		dbuf_nbytes -= len;
+	}
+	if (!ndescs) {
+		return -EINVAL;
+	}
+
+	if (ndescs == 1) {
+		sgl1 = descs[0];
+	} else {
+		sgl1.addr = lists->phys[page];
+		sgl1.len = ndescs * sizeof(*descs);
+		sgl1.type = NVME_SGL_TYPE_LAST_SEGMENT << 4;
+	}
+
+	cmd->fuse = (cmd->fuse & 0x3F) | (NVME_COMMAND_PSDT_SGL << 6);
+	memcpy(&cmd->prp1, &sgl1, sizeof(sgl1));
+
+	return 0;
+}
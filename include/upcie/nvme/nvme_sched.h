@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Routing of commands to qpairs by priority class
+ * ===============================================
+ *
+ * A 'struct nvme_sched' holds the I/O qpairs of a thread grouped by their priority class, that is,
+ * nvme_qpair->qprio, as created via nvme_io_qpair_opts->qprio. Commands are submitted with a
+ * class, e.g. NVME_QPAIR_QPRIO_URGENT for latency-critical reads and NVME_QPAIR_QPRIO_LOW for bulk
+ * writes, and go to a qpair of that class, round-robin among them, skipping qpairs which are full.
+ * Thus, background commands never occupy the SQ slots of the foreground commands, and, under
+ * Weighted Round Robin, see nvme_controller_wrr_enable(), the controller serves the classes by
+ * their weights. Under plain Round Robin the classes still do not share SQs.
+ *
+ * When no qpair has the class of a command, then the command goes to the nearest class with
+ * qpairs, of lower priority first, and then of higher priority. As for the qpairs, the scheduler
+ * is single-threaded.
+ *
+ * @file nvme_sched.h
+ * @version 0.4.4
+ */
+
+#define NVME_SCHED_NCLASSES 4
+#define NVME_SCHED_QPAIRS_MAX 16 ///< Qpairs per class
+
+struct nvme_sched {
+	struct nvme_qpair *qpairs[NVME_SCHED_NCLASSES][NVME_SCHED_QPAIRS_MAX];
+	uint16_t nqpairs[NVME_SCHED_NCLASSES]; ///< Number of qpairs of each class
+	uint16_t next[NVME_SCHED_NCLASSES];    ///< Qpair of each class to submit to next
+	uint8_t route[NVME_SCHED_NCLASSES];    ///< Class whose qpairs take the commands of a class
+	uint64_t nsubmitted[NVME_SCHED_NCLASSES]; ///< Commands submitted by class, as requested
+};
+
+static inline int
+nvme_sched_pr(struct nvme_sched *sched)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_sched:\n");
+	for (int class = 0; class < NVME_SCHED_NCLASSES; ++class) {
+		wrtn += printf("  - class: %d\n", class);
+		wrtn += printf("    nqpairs: %" PRIu16 "\n", sched->nqpairs[class]);
+		wrtn += printf("    route: %" PRIu8 "\n", sched->route[class]);
+		wrtn += printf("    nsubmitted: %" PRIu64 "\n", sched->nsubmitted[class]);
+	}
+
+	return wrtn;
+}
+
+static inline void
+nvme_sched_init(struct nvme_sched *sched)
+{
+	memset(sched, 0, sizeof(*sched));
+	for (int class = 0; class < NVME_SCHED_NCLASSES; ++class) {
+		sched->route[class] = class;
+	}
+}
+
+/**
+ * Add the qpair to the class of its nvme_qpair->qprio
+ *
+ * @return On success 0 is returned. When the class is full, -ENOSPC is returned.
+ */
+static inline int
+nvme_sched_add(struct nvme_sched *sched, struct nvme_qpair *qpair)
+{
+	int class = qpair->qprio & 0x3;
+
+	if (sched->nqpairs[class] == NVME_SCHED_QPAIRS_MAX) {
+		return -ENOSPC;
+	}
+	sched->qpairs[class][sched->nqpairs[class]++] = qpair;
+
+	// Route each class to itself when it has qpairs, else to the nearest, lower priority first
+	for (int want = 0; want < NVME_SCHED_NCLASSES; ++want) {
+		for (int dist = 0; dist < NVME_SCHED_NCLASSES; ++dist) {
+			if (want + dist < NVME_SCHED_NCLASSES && sched->nqpairs[want + dist]) {
+				sched->route[want] = want + dist;
+				break;
+			}
+			if (want - dist >= 0 && sched->nqpairs[want - dist]) {
+				sched->route[want] = want - dist;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the qpair a command of `class` is to be submitted to, or NULL when there is none
+ *
+ * The qpairs of the class are taken round-robin; a qpair whose SQ is full is skipped.
+ */
+static inline struct nvme_qpair *
+nvme_sched_qpair(struct nvme_sched *sched, int class)
+{
+	int route = sched->route[class & 0x3];
+	uint16_t n = sched->nqpairs[route];
+
+	for (uint16_t i = 0; i < n; ++i) {
+		struct nvme_qpair *qp = sched->qpairs[route][sched->next[route]];
+
+		sched->next[route] = (sched->next[route] + 1) % n;
+		if ((qp->tail + 1) % qp->depth != qp->sqhd) {
+			return qp;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Submit a command with a contiguous PRP payload to a qpair of `class`; nvme_sched_qpair()
+ *
+ * Same as nvme_qpair_submit_async_contig_prps(), on the qpair chosen for the class.
+ *
+ * @return On success 0 is returned. When no qpair for the class has room, -EBUSY is returned. On
+ *         other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_sched_submit_contig_prps(struct nvme_sched *sched, int class, struct hostmem_heap *heap,
+			      void *dbuf, size_t dbuf_nbytes, struct nvme_command *cmd,
+			      nvme_request_cb cb, void *user)
+{
+	struct nvme_qpair *qp = nvme_sched_qpair(sched, class);
+	int err;
+
+	if (!qp) {
+		return -EBUSY;
+	}
+
+	err = nvme_qpair_submit_async_contig_prps(qp, heap, dbuf, dbuf_nbytes, cmd, cb, user);
+	if (err) {
+		return err;
+	}
+	sched->nsubmitted[class & 0x3] += 1;
+
+	return 0;
+}
+
+/**
+ * Process the completions of the qpairs, those of the higher priority classes first
+ *
+ * @return The number of completions processed.
+ */
+static inline int
+nvme_sched_process_completions(struct nvme_sched *sched)
+{
+	int nreaped = 0;
+
+	for (int class = 0; class < NVME_SCHED_NCLASSES; ++class) {
+		for (uint16_t i = 0; i < sched->nqpairs[class]; ++i) {
+			nreaped += nvme_qpair_process_completions(sched->qpairs[class][i], 0);
+		}
+	}
+
+	return nreaped;
+}
@@ -0,0 +1,662 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Shared-memory submission rings served by a qpair-owning process
+ * ================================================================
+ *
+ * Opening a controller, and building the physical addresses of a heap, requires privileges; a
+ * heap can however be imported, via hostmem_heap_import(), by processes without them. A
+ * 'struct nvme_service' lets a privileged process, the daemon, own the controller and its I/O
+ * qpairs, and serve the I/O of other processes, the clients, via rings in a heap shared with them:
+ *
+ * - The daemon calls nvme_service_init() with a namespace, its qpairs and the shared heap; the
+ *   rings, and a 'struct nvme_service_desc' describing them, are allocated in the shared heap.
+ *   The path of the heap, and the offset of the description, nvme_service_offset(), are then
+ *   given to the clients, via whatever means, e.g. the command line, or a socket. The daemon
+ *   calls nvme_service_poll() in a loop.
+ * - A client imports the heap, attaches to a free ring with nvme_service_client_attach(), and
+ *   allocates its I/O buffers from the heap, via hostmem_dma_malloc(). It enqueues requests of
+ *   Read, Write, Write Zeroes and Flush, as a 'struct nvme_service_sqe' holding the offset of its
+ *   buffer in the heap, publishes a batch with nvme_service_client_flush(), and reaps the
+ *   completions with nvme_service_client_reap().
+ *
+ * Each ring is a pair of single-producer, single-consumer rings, a submission ring written by the
+ * client and a completion ring written by the daemon, with the indices on cache-lines of their
+ * own. The daemon takes the requests of a ring in batches, builds NVMe commands of them, with the
+ * PRPs pointing at the buffers of the client, and writes the SQ doorbell once per qpair and poll;
+ * the data is never copied. The completions are written to the completion ring of the client,
+ * with the tag of the request. Requests are validated by the daemon, that is, the opcode, the
+ * range of logical blocks against the namespace, and the buffer against the heap and the
+ * transfer size; an invalid request is completed with NVME_SERVICE_SC_INVALID_FIELD, or
+ * NVME_SERVICE_SC_LBA_RANGE, without reaching the controller.
+ *
+ * The rings are shared in memory only, there is no notification; the daemon and the clients
+ * poll. The daemon assigns the qpairs to the rings round-robin, and takes no more requests from a
+ * ring than its completion ring has room for, thus, a client cannot make the daemon overrun it.
+ * The layout of the rings, that is, their number, location and depth, is kept by the daemon in
+ * 'struct nvme_service', and never read back from the shared heap, where clients may corrupt it.
+ *
+ * Caveat: isolation
+ * -----------------
+ *
+ * The clients can read and write all of the shared heap. Thus, create the qpairs in a heap of the
+ * daemon alone, the heap of the controller, and give nvme_service_init() another heap, shared
+ * with the clients, which must be reachable by the controller as well, e.g. via vfio_map_heap().
+ * When the heap of the controller is shared instead, then the clients are trusted with its
+ * queues.
+ *
+ * @file nvme_service.h
+ * @version 0.4.4
+ */
+
+#define NVME_SERVICE_MAGIC 0x3176726573656d76ULL ///< "vmeserv1"
+#define NVME_SERVICE_RINGS_MAX 64
+
+#define NVME_SERVICE_SC_INVALID_FIELD 0x02 ///< Generic; Invalid Field in Command
+#define NVME_SERVICE_SC_LBA_RANGE 0x80     ///< Generic; LBA Out of Range
+
+/**
+ * A request, as written by the client to its submission ring
+ */
+struct nvme_service_sqe {
+	uint64_t tag;  ///< Handed back in the completion; opaque to the daemon
+	uint64_t slba; ///< Starting logical block
+	uint64_t buf;  ///< Offset of the buffer in the shared heap; unused by Flush, Write Zeroes
+	uint32_t nlb;  ///< Number of logical blocks, 1-based; at most 'max_nlb'
+	uint8_t opc;   ///< 0x0: Flush, 0x1: Write, 0x2: Read, 0x8: Write Zeroes
+	uint8_t rsvd[3];
+};
+
+/**
+ * A completion, as written by the daemon to the completion ring of the client
+ */
+struct nvme_service_cqe {
+	uint64_t tag;    ///< The tag of the request
+	uint32_t cdw0;   ///< Dword 0 of the NVMe completion
+	uint16_t status; ///< Status Field of the NVMe completion, without the phase tag; 0: success
+	uint16_t rsvd;
+};
+
+/**
+ * A ring of a client, in the shared heap; followed by the 'depth' entries of each ring
+ */
+struct nvme_service_ring {
+	uint32_t sq_tail __attribute__((aligned(64))); ///< Written by the client
+	uint32_t cq_head;                              ///< Written by the client
+	uint32_t sq_head __attribute__((aligned(64))); ///< Written by the daemon
+	uint32_t cq_tail;                              ///< Written by the daemon
+	uint32_t owner __attribute__((aligned(64)));   ///< pid of the client attached; 0: free
+	uint32_t depth;                                ///< Entries of each ring; a power of two
+};
+
+/**
+ * The description of the service, in the shared heap; its offset is given to the clients
+ */
+struct nvme_service_desc {
+	uint64_t magic;  ///< NVME_SERVICE_MAGIC, set once the rings are initialized
+	uint64_t nsze;   ///< Namespace Size, in logical blocks
+	uint32_t nsid;   ///< The namespace served
+	uint32_t nrings; ///< Number of rings
+	uint32_t depth;  ///< Entries of each ring
+	uint32_t max_nlb;
+	uint32_t xfer_nbytes; ///< Bytes of a logical block in the buffers
+	uint32_t rsvd;
+	uint64_t rings[NVME_SERVICE_RINGS_MAX]; ///< Offset of each ring in the shared heap
+};
+
+struct nvme_service;
+
+/**
+ * Per command in flight; indexed by qpair, and cid
+ */
+struct nvme_service_ctx {
+	struct nvme_service *svc;
+	uint64_t tag;
+	uint32_t ring;
+};
+
+/**
+ * The daemon side of the service; in the memory of the daemon
+ */
+struct nvme_service {
+	struct nvme_namespace *ns;      ///< The namespace served
+	struct nvme_qpair *qpairs;      ///< The qpairs of the daemon; one per ring at most
+	uint16_t nqpairs;               ///< Number of qpairs
+	struct hostmem_heap *heap;      ///< The heap shared with the clients
+	struct nvme_service_desc *desc; ///< In the shared heap
+	struct nvme_service_ctx **ctxs; ///< Per qpair, an entry per cid
+	uint64_t nsubmitted;            ///< Commands submitted on behalf of the clients
+	uint64_t nrejected;             ///< Requests completed as invalid by the daemon
+
+	struct nvme_service_ring *rings[NVME_SERVICE_RINGS_MAX]; ///< The rings, as allocated
+	uint32_t nrings; ///< Number of rings; the copy in 'desc' is for the clients
+	uint32_t depth;  ///< Entries of each ring; the copies in the rings are for the clients
+
+	uint32_t inflight[NVME_SERVICE_RINGS_MAX]; ///< Commands of each ring on the controller
+};
+
+/**
+ * The client side of the service; in the memory of the client
+ */
+struct nvme_service_client {
+	struct hostmem_heap *heap;      ///< The imported heap
+	struct nvme_service_desc *desc; ///< The description, in the imported heap
+	struct nvme_service_ring *ring; ///< The ring attached to
+	struct nvme_service_sqe *sqes;
+	struct nvme_service_cqe *cqes;
+	uint32_t idx;     ///< Index of the ring
+	uint32_t mask;    ///< Entries of each ring - 1
+	uint32_t sq_tail; ///< Tail of the requests enqueued, published by the flush
+	uint32_t cq_head; ///< Head of the completions reaped
+};
+
+static inline struct nvme_service_ring *
+nvme_service_ring_at(struct hostmem_heap *heap, struct nvme_service_desc *desc, uint32_t idx)
+{
+	return (struct nvme_service_ring *)((char *)heap->memory.virt + desc->rings[idx]);
+}
+
+static inline struct nvme_service_sqe *
+nvme_service_ring_sqes(struct nvme_service_ring *ring)
+{
+	return (struct nvme_service_sqe *)(ring + 1);
+}
+
+static inline struct nvme_service_cqe *
+nvme_service_ring_cqes(struct nvme_service_ring *ring, uint32_t depth)
+{
+	return (struct nvme_service_cqe *)(nvme_service_ring_sqes(ring) + depth);
+}
+
+static inline int
+nvme_service_pr(struct nvme_service *svc)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_service:\n");
+	wrtn += printf("  nsid: %" PRIu32 "\n", svc->ns->nsid);
+	wrtn += printf("  nrings: %" PRIu32 "\n", svc->nrings);
+	wrtn += printf("  depth: %" PRIu32 "\n", svc->depth);
+	wrtn += printf("  nqpairs: %" PRIu16 "\n", svc->nqpairs);
+	wrtn += printf("  nsubmitted: %" PRIu64 "\n", svc->nsubmitted);
+	wrtn += printf("  nrejected: %" PRIu64 "\n", svc->nrejected);
+	wrtn += printf("  rings:\n");
+	for (uint32_t i = 0; i < svc->nrings; ++i) {
+		wrtn += printf("  - {owner: %" PRIu32 ", inflight: %" PRIu32 "}\n",
+			       __atomic_load_n(&svc->rings[i]->owner, __ATOMIC_RELAXED),
+			       svc->inflight[i]);
+	}
+
+	return wrtn;
+}
+
+/**
+ * Returns the offset of the description in the shared heap; given to nvme_service_client_attach()
+ */
+static inline uint64_t
+nvme_service_offset(struct nvme_service *svc)
+{
+	return (uint64_t)((char *)svc->desc - (char *)svc->heap->memory.virt);
+}
+
+static inline void
+nvme_service_term(struct nvme_service *svc)
+{
+	if (svc->desc) {
+		__atomic_store_n(&svc->desc->magic, 0, __ATOMIC_RELEASE);
+		hostmem_dma_free(svc->heap, svc->desc);
+		svc->desc = NULL;
+	}
+	for (uint32_t i = 0; i < svc->nrings; ++i) {
+		hostmem_dma_free(svc->heap, svc->rings[i]);
+		svc->rings[i] = NULL;
+	}
+	svc->nrings = 0;
+	if (svc->ctxs) {
+		for (uint16_t q = 0; q < svc->nqpairs; ++q) {
+			free(svc->ctxs[q]);
+		}
+		free(svc->ctxs);
+		svc->ctxs = NULL;
+	}
+}
+
+/**
+ * Initialize the service, with `nrings` rings of `depth` entries each, in the shared `heap`
+ *
+ * @param svc The service to initialize
+ * @param ns The namespace to serve
+ * @param qpairs I/O qpairs of the controller of the namespace, used by the service alone
+ * @param nqpairs Number of qpairs
+ * @param heap The heap shared with the clients, e.g. with a path readable by them
+ * @param nrings Number of rings, that is, of clients attached at a time; at most
+ *               NVME_SERVICE_RINGS_MAX
+ * @param depth Entries of each ring; a power of two
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_service_init(struct nvme_service *svc, struct nvme_namespace *ns, struct nvme_qpair *qpairs,
+		  uint16_t nqpairs, struct hostmem_heap *heap, uint32_t nrings, uint32_t depth)
+{
+	size_t entry_nbytes = sizeof(struct nvme_service_sqe) + sizeof(struct nvme_service_cqe);
+	size_t ring_nbytes = sizeof(struct nvme_service_ring) + depth * entry_nbytes;
+	struct nvme_service_desc *desc;
+
+	if (!nqpairs || nqpairs > NVME_SERVICE_RINGS_MAX || !nrings ||
+	    nrings > NVME_SERVICE_RINGS_MAX || depth < 2 || (depth & (depth - 1))) {
+		return -EINVAL;
+	}
+
+	memset(svc, 0, sizeof(*svc));
+	svc->ns = ns;
+	svc->qpairs = qpairs;
+	svc->nqpairs = nqpairs;
+	svc->heap = heap;
+	svc->depth = depth;
+
+	svc->ctxs = calloc(nqpairs, sizeof(*svc->ctxs));
+	if (!svc->ctxs) {
+		UPCIE_DEBUG("FAILED: calloc(ctxs); errno(%d)", errno);
+		return -errno;
+	}
+	for (uint16_t q = 0; q < nqpairs; ++q) {
+		svc->ctxs[q] = calloc(qpairs[q].rpool->len, sizeof(**svc->ctxs));
+		if (!svc->ctxs[q]) {
+			UPCIE_DEBUG("FAILED: calloc(ctxs[%" PRIu16 "]); errno(%d)", q, errno);
+			nvme_service_term(svc);
+			return -ENOMEM;
+		}
+	}
+
+	desc = hostmem_dma_malloc(heap, sizeof(*desc));
+	if (!desc) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(desc); errno(%d)", errno);
+		nvme_service_term(svc);
+		return -ENOMEM;
+	}
+	memset(desc, 0, sizeof(*desc));
+	desc->nsze = ns->nsze;
+	desc->nsid = ns->nsid;
+	desc->depth = depth;
+	desc->max_nlb = ns->max_nlb;
+	desc->xfer_nbytes = ns->xfer_nbytes;
+
+	for (uint32_t i = 0; i < nrings; ++i) {
+		struct nvme_service_ring *ring = hostmem_dma_malloc(heap, ring_nbytes);
+
+		if (!ring) {
+			UPCIE_DEBUG("FAILED: hostmem_dma_malloc(ring); errno(%d)", errno);
+			svc->desc = desc;
+			nvme_service_term(svc);
+			return -ENOMEM;
+		}
+		memset(ring, 0, ring_nbytes);
+		ring->depth = depth;
+
+		svc->rings[i] = ring;
+		svc->nrings = i + 1;
+		desc->rings[i] = (uint64_t)((char *)ring - (char *)heap->memory.virt);
+		desc->nrings = i + 1;
+	}
+	svc->desc = desc;
+
+	// Publish the rings to clients
+	__atomic_store_n(&desc->magic, NVME_SERVICE_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static inline void
+nvme_service_cqe_post(struct nvme_service *svc, uint32_t idx, uint64_t tag, uint32_t cdw0,
+		      uint16_t status)
+{
+	struct nvme_service_ring *ring = svc->rings[idx];
+	struct nvme_service_cqe *cqes = nvme_service_ring_cqes(ring, svc->depth);
+	uint32_t tail = ring->cq_tail;
+	struct nvme_service_cqe *cqe = &cqes[tail & (svc->depth - 1)];
+
+	cqe->tag = tag;
+	cqe->cdw0 = cdw0;
+	cqe->status = status;
+	__atomic_store_n(&ring->cq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+nvme_service_cb(struct nvme_completion *cpl, void *user)
+{
+	struct nvme_service_ctx *ctx = user;
+
+	ctx->svc->inflight[ctx->ring] -= 1;
+	nvme_service_cqe_post(ctx->svc, ctx->ring, ctx->tag, cpl->cdw0, cpl->status >> 1);
+}
+
+/**
+ * Returns the status a request is to be rejected with, without reaching the controller; or 0
+ */
+static inline uint16_t
+nvme_service_sqe_check(struct nvme_service *svc, struct nvme_service_sqe *sqe)
+{
+	struct nvme_namespace *ns = svc->ns;
+	uint64_t nbytes;
+
+	switch (sqe->opc) {
+	case 0x0: ///< Flush
+		return 0;
+	case 0x1: ///< Write
+	case 0x2: ///< Read
+	case 0x8: ///< Write Zeroes
+		break;
+	default:
+		return NVME_SERVICE_SC_INVALID_FIELD;
+	}
+
+	if (!sqe->nlb || sqe->nlb > ns->max_nlb) {
+		return NVME_SERVICE_SC_INVALID_FIELD;
+	}
+	if (sqe->slba >= ns->nsze || sqe->nlb > ns->nsze - sqe->slba) {
+		return NVME_SERVICE_SC_LBA_RANGE;
+	}
+
+	nbytes = (uint64_t)sqe->nlb * ns->xfer_nbytes;
+	if (sqe->opc != 0x8 && (sqe->buf > svc->heap->memory.size ||
+				nbytes > svc->heap->memory.size - sqe->buf || (sqe->buf & 0x3))) {
+		return NVME_SERVICE_SC_INVALID_FIELD;
+	}
+
+	return 0;
+}
+
+/**
+ * Take the requests of the ring `idx`, as many as fit the qpair and the completion ring
+ *
+ * @return The number of commands enqueued on the qpair; the SQ doorbell is not written.
+ */
+static inline int
+nvme_service_ring_take(struct nvme_service *svc, uint32_t idx)
+{
+	struct nvme_service_ring *ring = svc->rings[idx];
+	struct nvme_service_sqe *sqes = nvme_service_ring_sqes(ring);
+	uint16_t q = idx % svc->nqpairs;
+	struct nvme_qpair *qp = &svc->qpairs[q];
+	uint32_t mask = svc->depth - 1;
+	uint32_t head = ring->sq_head;
+	uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+	int ncmds = 0;
+
+	while (head != tail) {
+		uint32_t cq_head = __atomic_load_n(&ring->cq_head, __ATOMIC_RELAXED);
+		struct nvme_service_sqe sqe = sqes[head & mask]; ///< Copied, as the client may race
+		struct nvme_service_ctx *ctx;
+		struct nvme_request *req;
+		struct nvme_command cmd;
+		uint16_t status;
+		int err;
+
+		// Completions in flight, and those not yet reaped, must fit the completion ring
+		if (svc->inflight[idx] + (ring->cq_tail - cq_head) >= svc->depth) {
+			break;
+		}
+
+		status = nvme_service_sqe_check(svc, &sqe);
+		if (status) {
+			nvme_service_cqe_post(svc, idx, sqe.tag, 0, status);
+			svc->nrejected++;
+			head++;
+			continue;
+		}
+
+		req = nvme_request_alloc(qp->rpool);
+		if (!req) {
+			break;
+		}
+		ctx = &svc->ctxs[q][req->cid];
+		ctx->svc = svc;
+		ctx->tag = sqe.tag;
+		ctx->ring = idx;
+		req->cb = nvme_service_cb;
+		req->user = ctx;
+
+		if (sqe.opc) {
+			nvme_namespace_prep(svc->ns, &cmd, sqe.opc, sqe.slba, sqe.nlb);
+		} else {
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.nsid = svc->ns->nsid;
+		}
+		cmd.cid = req->cid;
+
+		err = 0;
+		if (sqe.opc == 0x1 || sqe.opc == 0x2) {
+			err = nvme_request_prep_command_prps_contig(
+				req, svc->heap, (char *)svc->heap->memory.virt + sqe.buf,
+				(size_t)sqe.nlb * svc->ns->xfer_nbytes, &cmd);
+		}
+		if (!err) {
+			err = nvme_qpair_enqueue(qp, &cmd);
+		}
+		if (err) {
+			nvme_request_free(qp->rpool, req->cid);
+			break;
+		}
+
+		svc->inflight[idx] += 1;
+		svc->nsubmitted++;
+		ncmds++;
+		head++;
+	}
+	__atomic_store_n(&ring->sq_head, head, __ATOMIC_RELEASE);
+
+	return ncmds;
+}
+
+/**
+ * Take the requests of all rings, write the SQ doorbell of each qpair once, and process the
+ * completions; the daemon calls this in a loop
+ *
+ * @return The number of requests taken, and completions processed.
+ */
+static inline int
+nvme_service_poll(struct nvme_service *svc)
+{
+	uint64_t dirty = 0;
+	int nwork = 0;
+
+	for (uint32_t i = 0; i < svc->nrings; ++i) {
+		int ncmds = nvme_service_ring_take(svc, i);
+
+		if (ncmds) {
+			dirty |= 1ULL << (i % svc->nqpairs);
+			nwork += ncmds;
+		}
+	}
+
+	for (uint16_t q = 0; q < svc->nqpairs; ++q) {
+		if (dirty & (1ULL << q)) {
+			nvme_qpair_sqdb_update(&svc->qpairs[q]);
+		}
+		nwork += nvme_qpair_process_completions(&svc->qpairs[q], 0);
+	}
+
+	return nwork;
+}
+
+/**
+ * Release the ring `idx`, of a client which exited without detaching
+ *
+ * @return On success 0 is returned. When commands of the ring are in flight, -EBUSY is returned.
+ */
+static inline int
+nvme_service_evict(struct nvme_service *svc, uint32_t idx)
+{
+	struct nvme_service_ring *ring;
+
+	if (idx >= svc->nrings) {
+		return -EINVAL;
+	}
+	if (svc->inflight[idx]) {
+		return -EBUSY;
+	}
+
+	ring = svc->rings[idx];
+	ring->sq_tail = 0;
+	ring->cq_head = 0;
+	ring->sq_head = 0;
+	ring->cq_tail = 0;
+	__atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Attach to a free ring of the service described at `offset` of the imported `heap`
+ *
+ * @param client The client to initialize
+ * @param heap The shared heap, as imported by hostmem_heap_import()
+ * @param offset Offset of the description in the heap; as given by nvme_service_offset()
+ *
+ * @return On success 0 is returned. When `offset` does not hold a service, -EINVAL is returned,
+ *         and when all rings are attached to, -EBUSY.
+ */
+static inline int
+nvme_service_client_attach(struct nvme_service_client *client, struct hostmem_heap *heap,
+			   uint64_t offset)
+{
+	struct nvme_service_desc *desc;
+
+	if (offset > heap->memory.size - sizeof(*desc)) {
+		return -EINVAL;
+	}
+	desc = (struct nvme_service_desc *)((char *)heap->memory.virt + offset);
+	if (__atomic_load_n(&desc->magic, __ATOMIC_ACQUIRE) != NVME_SERVICE_MAGIC) {
+		UPCIE_DEBUG("FAILED: offset(%" PRIu64 ") does not hold a service", offset);
+		return -EINVAL;
+	}
+
+	memset(client, 0, sizeof(*client));
+	for (uint32_t i = 0; i < desc->nrings; ++i) {
+		struct nvme_service_ring *ring = nvme_service_ring_at(heap, desc, i);
+		uint32_t none = 0;
+
+		if (!__atomic_compare_exchange_n(&ring->owner, &none, (uint32_t)getpid(), 0,
+						 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		client->heap = heap;
+		client->desc = desc;
+		client->ring = ring;
+		client->sqes = nvme_service_ring_sqes(ring);
+		client->cqes = nvme_service_ring_cqes(ring, ring->depth);
+		client->idx = i;
+		client->mask = ring->depth - 1;
+		client->sq_tail = ring->sq_tail;
+		client->cq_head = ring->cq_head;
+
+		return 0;
+	}
+
+	return -EBUSY;
+}
+
+/**
+ * Release the ring; once the completions of all requests are reaped
+ */
+static inline void
+nvme_service_client_detach(struct nvme_service_client *client)
+{
+	if (!client->ring) {
+		return;
+	}
+	__atomic_store_n(&client->ring->owner, 0, __ATOMIC_RELEASE);
+	client->ring = NULL;
+}
+
+/**
+ * Enqueue a request; it is published to the daemon by nvme_service_client_flush()
+ *
+ * @param client The client
+ * @param opc 0x0: Flush, 0x1: Write, 0x2: Read, 0x8: Write Zeroes
+ * @param slba Starting logical block
+ * @param nlb Number of logical blocks, 1-based; at most desc->max_nlb
+ * @param buf Buffer allocated from the shared heap, of `nlb` logical blocks; NULL if unused
+ * @param tag Handed back in the completion
+ *
+ * @return On success 0 is returned. When the ring has no room, accounting for completions not
+ *         yet reaped, -EBUSY is returned; when `buf` is not in the shared heap, -EINVAL.
+ */
+static inline int
+nvme_service_client_enqueue(struct nvme_service_client *client, uint8_t opc, uint64_t slba,
+			    uint32_t nlb, void *buf, uint64_t tag)
+{
+	struct nvme_service_sqe *sqe;
+	char *virt = client->heap->memory.virt;
+
+	if (client->sq_tail - client->cq_head > client->mask) {
+		return -EBUSY;
+	}
+	if (buf && ((char *)buf < virt || (char *)buf >= virt + client->heap->memory.size)) {
+		return -EINVAL;
+	}
+
+	sqe = &client->sqes[client->sq_tail & client->mask];
+	sqe->tag = tag;
+	sqe->slba = slba;
+	sqe->buf = buf ? (uint64_t)((char *)buf - virt) : 0;
+	sqe->nlb = nlb;
+	sqe->opc = opc;
+	client->sq_tail++;
+
+	return 0;
+}
+
+/**
+ * Publish the requests enqueued to the daemon
+ */
+static inline void
+nvme_service_client_flush(struct nvme_service_client *client)
+{
+	__atomic_store_n(&client->ring->sq_tail, client->sq_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Enqueue a request and publish it; see nvme_service_client_enqueue()
+ */
+static inline int
+nvme_service_client_submit(struct nvme_service_client *client, uint8_t opc, uint64_t slba,
+			   uint32_t nlb, void *buf, uint64_t tag)
+{
+	int err;
+
+	err = nvme_service_client_enqueue(client, opc, slba, nlb, buf, tag);
+	if (err) {
+		return err;
+	}
+	nvme_service_client_flush(client);
+
+	return 0;
+}
+
+/**
+ * Reap up to `max` completions, without waiting
+ *
+ * @return The number of completions reaped into `cqes`.
+ */
+static inline int
+nvme_service_client_reap(struct nvme_service_client *client, struct nvme_service_cqe *cqes,
+			 uint32_t max)
+{
+	uint32_t tail = __atomic_load_n(&client->ring->cq_tail, __ATOMIC_ACQUIRE);
+	uint32_t nreaped = 0;
+
+	while (client->cq_head != tail && nreaped < max) {
+		cqes[nreaped++] = client->cqes[client->cq_head & client->mask];
+		client->cq_head++;
+	}
+
+	if (nreaped) {
+		__atomic_store_n(&client->ring->cq_head, client->cq_head, __ATOMIC_RELEASE);
+	}
+
+	return nreaped;
+}
@@ -0,0 +1,485 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Striping of a logical volume over multiple controllers
+ * =======================================================
+ *
+ * A 'struct nvme_stripe' is a logical volume over the namespaces of up to
+ * NVME_STRIPE_MEMBERS_MAX controllers, laid out RAID-0 style: the volume is cut in stripe units,
+ * of 'unit_nbytes', which are assigned to the members round-robin. Thus, unit `u` of the volume is
+ * unit `u / nmembers` of member `u % nmembers`.
+ *
+ * nvme_stripe_io() splits an I/O of the volume into per-member commands, targeting offsets in a
+ * single buffer, and drives them concurrently: commands are submitted alternating between the
+ * members, in volume order within each member, over the qpairs given to each member. A member
+ * whose qpairs are full is skipped, and the others are filled, until all are full; then
+ * completions are processed on all qpairs, until the I/O is done. The SQ doorbell of a qpair is
+ * written once per batch of commands.
+ *
+ * The buffer is described by a 'struct nvme_stripe_buf', which couples the buffer with the heap
+ * it is allocated in, and a function preparing the PRPs of a command from it. This header provides
+ * nvme_stripe_buf_hostmem(), for buffers in a 'struct hostmem_heap'; nvme_stripe_cuda.h provides
+ * nvme_stripe_buf_cudamem(), for buffers in a 'struct cudamem_heap', thus, reading into GPU memory.
+ *
+ * The members are assumed to use the same logical block size; commands of a member are limited to
+ * the MDTS of its qpairs. Just as the qpairs it drives, then a stripe is not thread-safe.
+ *
+ * @file nvme_stripe.h
+ * @version 0.4.4
+ */
+
+#define NVME_STRIPE_MEMBERS_MAX 32
+
+/**
+ * Prepares the PRPs of `cmd` for the `nbytes` at `virt`, of a buffer allocated in `heap`
+ *
+ * @return On success 0 is returned. When the request pool has no more free PRP-list pages, then
+ *         -ENOMEM is returned. On other errors, negative errno is returned.
+ */
+typedef int (*nvme_stripe_prep_fn)(struct nvme_request *req, void *heap, void *virt,
+				   size_t nbytes, struct nvme_command *cmd);
+
+struct nvme_stripe_buf {
+	void *virt;               ///< The buffer; offset 0 of the buffer is offset 0 of the I/O
+	void *heap;               ///< The heap the buffer is allocated in
+	nvme_stripe_prep_fn prep; ///< Prepares the PRPs of a command from the buffer
+};
+
+struct nvme_stripe_member {
+	struct nvme_controller *ctrlr; ///< The controller
+	struct nvme_qpair *qpairs;     ///< I/O qpairs of the controller, used by the stripe
+	uint32_t nqpairs;              ///< Number of qpairs in 'qpairs'
+	uint32_t nsid;                 ///< The namespace of the member
+	uint32_t next;                 ///< The qpair the next command is submitted on
+	uint32_t rsvd;
+	uint64_t nunits;               ///< Number of stripe units of the member
+	uint64_t ncmds;                ///< Number of commands submitted to the member
+	uint64_t dirty; ///< A bit per qpair with commands submitted since the last doorbell
+};
+
+struct nvme_stripe {
+	struct nvme_stripe_member members[NVME_STRIPE_MEMBERS_MAX];
+	uint32_t nmembers;    ///< Number of members
+	uint32_t lba_nbytes;  ///< Logical block size of the members
+	uint64_t unit_nbytes; ///< Size of a stripe unit, in bytes
+	uint64_t nbytes;      ///< Size of the volume, in bytes
+};
+
+/**
+ * State of a single nvme_stripe_io(); see nvme_qpair_pipeline_run()
+ */
+struct nvme_stripe_io_ctx {
+	struct nvme_stripe *stripe;
+	struct nvme_stripe_buf *buf;
+	uint64_t offset;
+	size_t nbytes;
+	size_t nsubmitted; ///< Number of bytes enqueued
+	size_t cursor[NVME_STRIPE_MEMBERS_MAX]; ///< Per member: next byte of the I/O to enqueue
+	uint8_t opc;
+};
+
+static inline int
+nvme_stripe_pp(struct nvme_stripe *stripe)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_stripe:\n");
+	wrtn += printf("  unit_nbytes: %" PRIu64 "\n", stripe->unit_nbytes);
+	wrtn += printf("  lba_nbytes: %" PRIu32 "\n", stripe->lba_nbytes);
+	wrtn += printf("  nbytes: %" PRIu64 "\n", stripe->nbytes);
+	wrtn += printf("  members:\n");
+
+	for (uint32_t i = 0; i < stripe->nmembers; ++i) {
+		struct nvme_stripe_member *member = &stripe->members[i];
+
+		wrtn += printf("  - {bdf: '%s', nsid: %" PRIu32 ", nqpairs: %" PRIu32
+			       ", nunits: %" PRIu64 ", ncmds: %" PRIu64 "}\n",
+			       member->ctrlr->func.bdf, member->nsid, member->nqpairs,
+			       member->nunits, member->ncmds);
+	}
+
+	return wrtn;
+}
+
+static inline int
+nvme_stripe_prep_hostmem(struct nvme_request *req, void *heap, void *virt, size_t nbytes,
+			 struct nvme_command *cmd)
+{
+	return nvme_request_prep_command_prps_contig(req, (struct hostmem_heap *)heap, virt, nbytes,
+						     cmd);
+}
+
+/**
+ * Describe a buffer allocated in a 'struct hostmem_heap'
+ */
+static inline void
+nvme_stripe_buf_hostmem(struct nvme_stripe_buf *buf, struct hostmem_heap *heap, void *virt)
+{
+	buf->virt = virt;
+	buf->heap = heap;
+	buf->prep = nvme_stripe_prep_hostmem;
+}
+
+/**
+ * Initialize an empty stripe
+ *
+ * @param stripe The stripe to initialize
+ * @param unit_nbytes Size of a stripe unit; a power-of-two multiple of `lba_nbytes`, and of at
+ *                    least 4096 bytes, such that every unit but the first of an I/O starts at a
+ *                    page-aligned offset of the buffer
+ * @param lba_nbytes Logical block size of the members
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_stripe_init(struct nvme_stripe *stripe, uint64_t unit_nbytes, uint32_t lba_nbytes)
+{
+	memset(stripe, 0, sizeof(*stripe));
+
+	if (!lba_nbytes || (lba_nbytes & (lba_nbytes - 1)) || (unit_nbytes & (unit_nbytes - 1)) ||
+	    unit_nbytes < 4096 || unit_nbytes < lba_nbytes) {
+		UPCIE_DEBUG("FAILED: invalid unit_nbytes(%" PRIu64 ") or lba_nbytes(%" PRIu32 ")",
+			    unit_nbytes, lba_nbytes);
+		return -EINVAL;
+	}
+
+	stripe->unit_nbytes = unit_nbytes;
+	stripe->lba_nbytes = lba_nbytes;
+
+	return 0;
+}
+
+/**
+ * Add a member to the stripe
+ *
+ * The volume shrinks to a whole number of stripe units per member, of the smallest member, thus,
+ * members of differing sizes are supported, at the cost of the excess of the larger ones.
+ *
+ * @param stripe The stripe
+ * @param ctrlr An open controller
+ * @param qpairs I/O qpairs created on the controller; at least one, and at most 64
+ * @param nqpairs Number of qpairs in `qpairs`
+ * @param nsid The namespace to stripe over
+ * @param nlbas Number of logical blocks of the namespace to use
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_stripe_member_add(struct nvme_stripe *stripe, struct nvme_controller *ctrlr,
+		       struct nvme_qpair *qpairs, uint32_t nqpairs, uint32_t nsid, uint64_t nlbas)
+{
+	struct nvme_stripe_member *member;
+	uint64_t nunits = nlbas / (stripe->unit_nbytes / stripe->lba_nbytes);
+
+	if (stripe->nmembers == NVME_STRIPE_MEMBERS_MAX) {
+		UPCIE_DEBUG("FAILED: nmembers(%" PRIu32 ") == max", stripe->nmembers);
+		return -ENOSPC;
+	}
+	if (!qpairs || !nqpairs || nqpairs > 64 || !nunits) {
+		UPCIE_DEBUG("FAILED: nqpairs(%" PRIu32 ") or nunits(%" PRIu64 ")", nqpairs, nunits);
+		return -EINVAL;
+	}
+
+	member = &stripe->members[stripe->nmembers];
+	memset(member, 0, sizeof(*member));
+	member->ctrlr = ctrlr;
+	member->qpairs = qpairs;
+	member->nqpairs = nqpairs;
+	member->nsid = nsid;
+	member->nunits = nunits;
+	stripe->nmembers++;
+
+	for (uint32_t i = 0; i < stripe->nmembers; ++i) {
+		if (stripe->members[i].nunits < nunits) {
+			nunits = stripe->members[i].nunits;
+		}
+	}
+	stripe->nbytes = nunits * stripe->nmembers * stripe->unit_nbytes;
+
+	return 0;
+}
+
+/**
+ * Map an offset of the volume to a member, and an offset of the member
+ *
+ * @param stripe The stripe
+ * @param offset Offset of the volume, in bytes
+ * @param member Pointer to store the index of the member
+ * @param member_offset Pointer to store the offset in the member, in bytes
+ *
+ * @return The number of bytes from `offset` to the end of its stripe unit
+ */
+static inline uint64_t
+nvme_stripe_map(struct nvme_stripe *stripe, uint64_t offset, uint32_t *member,
+		uint64_t *member_offset)
+{
+	const uint64_t unit = offset / stripe->unit_nbytes;
+	const uint64_t unit_offset = offset & (stripe->unit_nbytes - 1);
+
+	*member = unit % stripe->nmembers;
+	*member_offset = (unit / stripe->nmembers) * stripe->unit_nbytes + unit_offset;
+
+	return stripe->unit_nbytes - unit_offset;
+}
+
+/**
+ * Submit a command on the next qpair of the member, without writing the SQ doorbell
+ *
+ * @return On success 0 is returned. When the qpair, its request pool, or PRP-list pages are
+ *         exhausted, then -EBUSY. On other errors, negative errno is returned.
+ */
+static inline int
+nvme_stripe_member_submit(struct nvme_stripe_member *member, struct nvme_stripe_buf *buf,
+			  void *virt, size_t nbytes, struct nvme_command *cmd,
+			  struct nvme_qpair_pipeline *pl)
+{
+	uint32_t idx = member->next;
+	struct nvme_qpair *qp = &member->qpairs[idx];
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_qpair_pipeline_request(pl, qp);
+	if (!req) {
+		return -EBUSY;
+	}
+	cmd->cid = req->cid;
+
+	err = buf->prep(req, buf->heap, virt, nbytes, cmd);
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	err = nvme_qpair_enqueue(qp, cmd);
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	member->dirty |= 1ULL << idx;
+	member->next = (idx + 1) % member->nqpairs;
+	member->ncmds++;
+	pl->ncmds++;
+
+	return 0;
+}
+
+/**
+ * Write the SQ doorbells of qpairs with commands submitted since the last doorbell write
+ */
+static inline void
+nvme_stripe_sqdb_update(struct nvme_stripe *stripe)
+{
+	for (uint32_t i = 0; i < stripe->nmembers; ++i) {
+		struct nvme_stripe_member *member = &stripe->members[i];
+
+		for (uint32_t q = 0; member->dirty; ++q) {
+			if (member->dirty & (1ULL << q)) {
+				nvme_qpair_sqdb_update(&member->qpairs[q]);
+				member->dirty &= ~(1ULL << q);
+			}
+		}
+	}
+}
+
+/**
+ * Process the completions of all qpairs of the stripe
+ *
+ * @return The number of completions processed.
+ */
+static inline int
+nvme_stripe_process_completions(struct nvme_stripe *stripe)
+{
+	int nreaped = 0;
+
+	for (uint32_t i = 0; i < stripe->nmembers; ++i) {
+		struct nvme_stripe_member *member = &stripe->members[i];
+
+		for (uint32_t q = 0; q < member->nqpairs; ++q) {
+			nreaped += nvme_qpair_process_completions(&member->qpairs[q], 0);
+		}
+	}
+
+	return nreaped;
+}
+
+/**
+ * Enqueue the next command of member `idx` of a nvme_stripe_io(), at the cursor of the member
+ *
+ * @return On success 0 is returned. When the qpairs of the member are full, -EBUSY is returned.
+ *         On other errors, negative errno is returned.
+ */
+static inline int
+nvme_stripe_io_submit_member(struct nvme_stripe_io_ctx *ctx, uint32_t idx,
+			     struct nvme_qpair_pipeline *pl)
+{
+	struct nvme_stripe *stripe = ctx->stripe;
+	struct nvme_stripe_member *member = &stripe->members[idx];
+	const uint64_t lba_mask = stripe->lba_nbytes - 1;
+	const int lba_shift = __builtin_ctz(stripe->lba_nbytes);
+	uint8_t *virt = (uint8_t *)ctx->buf->virt + ctx->cursor[idx];
+	struct nvme_command cmd = {0};
+	uint64_t member_offset, chunk, slba, unit_left;
+	uint32_t midx, mdts;
+	int err;
+
+	unit_left = nvme_stripe_map(stripe, ctx->offset + ctx->cursor[idx], &midx, &member_offset);
+
+	chunk = unit_left;
+	if (chunk > ctx->nbytes - ctx->cursor[idx]) {
+		chunk = ctx->nbytes - ctx->cursor[idx];
+	}
+	mdts = member->qpairs[member->next].mdts_nbytes;
+	// A buffer not page-aligned takes a page more of PRPs than its length, within the MDTS
+	if (mdts > 4096 && ((uintptr_t)virt & 4095)) {
+		mdts -= 4096;
+	}
+	if (mdts && chunk > mdts) {
+		chunk = mdts & ~lba_mask;
+	}
+	if (chunk > (0x10000ULL << lba_shift)) {
+		chunk = 0x10000ULL << lba_shift;
+	}
+
+	slba = member_offset >> lba_shift;
+	cmd.opc = ctx->opc;
+	cmd.nsid = member->nsid;
+	cmd.cdw10 = slba & 0xFFFFFFFF;
+	cmd.cdw11 = slba >> 32;
+	cmd.cdw12 = (chunk >> lba_shift) - 1;
+
+	err = nvme_stripe_member_submit(member, ctx->buf, virt, chunk, &cmd, pl);
+	if (err) {
+		return err;
+	}
+	ctx->nsubmitted += chunk;
+
+	// At the end of a unit, then the next unit of the member is a stripe further
+	ctx->cursor[idx] += chunk;
+	if (chunk == unit_left) {
+		ctx->cursor[idx] += (stripe->nmembers - 1) * stripe->unit_nbytes;
+	}
+
+	return 0;
+}
+
+/**
+ * Enqueue the next commands of a nvme_stripe_io(); see nvme_qpair_pipeline_submit_fn
+ *
+ * A command is enqueued on each member in turn; members whose qpairs are full, or whose part of
+ * the I/O is enqueued, are skipped, until all are.
+ */
+static inline int
+nvme_stripe_io_submit(struct nvme_qpair_pipeline *pl, void *arg)
+{
+	struct nvme_stripe_io_ctx *ctx = arg;
+	struct nvme_stripe *stripe = ctx->stripe;
+	uint32_t full = 0; ///< A bit per member whose qpairs are full
+	int progress = 1;
+	int err = 0;
+
+	while (progress && !err) {
+		progress = 0;
+		for (uint32_t i = 0; i < stripe->nmembers && !err; ++i) {
+			if ((full & (1U << i)) || ctx->cursor[i] >= ctx->nbytes) {
+				continue;
+			}
+
+			err = nvme_stripe_io_submit_member(ctx, i, pl);
+			if (err == -EBUSY) {
+				full |= 1U << i;
+				err = 0;
+				continue;
+			}
+			if (err) {
+				UPCIE_DEBUG("FAILED: nvme_stripe_member_submit(); err(%d)", err);
+				break;
+			}
+			progress = 1;
+		}
+	}
+	nvme_stripe_sqdb_update(stripe);
+
+	return err ? err : ctx->nsubmitted < ctx->nbytes;
+}
+
+/**
+ * Returns qpair `idx` counted over the qpairs of all members; see nvme_qpair_pipeline_qpair_fn
+ */
+static inline struct nvme_qpair *
+nvme_stripe_io_qpair(void *arg, uint32_t idx)
+{
+	struct nvme_stripe_io_ctx *ctx = arg;
+
+	for (uint32_t i = 0; i < ctx->stripe->nmembers; ++i) {
+		struct nvme_stripe_member *member = &ctx->stripe->members[i];
+
+		if (idx < member->nqpairs) {
+			return &member->qpairs[idx];
+		}
+		idx -= member->nqpairs;
+	}
+
+	return NULL;
+}
+
+/**
+ * Read or write `nbytes` at `offset` of the volume, from/to the buffer, and wait for completion
+ *
+ * The range is split at stripe-unit boundaries, and at the MDTS of the qpairs, into commands of
+ * the NVM command set, with SLBA in cdw10/cdw11 and NLB in cdw12[15:0]; `opc` is e.g. 0x1 for
+ * write, or 0x2 for read. The buffer must hold `nbytes`, and, as every command but the first
+ * starts at a page boundary of the volume, its offset within a page must equal that of `offset`,
+ * e.g. a page-aligned buffer and a page-aligned offset.
+ *
+ * When no completion is processed for the largest timeout of the member controllers, then the
+ * I/O is given up; the commands still in flight are detached, see nvme_qpair_pipeline_run(),
+ * thus, the stripe may be used again, yet, the buffer must not be reused before the qpairs are
+ * destroyed.
+ *
+ * @param stripe The stripe
+ * @param opc The opcode of the commands
+ * @param offset Offset of the volume, in bytes; a multiple of the logical block size
+ * @param nbytes Number of bytes; a multiple of the logical block size
+ * @param buf The buffer
+ * @param cpl Pointer to store the completion of the first failed command; may be NULL
+ *
+ * @return On success 0 is returned. When a command fails, -EIO is returned, after all commands
+ *         have completed. On timeout -EAGAIN is returned. On other errors, negative errno is
+ *         returned to indicate the error.
+ */
+static inline int
+nvme_stripe_io(struct nvme_stripe *stripe, uint8_t opc, uint64_t offset, size_t nbytes,
+	       struct nvme_stripe_buf *buf, struct nvme_completion *cpl)
+{
+	const uint64_t lba_mask = stripe->lba_nbytes - 1;
+	struct nvme_stripe_io_ctx ctx = {.stripe = stripe, .buf = buf, .offset = offset,
+					 .nbytes = nbytes, .opc = opc};
+	struct nvme_qpair_pipeline pl = {0};
+	uint32_t timeout_ms = 0;
+
+	if (!stripe->nmembers || (offset & lba_mask) || (nbytes & lba_mask) ||
+	    offset + nbytes > stripe->nbytes || (((uintptr_t)buf->virt ^ offset) & 4095)) {
+		UPCIE_DEBUG("FAILED: offset(%" PRIu64 ") nbytes(%zu)", offset, nbytes);
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < stripe->nmembers; ++i) {
+		uint32_t ms = stripe->members[i].ctrlr->timeout_ms;
+
+		timeout_ms = ms > timeout_ms ? ms : timeout_ms;
+	}
+
+	// The first byte of the I/O within a unit of each member; past the I/O when it has none
+	for (uint32_t i = 0; i < stripe->nmembers; ++i) {
+		const uint64_t unit = offset / stripe->unit_nbytes;
+		const uint64_t first = unit + (i + stripe->nmembers - unit % stripe->nmembers) %
+						      stripe->nmembers;
+
+		ctx.cursor[i] = first == unit ? 0 : first * stripe->unit_nbytes - offset;
+	}
+
+	return nvme_qpair_pipeline_run(&pl, nvme_stripe_io_submit, nvme_stripe_io_qpair, &ctx,
+				       timeout_ms, cpl);
+}
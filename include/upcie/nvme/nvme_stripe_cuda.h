@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/**
+ * CUDA NVMe Stripe Extension
+ * ==========================
+ *
+ * This header extends `upcie/nvme/nvme_stripe.h` with buffers of a 'struct cudamem_heap', thus, a
+ * striped read lands in GPU memory, with the commands driven by the host qpairs of each member.
+ *
+ * @file nvme_stripe_cuda.h
+ * @version 0.4.4
+ */
+
+static inline int
+nvme_stripe_prep_cudamem(struct nvme_request *req, void *heap, void *virt, size_t nbytes,
+			 struct nvme_command *cmd)
+{
+	return nvme_request_prep_command_prps_contig_cuda(req, (struct cudamem_heap *)heap, virt,
+							  nbytes, cmd);
+}
+
+/**
+ * Describe a buffer allocated in a 'struct cudamem_heap'
+ */
+static inline void
+nvme_stripe_buf_cudamem(struct nvme_stripe_buf *buf, struct cudamem_heap *heap, void *virt)
+{
+	buf->virt = virt;
+	buf->heap = heap;
+	buf->prep = nvme_stripe_prep_cudamem;
+}
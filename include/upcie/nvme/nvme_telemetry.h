@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Per-qpair telemetry: latency histograms and hot-path counters
+ * =============================================================
+ *
+ * When compiled with UPCIE_TELEMETRY_ENABLED, e.g. via the 'telemetry' meson option, then every
+ * `struct nvme_qpair` carries a `struct nvme_telemetry`, and every `struct nvme_request` the
+ * time-stamp, in tsc_read() ticks, of the enqueue of its command. On completion, the latency, from
+ * enqueue to reap, is added to a log-linear histogram. Counted are: commands enqueued and
+ * completed, MMIO doorbell writes of the SQ and the CQ, polls finding the CQ empty, and failed
+ * commands, by status code.
+ *
+ * Without UPCIE_TELEMETRY_ENABLED, then neither the fields nor the updates exist; the hooks,
+ * wrapped in NVME_TELEMETRY_FCALL(), compile to nothing. The struct and the functions operating
+ * on it, e.g. nvme_telemetry_merge(), are always available, thus, tools reporting telemetry
+ * compile either way; nvme_qpair_telemetry_snapshot() returns -ENOTSUP when compiled out.
+ *
+ * A qpair, and thus its telemetry, is updated by the single thread owning it. A snapshot copies
+ * it a word at a time, such that it can be taken from another thread: each counter is then
+ * consistent on its own, though counters may differ by the updates in progress, e.g. the
+ * histogram count from `ncompleted`.
+ *
+ * The histogram is exact below NVME_TELEMETRY_HIST_NSUB ticks, and above, has
+ * NVME_TELEMETRY_HIST_NSUB buckets per power-of-two, that is, a bucket is within 1 /
+ * NVME_TELEMETRY_HIST_NSUB of the values in it.
+ *
+ * @file nvme_telemetry.h
+ * @version 0.4.4
+ */
+
+#ifdef UPCIE_TELEMETRY_ENABLED
+#define NVME_TELEMETRY_FCALL(x) x
+#else
+#define NVME_TELEMETRY_FCALL(x)
+#endif
+
+#define NVME_TELEMETRY_HIST_SUB_SHIFT 3
+#define NVME_TELEMETRY_HIST_NSUB (1 << NVME_TELEMETRY_HIST_SUB_SHIFT)
+#define NVME_TELEMETRY_HIST_NBUCKETS \
+	((64 - NVME_TELEMETRY_HIST_SUB_SHIFT + 1) * NVME_TELEMETRY_HIST_NSUB)
+#define NVME_TELEMETRY_ERRORS_MAX 16
+
+struct nvme_telemetry_error {
+	uint64_t status; ///< Status Code Type and Status Code; bits 10:8 and 7:0
+	uint64_t count;  ///< Number of completions with the status
+};
+
+struct nvme_telemetry {
+	uint64_t nsubmitted;    ///< Commands written to the SQ
+	uint64_t ncompleted;    ///< Completions reaped
+	uint64_t nsqdb;         ///< MMIO writes of the SQ tail doorbell
+	uint64_t ncqdb;         ///< MMIO writes of the CQ head doorbell
+	uint64_t npolls_empty;  ///< Polls of the CQ finding no completion
+	uint64_t nerrors;       ///< Completions with a non-zero status
+	uint64_t nerrors_other; ///< Completions with a status not fitting in `errors`
+	struct nvme_telemetry_error errors[NVME_TELEMETRY_ERRORS_MAX]; ///< By status, first seen
+
+	uint64_t lat_count; ///< Number of latencies in the histogram
+	uint64_t lat_sum;   ///< Sum of the latencies, in ticks
+	uint64_t lat_max;   ///< Largest latency, in ticks
+	uint64_t lat_buckets[NVME_TELEMETRY_HIST_NBUCKETS];
+};
+
+UPCIE_STATIC_ASSERT(sizeof(struct nvme_telemetry) % sizeof(uint64_t) == 0,
+		    "nvme_telemetry must be a whole number of words")
+
+static inline void
+nvme_telemetry_reset(struct nvme_telemetry *telemetry)
+{
+	memset(telemetry, 0, sizeof(*telemetry));
+}
+
+/**
+ * Returns the histogram bucket of the given latency, in ticks
+ */
+static inline uint32_t
+nvme_telemetry_hist_bucket(uint64_t ticks)
+{
+	uint32_t shift;
+
+	if (ticks < NVME_TELEMETRY_HIST_NSUB) {
+		return ticks;
+	}
+	shift = 63 - __builtin_clzll(ticks) - NVME_TELEMETRY_HIST_SUB_SHIFT;
+
+	return (shift + 1) * NVME_TELEMETRY_HIST_NSUB +
+	       ((ticks >> shift) & (NVME_TELEMETRY_HIST_NSUB - 1));
+}
+
+/**
+ * Returns the smallest latency, in ticks, of the given histogram bucket
+ */
+static inline uint64_t
+nvme_telemetry_hist_value(uint32_t bucket)
+{
+	if (bucket < NVME_TELEMETRY_HIST_NSUB) {
+		return bucket;
+	}
+
+	return (uint64_t)(NVME_TELEMETRY_HIST_NSUB + bucket % NVME_TELEMETRY_HIST_NSUB)
+	       << (bucket / NVME_TELEMETRY_HIST_NSUB - 1);
+}
+
+static inline void
+nvme_telemetry_lat_add(struct nvme_telemetry *telemetry, uint64_t ticks)
+{
+	telemetry->lat_buckets[nvme_telemetry_hist_bucket(ticks)]++;
+	telemetry->lat_count++;
+	telemetry->lat_sum += ticks;
+	if (ticks > telemetry->lat_max) {
+		telemetry->lat_max = ticks;
+	}
+}
+
+/**
+ * Count a failed completion by its status; `status` is the Status Field shifted right by one
+ */
+static inline void
+nvme_telemetry_error_add(struct nvme_telemetry *telemetry, uint64_t status, uint64_t count)
+{
+	telemetry->nerrors += count;
+
+	for (int i = 0; i < NVME_TELEMETRY_ERRORS_MAX; ++i) {
+		struct nvme_telemetry_error *error = &telemetry->errors[i];
+
+		if (error->count && error->status != status) {
+			continue;
+		}
+		error->status = status;
+		error->count += count;
+		return;
+	}
+
+	telemetry->nerrors_other += count;
+}
+
+/**
+ * Returns the latency, in ticks, at or below which the given fraction of the latencies are
+ *
+ * @param telemetry The telemetry, e.g. a snapshot, or the merge of several
+ * @param fraction In [0, 1], e.g. 0.99 for the 99th percentile
+ *
+ * @return The lower bound of the bucket holding the percentile; 0 when there are no latencies.
+ */
+static inline uint64_t
+nvme_telemetry_percentile(struct nvme_telemetry *telemetry, double fraction)
+{
+	uint64_t rank = (uint64_t)(fraction * telemetry->lat_count + 0.5);
+	uint64_t seen = 0;
+
+	if (!telemetry->lat_count) {
+		return 0;
+	}
+	rank = rank ? rank : 1;
+
+	for (uint32_t i = 0; i < NVME_TELEMETRY_HIST_NBUCKETS; ++i) {
+		seen += telemetry->lat_buckets[i];
+		if (seen >= rank) {
+			return nvme_telemetry_hist_value(i);
+		}
+	}
+
+	return telemetry->lat_max;
+}
+
+/**
+ * Accumulate `src` into `dst`, e.g. for totals over the qpairs of a controller
+ */
+static inline void
+nvme_telemetry_merge(struct nvme_telemetry *dst, struct nvme_telemetry *src)
+{
+	dst->nsubmitted += src->nsubmitted;
+	dst->ncompleted += src->ncompleted;
+	dst->nsqdb += src->nsqdb;
+	dst->ncqdb += src->ncqdb;
+	dst->npolls_empty += src->npolls_empty;
+
+	// nvme_telemetry_error_add() accumulates nerrors, thus, only that of `nerrors_other`
+	dst->nerrors += src->nerrors_other;
+	dst->nerrors_other += src->nerrors_other;
+	for (int i = 0; i < NVME_TELEMETRY_ERRORS_MAX && src->errors[i].count; ++i) {
+		nvme_telemetry_error_add(dst, src->errors[i].status, src->errors[i].count);
+	}
+
+	dst->lat_count += src->lat_count;
+	dst->lat_sum += src->lat_sum;
+	if (src->lat_max > dst->lat_max) {
+		dst->lat_max = src->lat_max;
+	}
+	for (uint32_t i = 0; i < NVME_TELEMETRY_HIST_NBUCKETS; ++i) {
+		dst->lat_buckets[i] += src->lat_buckets[i];
+	}
+}
+
+/**
+ * Copy `src` into `dst` a word at a time; see the header description on consistency
+ */
+static inline void
+nvme_telemetry_copy(struct nvme_telemetry *dst, struct nvme_telemetry *src)
+{
+	uint64_t *words = (uint64_t *)src;
+
+	for (size_t i = 0; i < sizeof(*src) / sizeof(uint64_t); ++i) {
+		((uint64_t *)dst)[i] = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+	}
+}
+
+static inline int
+nvme_telemetry_pr(struct nvme_telemetry *telemetry)
+{
+	double us = 1e6 / tsc_hz();
+	int wrtn = 0;
+
+	wrtn += printf("nvme_telemetry:");
+
+	if (!telemetry) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+
+	wrtn += printf("\n");
+	wrtn += printf("  nsubmitted: %" PRIu64 "\n", telemetry->nsubmitted);
+	wrtn += printf("  ncompleted: %" PRIu64 "\n", telemetry->ncompleted);
+	wrtn += printf("  nsqdb: %" PRIu64 "\n", telemetry->nsqdb);
+	wrtn += printf("  ncqdb: %" PRIu64 "\n", telemetry->ncqdb);
+	wrtn += printf("  npolls_empty: %" PRIu64 "\n", telemetry->npolls_empty);
+	wrtn += printf("  nerrors: %" PRIu64 "\n", telemetry->nerrors);
+	if (telemetry->nerrors) {
+		wrtn += printf("  errors:\n");
+		for (int i = 0; i < NVME_TELEMETRY_ERRORS_MAX && telemetry->errors[i].count; ++i) {
+			struct nvme_telemetry_error *error = &telemetry->errors[i];
+
+			wrtn += printf("  - {sct: 0x%" PRIx64 ", sc: 0x%02" PRIx64
+				       ", count: %" PRIu64 "}\n",
+				       error->status >> 8, error->status & 0xFF, error->count);
+		}
+		wrtn += printf("  nerrors_other: %" PRIu64 "\n", telemetry->nerrors_other);
+	}
+
+	wrtn += printf("  lat_us:");
+	if (!telemetry->lat_count) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+	wrtn += printf("\n");
+	wrtn += printf("    count: %" PRIu64 "\n", telemetry->lat_count);
+	wrtn += printf("    avg: %.2f\n", (double)telemetry->lat_sum / telemetry->lat_count * us);
+	wrtn += printf("    p50: %.2f\n", nvme_telemetry_percentile(telemetry, 0.50) * us);
+	wrtn += printf("    p99: %.2f\n", nvme_telemetry_percentile(telemetry, 0.99) * us);
+	wrtn += printf("    p999: %.2f\n", nvme_telemetry_percentile(telemetry, 0.999) * us);
+	wrtn += printf("    max: %.2f\n", telemetry->lat_max * us);
+
+	return wrtn;
+}
+
+#ifdef UPCIE_TELEMETRY_ENABLED
+
+/**
+ * Hook of the enqueue of a command; time-stamps its request, when the cid is of the pool
+ */
+static inline void
+nvme_telemetry_on_submit(struct nvme_telemetry *telemetry, struct nvme_request_pool *pool,
+			 uint16_t cid)
+{
+	telemetry->nsubmitted++;
+	if (cid < pool->len) {
+		pool->reqs[cid].submitted = tsc_read();
+	}
+}
+
+static inline void
+nvme_telemetry_on_submit_batch(struct nvme_telemetry *telemetry, struct nvme_request_pool *pool,
+			       struct nvme_command *cmds, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; ++i) {
+		nvme_telemetry_on_submit(telemetry, pool, cmds[i].cid);
+	}
+}
+
+/**
+ * Hook of the reap of a completion; adds the latency of its request and counts errors
+ */
+static inline void
+nvme_telemetry_on_complete(struct nvme_telemetry *telemetry, struct nvme_request_pool *pool,
+			   struct nvme_completion *cpl)
+{
+	telemetry->ncompleted++;
+	if (cpl->cid < pool->len && pool->reqs[cpl->cid].submitted) {
+		nvme_telemetry_lat_add(telemetry, tsc_read() - pool->reqs[cpl->cid].submitted);
+		pool->reqs[cpl->cid].submitted = 0;
+	}
+	if (cpl->status & 0x1FE) {
+		nvme_telemetry_error_add(telemetry, (cpl->status >> 1) & 0x7FF, 1);
+	}
+}
+
+#endif
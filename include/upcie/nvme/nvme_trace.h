@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Trace ring of the user-space NVMe path
+ * ======================================
+ *
+ * A binary ring of events, one ring per qpair, recording what the driver does: commands written
+ * to the SQ, SQ and CQ doorbell updates, completions reaped, and timeouts. Unlike UPCIE_DEBUG(),
+ * tracing is always compiled in, and enabled at runtime by attaching a ring to a qpair, see
+ * nvme_qpair_trace_attach(), and the CUDA counterpart nvme_controller_cuda_trace_attach(). A
+ * qpair without a ring pays a single, predictable, branch per hook.
+ *
+ * The ring lives in a file mapped shared, e.g. in /dev/shm, thus, it can be read while the
+ * process runs, and after it has exited or crashed. The format is fixed, a 64-byte header
+ * followed by `nevents` events of 32 bytes, little-endian; it is decoded, and merged with the
+ * timeline of the QEMU NVMe trace-events of cijoe/nvme_trace.events, by
+ * cijoe/scripts/nvme_trace_decode.py.
+ *
+ * Events are recorded without locks. On the host, a qpair is driven by a single thread, which
+ * is the only producer of its ring. On the GPU, any thread may record, and the slot of an event
+ * is reserved with an atomic increment of `head`. In both cases, the `seq` of an event is zeroed
+ * before, and set after, the other fields are written, thus, a reader discards events which are
+ * incomplete or overwritten while read, see nvme_trace_ring_read().
+ *
+ * Time-stamps are in ticks of the clock of the ring, see enum nvme_trace_clock. For the host,
+ * the ring carries a reference pair of a tick-count and CLOCK_REALTIME, for conversion into
+ * wall-clock time. For the GPU, the clock is the global timer, which is not synchronized with
+ * the host, thus, the decoder aligns it via the doorbell writes.
+ *
+ * @file nvme_trace.h
+ * @version 0.4.4
+ */
+
+#define NVME_TRACE_MAGIC 0x52545055 ///< "UPTR"
+#define NVME_TRACE_VERSION 1
+#define NVME_TRACE_NEVENTS_DEFAULT (1 << 16)
+#define NVME_TRACE_CID_NONE 0xFFFF
+#define NVME_TRACE_FLAG_SHADOW 0x1 ///< The doorbell was written to the shadow doorbell buffer
+
+enum nvme_trace_type {
+	NVME_TRACE_SUBMIT = 0x1,  ///< Command written to the SQ; opcode, nsid, SLBA and SQ slot
+	NVME_TRACE_SQDB = 0x2,    ///< SQ tail doorbell written; the tail
+	NVME_TRACE_CQE = 0x3,     ///< Completion reaped; the status and dword 0
+	NVME_TRACE_CQDB = 0x4,    ///< CQ head doorbell written; the head
+	NVME_TRACE_TIMEOUT = 0x5, ///< Wait for a completion timed out; the CQ head
+	NVME_TRACE_EXPIRE = 0x6,  ///< Deadline of a command in flight expired; SQ slot, nexpired
+};
+
+enum nvme_trace_clock {
+	NVME_TRACE_CLOCK_TSC = 0x1,         ///< tsc_read() of the host
+	NVME_TRACE_CLOCK_GLOBALTIMER = 0x2, ///< %globaltimer of the GPU, in nanoseconds
+};
+
+struct nvme_trace_event {
+	uint64_t ts;    ///< Ticks of the clock of the ring
+	uint64_t arg;   ///< SUBMIT: SLBA, that is, cdw11:cdw10; CQE: dword 0 of the completion
+	uint32_t nsid;  ///< SUBMIT: namespace identifier
+	uint32_t seq;   ///< Lower 32 bits of the index of the event plus one; 0 while written
+	uint8_t type;   ///< enum nvme_trace_type
+	uint8_t flags;  ///< SUBMIT: the opcode; SQDB and CQDB: NVME_TRACE_FLAG_SHADOW
+	uint16_t cid;   ///< SUBMIT, CQE: command identifier; otherwise NVME_TRACE_CID_NONE
+	uint16_t value; ///< SUBMIT: SQ slot; SQDB: tail; CQE: status; CQDB, TIMEOUT: head
+	uint16_t rsvd;
+};
+UPCIE_STATIC_ASSERT(sizeof(struct nvme_trace_event) == 32, "Incorrect size")
+
+struct nvme_trace_ring {
+	uint32_t magic;           ///< NVME_TRACE_MAGIC
+	uint16_t version;         ///< NVME_TRACE_VERSION
+	uint16_t clock;           ///< enum nvme_trace_clock
+	uint32_t nevents;         ///< Number of events of the ring; a power-of-two
+	uint32_t qid;             ///< Queue identifier of the qpair recording into the ring
+	uint64_t hz;              ///< Ticks per second of the clock
+	uint64_t ref_ts;          ///< Ticks at `ref_realtime_ns`
+	uint64_t ref_realtime_ns; ///< CLOCK_REALTIME at `ref_ts`; 0 when not related
+	unsigned long long head;  ///< Number of events recorded; the next is at head % nevents
+	uint8_t rsvd[16];
+};
+UPCIE_STATIC_ASSERT(sizeof(struct nvme_trace_ring) == 64, "Incorrect size")
+
+/**
+ * Returns the events of the ring, which follow the header
+ */
+static inline struct nvme_trace_event *
+nvme_trace_ring_events(struct nvme_trace_ring *ring)
+{
+	return (struct nvme_trace_event *)(ring + 1);
+}
+
+static inline size_t
+nvme_trace_ring_nbytes(uint32_t nevents)
+{
+	return sizeof(struct nvme_trace_ring) + (size_t)nevents * sizeof(struct nvme_trace_event);
+}
+
+static inline int
+nvme_trace_ring_pp(struct nvme_trace_ring *ring)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_trace_ring:");
+
+	if (!ring) {
+		wrtn += printf(" ~\n");
+		return wrtn;
+	}
+
+	wrtn += printf("\n");
+	wrtn += printf("  qid: %" PRIu32 "\n", ring->qid);
+	wrtn += printf("  clock: %" PRIu16 "\n", ring->clock);
+	wrtn += printf("  hz: %" PRIu64 "\n", ring->hz);
+	wrtn += printf("  nevents: %" PRIu32 "\n", ring->nevents);
+	wrtn += printf("  head: %llu\n", __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+
+	return wrtn;
+}
+
+/**
+ * Initialize the header of the ring; the events are invalidated
+ */
+static inline void
+nvme_trace_ring_init(struct nvme_trace_ring *ring, uint32_t nevents, enum nvme_trace_clock clock)
+{
+	struct timespec ts;
+
+	memset(ring, 0, nvme_trace_ring_nbytes(nevents));
+
+	ring->version = NVME_TRACE_VERSION;
+	ring->clock = clock;
+	ring->nevents = nevents;
+
+	if (clock == NVME_TRACE_CLOCK_TSC) {
+		ring->hz = tsc_hz();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ring->ref_ts = tsc_read();
+		ring->ref_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	} else {
+		ring->hz = 1000000000ULL;
+	}
+
+	__atomic_store_n(&ring->magic, NVME_TRACE_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * Create a ring of `nevents` events, mapped shared from the file at `path`, e.g. in /dev/shm
+ *
+ * An existing file is truncated. The file is not removed by nvme_trace_ring_close(), such that
+ * the trace can be decoded after the process has exited.
+ *
+ * @param ring Set to the mapping of the ring
+ * @param path Path of the file backing the ring
+ * @param nevents Number of events; a power-of-two, 0 gives NVME_TRACE_NEVENTS_DEFAULT
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_trace_ring_open(struct nvme_trace_ring **ring, const char *path, uint32_t nevents)
+{
+	size_t nbytes;
+	void *virt;
+	int err, fd;
+
+	nevents = nevents ? nevents : NVME_TRACE_NEVENTS_DEFAULT;
+	if (nevents & (nevents - 1)) {
+		UPCIE_DEBUG("FAILED: nevents(%" PRIu32 ") is not a power-of-two", nevents);
+		return -EINVAL;
+	}
+	nbytes = nvme_trace_ring_nbytes(nevents);
+
+	fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: open(%s); err(%d)", path, err);
+		return err;
+	}
+
+	if (ftruncate(fd, nbytes)) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: ftruncate(); err(%d)", err);
+		close(fd);
+		return err;
+	}
+
+	virt = mmap(NULL, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (virt == MAP_FAILED) {
+		err = -errno;
+		UPCIE_DEBUG("FAILED: mmap(); err(%d)", err);
+		return err;
+	}
+
+	*ring = (struct nvme_trace_ring *)virt;
+	nvme_trace_ring_init(*ring, nevents, NVME_TRACE_CLOCK_TSC);
+
+	return 0;
+}
+
+/**
+ * Unmap a ring created by nvme_trace_ring_open(); detach it from its qpair beforehand
+ */
+static inline void
+nvme_trace_ring_close(struct nvme_trace_ring *ring)
+{
+	if (!ring) {
+		return;
+	}
+
+	munmap(ring, nvme_trace_ring_nbytes(ring->nevents));
+}
+
+/**
+ * Record an event; by the single thread driving the qpair of the ring
+ */
+static inline void
+nvme_trace_record(struct nvme_trace_ring *ring, uint8_t type, uint8_t flags, uint16_t cid,
+		  uint16_t value, uint32_t nsid, uint64_t arg)
+{
+	unsigned long long idx = ring->head;
+	struct nvme_trace_event *event = &nvme_trace_ring_events(ring)[idx & (ring->nevents - 1)];
+
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	event->ts = tsc_read();
+	event->arg = arg;
+	event->nsid = nsid;
+	event->type = type;
+	event->flags = flags;
+	event->cid = cid;
+	event->value = value;
+
+	__atomic_store_n(&event->seq, (uint32_t)(idx + 1), __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, idx + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read the events recorded since `*pos`, at most `max`, skipping those that were overwritten
+ *
+ * @param ring The ring to read
+ * @param pos Index of the next event to read; start at 0, advanced past the events read
+ * @param events Populated with the events read, oldest first
+ * @param max Maximum number of events to read
+ *
+ * @return The number of events read; events lost to overwrites are skipped, and not counted.
+ */
+static inline uint32_t
+nvme_trace_ring_read(struct nvme_trace_ring *ring, uint64_t *pos, struct nvme_trace_event *events,
+		     uint32_t max)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t nread = 0;
+
+	if (head - *pos > ring->nevents) {
+		*pos = head - ring->nevents;
+	}
+
+	for (; *pos < head && nread < max; ++*pos) {
+		struct nvme_trace_event *event;
+		uint32_t seq;
+
+		event = &nvme_trace_ring_events(ring)[*pos & (ring->nevents - 1)];
+		seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+		if (seq != (uint32_t)(*pos + 1)) {
+			continue;
+		}
+		events[nread] = *event;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&event->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		nread++;
+	}
+
+	return nread;
+}
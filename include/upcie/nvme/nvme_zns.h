@@ -0,0 +1,541 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Zoned Namespaces (ZNS) and Zone Append
+ * ======================================
+ *
+ * A 'struct nvme_zns' extends a 'struct nvme_namespace' of the Zoned Namespace Command Set, with
+ * the zone size, the Maximum Active and Open Resources, the Zone Append Size Limit (ZASL), and a
+ * table of the zones, holding the state, capacity and write pointer of each, as reported by
+ * nvme_zns_report(). The controller must be enabled with all the supported I/O Command Sets,
+ * which nvme_controller_open() does when the controller offers it.
+ *
+ * The zones are managed via nvme_zns_zone_open(), nvme_zns_zone_finish(), nvme_zns_zone_reset()
+ * and nvme_zns_mgmt_send(), which update the table to the state the action leads to.
+ *
+ * Zone Append
+ * -----------
+ *
+ * A Zone Append writes to the zone, and the controller picks the logical blocks, at the write
+ * pointer as it is when the command executes, and returns the first of them in the completion,
+ * see nvme_zns_append_lba(). Thus, many appends can be in flight on the same zone, on the same or
+ * on distinct qpairs, without the host ordering them. nvme_zns_append_enqueue() advances the
+ * write pointer of the zone table as the appends are submitted, such that an append which would
+ * not fit the capacity of the zone is refused with -ENOSPC, at submission, rather than failed by
+ * the controller; when an append fails, then the table is ahead of the zone, and should be
+ * reported again.
+ *
+ * As with the namespace, then the zone table is not thread-safe; distinct threads append to the
+ * zones via distinct 'struct nvme_zns', or, serialize the submissions.
+ *
+ * @file nvme_zns.h
+ * @version 0.4.4
+ */
+
+#define NVME_ZNS_CSI 0x2 ///< Command Set Identifier of the Zoned Namespace Command Set
+
+#define NVME_ZNS_ZS_EMPTY 0x1 ///< Zone State
+#define NVME_ZNS_ZS_IOPEN 0x2 ///< Implicitly Opened
+#define NVME_ZNS_ZS_EOPEN 0x3 ///< Explicitly Opened
+#define NVME_ZNS_ZS_CLOSED 0x4
+#define NVME_ZNS_ZS_RONLY 0xD
+#define NVME_ZNS_ZS_FULL 0xE
+#define NVME_ZNS_ZS_OFFLINE 0xF
+
+#define NVME_ZNS_ZSA_CLOSE 0x1 ///< Zone Send Action of Zone Management Send
+#define NVME_ZNS_ZSA_FINISH 0x2
+#define NVME_ZNS_ZSA_OPEN 0x3
+#define NVME_ZNS_ZSA_RESET 0x4
+#define NVME_ZNS_ZSA_OFFLINE 0x5
+
+#define NVME_ZNS_ZONE_ALL UINT64_MAX ///< Zone index selecting all zones; Select All
+
+#define NVME_ZNS_REPORT_NBYTES (64 * 1024) ///< Buffer of each Zone Management Receive
+
+/**
+ * A zone, as kept in the zone table; the start of the zone is its index times the zone size
+ */
+struct nvme_zns_zone {
+	uint64_t zslba; ///< Zone Start Logical Block Address
+	uint64_t wp;    ///< Write Pointer, advanced by the appends submitted since the report
+	uint64_t zcap;  ///< Zone Capacity, in logical blocks
+	uint8_t zs;     ///< Zone State, NVME_ZNS_ZS_*
+	uint8_t zt;     ///< Zone Type; 0x2: Sequential Write Required
+	uint8_t za;     ///< Zone Attributes
+	uint8_t rsvd[5];
+};
+
+struct nvme_zns {
+	struct nvme_namespace *ns;   ///< The namespace of the zones
+	uint64_t zsze;               ///< Zone Size, in logical blocks
+	uint64_t nzones;             ///< Number of zones
+	uint32_t mar;                ///< Maximum Active Resources; 0: no limit
+	uint32_t mor;                ///< Maximum Open Resources; 0: no limit
+	uint32_t zasl_nlb;           ///< Maximum logical blocks of a Zone Append
+	uint16_t zoc;                ///< Zone Operation Characteristics
+	uint16_t ozcs;               ///< Optional Zoned Command Support
+	struct nvme_zns_zone *zones; ///< The zone table, of 'nzones' entries
+};
+
+static inline int
+nvme_zns_pr(struct nvme_zns *zns)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_zns:\n");
+	wrtn += printf("  nsid: %" PRIu32 "\n", zns->ns->nsid);
+	wrtn += printf("  zsze: %" PRIu64 "\n", zns->zsze);
+	wrtn += printf("  nzones: %" PRIu64 "\n", zns->nzones);
+	wrtn += printf("  mar: %" PRIu32 "\n", zns->mar);
+	wrtn += printf("  mor: %" PRIu32 "\n", zns->mor);
+	wrtn += printf("  zasl_nlb: %" PRIu32 "\n", zns->zasl_nlb);
+	wrtn += printf("  zoc: 0x%" PRIx16 "\n", zns->zoc);
+	wrtn += printf("  ozcs: 0x%" PRIx16 "\n", zns->ozcs);
+
+	return wrtn;
+}
+
+static inline int
+nvme_zns_zone_pr(struct nvme_zns_zone *zone)
+{
+	int wrtn = 0;
+
+	wrtn += printf("nvme_zns_zone:\n");
+	wrtn += printf("  zslba: %" PRIu64 "\n", zone->zslba);
+	wrtn += printf("  wp: %" PRIu64 "\n", zone->wp);
+	wrtn += printf("  zcap: %" PRIu64 "\n", zone->zcap);
+	wrtn += printf("  zs: 0x%" PRIx8 "\n", zone->zs);
+	wrtn += printf("  zt: 0x%" PRIx8 "\n", zone->zt);
+	wrtn += printf("  za: 0x%" PRIx8 "\n", zone->za);
+
+	return wrtn;
+}
+
+static inline void
+nvme_zns_term(struct nvme_zns *zns)
+{
+	free(zns->zones);
+	zns->zones = NULL;
+	zns->nzones = 0;
+}
+
+/**
+ * Sends an Identify, of `cns`, for the Zoned Namespace Command Set, into ctrlr->buf
+ */
+static inline int
+nvme_zns_identify(struct nvme_controller *ctrlr, uint32_t nsid, uint8_t cns)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = nsid;
+	cmd.cdw10 = cns;
+	cmd.cdw11 = (uint32_t)NVME_ZNS_CSI << 24;
+
+	return nvme_qpair_submit_sync_contig_prps(&ctrlr->aq, ctrlr->heap, ctrlr->buf, 4096, &cmd,
+						  ctrlr->timeout_ms, &cpl);
+}
+
+/**
+ * Returns the Command Set Identifier of the namespace, from its Identification Descriptors
+ *
+ * @return On success, the CSI is returned; 0x0, the NVM Command Set, when no CSI descriptor is
+ *         given. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_zns_csi(struct nvme_controller *ctrlr, uint32_t nsid)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *descs = ctrlr->buf;
+	int err;
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = nsid;
+	cmd.cdw10 = 0x3; ///< CNS=3: Namespace Identification Descriptor list
+
+	err = nvme_qpair_submit_sync_contig_prps(&ctrlr->aq, ctrlr->heap, ctrlr->buf, 4096, &cmd,
+						 ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)", err);
+		return err;
+	}
+
+	// Each descriptor is NIDT, NIDL, two reserved bytes, and NIDL bytes; NIDT=0 ends the list
+	for (size_t off = 0; off + 4 < 4096 && descs[off];) {
+		if (descs[off] == 0x4 && descs[off + 1] == 1) {
+			return descs[off + 4];
+		}
+		off += 4 + descs[off + 1];
+	}
+
+	return 0x0;
+}
+
+/**
+ * Identify the zoned namespace `ns`, and allocate its zone table; the table is filled in by
+ * nvme_zns_report()
+ *
+ * As other admin commands of the controller, this must not run concurrently with them.
+ *
+ * @return On success 0 is returned. When the namespace is not zoned, -ENODEV is returned. On
+ *         other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_zns_init(struct nvme_zns *zns, struct nvme_namespace *ns)
+{
+	struct nvme_controller *ctrlr = ns->ctrlr;
+	uint64_t cap = nvme_mmio_cap_read(ctrlr->func.bars[0].region);
+	uint8_t *idfy = ctrlr->buf;
+	uint32_t mar, mor;
+	uint8_t zasl;
+	int err;
+
+	memset(zns, 0, sizeof(*zns));
+
+	err = nvme_zns_csi(ctrlr, ns->nsid);
+	if (err < 0) {
+		UPCIE_DEBUG("FAILED: nvme_zns_csi(); err(%d)", err);
+		return err;
+	}
+	if (err != NVME_ZNS_CSI) {
+		UPCIE_DEBUG("FAILED: nsid(%" PRIu32 ") csi(0x%x) is not zoned", ns->nsid, err);
+		return -ENODEV;
+	}
+
+	err = nvme_zns_identify(ctrlr, ns->nsid, 0x5); ///< CNS=5: I/O Command Set specific NS
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_zns_identify(ns); err(%d)", err);
+		return err;
+	}
+	memcpy(&zns->zoc, &idfy[0], sizeof(zns->zoc));
+	memcpy(&zns->ozcs, &idfy[2], sizeof(zns->ozcs));
+	memcpy(&mar, &idfy[4], sizeof(mar));
+	memcpy(&mor, &idfy[8], sizeof(mor));
+	zns->mar = mar == UINT32_MAX ? 0 : mar + 1;
+	zns->mor = mor == UINT32_MAX ? 0 : mor + 1;
+
+	// The LBA Format Extensions, 64 of 16 bytes each, hold the Zone Size of each LBA Format
+	if (ns->lbaf >= ns->nlbaf) {
+		UPCIE_DEBUG("FAILED: nsid(%" PRIu32 ") lbaf(%" PRIu8 ") >= nlbaf(%" PRIu8 ")",
+			    ns->nsid, ns->lbaf, ns->nlbaf);
+		return -ENODEV;
+	}
+	memcpy(&zns->zsze, &idfy[2816 + 16 * ns->lbaf], sizeof(zns->zsze));
+	if (!zns->zsze) {
+		UPCIE_DEBUG("FAILED: nsid(%" PRIu32 ") zsze(0)", ns->nsid);
+		return -ENODEV;
+	}
+
+	err = nvme_zns_identify(ctrlr, 0, 0x6); ///< CNS=6: I/O Command Set specific Controller
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_zns_identify(ctrlr); err(%d)", err);
+		return err;
+	}
+	zasl = idfy[0];
+
+	// ZASL is a power of two of the minimum memory page size; 0 means that the MDTS applies
+	zns->zasl_nlb = ns->max_nlb;
+	if (zasl) {
+		uint64_t nbytes = (1ULL << zasl) << (12 + nvme_reg_cap_get_mpsmin(cap));
+		uint64_t nlb = nbytes / ns->xfer_nbytes;
+
+		if (nlb < zns->zasl_nlb) {
+			zns->zasl_nlb = nlb;
+		}
+	}
+
+	zns->nzones = ns->nsze / zns->zsze;
+	zns->zones = calloc(zns->nzones, sizeof(*zns->zones));
+	if (!zns->zones) {
+		UPCIE_DEBUG("FAILED: calloc(zones); errno(%d)", errno);
+		zns->nzones = 0;
+		return -errno;
+	}
+	for (uint64_t i = 0; i < zns->nzones; ++i) {
+		zns->zones[i].zslba = i * zns->zsze;
+		zns->zones[i].wp = zns->zones[i].zslba;
+		zns->zones[i].zcap = zns->zsze;
+	}
+	zns->ns = ns;
+
+	return 0;
+}
+
+/**
+ * Fill in the zone table with the zones reported by the controller; Zone Management Receive
+ *
+ * The zones are reported, NVME_ZNS_REPORT_NBYTES at a time, on the given I/O qpair, and waits for
+ * each report.
+ *
+ * @param zns The zoned namespace
+ * @param qp An I/O qpair of the controller of the namespace
+ * @param heap Heap to allocate the report buffer from
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_zns_report(struct nvme_zns *zns, struct nvme_qpair *qp, struct hostmem_heap *heap)
+{
+	size_t nbytes = NVME_ZNS_REPORT_NBYTES;
+	uint64_t zidx = 0;
+	uint8_t *buf;
+	int err = 0;
+
+	if (qp->mdts_nbytes && qp->mdts_nbytes < nbytes) {
+		nbytes = qp->mdts_nbytes;
+	}
+
+	buf = hostmem_dma_malloc(heap, nbytes);
+	if (!buf) {
+		UPCIE_DEBUG("FAILED: hostmem_dma_malloc(); errno(%d)", errno);
+		return -errno;
+	}
+
+	while (zidx < zns->nzones) {
+		struct nvme_completion cpl = {0};
+		struct nvme_command cmd = {0};
+		uint64_t nreported;
+		uint64_t slba = zidx * zns->zsze;
+
+		cmd.opc = 0x7A; ///< Zone Management Receive
+		cmd.nsid = zns->ns->nsid;
+		cmd.cdw10 = slba & 0xFFFFFFFF;
+		cmd.cdw11 = slba >> 32;
+		cmd.cdw12 = nbytes / 4 - 1; ///< Number of Dwords, 0-based
+		cmd.cdw13 = 1 << 16;        ///< Partial Report; ZRASF=0: all; ZRA=0: Report Zones
+
+		err = nvme_qpair_submit_sync_contig_prps(qp, heap, buf, nbytes, &cmd,
+							 zns->ns->ctrlr->timeout_ms, &cpl);
+		if (err) {
+			UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)", err);
+			break;
+		}
+
+		// A 64 byte header with the Number of Zones, followed by 64 byte Zone Descriptors
+		memcpy(&nreported, &buf[0], sizeof(nreported));
+		if (nreported > nbytes / 64 - 1) {
+			nreported = nbytes / 64 - 1;
+		}
+		if (!nreported) {
+			break;
+		}
+
+		for (uint64_t i = 0; i < nreported && zidx < zns->nzones; ++i) {
+			uint8_t *zd = &buf[64 + 64 * i];
+			struct nvme_zns_zone *zone;
+			uint64_t zslba;
+
+			memcpy(&zslba, &zd[16], sizeof(zslba));
+			zidx = zslba / zns->zsze;
+			if (zidx >= zns->nzones) {
+				break;
+			}
+			zone = &zns->zones[zidx];
+
+			zone->zt = zd[0] & 0xF;
+			zone->zs = zd[1] >> 4;
+			zone->za = zd[2];
+			memcpy(&zone->zcap, &zd[8], sizeof(zone->zcap));
+			zone->zslba = zslba;
+			memcpy(&zone->wp, &zd[24], sizeof(zone->wp));
+			zidx += 1;
+		}
+	}
+
+	hostmem_dma_free(heap, buf);
+
+	return err;
+}
+
+/**
+ * Perform the Zone Send Action `zsa` on the zone of index `zidx`; Zone Management Send
+ *
+ * The zone table is updated to the state which the action leads to. With NVME_ZNS_ZONE_ALL, then
+ * the action applies to all zones, in the states the action is valid for, and the zone table is
+ * reported again.
+ *
+ * @param zns The zoned namespace
+ * @param qp An I/O qpair of the controller of the namespace
+ * @param zidx Index of the zone in the zone table, or NVME_ZNS_ZONE_ALL
+ * @param zsa The Zone Send Action, NVME_ZNS_ZSA_*
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+nvme_zns_mgmt_send(struct nvme_zns *zns, struct nvme_qpair *qp, uint64_t zidx, uint8_t zsa)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	struct nvme_zns_zone *zone;
+	int err;
+
+	if (zidx != NVME_ZNS_ZONE_ALL && zidx >= zns->nzones) {
+		return -EINVAL;
+	}
+
+	cmd.opc = 0x79; ///< Zone Management Send
+	cmd.nsid = zns->ns->nsid;
+	cmd.cdw13 = zsa;
+	if (zidx == NVME_ZNS_ZONE_ALL) {
+		cmd.cdw13 |= 1 << 8; ///< Select All
+	} else {
+		cmd.cdw10 = zns->zones[zidx].zslba & 0xFFFFFFFF;
+		cmd.cdw11 = zns->zones[zidx].zslba >> 32;
+	}
+
+	err = nvme_qpair_submit_sync(qp, &cmd, zns->ns->ctrlr->timeout_ms, &cpl);
+	if (err) {
+		UPCIE_DEBUG("FAILED: nvme_qpair_submit_sync(); err(%d), status(0x%x)", err,
+			    cpl.status);
+		return err;
+	}
+
+	if (zidx == NVME_ZNS_ZONE_ALL) {
+		return nvme_zns_report(zns, qp, qp->heap);
+	}
+
+	zone = &zns->zones[zidx];
+	switch (zsa) {
+	case NVME_ZNS_ZSA_CLOSE:
+		zone->zs = zone->wp == zone->zslba ? NVME_ZNS_ZS_EMPTY : NVME_ZNS_ZS_CLOSED;
+		break;
+	case NVME_ZNS_ZSA_FINISH:
+		zone->zs = NVME_ZNS_ZS_FULL;
+		zone->wp = zone->zslba + zone->zcap;
+		break;
+	case NVME_ZNS_ZSA_OPEN:
+		zone->zs = NVME_ZNS_ZS_EOPEN;
+		break;
+	case NVME_ZNS_ZSA_RESET:
+		zone->zs = NVME_ZNS_ZS_EMPTY;
+		zone->wp = zone->zslba;
+		break;
+	case NVME_ZNS_ZSA_OFFLINE:
+		zone->zs = NVME_ZNS_ZS_OFFLINE;
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Explicitly open the zone of index `zidx`; see nvme_zns_mgmt_send()
+ */
+static inline int
+nvme_zns_zone_open(struct nvme_zns *zns, struct nvme_qpair *qp, uint64_t zidx)
+{
+	return nvme_zns_mgmt_send(zns, qp, zidx, NVME_ZNS_ZSA_OPEN);
+}
+
+/**
+ * Transition the zone of index `zidx` to Full; see nvme_zns_mgmt_send()
+ */
+static inline int
+nvme_zns_zone_finish(struct nvme_zns *zns, struct nvme_qpair *qp, uint64_t zidx)
+{
+	return nvme_zns_mgmt_send(zns, qp, zidx, NVME_ZNS_ZSA_FINISH);
+}
+
+/**
+ * Reset the write pointer of the zone of index `zidx`, making it Empty; see nvme_zns_mgmt_send()
+ */
+static inline int
+nvme_zns_zone_reset(struct nvme_zns *zns, struct nvme_qpair *qp, uint64_t zidx)
+{
+	return nvme_zns_mgmt_send(zns, qp, zidx, NVME_ZNS_ZSA_RESET);
+}
+
+/**
+ * Returns the first logical block written by a Zone Append, from its completion; dword 0 and 1
+ */
+static inline uint64_t
+nvme_zns_append_lba(const struct nvme_completion *cpl)
+{
+	return ((uint64_t)cpl->rsvd << 32) | cpl->cdw0;
+}
+
+/**
+ * Enqueue a Zone Append of `nlb` logical blocks from `buf` to the zone of index `zidx`
+ *
+ * The SQ doorbell is not written, thus, a batch of appends is enqueued, and then the doorbell
+ * written, once, via nvme_qpair_sqdb_update(); see nvme_zns_append_async(). On success, the write
+ * pointer of the zone table is advanced by `nlb`. The logical block written is given to `cb` in
+ * the completion, see nvme_zns_append_lba(). The buffer holds `nlb` times 'xfer_nbytes' of the
+ * namespace, and must remain valid until the callback has been invoked.
+ *
+ * @return On success 0 is returned. When the append exceeds the capacity of the zone, or the zone
+ *         is not writable, -ENOSPC is returned; when `nlb` exceeds 'zasl_nlb', -EINVAL. When the
+ *         qpair is exhausted, -EBUSY is returned. On other errors, negative errno is returned.
+ */
+static inline int
+nvme_zns_append_enqueue(struct nvme_zns *zns, struct nvme_qpair *qp, struct hostmem_heap *heap,
+			uint64_t zidx, void *buf, uint32_t nlb, nvme_request_cb cb, void *user)
+{
+	struct nvme_zns_zone *zone;
+	struct nvme_request *req;
+	struct nvme_command cmd;
+	int err;
+
+	if (zidx >= zns->nzones || !nlb || nlb > zns->zasl_nlb) {
+		return -EINVAL;
+	}
+	zone = &zns->zones[zidx];
+
+	if (zone->wp + nlb > zone->zslba + zone->zcap || zone->zs == NVME_ZNS_ZS_FULL ||
+	    zone->zs == NVME_ZNS_ZS_RONLY || zone->zs == NVME_ZNS_ZS_OFFLINE) {
+		return -ENOSPC;
+	}
+
+	req = nvme_request_alloc(qp->rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = cb;
+	req->user = user;
+
+	nvme_namespace_prep(zns->ns, &cmd, 0x7D, zone->zslba, nlb); ///< Zone Append
+	cmd.cid = req->cid;
+
+	err = nvme_request_prep_command_prps_contig(req, heap, buf,
+						    (size_t)nlb * zns->ns->xfer_nbytes, &cmd);
+	if (!err) {
+		err = nvme_qpair_enqueue(qp, &cmd);
+	}
+	if (err) {
+		nvme_request_free(qp->rpool, req->cid);
+		return err == -ENOMEM ? -EBUSY : err;
+	}
+
+	zone->wp += nlb;
+	if (zone->zs == NVME_ZNS_ZS_EMPTY || zone->zs == NVME_ZNS_ZS_CLOSED) {
+		zone->zs = NVME_ZNS_ZS_IOPEN;
+	}
+	if (zone->wp == zone->zslba + zone->zcap) {
+		zone->zs = NVME_ZNS_ZS_FULL;
+	}
+
+	return 0;
+}
+
+/**
+ * Submit a Zone Append without waiting for its completion; see nvme_zns_append_enqueue()
+ *
+ * Same as nvme_zns_append_enqueue(), and writes the SQ doorbell.
+ */
+static inline int
+nvme_zns_append_async(struct nvme_zns *zns, struct nvme_qpair *qp, struct hostmem_heap *heap,
+		      uint64_t zidx, void *buf, uint32_t nlb, nvme_request_cb cb, void *user)
+{
+	int err;
+
+	err = nvme_zns_append_enqueue(zns, qp, heap, zidx, buf, nlb, cb, user);
+	if (err) {
+		return err;
+	}
+	nvme_qpair_sqdb_update(qp);
+
+	return 0;
+}
@@ -7,11 +7,20 @@
  *
  * - Scan system for PCI devices / functions
  *   - Callback invocation on each discovered function
+ *   - Filtered by vendor and class, via pci_scan_filter(), reading only the 'class' and 'vendor'
+ *     of functions which do not match
+ *
+ * - Index of the functions, via pci_index_build(), with the NUMA node, IOMMU group, and upstream
+ *   bridge of each, without opening them; optionally cached in a file, see pci_index_init()
  *
  * - Retrieve "handles" to PCI devices via pci_func_{open,close} using PCI BDF
  *  - Handles provide PCI addresses, identifiers, and a container for BAR regions
  *
  * - Does BAR region mapping via /sys/bus/pci/devices/<PCI_ADDR>/resourceX
+ *   - Write-combining mapping of prefetchable BARs via resourceX_wc, e.g. for device memory which
+ *     the host writes, but rarely reads, and the bus address of a BAR via 'resource'
+ *
+ * - Retrieves the NUMA node of a function via /sys/bus/pci/devices/<PCI_ADDR>/numa_node
  *
  * - Provides MMIO accessor functions: pci_region_read32, pci_region_read64, pci_region_write32,
  *   and pci_region_write64
@@ -22,6 +31,9 @@
 #define PCI_BDF_LEN 12
 #define PCI_NBARS 6
 
+#define PCI_CLASS_NVME 0x010802 ///< Mass storage, Non-Volatile Memory controller, NVM Express
+#define PCI_INDEX_MAGIC "upcie-pci-index-v1"
+
 enum pci_scan_action { PCI_SCAN_ACTION_CLAIM_FUNC = 0x1, PCI_SCAN_ACTION_RELEASE_FUNC = 0x2 };
 
 struct pci_addr {
@@ -76,6 +88,7 @@ struct pci_func {
 	char bdf[PCI_BDF_LEN + 1];           ///< PCI address as a null-terminated full BDF string
 	struct pci_idents ident;             ///< Describes who made it and what it is
 	struct pci_func_bar bars[PCI_NBARS]; ///< The six BARs associated with a PCI Function
+	int numa_node;                       ///< NUMA node local to the function; -1 when unknown
 };
 
 /**
@@ -86,6 +99,35 @@ struct pci_func {
  */
 typedef int (*pci_func_callback)(struct pci_func *func, void *callback_arg);
 
+/**
+ * Selection of functions by vendor and class; a zeroed filter matches all functions
+ */
+struct pci_filter {
+	uint16_t vendor_id; ///< Vendor to match; 0 matches any vendor
+	uint32_t classcode; ///< Class to match, under 'classmask'
+	uint32_t classmask; ///< Bits of the classcode to match; 0 matches any, 0xFFFFFF the exact
+};
+
+/**
+ * A function in the pci_index; what is known of it without opening it
+ */
+struct pci_index_entry {
+	char bdf[PCI_BDF_LEN + 1];    ///< PCI address as a null-terminated full BDF string
+	char parent[PCI_BDF_LEN + 1]; ///< BDF of the upstream bridge, e.g. switch port; "" at root
+	struct pci_idents ident;      ///< Describes who made it and what it is
+	int numa_node;                ///< NUMA node local to the function; -1 when unknown
+	int iommu_group;              ///< IOMMU group of the function; -1 when not in one
+};
+
+/**
+ * The functions matching a filter, sorted by BDF
+ */
+struct pci_index {
+	struct pci_index_entry *entries; ///< Array of 'nentries' entries
+	size_t nentries;                 ///< Number of entries
+	struct pci_filter filter;        ///< The filter the index was built with
+};
+
 static inline int
 pci_bar_pr(struct pci_func_bar *bar)
 {
@@ -116,6 +158,7 @@ pci_func_pr(struct pci_func *func)
 	printf("    vendor_id: 0x%" PRIx16 "\n", func->ident.vendor_id);
 	printf("    device_id: 0x%" PRIx16 "\n", func->ident.device_id);
 	printf("    classcode: 0x%" PRIx32 "\n", func->ident.classcode);
+	printf("  numa_node: %d\n", func->numa_node);
 
 	return wrtn;
 }
@@ -143,6 +186,46 @@ pci_addr_from_text(const char *text, struct pci_addr *addr)
 	return 0;
 }
 
+/**
+ * Read the NUMA node local to the function at `bdf` from sysfs
+ *
+ * @param bdf The PCI address of the function, e.g. '0000:05:00.0'
+ * @param node Pointer to store the node in; -1 when the system does not report one
+ *
+ * @return 0 on success, negative errno on failure.
+ */
+static inline int
+pci_numa_node(const char *bdf, int *node)
+{
+	char path[256] = {0};
+	char buf[16] = {0};
+	ssize_t ret;
+	int fd;
+
+	if (!bdf || !node) {
+		return -EINVAL;
+	}
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s/numa_node", PCI_BDF_LEN, bdf);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	ret = read(fd, buf, sizeof(buf) - 1);
+	if (ret < 0) {
+		close(fd);
+		return -errno;
+	}
+	buf[ret] = 0;
+	close(fd);
+
+	*node = strtol(buf, NULL, 10);
+
+	return 0;
+}
+
 /**
  * Populates the given char-array with a textual representation of the given 'addr'
  */
@@ -223,6 +306,11 @@ pci_func_open(const char *bdf, struct pci_func *func)
 	func->ident.classcode = strtoul(buf, NULL, 16);
 	close(fd);
 
+	// numa_node; not available on all systems
+	if (pci_numa_node(func->bdf, &func->numa_node)) {
+		func->numa_node = -1;
+	}
+
 	for (int id = 0; id < PCI_NBARS; ++id) {
 		func->bars[id].id = id;
 		func->bars[id].fd = -1;
@@ -321,15 +409,59 @@ pci_bar_largest_size(const char *bdf, size_t *size)
 	return 0;
 }
 
+/**
+ * Read the bus address of PCI BAR `id` for the function at `bdf` from sysfs
+ *
+ * That is, the address at which peers, and the function itself, reach the BAR. E.g. an NVMe
+ * controller is given the address of its Controller Memory Buffer via this.
+ *
+ * @return 0 on success, negative errno on failure; -ENOENT when the BAR is not mapped.
+ */
 static inline int
-pci_bar_map(const char *bdf, uint8_t id, struct pci_func_bar *bar)
+pci_bar_addr(const char *bdf, uint8_t id, uint64_t *addr)
+{
+	char path[256] = {0};
+	char line[128];
+	FILE *fp;
+	int err = -ENOENT;
+
+	if (!bdf || !addr || id >= PCI_NBARS) {
+		return -EINVAL;
+	}
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s/resource", PCI_BDF_LEN, bdf);
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		return -errno;
+	}
+
+	for (int i = 0; fgets(line, sizeof(line), fp); ++i) {
+		unsigned long long start, end, flags;
+
+		if (i != id) {
+			continue;
+		}
+		if (sscanf(line, "%llx %llx %llx", &start, &end, &flags) == 3 && start) {
+			*addr = start;
+			err = 0;
+		}
+		break;
+	}
+	fclose(fp);
+
+	return err;
+}
+
+static inline int
+pci_bar_map_file(const char *bdf, uint8_t id, const char *suffix, struct pci_func_bar *bar)
 {
 	struct stat barstat = {0};
 	char path[256] = {0};
 	int err;
 
-	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s/resource%" PRIu8, PCI_BDF_LEN, bdf,
-		 id);
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s/resource%" PRIu8 "%s", PCI_BDF_LEN,
+		 bdf, id, suffix);
 
 	err = stat(path, &barstat);
 	if (err) {
@@ -354,6 +486,26 @@ pci_bar_map(const char *bdf, uint8_t id, struct pci_func_bar *bar)
 	return 0;
 }
 
+static inline int
+pci_bar_map(const char *bdf, uint8_t id, struct pci_func_bar *bar)
+{
+	return pci_bar_map_file(bdf, id, "", bar);
+}
+
+/**
+ * Map PCI BAR `id` write-combining, via resourceX_wc, thus, stores to it are posted in bursts
+ *
+ * Stores are only guaranteed to have reached the device after a store barrier, see wmb().
+ *
+ * @return 0 on success, negative errno on failure; -ENOENT when the BAR is not prefetchable, in
+ *         which case pci_bar_map() can be used instead.
+ */
+static inline int
+pci_bar_map_wc(const char *bdf, uint8_t id, struct pci_func_bar *bar)
+{
+	return pci_bar_map_file(bdf, id, "_wc", bar);
+}
+
 static inline void
 pci_func_close(struct pci_func *func)
 {
@@ -367,10 +519,148 @@ pci_func_close(struct pci_func *func)
 }
 
 /**
- * Scans /sys/bus/pci/devices for PCI functions and calls the provided callback for each one
+ * Read the sysfs attribute `attr` of the function at `bdf`, e.g. 'class', into `buf`
+ *
+ * @return On success, 0 is returned, with `buf` null-terminated. On error, negative errno is
+ *         returned to indicate the error.
  */
 static inline int
-pci_scan(pci_func_callback callback, void *callback_arg)
+pci_attr_read(const char *bdf, const char *attr, char *buf, size_t len)
+{
+	char path[256] = {0};
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s/%s", PCI_BDF_LEN, bdf, attr);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	ret = read(fd, buf, len - 1);
+	if (ret < 0) {
+		close(fd);
+		return -errno;
+	}
+	buf[ret] = 0;
+	close(fd);
+
+	return 0;
+}
+
+/**
+ * Same as pci_attr_read(), for an attribute holding a hexadecimal value, e.g. 'vendor'
+ */
+static inline int
+pci_attr_read_hex(const char *bdf, const char *attr, uint32_t *val)
+{
+	char buf[16] = {0};
+	int err;
+
+	err = pci_attr_read(bdf, attr, buf, sizeof(buf));
+	if (err) {
+		return err;
+	}
+	*val = strtoul(buf, NULL, 16);
+
+	return 0;
+}
+
+/**
+ * Read the IOMMU group of the function at `bdf`, from its sysfs 'iommu_group' link
+ *
+ * @param bdf The PCI address of the function, e.g. '0000:05:00.0'
+ * @param group Pointer to store the group in; -1 when the function is not in one
+ *
+ * @return 0 on success, negative errno on failure.
+ */
+static inline int
+pci_iommu_group(const char *bdf, int *group)
+{
+	char path[256] = {0};
+	char link[256] = {0};
+	ssize_t ret;
+	char *base;
+
+	*group = -1;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s/iommu_group", PCI_BDF_LEN, bdf);
+
+	ret = readlink(path, link, sizeof(link) - 1);
+	if (ret < 0) {
+		return -errno;
+	}
+	link[ret] = 0;
+
+	base = strrchr(link, '/');
+	*group = strtol(base ? base + 1 : link, NULL, 10);
+
+	return 0;
+}
+
+/**
+ * Find the BDF of the bridge upstream of the function at `bdf`, from its place in /sys/devices
+ *
+ * The bridge is, e.g. a root port, or the downstream port of a switch. Functions behind the same
+ * switch share the parent of their bridges, that is, the upstream port of the switch.
+ *
+ * @param bdf The PCI address of the function, e.g. '0000:05:00.0'
+ * @param parent Array of PCI_BDF_LEN + 1; empty when the function is on a root bus
+ *
+ * @return 0 on success, negative errno on failure.
+ */
+static inline int
+pci_parent(const char *bdf, char *parent)
+{
+	struct pci_addr addr;
+	char path[256] = {0};
+	char *real, *base;
+
+	parent[0] = 0;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.*s", PCI_BDF_LEN, bdf);
+
+	real = realpath(path, NULL);
+	if (!real) {
+		return -errno;
+	}
+
+	// E.g. /sys/devices/pci0000:00/0000:00:1c.0/0000:02:00.0, where "pci0000:00" is no function
+	base = strrchr(real, '/');
+	if (base) {
+		*base = 0;
+		base = strrchr(real, '/');
+	}
+	if (base && strlen(base + 1) == PCI_BDF_LEN && !pci_addr_from_text(base + 1, &addr)) {
+		snprintf(parent, PCI_BDF_LEN + 1, "%s", base + 1);
+	}
+	free(real);
+
+	return 0;
+}
+
+static inline int
+pci_filter_match(const struct pci_filter *filter, uint16_t vendor_id, uint32_t classcode)
+{
+	if (!filter) {
+		return 1;
+	}
+	if (filter->vendor_id && filter->vendor_id != vendor_id) {
+		return 0;
+	}
+
+	return (classcode & filter->classmask) == (filter->classcode & filter->classmask);
+}
+
+/**
+ * Same as pci_scan(), calling the callback only for the functions matching `filter`
+ *
+ * Only the 'class' and 'vendor' attributes of a function are read to match it, a function is
+ * opened, via pci_func_open(), only when it matches. Passing NULL as `filter` matches all.
+ */
+static inline int
+pci_scan_filter(const struct pci_filter *filter, pci_func_callback callback, void *callback_arg)
 {
 	const char *sysfs_path = "/sys/bus/pci/devices";
 	int err = 0;
@@ -383,6 +673,7 @@ pci_scan(pci_func_callback callback, void *callback_arg)
 	}
 
 	while ((entry = readdir(dir))) {
+		uint32_t vendor_id, classcode;
 		struct pci_func *func;
 		int action;
 
@@ -390,14 +681,22 @@ pci_scan(pci_func_callback callback, void *callback_arg)
 			continue;
 		}
 
+		if (filter && (pci_attr_read_hex(entry->d_name, "vendor", &vendor_id) ||
+			       pci_attr_read_hex(entry->d_name, "class", &classcode) ||
+			       !pci_filter_match(filter, vendor_id, classcode))) {
+			continue;
+		}
+
 		func = calloc(1, sizeof(*func));
 		if (!func) {
-			return -errno;
+			err = -errno;
+			goto exit;
 		}
 
 		err = pci_func_open(entry->d_name, func);
 		if (err) {
 			free(func);
+			err = 0;
 			continue;
 		}
 
@@ -421,3 +720,306 @@ exit:
 	closedir(dir);
 	return err;
 }
+
+/**
+ * Scans /sys/bus/pci/devices for PCI functions and calls the provided callback for each one
+ */
+static inline int
+pci_scan(pci_func_callback callback, void *callback_arg)
+{
+	return pci_scan_filter(NULL, callback, callback_arg);
+}
+
+static inline int
+pci_index_pr(struct pci_index *index)
+{
+	int wrtn = 0;
+
+	wrtn += printf("pci_index:\n");
+	wrtn += printf("  nentries: %zu\n", index->nentries);
+	wrtn += printf("  entries:\n");
+	for (size_t i = 0; i < index->nentries; ++i) {
+		struct pci_index_entry *entry = &index->entries[i];
+
+		wrtn += printf("  - bdf: '%s'\n", entry->bdf);
+		wrtn += printf("    parent: '%s'\n", entry->parent);
+		wrtn += printf("    vendor_id: 0x%" PRIx16 "\n", entry->ident.vendor_id);
+		wrtn += printf("    device_id: 0x%" PRIx16 "\n", entry->ident.device_id);
+		wrtn += printf("    classcode: 0x%" PRIx32 "\n", entry->ident.classcode);
+		wrtn += printf("    numa_node: %d\n", entry->numa_node);
+		wrtn += printf("    iommu_group: %d\n", entry->iommu_group);
+	}
+
+	return wrtn;
+}
+
+static inline void
+pci_index_term(struct pci_index *index)
+{
+	free(index->entries);
+	memset(index, 0, sizeof(*index));
+}
+
+static inline int
+pci_index_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pci_index_entry *)a)->bdf,
+		      ((const struct pci_index_entry *)b)->bdf);
+}
+
+/**
+ * Append an entry to the index, growing it as needed; the index is sorted by the caller
+ */
+static inline struct pci_index_entry *
+pci_index_append(struct pci_index *index, size_t *capacity)
+{
+	if (index->nentries == *capacity) {
+		size_t ncapacity = *capacity ? *capacity * 2 : 64;
+		struct pci_index_entry *entries;
+
+		entries = realloc(index->entries, ncapacity * sizeof(*entries));
+		if (!entries) {
+			return NULL;
+		}
+		index->entries = entries;
+		*capacity = ncapacity;
+	}
+
+	memset(&index->entries[index->nentries], 0, sizeof(*index->entries));
+
+	return &index->entries[index->nentries++];
+}
+
+/**
+ * Index the functions in /sys/bus/pci/devices matching `filter`
+ *
+ * Same as pci_scan_filter(), the 'class' and 'vendor' of every function are read, and the rest
+ * only of the functions matching. The functions are not opened. Passing NULL as `filter` indexes
+ * all functions. The index must be released with pci_index_term().
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+pci_index_build(struct pci_index *index, const struct pci_filter *filter)
+{
+	struct dirent *dent;
+	size_t capacity = 0;
+	int err = 0;
+	DIR *dir;
+
+	memset(index, 0, sizeof(*index));
+	if (filter) {
+		index->filter = *filter;
+	}
+
+	dir = opendir("/sys/bus/pci/devices");
+	if (!dir) {
+		return -errno;
+	}
+
+	while ((dent = readdir(dir))) {
+		struct pci_index_entry *entry;
+		uint32_t vendor_id, device_id, classcode;
+		struct pci_addr addr;
+
+		if (dent->d_name[0] == '.' || strlen(dent->d_name) != PCI_BDF_LEN ||
+		    pci_addr_from_text(dent->d_name, &addr)) {
+			continue;
+		}
+
+		if (pci_attr_read_hex(dent->d_name, "vendor", &vendor_id) ||
+		    pci_attr_read_hex(dent->d_name, "class", &classcode) ||
+		    !pci_filter_match(filter, vendor_id, classcode) ||
+		    pci_attr_read_hex(dent->d_name, "device", &device_id)) {
+			continue;
+		}
+
+		entry = pci_index_append(index, &capacity);
+		if (!entry) {
+			err = -ENOMEM;
+			UPCIE_DEBUG("FAILED: pci_index_append(); err(%d)", err);
+			pci_index_term(index);
+			goto exit;
+		}
+		snprintf(entry->bdf, sizeof(entry->bdf), "%.*s", PCI_BDF_LEN, dent->d_name);
+		entry->ident.vendor_id = vendor_id;
+		entry->ident.device_id = device_id;
+		entry->ident.classcode = classcode;
+
+		// Not available on all systems, thus, not an error
+		if (pci_numa_node(entry->bdf, &entry->numa_node)) {
+			entry->numa_node = -1;
+		}
+		pci_iommu_group(entry->bdf, &entry->iommu_group);
+		pci_parent(entry->bdf, entry->parent);
+	}
+
+	qsort(index->entries, index->nentries, sizeof(*index->entries), pci_index_entry_cmp);
+
+exit:
+	closedir(dir);
+	return err;
+}
+
+/**
+ * Returns the entry of the function at `bdf`, or NULL when it is not in the index
+ */
+static inline struct pci_index_entry *
+pci_index_find(struct pci_index *index, const char *bdf)
+{
+	struct pci_index_entry key = {0};
+
+	snprintf(key.bdf, sizeof(key.bdf), "%.*s", PCI_BDF_LEN, bdf);
+
+	return bsearch(&key, index->entries, index->nentries, sizeof(*index->entries),
+		       pci_index_entry_cmp);
+}
+
+/**
+ * Write the index to the file at `path`, as text, a line per function, for pci_index_load()
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+pci_index_save(struct pci_index *index, const char *path)
+{
+	int err = 0;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		return -errno;
+	}
+
+	fprintf(fp, "%s %" PRIx16 " %" PRIx32 " %" PRIx32 "\n", PCI_INDEX_MAGIC,
+		index->filter.vendor_id, index->filter.classcode, index->filter.classmask);
+	for (size_t i = 0; i < index->nentries; ++i) {
+		struct pci_index_entry *entry = &index->entries[i];
+
+		fprintf(fp, "%s %" PRIx16 " %" PRIx16 " %" PRIx32 " %d %d %s\n", entry->bdf,
+			entry->ident.vendor_id, entry->ident.device_id, entry->ident.classcode,
+			entry->numa_node, entry->iommu_group,
+			entry->parent[0] ? entry->parent : "-");
+	}
+
+	if (ferror(fp)) {
+		err = -EIO;
+	}
+	if (fclose(fp) && !err) {
+		err = -errno;
+	}
+
+	return err;
+}
+
+/**
+ * Read an index written by pci_index_save(), which must have been built with `filter`
+ *
+ * The file is taken as is; it is up to the caller to discard it when the functions change, e.g.
+ * on hotplug, or when SR-IOV VFs are created.
+ *
+ * @return On success 0 is returned. When the file was built with another filter, -ESTALE is
+ *         returned. On other errors, negative errno is returned to indicate the error.
+ */
+static inline int
+pci_index_load(struct pci_index *index, const struct pci_filter *filter, const char *path)
+{
+	struct pci_filter any = {0};
+	unsigned int vendor_id, classcode, classmask;
+	char magic[32] = {0};
+	size_t capacity = 0;
+	char line[128];
+	int err = 0;
+	FILE *fp;
+
+	memset(index, 0, sizeof(*index));
+	filter = filter ? filter : &any;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		return -errno;
+	}
+
+	if (!fgets(line, sizeof(line), fp) ||
+	    sscanf(line, "%31s %x %x %x", magic, &vendor_id, &classcode, &classmask) != 4 ||
+	    strcmp(magic, PCI_INDEX_MAGIC)) {
+		err = -EINVAL;
+		goto exit;
+	}
+	if (vendor_id != filter->vendor_id || classcode != filter->classcode ||
+	    classmask != filter->classmask) {
+		err = -ESTALE;
+		goto exit;
+	}
+	index->filter = *filter;
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct pci_index_entry *entry;
+		unsigned int vid, did, class;
+		char bdf[16], parent[16];
+		int numa_node, iommu_group;
+
+		if (sscanf(line, "%15s %x %x %x %d %d %15s", bdf, &vid, &did, &class, &numa_node,
+			   &iommu_group, parent) != 7) {
+			err = -EINVAL;
+			break;
+		}
+
+		entry = pci_index_append(index, &capacity);
+		if (!entry) {
+			err = -ENOMEM;
+			break;
+		}
+		snprintf(entry->bdf, sizeof(entry->bdf), "%.*s", PCI_BDF_LEN, bdf);
+		snprintf(entry->parent, sizeof(entry->parent), "%.*s", PCI_BDF_LEN,
+			 strcmp(parent, "-") ? parent : "");
+		entry->ident.vendor_id = vid;
+		entry->ident.device_id = did;
+		entry->ident.classcode = class;
+		entry->numa_node = numa_node;
+		entry->iommu_group = iommu_group;
+	}
+
+	qsort(index->entries, index->nentries, sizeof(*index->entries), pci_index_entry_cmp);
+
+exit:
+	if (err) {
+		UPCIE_DEBUG("FAILED: pci_index_load(%s); err(%d)", path, err);
+		pci_index_term(index);
+	}
+	fclose(fp);
+
+	return err;
+}
+
+/**
+ * Load the index from the file at `cache`, or, when it is missing or stale, build and save it
+ *
+ * Passing NULL as `cache` always builds the index. Failing to save the cache is not an error.
+ *
+ * @return On success 0 is returned. On error, negative errno is returned to indicate the error.
+ */
+static inline int
+pci_index_init(struct pci_index *index, const struct pci_filter *filter, const char *cache)
+{
+	int err;
+
+	if (cache && !pci_index_load(index, filter, cache)) {
+		return 0;
+	}
+
+	err = pci_index_build(index, filter);
+	if (err) {
+		UPCIE_DEBUG("FAILED: pci_index_build(); err(%d)", err);
+		return err;
+	}
+
+	if (cache) {
+		err = pci_index_save(index, cache);
+		if (err) {
+			UPCIE_DEBUG("FAILED: pci_index_save(%s); err(%d)", cache, err);
+		}
+	}
+
+	return 0;
+}
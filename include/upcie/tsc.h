@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) Simon Andreas Frimann Lund <os@safl.dk>
+
+/**
+ * Time-Stamp Counter
+ * ==================
+ *
+ * Cheap, monotonic timestamps for deadlines in polling loops, where calling into clock_gettime()
+ * and usleep() per iteration is too coarse. On x86 the TSC is read via rdtsc, on aarch64 the
+ * virtual counter of the generic timer (cntvct_el0) is read.
+ *
+ * The tick-frequency is provided by tsc_hz(). On aarch64 it is read from cntfrq_el0, on x86 it is
+ * calibrated against CLOCK_MONOTONIC_RAW on first use; this busy-waits for about a millisecond.
+ * The calibrated value is cached per translation unit.
+ *
+ * Caveat: on x86 an invariant TSC is assumed, that is, constant rate and synchronized across
+ * cores, as is the case for any x86 CPU from the last decade.
+ *
+ * Will not compile on other architectures.
+ *
+ * @file tsc.h
+ * @version 0.4.4
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // for __rdtsc()
+#endif
+
+#define TSC_CALIBRATION_NS 1000000ULL
+
+/**
+ * Read the time-stamp counter
+ */
+static inline uint64_t
+tsc_read(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t val;
+
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+
+	return val;
+#else
+#error "tsc_read() not implemented for this architecture"
+#endif
+}
+
+static inline uint64_t
+tsc_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns the number of ticks per second of the counter read by tsc_read()
+ */
+static inline uint64_t
+tsc_hz(void)
+{
+	static uint64_t hz;
+
+	if (!hz) {
+#if defined(__aarch64__)
+		__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(hz));
+#else
+		uint64_t ns_begin, ns_end, tsc_begin, tsc_end;
+
+		ns_begin = tsc_clock_ns();
+		tsc_begin = tsc_read();
+		do {
+			ns_end = tsc_clock_ns();
+		} while (ns_end - ns_begin < TSC_CALIBRATION_NS);
+		tsc_end = tsc_read();
+
+		hz = ((tsc_end - tsc_begin) * 1000000000ULL) / (ns_end - ns_begin);
+#endif
+	}
+
+	return hz;
+}
+
+/**
+ * Convert the given number of microseconds into ticks
+ */
+static inline uint64_t
+tsc_from_us(uint64_t us)
+{
+	return (tsc_hz() / 1000000ULL) * us;
+}
+
+/**
+ * Convert the given number of milliseconds into ticks
+ */
+static inline uint64_t
+tsc_from_ms(uint64_t ms)
+{
+	return (tsc_hz() / 1000ULL) * ms;
+}
@@ -49,26 +49,32 @@ extern "C" {
 #include <fcntl.h>
 #include <inttypes.h>
 #include <linux/memfd.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 // Linux UAPI
 #include <linux/memfd.h>
+#include <linux/mempolicy.h>
 #include <linux/pci_regs.h>
 #include <linux/vfio.h>
 
 // uPCIe libraries
 #include <upcie/debug.h>
 #include <upcie/barriers.h>
+#include <upcie/tsc.h>
 #include <upcie/bitfield.h>
 #include <upcie/dmabuf.h>
 #include <upcie/hostmem.h>
@@ -76,6 +82,7 @@ extern "C" {
 #include <upcie/hostmem_hugepage.h>
 #include <upcie/hostmem_heap.h>
 #include <upcie/hostmem_dma.h>
+#include <upcie/hostmem_dma_pool.h>
 #include <upcie/mmio.h>
 #include <upcie/pci.h>
 #include <upcie/vfioctl.h>
@@ -83,12 +90,26 @@ extern "C" {
 // uPCIe NVMe libraries
 #ifdef _UPCIE_WITH_NVME
 #include <upcie/nvme/nvme_command.h>
+#include <upcie/nvme/nvme_cmb.h>
 #include <upcie/nvme/nvme_request.h>
+#include <upcie/nvme/nvme_telemetry.h>
+#include <upcie/nvme/nvme_trace.h>
 #include <upcie/nvme/nvme_mmio.h>
 #include <upcie/nvme/nvme_qid.h>
 #include <upcie/nvme/nvme_qpair.h>
+#include <upcie/nvme/nvme_cq.h>
 #include <upcie/nvme/nvme_controller.h>
 #include <upcie/nvme/nvme_controller_vfio.h>
+#include <upcie/nvme/nvme_namespace.h>
+#include <upcie/nvme/nvme_pi.h>
+#include <upcie/nvme/nvme_zns.h>
+#include <upcie/nvme/nvme_irq.h>
+#include <upcie/nvme/nvme_mpsc.h>
+#include <upcie/nvme/nvme_offload.h>
+#include <upcie/nvme/nvme_reactor.h>
+#include <upcie/nvme/nvme_sched.h>
+#include <upcie/nvme/nvme_service.h>
+#include <upcie/nvme/nvme_stripe.h>
 #endif
 
 #ifdef __cplusplus
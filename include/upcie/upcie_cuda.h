@@ -33,9 +33,12 @@ extern "C" {
 
 // CUDA uPCIe NVMe libraries
 #ifdef _UPCIE_WITH_NVME
+#include <upcie/nvme/nvme_request_cuda_device.h>
 #include <upcie/nvme/nvme_request_cuda.h>
 #include <upcie/nvme/nvme_qpair_cuda.h>
+#include <upcie/nvme/nvme_engine_cuda.h>
 #include <upcie/nvme/nvme_controller_cuda.h>
+#include <upcie/nvme/nvme_stripe_cuda.h>
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Benchmarks GPU-initiated I/O via the shared submission path of nvme_qpair_cuda
+// (include/upcie/nvme/nvme_qpair_cuda.h), with the kernels in tests/nvme_cuda_kernels.cu
+//
+// Sweeps the cartesian product of the given lists of parameters, with a case per combination:
+//
+//   grid     Number of thread blocks
+//   block    Number of threads per block
+//   queues   Number of queue-pairs, created per combination of queues and depth
+//   depth    Depth of each queue-pair, that is, depth commands in flight per queue-pair
+//   bs       Bytes per I/O; a multiple of the LBA size, at most the MDTS
+//   pattern  seq or rand; slots of bs bytes over the first span bytes of namespace 1
+//   rw       read or write; note that write overwrites the span
+//   ios      Number of I/Os per case
+//   span     Bytes of namespace 1 addressed; 0, the default, is the whole namespace
+//
+// Each case is reported as a line of YAML, with the bandwidth and IOPS over the wall-clock time of
+// the kernel, and the distribution of the latency of each I/O, as measured on the device via
+// clock64(), converted via nvme_qpair_cuda->clocks_per_ms. Run via 'meson test --benchmark', with
+// the controller given via the 'bench-bdf' option, or directly, e.g.:
+//
+//   bench_cuda_nvme 0000:01:00.0 grid=1,16 block=64 queues=1,4 depth=64 bs=4096,131072
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie_cuda.h>
+
+int nvme_bench_launch(struct nvme_qpair_cuda **qps, struct nvme_request_cuda_lists *lists,
+		      uint32_t num_queues, struct nvme_request_cuda_lut *lut, uint8_t *bufs,
+		      uint32_t nbufs, uint8_t opc, uint32_t io_nbytes, int lba_shift,
+		      uint64_t nslots, int random, int *results, long long *cycles,
+		      uint32_t num_ios, unsigned int grid, unsigned int block, float *elapsed_ms);
+
+#define BENCH_PARAM_NVALUES 16
+#define BENCH_BUFS_NBYTES (1024 * 1024 * 256ULL) ///< Bound on the I/O buffers of a case
+#define BENCH_HEAP_NBYTES (BENCH_BUFS_NBYTES + 1024 * 1024 * 64ULL)
+
+struct bench_param {
+	const char *name;
+	uint64_t values[BENCH_PARAM_NVALUES];
+	int nvalues;
+};
+
+enum bench_param_idx {
+	BENCH_GRID = 0,
+	BENCH_BLOCK,
+	BENCH_QUEUES,
+	BENCH_DEPTH,
+	BENCH_BS,
+	BENCH_PATTERN,
+	BENCH_RW,
+	BENCH_IOS,
+	BENCH_SPAN,
+	BENCH_NPARAMS,
+};
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+	struct cudamem_config cuda_config;
+	struct cudamem_heap cuda_heap;
+	CUcontext cu_ctx;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair_cuda **ioqs;            ///< Host array of device queue-pair pointers
+	struct nvme_qpair_cuda **cu_ioqs;         ///< Device array of queue-pair pointers
+	struct nvme_request_cuda_lists *lists;    ///< Host array of PRP list pages, one per queue
+	struct nvme_request_cuda_lists *cu_lists; ///< Device array of the PRP list pages
+	struct nvme_request_cuda_lut lut;         ///< LUT of the CUDA heap
+	int num_queues;
+	int queue_depth;
+	int lba_shift;   ///< LBA size of namespace 1, as a power of two
+	uint64_t nsze;   ///< Size of namespace 1, in LBAs
+	uint64_t clocks_per_ms;
+};
+
+static int
+cmp_cycles(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Parse "<name>=<value>[,<value>]..." into the parameter of the given name
+ *
+ * The values of pattern are seq (0) and rand (1), those of rw are read (0x2) and write (0x1).
+ */
+static int
+bench_param_parse(struct bench_param *params, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	char buf[256];
+
+	if (!eq || strlen(eq + 1) >= sizeof(buf)) {
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < BENCH_NPARAMS; i++) {
+		struct bench_param *param = &params[i];
+		char *save = NULL;
+
+		if (strlen(param->name) != (size_t)(eq - arg) ||
+		    strncmp(param->name, arg, eq - arg)) {
+			continue;
+		}
+
+		snprintf(buf, sizeof(buf), "%s", eq + 1);
+		param->nvalues = 0;
+		for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			uint64_t value;
+
+			if (param->nvalues == BENCH_PARAM_NVALUES) {
+				return -E2BIG;
+			}
+			if (i == BENCH_PATTERN) {
+				value = !strcmp(tok, "rand");
+			} else if (i == BENCH_RW) {
+				value = !strcmp(tok, "write") ? 0x1 : 0x2;
+			} else {
+				value = strtoull(tok, NULL, 0);
+			}
+			param->values[param->nvalues++] = value;
+		}
+
+		return param->nvalues ? 0 : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+void
+rte_term(struct rte *rte)
+{
+	hostmem_heap_term(&rte->heap);
+	cudamem_heap_term(&rte->cuda_heap);
+	cuCtxDestroy(rte->cu_ctx);
+}
+
+int
+rte_init(struct rte *rte)
+{
+	CUdevice cu_dev;
+	int err;
+
+	err = hostmem_config_init(&rte->config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return err;
+	}
+
+	err = hostmem_heap_init(&rte->heap, 1024 * 1024 * 128ULL, &rte->config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return err;
+	}
+
+	err = cuInit(0);
+	if (!err) {
+		err = cuDeviceGet(&cu_dev, 0);
+	}
+	if (err) {
+		printf("FAILED: cuInit() / cuDeviceGet(); err(%d)\n", err);
+		hostmem_heap_term(&rte->heap);
+		return err;
+	}
+
+	err = cudamem_ctx_create(&rte->cu_ctx, cu_dev);
+	if (err) {
+		printf("FAILED: cuCtxCreate(); err(%d)\n", err);
+		hostmem_heap_term(&rte->heap);
+		return err;
+	}
+
+	err = cudamem_config_init(&rte->cuda_config, 0);
+	if (!err) {
+		err = cudamem_heap_init(&rte->cuda_heap, BENCH_HEAP_NBYTES, &rte->cuda_config);
+	}
+	if (err) {
+		printf("FAILED: cudamem_config_init() / cudamem_heap_init(); err(%d)\n", err);
+		cuCtxDestroy(rte->cu_ctx);
+		hostmem_heap_term(&rte->heap);
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Identify namespace 1, for its LBA size and size
+ */
+int
+nvme_identify_ns(struct nvme *nvme)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *idfy = nvme->ctrlr.buf;
+	int err;
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = 1;
+	cmd.cdw10 = 0; // CNS=0: Identify Namespace
+
+	err = nvme_qpair_submit_sync_contig_prps(&nvme->ctrlr.aq, nvme->ctrlr.heap,
+						 nvme->ctrlr.buf, 4096, &cmd,
+						 nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+		return err;
+	}
+	memcpy(&nvme->nsze, idfy, sizeof(nvme->nsze));
+	nvme->lba_shift = idfy[128 + 4 * (idfy[26] & 0xF) + 2]; ///< LBADS of the format in FLBAS
+
+	return 0;
+}
+
+/**
+ * Delete the queue-pairs, and their PRP list pages
+ */
+void
+nvme_queues_term(struct nvme *nvme, struct rte *rte)
+{
+	for (int i = 0; nvme->lists && i < nvme->num_queues; i++) {
+		nvme_request_cuda_lists_term(&nvme->lists[i], &rte->cuda_heap);
+	}
+	cuMemFree((CUdeviceptr)nvme->cu_lists);
+	free(nvme->lists);
+	nvme->cu_lists = NULL;
+	nvme->lists = NULL;
+
+	for (int i = 0; i < nvme->num_queues; i++) {
+		nvme_controller_cuda_delete_io_qpair(&nvme->ctrlr, nvme->ioqs[i],
+						     &rte->cuda_heap);
+		cuMemFree((CUdeviceptr)nvme->ioqs[i]);
+	}
+	cuMemFree((CUdeviceptr)nvme->cu_ioqs);
+	free(nvme->ioqs);
+	nvme->cu_ioqs = NULL;
+	nvme->ioqs = NULL;
+	nvme->num_queues = 0;
+}
+
+/**
+ * Create num_queues queue-pairs of queue_depth, with PRP list pages for I/Os of max_nbytes
+ */
+int
+nvme_queues_init(struct nvme *nvme, struct rte *rte, int num_queues, int queue_depth,
+		 size_t max_nbytes)
+{
+	size_t pagesize = rte->cuda_config.pagesize;
+	size_t nentries = (max_nbytes + pagesize - 1) / pagesize;
+	uint32_t npages = 1 + nentries / (pagesize / sizeof(uint64_t) - 1);
+	struct nvme_qpair_cuda qp;
+	int err;
+
+	nvme->queue_depth = queue_depth;
+	nvme->ioqs = calloc(num_queues, sizeof(*nvme->ioqs));
+	nvme->lists = calloc(num_queues, sizeof(*nvme->lists));
+	if (!nvme->ioqs || !nvme->lists) {
+		err = -errno;
+		printf("FAILED: calloc(); err(%d)\n", err);
+		goto failed;
+	}
+
+	for (int i = 0; i < num_queues; i++) {
+		err = cuMemAlloc((CUdeviceptr *)&nvme->ioqs[i], sizeof(struct nvme_qpair_cuda));
+		if (err) {
+			printf("FAILED: cuMemAlloc(ioqs[%d]); CUresult(%d)\n", i, err);
+			goto failed;
+		}
+
+		// The shared path keeps depth - 1 commands in flight, thus the + 1
+		err = nvme_controller_cuda_create_io_qpair(&nvme->ctrlr, nvme->ioqs[i],
+							   queue_depth + 1, &rte->cuda_heap);
+		if (err) {
+			printf("FAILED: nvme_controller_cuda_create_io_qpair(%d); err(%d)\n", i,
+			       err);
+			cuMemFree((CUdeviceptr)nvme->ioqs[i]);
+			goto failed;
+		}
+		nvme->num_queues++;
+
+		err = nvme_request_cuda_lists_init(&nvme->lists[i], &rte->cuda_heap, queue_depth,
+						   npages);
+		if (err) {
+			printf("FAILED: nvme_request_cuda_lists_init(%d); err(%d)\n", i, err);
+			goto failed;
+		}
+	}
+
+	err = cuMemAlloc((CUdeviceptr *)&nvme->cu_ioqs, num_queues * sizeof(*nvme->ioqs));
+	if (!err) {
+		err = cuMemcpyHtoD((CUdeviceptr)nvme->cu_ioqs, nvme->ioqs,
+				   num_queues * sizeof(*nvme->ioqs));
+	}
+	if (!err) {
+		err = cuMemAlloc((CUdeviceptr *)&nvme->cu_lists, num_queues * sizeof(*nvme->lists));
+	}
+	if (!err) {
+		err = cuMemcpyHtoD((CUdeviceptr)nvme->cu_lists, nvme->lists,
+				   num_queues * sizeof(*nvme->lists));
+	}
+	if (!err) {
+		err = cuMemcpyDtoH(&qp, (CUdeviceptr)nvme->ioqs[0], sizeof(qp));
+	}
+	if (err) {
+		printf("FAILED: cuMemAlloc() / cuMemcpy(); CUresult(%d)\n", err);
+		goto failed;
+	}
+	nvme->clocks_per_ms = qp.clocks_per_ms;
+
+	return 0;
+
+failed:
+	nvme_queues_term(nvme, rte);
+	return err;
+}
+
+/**
+ * Run a case, with the queue-pairs of nvme, and report it
+ */
+int
+bench_case(struct nvme *nvme, struct rte *rte, uint64_t *values)
+{
+	const uint32_t num_ios = values[BENCH_IOS];
+	const uint32_t io_nbytes = values[BENCH_BS];
+	uint64_t span = values[BENCH_SPAN] ? values[BENCH_SPAN] : nvme->nsze << nvme->lba_shift;
+	uint64_t threads = values[BENCH_GRID] * values[BENCH_BLOCK];
+	uint64_t nbufs = BENCH_BUFS_NBYTES / io_nbytes;
+	int *results = NULL, *cu_results = NULL;
+	long long *cycles = NULL, *cu_cycles = NULL;
+	float elapsed_ms = 0;
+	uint8_t *bufs = NULL;
+	double usecs, secs, sum = 0;
+	int err;
+
+	if (!num_ios || !io_nbytes || (io_nbytes & ((1U << nvme->lba_shift) - 1)) ||
+	    ((io_nbytes >> nvme->lba_shift) > 0x10000) ||
+	    (nvme->ctrlr.mdts_nbytes && io_nbytes > nvme->ctrlr.mdts_nbytes) ||
+	    span / io_nbytes == 0) {
+		printf("  # SKIPPED: bs(%" PRIu32 ") with lba_shift(%d), mdts(%" PRIu32
+		       "), span(%" PRIu64 ")\n",
+		       io_nbytes, nvme->lba_shift, nvme->ctrlr.mdts_nbytes, span);
+		return 0;
+	}
+	if (nbufs > threads) {
+		nbufs = threads;
+	}
+
+	bufs = cudamem_heap_block_alloc(&rte->cuda_heap, nbufs * io_nbytes);
+	results = calloc(num_ios, sizeof(*results));
+	cycles = calloc(num_ios, sizeof(*cycles));
+	if (!bufs || !results || !cycles) {
+		err = -ENOMEM;
+		printf("FAILED: cudamem_heap_block_alloc() / calloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = cuMemAlloc((CUdeviceptr *)&cu_results, num_ios * sizeof(*results));
+	if (!err) {
+		err = cuMemAlloc((CUdeviceptr *)&cu_cycles, num_ios * sizeof(*cycles));
+	}
+	if (err) {
+		printf("FAILED: cuMemAlloc(); CUresult(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_bench_launch(nvme->cu_ioqs, nvme->cu_lists, nvme->num_queues, &nvme->lut,
+				bufs, nbufs, values[BENCH_RW], io_nbytes, nvme->lba_shift,
+				span / io_nbytes, values[BENCH_PATTERN], cu_results, cu_cycles,
+				num_ios, values[BENCH_GRID], values[BENCH_BLOCK], &elapsed_ms);
+	if (err) {
+		printf("FAILED: nvme_bench_launch(); cudaError_t(%d)\n", err);
+		goto exit;
+	}
+
+	err = cuMemcpyDtoH(results, (CUdeviceptr)cu_results, num_ios * sizeof(*results));
+	if (!err) {
+		err = cuMemcpyDtoH(cycles, (CUdeviceptr)cu_cycles, num_ios * sizeof(*cycles));
+	}
+	if (err) {
+		printf("FAILED: cuMemcpyDtoH(); CUresult(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < num_ios; i++) {
+		if (results[i]) {
+			printf("FAILED: nvme_bench[%zu]; result(%d)\n", i, results[i]);
+			err = results[i];
+			goto exit;
+		}
+		sum += cycles[i];
+	}
+	qsort(cycles, num_ios, sizeof(*cycles), cmp_cycles);
+
+	usecs = 1000.0 / nvme->clocks_per_ms; ///< Microseconds per SM clock cycle
+	secs = elapsed_ms / 1000.0;
+
+	printf("  - {grid: %" PRIu64 ", block: %" PRIu64 ", queues: %d, depth: %d, bs: %" PRIu32
+	       ", pattern: %s, rw: %s, ios: %" PRIu32 ", gbps: %.3f, iops: %.0f, "
+	       "lat_us: {avg: %.2f, p50: %.2f, p90: %.2f, p99: %.2f, p999: %.2f, max: %.2f}}\n",
+	       values[BENCH_GRID], values[BENCH_BLOCK], nvme->num_queues, nvme->queue_depth,
+	       io_nbytes, values[BENCH_PATTERN] ? "rand" : "seq",
+	       values[BENCH_RW] == 0x1 ? "write" : "read", num_ios,
+	       (double)num_ios * io_nbytes / secs / 1e9, num_ios / secs, sum / num_ios * usecs,
+	       cycles[num_ios / 2] * usecs, cycles[(uint64_t)num_ios * 90 / 100] * usecs,
+	       cycles[(uint64_t)num_ios * 99 / 100] * usecs,
+	       cycles[(uint64_t)num_ios * 999 / 1000] * usecs, cycles[num_ios - 1] * usecs);
+
+exit:
+	cuMemFree((CUdeviceptr)cu_results);
+	cuMemFree((CUdeviceptr)cu_cycles);
+	cudamem_heap_block_free(&rte->cuda_heap, bufs);
+	free(results);
+	free(cycles);
+
+	return err;
+}
+
+/**
+ * Run the cases of all combinations, with the queue-pairs created per queues and depth
+ */
+int
+bench_sweep(struct nvme *nvme, struct rte *rte, struct bench_param *params)
+{
+	uint64_t values[BENCH_NPARAMS];
+	size_t max_nbytes = 0;
+	int idx[BENCH_NPARAMS] = {0};
+	int err = 0;
+
+	for (int i = 0; i < params[BENCH_BS].nvalues; i++) {
+		if (params[BENCH_BS].values[i] > max_nbytes) {
+			max_nbytes = params[BENCH_BS].values[i];
+		}
+	}
+
+	printf("bench_cuda_nvme:\n");
+	printf("  bdf: '%s'\n", nvme->ctrlr.func.bdf);
+	printf("  lba_nbytes: %d\n", 1 << nvme->lba_shift);
+	printf("  nsze: %" PRIu64 "\n", nvme->nsze);
+	printf("  clocks_per_ms: %" PRIu64 "\n", nvme->clocks_per_ms);
+	printf("  cases:\n");
+
+	for (int q = 0; !err && q < params[BENCH_QUEUES].nvalues; q++) {
+		for (int d = 0; !err && d < params[BENCH_DEPTH].nvalues; d++) {
+			err = nvme_queues_init(nvme, rte, params[BENCH_QUEUES].values[q],
+					       params[BENCH_DEPTH].values[d], max_nbytes);
+			if (err) {
+				break;
+			}
+			idx[BENCH_QUEUES] = q;
+			idx[BENCH_DEPTH] = d;
+
+			// Odometer over the parameters other than queues and depth
+			for (;;) {
+				int i;
+
+				for (i = 0; i < BENCH_NPARAMS; i++) {
+					values[i] = params[i].values[idx[i]];
+				}
+
+				err = bench_case(nvme, rte, values);
+				if (err) {
+					break;
+				}
+
+				for (i = 0; i < BENCH_NPARAMS; i++) {
+					if (i == BENCH_QUEUES || i == BENCH_DEPTH) {
+						continue;
+					}
+					if (++idx[i] < params[i].nvalues) {
+						break;
+					}
+					idx[i] = 0;
+				}
+				if (i == BENCH_NPARAMS) {
+					break;
+				}
+			}
+
+			nvme_queues_term(nvme, rte);
+		}
+	}
+
+	return err;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_param params[BENCH_NPARAMS] = {
+		[BENCH_GRID] = {"grid", {1, 8, 32}, 3},
+		[BENCH_BLOCK] = {"block", {32, 128}, 2},
+		[BENCH_QUEUES] = {"queues", {1, 4}, 2},
+		[BENCH_DEPTH] = {"depth", {64}, 1},
+		[BENCH_BS] = {"bs", {4096, 65536}, 2},
+		[BENCH_PATTERN] = {"pattern", {0, 1}, 2},
+		[BENCH_RW] = {"rw", {0x2}, 1},
+		[BENCH_IOS] = {"ios", {32768}, 1},
+		[BENCH_SPAN] = {"span", {0}, 1},
+	};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc < 2) {
+		printf("Usage: %s <PCI-BDF> [<name>=<value>[,<value>]...]...\n", argv[0]);
+		printf("  With name one of:");
+		for (int i = 0; i < BENCH_NPARAMS; i++) {
+			printf(" %s", params[i].name);
+		}
+		printf("\n");
+		return 1;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		err = bench_param_parse(params, argv[i]);
+		if (err) {
+			printf("FAILED: bench_param_parse(%s); err(%d)\n", argv[i], err);
+			return 1;
+		}
+	}
+
+	err = rte_init(&rte);
+	if (err) {
+		printf("FAILED: rte_init(); err(%d)\n", err);
+		return 1;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		rte_term(&rte);
+		return 1;
+	}
+
+	err = nvme_identify_ns(&nvme);
+	if (!err) {
+		err = nvme_request_cuda_lut_from_heap(&nvme.lut, &rte.cuda_heap);
+	}
+	if (!err) {
+		err = bench_sweep(&nvme, &rte, params);
+	}
+
+	nvme_request_cuda_lut_term(&nvme.lut);
+	nvme_controller_close(&nvme.ctrlr);
+	rte_term(&rte);
+
+	return err ? 1 : 0;
+}
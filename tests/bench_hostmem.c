@@ -0,0 +1,534 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Micro-benchmarks of the hot helpers of the heap (include/upcie/hostmem_heap.h), the
+// virt-to-phys lookup (include/upcie/hostmem_dma.h), and the requests and PRP-builders
+// (include/upcie/nvme/nvme_request.h); needs hugepages, as the other hostmem tests, but no device
+//
+// Each case is a line of YAML, with the cost of the operation in nanoseconds, as measured via the
+// TSC over 'ops' operations, repeated for 'rounds' rounds after one round of warm-up. The median
+// round is reported as ns_op, along with the fastest and slowest round, such that runs, and
+// revisions, can be compared on ns_op, with the spread telling how much to trust it:
+//
+//   heap_alloc, heap_free  hostmem_heap_block_alloc_array_aligned() / hostmem_heap_block_free()
+//                          of batches of blocks, by size mix, with the heap fragmented by 'frag'
+//   dma_v2p                hostmem_dma_v2p() of addresses spread over the heap
+//   request_alloc_free     nvme_request_alloc() followed by nvme_request_free()
+//   prps_contig, prps_iov  nvme_request_prep_command_prps_contig() / _iov(), by I/O size 'bs'
+//
+// The parameters are given as lists of values, <name>=<value>[,<value>]..., e.g.:
+//
+//   bench_hostmem rounds=9 frag=0,50,90 bs=4096,131072,2097152
+//
+// With 'frag' being the percentage of the blocks, held over a quarter of the heap, which are freed
+// at random, before the cases of the heap are run; 0 is an unfragmented heap.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define BENCH_PARAM_NVALUES 16
+#define BENCH_HEAP_NBYTES (1024 * 1024 * 256ULL)
+#define BENCH_BATCH 64              ///< Blocks allocated, then freed, per batch of heap_alloc
+#define BENCH_HOLD_MAX (1 << 16)    ///< Bound on the blocks held to fragment the heap
+#define BENCH_IOV_NBYTES (16 * 1024) ///< Bytes per iovec entry of prps_iov
+
+struct bench_param {
+	const char *name;
+	uint64_t values[BENCH_PARAM_NVALUES];
+	int nvalues;
+};
+
+enum bench_param_idx {
+	BENCH_ROUNDS = 0,
+	BENCH_OPS,
+	BENCH_FRAG,
+	BENCH_BS,
+	BENCH_NPARAMS,
+};
+
+struct bench_mix {
+	const char *name;
+	int order_min; ///< Sizes are drawn in [1 << order_min, 1 << order_max]
+	int order_max;
+};
+
+static const struct bench_mix g_mixes[] = {
+	{"64b", 6, 6},
+	{"4k", 12, 12},
+	{"small", 6, 12},
+	{"mixed", 6, 20},
+};
+
+struct bench {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+	struct nvme_request_pool pool;
+	uint64_t hz;
+	uint64_t rounds;
+	uint64_t ops;
+	double *samples; ///< Nanoseconds per operation, by round
+	size_t *sizes;   ///< Sizes of a case of the heap, one per operation
+	void **blocks;
+};
+
+/**
+ * A linear congruential generator; the cases draw the same values on every run
+ */
+static inline uint64_t
+bench_rand(uint64_t *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+
+	return *state >> 33;
+}
+
+static size_t
+bench_mix_size(const struct bench_mix *mix, uint64_t *state)
+{
+	int order = mix->order_min + bench_rand(state) % (mix->order_max - mix->order_min + 1);
+	size_t size = (size_t)1 << order;
+
+	// Anywhere in [size, 2 * size), except for the fixed-size mixes
+	if (mix->order_min != mix->order_max && order < mix->order_max) {
+		size += bench_rand(state) % size;
+	}
+
+	return size;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+bench_ticks_to_ns(struct bench *bench, uint64_t ticks, uint64_t ops)
+{
+	return (double)ticks * 1e9 / (double)bench->hz / (double)ops;
+}
+
+/**
+ * Print the median, fastest and slowest, of the rounds in bench->samples
+ */
+static void
+bench_pr(struct bench *bench, const char *op, const char *desc)
+{
+	double *samples = bench->samples;
+	uint64_t rounds = bench->rounds;
+
+	qsort(samples, rounds, sizeof(*samples), cmp_double);
+
+	printf("  - {op: %s%s, ops: %" PRIu64 ", ns_op: %.2f, ns_op_min: %.2f, ns_op_max: %.2f}\n",
+	       op, desc, bench->ops, samples[rounds / 2], samples[0], samples[rounds - 1]);
+}
+
+/**
+ * Parse "<name>=<value>[,<value>]..." into the parameter of the given name
+ */
+static int
+bench_param_parse(struct bench_param *params, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	char buf[256];
+
+	if (!eq || strlen(eq + 1) >= sizeof(buf)) {
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < BENCH_NPARAMS; i++) {
+		struct bench_param *param = &params[i];
+		char *save = NULL;
+
+		if (strlen(param->name) != (size_t)(eq - arg) ||
+		    strncmp(param->name, arg, eq - arg)) {
+			continue;
+		}
+
+		snprintf(buf, sizeof(buf), "%s", eq + 1);
+		param->nvalues = 0;
+		for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (param->nvalues == BENCH_PARAM_NVALUES) {
+				return -E2BIG;
+			}
+			param->values[param->nvalues++] = strtoull(tok, NULL, 0);
+		}
+
+		return param->nvalues ? 0 : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Hold blocks of the "small" mix over a quarter of the heap, and free 'frag' percent of them
+ *
+ * @return The number of blocks held, to be released by bench_unfragment(); negative errno on error
+ */
+static int
+bench_fragment(struct bench *bench, void **hold, uint64_t frag)
+{
+	const size_t target = bench->heap.memory.size / 4;
+	uint64_t state = 0xf4a9;
+	size_t nbytes = 0;
+	int nhold = 0;
+
+	while (nbytes < target && nhold < BENCH_HOLD_MAX) {
+		size_t size = bench_mix_size(&g_mixes[2], &state);
+
+		hold[nhold] = hostmem_heap_block_alloc_array_aligned(&bench->heap, 1, size, 64);
+		if (!hold[nhold]) {
+			printf("FAILED: hostmem_heap_block_alloc_array_aligned(%zu); errno(%d)\n", size,
+			       errno);
+			return -ENOMEM;
+		}
+		nbytes += size;
+		nhold++;
+	}
+
+	for (int i = 0; i < nhold; ++i) {
+		if (bench_rand(&state) % 100 < frag) {
+			hostmem_heap_block_free(&bench->heap, hold[i]);
+			hold[i] = NULL;
+		}
+	}
+
+	return nhold;
+}
+
+static void
+bench_unfragment(struct bench *bench, void **hold, int nhold)
+{
+	for (int i = 0; i < nhold; ++i) {
+		if (hold[i]) {
+			hostmem_heap_block_free(&bench->heap, hold[i]);
+		}
+	}
+}
+
+/**
+ * Allocate batches of BENCH_BATCH blocks of the given mix, and free them in the reverse order
+ */
+static int
+bench_heap(struct bench *bench, uint64_t frag, const struct bench_mix *mix)
+{
+	double *free_samples;
+	uint64_t state = 0x5eed;
+	char desc[64];
+
+	free_samples = calloc(bench->rounds, sizeof(*free_samples));
+	if (!free_samples) {
+		return -ENOMEM;
+	}
+
+	for (uint64_t i = 0; i < bench->ops; ++i) {
+		bench->sizes[i] = bench_mix_size(mix, &state);
+	}
+
+	for (uint64_t round = 0; round <= bench->rounds; ++round) {
+		uint64_t alloc_ticks = 0, free_ticks = 0;
+
+		for (uint64_t i = 0; i < bench->ops; i += BENCH_BATCH) {
+			uint64_t n = bench->ops - i < BENCH_BATCH ? bench->ops - i : BENCH_BATCH;
+			uint64_t t0, t1, t2;
+
+			t0 = tsc_read();
+			for (uint64_t j = 0; j < n; ++j) {
+				size_t size = bench->sizes[i + j];
+				size_t alignment = size < 4096 ? 64 : 4096;
+
+				bench->blocks[j] = hostmem_heap_block_alloc_array_aligned(
+					&bench->heap, 1, size, alignment);
+			}
+			t1 = tsc_read();
+			for (uint64_t j = n; j-- > 0;) {
+				hostmem_heap_block_free(&bench->heap, bench->blocks[j]);
+			}
+			t2 = tsc_read();
+
+			for (uint64_t j = 0; j < n; ++j) {
+				if (!bench->blocks[j]) {
+					printf("FAILED: heap_alloc(%zu); out of memory\n",
+					       bench->sizes[i + j]);
+					free(free_samples);
+					return -ENOMEM;
+				}
+			}
+			alloc_ticks += t1 - t0;
+			free_ticks += t2 - t1;
+		}
+
+		if (round) {
+			bench->samples[round - 1] = bench_ticks_to_ns(bench, alloc_ticks, bench->ops);
+			free_samples[round - 1] = bench_ticks_to_ns(bench, free_ticks, bench->ops);
+		}
+	}
+
+	snprintf(desc, sizeof(desc), ", frag: %" PRIu64 ", mix: %s", frag, mix->name);
+	bench_pr(bench, "heap_alloc", desc);
+	memcpy(bench->samples, free_samples, bench->rounds * sizeof(*free_samples));
+	bench_pr(bench, "heap_free", desc);
+
+	free(free_samples);
+
+	return 0;
+}
+
+static int
+bench_v2p(struct bench *bench)
+{
+	uint8_t *virt = bench->heap.memory.virt;
+	volatile uint64_t sink = 0;
+	uint64_t state = 0x5eed;
+
+	for (uint64_t i = 0; i < bench->ops; ++i) {
+		bench->blocks[i] = virt + bench_rand(&state) % bench->heap.memory.size;
+	}
+
+	for (uint64_t round = 0; round <= bench->rounds; ++round) {
+		uint64_t t0, t1, acc = 0;
+
+		t0 = tsc_read();
+		for (uint64_t i = 0; i < bench->ops; ++i) {
+			acc += hostmem_dma_v2p(&bench->heap, bench->blocks[i]);
+		}
+		t1 = tsc_read();
+		sink += acc;
+
+		if (round) {
+			bench->samples[round - 1] = bench_ticks_to_ns(bench, t1 - t0, bench->ops);
+		}
+	}
+	(void)sink;
+
+	bench_pr(bench, "dma_v2p", "");
+
+	return 0;
+}
+
+static int
+bench_request(struct bench *bench)
+{
+	for (uint64_t round = 0; round <= bench->rounds; ++round) {
+		uint64_t t0, t1;
+
+		t0 = tsc_read();
+		for (uint64_t i = 0; i < bench->ops; ++i) {
+			struct nvme_request *request = nvme_request_alloc(&bench->pool);
+
+			if (!request) {
+				printf("FAILED: nvme_request_alloc(); errno(%d)\n", errno);
+				return -ENOMEM;
+			}
+			nvme_request_free(&bench->pool, request->cid);
+		}
+		t1 = tsc_read();
+
+		if (round) {
+			bench->samples[round - 1] = bench_ticks_to_ns(bench, t1 - t0, bench->ops);
+		}
+	}
+
+	bench_pr(bench, "request_alloc_free", "");
+
+	return 0;
+}
+
+/**
+ * Prepare the PRPs of a command of 'bs' bytes, as a contiguous buffer, and as an iovec of
+ * BENCH_IOV_NBYTES entries, given in the reverse order of the buffer, thus, not contiguous
+ */
+static int
+bench_prps(struct bench *bench, uint64_t bs)
+{
+	struct iovec dvec[(2 * 1024 * 1024) / BENCH_IOV_NBYTES];
+	struct nvme_request *request;
+	size_t dvec_cnt = 0;
+	char desc[32];
+	uint8_t *buf;
+	int err = 0;
+
+	if (bs % 4096 || bs > 2 * 1024 * 1024ULL) {
+		printf("  # SKIPPED: bs(%" PRIu64 "); not a multiple of 4K, within 2M\n", bs);
+		return 0;
+	}
+
+	buf = hostmem_dma_malloc(&bench->heap, bs);
+	request = nvme_request_alloc(&bench->pool);
+	if (!buf || !request) {
+		printf("FAILED: hostmem_dma_malloc() / nvme_request_alloc(); errno(%d)\n", errno);
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	for (uint64_t off = bs; off > 0;) {
+		size_t len = off < BENCH_IOV_NBYTES ? off : BENCH_IOV_NBYTES;
+
+		off -= len;
+		dvec[dvec_cnt].iov_base = buf + off;
+		dvec[dvec_cnt].iov_len = len;
+		dvec_cnt++;
+	}
+
+	for (int iov = 0; iov < 2; ++iov) {
+		for (uint64_t round = 0; round <= bench->rounds; ++round) {
+			uint64_t t0, t1;
+
+			t0 = tsc_read();
+			for (uint64_t i = 0; i < bench->ops && !err; ++i) {
+				struct nvme_command cmd = {0};
+
+				err = iov ? nvme_request_prep_command_prps_iov(request, &bench->heap,
+									      dvec, dvec_cnt, &cmd)
+					  : nvme_request_prep_command_prps_contig(request, &bench->heap,
+										  buf, bs, &cmd);
+			}
+			t1 = tsc_read();
+			if (err) {
+				printf("FAILED: nvme_request_prep_command_prps_%s(); err(%d)\n",
+				       iov ? "iov" : "contig", err);
+				goto exit;
+			}
+
+			if (round) {
+				bench->samples[round - 1] =
+					bench_ticks_to_ns(bench, t1 - t0, bench->ops);
+			}
+		}
+
+		snprintf(desc, sizeof(desc), ", bs: %" PRIu64, bs);
+		bench_pr(bench, iov ? "prps_iov" : "prps_contig", desc);
+	}
+
+exit:
+	if (request) {
+		nvme_request_free(&bench->pool, request->cid);
+	}
+	hostmem_dma_free(&bench->heap, buf);
+
+	return err;
+}
+
+int
+bench_run(struct bench *bench, struct bench_param *params)
+{
+	void **hold;
+	int err = 0;
+
+	hold = calloc(BENCH_HOLD_MAX, sizeof(*hold));
+	if (!hold) {
+		return -ENOMEM;
+	}
+
+	printf("bench_hostmem:\n");
+	printf("  heap_nbytes: %zu\n", bench->heap.memory.size);
+	printf("  hugepgsz: %d\n", bench->config.hugepgsz);
+	printf("  tsc_hz: %" PRIu64 "\n", bench->hz);
+	printf("  rounds: %" PRIu64 "\n", bench->rounds);
+	printf("  cases:\n");
+
+	for (int f = 0; !err && f < params[BENCH_FRAG].nvalues; ++f) {
+		uint64_t frag = params[BENCH_FRAG].values[f];
+		int nhold;
+
+		nhold = bench_fragment(bench, hold, frag);
+		if (nhold < 0) {
+			err = nhold;
+			break;
+		}
+
+		for (size_t m = 0; !err && m < sizeof(g_mixes) / sizeof(*g_mixes); ++m) {
+			err = bench_heap(bench, frag, &g_mixes[m]);
+		}
+
+		bench_unfragment(bench, hold, nhold);
+	}
+
+	if (!err) {
+		err = bench_v2p(bench);
+	}
+	if (!err) {
+		err = bench_request(bench);
+	}
+	for (int b = 0; !err && b < params[BENCH_BS].nvalues; ++b) {
+		err = bench_prps(bench, params[BENCH_BS].values[b]);
+	}
+
+	free(hold);
+
+	return err;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_param params[BENCH_NPARAMS] = {
+		[BENCH_ROUNDS] = {"rounds", {5}, 1},
+		[BENCH_OPS] = {"ops", {65536}, 1},
+		[BENCH_FRAG] = {"frag", {0, 25, 50, 90}, 4},
+		[BENCH_BS] = {"bs", {4096, 8192, 16384, 65536, 131072, 524288, 2097152}, 7},
+	};
+	struct bench bench = {0};
+	int err;
+
+	for (int i = 1; i < argc; i++) {
+		err = bench_param_parse(params, argv[i]);
+		if (err) {
+			printf("FAILED: bench_param_parse(%s); err(%d)\n", argv[i], err);
+			printf("Usage: %s [<name>=<value>[,<value>]...]...\n", argv[0]);
+			printf("  With name one of:");
+			for (int j = 0; j < BENCH_NPARAMS; j++) {
+				printf(" %s", params[j].name);
+			}
+			printf("\n");
+			return 1;
+		}
+	}
+	bench.rounds = params[BENCH_ROUNDS].values[0] ? params[BENCH_ROUNDS].values[0] : 1;
+	bench.ops = params[BENCH_OPS].values[0] ? params[BENCH_OPS].values[0] : 1;
+	bench.hz = tsc_hz();
+
+	err = hostmem_config_init(&bench.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return 1;
+	}
+
+	err = hostmem_heap_init(&bench.heap, BENCH_HEAP_NBYTES, &bench.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return 1;
+	}
+
+	bench.samples = calloc(bench.rounds, sizeof(*bench.samples));
+	bench.sizes = calloc(bench.ops, sizeof(*bench.sizes));
+	bench.blocks = calloc(bench.ops > BENCH_BATCH ? bench.ops : BENCH_BATCH,
+			      sizeof(*bench.blocks));
+	if (!bench.samples || !bench.sizes || !bench.blocks) {
+		printf("FAILED: calloc(); errno(%d)\n", errno);
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	err = nvme_request_pool_init(&bench.pool, 0);
+	if (!err) {
+		err = nvme_request_pool_init_prps(&bench.pool, &bench.heap, 0);
+	}
+	if (err) {
+		printf("FAILED: nvme_request_pool_init(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = bench_run(&bench, params);
+
+exit:
+	nvme_request_pool_term_prps(&bench.pool, &bench.heap);
+	nvme_request_pool_term(&bench.pool);
+	free(bench.samples);
+	free(bench.sizes);
+	free(bench.blocks);
+	hostmem_heap_term(&bench.heap);
+
+	return err ? 1 : 0;
+}
@@ -3,11 +3,24 @@
 // Include CUDA and minimal upcie headers directly to avoid pulling in
 // non-CUDA headers via the bundle, which have C-only void* cast idioms.
 #include <cuda_runtime.h>
+#include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <upcie/debug.h>
+#include <upcie/tsc.h>
 #include <upcie/nvme/nvme_command.h>
+#include <upcie/nvme/nvme_trace.h>
 #include <upcie/nvme/nvme_qpair_cuda.h>
+#include <upcie/nvme/nvme_engine_cuda.h>
+#include <upcie/nvme/nvme_request_cuda_device.h>
 
 /**
  * Submit NVMe IOs from the GPU and reap their completions.
@@ -29,11 +42,12 @@
  * @param qps     Device array of queue-pair pointers, one per block
  * @param cmds    Flat device array of commands (num_ios entries)
  * @param results Flat device array of per-command results (num_ios entries)
+ * @param cycles  Flat device array of per-command latency in SM clock cycles, or NULL
  * @param num_ios Total number of IOs to submit
  */
 extern "C" __global__ void
 nvme_io(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
-	uint32_t num_ios)
+	long long *cycles, uint32_t num_ios)
 {
 	size_t bid = blockIdx.x;
 	size_t tid = threadIdx.x;
@@ -47,14 +61,163 @@ nvme_io(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
 		size_t gid = block_start + tid;
 		size_t cmd_idx = tid < batch_size ? gid : block_start;
 
+		long long start = clock64();
 		int result = nvme_qpair_cuda_io(qps[bid], &cmds[cmd_idx], tid, batch_size);
 
 		if (gid < (size_t)num_ios) {
 			results[gid] = result;
+			if (cycles) {
+				cycles[gid] = clock64() - start;
+			}
 		}
 	}
 }
 
+NVME_QPAIR_CUDA_POW2_DEFINE(64)
+NVME_QPAIR_CUDA_POW2_DEFINE(256)
+NVME_QPAIR_CUDA_POW2_DEFINE(1024)
+
+/**
+ * Define nvme_io_pow2_<DEPTH>: as nvme_io, via nvme_qpair_cuda_pow2_<DEPTH>_io(), without cycles
+ */
+#define NVME_IO_POW2_DEFINE(DEPTH)                                                                \
+	extern "C" __global__ void                                                                \
+	nvme_io_pow2_##DEPTH(struct nvme_qpair_cuda **qps, struct nvme_command *cmds,             \
+			     int *results, uint32_t num_ios)                                      \
+	{                                                                                         \
+		size_t bid = blockIdx.x;                                                          \
+		size_t tid = threadIdx.x;                                                         \
+		size_t stride = gridDim.x * blockDim.x;                                           \
+		size_t num_rounds = (num_ios + stride - 1) / stride;                              \
+                                                                                                  \
+		for (size_t r = 0; r < num_rounds; r++) {                                         \
+			size_t block_start = (size_t)r * stride + bid * blockDim.x;               \
+			size_t remaining = block_start < num_ios ? num_ios - block_start : 0;     \
+			size_t batch_size = remaining < blockDim.x ? remaining : blockDim.x;      \
+			size_t gid = block_start + tid;                                           \
+			size_t cmd_idx = tid < batch_size ? gid : block_start;                    \
+			int result;                                                               \
+                                                                                                  \
+			result = nvme_qpair_cuda_pow2_##DEPTH##_io(qps[bid], &cmds[cmd_idx], tid, \
+								   batch_size);                   \
+                                                                                                  \
+			if (gid < num_ios) {                                                      \
+				results[gid] = result;                                            \
+			}                                                                         \
+		}                                                                                 \
+	}
+
+
+NVME_IO_POW2_DEFINE(64)
+NVME_IO_POW2_DEFINE(256)
+NVME_IO_POW2_DEFINE(1024)
+
+/**
+ * Submit NVMe IOs from the GPU via the shared submission path.
+ *
+ * Unlike nvme_io, any grid shape drives any number of queues: each thread
+ * handles IOs gid, gid + stride, ..., with stride = gridDim.x * blockDim.x, on
+ * queue qps[gid % num_queues]; see nvme_qpair_cuda_io_shared().
+ *
+ * @param qps        Device array of queue-pair pointers
+ * @param num_queues Number of queue-pairs in qps
+ * @param cmds       Flat device array of commands (num_ios entries)
+ * @param results    Flat device array of per-command results (num_ios entries)
+ * @param num_ios    Total number of IOs to submit
+ */
+extern "C" __global__ void
+nvme_io_shared(struct nvme_qpair_cuda **qps, uint32_t num_queues, struct nvme_command *cmds,
+	       int *results, uint32_t num_ios)
+{
+	size_t stride = (size_t)gridDim.x * blockDim.x;
+
+	for (size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x; gid < num_ios;
+	     gid += stride) {
+		struct nvme_command cmd = cmds[gid];
+
+		results[gid] = nvme_qpair_cuda_io_shared(qps[gid % num_queues], &cmd);
+	}
+}
+
+/**
+ * Submit NVMe IOs from the GPU with the PRPs built on the GPU.
+ *
+ * As nvme_io_shared, with IO gid transferring buf_nbytes to or from bufs + gid * buf_nbytes; the
+ * PRPs, and PRP list, are built per CID via nvme_request_cuda_prep_command_prps().
+ *
+ * @param qps        Device array of queue-pair pointers
+ * @param lists      Device array of the PRP list pages of each queue-pair
+ * @param num_queues Number of queue-pairs in qps
+ * @param lut        LUT of the heap holding bufs
+ * @param bufs       The IO buffers
+ * @param buf_nbytes Bytes transferred per IO
+ * @param cmds       Flat device array of commands (num_ios entries), without PRPs
+ * @param results    Flat device array of per-command results (num_ios entries)
+ * @param num_ios    Total number of IOs to submit
+ */
+extern "C" __global__ void
+nvme_io_prps(struct nvme_qpair_cuda **qps, struct nvme_request_cuda_lists *lists,
+	     uint32_t num_queues, struct nvme_request_cuda_lut lut, uint8_t *bufs,
+	     size_t buf_nbytes, struct nvme_command *cmds, int *results, uint32_t num_ios)
+{
+	size_t stride = (size_t)gridDim.x * blockDim.x;
+
+	for (size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x; gid < num_ios;
+	     gid += stride) {
+		struct nvme_qpair_cuda *qp = qps[gid % num_queues];
+		struct nvme_command cmd = cmds[gid];
+		int cid, err;
+
+		cid = nvme_qpair_cuda_cid_get(qp);
+		if (cid < 0) {
+			results[gid] = cid;
+			continue;
+		}
+
+		err = nvme_request_cuda_prep_command_prps(&lut, &lists[gid % num_queues], cid,
+							  bufs + gid * buf_nbytes, buf_nbytes,
+							  &cmd);
+		if (err) {
+			nvme_qpair_cuda_cid_free(qp, cid);
+			results[gid] = err;
+			continue;
+		}
+
+		nvme_qpair_cuda_submit_cid(qp, &cmd, cid);
+		results[gid] = nvme_qpair_cuda_wait(qp, cid, qp->timeout_ms);
+	}
+}
+
+/**
+ * Launch nvme_io_prps and synchronize.
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_io_prps_launch(struct nvme_qpair_cuda **qps, struct nvme_request_cuda_lists *lists,
+		    uint32_t num_queues, struct nvme_request_cuda_lut *lut, uint8_t *bufs,
+		    size_t buf_nbytes, struct nvme_command *cmds, int *results, uint32_t num_ios,
+		    unsigned int grid, unsigned int block)
+{
+	nvme_io_prps<<<grid, block>>>(qps, lists, num_queues, *lut, bufs, buf_nbytes, cmds,
+				      results, num_ios);
+	return cudaDeviceSynchronize();
+}
+
+/**
+ * Launch nvme_io_shared and synchronize.
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_io_shared_launch(struct nvme_qpair_cuda **qps, uint32_t num_queues,
+		      struct nvme_command *cmds, int *results, uint32_t num_ios,
+		      unsigned int grid, unsigned int block)
+{
+	nvme_io_shared<<<grid, block>>>(qps, num_queues, cmds, results, num_ios);
+	return cudaDeviceSynchronize();
+}
+
 /**
  * Launch nvme_io and synchronize.
  *
@@ -71,6 +234,319 @@ extern "C" cudaError_t
 nvme_io_launch(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
 	       uint32_t num_ios, unsigned int grid, unsigned int block)
 {
-	nvme_io<<<grid, block>>>(qps, cmds, results, num_ios);
+	nvme_io<<<grid, block>>>(qps, cmds, results, NULL, num_ios);
+	return cudaDeviceSynchronize();
+}
+
+/**
+ * Launch nvme_io_pow2_<depth> and synchronize.
+ *
+ * As nvme_io_launch, on queues of the given depth, which must be one of those defined above.
+ *
+ * @return cudaSuccess on success, cudaError_t on failure; cudaErrorInvalidValue when there is no
+ *         kernel for the depth.
+ */
+extern "C" cudaError_t
+nvme_io_pow2_launch(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
+		    uint32_t num_ios, unsigned int grid, unsigned int block, uint32_t depth)
+{
+	switch (depth) {
+	case 64:
+		nvme_io_pow2_64<<<grid, block>>>(qps, cmds, results, num_ios);
+		break;
+	case 256:
+		nvme_io_pow2_256<<<grid, block>>>(qps, cmds, results, num_ios);
+		break;
+	case 1024:
+		nvme_io_pow2_1024<<<grid, block>>>(qps, cmds, results, num_ios);
+		break;
+	default:
+		return cudaErrorInvalidValue;
+	}
+
 	return cudaDeviceSynchronize();
 }
+
+/**
+ * Launch nvme_io, with per-command latencies, and time it.
+ *
+ * Used to compare the placements of the queues, see enum nvme_qpair_cuda_placement; the kernel
+ * is the same as that of nvme_io_launch, thus, any difference is due to where the SQ and CQ are.
+ *
+ * @param qps        Device array of queue-pair pointers, one per block
+ * @param cmds       Flat device array of commands (num_ios entries)
+ * @param results    Flat device array of per-command results (num_ios entries)
+ * @param cycles     Flat device array of per-command latency in SM clock cycles (num_ios entries)
+ * @param num_ios    Total number of IOs to submit
+ * @param grid       Number of thread blocks (one per queue)
+ * @param block      Number of threads per block (queue depth)
+ * @param elapsed_ms Pointer to store the wall-clock time of the kernel in milliseconds
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_io_bench_launch(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
+		     long long *cycles, uint32_t num_ios, unsigned int grid, unsigned int block,
+		     float *elapsed_ms)
+{
+	cudaEvent_t start, stop;
+	cudaError_t err;
+
+	err = cudaEventCreate(&start);
+	if (err) {
+		return err;
+	}
+	err = cudaEventCreate(&stop);
+	if (err) {
+		cudaEventDestroy(start);
+		return err;
+	}
+
+	cudaEventRecord(start);
+	nvme_io<<<grid, block>>>(qps, cmds, results, cycles, num_ios);
+	cudaEventRecord(stop);
+
+	err = cudaEventSynchronize(stop);
+	if (!err) {
+		err = cudaEventElapsedTime(elapsed_ms, start, stop);
+	}
+
+	cudaEventDestroy(start);
+	cudaEventDestroy(stop);
+
+	return err;
+}
+
+/**
+ * Pseudo-random 64-bit value of x, via the splitmix64 finalizer
+ */
+static __device__ uint64_t
+nvme_bench_mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+	return x ^ (x >> 31);
+}
+
+/**
+ * Benchmark the shared submission path, with the commands generated on the device.
+ *
+ * As nvme_io_prps, with IO gid addressing slot gid of the span, or a pseudo-random slot when
+ * random is set; a slot is io_nbytes, and the span is nslots slots from LBA 0. The transfer goes
+ * to, or from, buffer gid % nbufs. Only the service time of a command is measured, that is, from
+ * submission until its completion is seen; not the time waiting for a free CID.
+ *
+ * @param qps        Device array of queue-pair pointers
+ * @param lists      Device array of the PRP list pages of each queue-pair
+ * @param num_queues Number of queue-pairs in qps
+ * @param lut        LUT of the heap holding bufs
+ * @param bufs       The IO buffers, nbufs of io_nbytes
+ * @param nbufs      Number of IO buffers
+ * @param opc        Opcode of the commands, 0x1 for write, 0x2 for read
+ * @param io_nbytes  Bytes transferred per IO; a multiple of the LBA size
+ * @param lba_shift  LBA size of namespace 1, as a power of two
+ * @param nslots     Number of slots of the span
+ * @param random     When set, then the slots are pseudo-random, else sequential
+ * @param results    Flat device array of per-command results (num_ios entries)
+ * @param cycles     Flat device array of per-command latency in SM clock cycles (num_ios entries)
+ * @param num_ios    Total number of IOs to submit
+ */
+extern "C" __global__ void
+nvme_bench(struct nvme_qpair_cuda **qps, struct nvme_request_cuda_lists *lists,
+	   uint32_t num_queues, struct nvme_request_cuda_lut lut, uint8_t *bufs, uint32_t nbufs,
+	   uint8_t opc, uint32_t io_nbytes, int lba_shift, uint64_t nslots, int random,
+	   int *results, long long *cycles, uint32_t num_ios)
+{
+	size_t stride = (size_t)gridDim.x * blockDim.x;
+	uint32_t nlb = io_nbytes >> lba_shift;
+
+	for (size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x; gid < num_ios;
+	     gid += stride) {
+		struct nvme_qpair_cuda *qp = qps[gid % num_queues];
+		uint64_t slot = random ? nvme_bench_mix(gid) % nslots : gid % nslots;
+		uint64_t slba = slot * nlb;
+		struct nvme_command cmd;
+		long long start;
+		int cid, err;
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.opc = opc;
+		cmd.nsid = 1;
+		cmd.cdw10 = slba & 0xFFFFFFFF;
+		cmd.cdw11 = slba >> 32;
+		cmd.cdw12 = nlb - 1;
+
+		cid = nvme_qpair_cuda_cid_get(qp);
+		if (cid < 0) {
+			results[gid] = cid;
+			continue;
+		}
+
+		err = nvme_request_cuda_prep_command_prps(&lut, &lists[gid % num_queues], cid,
+							  bufs + (gid % nbufs) * io_nbytes,
+							  io_nbytes, &cmd);
+		if (err) {
+			nvme_qpair_cuda_cid_free(qp, cid);
+			results[gid] = err;
+			continue;
+		}
+
+		start = clock64();
+		nvme_qpair_cuda_submit_cid(qp, &cmd, cid);
+		results[gid] = nvme_qpair_cuda_wait(qp, cid, qp->timeout_ms);
+		cycles[gid] = clock64() - start;
+	}
+}
+
+/**
+ * Launch nvme_bench, and time it.
+ *
+ * @param elapsed_ms Pointer to store the wall-clock time of the kernel in milliseconds
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_bench_launch(struct nvme_qpair_cuda **qps, struct nvme_request_cuda_lists *lists,
+		  uint32_t num_queues, struct nvme_request_cuda_lut *lut, uint8_t *bufs,
+		  uint32_t nbufs, uint8_t opc, uint32_t io_nbytes, int lba_shift, uint64_t nslots,
+		  int random, int *results, long long *cycles, uint32_t num_ios, unsigned int grid,
+		  unsigned int block, float *elapsed_ms)
+{
+	cudaEvent_t start, stop;
+	cudaError_t err;
+
+	err = cudaEventCreate(&start);
+	if (err) {
+		return err;
+	}
+	err = cudaEventCreate(&stop);
+	if (err) {
+		cudaEventDestroy(start);
+		return err;
+	}
+
+	cudaEventRecord(start);
+	nvme_bench<<<grid, block>>>(qps, lists, num_queues, *lut, bufs, nbufs, opc, io_nbytes,
+				    lba_shift, nslots, random, results, cycles, num_ios);
+	cudaEventRecord(stop);
+
+	err = cudaEventSynchronize(stop);
+	if (!err) {
+		err = cudaEventElapsedTime(elapsed_ms, start, stop);
+	}
+
+	cudaEventDestroy(start);
+	cudaEventDestroy(stop);
+
+	return err;
+}
+
+/**
+ * Run the persistent I/O engines, one warp per engine
+ *
+ * @param engines     Device array of engine pointers, one per block
+ * @param num_engines Number of engines
+ */
+extern "C" __global__ void
+nvme_engine(struct nvme_engine_cuda **engines, uint32_t num_engines)
+{
+	if (blockIdx.x < num_engines && threadIdx.x < NVME_ENGINE_CUDA_WARP) {
+		nvme_engine_cuda_run(engines[blockIdx.x]);
+	}
+}
+
+/**
+ * Launch nvme_engine on a stream of its own, without waiting for it to return
+ *
+ * The stream does not synchronize with the default stream, thus, other kernels can feed the
+ * engines while they run. Pass the stream to nvme_engine_join().
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_engine_start(struct nvme_engine_cuda **engines, uint32_t num_engines, void **stream)
+{
+	cudaStream_t s;
+	cudaError_t err;
+
+	err = cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking);
+	if (err) {
+		return err;
+	}
+
+	nvme_engine<<<num_engines, NVME_ENGINE_CUDA_WARP, 0, s>>>(engines, num_engines);
+	err = cudaGetLastError();
+	if (err) {
+		cudaStreamDestroy(s);
+		return err;
+	}
+	*stream = s;
+
+	return cudaSuccess;
+}
+
+/**
+ * Wait for the engines launched by nvme_engine_start() to return; see nvme_engine_cuda_stop()
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_engine_join(void *stream)
+{
+	cudaError_t err = cudaStreamSynchronize((cudaStream_t)stream);
+
+	cudaStreamDestroy((cudaStream_t)stream);
+
+	return err;
+}
+
+/**
+ * Feed NVMe IOs to the running engines, IO gid going to engines[gid % num_engines]
+ *
+ * @param engines     Device array of engine pointers
+ * @param num_engines Number of engines
+ * @param cmds        Flat device array of commands (num_ios entries)
+ * @param results     Flat device array of per-command results (num_ios entries)
+ * @param num_ios     Total number of IOs to feed
+ */
+extern "C" __global__ void
+nvme_engine_feed(struct nvme_engine_cuda **engines, uint32_t num_engines,
+		 struct nvme_command *cmds, int *results, uint32_t num_ios)
+{
+	size_t stride = (size_t)gridDim.x * blockDim.x;
+
+	for (size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x; gid < num_ios;
+	     gid += stride) {
+		struct nvme_engine_cuda_wq *wq = engines[gid % num_engines]->wq;
+
+		while (nvme_engine_cuda_push(wq, &cmds[gid], &results[gid]) == -EBUSY) {
+			;
+		}
+	}
+}
+
+/**
+ * Launch nvme_engine_feed on a stream of its own, and wait for it to return
+ *
+ * @return cudaSuccess on success, cudaError_t on failure.
+ */
+extern "C" cudaError_t
+nvme_engine_feed_launch(struct nvme_engine_cuda **engines, uint32_t num_engines,
+			struct nvme_command *cmds, int *results, uint32_t num_ios)
+{
+	cudaStream_t s;
+	cudaError_t err;
+
+	err = cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking);
+	if (err) {
+		return err;
+	}
+
+	nvme_engine_feed<<<4, 128, 0, s>>>(engines, num_engines, cmds, results, num_ios);
+	err = cudaStreamSynchronize(s);
+	cudaStreamDestroy(s);
+
+	return err;
+}
@@ -5,9 +5,26 @@
 
 int nvme_io_launch(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
 		   uint32_t num_ios, unsigned int grid, unsigned int block);
+int nvme_io_shared_launch(struct nvme_qpair_cuda **qps, uint32_t num_queues,
+			  struct nvme_command *cmds, int *results, uint32_t num_ios,
+			  unsigned int grid, unsigned int block);
+int nvme_io_pow2_launch(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
+			uint32_t num_ios, unsigned int grid, unsigned int block, uint32_t depth);
+int nvme_engine_start(struct nvme_engine_cuda **engines, uint32_t num_engines, void **stream);
+int nvme_engine_join(void *stream);
+int nvme_io_prps_launch(struct nvme_qpair_cuda **qps, struct nvme_request_cuda_lists *lists,
+			uint32_t num_queues, struct nvme_request_cuda_lut *lut, uint8_t *bufs,
+			size_t buf_nbytes, struct nvme_command *cmds, int *results,
+			uint32_t num_ios, unsigned int grid, unsigned int block);
+int nvme_io_bench_launch(struct nvme_qpair_cuda **qps, struct nvme_command *cmds, int *results,
+			 long long *cycles, uint32_t num_ios, unsigned int grid,
+			 unsigned int block, float *elapsed_ms);
+int nvme_engine_feed_launch(struct nvme_engine_cuda **engines, uint32_t num_engines,
+			    struct nvme_command *cmds, int *results, uint32_t num_ios);
 
 #define BUF_SIZE     (64 * 1024)  ///< One CUDA heap page per IO buffer
 #define VERIFY_SIZE  512          ///< Bytes to fill and verify per buffer (min NVMe sector size)
+#define ENGINE_NSLOTS 256         ///< Slots of the work queue of each engine
 
 struct rte {
 	struct hostmem_config config;
@@ -23,6 +40,18 @@ struct nvme {
 	struct nvme_qpair_cuda **cu_ioqs; ///< Device array of queue-pair pointers
 	int num_queues;
 	int queue_depth;
+	unsigned int grid;  ///< Threadblocks of the shared submission path; 0: one block per queue
+	unsigned int block; ///< Threads per block of the shared submission path
+	const char *engine; ///< "host" or "device": the IOs are fed to engines by that, else NULL
+	int prps;           ///< The IOs transfer BUF_SIZE, with the PRPs built on the device
+	int pow2;           ///< The IOs are submitted via nvme_qpair_cuda_pow2_<depth>_io()
+	int lba_shift;      ///< LBA size of namespace 1, as a power of two
+	struct nvme_io_qpair_cuda_opts qopts;     ///< Placement of the SQ and CQ of each queue-pair
+	struct nvme_request_cuda_lut lut;         ///< LUT of the CUDA heap
+	struct nvme_request_cuda_lists *lists;    ///< Host array of PRP list pages, one per queue
+	struct nvme_request_cuda_lists *cu_lists; ///< Device array of the PRP list pages
+	struct nvme_engine_cuda **engines;    ///< Host array of engines, one per queue-pair
+	struct nvme_engine_cuda **cu_engines; ///< Device array of engine pointers
 };
 
 void
@@ -94,6 +123,19 @@ rte_init(struct rte *rte, size_t cuda_heap_size)
 void
 nvme_term(struct nvme *nvme, struct rte *rte)
 {
+	for (int i = 0; nvme->lists && i < nvme->num_queues; i++) {
+		nvme_request_cuda_lists_term(&nvme->lists[i], &rte->cuda_heap);
+	}
+	cuMemFree((CUdeviceptr)nvme->cu_lists);
+	free(nvme->lists);
+	nvme_request_cuda_lut_term(&nvme->lut);
+
+	for (int i = 0; nvme->engines && i < nvme->num_queues; i++) {
+		nvme_controller_cuda_engine_destroy(nvme->engines[i], &rte->cuda_heap);
+	}
+	cuMemFree((CUdeviceptr)nvme->cu_engines);
+	free(nvme->engines);
+
 	for (int i = 0; i < nvme->num_queues; i++) {
 		nvme_controller_cuda_delete_io_qpair(&nvme->ctrlr, nvme->ioqs[i],
 						     &rte->cuda_heap);
@@ -105,6 +147,68 @@ nvme_term(struct nvme *nvme, struct rte *rte)
 	nvme_controller_close(&nvme->ctrlr);
 }
 
+/**
+ * Determine the LBA size of namespace 1, and set up the LUT and the PRP list pages per queue-pair
+ */
+int
+nvme_init_prps(struct nvme *nvme, struct rte *rte, int num_queues, int queue_depth)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	uint8_t *idfy = nvme->ctrlr.buf;
+	int err;
+
+	cmd.opc = 0x6; ///< IDENTIFY
+	cmd.nsid = 1;
+	cmd.cdw10 = 0; // CNS=0: Identify Namespace
+
+	err = nvme_qpair_submit_sync_contig_prps(&nvme->ctrlr.aq, nvme->ctrlr.heap,
+						 nvme->ctrlr.buf, 4096, &cmd,
+						 nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_qpair_submit_sync(); err(%d)\n", err);
+		return err;
+	}
+	nvme->lba_shift = idfy[128 + 4 * (idfy[26] & 0xF) + 2]; ///< LBADS of the format in FLBAS
+
+	err = nvme_request_cuda_lut_from_heap(&nvme->lut, &rte->cuda_heap);
+	if (err) {
+		printf("FAILED: nvme_request_cuda_lut_from_heap(); err(%d)\n", err);
+		return err;
+	}
+
+	nvme->lists = calloc(num_queues, sizeof(*nvme->lists));
+	if (!nvme->lists) {
+		err = -errno;
+		printf("FAILED: calloc(lists); err(%d)\n", err);
+		return err;
+	}
+
+	for (int i = 0; i < num_queues; i++) {
+		err = nvme_request_cuda_lists_init(&nvme->lists[i], &rte->cuda_heap, queue_depth,
+						   1);
+		if (err) {
+			printf("FAILED: nvme_request_cuda_lists_init(%d); err(%d)\n", i, err);
+			return err;
+		}
+	}
+
+	err = cuMemAlloc((CUdeviceptr *)&nvme->cu_lists, num_queues * sizeof(*nvme->lists));
+	if (err) {
+		printf("FAILED: cuMemAlloc(cu_lists); CUresult(%d)\n", err);
+		return err;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)nvme->cu_lists, nvme->lists,
+			   num_queues * sizeof(*nvme->lists));
+	if (err) {
+		printf("FAILED: cuMemcpyHtoD(cu_lists); CUresult(%d)\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
 int
 nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte, int num_queues, int queue_depth)
 {
@@ -148,10 +252,12 @@ nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte, int num_queues, i
 
 		// NVMe queues hold at most depth-1 in-flight commands; add 1 so all
 		// queue_depth threads can have a command outstanding simultaneously.
-		err = nvme_controller_cuda_create_io_qpair(&nvme->ctrlr, nvme->ioqs[i],
-							   queue_depth + 1, &rte->cuda_heap);
+		err = nvme_controller_cuda_create_io_qpair_opts(&nvme->ctrlr, nvme->ioqs[i],
+								queue_depth + 1, &rte->cuda_heap,
+								&nvme->qopts);
 		if (err) {
-			printf("FAILED: nvme_controller_cuda_create_io_qpair(%d); err(%d)\n", i, err);
+			printf("FAILED: nvme_controller_cuda_create_io_qpair_opts(%d); "
+			       "err(%d)\n", i, err);
 			cuMemFree((CUdeviceptr)nvme->ioqs[i]);
 			goto err_term;
 		}
@@ -173,6 +279,44 @@ nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte, int num_queues, i
 		goto err_term;
 	}
 
+	if (nvme->prps) {
+		return nvme_init_prps(nvme, rte, num_queues, queue_depth);
+	}
+	if (!nvme->engine) {
+		return 0;
+	}
+
+	nvme->engines = calloc(num_queues, sizeof(*nvme->engines));
+	if (!nvme->engines) {
+		err = -errno;
+		printf("FAILED: calloc(engines); err(%d)\n", err);
+		goto err_term;
+	}
+
+	for (int i = 0; i < num_queues; i++) {
+		err = nvme_controller_cuda_engine_create(nvme->ioqs[i], ENGINE_NSLOTS,
+							 !strcmp(nvme->engine, "host"),
+							 &rte->cuda_heap, &nvme->engines[i]);
+		if (err) {
+			printf("FAILED: nvme_controller_cuda_engine_create(%d); err(%d)\n", i, err);
+			goto err_term;
+		}
+	}
+
+	err = cuMemAlloc((CUdeviceptr *)&nvme->cu_engines,
+			 num_queues * sizeof(struct nvme_engine_cuda *));
+	if (err) {
+		printf("FAILED: cuMemAlloc(cu_engines); CUresult(%d)\n", err);
+		goto err_term;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)nvme->cu_engines, nvme->engines,
+			   num_queues * sizeof(struct nvme_engine_cuda *));
+	if (err) {
+		printf("FAILED: cuMemcpyHtoD(cu_engines); CUresult(%d)\n", err);
+		goto err_term;
+	}
+
 	return 0;
 
 err_term:
@@ -180,6 +324,89 @@ err_term:
 	return err;
 }
 
+/**
+ * Feed the IOs to the engines from the host, with the results in mapped host memory
+ */
+int
+nvme_io_engine_host(struct nvme *nvme, struct nvme_command *cmds, int *results, size_t num_ios)
+{
+	int32_t *mapped;
+	void *stream;
+	int err;
+
+	err = cuMemHostAlloc((void **)&mapped, num_ios * sizeof(*mapped),
+			     CU_MEMHOSTALLOC_DEVICEMAP | CU_MEMHOSTALLOC_PORTABLE);
+	if (err) {
+		printf("FAILED: cuMemHostAlloc(results); CUresult(%d)\n", err);
+		return err;
+	}
+
+	err = nvme_engine_start(nvme->cu_engines, nvme->num_queues, &stream);
+	if (err) {
+		printf("FAILED: nvme_engine_start(); cudaError_t(%d)\n", err);
+		cuMemFreeHost(mapped);
+		return err;
+	}
+
+	for (size_t gid = 0; gid < num_ios; gid++) {
+		struct nvme_engine_cuda *engine = nvme->engines[gid % nvme->num_queues];
+
+		while (nvme_engine_cuda_host_push(engine->wq, &cmds[gid], &mapped[gid]) == -EBUSY) {
+			;
+		}
+	}
+
+	for (int i = 0; i < nvme->num_queues; i++) {
+		nvme_engine_cuda_stop(nvme->engines[i]);
+	}
+
+	err = nvme_engine_join(stream);
+	if (err) {
+		printf("FAILED: nvme_engine_join(); cudaError_t(%d)\n", err);
+	}
+
+	for (size_t gid = 0; gid < num_ios; gid++) {
+		results[gid] = __atomic_load_n(&mapped[gid], __ATOMIC_ACQUIRE);
+	}
+	cuMemFreeHost(mapped);
+
+	return err;
+}
+
+/**
+ * Feed the IOs to the engines from a kernel running concurrently with them
+ */
+int
+nvme_io_engine_device(struct nvme *nvme, struct nvme_command *cu_cmds, int *cu_results,
+		      size_t num_ios)
+{
+	void *stream;
+	int err;
+
+	err = nvme_engine_start(nvme->cu_engines, nvme->num_queues, &stream);
+	if (err) {
+		printf("FAILED: nvme_engine_start(); cudaError_t(%d)\n", err);
+		return err;
+	}
+
+	err = nvme_engine_feed_launch(nvme->cu_engines, nvme->num_queues, cu_cmds, cu_results,
+				      (uint32_t)num_ios);
+	if (err) {
+		printf("FAILED: nvme_engine_feed_launch(); cudaError_t(%d)\n", err);
+	}
+
+	for (int i = 0; i < nvme->num_queues; i++) {
+		nvme_engine_cuda_stop(nvme->engines[i]);
+	}
+
+	if (nvme_engine_join(stream) && !err) {
+		printf("FAILED: nvme_engine_join()\n");
+		err = -EIO;
+	}
+
+	return err;
+}
+
 int
 prep_nvme_io(struct nvme *nvme, struct cudamem_heap *cuda_heap, uint8_t opc, void *buffers,
 	     size_t num_ios)
@@ -211,6 +438,19 @@ prep_nvme_io(struct nvme *nvme, struct cudamem_heap *cuda_heap, uint8_t opc, voi
 		cmds[gid].cdw12 = 0;   ///< NLB == 1 LBA
 		cmds[gid].prp1 = cudamem_heap_block_vtp(
 			cuda_heap, (uint8_t *)buffers + gid * BUF_SIZE);
+
+		// All of the buffer, with the PRPs set on the device
+		if (nvme->prps) {
+			cmds[gid].cdw10 = gid * (BUF_SIZE >> nvme->lba_shift);
+			cmds[gid].cdw12 = (BUF_SIZE >> nvme->lba_shift) - 1;
+			cmds[gid].prp1 = 0;
+		}
+	}
+
+	if (nvme->engine && !strcmp(nvme->engine, "host")) {
+		err = nvme_io_engine_host(nvme, cmds, results, num_ios);
+		free(cmds);
+		goto check;
 	}
 
 	err = cuMemAlloc((CUdeviceptr *)&cu_cmds, num_ios * sizeof(*cmds));
@@ -238,8 +478,23 @@ prep_nvme_io(struct nvme *nvme, struct cudamem_heap *cuda_heap, uint8_t opc, voi
 		return err;
 	}
 
-	err = nvme_io_launch(nvme->cu_ioqs, cu_cmds, cu_results, (uint32_t)num_ios,
-			     nvme->num_queues, nvme->queue_depth);
+	if (nvme->prps) {
+		err = nvme_io_prps_launch(nvme->cu_ioqs, nvme->cu_lists, nvme->num_queues,
+					  &nvme->lut, buffers, BUF_SIZE, cu_cmds, cu_results,
+					  (uint32_t)num_ios, nvme->num_queues, nvme->queue_depth);
+	} else if (nvme->engine) {
+		err = nvme_io_engine_device(nvme, cu_cmds, cu_results, num_ios);
+	} else if (nvme->pow2) {
+		err = nvme_io_pow2_launch(nvme->cu_ioqs, cu_cmds, cu_results, (uint32_t)num_ios,
+					  nvme->num_queues, nvme->queue_depth,
+					  nvme->queue_depth + 1);
+	} else if (nvme->grid) {
+		err = nvme_io_shared_launch(nvme->cu_ioqs, nvme->num_queues, cu_cmds, cu_results,
+					    (uint32_t)num_ios, nvme->grid, nvme->block);
+	} else {
+		err = nvme_io_launch(nvme->cu_ioqs, cu_cmds, cu_results, (uint32_t)num_ios,
+				     nvme->num_queues, nvme->queue_depth);
+	}
 	if (err) {
 		printf("FAILED: nvme_io_launch(); cudaError_t(%d)\n", err);
 		cuMemFree((CUdeviceptr)cu_cmds);
@@ -257,6 +512,7 @@ prep_nvme_io(struct nvme *nvme, struct cudamem_heap *cuda_heap, uint8_t opc, voi
 		return err;
 	}
 
+check:
 	for (size_t i = 0; i < num_ios; i++) {
 		if (results[i]) {
 			printf("FAILED: nvme_io[%zu]; result(%d)\n", i, results[i]);
@@ -270,25 +526,197 @@ prep_nvme_io(struct nvme *nvme, struct cudamem_heap *cuda_heap, uint8_t opc, voi
 	return err;
 }
 
+static int
+cmp_cycles(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Read num_ios LBAs via nvme_io, and report IOPS and latency, for the placement in nvme->qopts
+ */
+int
+bench_nvme_io(struct nvme *nvme, struct cudamem_heap *cuda_heap, void *buffers, size_t num_ios)
+{
+	struct nvme_command *cmds = NULL, *cu_cmds = NULL;
+	long long *cycles = NULL, *cu_cycles = NULL;
+	int *results = NULL, *cu_results = NULL;
+	int clock_rate_khz = 0;
+	float elapsed_ms = 0;
+	double usecs, sum = 0;
+	CUdevice dev;
+	int err;
+
+	cmds = calloc(num_ios, sizeof(*cmds));
+	results = calloc(num_ios, sizeof(*results));
+	cycles = calloc(num_ios, sizeof(*cycles));
+	if (!cmds || !results || !cycles) {
+		err = -errno;
+		printf("FAILED: calloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t gid = 0; gid < num_ios; gid++) {
+		cmds[gid].nsid = 1;
+		cmds[gid].opc = 0x2;
+		cmds[gid].cdw10 = gid; ///< SLBA == global IO index
+		cmds[gid].cdw12 = 0;   ///< NLB == 1 LBA
+		cmds[gid].prp1 = cudamem_heap_block_vtp(cuda_heap,
+							(uint8_t *)buffers + gid * BUF_SIZE);
+	}
+
+	err = cuMemAlloc((CUdeviceptr *)&cu_cmds, num_ios * sizeof(*cmds));
+	if (!err) {
+		err = cuMemAlloc((CUdeviceptr *)&cu_results, num_ios * sizeof(*results));
+	}
+	if (!err) {
+		err = cuMemAlloc((CUdeviceptr *)&cu_cycles, num_ios * sizeof(*cycles));
+	}
+	if (err) {
+		printf("FAILED: cuMemAlloc(); CUresult(%d)\n", err);
+		goto exit;
+	}
+
+	err = cuMemcpyHtoD((CUdeviceptr)cu_cmds, cmds, num_ios * sizeof(*cmds));
+	if (err) {
+		printf("FAILED: cuMemcpyHtoD(cmds); CUresult(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_io_bench_launch(nvme->cu_ioqs, cu_cmds, cu_results, cu_cycles,
+				   (uint32_t)num_ios, nvme->num_queues, nvme->queue_depth,
+				   &elapsed_ms);
+	if (err) {
+		printf("FAILED: nvme_io_bench_launch(); cudaError_t(%d)\n", err);
+		goto exit;
+	}
+
+	err = cuMemcpyDtoH(results, (CUdeviceptr)cu_results, num_ios * sizeof(*results));
+	if (!err) {
+		err = cuMemcpyDtoH(cycles, (CUdeviceptr)cu_cycles, num_ios * sizeof(*cycles));
+	}
+	if (err) {
+		printf("FAILED: cuMemcpyDtoH(); CUresult(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < num_ios; i++) {
+		if (results[i]) {
+			printf("FAILED: nvme_io[%zu]; result(%d)\n", i, results[i]);
+			err = results[i];
+			goto exit;
+		}
+		sum += cycles[i];
+	}
+	qsort(cycles, num_ios, sizeof(*cycles), cmp_cycles);
+
+	cuCtxGetDevice(&dev);
+	cuDeviceGetAttribute(&clock_rate_khz, CU_DEVICE_ATTRIBUTE_CLOCK_RATE, dev);
+	usecs = 1000.0 / clock_rate_khz; ///< Microseconds per SM clock cycle
+
+	printf("placement: {sq: %s, cq: %s, ios: %zu, iops: %.0f, "
+	       "lat_us: {avg: %.2f, p50: %.2f, p99: %.2f, max: %.2f}}\n",
+	       nvme->qopts.sq == NVME_QPAIR_CUDA_PLACEMENT_HOST ? "host" : "device",
+	       nvme->qopts.cq == NVME_QPAIR_CUDA_PLACEMENT_HOST ? "host" : "device", num_ios,
+	       num_ios / (elapsed_ms / 1000.0), sum / num_ios * usecs, cycles[num_ios / 2] * usecs,
+	       cycles[num_ios * 99 / 100] * usecs, cycles[num_ios - 1] * usecs);
+
+exit:
+	cuMemFree((CUdeviceptr)cu_cmds);
+	cuMemFree((CUdeviceptr)cu_results);
+	cuMemFree((CUdeviceptr)cu_cycles);
+	free(cmds);
+	free(results);
+	free(cycles);
+
+	return err;
+}
+
+/**
+ * Run bench_nvme_io() with the SQ and CQ in GPU memory, the SQ in host memory, and both in host
+ * memory
+ */
+int
+bench_placements(const char *bdf, struct rte *rte, int num_queues, int queue_depth,
+		 size_t num_ios)
+{
+	const enum nvme_qpair_cuda_placement placements[][2] = {
+		{NVME_QPAIR_CUDA_PLACEMENT_DEVICE, NVME_QPAIR_CUDA_PLACEMENT_DEVICE},
+		{NVME_QPAIR_CUDA_PLACEMENT_HOST, NVME_QPAIR_CUDA_PLACEMENT_DEVICE},
+		{NVME_QPAIR_CUDA_PLACEMENT_HOST, NVME_QPAIR_CUDA_PLACEMENT_HOST},
+	};
+	void *buf;
+	int err = 0;
+
+	buf = cudamem_heap_block_alloc(&rte->cuda_heap, num_ios * BUF_SIZE);
+	if (!buf) {
+		err = -errno;
+		printf("FAILED: cudamem_heap_block_alloc(buf); err(%d)\n", err);
+		return err;
+	}
+
+	for (size_t i = 0; !err && i < sizeof(placements) / sizeof(*placements); i++) {
+		struct nvme nvme = {0};
+
+		nvme_io_qpair_cuda_opts_init(&nvme.qopts);
+		nvme.qopts.sq = placements[i][0];
+		nvme.qopts.cq = placements[i][1];
+
+		err = nvme_init(&nvme, bdf, rte, num_queues, queue_depth);
+		if (err) {
+			printf("FAILED: nvme_init(); err(%d)\n", err);
+			break;
+		}
+
+		err = bench_nvme_io(&nvme, &rte->cuda_heap, buf, num_ios);
+		nvme_term(&nvme, rte);
+	}
+
+	cudamem_heap_block_free(&rte->cuda_heap, buf);
+
+	return err;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct nvme nvme = {0};
 	struct rte rte = {0};
 	int num_queues, queue_depth;
-	size_t num_ios;
+	size_t num_ios, verify_off;
 	void *write_buf = NULL, *read_buf = NULL;	///< CUDA IO buffers
 	uint8_t *expected = NULL, *actual = NULL;	///< HOST buffers for comparison
 	int err;
 
-	if (argc != 5) {
-		printf("Usage: %s <PCI-BDF> <num-queues> <queue-depth> <num-ios>\n", argv[0]);
+	if ((argc < 5 || argc > 7) ||
+	    (argc == 6 && strcmp(argv[5], "host") && strcmp(argv[5], "device") &&
+	     strcmp(argv[5], "prps") && strcmp(argv[5], "placement") && strcmp(argv[5], "pow2"))) {
+		printf("Usage: %s <PCI-BDF> <num-queues> <queue-depth> <num-ios>"
+		       " [<grid> <block> | host | device | prps | placement | pow2]\n",
+		       argv[0]);
+		printf("  With <grid> and <block>, the IOs are submitted via the shared path\n");
+		printf("  With host or device, the IOs are fed to persistent engines by that\n");
+		printf("  With prps, the IOs are of %d bytes, with the PRPs built on the device\n",
+		       BUF_SIZE);
+		printf("  With placement, reads are timed with the queues in GPU and host "
+		       "memory\n");
+		printf("  With pow2, the queues are of <queue-depth> + 1, a power of two, driven "
+		       "by the specialized path\n");
 		return 1;
 	}
 
 	num_queues = atoi(argv[2]);
 	queue_depth = atoi(argv[3]);
 	num_ios = (size_t)atoi(argv[4]);
+	if (argc == 6 && !strcmp(argv[5], "prps")) {
+		nvme.prps = 1;
+	} else if (argc == 6 && !strcmp(argv[5], "pow2")) {
+		nvme.pow2 = 1;
+	} else if (argc == 6 && strcmp(argv[5], "placement")) {
+		nvme.engine = argv[5];
+	}
 
 	err = rte_init(&rte, num_ios * BUF_SIZE * 2 + 8 * 1024 * 1024ULL);
 	if (err) {
@@ -296,12 +724,23 @@ main(int argc, char **argv)
 		return err;
 	}
 
+	if (argc == 6 && !strcmp(argv[5], "placement")) {
+		err = bench_placements(argv[1], &rte, num_queues, queue_depth, num_ios);
+		rte_term(&rte);
+		return err;
+	}
+
+	nvme_io_qpair_cuda_opts_init(&nvme.qopts);
 	err = nvme_init(&nvme, argv[1], &rte, num_queues, queue_depth);
 	if (err) {
 		printf("FAILED: nvme_init(); err(%d)\n", err);
 		rte_term(&rte);
 		return err;
 	}
+	if (argc == 7) {
+		nvme.grid = (unsigned int)atoi(argv[5]);
+		nvme.block = (unsigned int)atoi(argv[6]);
+	}
 
 	write_buf = cudamem_heap_block_alloc(&rte.cuda_heap, num_ios * BUF_SIZE);
 	if (!write_buf) {
@@ -340,9 +779,12 @@ main(int argc, char **argv)
 
 	memset(actual, 0, num_ios * VERIFY_SIZE);
 
-	// Copy expected patterns into the first VERIFY_SIZE bytes of each write buffer
+	// With device-built PRPs, verify the last bytes, which are only reached via the PRP list
+	verify_off = nvme.prps ? BUF_SIZE - VERIFY_SIZE : 0;
+
+	// Copy expected patterns into VERIFY_SIZE bytes of each write buffer
 	for (size_t i = 0; i < num_ios; i++) {
-		err = cuMemcpyHtoD((CUdeviceptr)((uint8_t *)write_buf + i * BUF_SIZE),
+		err = cuMemcpyHtoD((CUdeviceptr)((uint8_t *)write_buf + i * BUF_SIZE + verify_off),
 				   expected + i * VERIFY_SIZE, VERIFY_SIZE);
 		if (err) {
 			printf("FAILED: cuMemcpyHtoD(write_buf[%zu]); err(%d)\n", i, err);
@@ -362,10 +804,10 @@ main(int argc, char **argv)
 		goto exit;
 	}
 
-	// Copy back the first VERIFY_SIZE bytes of each read buffer
+	// Copy back VERIFY_SIZE bytes of each read buffer
 	for (size_t i = 0; i < num_ios; i++) {
 		err = cuMemcpyDtoH(actual + i * VERIFY_SIZE,
-				   (CUdeviceptr)((uint8_t *)read_buf + i * BUF_SIZE),
+				   (CUdeviceptr)((uint8_t *)read_buf + i * BUF_SIZE + verify_off),
 				   VERIFY_SIZE);
 		if (err) {
 			printf("FAILED: cuMemcpyDtoH(read_buf[%zu]); err(%d)\n", i, err);
@@ -386,8 +828,10 @@ main(int argc, char **argv)
 		}
 	}
 
-	printf("SUCCESS: %zu IOs written and read back correctly (%d queue(s), depth %d)\n",
-	       num_ios, num_queues, queue_depth);
+	printf("SUCCESS: %zu IOs written and read back correctly (%d queue(s), depth %d, grid %u, "
+	       "block %u, engine %s)\n",
+	       num_ios, num_queues, queue_depth, nvme.grid, nvme.block,
+	       nvme.engine ? nvme.engine : "none");
 
 exit:
 	cudamem_heap_block_free(&rte.cuda_heap, write_buf);
@@ -10,6 +10,40 @@ CASES = [
     (4, 128, 100),
 ]
 
+# Shared submission path: (num_queues, queue_depth, num_ios, grid, block)
+SHARED_CASES = [
+    (1, 32, 1024, 4, 256),
+    (4, 128, 1024, 3, 96),
+    (2, 1024, 4096, 8, 512),
+]
+
+# Persistent engines: (num_queues, queue_depth, num_ios, fed by)
+ENGINE_CASES = [
+    (1, 32, 1024, "host"),
+    (4, 128, 4096, "host"),
+    (1, 32, 1024, "device"),
+    (4, 128, 4096, "device"),
+]
+
+# PRPs built on the device: (num_queues, queue_depth, num_ios)
+PRPS_CASES = [
+    (1, 32, 256),
+    (4, 128, 1024),
+]
+
+# Queues of a power-of-two depth, queue_depth + 1, via the specialized path: (num_queues,
+# queue_depth, num_ios)
+POW2_CASES = [
+    (1, 63, 256),
+    (4, 255, 4096),
+]
+
+# Placement of the SQ and CQ, each timed in GPU and host memory: (num_queues, queue_depth, num_ios)
+PLACEMENT_CASES = [
+    (1, 32, 1024),
+    (4, 128, 4096),
+]
+
 
 @pytest.mark.parametrize("bdf", uio_devices())
 def test_cuda_nvme_readwrite(cijoe, bdf):
@@ -22,3 +56,25 @@ def test_cuda_nvme_readwrite(cijoe, bdf):
     for num_queues, queue_depth, num_ios in CASES:
         err, _ = cijoe.run(f"{binary} {bdf} {num_queues} {queue_depth} {num_ios}")
         assert not err
+
+    for num_queues, queue_depth, num_ios, grid, block in SHARED_CASES:
+        err, _ = cijoe.run(
+            f"{binary} {bdf} {num_queues} {queue_depth} {num_ios} {grid} {block}"
+        )
+        assert not err
+
+    for num_queues, queue_depth, num_ios, fed_by in ENGINE_CASES:
+        err, _ = cijoe.run(f"{binary} {bdf} {num_queues} {queue_depth} {num_ios} {fed_by}")
+        assert not err
+
+    for num_queues, queue_depth, num_ios in PRPS_CASES:
+        err, _ = cijoe.run(f"{binary} {bdf} {num_queues} {queue_depth} {num_ios} prps")
+        assert not err
+
+    for num_queues, queue_depth, num_ios in POW2_CASES:
+        err, _ = cijoe.run(f"{binary} {bdf} {num_queues} {queue_depth} {num_ios} pow2")
+        assert not err
+
+    for num_queues, queue_depth, num_ios in PLACEMENT_CASES:
+        err, _ = cijoe.run(f"{binary} {bdf} {num_queues} {queue_depth} {num_ios} placement")
+        assert not err
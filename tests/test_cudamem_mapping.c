@@ -2,6 +2,7 @@
 
 #include <upcie/upcie_cuda.h>
 #include <cuda.h>
+#include <pthread.h>
 
 #define EXPECT_EQ(label, got, want)                                                      \
 	do {                                                                             \
@@ -505,6 +506,82 @@ test_cross_chunk_mapping(struct cudamem_mapping_registry *registry, struct cudam
 	return 0;
 }
 
+struct concurrent_reader {
+	pthread_t thread;
+	struct cudamem_mapping_registry *registry;
+	void *vaddr;
+	int stop;
+	int id;
+	size_t nresolved;
+	size_t nunmapped;
+};
+
+static void *
+concurrent_reader_run(void *arg)
+{
+	struct concurrent_reader *reader = arg;
+
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+		uint64_t phys = 0;
+
+		if (cudamem_mapping_virt_to_phys(reader->registry, reader->vaddr, &phys)) {
+			reader->nunmapped++;
+		} else {
+			reader->nresolved++;
+		}
+		cudamem_mapping_quiescent(reader->registry, reader->id);
+	}
+
+	return NULL;
+}
+
+/* A reader translates, lock-free, while the main thread registers and
+ * removes the buffer; the dma-bufs of removed chunks are retired, and are
+ * detached once the reader has declared a quiescent state. */
+static int
+test_concurrent_readers(struct cudamem_mapping_registry *registry, struct cudamem_config *config)
+{
+	const size_t nbytes = config->alloc_granularity;
+	struct concurrent_reader reader = {0};
+	CUdeviceptr raw = 0;
+	int err;
+
+	printf("# test_concurrent_readers\n");
+
+	err = (cuMemAlloc(&raw, nbytes) == CUDA_SUCCESS) ? 0 : -ENOMEM;
+	EXPECT_EQ("cuMemAlloc", err, 0);
+
+	reader.registry = registry;
+	reader.vaddr = (void *)raw;
+	err = cudamem_mapping_reader_register(registry, &reader.id);
+	EXPECT_EQ("cudamem_mapping_reader_register", err, 0);
+
+	err = pthread_create(&reader.thread, NULL, concurrent_reader_run, &reader);
+	EXPECT_EQ("pthread_create", err, 0);
+
+	for (int i = 0; i < 100 && !err; ++i) {
+		err = cudamem_mapping_add(registry, config, (void *)raw, nbytes, NULL);
+		if (!err) {
+			err = cudamem_mapping_remove(registry, (void *)raw);
+		}
+	}
+
+	__atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(reader.thread, NULL);
+	EXPECT_EQ("add/remove", err, 0);
+
+	printf("# test_concurrent_readers: resolved=%zu unmapped=%zu\n", reader.nresolved,
+	       reader.nunmapped);
+
+	// The reader has stopped, thus, every retired dma-buf is past its grace period
+	cudamem_mapping_quiescent(registry, reader.id);
+	EXPECT_EQ("cudamem_mapping_reclaim", cudamem_mapping_reclaim(registry), 0);
+	cudamem_mapping_reader_unregister(registry, reader.id);
+
+	cuMemFree(raw);
+	return 0;
+}
+
 int
 main(void)
 {
@@ -584,6 +661,10 @@ main(void)
 	if (err) {
 		goto exit;
 	}
+	err = test_concurrent_readers(&registry, &config);
+	if (err) {
+		goto exit;
+	}
 
 	printf("SUCCES: all cudamem_mapping tests passed\n");
 
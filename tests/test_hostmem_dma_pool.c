@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the pools of fixed-size DMA buffers (include/upcie/hostmem_dma_pool.h)
+//
+// For each object size, NUM_THREADS threads each get and put objects via their own cache, then
+// verify that the physical address handed out equals that of hostmem_dma_v2p(), and that no object
+// is handed out twice at the same time. The pool is sized such that the objects held by the
+// caches of the other threads can never exhaust it.
+
+#include <upcie/upcie.h>
+
+#include <pthread.h>
+
+#define HOSTMEM_HEAP_SIZE (1024 * 1024 * 1024ULL)
+#define NUM_THREADS 4
+#define NUM_HELD 16 ///< Maximum number of objects held by a thread outside of its cache
+#define NUM_OBJS (NUM_THREADS * (HOSTMEM_DMA_POOL_MAGAZINE + NUM_HELD))
+#define NUM_ROUNDS 1000
+
+struct worker {
+	pthread_t thread;
+	struct hostmem_dma_pool *pool;
+	uint8_t tag;
+	int err;
+};
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *worker = arg;
+	struct hostmem_dma_pool_cache cache;
+	void *objs[NUM_HELD];
+
+	hostmem_dma_pool_cache_init(&cache, worker->pool);
+
+	for (int round = 0; round < NUM_ROUNDS; ++round) {
+		size_t nobjs = 1 + round % NUM_HELD;
+
+		for (size_t i = 0; i < nobjs; ++i) {
+			uint64_t phys;
+
+			objs[i] = hostmem_dma_pool_get(worker->pool, &cache, &phys);
+			if (!objs[i]) {
+				printf("FAILED: hostmem_dma_pool_get(); errno(%d)\n", errno);
+				worker->err = -ENOMEM;
+				nobjs = i;
+				break;
+			}
+			if (phys != hostmem_dma_v2p(worker->pool->heap, objs[i])) {
+				printf("FAILED: phys(0x%" PRIx64 ") != hostmem_dma_v2p()\n", phys);
+				worker->err = -EIO;
+			}
+			memset(objs[i], worker->tag, 64);
+		}
+
+		for (size_t i = 0; i < nobjs; ++i) {
+			uint8_t *obj = objs[i];
+
+			for (size_t j = 0; j < 64; ++j) {
+				if (obj[j] != worker->tag) {
+					printf("FAILED: object handed out twice\n");
+					worker->err = -EIO;
+					break;
+				}
+			}
+			hostmem_dma_pool_put(worker->pool, &cache, objs[i]);
+		}
+
+		if (worker->err) {
+			break;
+		}
+	}
+
+	hostmem_dma_pool_cache_flush(&cache);
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	struct hostmem_config config = {0};
+	struct hostmem_heap heap = {0};
+	const size_t sizes[] = {4096, 1024 * 128, 1024 * 1024 * 2ULL};
+	int err;
+
+	err = hostmem_config_init(&config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&heap, HOSTMEM_HEAP_SIZE, &config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+		struct worker workers[NUM_THREADS] = {0};
+		struct hostmem_dma_pool pool;
+
+		err = hostmem_dma_pool_init(&pool, &heap, sizes[i], NUM_OBJS);
+		if (err) {
+			printf("FAILED: hostmem_dma_pool_init(%zu); err(%d)\n", sizes[i], err);
+			goto exit;
+		}
+		hostmem_dma_pool_pp(&pool);
+
+		for (int j = 0; j < NUM_THREADS; ++j) {
+			workers[j].pool = &pool;
+			workers[j].tag = j + 1;
+
+			err = -pthread_create(&workers[j].thread, NULL, worker_run, &workers[j]);
+			if (err) {
+				printf("FAILED: pthread_create(); err(%d)\n", err);
+				hostmem_dma_pool_term(&pool);
+				goto exit;
+			}
+		}
+		for (int j = 0; j < NUM_THREADS; ++j) {
+			pthread_join(workers[j].thread, NULL);
+			if (workers[j].err && !err) {
+				err = workers[j].err;
+			}
+		}
+
+		hostmem_dma_pool_term(&pool);
+		if (err) {
+			goto exit;
+		}
+	}
+
+	printf("SUCCES: threads(%d), objs(%d), rounds(%d)\n", NUM_THREADS, NUM_OBJS, NUM_ROUNDS);
+
+exit:
+	hostmem_heap_term(&heap);
+
+	return -err;
+}
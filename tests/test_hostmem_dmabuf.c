@@ -26,6 +26,7 @@ int main(void)
 {
 	struct hostmem_config config = {0};
 	struct dmabuf dmabuf = {0};
+	struct dmabuf_extents extents = {0};
 	const size_t npages = 8;
 	size_t size;
 	uint64_t *phys_lut;
@@ -99,7 +100,27 @@ int main(void)
 		printf("  - 0x%" PRIx64 "\n", phys_lut[i]);
 	}
 
+	err = dmabuf_get_extents(&dmabuf, &extents);
+	if (err) {
+		printf("# FAILED: dmabuf_get_extents(); err(%d)\n", err);
+		goto exit;
+	}
+
+	printf("extents:\n");
+	printf("  nextents: %zu\n", extents.nextents);
+	for (size_t i = 0; i < nphys; i++) {
+		uint64_t addr = dmabuf_extents_addr(&extents, i * config.pagesize, NULL);
+
+		if (addr != phys_lut[i]) {
+			printf("# FAILED: extents(0x%" PRIx64 ") != phys_lut[%zu]\n", addr, i);
+			err = -EIO;
+			goto exit;
+		}
+	}
+
+exit:
+	dmabuf_extents_term(&extents);
 	dmabuf_detach(&dmabuf);
 	free(phys_lut);
-	return 0;
+	return err;
 }
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the growable heap (hostmem_heap_init_growable() in include/upcie/hostmem_heap.h)
+//
+// Allocates hugepage-sized blocks until the heap is exhausted, checking that the heap grows one
+// extent at a time, up to its maximum size, and that the physical address of each block equals
+// that of /proc/self/pagemap. Then frees the blocks, and checks that all extents but the first
+// are released by hostmem_heap_shrink().
+
+#include <upcie/upcie.h>
+
+#define EXTENT_SIZE (1024 * 1024 * 8ULL)
+#define MAX_SIZE (EXTENT_SIZE * 8)
+
+int
+main(void)
+{
+	struct hostmem_config config = {0};
+	struct hostmem_heap heap = {0};
+	void *blocks[MAX_SIZE / (1024 * 1024 * 2ULL)];
+	size_t nblocks = 0;
+	int err;
+
+	err = hostmem_config_init(&config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init_growable(&heap, EXTENT_SIZE, MAX_SIZE, &config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init_growable(); err(%d)\n", err);
+		return -err;
+	}
+
+	for (; nblocks < sizeof(blocks) / sizeof(*blocks); ++nblocks) {
+		uint64_t phys = 0;
+
+		blocks[nblocks] = hostmem_heap_block_alloc(&heap, config.hugepgsz);
+		if (!blocks[nblocks]) {
+			break;
+		}
+		memset(blocks[nblocks], 0xAB, config.hugepgsz);
+
+		err = hostmem_pagemap_virt_to_phys(blocks[nblocks], &phys);
+		if (err) {
+			printf("FAILED: hostmem_pagemap_virt_to_phys(); err(%d)\n", err);
+			goto exit;
+		}
+		if (phys != hostmem_dma_v2p(&heap, blocks[nblocks])) {
+			printf("FAILED: phys(0x%" PRIx64 ") != hostmem_dma_v2p()\n", phys);
+			err = -EIO;
+			goto exit;
+		}
+	}
+	hostmem_heap_pp(&heap);
+
+	if (nblocks * config.hugepgsz != MAX_SIZE || heap.desc->extents != 0xFF) {
+		printf("FAILED: nblocks(%zu), extents(0x%" PRIx64 ")\n", nblocks,
+		       heap.desc->extents);
+		err = -EIO;
+		goto exit;
+	}
+
+	while (nblocks) {
+		hostmem_heap_block_free(&heap, blocks[--nblocks]);
+	}
+
+	err = hostmem_heap_shrink(&heap);
+	if (err != 7 || heap.desc->extents != 0x1) {
+		printf("FAILED: hostmem_heap_shrink(); err(%d)\n", err);
+		err = err < 0 ? err : -EIO;
+		goto exit;
+	}
+	err = 0;
+
+	printf("SUCCES: grown to max_size(%llu), and shrunk\n", MAX_SIZE);
+
+exit:
+	while (nblocks) {
+		hostmem_heap_block_free(&heap, blocks[--nblocks]);
+	}
+	hostmem_heap_term(&heap);
+
+	return -err;
+}
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests sharing a heap between processes (hostmem_heap_import() in include/upcie/hostmem_heap.h)
+//
+// Without arguments: initialize a heap, allocate a block holding a message, and wait for an
+// importer to release it. With the path of the heap as argument: import the heap, check the
+// physical addresses against those of the initializer, allocate and free blocks, and release the
+// block of the initializer. The importer does not need CAP_SYS_ADMIN.
+
+#include <upcie/upcie.h>
+
+#define HOSTMEM_HEAP_SIZE (1024 * 1024 * 64ULL)
+
+struct shared_block {
+	char message[256];
+	uint64_t phys; ///< Physical address of the block, as resolved by the initializer
+	int val;
+};
+
+int
+heap_initialize(struct hostmem_config *config)
+{
+	struct hostmem_heap heap = {0};
+	struct shared_block *shared;
+	int err;
+
+	err = hostmem_heap_init(&heap, HOSTMEM_HEAP_SIZE, config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return err;
+	}
+
+	shared = hostmem_heap_block_alloc(&heap, sizeof(*shared));
+	if (!shared) {
+		err = -errno;
+		printf("FAILED: hostmem_heap_block_alloc(); err(%d)\n", err);
+		goto exit;
+	}
+	snprintf(shared->message, sizeof(shared->message), "%s", "Hello there!");
+	shared->phys = hostmem_dma_v2p(&heap, shared);
+	__atomic_store_n(&shared->val, 1, __ATOMIC_RELEASE);
+
+	printf("info: {pid: %d, path: '%s', offset: %zu}\n", getpid(), heap.memory.path,
+	       (size_t)((char *)shared - (char *)heap.memory.virt));
+	fflush(stdout);
+
+	while (__atomic_load_n(&shared->val, __ATOMIC_ACQUIRE)) {
+		sleep(1);
+	}
+
+	hostmem_heap_block_free(&heap, shared);
+	hostmem_heap_pp(&heap);
+
+exit:
+	hostmem_heap_term(&heap);
+
+	return err;
+}
+
+int
+heap_import(struct hostmem_config *config, const char *path, size_t offset)
+{
+	struct hostmem_heap heap = {0};
+	struct shared_block *shared;
+	void *bufs[16];
+	int err;
+
+	err = hostmem_heap_import(&heap, path, config);
+	if (err) {
+		printf("FAILED: hostmem_heap_import(); err(%d)\n", err);
+		return err;
+	}
+
+	shared = (void *)((char *)heap.memory.virt + offset);
+	printf("info: {pid: %d, shared: {message: '%s'}}\n", getpid(), shared->message);
+
+	if (hostmem_dma_v2p(&heap, shared) != shared->phys) {
+		printf("FAILED: phys(0x%" PRIx64 ") != 0x%" PRIx64 "\n",
+		       hostmem_dma_v2p(&heap, shared), shared->phys);
+		err = -EIO;
+		goto exit;
+	}
+
+	for (size_t i = 0; i < sizeof(bufs) / sizeof(*bufs); ++i) {
+		bufs[i] = hostmem_heap_block_alloc(&heap, 4096 * (i + 1));
+		if (!bufs[i]) {
+			err = -errno;
+			printf("FAILED: hostmem_heap_block_alloc(); err(%d)\n", err);
+			goto exit;
+		}
+	}
+	for (size_t i = 0; i < sizeof(bufs) / sizeof(*bufs); ++i) {
+		hostmem_heap_block_free(&heap, bufs[i]);
+	}
+
+	printf("SUCCES: imported heap; phys(0x%" PRIx64 ")\n", shared->phys);
+
+exit:
+	__atomic_store_n(&shared->val, 0, __ATOMIC_RELEASE);
+	hostmem_heap_term(&heap);
+
+	return err;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct hostmem_config config = {0};
+	int err;
+
+	err = hostmem_config_init(&config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	switch (argc) {
+	case 1:
+		err = heap_initialize(&config);
+		break;
+
+	case 3:
+		err = heap_import(&config, argv[1], strtoull(argv[2], NULL, 10));
+		break;
+
+	default:
+		printf("Usage: %s [<path> <offset>]\n", argv[0]);
+		return EINVAL;
+	}
+
+	return -err;
+}
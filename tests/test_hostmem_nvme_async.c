@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the asynchronous submission path of nvme_qpair (include/upcie/nvme/nvme_qpair.h)
+//
+// Writes NUM_IOS logical blocks, each with a distinct pattern, keeping up to QUEUE_DEPTH - 1
+// commands in flight via nvme_qpair_submit_async_contig_prps(), then reads them back the same way
+// and verifies the content. Completion callbacks count completions and record errors.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NUM_IOS 256
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+};
+
+struct io_stats {
+	size_t ncompleted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+
+	stats->ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats->nerrors += 1;
+	}
+}
+
+int
+nvme_io_async(struct nvme *nvme, uint8_t opc, uint8_t *buffer)
+{
+	struct io_stats stats = {0};
+	size_t nsubmitted = 0;
+	int err;
+
+	while (stats.ncompleted < NUM_IOS) {
+		while (nsubmitted < NUM_IOS) {
+			struct nvme_command cmd = {0};
+
+			cmd.opc = opc;
+			cmd.nsid = 1;
+			cmd.cdw10 = nsubmitted; ///< SLBA
+			cmd.cdw12 = 0;          ///< NLB == 0
+
+			err = nvme_qpair_submit_async_contig_prps(&nvme->ioq, nvme->ctrlr.heap,
+								  buffer + nsubmitted * LBA_SIZE,
+								  LBA_SIZE, &cmd, io_cb, &stats);
+			if (err == -EBUSY) {
+				break;
+			}
+			if (err) {
+				printf("FAILED: nvme_qpair_submit_async_contig_prps(); err(%d)\n", err);
+				return err;
+			}
+			nsubmitted++;
+		}
+
+		nvme_qpair_process_completions(&nvme->ioq, 0);
+	}
+
+	return stats.nerrors ? -EIO : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t buffer_size = NUM_IOS * LBA_SIZE;
+	uint8_t *write_buf = NULL, *read_buf = NULL;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+
+	write_buf = hostmem_dma_malloc(&rte.heap, buffer_size);
+	read_buf = hostmem_dma_malloc(&rte.heap, buffer_size);
+	if (!write_buf || !read_buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < buffer_size; ++i) {
+		write_buf[i] = ((i / LBA_SIZE) + i) & 0xFF;
+	}
+	memset(read_buf, 0, buffer_size);
+
+	err = nvme_io_async(&nvme, 0x1, write_buf);
+	if (err) {
+		printf("FAILED: nvme_io_async(write); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_io_async(&nvme, 0x2, read_buf);
+	if (err) {
+		printf("FAILED: nvme_io_async(read); err(%d)\n", err);
+		goto exit;
+	}
+
+	if (memcmp(write_buf, read_buf, buffer_size)) {
+		printf("FAILED: written data != read data\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: written data == read data; num_ios(%d), queue_depth(%d)\n", NUM_IOS,
+	       QUEUE_DEPTH);
+
+exit:
+	hostmem_dma_free(&rte.heap, write_buf);
+	hostmem_dma_free(&rte.heap, read_buf);
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
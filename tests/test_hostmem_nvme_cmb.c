@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests placing the SQ, and PRP-list pages, of an I/O qpair in the Controller Memory Buffer
+// (nvme_io_qpair_opts->sq_cmb in include/upcie/nvme/nvme_controller.h)
+//
+// Writes, and reads back, a buffer spanning several pages, thus, with a PRP list, which is in
+// the CMB when it supports lists. Skipped, successfully, when the controller has no CMB, or one
+// without submission queue support. The Persistent Memory Region is set up and reported, when
+// the controller has one.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define BUFFER_SIZE (64 * 1024)
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+};
+
+int
+nvme_io(struct nvme *nvme, uint8_t opc, void *buffer, size_t buffer_size)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	struct nvme_request *req;
+	uint8_t sc;
+	int err;
+
+	req = nvme_request_alloc(nvme->ioq.rpool);
+	if (!req) {
+		err = -errno;
+		printf("FAILED: nvme_request_alloc(); err(%d)\n", err);
+		return err;
+	}
+	cmd.cid = req->cid;
+	cmd.nsid = 1;
+	cmd.opc = opc;
+	cmd.cdw10 = 0;                        ///< SLBA == 0
+	cmd.cdw12 = (buffer_size >> 9) - 1; ///< NLB, in units of 512 bytes
+
+	err = nvme_request_prep_command_prps_contig(req, nvme->ctrlr.heap, buffer, buffer_size,
+						    &cmd);
+	if (err) {
+		printf("FAILED: nvme_request_prep_command_prps_contig(); err(%d)\n", err);
+		nvme_request_free(nvme->ioq.rpool, req->cid);
+		return err;
+	}
+
+	err = nvme_qpair_enqueue(&nvme->ioq, &cmd);
+	if (err) {
+		printf("FAILED: nvme_qpair_enqueue(); err(%d)\n", err);
+		nvme_request_free(nvme->ioq.rpool, req->cid);
+		return err;
+	}
+	nvme_qpair_sqdb_update(&nvme->ioq);
+
+	err = nvme_qpair_reap_cpl(&nvme->ioq, nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_qpair_reap_cpl(); err(%d)\n", err);
+		return err;
+	}
+	nvme_request_free(nvme->ioq.rpool, cpl.cid);
+
+	sc = (cpl.status & 0x1FE) >> 1;
+	if (sc) {
+		printf("FAILED: Status Code(0x%x)\n", sc);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int
+nvme_init(struct nvme *nvme, const char *bdf, struct rte *rte)
+{
+	struct nvme_io_qpair_opts opts;
+	int err;
+
+	err = nvme_controller_open(&nvme->ctrlr, bdf, &rte->heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		return err;
+	}
+	nvme_cmb_pp(&nvme->ctrlr.cmb);
+	if (nvme->ctrlr.cmb.virt) {
+		nvme_reg_cmbsz_pr(nvme->ctrlr.cmb.cmbsz);
+	}
+
+	err = nvme_controller_pmr_setup(&nvme->ctrlr);
+	if (err == 0) {
+		printf("pmr: {nbytes: %zu, addr: 0x%" PRIx64 "}\n", nvme->ctrlr.pmr.nbytes,
+		       nvme->ctrlr.pmr.addr);
+	} else if (err != -ENOTSUP) {
+		printf("FAILED: nvme_controller_pmr_setup(); err(%d)\n", err);
+		nvme_controller_close(&nvme->ctrlr);
+		return err;
+	}
+
+	nvme_io_qpair_opts_init(&opts);
+	opts.sq_cmb = 1;
+
+	err = nvme_controller_create_io_qpair_opts(&nvme->ctrlr, &nvme->ioq, 32, &opts);
+	if (err) {
+		if (err != -ENOTSUP) {
+			printf("FAILED: nvme_controller_create_io_qpair_opts(); err(%d)\n", err);
+		}
+		nvme_controller_close(&nvme->ctrlr);
+		return err;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *write_buf = NULL, *read_buf = NULL;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_init(&nvme, argv[1], &rte);
+	if (err == -ENOTSUP) {
+		printf("SKIPPED: no CMB with submission queue support\n");
+		hostmem_heap_term(&rte.heap);
+		return 0;
+	}
+	if (err) {
+		printf("FAILED: nvme_init(); err(%d)\n", err);
+		hostmem_heap_term(&rte.heap);
+		return -err;
+	}
+
+	write_buf = hostmem_dma_malloc(&rte.heap, BUFFER_SIZE);
+	read_buf = hostmem_dma_malloc(&rte.heap, BUFFER_SIZE);
+	if (!write_buf || !read_buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < BUFFER_SIZE; i++) {
+		write_buf[i] = (uint8_t)(i * 7 + (i >> 12));
+	}
+	memset(read_buf, 0, BUFFER_SIZE);
+
+	err = nvme_io(&nvme, 0x1, write_buf, BUFFER_SIZE);
+	if (err) {
+		printf("FAILED: nvme_io(write); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_io(&nvme, 0x2, read_buf, BUFFER_SIZE);
+	if (err) {
+		printf("FAILED: nvme_io(read); err(%d)\n", err);
+		goto exit;
+	}
+
+	if (memcmp(write_buf, read_buf, BUFFER_SIZE)) {
+		printf("FAILED: written data != read data\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: written data == read data; sq in CMB, lists in %s\n",
+	       nvme.ioq.rpool->cmb ? "CMB" : "host memory");
+
+exit:
+	hostmem_dma_free(&rte.heap, write_buf);
+	hostmem_dma_free(&rte.heap, read_buf);
+	nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	nvme_controller_close(&nvme.ctrlr);
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
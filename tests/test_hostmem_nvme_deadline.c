@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests deadlines of commands in flight (nvme_qpair_set_timeout(), nvme_controller_expire_abort())
+//
+// Gives the commands of an I/O qpair a deadline of TIMEOUT_MS, with an Abort queued for each
+// command missing it, and keeps QUEUE_DEPTH - 1 reads of IO_NBYTES in flight, without waiting on
+// any of them; the Aborts are submitted, and a stuck controller reset, by
+// nvme_controller_process_aborts(). Every command must then complete, once, successfully, or as
+// aborted, leaving no request armed. Run with a short TIMEOUT_MS, on a slow controller, for
+// Aborts to be submitted.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NUM_IOS 1024
+#define IO_NBYTES (128 * 1024)
+#define TIMEOUT_MS 1
+#define NVME_SC_ABORT_REQUESTED 0x07 ///< Generic; Command Abort Requested
+#define NVME_SC_ABORTED_SQ_DELETION 0x08 ///< Generic; completed as such on controller reset
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+struct io_stats {
+	size_t ncompleted;
+	size_t naborted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+	uint16_t sc = (cpl->status >> 1) & 0xFF;
+	uint16_t sct = (cpl->status >> 9) & 0x7;
+
+	stats->ncompleted += 1;
+	if (!sct && (sc == NVME_SC_ABORT_REQUESTED || sc == NVME_SC_ABORTED_SQ_DELETION)) {
+		stats->naborted += 1;
+	} else if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats->nerrors += 1;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct io_stats stats = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	size_t nsubmitted = 0;
+	uint8_t *buffer = NULL;
+	uint64_t deadline;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	buffer = hostmem_dma_malloc(&rte.heap, QUEUE_DEPTH * IO_NBYTES);
+	if (!buffer) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	nvme_qpair_set_timeout(&nvme.ioq, TIMEOUT_MS, nvme_controller_expire_abort, &nvme.ctrlr);
+
+	deadline = tsc_clock_ns() + 10 * (uint64_t)nvme.ctrlr.timeout_ms * 1000000ULL;
+	while (stats.ncompleted < NUM_IOS) {
+		while (nsubmitted < NUM_IOS) {
+			uint8_t *buf = buffer + (nsubmitted % QUEUE_DEPTH) * IO_NBYTES;
+			struct nvme_command cmd = {0};
+
+			cmd.opc = 0x2; ///< READ
+			cmd.nsid = 1;
+			cmd.cdw10 = (nsubmitted % 64) * (IO_NBYTES / 512); ///< SLBA
+			cmd.cdw12 = IO_NBYTES / 512 - 1;                    ///< NLB, zeroes-based
+
+			err = nvme_qpair_submit_async_contig_prps(&nvme.ioq, &rte.heap, buf,
+								  IO_NBYTES, &cmd, io_cb, &stats);
+			if (err == -EBUSY) {
+				break;
+			}
+			if (err) {
+				printf("FAILED: nvme_qpair_submit_async(); err(%d)\n", err);
+				goto exit;
+			}
+			nsubmitted++;
+		}
+
+		nvme_qpair_process_completions(&nvme.ioq, 0);
+		err = nvme_controller_process_aborts(&nvme.ctrlr, &nvme.ioq, 1, 0);
+		if (err < 0) {
+			printf("FAILED: nvme_controller_process_aborts(); err(%d)\n", err);
+			goto exit;
+		}
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; ncompleted(%zu)\n", stats.ncompleted);
+			err = -ETIMEDOUT;
+			goto exit;
+		}
+	}
+	printf("INFO: ncompleted(%zu), naborted(%zu), nexpired(%" PRIu64 ")\n", stats.ncompleted,
+	       stats.naborted, nvme.ioq.stats.nexpired);
+
+	if (stats.nerrors || stats.ncompleted != NUM_IOS || nvme.ioq.rpool->timer.narmed) {
+		printf("FAILED: nerrors(%zu), narmed(%" PRIu32 ")\n", stats.nerrors,
+		       nvme.ioq.rpool->timer.narmed);
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: all commands completed, once\n");
+	err = 0;
+
+exit:
+	hostmem_dma_free(&rte.heap, buffer);
+	if (nvme.nioqs) {
+		nvme_qpair_set_timeout(&nvme.ioq, 0, NULL, NULL);
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
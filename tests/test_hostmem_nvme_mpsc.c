@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the multi-producer submission ring (include/upcie/nvme/nvme_mpsc.h)
+//
+// Writes NUM_IOS logical blocks, each with a distinct pattern, then reads them back and verifies
+// the content. NUM_PRODUCERS threads submit via nvme_mpsc_submit_contig_prps(), each its own share
+// of the logical blocks, while the main thread is the consumer, calling nvme_mpsc_poll().
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#include <pthread.h>
+
+#define QUEUE_DEPTH 32
+#define RING_NSLOTS 64
+#define NUM_PRODUCERS 4
+#define NUM_IOS 256
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+	struct nvme_mpsc ring;
+};
+
+struct producer {
+	pthread_t thread;
+	struct nvme *nvme;
+	uint8_t opc;
+	uint8_t *buffer;
+	size_t first; ///< First LBA of the share of the producer
+	size_t count; ///< Number of LBAs in the share of the producer
+	int err;
+};
+
+struct io_stats {
+	size_t ncompleted; ///< Updated on the consumer thread only
+	size_t nerrors;
+};
+
+static struct io_stats stats;
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	(void)user;
+
+	stats.ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats.nerrors += 1;
+	}
+}
+
+static void *
+producer_run(void *arg)
+{
+	struct producer *producer = arg;
+
+	for (size_t i = 0; i < producer->count;) {
+		size_t lba = producer->first + i;
+		struct nvme_command cmd = {0};
+		int err;
+
+		cmd.opc = producer->opc;
+		cmd.nsid = 1;
+		cmd.cdw10 = lba; ///< SLBA
+		cmd.cdw12 = 0;   ///< NLB == 0
+
+		err = nvme_mpsc_submit_contig_prps(&producer->nvme->ring, producer->nvme->ctrlr.heap,
+						   producer->buffer + lba * LBA_SIZE, LBA_SIZE,
+						   &cmd, io_cb, NULL);
+		if (err == -EBUSY) {
+			cpu_relax();
+			continue;
+		}
+		if (err) {
+			printf("FAILED: nvme_mpsc_submit_contig_prps(); err(%d)\n", err);
+			__atomic_store_n(&producer->err, err, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		i++;
+	}
+
+	return NULL;
+}
+
+int
+nvme_io_mpsc(struct nvme *nvme, uint8_t opc, uint8_t *buffer)
+{
+	struct producer producers[NUM_PRODUCERS] = {0};
+	size_t nexpected = 0;
+	int err = 0;
+
+	memset(&stats, 0, sizeof(stats));
+
+	for (int i = 0; i < NUM_PRODUCERS; ++i) {
+		producers[i].nvme = nvme;
+		producers[i].opc = opc;
+		producers[i].buffer = buffer;
+		producers[i].first = i * (NUM_IOS / NUM_PRODUCERS);
+		producers[i].count = NUM_IOS / NUM_PRODUCERS;
+
+		err = -pthread_create(&producers[i].thread, NULL, producer_run, &producers[i]);
+		if (err) {
+			printf("FAILED: pthread_create(); err(%d)\n", err);
+			return err;
+		}
+		nexpected += producers[i].count;
+	}
+
+	while (stats.ncompleted < nexpected) {
+		int nproducing = 0;
+
+		nvme_mpsc_poll(&nvme->ring, 0);
+
+		// A producer failing to submit its share reduces the number of expected completions
+		for (int i = 0; i < NUM_PRODUCERS; ++i) {
+			nproducing += __atomic_load_n(&producers[i].err, __ATOMIC_RELAXED) == 0;
+		}
+		if (nproducing < NUM_PRODUCERS) {
+			break;
+		}
+	}
+
+	for (int i = 0; i < NUM_PRODUCERS; ++i) {
+		pthread_join(producers[i].thread, NULL);
+		if (producers[i].err && !err) {
+			err = producers[i].err;
+		}
+	}
+	if (err) {
+		return err;
+	}
+
+	return stats.nerrors ? -EIO : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t buffer_size = NUM_IOS * LBA_SIZE;
+	uint8_t *write_buf = NULL, *read_buf = NULL;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_mpsc_init(&nvme.ring, &nvme.ioq, RING_NSLOTS);
+	if (err) {
+		printf("FAILED: nvme_mpsc_init(); err(%d)\n", err);
+		goto exit;
+	}
+
+	write_buf = hostmem_dma_malloc(&rte.heap, buffer_size);
+	read_buf = hostmem_dma_malloc(&rte.heap, buffer_size);
+	if (!write_buf || !read_buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < buffer_size; ++i) {
+		write_buf[i] = ((i / LBA_SIZE) + i) & 0xFF;
+	}
+	memset(read_buf, 0, buffer_size);
+
+	err = nvme_io_mpsc(&nvme, 0x1, write_buf);
+	if (err) {
+		printf("FAILED: nvme_io_mpsc(write); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_io_mpsc(&nvme, 0x2, read_buf);
+	if (err) {
+		printf("FAILED: nvme_io_mpsc(read); err(%d)\n", err);
+		goto exit;
+	}
+
+	if (memcmp(write_buf, read_buf, buffer_size)) {
+		printf("FAILED: written data != read data\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: written data == read data; num_ios(%d), producers(%d), flushes(%" PRIu64
+	       ")\n",
+	       NUM_IOS, NUM_PRODUCERS, nvme.ring.nflushes);
+
+exit:
+	nvme_mpsc_term(&nvme.ring);
+	hostmem_dma_free(&rte.heap, write_buf);
+	hostmem_dma_free(&rte.heap, read_buf);
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the namespace and its large I/O (include/upcie/nvme/nvme_namespace.h)
+//
+// Identifies the namespace, then writes a range spanning multiple MDTS-sized commands, and a
+// partial one, with a single nvme_namespace_write(), reads it back with nvme_namespace_read(), and
+// verifies the payload. The split of the range into commands is verified to cover it exactly,
+// with every command within the limits of the namespace.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NSID 1
+#define BUF_NBYTES_MAX (16 * 1024 * 1024)
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_namespace ns;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+int
+split_verify(struct nvme_namespace *ns, uint8_t opc, uint64_t slba, uint64_t nlb)
+{
+	size_t ncmds = 0;
+
+	for (uint64_t done = 0; done < nlb; ++ncmds) {
+		uint32_t n = nvme_namespace_cmd_nlb(ns, opc, slba + done, nlb - done);
+
+		if (!n || n > ns->max_nlb || n > nlb - done ||
+		    (ns->noiob && (slba + done) / ns->noiob != (slba + done + n - 1) / ns->noiob)) {
+			printf("FAILED: cmd(%zu); slba(%" PRIu64 "), n(%" PRIu32 ")\n", ncmds,
+			       slba + done, n);
+			return -EINVAL;
+		}
+		done += n;
+	}
+	printf("INFO: opc(0x%x) nlb(%" PRIu64 ") split into ncmds(%zu)\n", opc, nlb, ncmds);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *buf = NULL;
+	uint64_t nlb;
+	size_t nbytes;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_namespace_init(&nvme.ns, &nvme.ctrlr, NSID);
+	if (err) {
+		printf("FAILED: nvme_namespace_init(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_namespace_pr(&nvme.ns);
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	// Multiple full commands, and a partial one, bounded by the buffer and the namespace
+	nlb = 3 * (uint64_t)nvme.ns.max_nlb + 7;
+	if ((nlb << nvme.ns.lba_shift) > BUF_NBYTES_MAX) {
+		nlb = (BUF_NBYTES_MAX >> nvme.ns.lba_shift) - 1;
+	}
+	if (nlb > nvme.ns.nsze) {
+		nlb = nvme.ns.nsze;
+	}
+	nbytes = nlb << nvme.ns.lba_shift;
+
+	err = split_verify(&nvme.ns, 0x1, 0, nlb);
+	err = err ? err : split_verify(&nvme.ns, 0x2, 1, nlb - 1);
+	if (err) {
+		goto exit;
+	}
+
+	buf = hostmem_dma_malloc(&rte.heap, nbytes);
+	if (!buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < nbytes; ++i) {
+		buf[i] = (i * 7 + (i >> nvme.ns.lba_shift)) & 0xFF;
+	}
+
+	err = nvme_namespace_write(&nvme.ns, &nvme.ioq, &rte.heap, 0, nlb, buf, &cpl);
+	if (err) {
+		printf("FAILED: nvme_namespace_write(); err(%d), status(0x%x)\n", err, cpl.status);
+		goto exit;
+	}
+
+	memset(buf, 0, nbytes);
+	err = nvme_namespace_read(&nvme.ns, &nvme.ioq, &rte.heap, 0, nlb, buf, &cpl);
+	if (err) {
+		printf("FAILED: nvme_namespace_read(); err(%d), status(0x%x)\n", err, cpl.status);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < nbytes; ++i) {
+		if (buf[i] != ((i * 7 + (i >> nvme.ns.lba_shift)) & 0xFF)) {
+			printf("FAILED: mismatch at byte(%zu)\n", i);
+			err = -EIO;
+			goto exit;
+		}
+	}
+	printf("SUCCES: nlb(%" PRIu64 ") written and read back\n", nlb);
+
+exit:
+	hostmem_dma_free(&rte.heap, buf);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
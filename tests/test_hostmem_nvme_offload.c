@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the offloaded data movement helpers (include/upcie/nvme/nvme_offload.h)
+//
+// Gathers the offload capabilities, and, for each supported command:
+//
+// - Write Zeroes: writes a pattern, zeroes it, and verifies that it reads back as zeroes
+// - Dataset Management: builds a list of adjacent, and non-adjacent, ranges, verifies that the
+//   adjacent ones are merged, and deallocates them
+// - Copy: writes a pattern to two source ranges, copies them to a destination, and verifies that
+//   the destination reads back as the concatenation of the sources
+//
+// Commands which the controller does not support are SKIPPED.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NSID 1
+#define NLB 16 ///< Logical blocks per range of the tests
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+	struct nvme_offload_caps caps;
+	uint32_t lba_nbytes;
+	int nioqs;
+};
+
+int
+nvme_io(struct nvme *nvme, struct hostmem_heap *heap, uint8_t opc, uint64_t slba, uint32_t nlb,
+	uint8_t *buf)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+
+	cmd.opc = opc;
+	cmd.nsid = NSID;
+	cmd.cdw10 = slba & 0xFFFFFFFF;
+	cmd.cdw11 = slba >> 32;
+	cmd.cdw12 = nlb - 1;
+
+	return nvme_qpair_submit_sync_contig_prps(&nvme->ioq, heap, buf, nlb * nvme->lba_nbytes,
+						  &cmd, nvme->ctrlr.timeout_ms, &cpl);
+}
+
+int
+test_write_zeroes(struct nvme *nvme, struct hostmem_heap *heap, uint8_t *buf)
+{
+	const size_t nbytes = NLB * nvme->lba_nbytes;
+	struct nvme_completion cpl = {0};
+	int err;
+
+	memset(buf, 0xAB, nbytes);
+	err = nvme_io(nvme, heap, 0x1, 0, NLB, buf);
+	if (err) {
+		printf("FAILED: nvme_io(write); err(%d)\n", err);
+		return err;
+	}
+
+	err = nvme_offload_write_zeroes(&nvme->ioq, NSID, 0, NLB, 0, nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_offload_write_zeroes(); err(%d), status(0x%x)\n", err,
+		       cpl.status);
+		return err;
+	}
+
+	memset(buf, 0xFF, nbytes);
+	err = nvme_io(nvme, heap, 0x2, 0, NLB, buf);
+	if (err) {
+		printf("FAILED: nvme_io(read); err(%d)\n", err);
+		return err;
+	}
+	for (size_t i = 0; i < nbytes; ++i) {
+		if (buf[i]) {
+			printf("FAILED: byte(%zu) is 0x%x, not zero\n", i, buf[i]);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int
+test_dsm(struct nvme *nvme, struct hostmem_heap *heap)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_offload_dsm dsm;
+	int err;
+
+	err = nvme_offload_dsm_init(&dsm, heap);
+	if (err) {
+		printf("FAILED: nvme_offload_dsm_init(); err(%d)\n", err);
+		return err;
+	}
+
+	err = nvme_offload_dsm_add(&dsm, 0, NLB);
+	err = err ? err : nvme_offload_dsm_add(&dsm, NLB, NLB);
+	err = err ? err : nvme_offload_dsm_add(&dsm, 4 * NLB, NLB);
+	if (err || dsm.nranges != 2 || dsm.nlb != 3 * NLB || dsm.ranges[0].nlb != 2 * NLB) {
+		printf("FAILED: nvme_offload_dsm_add(); err(%d), nranges(%" PRIu32 ")\n", err,
+		       dsm.nranges);
+		err = err ? err : -EINVAL;
+		goto exit;
+	}
+
+	err = nvme_offload_dsm_submit_sync(&nvme->ioq, heap, &dsm, NSID, nvme->ctrlr.timeout_ms,
+					   &cpl);
+	if (err || dsm.nranges) {
+		printf("FAILED: nvme_offload_dsm_submit_sync(); err(%d), status(0x%x)\n", err,
+		       cpl.status);
+		err = err ? err : -EINVAL;
+	}
+
+exit:
+	nvme_offload_dsm_term(&dsm, heap);
+
+	return err;
+}
+
+int
+test_copy(struct nvme *nvme, struct hostmem_heap *heap, uint8_t *buf)
+{
+	const size_t nbytes = NLB * nvme->lba_nbytes;
+	const uint64_t srcs[] = {8 * NLB, 16 * NLB};
+	const uint64_t sdlba = 32 * NLB;
+	struct nvme_completion cpl = {0};
+	struct nvme_offload_copy copy;
+	int err;
+
+	if (nvme->caps.msrc < 2 || (nvme->caps.mcl && nvme->caps.mcl < 2 * NLB)) {
+		printf("SKIPPED: copy; msrc(%" PRIu16 "), mcl(%" PRIu32 ") too small\n",
+		       nvme->caps.msrc, nvme->caps.mcl);
+		return 0;
+	}
+
+	err = nvme_offload_copy_init(&copy, heap, &nvme->caps);
+	if (err) {
+		printf("FAILED: nvme_offload_copy_init(); err(%d)\n", err);
+		return err;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		memset(buf, 0x10 + i, nbytes);
+		err = nvme_io(nvme, heap, 0x1, srcs[i], NLB, buf);
+		if (err) {
+			printf("FAILED: nvme_io(write); err(%d)\n", err);
+			goto exit;
+		}
+
+		err = nvme_offload_copy_add(&copy, srcs[i], NLB);
+		if (err) {
+			printf("FAILED: nvme_offload_copy_add(); err(%d)\n", err);
+			goto exit;
+		}
+	}
+
+	err = nvme_offload_copy_submit_sync(&nvme->ioq, heap, &copy, NSID, sdlba,
+					    nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_offload_copy_submit_sync(); err(%d), status(0x%x)\n", err,
+		       cpl.status);
+		goto exit;
+	}
+
+	memset(buf, 0, 2 * nbytes);
+	err = nvme_io(nvme, heap, 0x2, sdlba, 2 * NLB, buf);
+	if (err) {
+		printf("FAILED: nvme_io(read); err(%d)\n", err);
+		goto exit;
+	}
+	for (size_t i = 0; i < 2 * nbytes; ++i) {
+		if (buf[i] != 0x10 + i / nbytes) {
+			printf("FAILED: byte(%zu) is 0x%x, not 0x%zx\n", i, buf[i],
+			       0x10 + i / nbytes);
+			err = -EIO;
+			goto exit;
+		}
+	}
+
+exit:
+	nvme_offload_copy_term(&copy, heap);
+
+	return err;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *buf = NULL;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_offload_caps_init(&nvme.caps, &nvme.ctrlr, NSID);
+	if (err) {
+		printf("FAILED: nvme_offload_caps_init(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_offload_caps_pr(&nvme.caps);
+
+	// The Identify Namespace is left in ctrlr->buf; LBADS of the format in use
+	{
+		uint8_t *idfy = nvme.ctrlr.buf;
+
+		nvme.lba_nbytes = 1 << idfy[128 + (idfy[26] & 0xF) * 4 + 2];
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	buf = hostmem_dma_malloc(&rte.heap, 2 * NLB * nvme.lba_nbytes);
+	if (!buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	if (nvme.caps.oncs & NVME_OFFLOAD_ONCS_WRITE_ZEROES) {
+		err = test_write_zeroes(&nvme, &rte.heap, buf);
+		if (err) {
+			goto exit;
+		}
+		printf("SUCCES: write_zeroes\n");
+	} else {
+		printf("SKIPPED: write_zeroes; not supported\n");
+	}
+
+	if (nvme.caps.oncs & NVME_OFFLOAD_ONCS_DSM) {
+		err = test_dsm(&nvme, &rte.heap);
+		if (err) {
+			goto exit;
+		}
+		printf("SUCCES: dsm\n");
+	} else {
+		printf("SKIPPED: dsm; not supported\n");
+	}
+
+	if (nvme.caps.oncs & NVME_OFFLOAD_ONCS_COPY) {
+		err = test_copy(&nvme, &rte.heap, buf);
+		if (err) {
+			goto exit;
+		}
+		printf("SUCCES: copy\n");
+	} else {
+		printf("SKIPPED: copy; not supported\n");
+	}
+
+exit:
+	hostmem_dma_free(&rte.heap, buf);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests opening multiple controllers concurrently (nvme_controller_open_parallel())
+//
+// Opens all the given controllers with a single nvme_controller_open_parallel(), creating
+// NUM_QPAIRS I/O qpairs on each from the callback, thus, on the thread setting up the controller.
+// Then reads a logical block on every qpair, and reports the time it took to open. Works with a
+// single controller as well.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define LBA_SIZE 512
+#define NUM_QPAIRS 2
+#define QUEUE_DEPTH 32
+#define CTRLRS_MAX 32
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_qpair ioqs[NUM_QPAIRS];
+	int nioqs;
+};
+
+int
+nvme_open_cb(struct nvme_controller *ctrlr, int idx, void *user)
+{
+	struct nvme *nvme = &((struct nvme *)user)[idx];
+	int err;
+
+	err = nvme_controller_create_io_qpairs(ctrlr, NUM_QPAIRS, QUEUE_DEPTH, nvme->ioqs);
+	if (err < 0) {
+		printf("FAILED: nvme_controller_create_io_qpairs(); err(%d)\n", err);
+		return err;
+	}
+	nvme->nioqs = err;
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme_controller ctrlrs[CTRLRS_MAX] = {0};
+	struct nvme nvmes[CTRLRS_MAX] = {0};
+	int errs[CTRLRS_MAX] = {0};
+	const char **bdfs = (const char **)&argv[1];
+	struct rte rte = {0};
+	uint8_t *buf = NULL;
+	int nnvmes = argc - 1;
+	uint64_t begin;
+	int err;
+
+	if (argc < 2 || nnvmes > CTRLRS_MAX) {
+		printf("Usage: %s <PCI-BDF> [<PCI-BDF> ...]; at most %d\n", argv[0], CTRLRS_MAX);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	begin = tsc_clock_ns();
+	err = nvme_controller_open_parallel(ctrlrs, bdfs, nnvmes, &rte.heap, nvme_open_cb, nvmes,
+					    errs);
+	printf("INFO: elapsed_ms(%.3f)\n", (tsc_clock_ns() - begin) / 1e6);
+	for (int i = 0; i < nnvmes; ++i) {
+		printf("INFO: bdf(%s), err(%d), nioqs(%d)\n", bdfs[i], errs[i], nvmes[i].nioqs);
+	}
+	if (err) {
+		printf("FAILED: nvme_controller_open_parallel(); err(%d)\n", err);
+		goto exit;
+	}
+
+	buf = hostmem_dma_malloc(&rte.heap, LBA_SIZE);
+	if (!buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (int i = 0; i < nnvmes; ++i) {
+		for (int q = 0; q < nvmes[i].nioqs; ++q) {
+			struct nvme_completion cpl = {0};
+			struct nvme_command cmd = {0};
+
+			cmd.opc = 0x2; ///< READ
+			cmd.nsid = 1;
+
+			err = nvme_qpair_submit_sync_contig_prps(&nvmes[i].ioqs[q], &rte.heap, buf,
+								 LBA_SIZE, &cmd,
+								 ctrlrs[i].timeout_ms, &cpl);
+			if (err) {
+				printf("FAILED: read; bdf(%s), qid(%" PRIu32 "), err(%d)\n",
+				       bdfs[i], nvmes[i].ioqs[q].qid, err);
+				goto exit;
+			}
+		}
+	}
+	printf("SUCCES: opened and read from all; nctrlrs(%d)\n", nnvmes);
+
+exit:
+	hostmem_dma_free(&rte.heap, buf);
+	for (int i = 0; i < nnvmes; ++i) {
+		if (errs[i]) {
+			continue; ///< Failed, thus, already closed
+		}
+		nvme_controller_delete_io_qpairs(&ctrlrs[i], nvmes[i].ioqs, nvmes[i].nioqs);
+		nvme_controller_close(&ctrlrs[i]);
+	}
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
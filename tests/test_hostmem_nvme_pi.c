@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests end-to-end data protection (include/upcie/nvme/nvme_pi.h)
+//
+// Checks the CRC16 T10-DIF against its check value, and nvme_pi_crc16() against the scalar, for
+// buffers of any length and alignment. Then, on a namespace formatted with PI, skipping when it is
+// not, generates the PI of NLB blocks in the host and writes them, with the metadata via MPTR or
+// as extended LBAs, with the controller checking all fields. Reads them back, with the controller
+// checking, verifies the PI in the host, and compares the data. A write with a corrupted Guard
+// must fail the check of the controller. When the namespace has 'pract', then a write and read of
+// the data alone, with the PI inserted and stripped by the controller, are verified as well.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NSID 1
+#define SLBA 0
+#define NLB 8
+#define APPTAG 0x5AA5
+#define CRC_NBYTES 8192
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_namespace ns;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+static int
+crc16_verify(void)
+{
+	uint8_t *buf = malloc(CRC_NBYTES + 64);
+
+	if (!buf) {
+		return -ENOMEM;
+	}
+	for (size_t i = 0; i < CRC_NBYTES + 64; ++i) {
+		buf[i] = (i * 7 + (i >> 9)) & 0xFF;
+	}
+
+	if (nvme_pi_crc16(0, "123456789", 9) != 0xD0DB) {
+		printf("FAILED: crc16('123456789') != 0xD0DB\n");
+		free(buf);
+		return -EIO;
+	}
+	for (size_t nbytes = 0; nbytes <= CRC_NBYTES; nbytes += 1 + nbytes / 4) {
+		for (size_t offset = 0; offset < 64; offset += 13) {
+			uint16_t crc = nbytes * 31 + offset;
+
+			if (nvme_pi_crc16(crc, buf + offset, nbytes) !=
+			    nvme_pi_crc16_scalar(crc, buf + offset, nbytes)) {
+				printf("FAILED: crc16 of nbytes(%zu) at offset(%zu)\n", nbytes,
+				       offset);
+				free(buf);
+				return -EIO;
+			}
+		}
+	}
+	free(buf);
+
+	printf("SUCCES: crc16 matches the scalar\n");
+
+	return 0;
+}
+
+/**
+ * Read, or write, NLB blocks at SLBA, with the metadata via MPTR unless the LBAs are extended
+ */
+static int
+pi_io(struct nvme *nvme, struct hostmem_heap *heap, uint8_t opc, uint8_t *data, uint8_t *meta,
+      uint8_t prinfo, struct nvme_completion *cpl)
+{
+	size_t blk_nbytes = nvme->ns.lba_nbytes + (nvme->ns.ext ? nvme->ns.ms : 0);
+	struct nvme_command cmd;
+	int err;
+
+	nvme_namespace_prep(&nvme->ns, &cmd, opc, SLBA, NLB);
+	nvme_pi_prep(&cmd, prinfo, SLBA, APPTAG, 0xFFFF);
+	if (meta) {
+		err = nvme_request_prep_command_mptr(heap, meta, (size_t)NLB * nvme->ns.ms, &cmd);
+		if (err) {
+			printf("FAILED: nvme_request_prep_command_mptr(); err(%d)\n", err);
+			return err;
+		}
+	}
+
+	return nvme_qpair_submit_sync_contig_prps(&nvme->ioq, heap, data, NLB * blk_nbytes, &cmd,
+						  nvme->ctrlr.timeout_ms, cpl);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme_completion cpl = {0};
+	uint8_t *wdata = NULL, *wmeta = NULL, *rdata = NULL, *rmeta = NULL;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	size_t data_nbytes, meta_nbytes;
+	uint64_t bad = 0;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = crc16_verify();
+	if (err) {
+		return -err;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_namespace_init(&nvme.ns, &nvme.ctrlr, NSID);
+	if (err) {
+		printf("FAILED: nvme_namespace_init(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_namespace_pr(&nvme.ns);
+	if (!(nvme.ns.dps & NVME_NAMESPACE_DPS_PIT_MASK) || nvme.ns.nsze < SLBA + NLB) {
+		printf("SKIPPED: nsid(%d) is not formatted with PI\n", NSID);
+		goto exit;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	data_nbytes = (size_t)NLB * (nvme.ns.lba_nbytes + nvme.ns.ms);
+	meta_nbytes = (size_t)NLB * nvme.ns.ms;
+	wdata = hostmem_dma_malloc(&rte.heap, data_nbytes);
+	rdata = hostmem_dma_malloc(&rte.heap, data_nbytes);
+	wmeta = hostmem_dma_malloc(&rte.heap, meta_nbytes);
+	rmeta = hostmem_dma_malloc(&rte.heap, meta_nbytes);
+	if (!wdata || !rdata || !wmeta || !rmeta) {
+		err = -ENOMEM;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+	for (size_t i = 0; i < data_nbytes; ++i) {
+		wdata[i] = (i * 31 + (i >> 9)) & 0xFF;
+	}
+	memset(wmeta, 0, meta_nbytes);
+	memset(rdata, 0, data_nbytes);
+	memset(rmeta, 0, meta_nbytes);
+
+	err = nvme_pi_generate(&nvme.ns, wdata, nvme.ns.ext ? NULL : wmeta, SLBA, NLB, APPTAG);
+	if (err) {
+		printf("FAILED: nvme_pi_generate(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = pi_io(&nvme, &rte.heap, 0x1, wdata, nvme.ns.ext ? NULL : wmeta,
+		    NVME_PI_PRINFO_PRCHK_ALL, &cpl);
+	err = err ? err
+		  : pi_io(&nvme, &rte.heap, 0x2, rdata, nvme.ns.ext ? NULL : rmeta,
+			  NVME_PI_PRINFO_PRCHK_ALL, &cpl);
+	if (err) {
+		printf("FAILED: pi_io(); err(%d), status(0x%" PRIx16 ")\n", err, cpl.status);
+		goto exit;
+	}
+
+	err = nvme_pi_verify(&nvme.ns, rdata, nvme.ns.ext ? NULL : rmeta, SLBA, NLB, APPTAG,
+			     0xFFFF, &bad);
+	if (err) {
+		printf("FAILED: nvme_pi_verify(); err(%d), block(%" PRIu64 ")\n", err, bad);
+		goto exit;
+	}
+	if (memcmp(wdata, rdata, nvme.ns.ext ? data_nbytes : (size_t)NLB * nvme.ns.lba_nbytes)) {
+		printf("FAILED: mismatch of data read back\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: nlb(%d) written and read back with PI checked; ext(%" PRIu8 ")\n", NLB,
+	       nvme.ns.ext);
+
+	// Corrupt the data of the last block; the Guard of its PI no longer matches
+	wdata[(NLB - 1) * (nvme.ns.lba_nbytes + (nvme.ns.ext ? nvme.ns.ms : 0))] ^= 0xFF;
+	err = pi_io(&nvme, &rte.heap, 0x1, wdata, nvme.ns.ext ? NULL : wmeta,
+		    NVME_PI_PRINFO_PRCHK_GUARD, &cpl);
+	if (err != -EIO || ((cpl.status >> 1) & 0x7FF) != 0x282) {
+		printf("FAILED: write with bad guard; err(%d) status(0x%" PRIx16 ")\n", err,
+		       cpl.status);
+		err = err ? err : -EIO;
+		goto exit;
+	}
+	printf("SUCCES: controller refused a bad guard\n");
+
+	if (nvme.ns.pract) {
+		err = nvme_namespace_write(&nvme.ns, &nvme.ioq, &rte.heap, SLBA, NLB, rdata, &cpl);
+		err = err ? err
+			  : nvme_namespace_read(&nvme.ns, &nvme.ioq, &rte.heap, SLBA, NLB, wdata,
+						&cpl);
+		if (err) {
+			printf("FAILED: nvme_namespace_{write,read}(); err(%d)\n", err);
+			goto exit;
+		}
+		if (memcmp(wdata, rdata, (size_t)NLB * nvme.ns.xfer_nbytes)) {
+			printf("FAILED: mismatch of data read back with PRACT\n");
+			err = -EIO;
+			goto exit;
+		}
+		printf("SUCCES: nlb(%d) written and read back with PRACT\n", NLB);
+	}
+	err = 0;
+
+exit:
+	hostmem_dma_free(&rte.heap, wdata);
+	hostmem_dma_free(&rte.heap, rdata);
+	hostmem_dma_free(&rte.heap, wmeta);
+	hostmem_dma_free(&rte.heap, rmeta);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
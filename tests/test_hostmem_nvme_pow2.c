@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the enqueue functions of qpairs of a power-of-two depth (include/upcie/nvme/nvme_qpair.h)
+//
+// Writes NUM_IOS logical blocks, each with a distinct pattern, on a qpair of depth 64, enqueueing
+// via nvme_qpair_pow2_64_enqueue_batch() and nvme_qpair_pow2_64_enqueue(), in turns of BATCH
+// commands, keeping the SQ full, such that its tail wraps around many times. Then reads them back
+// the same way and verifies the content. Also checks that the SQ refuses a command when full.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 64
+#define NUM_IOS 1024
+#define BATCH 8
+#define LBA_SIZE 512
+
+NVME_QPAIR_POW2_DEFINE(64)
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+struct io_stats {
+	size_t ncompleted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+
+	stats->ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats->nerrors += 1;
+	}
+}
+
+/**
+ * Prepare the command of the IO at `slba`, with a request of the qpair
+ */
+static int
+io_prep(struct nvme *nvme, uint8_t opc, uint8_t *buffer, size_t slba, struct io_stats *stats,
+	struct nvme_command *cmd)
+{
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(nvme->ioq.rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = io_cb;
+	req->user = stats;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = opc;
+	cmd->nsid = 1;
+	cmd->cid = req->cid;
+	cmd->cdw10 = slba; ///< SLBA
+	cmd->cdw12 = 0;    ///< NLB == 0
+
+	err = nvme_request_prep_command_prps_contig(req, nvme->ctrlr.heap, buffer + slba * LBA_SIZE,
+						    LBA_SIZE, cmd);
+	if (err) {
+		nvme_request_free(nvme->ioq.rpool, req->cid);
+	}
+
+	return err;
+}
+
+/**
+ * Prepare a FLUSH command, with a request of the qpair
+ */
+static int
+flush_prep(struct nvme *nvme, struct io_stats *stats, struct nvme_command *cmd)
+{
+	struct nvme_request *req;
+
+	req = nvme_request_alloc(nvme->ioq.rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = io_cb;
+	req->user = stats;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = 0x0; ///< FLUSH
+	cmd->nsid = 1;
+	cmd->cid = req->cid;
+
+	return 0;
+}
+
+static int
+io_pow2(struct nvme *nvme, uint8_t opc, uint8_t *buffer)
+{
+	struct io_stats stats = {0};
+	size_t nsubmitted = 0;
+	int batch = 1;
+	int err = 0;
+
+	while (stats.ncompleted < NUM_IOS) {
+		while (nsubmitted < NUM_IOS) {
+			struct nvme_command cmds[BATCH];
+			uint32_t n = 0, nenqueued;
+
+			while (n < BATCH && nsubmitted + n < NUM_IOS &&
+			       !io_prep(nvme, opc, buffer, nsubmitted + n, &stats, &cmds[n])) {
+				n++;
+			}
+
+			if (!n) {
+				break;
+			}
+
+			// Turns of all-or-none batches, and of single commands, as far as they fit
+			if (batch) {
+				err = nvme_qpair_pow2_64_enqueue_batch(&nvme->ioq, cmds, n);
+				nenqueued = err ? 0 : n;
+			} else {
+				for (nenqueued = 0; nenqueued < n; ++nenqueued) {
+					err = nvme_qpair_pow2_64_enqueue(&nvme->ioq,
+									 &cmds[nenqueued]);
+					if (err) {
+						break;
+					}
+				}
+			}
+			for (uint32_t i = nenqueued; i < n; ++i) {
+				nvme_request_free(nvme->ioq.rpool, cmds[i].cid);
+			}
+			nsubmitted += nenqueued;
+			batch = !batch;
+			if (err && err != -EBUSY) {
+				printf("FAILED: nvme_qpair_pow2_64_enqueue*(); err(%d)\n", err);
+				return err;
+			}
+			if (err) {
+				break;
+			}
+		}
+
+		nvme_qpair_sqdb_update(&nvme->ioq);
+		nvme_qpair_process_completions(&nvme->ioq, 0);
+	}
+
+	return stats.nerrors ? -EIO : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t buffer_size = NUM_IOS * LBA_SIZE;
+	uint8_t *write_buf = NULL, *read_buf = NULL;
+	struct io_stats stats = {0};
+	struct nvme_command cmd = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	write_buf = hostmem_dma_malloc(&rte.heap, buffer_size);
+	read_buf = hostmem_dma_malloc(&rte.heap, buffer_size);
+	if (!write_buf || !read_buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < buffer_size; ++i) {
+		write_buf[i] = ((i / LBA_SIZE) * 7 + i) & 0xFF;
+	}
+	memset(read_buf, 0, buffer_size);
+
+	err = io_pow2(&nvme, 0x1, write_buf);
+	if (err) {
+		printf("FAILED: io_pow2(write); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = io_pow2(&nvme, 0x2, read_buf);
+	if (err) {
+		printf("FAILED: io_pow2(read); err(%d)\n", err);
+		goto exit;
+	}
+
+	if (memcmp(write_buf, read_buf, buffer_size)) {
+		printf("FAILED: written data != read data\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: written data == read data; num_ios(%d), queue_depth(%d)\n", NUM_IOS,
+	       QUEUE_DEPTH);
+
+	// Before the doorbell is written, the SQ holds QUEUE_DEPTH - 1 commands, then refuses more
+	for (int i = 0; i < QUEUE_DEPTH - 1; ++i) {
+		err = flush_prep(&nvme, &stats, &cmd);
+		err = err ? err : nvme_qpair_pow2_64_enqueue(&nvme.ioq, &cmd);
+		if (err) {
+			printf("FAILED: nvme_qpair_pow2_64_enqueue(flush: %d); err(%d)\n", i, err);
+			goto exit;
+		}
+	}
+	if (nvme_qpair_pow2_64_enqueue(&nvme.ioq, &cmd) != -EBUSY ||
+	    nvme_qpair_pow2_64_enqueue_batch(&nvme.ioq, &cmd, 1) != -EBUSY) {
+		printf("FAILED: enqueue into a full SQ did not return -EBUSY\n");
+		err = -EIO;
+		goto exit;
+	}
+	nvme_qpair_sqdb_update(&nvme.ioq);
+	while (stats.ncompleted < QUEUE_DEPTH - 1) {
+		nvme_qpair_process_completions(&nvme.ioq, 0);
+	}
+	if (stats.nerrors) {
+		printf("FAILED: flush; nerrors(%zu)\n", stats.nerrors);
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: full SQ refused the command; queued flushes completed\n");
+
+exit:
+	hostmem_dma_free(&rte.heap, write_buf);
+	hostmem_dma_free(&rte.heap, read_buf);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the polling reactor (include/upcie/nvme/nvme_reactor.h)
+//
+// Opens every controller given, creates NUM_QPAIRS qpairs on each, and registers all of them with
+// a single reactor. Each qpair is kept at QUEUE_DEPTH / 2 reads in flight: the callback of every
+// read enqueues the next one, leaving the doorbell to the reactor, until NUM_IOS reads are done on
+// the qpair. A poller counts the iterations, and a timer gives up after TIMEOUT_US; the last
+// callback stops the reactor. Every read must complete once, without errors.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define CTRLRS_MAX 8
+#define NUM_QPAIRS 2
+#define QUEUE_DEPTH 64
+#define NUM_IOS 4096
+#define NSID 1
+#define IO_NBYTES 4096
+#define TIMEOUT_US (30 * 1000000ULL)
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct io {
+	struct nvme_reactor *reactor;
+	struct nvme_qpair qp;
+	struct hostmem_heap *heap;
+	uint8_t *buf;
+	size_t nsubmitted;
+	size_t ncompleted;
+	size_t nerrors;
+};
+
+struct nvme {
+	struct nvme_controller ctrlrs[CTRLRS_MAX];
+	struct io ios[CTRLRS_MAX * NUM_QPAIRS];
+	struct nvme_reactor reactor;
+	int nctrlrs;
+	int nios;
+	size_t ndone; ///< Number of qpairs done with NUM_IOS reads
+};
+
+static struct nvme nvme;
+
+static void io_cb(struct nvme_completion *cpl, void *user);
+
+/**
+ * Enqueue the next read of the qpair; the doorbell is written by the reactor
+ */
+static int
+io_enqueue(struct io *io)
+{
+	size_t slot = io->nsubmitted % (QUEUE_DEPTH / 2);
+	struct nvme_command cmd = {0};
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(io->qp.rpool);
+	if (!req) {
+		return -EBUSY;
+	}
+	req->cb = io_cb;
+	req->user = io;
+
+	cmd.opc = 0x2; ///< READ
+	cmd.nsid = NSID;
+	cmd.cid = req->cid;
+	cmd.cdw10 = io->nsubmitted % 1024; ///< SLBA
+
+	err = nvme_request_prep_command_prps_contig(req, io->heap, io->buf + slot * IO_NBYTES, 512,
+						    &cmd);
+	err = err ? err : nvme_qpair_enqueue(&io->qp, &cmd);
+	if (err) {
+		nvme_request_free(io->qp.rpool, req->cid);
+		return err;
+	}
+	io->nsubmitted++;
+
+	return 0;
+}
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io *io = user;
+
+	io->ncompleted++;
+	if (cpl->status & 0x1FE) {
+		printf("FAILED: qid(%" PRIu32 ") status(0x%" PRIx16 ")\n", io->qp.qid, cpl->status);
+		io->nerrors++;
+	}
+
+	if (io->nsubmitted < NUM_IOS) {
+		if (io_enqueue(io)) {
+			io->nerrors++;
+		}
+	} else if (io->ncompleted == NUM_IOS && ++nvme.ndone == (size_t)nvme.nios) {
+		nvme_reactor_stop(io->reactor);
+	}
+}
+
+static int
+iters_poller(void *arg)
+{
+	uint64_t *niters = arg;
+
+	*niters += 1;
+
+	return 0;
+}
+
+static int
+timeout_timer(void *arg)
+{
+	int *nexpired = arg;
+
+	if (++*nexpired > 1) {
+		printf("FAILED: timeout; ndone(%zu)\n", nvme.ndone);
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct rte rte = {0};
+	uint64_t niters = 0;
+	int nexpired = 0;
+	int err = 0;
+
+	if (argc < 2 || argc > CTRLRS_MAX + 1) {
+		printf("Usage: %s <PCI-BDF> [<PCI-BDF> ...]\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	nvme_reactor_init(&nvme.reactor);
+
+	for (int c = 0; c < argc - 1; ++c) {
+		err = nvme_controller_open(&nvme.ctrlrs[c], argv[c + 1], &rte.heap);
+		if (err) {
+			printf("FAILED: nvme_controller_open(%s); err(%d)\n", argv[c + 1], err);
+			goto exit;
+		}
+		nvme.nctrlrs++;
+
+		for (int q = 0; q < NUM_QPAIRS; ++q) {
+			struct io *io = &nvme.ios[nvme.nios];
+
+			io->reactor = &nvme.reactor;
+			io->heap = &rte.heap;
+			io->buf = hostmem_dma_malloc(&rte.heap, (QUEUE_DEPTH / 2) * IO_NBYTES);
+			if (!io->buf) {
+				err = -ENOMEM;
+				printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+				goto exit;
+			}
+
+			err = nvme_controller_create_io_qpair(&nvme.ctrlrs[c], &io->qp,
+							      QUEUE_DEPTH);
+			if (err) {
+				printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+				hostmem_dma_free(&rte.heap, io->buf);
+				goto exit;
+			}
+			nvme.nios++;
+
+			err = nvme_reactor_add(&nvme.reactor, &io->qp);
+			if (err) {
+				printf("FAILED: nvme_reactor_add(); err(%d)\n", err);
+				goto exit;
+			}
+		}
+	}
+
+	err = nvme_reactor_poller_add(&nvme.reactor, iters_poller, &niters, 0);
+	err = err < 0 ? err
+		      : nvme_reactor_poller_add(&nvme.reactor, timeout_timer, &nexpired,
+						TIMEOUT_US);
+	if (err < 0) {
+		printf("FAILED: nvme_reactor_poller_add(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (int i = 0; i < nvme.nios; ++i) {
+		for (int n = 0; n < QUEUE_DEPTH / 2; ++n) {
+			err = io_enqueue(&nvme.ios[i]);
+			if (err) {
+				printf("FAILED: io_enqueue(); err(%d)\n", err);
+				goto exit;
+			}
+		}
+	}
+
+	err = nvme_reactor_run(&nvme.reactor);
+	nvme_reactor_pr(&nvme.reactor);
+	if (err) {
+		printf("FAILED: nvme_reactor_run(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (int i = 0; i < nvme.nios; ++i) {
+		struct io *io = &nvme.ios[i];
+
+		if (io->nerrors || io->ncompleted != NUM_IOS) {
+			printf("FAILED: io(%d); ncompleted(%zu), nerrors(%zu)\n", i, io->ncompleted,
+			       io->nerrors);
+			err = -EIO;
+			goto exit;
+		}
+	}
+	if (niters != nvme.reactor.niters) {
+		printf("FAILED: poller niters(%" PRIu64 ") != %" PRIu64 "\n", niters,
+		       nvme.reactor.niters);
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: nqpairs(%d) of nctrlrs(%d) driven by one reactor; nreaped(%" PRIu64 ")\n",
+	       nvme.nios, nvme.nctrlrs, nvme.reactor.nreaped);
+
+exit:
+	for (int i = 0; i < nvme.nios; ++i) {
+		struct io *io = &nvme.ios[i];
+
+		nvme_reactor_remove(&nvme.reactor, &io->qp);
+		nvme_controller_delete_io_qpair(&nvme.ctrlrs[i / NUM_QPAIRS], &io->qp);
+		hostmem_dma_free(&rte.heap, io->buf);
+	}
+	for (int c = 0; c < nvme.nctrlrs; ++c) {
+		nvme_controller_close(&nvme.ctrlrs[c]);
+	}
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests resetting the controller in place (nvme_controller_reset())
+//
+// Writes NUM_IOS logical blocks, each with a distinct pattern, then submits reads of them, without
+// reaping completions, and resets the controller with NVME_CONTROLLER_RESET_RESUBMIT. The reads
+// must then complete, once each, on the same qpair, with the content written. Then submits reads
+// again, and resets without resubmitting; each must then be completed, by the reset, as aborted.
+// Finally, the qpair is verified to be usable after the resets.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 64
+#define NUM_IOS 32
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+struct io_stats {
+	size_t ncompleted;
+	size_t naborted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+	uint16_t sc = (cpl->status >> 1) & 0xFF;
+	uint16_t sct = (cpl->status >> 9) & 0x7;
+
+	stats->ncompleted += 1;
+	if (!sct && sc == NVME_QPAIR_SC_ABORTED_SQ_DELETION) {
+		stats->naborted += 1;
+	} else if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats->nerrors += 1;
+	}
+}
+
+static int
+submit_all(struct nvme *nvme, uint8_t opc, uint8_t *buffer, struct io_stats *stats)
+{
+	for (size_t i = 0; i < NUM_IOS; ++i) {
+		struct nvme_command cmd = {0};
+		int err;
+
+		cmd.opc = opc;
+		cmd.nsid = 1;
+		cmd.cdw10 = i; ///< SLBA
+		cmd.cdw12 = 0; ///< NLB == 0
+
+		err = nvme_qpair_submit_async_contig_prps(&nvme->ioq, nvme->ctrlr.heap,
+							  buffer + i * LBA_SIZE, LBA_SIZE, &cmd,
+							  io_cb, stats);
+		if (err) {
+			printf("FAILED: nvme_qpair_submit_async_contig_prps(); err(%d)\n", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int
+reap_all(struct nvme *nvme, struct io_stats *stats)
+{
+	uint64_t deadline = tsc_clock_ns() + (uint64_t)nvme->ctrlr.timeout_ms * 1000000ULL;
+
+	while (stats->ncompleted < NUM_IOS) {
+		nvme_qpair_process_completions(&nvme->ioq, 0);
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; ncompleted(%zu)\n", stats->ncompleted);
+			return -ETIMEDOUT;
+		}
+	}
+
+	return 0;
+}
+
+static int
+verify(uint8_t *buffer)
+{
+	for (size_t i = 0; i < NUM_IOS * LBA_SIZE; ++i) {
+		if (buffer[i] != ((i / LBA_SIZE + i) & 0xFF)) {
+			printf("FAILED: mismatch at byte(%zu)\n", i);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct io_stats stats = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *buffer = NULL;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	buffer = hostmem_dma_malloc(&rte.heap, NUM_IOS * LBA_SIZE);
+	if (!buffer) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < NUM_IOS * LBA_SIZE; ++i) {
+		buffer[i] = (i / LBA_SIZE + i) & 0xFF;
+	}
+	err = submit_all(&nvme, 0x1, buffer, &stats);
+	err = err ? err : reap_all(&nvme, &stats);
+	if (err || stats.nerrors) {
+		err = err ? err : -EIO;
+		goto exit;
+	}
+
+	// Reads in flight across the reset are submitted again, and complete once each
+	memset(buffer, 0, NUM_IOS * LBA_SIZE);
+	memset(&stats, 0, sizeof(stats));
+	err = submit_all(&nvme, 0x2, buffer, &stats);
+	if (err) {
+		goto exit;
+	}
+
+	err = nvme_controller_reset(&nvme.ctrlr, &nvme.ioq, 1, NVME_CONTROLLER_RESET_RESUBMIT);
+	if (err) {
+		printf("FAILED: nvme_controller_reset(RESUBMIT); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = reap_all(&nvme, &stats);
+	if (err || stats.nerrors || stats.naborted || stats.ncompleted != NUM_IOS) {
+		printf("FAILED: resubmit; ncompleted(%zu), naborted(%zu), nerrors(%zu)\n",
+		       stats.ncompleted, stats.naborted, stats.nerrors);
+		err = err ? err : -EIO;
+		goto exit;
+	}
+	err = verify(buffer);
+	if (err) {
+		goto exit;
+	}
+	printf("SUCCES: resubmitted; ncompleted(%zu)\n", stats.ncompleted);
+
+	// Without resubmitting, the reads in flight are completed by the reset, as aborted
+	memset(&stats, 0, sizeof(stats));
+	err = submit_all(&nvme, 0x2, buffer, &stats);
+	if (err) {
+		goto exit;
+	}
+
+	err = nvme_controller_reset(&nvme.ctrlr, &nvme.ioq, 1, 0);
+	if (err) {
+		printf("FAILED: nvme_controller_reset(); err(%d)\n", err);
+		goto exit;
+	}
+	if (stats.ncompleted != NUM_IOS || stats.naborted != NUM_IOS) {
+		printf("FAILED: abort; ncompleted(%zu), naborted(%zu)\n", stats.ncompleted,
+		       stats.naborted);
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: aborted; naborted(%zu)\n", stats.naborted);
+
+	// The qpair is usable after the resets
+	memset(buffer, 0, NUM_IOS * LBA_SIZE);
+	memset(&stats, 0, sizeof(stats));
+	err = submit_all(&nvme, 0x2, buffer, &stats);
+	err = err ? err : reap_all(&nvme, &stats);
+	if (err || stats.nerrors || stats.naborted) {
+		err = err ? err : -EIO;
+		goto exit;
+	}
+	err = verify(buffer);
+	if (err) {
+		goto exit;
+	}
+	printf("SUCCES: read after reset\n");
+
+exit:
+	hostmem_dma_free(&rte.heap, buffer);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests serving the I/O of other processes (include/upcie/nvme/nvme_service.h)
+//
+// The process opening the controller creates NUM_QPAIRS qpairs, and a service of NUM_RINGS rings
+// on its heap, then forks a client and polls the service until the client exits. The client
+// imports the heap via its path, as an unprivileged process would, attaches to a ring, and writes
+// NUM_IOS distinct patterns, keeping the ring full, then reads them back and verifies them. It
+// also submits requests which the service must reject: an unknown opcode, a range beyond the
+// namespace, and a buffer beyond the heap. Last, it corrupts the layout of the rings in the shared
+// heap, the depth of its ring, and the number and offsets of rings in the description, and reads
+// the patterns back again; the service must be unaffected.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+#include <sys/wait.h>
+
+#define QUEUE_DEPTH 64
+#define RING_DEPTH 32
+#define NUM_QPAIRS 2
+#define NUM_RINGS 4
+#define NUM_IOS 256
+#define NSID 1
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_namespace ns;
+	struct nvme_qpair qpairs[NUM_QPAIRS];
+	struct nvme_service svc;
+	int nioqs;
+};
+
+/**
+ * Run all of `nios` requests of `opc`, at the logical block of their index, through the ring
+ */
+static int
+client_run(struct nvme_service_client *client, uint8_t opc, uint8_t *buf, size_t lba_nbytes,
+	   size_t nios, uint64_t deadline)
+{
+	size_t nsubmitted = 0, ncompleted = 0;
+
+	while (ncompleted < nios) {
+		struct nvme_service_cqe cqes[RING_DEPTH];
+		int nreaped;
+
+		while (nsubmitted < nios &&
+		       !nvme_service_client_enqueue(client, opc, nsubmitted, 1,
+						    buf + nsubmitted * lba_nbytes, nsubmitted)) {
+			nsubmitted++;
+		}
+		nvme_service_client_flush(client);
+
+		nreaped = nvme_service_client_reap(client, cqes, RING_DEPTH);
+		for (int i = 0; i < nreaped; ++i) {
+			if (cqes[i].status) {
+				printf("FAILED: tag(%" PRIu64 ") status(0x%" PRIx16 ")\n",
+				       cqes[i].tag, cqes[i].status);
+				return -EIO;
+			}
+		}
+		ncompleted += nreaped;
+
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; ncompleted(%zu)\n", ncompleted);
+			return -ETIMEDOUT;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Submit a request which the service must complete with `expected`, without reaching the device
+ */
+static int
+client_reject(struct nvme_service_client *client, uint8_t opc, uint64_t slba, void *buf,
+	      uint16_t expected, uint64_t deadline)
+{
+	struct nvme_service_cqe cqe;
+	int err;
+
+	err = nvme_service_client_submit(client, opc, slba, 1, buf, 0xBAD);
+	if (err) {
+		printf("FAILED: nvme_service_client_submit(); err(%d)\n", err);
+		return err;
+	}
+	while (!nvme_service_client_reap(client, &cqe, 1)) {
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; opc(0x%" PRIx8 ")\n", opc);
+			return -ETIMEDOUT;
+		}
+	}
+	if (cqe.tag != 0xBAD || cqe.status != expected) {
+		printf("FAILED: opc(0x%" PRIx8 ") status(0x%" PRIx16 ") != 0x%" PRIx16 "\n", opc,
+		       cqe.status, expected);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int
+client_main(struct hostmem_config *config, const char *path, uint64_t offset)
+{
+	struct nvme_service_client client = {0};
+	struct hostmem_heap heap = {0};
+	uint8_t *wbuf = NULL, *rbuf = NULL;
+	size_t lba_nbytes, nbytes;
+	uint64_t deadline;
+	int err;
+
+	err = hostmem_heap_import(&heap, path, config);
+	if (err) {
+		printf("FAILED: hostmem_heap_import(); err(%d)\n", err);
+		return err;
+	}
+
+	err = nvme_service_client_attach(&client, &heap, offset);
+	if (err) {
+		printf("FAILED: nvme_service_client_attach(); err(%d)\n", err);
+		goto exit;
+	}
+	printf("INFO: pid(%d) attached to ring(%" PRIu32 ")\n", getpid(), client.idx);
+
+	lba_nbytes = client.desc->xfer_nbytes;
+	nbytes = NUM_IOS * lba_nbytes;
+	wbuf = hostmem_dma_malloc(&heap, nbytes);
+	rbuf = hostmem_dma_malloc(&heap, nbytes);
+	if (!wbuf || !rbuf) {
+		err = -ENOMEM;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+	for (size_t i = 0; i < nbytes; ++i) {
+		wbuf[i] = (i / lba_nbytes * 31 + i) & 0xFF;
+	}
+	memset(rbuf, 0, nbytes);
+
+	deadline = tsc_clock_ns() + 30 * 1000000000ULL;
+
+	err = client_run(&client, 0x1, wbuf, lba_nbytes, NUM_IOS, deadline);
+	err = err ? err : client_run(&client, 0x2, rbuf, lba_nbytes, NUM_IOS, deadline);
+	if (err) {
+		goto exit;
+	}
+	if (memcmp(wbuf, rbuf, nbytes)) {
+		printf("FAILED: mismatch of data read back\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: nios(%d) written and read back via ring(%" PRIu32 ")\n", NUM_IOS,
+	       client.idx);
+
+	err = client_reject(&client, 0x9F, 0, wbuf, NVME_SERVICE_SC_INVALID_FIELD, deadline);
+	err = err ? err
+		  : client_reject(&client, 0x2, client.desc->nsze, rbuf, NVME_SERVICE_SC_LBA_RANGE,
+				  deadline);
+	err = err ? err
+		  : client_reject(&client, 0x2, 0, (char *)heap.memory.virt + heap.memory.size - 8,
+				  NVME_SERVICE_SC_INVALID_FIELD, deadline);
+	if (err) {
+		goto exit;
+	}
+	printf("SUCCES: invalid requests rejected by the service\n");
+
+	client.ring->depth = UINT32_MAX;
+	client.desc->nrings = UINT32_MAX;
+	for (uint32_t i = 0; i < NVME_SERVICE_RINGS_MAX; ++i) {
+		client.desc->rings[i] = UINT64_MAX - i;
+	}
+	memset(rbuf, 0, nbytes);
+
+	err = client_run(&client, 0x2, rbuf, lba_nbytes, NUM_IOS, deadline);
+	if (err) {
+		goto exit;
+	}
+	if (memcmp(wbuf, rbuf, nbytes)) {
+		printf("FAILED: mismatch of data read back after corrupting the ring layout\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: ring layout corrupted by the client; service unaffected\n");
+
+exit:
+	nvme_service_client_detach(&client);
+	hostmem_dma_free(&heap, wbuf);
+	hostmem_dma_free(&heap, rbuf);
+	hostmem_heap_term(&heap);
+
+	return err;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int status = 0;
+	pid_t pid;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_namespace_init(&nvme.ns, &nvme.ctrlr, NSID);
+	if (err) {
+		printf("FAILED: nvme_namespace_init(); err(%d)\n", err);
+		goto exit;
+	}
+	if (nvme.ns.nsze < NUM_IOS) {
+		printf("SKIPPED: nsze(%" PRIu64 ") < nios(%d)\n", nvme.ns.nsze, NUM_IOS);
+		goto exit;
+	}
+
+	for (int i = 0; i < NUM_QPAIRS; ++i) {
+		err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.qpairs[i], QUEUE_DEPTH);
+		if (err) {
+			printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+			goto exit;
+		}
+		nvme.nioqs += 1;
+	}
+
+	err = nvme_service_init(&nvme.svc, &nvme.ns, nvme.qpairs, NUM_QPAIRS, &rte.heap, NUM_RINGS,
+				RING_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_service_init(); err(%d)\n", err);
+		goto exit;
+	}
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0) {
+		err = -errno;
+		printf("FAILED: fork(); err(%d)\n", err);
+		goto exit;
+	}
+	if (!pid) {
+		_exit(-client_main(&rte.config, rte.heap.memory.path,
+				   nvme_service_offset(&nvme.svc)));
+	}
+
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		nvme_service_poll(&nvme.svc);
+	}
+	nvme_service_pr(&nvme.svc);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("FAILED: client exited with status(%d)\n", status);
+		err = -EIO;
+		goto exit;
+	}
+	if (nvme.svc.nrejected != 3) {
+		printf("FAILED: nrejected(%" PRIu64 ") != 3\n", nvme.svc.nrejected);
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: client served; nsubmitted(%" PRIu64 ")\n", nvme.svc.nsubmitted);
+
+exit:
+	nvme_service_term(&nvme.svc);
+	nvme_controller_delete_io_qpairs(&nvme.ctrlr, nvme.qpairs, nvme.nioqs);
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests SQs sharing a CQ (include/upcie/nvme/nvme_cq.h)
+//
+// Creates a single CQ, via nvme_controller_create_io_cq(), and NUM_SQS SQs completing to it, via
+// nvme_controller_create_io_sq(). Submits reads on all the SQs, and processes the completions by
+// polling the shared CQ alone; each completion must come back to a callback of its own SQ, and
+// every read must complete once. Then deletes the SQs, and the CQ.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define NUM_SQS 4
+#define SQ_DEPTH 32
+#define CQ_DEPTH (NUM_SQS * SQ_DEPTH)
+#define NUM_IOS_PER_SQ 24
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_cq cq;
+	struct nvme_qpair sqs[NUM_SQS];
+	int nsqs;
+	int ncqs;
+};
+
+struct io_stats {
+	uint32_t sqid;
+	size_t ncompleted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+
+	stats->ncompleted += 1;
+	if (cpl->sqid != stats->sqid) {
+		printf("FAILED: sqid(%" PRIu16 ") != expected(%" PRIu32 ")\n", cpl->sqid,
+		       stats->sqid);
+		stats->nerrors += 1;
+	} else if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats->nerrors += 1;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct io_stats stats[NUM_SQS] = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *buffer = NULL;
+	size_t ncompleted = 0;
+	uint64_t deadline;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_cq(&nvme.ctrlr, &nvme.cq, CQ_DEPTH, -1);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_cq(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.ncqs = 1;
+
+	for (int i = 0; i < NUM_SQS; ++i) {
+		struct nvme_io_qpair_opts opts;
+
+		nvme_io_qpair_opts_init(&opts);
+
+		err = nvme_controller_create_io_sq(&nvme.ctrlr, &nvme.sqs[i], &nvme.cq, SQ_DEPTH,
+						   &opts);
+		if (err) {
+			printf("FAILED: nvme_controller_create_io_sq(%d); err(%d)\n", i, err);
+			goto exit;
+		}
+		nvme.nsqs += 1;
+		stats[i].sqid = nvme.sqs[i].qid;
+	}
+	nvme_cq_pr(&nvme.cq);
+
+	buffer = hostmem_dma_malloc(&rte.heap, NUM_SQS * NUM_IOS_PER_SQ * LBA_SIZE);
+	if (!buffer) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (int n = 0; n < NUM_IOS_PER_SQ; ++n) {
+		for (int i = 0; i < NUM_SQS; ++i) {
+			size_t idx = (size_t)n * NUM_SQS + i;
+			struct nvme_command cmd = {0};
+
+			cmd.opc = 0x2; ///< READ
+			cmd.nsid = 1;
+			cmd.cdw10 = idx; ///< SLBA
+
+			err = nvme_qpair_submit_async_contig_prps(&nvme.sqs[i], &rte.heap,
+								  buffer + idx * LBA_SIZE,
+								  LBA_SIZE, &cmd, io_cb, &stats[i]);
+			if (err) {
+				printf("FAILED: nvme_qpair_submit_async_contig_prps(); err(%d)\n",
+				       err);
+				goto exit;
+			}
+		}
+	}
+
+	deadline = tsc_clock_ns() + (uint64_t)nvme.ctrlr.timeout_ms * 1000000ULL;
+	while (ncompleted < NUM_SQS * NUM_IOS_PER_SQ) {
+		ncompleted += nvme_cq_process_completions(&nvme.cq, 0);
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; ncompleted(%zu)\n", ncompleted);
+			err = -ETIMEDOUT;
+			goto exit;
+		}
+	}
+	nvme_cq_pr(&nvme.cq);
+
+	for (int i = 0; i < NUM_SQS; ++i) {
+		if (stats[i].nerrors || stats[i].ncompleted != NUM_IOS_PER_SQ) {
+			printf("FAILED: sqid(%" PRIu32 "); ncompleted(%zu), nerrors(%zu)\n",
+			       stats[i].sqid, stats[i].ncompleted, stats[i].nerrors);
+			err = -EIO;
+			goto exit;
+		}
+	}
+	printf("SUCCES: nsqs(%d) completed on cqid(%" PRIu32 "); ncompleted(%zu)\n", NUM_SQS,
+	       nvme.cq.qid, ncompleted);
+
+exit:
+	hostmem_dma_free(&rte.heap, buffer);
+	nvme_controller_delete_io_qpairs(&nvme.ctrlr, nvme.sqs, nvme.nsqs);
+	if (nvme.ncqs) {
+		nvme_controller_delete_io_cq(&nvme.ctrlr, &nvme.cq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests striping over multiple controllers (include/upcie/nvme/nvme_stripe.h)
+//
+// Opens each of the given controllers, creates NUM_QPAIRS I/O qpairs on each, and adds namespace 1
+// of each as a member of a stripe with a unit of STRIPE_UNIT bytes. Then writes a buffer of
+// BUFFER_SIZE bytes via nvme_stripe_io(), reads it back into a second buffer, and verifies the
+// content; also with an offset which is not aligned to a stripe unit. Works with a single
+// controller as well.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define BUFFER_SIZE (1024 * 1024 * 4ULL)
+#define STRIPE_UNIT (1024 * 128ULL)
+#define LBA_SIZE 512
+#define NUM_QPAIRS 2
+#define QUEUE_DEPTH 32
+#define CTRLRS_MAX 8
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioqs[NUM_QPAIRS];
+	int nioqs;
+};
+
+static int
+stripe_io_verify(struct nvme_stripe *stripe, struct hostmem_heap *heap, uint64_t offset,
+		 uint8_t *write_buf, uint8_t *read_buf, size_t nbytes)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_stripe_buf buf;
+	int err;
+
+	for (size_t i = 0; i < nbytes; ++i) {
+		write_buf[i] = ((offset + i) / LBA_SIZE + i + offset) & 0xFF;
+	}
+	memset(read_buf, 0, nbytes);
+
+	nvme_stripe_buf_hostmem(&buf, heap, write_buf);
+	err = nvme_stripe_io(stripe, 0x1, offset, nbytes, &buf, &cpl);
+	if (err) {
+		printf("FAILED: nvme_stripe_io(write); err(%d), status(0x%" PRIx16 ")\n", err,
+		       cpl.status);
+		return err;
+	}
+
+	nvme_stripe_buf_hostmem(&buf, heap, read_buf);
+	err = nvme_stripe_io(stripe, 0x2, offset, nbytes, &buf, &cpl);
+	if (err) {
+		printf("FAILED: nvme_stripe_io(read); err(%d), status(0x%" PRIx16 ")\n", err,
+		       cpl.status);
+		return err;
+	}
+
+	if (memcmp(write_buf, read_buf, nbytes)) {
+		printf("FAILED: written data != read data; offset(%" PRIu64 ")\n", offset);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme nvmes[CTRLRS_MAX] = {0};
+	uint8_t *write_buf = NULL, *read_buf = NULL;
+	struct nvme_stripe stripe;
+	struct rte rte = {0};
+	int nnvmes = 0;
+	int err;
+
+	if (argc < 2 || argc - 1 > CTRLRS_MAX) {
+		printf("Usage: %s <PCI-BDF> [<PCI-BDF> ...]; at most %d\n", argv[0], CTRLRS_MAX);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_stripe_init(&stripe, STRIPE_UNIT, LBA_SIZE);
+	if (err) {
+		printf("FAILED: nvme_stripe_init(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (; nnvmes < argc - 1; ++nnvmes) {
+		struct nvme *nvme = &nvmes[nnvmes];
+
+		err = nvme_controller_open(&nvme->ctrlr, argv[nnvmes + 1], &rte.heap);
+		if (err) {
+			printf("FAILED: nvme_controller_open(%s); err(%d)\n", argv[nnvmes + 1],
+			       err);
+			goto exit;
+		}
+
+		err = nvme_controller_create_io_qpairs(&nvme->ctrlr, NUM_QPAIRS, QUEUE_DEPTH,
+						       nvme->ioqs);
+		if (err < 0) {
+			printf("FAILED: nvme_controller_create_io_qpairs(); err(%d)\n", err);
+			nvme_controller_close(&nvme->ctrlr);
+			goto exit;
+		}
+		nvme->nioqs = err;
+
+		err = nvme_stripe_member_add(&stripe, &nvme->ctrlr, nvme->ioqs, nvme->nioqs, 1,
+					     (BUFFER_SIZE + STRIPE_UNIT) / LBA_SIZE);
+		if (err) {
+			printf("FAILED: nvme_stripe_member_add(); err(%d)\n", err);
+			nvme_controller_delete_io_qpairs(&nvme->ctrlr, nvme->ioqs, nvme->nioqs);
+			nvme_controller_close(&nvme->ctrlr);
+			goto exit;
+		}
+	}
+
+	write_buf = hostmem_dma_malloc(&rte.heap, BUFFER_SIZE);
+	read_buf = hostmem_dma_malloc(&rte.heap, BUFFER_SIZE);
+	if (!write_buf || !read_buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = stripe_io_verify(&stripe, &rte.heap, 0, write_buf, read_buf, BUFFER_SIZE);
+	if (err) {
+		goto exit;
+	}
+
+	// Starts, and ends, within a stripe unit; the buffer page offset equals that of the offset
+	err = stripe_io_verify(&stripe, &rte.heap, STRIPE_UNIT / 2 + LBA_SIZE,
+			       write_buf + LBA_SIZE, read_buf + LBA_SIZE,
+			       BUFFER_SIZE - STRIPE_UNIT);
+	if (err) {
+		goto exit;
+	}
+
+	nvme_stripe_pp(&stripe);
+	printf("SUCCES: written data == read data; nmembers(%d), unit(%llu)\n", nnvmes,
+	       STRIPE_UNIT);
+
+exit:
+	hostmem_dma_free(&rte.heap, write_buf);
+	hostmem_dma_free(&rte.heap, read_buf);
+	while (nnvmes--) {
+		nvme_controller_delete_io_qpairs(&nvmes[nnvmes].ctrlr, nvmes[nnvmes].ioqs,
+						 nvmes[nnvmes].nioqs);
+		nvme_controller_close(&nvmes[nnvmes].ctrlr);
+	}
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
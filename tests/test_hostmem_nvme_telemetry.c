@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the per-qpair telemetry (include/upcie/nvme/nvme_telemetry.h)
+//
+// Compiled with UPCIE_TELEMETRY_ENABLED regardless of the 'telemetry' option. Reads NUM_IOS
+// logical blocks asynchronously on each of NUM_QPAIRS qpairs, and issues one read beyond the
+// end of the namespace, which must fail with "LBA Out of Range". Then snapshots the telemetry of
+// each qpair, verifies the counters and histogram against what was issued, and merges them.
+
+#ifndef UPCIE_TELEMETRY_ENABLED
+#define UPCIE_TELEMETRY_ENABLED
+#endif
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NUM_IOS 256
+#define NUM_QPAIRS 2
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioqs[NUM_QPAIRS];
+	int nioqs;
+};
+
+struct io_stats {
+	size_t ncompleted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+
+	stats->ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		stats->nerrors += 1;
+	}
+}
+
+int
+nvme_io_async(struct nvme_qpair *qp, struct hostmem_heap *heap, uint8_t *buffer)
+{
+	struct io_stats stats = {0};
+	size_t nsubmitted = 0;
+	int err;
+
+	while (stats.ncompleted < NUM_IOS) {
+		while (nsubmitted < NUM_IOS) {
+			struct nvme_command cmd = {0};
+
+			cmd.opc = 0x2; ///< READ
+			cmd.nsid = 1;
+			cmd.cdw10 = nsubmitted; ///< SLBA
+			cmd.cdw12 = 0;          ///< NLB == 0
+
+			err = nvme_qpair_submit_async_contig_prps(qp, heap, buffer, LBA_SIZE, &cmd,
+								  io_cb, &stats);
+			if (err == -EBUSY) {
+				break;
+			}
+			if (err) {
+				printf("FAILED: nvme_qpair_submit_async_contig_prps(); err(%d)\n",
+				       err);
+				return err;
+			}
+			nsubmitted++;
+		}
+
+		nvme_qpair_process_completions(qp, 0);
+	}
+
+	return stats.nerrors ? -EIO : 0;
+}
+
+/**
+ * Reads the last possible LBA, which no namespace has, thus, "LBA Out of Range"
+ */
+int
+nvme_io_out_of_range(struct nvme_qpair *qp, struct hostmem_heap *heap, uint8_t *buffer,
+		     int timeout_ms)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	int err;
+
+	cmd.opc = 0x2; ///< READ
+	cmd.nsid = 1;
+	cmd.cdw10 = 0xFFFFFFFF; ///< SLBA[31:0]
+	cmd.cdw11 = 0xFFFFFFFF; ///< SLBA[63:32]
+
+	err = nvme_qpair_submit_sync_contig_prps(qp, heap, buffer, LBA_SIZE, &cmd, timeout_ms,
+						 &cpl);
+	if (err != -EIO) {
+		printf("FAILED: expected -EIO; err(%d)\n", err);
+		return err ? err : -EINVAL;
+	}
+
+	return 0;
+}
+
+int
+telemetry_verify(struct nvme_telemetry *telemetry)
+{
+	uint64_t p50 = nvme_telemetry_percentile(telemetry, 0.50);
+	uint64_t p99 = nvme_telemetry_percentile(telemetry, 0.99);
+	uint64_t nbucketed = 0;
+
+	for (uint32_t i = 0; i < NVME_TELEMETRY_HIST_NBUCKETS; ++i) {
+		nbucketed += telemetry->lat_buckets[i];
+	}
+
+	if (telemetry->nsubmitted != NUM_IOS + 1 || telemetry->ncompleted != NUM_IOS + 1) {
+		printf("FAILED: nsubmitted(%" PRIu64 "), ncompleted(%" PRIu64 ") != %d\n",
+		       telemetry->nsubmitted, telemetry->ncompleted, NUM_IOS + 1);
+		return -EINVAL;
+	}
+	if (telemetry->lat_count != NUM_IOS + 1 || nbucketed != telemetry->lat_count) {
+		printf("FAILED: lat_count(%" PRIu64 "), nbucketed(%" PRIu64 ")\n",
+		       telemetry->lat_count, nbucketed);
+		return -EINVAL;
+	}
+	if (!telemetry->nsqdb || telemetry->nsqdb > telemetry->nsubmitted || !telemetry->ncqdb) {
+		printf("FAILED: nsqdb(%" PRIu64 "), ncqdb(%" PRIu64 ")\n", telemetry->nsqdb,
+		       telemetry->ncqdb);
+		return -EINVAL;
+	}
+	if (telemetry->nerrors != 1 || telemetry->errors[0].status != 0x080) {
+		printf("FAILED: nerrors(%" PRIu64 "), status(0x%" PRIx64 ") != LBA Out of Range\n",
+		       telemetry->nerrors, telemetry->errors[0].status);
+		return -EINVAL;
+	}
+	if (p50 > p99 || p99 > telemetry->lat_max) {
+		printf("FAILED: percentiles are not monotonic\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme_telemetry *snapshot = NULL, *total = NULL;
+	uint8_t *buf = NULL;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpairs(&nvme.ctrlr, NUM_QPAIRS, QUEUE_DEPTH, nvme.ioqs);
+	if (err < NUM_QPAIRS) {
+		printf("FAILED: nvme_controller_create_io_qpairs(); err(%d)\n", err);
+		nvme.nioqs = err > 0 ? err : 0;
+		err = err < 0 ? err : -ENOSPC;
+		goto exit;
+	}
+	nvme.nioqs = err;
+
+	snapshot = calloc(1, sizeof(*snapshot));
+	total = calloc(1, sizeof(*total));
+	buf = hostmem_dma_malloc(&rte.heap, LBA_SIZE);
+	if (!snapshot || !total || !buf) {
+		err = -ENOMEM;
+		printf("FAILED: allocation; err(%d)\n", err);
+		goto exit;
+	}
+
+	for (int i = 0; i < nvme.nioqs; ++i) {
+		err = nvme_io_async(&nvme.ioqs[i], &rte.heap, buf);
+		if (err) {
+			printf("FAILED: nvme_io_async(); err(%d)\n", err);
+			goto exit;
+		}
+
+		err = nvme_io_out_of_range(&nvme.ioqs[i], &rte.heap, buf, nvme.ctrlr.timeout_ms);
+		if (err) {
+			printf("FAILED: nvme_io_out_of_range(); err(%d)\n", err);
+			goto exit;
+		}
+
+		err = nvme_qpair_telemetry_snapshot(&nvme.ioqs[i], snapshot);
+		if (err) {
+			printf("FAILED: nvme_qpair_telemetry_snapshot(); err(%d)\n", err);
+			goto exit;
+		}
+
+		err = telemetry_verify(snapshot);
+		if (err) {
+			printf("FAILED: telemetry_verify(qid: %" PRIu32 "); err(%d)\n",
+			       nvme.ioqs[i].qid, err);
+			goto exit;
+		}
+
+		nvme_telemetry_merge(total, snapshot);
+	}
+
+	nvme_telemetry_pr(total);
+	if (total->ncompleted != (uint64_t)nvme.nioqs * (NUM_IOS + 1) ||
+	    total->errors[0].count != (uint64_t)nvme.nioqs || total->nerrors_other) {
+		printf("FAILED: merged telemetry does not add up\n");
+		err = -EINVAL;
+		goto exit;
+	}
+	printf("SUCCES: telemetry matches the commands issued; nqpairs(%d), num_ios(%d)\n",
+	       nvme.nioqs, NUM_IOS);
+
+exit:
+	hostmem_dma_free(&rte.heap, buf);
+	free(snapshot);
+	free(total);
+	nvme_controller_delete_io_qpairs(&nvme.ctrlr, nvme.ioqs, nvme.nioqs);
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
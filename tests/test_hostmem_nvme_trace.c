@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the trace ring of a qpair (include/upcie/nvme/nvme_trace.h)
+//
+// Creates a ring in /dev/shm, attaches it to an I/O qpair, and reads NUM_IOS logical blocks
+// synchronously. Then reads back the events, and verifies that each command was recorded in the
+// order: SUBMIT, SQDB, CQE, CQDB, with the CID of the SUBMIT matching that of the CQE.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 32
+#define NUM_IOS 64
+#define LBA_SIZE 512
+#define TRACE_PATH "/dev/shm/upcie-trace-test"
+#define TRACE_NEVENTS 1024
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+int
+nvme_io_sync(struct nvme_qpair *qp, struct hostmem_heap *heap, uint8_t *buffer, int timeout_ms)
+{
+	for (int i = 0; i < NUM_IOS; ++i) {
+		struct nvme_completion cpl = {0};
+		struct nvme_command cmd = {0};
+		int err;
+
+		cmd.opc = 0x2; ///< READ
+		cmd.nsid = 1;
+		cmd.cdw10 = i; ///< SLBA
+		cmd.cdw12 = 0; ///< NLB == 0
+
+		err = nvme_qpair_submit_sync_contig_prps(qp, heap, buffer, LBA_SIZE, &cmd,
+							 timeout_ms, &cpl);
+		if (err) {
+			printf("FAILED: nvme_qpair_submit_sync_contig_prps(); err(%d)\n", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+int
+trace_verify(struct nvme_trace_ring *ring, uint32_t qid)
+{
+	static const uint8_t expected[] = {NVME_TRACE_SUBMIT, NVME_TRACE_SQDB, NVME_TRACE_CQE,
+					   NVME_TRACE_CQDB};
+	struct nvme_trace_event *events;
+	uint64_t pos = 0;
+	uint32_t nread;
+	int err = 0;
+
+	events = calloc(TRACE_NEVENTS, sizeof(*events));
+	if (!events) {
+		printf("FAILED: calloc(); errno(%d)\n", errno);
+		return -ENOMEM;
+	}
+
+	nread = nvme_trace_ring_read(ring, &pos, events, TRACE_NEVENTS);
+	if (ring->qid != qid || nread != NUM_IOS * 4 || pos != nread) {
+		printf("FAILED: qid(%" PRIu32 "), nread(%" PRIu32 "), pos(%" PRIu64 ")\n",
+		       ring->qid, nread, pos);
+		err = -EINVAL;
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < nread; ++i) {
+		struct nvme_trace_event *event = &events[i];
+
+		if (event->type != expected[i % 4] || event->seq != i + 1 ||
+		    (i && event->ts < events[i - 1].ts)) {
+			printf("FAILED: event(%" PRIu32 "); type(%d), seq(%" PRIu32 ")\n", i,
+			       event->type, event->seq);
+			err = -EINVAL;
+			goto exit;
+		}
+
+		switch (event->type) {
+		case NVME_TRACE_SUBMIT:
+			if (event->flags != 0x2 || event->nsid != 1 || event->arg != i / 4) {
+				printf("FAILED: event(%" PRIu32 "); not the READ submitted\n", i);
+				err = -EINVAL;
+				goto exit;
+			}
+			break;
+
+		case NVME_TRACE_CQE:
+			if (event->cid != events[i - 2].cid || (event->value & 0x1FE)) {
+				printf("FAILED: event(%" PRIu32 "); cid(%" PRIu16 ") != (%" PRIu16
+				       "), status(0x%x)\n",
+				       i, event->cid, events[i - 2].cid, event->value);
+				err = -EINVAL;
+				goto exit;
+			}
+			break;
+		}
+	}
+
+exit:
+	free(events);
+
+	return err;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme_trace_ring *ring = NULL;
+	uint8_t *buf = NULL;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	err = nvme_trace_ring_open(&ring, TRACE_PATH, TRACE_NEVENTS);
+	if (err) {
+		printf("FAILED: nvme_trace_ring_open(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_qpair_trace_attach(&nvme.ioq, ring);
+
+	buf = hostmem_dma_malloc(&rte.heap, LBA_SIZE);
+	if (!buf) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_io_sync(&nvme.ioq, &rte.heap, buf, nvme.ctrlr.timeout_ms);
+	if (err) {
+		printf("FAILED: nvme_io_sync(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_qpair_trace_detach(&nvme.ioq);
+
+	nvme_trace_ring_pp(ring);
+
+	err = trace_verify(ring, nvme.ioq.qid);
+	if (err) {
+		printf("FAILED: trace_verify(); err(%d)\n", err);
+		goto exit;
+	}
+	printf("SUCCES: trace matches the commands issued; num_ios(%d)\n", NUM_IOS);
+
+exit:
+	nvme_qpair_trace_detach(&nvme.ioq);
+	nvme_trace_ring_close(ring);
+	unlink(TRACE_PATH);
+	hostmem_dma_free(&rte.heap, buf);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests I/O to and from application buffers registered via nvme_vfio_register()
+// (include/upcie/nvme/nvme_controller_vfio.h)
+//
+// Opens the controller via VFIO, thus, the heap is mapped at an IOVA range instead of by physical
+// address. Then writes NUM_LBAS logical blocks from an anonymous mmap(), not from the heap, and
+// reads them back into another. The first buffer is registered twice, the second registration
+// must be served by the registration cache, at the same IOVA.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define NUM_LBAS 64
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct vfio_ctx vfio;
+	struct nvme_qpair ioq;
+};
+
+int
+nvme_io(struct nvme *nvme, uint8_t opc, uint64_t iova, size_t nbytes)
+{
+	struct nvme_completion cpl = {0};
+	struct nvme_command cmd = {0};
+	struct nvme_request *req;
+	int err;
+
+	req = nvme_request_alloc(nvme->ioq.rpool);
+	if (!req) {
+		printf("FAILED: nvme_request_alloc(); errno(%d)\n", errno);
+		return -ENOMEM;
+	}
+	cmd.cid = req->cid;
+	cmd.nsid = 1;
+	cmd.opc = opc;
+	cmd.cdw10 = 0;                      ///< SLBA == 0
+	cmd.cdw12 = nbytes / LBA_SIZE - 1; ///< NLB, zero-based
+
+	// The registered buffer is contiguous in IOVA space, thus, the IOVA is all the PRPs need
+	err = nvme_request_prep_command_prps_phys(req, nvme->ctrlr.heap, iova, nbytes, &cmd);
+	if (err) {
+		printf("FAILED: nvme_request_prep_command_prps_phys(); err(%d)\n", err);
+		nvme_request_free(nvme->ioq.rpool, req->cid);
+		return err;
+	}
+
+	err = nvme_qpair_enqueue(&nvme->ioq, &cmd);
+	if (err) {
+		printf("FAILED: nvme_qpair_enqueue(); err(%d)\n", err);
+		return err;
+	}
+	nvme_qpair_sqdb_update(&nvme->ioq);
+
+	err = nvme_qpair_reap_cpl(&nvme->ioq, nvme->ctrlr.timeout_ms, &cpl);
+	if (err) {
+		printf("FAILED: nvme_qpair_reap_cpl(); err(%d)\n", err);
+		return err;
+	}
+	nvme_request_free(nvme->ioq.rpool, cpl.cid);
+
+	if (cpl.status & 0x1FE) {
+		printf("FAILED: status(0x%" PRIx16 ")\n", cpl.status);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t buffer_size = NUM_LBAS * LBA_SIZE;
+	uint64_t write_iova, read_iova, iova;
+	uint8_t *write_buf, *read_buf;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	write_buf = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			 -1, 0);
+	read_buf = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (write_buf == MAP_FAILED || read_buf == MAP_FAILED) {
+		err = -errno;
+		printf("FAILED: mmap(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_open_vfio(&nvme.ctrlr, &nvme.vfio, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open_vfio(); err(%d)\n", err);
+		goto term;
+	}
+	iova = hostmem_dma_v2iova(&rte.heap, nvme.ctrlr.buf);
+	if (hostmem_dma_v2p(&rte.heap, nvme.ctrlr.buf) != iova) {
+		printf("FAILED: hostmem_dma_v2p() != hostmem_dma_v2iova()\n");
+		err = -EIO;
+		goto exit;
+	}
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, 32);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_vfio_register(&nvme.vfio, write_buf, buffer_size, &write_iova);
+	if (!err) {
+		err = nvme_vfio_register(&nvme.vfio, read_buf, buffer_size, &read_iova);
+	}
+	if (!err) {
+		err = nvme_vfio_register(&nvme.vfio, write_buf + LBA_SIZE, LBA_SIZE, &iova);
+	}
+	if (err) {
+		printf("FAILED: nvme_vfio_register(); err(%d)\n", err);
+		goto exit;
+	}
+	if (nvme.vfio.nregs != 2 || iova != write_iova + LBA_SIZE) {
+		printf("FAILED: nregs(%d), iova(0x%" PRIx64 "); not cached\n", nvme.vfio.nregs,
+		       iova);
+		err = -EIO;
+		goto exit;
+	}
+	nvme_vfio_unregister(&nvme.vfio, write_buf + LBA_SIZE, LBA_SIZE);
+
+	for (size_t i = 0; i < buffer_size; ++i) {
+		write_buf[i] = ((i / LBA_SIZE) + i) & 0xFF;
+	}
+	memset(read_buf, 0, buffer_size);
+
+	err = nvme_io(&nvme, 0x1, write_iova, buffer_size);
+	if (err) {
+		printf("FAILED: nvme_io(write); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_io(&nvme, 0x2, read_iova, buffer_size);
+	if (err) {
+		printf("FAILED: nvme_io(read); err(%d)\n", err);
+		goto exit;
+	}
+
+	if (memcmp(write_buf, read_buf, buffer_size)) {
+		printf("FAILED: written data != read data\n");
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: written data == read data; iova(0x%" PRIx64 ")\n", write_iova);
+
+	nvme_vfio_unregister(&nvme.vfio, write_buf, buffer_size);
+	nvme_vfio_unregister(&nvme.vfio, read_buf, buffer_size);
+	nvme_vfio_reg_flush(&nvme.vfio);
+
+exit:
+	nvme_controller_close_vfio(&nvme.ctrlr, &nvme.vfio);
+
+term:
+	if (write_buf != MAP_FAILED) {
+		munmap(write_buf, buffer_size);
+	}
+	if (read_buf != MAP_FAILED) {
+		munmap(read_buf, buffer_size);
+	}
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests Weighted Round Robin arbitration and the class scheduler (nvme_sched.h)
+//
+// Enables WRR via nvme_controller_wrr_enable(), skipping when the controller does not support it,
+// then sets the Arbitration weights and verifies them with Get Features. Creates an urgent and a
+// low priority qpair, adds them to a 'struct nvme_sched', and submits reads of both classes,
+// interleaved, verifying that all complete, and that each class went to its own qpair.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 64
+#define NUM_IOS 48
+#define LBA_SIZE 512
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_qpair ioqs[2];
+	int nioqs;
+};
+
+struct io_stats {
+	size_t ncompleted;
+	size_t nerrors;
+};
+
+static void
+io_cb(struct nvme_completion *cpl, void *user)
+{
+	struct io_stats *stats = user;
+
+	stats->ncompleted += 1;
+	if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		stats->nerrors += 1;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nvme_controller_arbitration arb = {.ab = 3, .lpw = 1, .mpw = 3, .hpw = 7};
+	struct nvme_controller_arbitration got = {0};
+	int qprios[2] = {NVME_QPAIR_QPRIO_URGENT, NVME_QPAIR_QPRIO_LOW};
+	struct io_stats stats = {0};
+	struct nvme_sched sched;
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *buffer = NULL;
+	uint64_t deadline;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_controller_wrr_enable(&nvme.ctrlr);
+	if (err == -ENOTSUP) {
+		printf("SKIPPED: controller does not support Weighted Round Robin\n");
+		err = 0;
+		goto exit;
+	}
+	if (err) {
+		printf("FAILED: nvme_controller_wrr_enable(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_controller_arbitration_set(&nvme.ctrlr, &arb);
+	err = err ? err : nvme_controller_arbitration_get(&nvme.ctrlr, &got);
+	if (err) {
+		printf("FAILED: nvme_controller_arbitration_{set,get}(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_controller_arbitration_pr(&got);
+	if (got.lpw != arb.lpw || got.mpw != arb.mpw || got.hpw != arb.hpw) {
+		printf("FAILED: arbitration weights not as set\n");
+		err = -EIO;
+		goto exit;
+	}
+
+	nvme_sched_init(&sched);
+	for (int i = 0; i < 2; ++i) {
+		struct nvme_io_qpair_opts opts;
+
+		nvme_io_qpair_opts_init(&opts);
+		opts.qprio = qprios[i];
+
+		err = nvme_controller_create_io_qpair_opts(&nvme.ctrlr, &nvme.ioqs[i], QUEUE_DEPTH,
+							   &opts);
+		if (err) {
+			printf("FAILED: nvme_controller_create_io_qpair_opts(); err(%d)\n", err);
+			goto exit;
+		}
+		nvme.nioqs += 1;
+
+		err = nvme_sched_add(&sched, &nvme.ioqs[i]);
+		if (err) {
+			printf("FAILED: nvme_sched_add(); err(%d)\n", err);
+			goto exit;
+		}
+	}
+
+	buffer = hostmem_dma_malloc(&rte.heap, NUM_IOS * LBA_SIZE);
+	if (!buffer) {
+		err = -errno;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+
+	for (size_t i = 0; i < NUM_IOS; ++i) {
+		struct nvme_command cmd = {0};
+
+		cmd.opc = 0x2; ///< READ
+		cmd.nsid = 1;
+		cmd.cdw10 = i; ///< SLBA
+
+		err = nvme_sched_submit_contig_prps(&sched, qprios[i % 2], &rte.heap,
+						    buffer + i * LBA_SIZE, LBA_SIZE, &cmd, io_cb,
+						    &stats);
+		if (err) {
+			printf("FAILED: nvme_sched_submit_contig_prps(); err(%d)\n", err);
+			goto exit;
+		}
+	}
+
+	deadline = tsc_clock_ns() + (uint64_t)nvme.ctrlr.timeout_ms * 1000000ULL;
+	while (stats.ncompleted < NUM_IOS) {
+		nvme_sched_process_completions(&sched);
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; ncompleted(%zu)\n", stats.ncompleted);
+			err = -ETIMEDOUT;
+			goto exit;
+		}
+	}
+	nvme_sched_pr(&sched);
+
+	if (stats.nerrors || sched.nsubmitted[NVME_QPAIR_QPRIO_URGENT] != NUM_IOS / 2 ||
+	    sched.nsubmitted[NVME_QPAIR_QPRIO_LOW] != NUM_IOS / 2 ||
+	    sched.route[NVME_QPAIR_QPRIO_URGENT] != NVME_QPAIR_QPRIO_URGENT ||
+	    sched.route[NVME_QPAIR_QPRIO_LOW] != NVME_QPAIR_QPRIO_LOW) {
+		printf("FAILED: nerrors(%zu) or commands not routed by class\n", stats.nerrors);
+		err = -EIO;
+		goto exit;
+	}
+	printf("SUCCES: ncompleted(%zu) across classes under WRR\n", stats.ncompleted);
+
+exit:
+	hostmem_dma_free(&rte.heap, buffer);
+	nvme_controller_delete_io_qpairs(&nvme.ctrlr, nvme.ioqs, nvme.nioqs);
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
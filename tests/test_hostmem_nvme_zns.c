@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests Zoned Namespaces and the Zone Append pipeline (include/upcie/nvme/nvme_zns.h)
+//
+// Identifies the zoned namespace, skipping when it is not zoned, and reports its zones. Resets the
+// first zone, then keeps up to QUEUE_DEPTH - 1 Zone Appends of APPEND_NLB blocks, each with a
+// distinct pattern, in flight on it, until NUM_APPENDS are done. The logical blocks returned by
+// the completions must be distinct, within the zone, and, as reported again, sum up to the write
+// pointer. Then reads back every append, at the logical block it was given, and verifies it.
+// Finally, finishes, and resets, the zone.
+
+#define _UPCIE_WITH_NVME
+#include <upcie/upcie.h>
+
+#define QUEUE_DEPTH 64
+#define NSID 1
+#define NUM_APPENDS 256
+#define APPEND_NLB 2
+
+struct rte {
+	struct hostmem_config config;
+	struct hostmem_heap heap;
+};
+
+struct nvme {
+	struct nvme_controller ctrlr;
+	struct nvme_namespace ns;
+	struct nvme_zns zns;
+	struct nvme_qpair ioq;
+	int nioqs;
+};
+
+struct append {
+	uint64_t lba;
+	int failed;
+};
+
+static void
+append_cb(struct nvme_completion *cpl, void *user)
+{
+	struct append *append = user;
+
+	append->lba = nvme_zns_append_lba(cpl);
+	if (cpl->status & 0x1FE) {
+		printf("FAILED: cid(%" PRIu16 ") status(0x%" PRIx16 ")\n", cpl->cid, cpl->status);
+		append->failed = 1;
+	}
+}
+
+static int
+append_verify(struct nvme_zns_zone *zone, struct append *appends)
+{
+	uint64_t nlb = 0;
+
+	for (size_t i = 0; i < NUM_APPENDS; ++i) {
+		uint64_t lba = appends[i].lba;
+
+		if (appends[i].failed || lba < zone->zslba || lba + APPEND_NLB > zone->wp ||
+		    (lba - zone->zslba) % APPEND_NLB) {
+			printf("FAILED: append(%zu) lba(%" PRIu64 ")\n", i, lba);
+			return -EIO;
+		}
+		for (size_t j = 0; j < i; ++j) {
+			if (appends[j].lba == lba) {
+				printf("FAILED: append(%zu) and (%zu) at lba(%" PRIu64 ")\n", j, i,
+				       lba);
+				return -EIO;
+			}
+		}
+		nlb += APPEND_NLB;
+	}
+	if (zone->wp - zone->zslba != nlb) {
+		printf("FAILED: wp(%" PRIu64 ") != zslba + nlb(%" PRIu64 ")\n", zone->wp, nlb);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct append appends[NUM_APPENDS] = {0};
+	struct nvme nvme = {0};
+	struct rte rte = {0};
+	uint8_t *buf = NULL, *rbuf = NULL;
+	size_t nsubmitted = 0, ncompleted = 0;
+	size_t append_nbytes;
+	uint64_t deadline;
+	int err;
+
+	if (argc != 2) {
+		printf("Usage: %s <PCI-BDF>\n", argv[0]);
+		return 1;
+	}
+
+	err = hostmem_config_init(&rte.config);
+	if (err) {
+		printf("FAILED: hostmem_config_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = hostmem_heap_init(&rte.heap, 1024 * 1024 * 128ULL, &rte.config);
+	if (err) {
+		printf("FAILED: hostmem_heap_init(); err(%d)\n", err);
+		return -err;
+	}
+
+	err = nvme_controller_open(&nvme.ctrlr, argv[1], &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_controller_open(); err(%d)\n", err);
+		goto term;
+	}
+
+	err = nvme_namespace_init(&nvme.ns, &nvme.ctrlr, NSID);
+	if (err) {
+		printf("FAILED: nvme_namespace_init(); err(%d)\n", err);
+		goto exit;
+	}
+
+	err = nvme_zns_init(&nvme.zns, &nvme.ns);
+	if (err == -ENODEV) {
+		printf("SKIPPED: nsid(%d) is not zoned\n", NSID);
+		err = 0;
+		goto exit;
+	}
+	if (err) {
+		printf("FAILED: nvme_zns_init(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_zns_pr(&nvme.zns);
+
+	err = nvme_controller_create_io_qpair(&nvme.ctrlr, &nvme.ioq, QUEUE_DEPTH);
+	if (err) {
+		printf("FAILED: nvme_controller_create_io_qpair(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme.nioqs = 1;
+
+	err = nvme_zns_report(&nvme.zns, &nvme.ioq, &rte.heap);
+	err = err ? err : nvme_zns_zone_reset(&nvme.zns, &nvme.ioq, 0);
+	if (err) {
+		printf("FAILED: nvme_zns_{report,zone_reset}(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_zns_zone_pr(&nvme.zns.zones[0]);
+	if (nvme.zns.zones[0].zcap < NUM_APPENDS * APPEND_NLB || nvme.zns.zasl_nlb < APPEND_NLB) {
+		printf("SKIPPED: zcap or zasl_nlb too small\n");
+		goto exit;
+	}
+
+	append_nbytes = (size_t)APPEND_NLB * nvme.ns.xfer_nbytes;
+	buf = hostmem_dma_malloc(&rte.heap, NUM_APPENDS * append_nbytes);
+	rbuf = hostmem_dma_malloc(&rte.heap, append_nbytes);
+	if (!buf || !rbuf) {
+		err = -ENOMEM;
+		printf("FAILED: hostmem_dma_malloc(); err(%d)\n", err);
+		goto exit;
+	}
+	for (size_t i = 0; i < NUM_APPENDS * append_nbytes; ++i) {
+		buf[i] = (i / append_nbytes * 31 + i) & 0xFF;
+	}
+
+	// Keep the qpair full of appends to the same zone, with one doorbell write per batch
+	deadline = tsc_clock_ns() + (uint64_t)nvme.ctrlr.timeout_ms * 1000000ULL;
+	while (ncompleted < NUM_APPENDS) {
+		size_t nbatch = 0;
+
+		while (nsubmitted < NUM_APPENDS) {
+			err = nvme_zns_append_enqueue(&nvme.zns, &nvme.ioq, &rte.heap, 0,
+						      buf + nsubmitted * append_nbytes, APPEND_NLB,
+						      append_cb, &appends[nsubmitted]);
+			if (err == -EBUSY) {
+				err = 0;
+				break;
+			}
+			if (err) {
+				printf("FAILED: nvme_zns_append_enqueue(); err(%d)\n", err);
+				goto exit;
+			}
+			nsubmitted++;
+			nbatch++;
+		}
+		if (nbatch) {
+			nvme_qpair_sqdb_update(&nvme.ioq);
+		}
+
+		ncompleted += nvme_qpair_process_completions(&nvme.ioq, 0);
+		if (tsc_clock_ns() > deadline) {
+			printf("FAILED: timeout; ncompleted(%zu)\n", ncompleted);
+			err = -ETIMEDOUT;
+			goto exit;
+		}
+	}
+
+	err = nvme_zns_report(&nvme.zns, &nvme.ioq, &rte.heap);
+	if (err) {
+		printf("FAILED: nvme_zns_report(); err(%d)\n", err);
+		goto exit;
+	}
+	nvme_zns_zone_pr(&nvme.zns.zones[0]);
+
+	err = append_verify(&nvme.zns.zones[0], appends);
+	if (err) {
+		goto exit;
+	}
+
+	for (size_t i = 0; i < NUM_APPENDS; ++i) {
+		err = nvme_namespace_read(&nvme.ns, &nvme.ioq, &rte.heap, appends[i].lba,
+					  APPEND_NLB, rbuf, NULL);
+		if (err) {
+			printf("FAILED: nvme_namespace_read(); err(%d)\n", err);
+			goto exit;
+		}
+		if (memcmp(rbuf, buf + i * append_nbytes, append_nbytes)) {
+			printf("FAILED: append(%zu) mismatch at lba(%" PRIu64 ")\n", i,
+			       appends[i].lba);
+			err = -EIO;
+			goto exit;
+		}
+	}
+	printf("SUCCES: nappends(%d) in flight on one zone, and read back\n", NUM_APPENDS);
+
+	err = nvme_zns_zone_finish(&nvme.zns, &nvme.ioq, 0);
+	err = err ? err : nvme_zns_append_async(&nvme.zns, &nvme.ioq, &rte.heap, 0, buf,
+						 APPEND_NLB, append_cb, &appends[0]);
+	if (err != -ENOSPC) {
+		printf("FAILED: append to a finished zone; err(%d)\n", err);
+		err = err ? err : -EIO;
+		goto exit;
+	}
+	err = nvme_zns_zone_reset(&nvme.zns, &nvme.ioq, 0);
+	if (err) {
+		printf("FAILED: nvme_zns_zone_reset(); err(%d)\n", err);
+		goto exit;
+	}
+	printf("SUCCES: zone finished and reset\n");
+
+exit:
+	hostmem_dma_free(&rte.heap, buf);
+	hostmem_dma_free(&rte.heap, rbuf);
+	if (nvme.nioqs) {
+		nvme_controller_delete_io_qpair(&nvme.ctrlr, &nvme.ioq);
+	}
+	nvme_zns_term(&nvme.zns);
+	nvme_controller_close(&nvme.ctrlr);
+
+term:
+	hostmem_heap_term(&rte.heap);
+
+	return -err;
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Tests the index of PCI functions (pci_index_build(), pci_index_init())
+//
+// Builds an index of the NVMe controllers, or of all functions when given "all", prints it, and
+// verifies that it agrees with pci_scan_filter(). Then saves it to a cache file, and verifies that
+// pci_index_init() loads the same index from it, and that a different filter is stale.
+
+#include <upcie/upcie.h>
+
+#define CACHE_PATH "/tmp/upcie_test_pci_index.txt"
+
+struct scan_arg {
+	struct pci_index *index;
+	size_t nmatched;
+	int err;
+};
+
+int
+scan_cb(struct pci_func *func, void *callback_arg)
+{
+	struct scan_arg *arg = callback_arg;
+	struct pci_index_entry *entry = pci_index_find(arg->index, func->bdf);
+
+	if (!entry || entry->ident.vendor_id != func->ident.vendor_id ||
+	    entry->ident.classcode != func->ident.classcode ||
+	    entry->numa_node != func->numa_node) {
+		printf("FAILED: bdf(%s) mismatch\n", func->bdf);
+		arg->err = -EINVAL;
+	}
+	arg->nmatched += 1;
+
+	return PCI_SCAN_ACTION_RELEASE_FUNC;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pci_filter filter = {.classcode = PCI_CLASS_NVME, .classmask = 0xFFFFFF};
+	struct pci_filter other = {.vendor_id = 0x1b36};
+	struct pci_index index = {0};
+	struct pci_index cached = {0};
+	struct scan_arg arg = {.index = &index};
+	uint64_t begin;
+	int err;
+
+	if (argc > 1 && !strcmp(argv[1], "all")) {
+		memset(&filter, 0, sizeof(filter));
+	}
+
+	begin = tsc_clock_ns();
+	err = pci_index_build(&index, &filter);
+	if (err) {
+		printf("FAILED: pci_index_build(); err(%d)\n", err);
+		return -err;
+	}
+	printf("INFO: built in elapsed_ms(%.3f)\n", (tsc_clock_ns() - begin) / 1e6);
+	pci_index_pr(&index);
+
+	err = pci_scan_filter(&filter, scan_cb, &arg);
+	if (err || arg.err || arg.nmatched != index.nentries) {
+		printf("FAILED: pci_scan_filter(); err(%d), nmatched(%zu)\n", err, arg.nmatched);
+		err = err ? err : -EINVAL;
+		goto exit;
+	}
+
+	remove(CACHE_PATH);
+	err = pci_index_save(&index, CACHE_PATH);
+	if (err) {
+		printf("FAILED: pci_index_save(); err(%d)\n", err);
+		goto exit;
+	}
+
+	begin = tsc_clock_ns();
+	err = pci_index_init(&cached, &filter, CACHE_PATH);
+	if (err) {
+		printf("FAILED: pci_index_init(); err(%d)\n", err);
+		goto exit;
+	}
+	printf("INFO: loaded in elapsed_ms(%.3f)\n", (tsc_clock_ns() - begin) / 1e6);
+
+	if (cached.nentries != index.nentries ||
+	    (index.nentries && memcmp(cached.entries, index.entries,
+				      index.nentries * sizeof(*index.entries)))) {
+		printf("FAILED: cached index differs\n");
+		err = -EINVAL;
+		goto exit;
+	}
+
+	err = pci_index_load(&cached, &other, CACHE_PATH);
+	if (err != -ESTALE) {
+		printf("FAILED: pci_index_load(other); err(%d) != -ESTALE\n", err);
+		err = -EINVAL;
+		goto exit;
+	}
+	err = 0;
+
+	printf("SUCCES: nentries(%zu)\n", index.nentries);
+
+exit:
+	remove(CACHE_PATH);
+	pci_index_term(&cached);
+	pci_index_term(&index);
+
+	return -err;
+}